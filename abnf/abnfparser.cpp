@@ -30,7 +30,9 @@ public:
 
     This class maintains a cursor for an input EString and provides
     functions to examine or extract tokens, advancing the cursor as
-    required. These generic functions may be used by subclasses (e.g.
+    required. The tokens returned share the input's memory (see
+    EString::mid()), so extracting one costs a small allocation, not a
+    copy. These generic functions may be used by subclasses (e.g.
     ImapParser) to parse more complex productions.
 
     The functions usually return a token extracted from the input string
@@ -151,11 +153,25 @@ bool AbnfParser::present( const EString & s )
     if ( s.isEmpty() )
         return true;
 
-    EString l = str.mid( d->at, s.length() ).lower();
-    if ( l != s.lower() )
+    uint l = s.length();
+    if ( d->at + l > str.length() )
         return false;
 
-    step( s.length() );
+    // compare in place rather than lowercasing copies of both
+    uint i = 0;
+    while ( i < l ) {
+        char a = str[d->at + i];
+        char b = s[i];
+        if ( a >= 'A' && a <= 'Z' )
+            a = a - 'A' + 'a';
+        if ( b >= 'A' && b <= 'Z' )
+            b = b - 'A' + 'a';
+        if ( a != b )
+            return false;
+        i++;
+    }
+
+    step( l );
     return true;
 }
 
@@ -180,19 +196,18 @@ void AbnfParser::require( const EString & s )
 
 EString AbnfParser::digits( uint min, uint max )
 {
-    EString r;
+    uint start = d->at;
     uint i = 0;
     char c = nextChar();
     while ( i < max && c >= '0' && c <= '9' ) {
         step();
-        r.append( c );
         c = nextChar();
         i++;
     }
     if ( i < min )
         setError( "Expected at least " + fn( min-i ) + " more digits, "
                   "but saw: " + following() );
-    return r;
+    return str.mid( start, i );
 }
 
 
@@ -203,21 +218,20 @@ EString AbnfParser::digits( uint min, uint max )
 
 EString AbnfParser::letters( uint min, uint max )
 {
-    EString r;
+    uint start = d->at;
     uint i = 0;
     char c = nextChar();
     while ( i < max &&
             ( ( c >= 'A' && c <= 'Z' ) || ( c >= 'a' && c <= 'z' ) ) )
     {
         step();
-        r.append( c );
         c = nextChar();
         i++;
     }
     if ( i < min )
         setError( "Expected at least " + fn( min-i ) + " more letters, "
                   "but saw: " + following() );
-    return r;
+    return str.mid( start, i );
 }
 
 
@@ -229,25 +243,35 @@ EString AbnfParser::letters( uint min, uint max )
 
 uint AbnfParser::number()
 {
-    EString s;
+    uint start = d->at;
     char c = nextChar();
 
     bool zero = false;
     if ( c == '0' )
         zero = true;
 
+    // compute the value as we go, so the digits needn't be copied
+    bool ok = true;
+    uint u = 0;
     while ( c >= '0' && c <= '9' ) {
-        s.append( c );
+        uint n = u * 10 + c - '0';
+        if ( n / 10 != u )
+            ok = false;
+        u = n;
         step();
         c = nextChar();
     }
+    if ( d->at == start )
+        ok = false;
 
-    bool ok = true;
-    uint u = s.number( &ok );
-    if ( !ok )
-        setError( "Expected a number, but saw: " + s + following() );
-    else if ( u > 0 && zero )
+    if ( !ok ) {
+        setError( "Expected a number, but saw: " +
+                  str.mid( start, d->at - start ) + following() );
+        u = 0;
+    }
+    else if ( u > 0 && zero ) {
         setError( "Zero used as leading digit" );
+    }
 
     return u;
 }
@@ -9,12 +9,17 @@
 #include "postgres.h"
 #include "selector.h"
 #include "recipient.h"
+#include "blobstore.h"
 #include "transaction.h"
+#include "tunableindex.h"
 #include "configuration.h"
+#include "timer.h"
+#include "expirer.h"
+#include "dict.h"
 
 #include <stdio.h>
-
-#define MSGBLOCKCOUNT	"1000"
+// gettimeofday
+#include <sys/time.h>
 
 static const char * versions[] = {
     "", "", "0.91", "0.92", "0.92", "0.92 to 0.93", // 0-5
@@ -97,14 +102,19 @@ void ShowSchema::execute()
 
 static AoxFactory<UpgradeSchema>
 f2( "upgrade", "schema", "Upgrade the database schema.",
-    "    Synopsis: aox upgrade schema [-n]\n\n"
+    "    Synopsis: aox upgrade schema [-n|-o]\n\n"
     "    Checks that the database schema is one that this version of\n"
     "    Archiveopteryx is compatible with, and updates it if needed.\n"
     "\n"
     "    The -n flag causes aox to perform the SQL statements for the\n"
     "    schema upgrade and report on their status without COMMITting\n"
     "    the transaction (i.e. see what the upgrade would do, without\n"
-    "    changing anything).\n" );
+    "    changing anything).\n\n"
+    "    The -o flag performs an online upgrade, which may be done\n"
+    "    while the servers are running: it gives up rather than wait\n"
+    "    long for a busy table, and builds large indices concurrently\n"
+    "    after committing the rest of the upgrade. If that is\n"
+    "    interrupted, running aox upgrade schema -o again finishes it.\n" );
 
 
 /*! \class UpgradeSchema schema.h
@@ -129,6 +139,7 @@ void UpgradeSchema::execute()
 
         database( true );
         Schema * s = new Schema( this, true, commit );
+        s->setOnline( opt( 'o' ) > 0 );
         q = s->result();
         s->execute();
     }
@@ -142,227 +153,503 @@ void UpgradeSchema::execute()
 
 static AoxFactory<Vacuum>
 f3( "vacuum", "", "Perform routine maintenance.",
-    "    Synopsis: aox vacuum\n\n"
+    "    Synopsis: aox vacuum [-av] [-r rows] [-t ms] [-c minutes]\n\n"
     "    Permanently deletes messages that were marked for deletion\n"
     "    more than a certain number of days ago (cf. undelete-time)\n"
-    "    and removes any bodyparts that are no longer used.\n\n"
+    "    and removes any bodyparts that are no longer used, including\n"
+    "    their files in blob-directory. It also prunes the journal of\n"
+    "    changes used by QRESYNC (cf. change-journal-window), and\n"
+    "    maintains the block range index on messages.idate, which\n"
+    "    lets date searches and retention skip most of an archive.\n\n"
+    "    Rows are deleted in blocks, each in its own transaction. The\n"
+    "    block size adapts so that each statement takes about -t ms\n"
+    "    (default 1000), and -r limits the deletions to that many rows\n"
+    "    per second, so that vacuuming during the day doesn't hurt\n"
+    "    replication or IMAP latency. -v shows progress.\n\n"
+    "    -c keeps aox running, vacuuming again every so many minutes.\n\n"
+    "    -a also removes unused addresses. This locks the database\n"
+    "    for a while.\n\n"
     "    This is not a replacement for running VACUUM ANALYSE on the\n"
     "    database (either with vaccumdb or via autovacuum).\n\n"
-    "    This command should be run (we suggest daily) via crontab.\n" );
+    "    This command should be run (we suggest daily) via crontab,\n"
+    "    unless -c is used.\n" );
+
+
+// the steps of a vacuum pass, in order
+enum VacuumStep {
+    Deliveries, DeletedMessages,
+    JournalMarkers, JournalStart, JournalEntries,
+    Messages, Bodyparts, Blobs,
+    DateIndex, DateRanges,
+    Retention
+};
+
+// the block size we start with, and the limits of its adaptation
+static const uint initialBlock = 1000;
+static const uint minimumBlock = 10;
+static const uint maximumBlock = 100000;
+
+
+// returns the current time in milliseconds
+
+static int64 now()
+{
+    struct timeval tv;
+    (void)::gettimeofday( &tv, 0 );
+    return (int64)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+class VacuumData
+    : public Garbage
+{
+public:
+    VacuumData()
+        : started( false ), step( Deliveries ),
+          q( 0 ), t( 0 ), expirer( 0 ), timer( 0 ),
+          block( initialBlock ), rate( 0 ), statementTime( 1000 ),
+          interval( 0 ), restart( false ), expired( 0 ), fullExpiry( 0 ),
+          issued( 0 ), stepStarted( 0 ), stepRows( 0 )
+    {}
+
+    bool started;
+    uint step;
+    Query * q;
+    Transaction * t;
+    Expirer * expirer;
+    Timer * timer;
+
+    uint block;
+    uint rate;
+    uint statementTime;
+    uint interval;
+    bool restart;
+    uint expired;
+    uint fullExpiry;
+    EString fingerprint;
+
+    int64 issued;
+    int64 stepStarted;
+    uint stepRows;
+};
+
 
 /*! \class Vacuum Vacuum.h
     This class handles the "aox vacuum" command.
+
+    The deletions which may touch many rows are done in blocks, each
+    block in its own transaction. The block size adapts to the time
+    each statement takes, so that no statement holds its locks for much
+    longer than the -t budget, and the optional -r budget limits the
+    number of rows deleted per second by pausing between blocks.
 */
 
 Vacuum::Vacuum( EStringList * args )
-    : AoxCommand( args ), t( 0 ), r( 0 ), s( 0 )
+    : AoxCommand( args ), d( new VacuumData )
 {
 }
 
 
 void Vacuum::execute()
 {
-    if (!t) {
-        uint days = Configuration::scalar( Configuration::UndeleteTime );
-
-        switch (qstate) {
-            case 0:
-                parseOptions();
-                end();
-                database( true );
-                qstate = 1;
-                log( "vacuum: delete from deliveries", Log::Significant );
-                do {
-                    // Literals have changed meaning in c++11, we need spaces
-                    // or they have potentially changed effect in future
-                    // http://www.preney.ca/paul/archives/636
-                    q = new Query( "delete from deliveries "
-                                   "where injected_at<current_timestamp-'" +
-                                   fn( days ) + " days'::interval "
-                                   "and id in "
-                                   "(select delivery from delivery_recipients "
-                                   " where action not in ($1,$2) "
-                                   " limit " MSGBLOCKCOUNT ") "
-                                   "and id not in "
-                                   "(select delivery from delivery_recipients "
-                                   " where action in ($1,$2))", this );
-                    q->bind( 1, Recipient::Unknown );
-                    q->bind( 2, Recipient::Delayed );
-                    q->execute();
-            case 1:
-                    if (!q->done())
-                        return;
-                } while (q->rows());
-                qstate = 2;
-                log( "vacuum: delete from deleted_messages", Log::Significant );
-                q = new Query( "delete from deleted_messages "
-                               "where deleted_at<current_timestamp-'" + fn( days ) +
-                               " days'::interval", this );
-                q->execute();
-            case 2:
-                if (!q->done())
-                    return;
-                qstate = 3;
-                log( "vacuum: delete from messages", Log::Significant );
-                do {
-                    q = new Query( "delete from messages where id in "
-                                   "(select m.id from messages m"
-                                   " left join mailbox_messages mm on (m.id=mm.message)"
-                                   " left join deleted_messages dm on (m.id=dm.message)"
-                                   " left join deliveries d on (m.id=d.message)"
-                                   " where mm.message is null and dm.message is null"
-                                   " and d.message is null "
-                                   " limit " MSGBLOCKCOUNT ")", this );
-                    q->execute();
-            case 3:
-                    if (!q->done())
-                        return;
-                } while (q->rows());
-                qstate = 4;
-                log( "vacuum: delete from bodyparts", Log::Significant );
-                do {
-                    q = new Query( "delete from bodyparts where id in (select id "
-                                   "from bodyparts b left join part_numbers p on "
-                                   "(b.id=p.bodypart) where bodypart is null "
-                                   " limit " MSGBLOCKCOUNT ")", this );
-                    q->execute();
-            case 4:
-                    if (!q->done())
-                        return;
-                } while (q->rows());
+    if ( !d->started ) {
+        d->started = true;
+        EString p = next();
+        while ( p[0] == '-' ) {
+            if ( p == "-a" ) {
+                setopt( 'a' );
+            }
+            else if ( p == "-v" ) {
+                setopt( 'v' );
+            }
+            else if ( p == "-r" || p == "-t" || p == "-c" ) {
+                bool ok = false;
+                uint n = next().number( &ok );
+                if ( !ok || !n )
+                    error( p + " needs a positive number" );
+                if ( p == "-r" )
+                    d->rate = n;
+                else if ( p == "-t" )
+                    d->statementTime = n;
+                else
+                    d->interval = n;
+            }
+            else {
+                error( "Bad option name: " + p.quoted() );
+            }
+            p = next();
         }
+        if ( !p.isEmpty() )
+            error( "Unexpected argument: " + p );
+        end();
+        if ( d->rate && d->block > d->rate )
+            d->block = d->rate;
+        database( true );
+        Mailbox::setup( this );
+        startStep( Deliveries );
+    }
 
-        t = new Transaction( this );
-        if ( opt( 'a' ) > 0 ) {
-            // delete the unnecessary addresses rows. this locks the
-            // database for quite a while (seconds, perhaps even a
-            // minute), so this isn't in the regular vacuum.
-
-            t->enqueue( "create temporary table au "
-                        "( address integer, used boolean )" );
-            // pick some candidates at random
-            t->enqueue( "insert into au (address, used) "
-                        "select id, false from addresses" );
-            // make sure noone can add new references to those rows
-            t->enqueue(
-                "select id from addresses where id in (select id from au) "
-                "for update" );
-            // create an index: the next update and last delete need it
-            t->enqueue(
-                "create index af_a on address_fields using btree(address)" );
-            // mark those addresses that are used by something
-            t->enqueue(
-                "update au set used=true from address_fields "
-                "where au.address=address_fields.address" );
-            t->enqueue(
-                "update au set used=true from aliases "
-                "where au.address=aliases.address" );
-            t->enqueue(
-                "update au set used=true from deliveries "
-                "where au.address=deliveries.sender" );
-            t->enqueue(
-                "update au set used=true from delivery_recipients "
-                "where au.address=delivery_recipients.recipient" );
-            t->enqueue(
-                "update au set used=true from autoresponses "
-                "where au.address=autoresponses.sent_from" );
-            t->enqueue(
-                "update au set used=true from autoresponses "
-                "where au.address=autoresponses.sent_to" );
-            // delete all those we know are unused
-            t->enqueue(
-                "delete from addresses where id in "
-                "(select address from au where not used)" );
-            // the index has to go away again
-            t->enqueue( "drop table au" );
-            t->enqueue( "drop index af_a" );
+    while ( d->step < Retention ) {
+        if ( d->timer && d->timer->active() )
+            return;
+
+        if ( d->restart ) {
+            d->restart = false;
+            startStep( Deliveries );
         }
 
-        Mailbox::setup( this );
-        log( "vacuum: RetentionSelector", Log::Significant );
-        r = new RetentionSelector( t, this );
-        r->execute();
+        if ( !d->q ) {
+            d->q = query();
+            d->issued = now();
+            if ( d->q )
+                d->q->execute();
+        }
+        if ( d->q && !d->q->done() )
+            return;
+        if ( d->q && d->q->failed() )
+            error( "Vacuuming failed: " + d->q->error() );
+
+        bool more = false;
+        uint rows = 0;
+        if ( d->q ) {
+            rows = d->q->rows();
+            if ( d->step == Blobs )
+                removeBlobs();
+            else if ( d->step == DateRanges && d->q->hasResults() )
+                d->stepRows += d->q->nextRow()->getInt( "ranges" );
+            else
+                d->stepRows += rows;
+            if ( d->step == Deliveries || d->step == DeletedMessages ||
+                 d->step == Messages || d->step == Bodyparts ) {
+                more = rows > 0;
+                adapt( (uint)( now() - d->issued ), rows );
+            }
+        }
+        d->q = 0;
 
-        t->execute();
+        if ( !more )
+            startStep( d->step + 1 );
     }
 
-    if ( !r->done() )
+    if ( !d->t && opt( 'a' ) > 0 ) {
+        d->t = new Transaction( this );
+        removeAddresses();
+        d->t->commit();
+    }
+
+    if ( d->t && !d->t->done() )
         return;
 
-    if ( !s ) {
-        s = new Selector( Selector::And );
-        if ( r->deletes() ) {
-            s->add( r->deletes() );
-            if ( r->retains() ) {
-                Selector * n = new Selector( Selector::Not );
-                s->add( n );
-                n->add( r->retains() );
-            }
-            s->simplify();
-            EStringList wanted;
-            wanted.append( "mailbox" );
-            wanted.append( "uid" );
-            // moving stuff from mm to dm while increasing modseq
-            // appropriately and not locking unrelated mailboxes is
-            // complicated.
-
-            // make a staging table.
-            t->enqueue( new Query( "create temporary table s ("
-                                   "mailbox integer, "
-                                   "uid integer )", 0 ) );
-
-            // insert the messages to be deleted there.
-            Query * iq = s->query( 0, 0, 0, this, false, &wanted, false );
-            iq->setString( "insert into s (mailbox,uid) " + iq->string() );
-            t->enqueue( iq );
-
-            // lock all relevant mailboxes against concurrent
-            // modification.  this doesn't quite work, since something
-            // may have changed the mailbox concurrently with the
-            // insert above. but it'll lock at least as many mailboxes
-            // as we need, and very seldom any extra ones.
-            t->enqueue( new Query( "select nextmodseq from mailboxes "
-                                   "join s on (mailboxes.id=s.mailbox) "
-                                   "order by id "
-                                   "for update", 0 ) );
-
-            // insert those messages which still exist into dm. we
-            // join against mm just in case someone deleted one of
-            // those messages while the insert was running.
-            t->enqueue( new Query( "insert into deleted_messages "
-                                   "(mailbox, uid, message,"
-                                   " modseq, deleted_by, reason) "
-                                   "select s.mailbox, s.uid, mm.message,"
-                                   " m.nextmodseq, null, 'Retention policy' "
-                                   "from s "
-                                   "join mailbox_messages mm"
-                                   " using (mailbox,uid) "
-                                   "join mailboxes m on (s.mailbox=m.id)",
-                                   0 ) );
-
-            // consume a modseq for each mailbox we (may have) modified.
-            t->enqueue( new Query( "update mailboxes "
-                                   "set nextmodseq=nextmodseq+1 "
-                                   "where id in (select mailbox from s)",
-                                   0 ) );
-
-            // we don't need the staging table any more
-            t->enqueue( new Query( "drop table s", 0 ) );
-
-            // but we do need to notify the running server of the change
-            t->enqueue( new Query( "notify mailboxes_updated", 0 ) );
-        }
+    if ( d->t && d->t->failed() )
+        error( "Vacuuming failed: " + d->t->error() );
+
+    if ( !d->expirer ) {
+        log( "vacuum: expire messages", Log::Significant );
+        if ( opt( 'v' ) )
+            printf( "vacuum: expire messages\n" );
+        d->expirer = new Expirer( this );
+        d->expirer->setBatchSize( d->block );
+        // only the messages which have expired since the last pass,
+        // except once a day, which catches messages copied into a
+        // mailbox with an old internal date
+        if ( d->expired && d->expired < d->fullExpiry + 86400 )
+            d->expirer->setSince( d->expired, d->fingerprint );
+        d->expirer->execute();
+    }
 
-        t->commit();
+    if ( !d->expirer->done() )
+        return;
+
+    if ( d->expirer->failed() )
+        error( "Vacuuming failed: " + d->expirer->error() );
+    if ( opt( 'v' ) )
+        printf( "vacuum: expired %d messages\n", d->expirer->expired() );
+    d->expired = d->expirer->time();
+    d->fingerprint = d->expirer->fingerprint();
+    if ( !d->expirer->incremental() )
+        d->fullExpiry = d->expired;
+
+    if ( !d->interval ) {
+        finish();
+        return;
     }
 
-    if ( !t->done() )
+    // start over after the interval
+    if ( opt( 'v' ) )
+        printf( "vacuum: done; next pass in %d minutes\n", d->interval );
+    d->t = 0;
+    d->expirer = 0;
+    d->step = Deliveries;
+    d->restart = true;
+    d->timer = new Timer( this, d->interval * 60 );
+}
+
+
+/*! Finishes the current step, reporting how many rows it deleted, and
+    starts step \a step.
+*/
+
+void Vacuum::startStep( uint step )
+{
+    if ( step > Deliveries ) {
+        uint ms = (uint)( now() - d->stepStarted );
+        if ( d->stepRows )
+            log( "vacuum: affected " + fn( d->stepRows ) + " rows in " +
+                 fn( ms ) + "ms", Log::Significant );
+        if ( opt( 'v' ) && d->stepRows )
+            printf( "vacuum: affected %d rows in %d.%03ds\n",
+                    d->stepRows, ms / 1000, ms % 1000 );
+    }
+
+    d->step = step;
+    d->stepRows = 0;
+    d->stepStarted = now();
+
+    EString what;
+    switch ( d->step ) {
+    case Deliveries:
+        what = "delete from deliveries";
+        break;
+    case DeletedMessages:
+        what = "delete from deleted_messages";
+        break;
+    case JournalMarkers:
+        what = "prune mailbox_changes";
+        break;
+    case Messages:
+        what = "delete from messages";
+        break;
+    case Bodyparts:
+        what = "delete from bodyparts";
+        break;
+    case Blobs:
+        if ( !Configuration::text( Configuration::BlobDir ).isEmpty() )
+            what = "remove unused blobs";
+        break;
+    case DateIndex:
+        if ( Postgres::version() >= 90500 )
+            what = "summarise new messages in m_ib";
+        break;
+    }
+    if ( what.isEmpty() )
         return;
+    log( "vacuum: " + what, Log::Significant );
+    if ( opt( 'v' ) )
+        printf( "vacuum: %s\n", what.cstr() );
+}
 
-    if ( t->failed() )
-        error( "Vacuuming failed" );
 
-    finish();
+/*! Returns a query to run for the current step, or a null pointer if
+    the step has nothing to do. The block-by-block steps use the
+    current block size.
+*/
+
+Query * Vacuum::query()
+{
+    uint days = Configuration::scalar( Configuration::UndeleteTime );
+    uint window =
+        Configuration::scalar( Configuration::ChangeJournalWindow );
+    Query * q = 0;
+
+    switch ( d->step ) {
+    case Deliveries:
+        // Literals have changed meaning in c++11, we need spaces
+        // or they have potentially changed effect in future
+        // http://www.preney.ca/paul/archives/636
+        q = new Query( "delete from deliveries "
+                       "where injected_at<current_timestamp-'" +
+                       fn( days ) + " days'::interval "
+                       "and id in "
+                       "(select delivery from delivery_recipients "
+                       " where action not in ($1,$2) "
+                       " limit $3) "
+                       "and id not in "
+                       "(select delivery from delivery_recipients "
+                       " where action in ($1,$2))", this );
+        q->bind( 1, Recipient::Unknown );
+        q->bind( 2, Recipient::Delayed );
+        q->bind( 3, d->block );
+        break;
+    case DeletedMessages:
+        q = new Query( "delete from deleted_messages "
+                       "where (mailbox,uid) in "
+                       "(select mailbox,uid from deleted_messages "
+                       " where deleted_at<current_timestamp-'" +
+                       fn( days ) + " days'::interval "
+                       " limit $1)", this );
+        q->bind( 1, d->block );
+        break;
+    case JournalMarkers:
+        // the uid 0 rows move first, so that the journal never
+        // looks more complete than it is
+        q = new Query( "update mailbox_changes mc "
+                       "set modseq=mb.nextmodseq-$1 "
+                       "from mailboxes mb "
+                       "where mc.mailbox=mb.id and mc.uid=0 "
+                       "and mc.modseq<mb.nextmodseq-$1", this );
+        q->bind( 1, window );
+        break;
+    case JournalStart:
+        q = new Query( "insert into mailbox_changes "
+                       "(mailbox, uid, modseq, expunged) "
+                       "select mb.id, 0, mb.nextmodseq-$1, true "
+                       "from mailboxes mb "
+                       "where mb.nextmodseq>$1+1 and not exists "
+                       "(select 1 from mailbox_changes "
+                       " where mailbox=mb.id and uid=0)", this );
+        q->bind( 1, window );
+        break;
+    case JournalEntries:
+        q = new Query( "delete from mailbox_changes mc "
+                       "using mailboxes mb "
+                       "where mc.mailbox=mb.id and mc.uid>0 "
+                       "and mc.modseq<mb.nextmodseq-$1", this );
+        q->bind( 1, window );
+        break;
+    case Messages:
+        q = new Query( "delete from messages where id in "
+                       "(select m.id from messages m"
+                       " left join mailbox_messages mm on (m.id=mm.message)"
+                       " left join deleted_messages dm on (m.id=dm.message)"
+                       " left join deliveries d on (m.id=d.message)"
+                       " where mm.message is null and dm.message is null"
+                       " and d.message is null "
+                       " limit $1)", this );
+        q->bind( 1, d->block );
+        break;
+    case Bodyparts:
+        q = new Query( "delete from bodyparts where id in (select id "
+                       "from bodyparts b left join part_numbers p on "
+                       "(b.id=p.bodypart) where bodypart is null "
+                       " limit $1)", this );
+        q->bind( 1, d->block );
+        break;
+    case Blobs:
+        if ( !Configuration::text( Configuration::BlobDir ).isEmpty() )
+            q = new Query( "select hash from bodyparts "
+                           "where external", this );
+        break;
+    case DateIndex:
+        // the schema only has m_ib if the server had 9.5 when it
+        // was upgraded, so we build it if it's missing.
+        if ( Postgres::version() >= 90500 )
+            q = new Query( "create index concurrently if not exists m_ib "
+                           "on messages using brin(idate)", this );
+        break;
+    case DateRanges:
+        // without this, the ranges added since the last (auto)vacuum
+        // aren't summarised, and every date search reads them
+        if ( Postgres::version() >= 90500 )
+            q = new Query( "select brin_summarize_new_values("
+                           "'m_ib'::regclass) as ranges", this );
+        break;
+    }
+    return q;
+}
+
+
+/*! Adjusts the block size after a statement deleted \a rows rows in
+    \a ms milliseconds, and pauses if that was faster than the -r
+    budget allows.
+
+    The block shrinks by half if a statement takes longer than the -t
+    budget, and grows by half if it takes less than half the budget.
+*/
+
+void Vacuum::adapt( uint ms, uint rows )
+{
+    uint old = d->block;
+    if ( ms > d->statementTime )
+        d->block = d->block / 2;
+    else if ( ms < d->statementTime / 2 && rows >= d->block )
+        d->block = d->block + d->block / 2;
+    if ( d->rate && d->block > d->rate )
+        d->block = d->rate;
+    if ( d->block < minimumBlock )
+        d->block = minimumBlock;
+    if ( d->block > maximumBlock )
+        d->block = maximumBlock;
+
+    if ( opt( 'v' ) > 1 || ( opt( 'v' ) && old != d->block ) )
+        printf( "vacuum: %d rows so far; %d rows took %dms, "
+                "block size now %d\n",
+                d->stepRows, rows, ms, d->block );
+
+    if ( !d->rate || !rows )
+        return;
+
+    // how long deleting stepRows should have taken, at most
+    int64 budget = (int64)d->stepRows * 1000 / d->rate;
+    int64 spent = now() - d->stepStarted;
+    if ( budget <= spent )
+        return;
+    uint seconds = (uint)( ( budget - spent + 999 ) / 1000 );
+    d->timer = new Timer( this, seconds );
+}
+
+
+/*! Removes the files in blob-directory that no bodypart uses any more,
+    based on the hashes the Blobs step selected.
+*/
+
+void Vacuum::removeBlobs()
+{
+    Dict<void> used;
+    while ( d->q->hasResults() )
+        used.insert( d->q->nextRow()->getEString( "hash" ), (void *)1 );
+    uint n = BlobStore::removeUnused( used, 86400 );
+    if ( n )
+        log( "vacuum: removed " + fn( n ) + " unused blobs",
+             Log::Significant );
+}
+
+
+/*! Enqueues the queries that delete the unnecessary addresses rows.
+    This locks the database for quite a while (seconds, perhaps even a
+    minute), so it's only done when -a is used.
+*/
+
+void Vacuum::removeAddresses()
+{
+    Transaction * t = d->t;
+    t->enqueue( "create temporary table au "
+                "( address integer, used boolean )" );
+    // pick some candidates at random
+    t->enqueue( "insert into au (address, used) "
+                "select id, false from addresses" );
+    // make sure noone can add new references to those rows
+    t->enqueue(
+        "select id from addresses where id in (select id from au) "
+        "for update" );
+    // create an index: the next update and last delete need it
+    t->enqueue(
+        "create index af_a on address_fields using btree(address)" );
+    // mark those addresses that are used by something
+    t->enqueue(
+        "update au set used=true from address_fields "
+        "where au.address=address_fields.address" );
+    t->enqueue(
+        "update au set used=true from aliases "
+        "where au.address=aliases.address" );
+    t->enqueue(
+        "update au set used=true from deliveries "
+        "where au.address=deliveries.sender" );
+    t->enqueue(
+        "update au set used=true from delivery_recipients "
+        "where au.address=delivery_recipients.recipient" );
+    t->enqueue(
+        "update au set used=true from autoresponses "
+        "where au.address=autoresponses.sent_from" );
+    t->enqueue(
+        "update au set used=true from autoresponses "
+        "where au.address=autoresponses.sent_to" );
+    // delete all those we know are unused
+    t->enqueue(
+        "delete from addresses where id in "
+        "(select address from au where not used)" );
+    // the index has to go away again
+    t->enqueue( "drop table au" );
+    t->enqueue( "drop index af_a" );
 }
 
 
@@ -419,93 +706,60 @@ void GrantPrivileges::execute()
 }
 
 
-struct TunableIndex {
-    const char * name;
-    const char * table;
-    const char * definition;
-    bool writing;
-    bool reading;
-    bool advanced;
-} tunableIndices[] = {
-    { "pn_b", "part_numbers",
-      "CREATE INDEX pn_b ON part_numbers "
-      "USING btree (bodypart)",
-      false, true, true },
-    { "af_mp", "address_fields",
-      "CREATE INDEX af_mp ON address_fields "
-      "USING btree (message, part)",
-      false, true, true },
-    { "fl_mu", "flags",
-      "CREATE INDEX fl_mu ON flags "
-      "USING btree (mailbox, uid)",
-      false, true, true },
-    { "dm_mud", "deleted_messages",
-      "CREATE INDEX dm_mud ON deleted_messages "
-      "USING btree (mailbox, uid, deleted_at)",
-      false, true, true },
-    { "mm_m", "mailbox_messages",
-      "CREATE INDEX mm_m ON mailbox_messages "
-      "USING btree (message)",
-      false, true, true },
-    { "dm_m", "deleted_messages",
-      "CREATE INDEX dm_m ON deleted_messages "
-      "USING btree (message)",
-      false, true, true },
-    { "df_m", "date_fields",
-      "CREATE INDEX df_m ON date_fields "
-      "USING btree (message)",
-      false, true, true },
-    { "hf_msgid", "header_fields",
-      "CREATE INDEX hf_msgid ON header_fields "
-      "USING btree (value) WHERE (field = 13)",
-      false, true, true },
-    { "dm_mm", "deleted_messages",
-      "CREATE INDEX dm_mm ON deleted_messages "
-      "USING btree (mailbox, modseq)",
-      false, true, true },
-    { "b_text", "bodyparts",
-      "CREATE INDEX b_text ON bodyparts "
-      "USING gin (to_tsvector('simple'::regconfig, text)) "
-      "WHERE (octet_length(text) < (640000))",
-      false, false, true },
-    { "hf_subject", "header_fields",
-      "CREATE INDEX hf_subject ON header_fields "
-      "USING gin (to_tsvector('simple'::regconfig, value)) "
-      "WHERE (octet_length(value) < (640000) and field=20)",
-      false, false, true },
-    { 0, 0, 0, false, false, false }
-};
-
-
 class TuneDatabaseData
     : public Garbage
 {
 public:
-    TuneDatabaseData(): mode( Reading ), t( 0 ), find( 0 ), set( false ) {}
+    TuneDatabaseData()
+        : mode( Reading ), state( 0 ), t( 0 ), find( 0 ),
+          tables( 0 ), indexes( 0 ), extension( 0 ), statements( 0 )
+    {}
     enum Mode {
-        Writing, Reading, Advanced
+        Writing, Reading, Advanced, Observed
     };
     Mode mode;
+    uint state;
     Transaction * t;
     Query * find;
-    bool set;
+
+    Query * tables;
+    Query * indexes;
+    Query * extension;
+    Query * statements;
+
+    EStringList wanted;
+    EStringList changes;
 };
 
 
 static AoxFactory<TuneDatabase>
 f5( "tune", "database", "Adds or removes indices.",
-    "    Synopsis: aox tune database <mode>\n\n"
-    "    There are three modes: mostly-writing, mostly-reading and\n"
-    "    advanced-reading.\n"
+    "    Synopsis: aox tune database [-n] <mode>\n\n"
+    "    There are four modes: mostly-writing, mostly-reading,\n"
+    "    advanced-reading and observed.\n"
     "    Mode mostly-writing tunes the database for fast message\n"
     "    injection at the cost of reading.\n"
     "    Mode mostly-reading tunes the database for message reading,\n"
     "    but without full-text indexing.\n"
     "    Mode advanced-reading tunes the database for fast message\n"
-    "    searching and reading, at the cost of injection speed.\n" );
+    "    searching and reading, at the cost of injection speed.\n"
+    "    Mode observed picks one of the other three based on the\n"
+    "    statistics PostgreSQL has collected (including those from\n"
+    "    pg_stat_statements, if it is installed), adds the indices\n"
+    "    the observed searches need, and tunes autovacuum for tables\n"
+    "    which change often.\n\n"
+    "    The -n flag causes aox to report what it would do without\n"
+    "    doing it.\n" );
 
 /*! \class TuneDatabase db.h
     This class handles the "aox tune database" command.
+
+    In the observed mode, TuneDatabase looks at the statistics
+    collector's figures for our tables and indices, and at
+    pg_stat_statements if that's available, to decide which of the
+    fixed modes fits the workload. The observations are relative to
+    the last time the statistics were reset, so they mean more the
+    longer the server has been running.
 */
 
 
@@ -517,7 +771,7 @@ TuneDatabase::TuneDatabase( EStringList * args )
 
 void TuneDatabase::execute()
 {
-    if ( !d->t ) {
+    if ( d->state == 0 ) {
         parseOptions();
         EString mode = next().lower();
         if ( mode == "mostly-writing" )
@@ -526,12 +780,88 @@ void TuneDatabase::execute()
             d->mode = TuneDatabaseData::Reading;
         else if ( mode == "advanced-reading" )
             d->mode = TuneDatabaseData::Advanced;
+        else if ( mode == "observed" )
+            d->mode = TuneDatabaseData::Observed;
         else
             error( "Unknown database mode.\n"
-                   "Supported: mostly-writing, mostly-reading and "
-                   "advanced-reading" );
+                   "Supported: mostly-writing, mostly-reading, "
+                   "advanced-reading and observed" );
+        end();
         database( true );
 
+        if ( d->mode == TuneDatabaseData::Observed ) {
+            d->tables = new Query( "select relname::text as name, "
+                                   "coalesce(idx_tup_fetch,0) as fetched, "
+                                   "n_tup_ins+n_tup_upd+n_tup_del "
+                                   "as written, "
+                                   "n_tup_upd+n_tup_del as churn, "
+                                   "n_live_tup as live "
+                                   "from pg_stat_user_tables "
+                                   "where schemaname=$1", this );
+            d->tables->bind( 1,
+                             Configuration::text( Configuration::DbSchema ) );
+            d->tables->execute();
+            d->indexes = new Query( "select indexrelname::text as name, "
+                                    "idx_scan as scans "
+                                    "from pg_stat_user_indexes "
+                                    "where schemaname=$1", this );
+            d->indexes->bind( 1,
+                              Configuration::text( Configuration::DbSchema ) );
+            d->indexes->execute();
+            d->extension = new Query( "select extname::text from pg_extension "
+                                      "where extname='pg_stat_statements'",
+                                      this );
+            d->extension->execute();
+            d->state = 1;
+        }
+        else {
+            d->state = 3;
+        }
+    }
+
+    if ( d->state == 1 ) {
+        if ( !d->tables->done() || !d->indexes->done() ||
+             !d->extension->done() )
+            return;
+        if ( d->tables->failed() || d->indexes->failed() )
+            error( "Cannot read the database statistics" );
+        if ( d->extension->hasResults() ) {
+            // pg_stat_statements calls it total_exec_time since 13
+            EString t( "total_time" );
+            if ( Postgres::version() >= 130000 )
+                t = "total_exec_time";
+            d->statements =
+                new Query( "select "
+                           "coalesce(sum(case when query ~* "
+                           "'^\\s*(insert|update|delete)' then " + t +
+                           " end),0)::bigint as writing, "
+                           "coalesce(sum(case when query ~* '^\\s*select' "
+                           "then " + t + " end),0)::bigint as reading, "
+                           "coalesce(sum(case when query ~* '^\\s*select' "
+                           "and query like '%to_tsvector%' then " + t +
+                           " end),0)::bigint as fulltext, "
+                           "coalesce(sum(case when query ~* '^\\s*select' "
+                           "and query like '% ilike %' then " + t +
+                           " end),0)::bigint as substring, "
+                           "coalesce(sum(case when query ~* '^\\s*select' "
+                           "and query like '%mm.seen%' then " + t +
+                           " end),0)::bigint as unseen "
+                           "from pg_stat_statements "
+                           "where dbid=(select oid from pg_database "
+                           "where datname=current_database())", this );
+            d->statements->execute();
+        }
+        d->state = 2;
+    }
+
+    if ( d->state == 2 ) {
+        if ( d->statements && !d->statements->done() )
+            return;
+        observe();
+        d->state = 3;
+    }
+
+    if ( d->state == 3 ) {
         d->t = new Transaction( this );
 
         EStringList indexnames;
@@ -548,15 +878,17 @@ void TuneDatabase::execute()
 
         d->t->enqueue( d->find );
         d->t->execute();
+        d->state = 4;
     }
 
-    if ( !d->find->done() )
-        return;
+    if ( d->state == 4 ) {
+        if ( !d->find->done() )
+            return;
 
-    if ( d->t->failed() )
-        error( "Cannot tune database" );
+        if ( d->t->failed() )
+            error( "Cannot tune database" );
 
-    if ( !d->set ) {
+        bool dryRun = opt( 'n' ) > 0;
         EStringList present;
         while ( d->find->hasResults() ) {
             Row * r = d->find->nextRow();
@@ -570,16 +902,19 @@ void TuneDatabase::execute()
         }
         uint i = 0;
         while ( tunableIndices[i].name ) {
-            bool wanted = false;
+            bool wanted = d->wanted.contains( tunableIndices[i].name );
             switch ( d->mode ) {
             case TuneDatabaseData::Writing:
-                wanted = tunableIndices[i].writing;
+                wanted = wanted || tunableIndices[i].writing;
                 break;
             case TuneDatabaseData::Reading:
-                wanted = tunableIndices[i].reading;
+                wanted = wanted || tunableIndices[i].reading;
                 break;
             case TuneDatabaseData::Advanced:
-                wanted = tunableIndices[i].advanced;
+                wanted = wanted || tunableIndices[i].advanced;
+                break;
+            case TuneDatabaseData::Observed:
+                // observe() has chosen one of the others
                 break;
             }
             Query * q = 0;
@@ -591,27 +926,298 @@ void TuneDatabase::execute()
                 }
                 else {
                     q = new Query( tunableIndices[i].definition, 0 );
-                    printf( "Executing %s;\n", tunableIndices[i].definition );
+                    printf( "%s %s;\n",
+                            dryRun ? "Would execute" : "Executing",
+                            tunableIndices[i].definition );
                 }
             }
             else if ( present.find( tunableIndices[i].name ) && !wanted ) {
                 q = new Query( EString("drop index ") + tunableIndices[i].name,
                                0 );
-                printf( "Dropping index %s.\n",
+                printf( "%s index %s.\n",
+                        dryRun ? "Would drop" : "Dropping",
                         tunableIndices[i].name );
             }
             if ( q )
                 d->t->enqueue( q );
             i++;
         }
+        EStringList::Iterator c( d->changes );
+        while ( c ) {
+            printf( "%s %s;\n",
+                    dryRun ? "Would execute" : "Executing", c->cstr() );
+            d->t->enqueue( new Query( *c, 0 ) );
+            ++c;
+        }
         d->t->enqueue( new Query( "notify database_retuned", 0 ) );
-        d->t->commit();
-        d->set = true;
+        if ( dryRun )
+            d->t->rollback();
+        else
+            d->t->commit();
+        d->state = 5;
     }
 
     if ( !d->t->done() )
         return;
 
+    if ( d->t->failed() )
+        error( "Cannot tune database: " + d->t->error() );
+
+    finish();
+}
+
+
+/*! Looks at the statistics fetched by execute(), reports on them,
+    and chooses the fixed mode, the extra indices and the storage
+    parameter changes that suit the observed workload.
+*/
+
+void TuneDatabase::observe()
+{
+    Dict<int64> scans;
+    Row * r;
+    while ( (r=d->indexes->nextRow()) != 0 )
+        scans.insert( r->getEString( "name" ),
+                      new int64( r->getBigint( "scans" ) ) );
+
+    int64 fetched = 0;
+    int64 written = 0;
+    while ( (r=d->tables->nextRow()) != 0 ) {
+        EString name = r->getEString( "name" );
+        fetched += r->getBigint( "fetched" );
+        written += r->getBigint( "written" );
+
+        // the default scale factors let a big, busy table accumulate
+        // millions of dead rows between autovacuum runs
+        int64 live = r->getBigint( "live" );
+        if ( ( name == "mailbox_messages" || name == "mailbox_changes" ||
+               name == "flags" ) &&
+             live >= 100000 && r->getBigint( "churn" ) >= live )
+            d->changes.append( "alter table " + name + " set "
+                               "(autovacuum_vacuum_scale_factor=0.02, "
+                               "autovacuum_analyze_scale_factor=0.01)" );
+    }
+
+    printf( "Since the statistics were last reset, %s rows have been "
+            "written\nand %s fetched using indices.\n",
+            fn( written ).cstr(), fn( fetched ).cstr() );
+
+    bool fullText = false;
+    Row * s = 0;
+    if ( d->statements && !d->statements->failed() )
+        s = d->statements->nextRow();
+    if ( s ) {
+        int64 reading = s->getBigint( "reading" );
+        printf( "pg_stat_statements shows %ss spent writing and %ss "
+                "reading,\nincluding %ss on full-text searches, %ss on "
+                "substring searches\nand %ss on searches for "
+                "unseen messages.\n",
+                fn( s->getBigint( "writing" ) / 1000 ).cstr(),
+                fn( reading / 1000 ).cstr(),
+                fn( s->getBigint( "fulltext" ) / 1000 ).cstr(),
+                fn( s->getBigint( "substring" ) / 1000 ).cstr(),
+                fn( s->getBigint( "unseen" ) / 1000 ).cstr() );
+        if ( s->getBigint( "writing" ) > reading )
+            d->mode = TuneDatabaseData::Writing;
+        else
+            d->mode = TuneDatabaseData::Reading;
+        // a search type deserves its index if it takes a percent of
+        // the time spent reading
+        if ( s->getBigint( "fulltext" ) * 100 > reading )
+            fullText = true;
+        if ( d->mode == TuneDatabaseData::Reading &&
+             s->getBigint( "unseen" ) * 100 > reading )
+            d->wanted.append( "mm_unseen" );
+        if ( s->getBigint( "substring" ) * 100 > reading &&
+             !scans.contains( "hf_trgm" ) )
+            printf( "Substring searches are common. "
+                    "Consider running aox tune search.\n" );
+    }
+    else {
+        printf( "pg_stat_statements is not available, using table "
+                "statistics only.\n" );
+        if ( written > fetched )
+            d->mode = TuneDatabaseData::Writing;
+        else
+            d->mode = TuneDatabaseData::Reading;
+        // keep the full-text indices if something uses them
+        int64 * b = scans.find( "b_text" );
+        int64 * h = scans.find( "hf_subject" );
+        if ( ( b && *b ) || ( h && *h ) )
+            fullText = true;
+    }
+    if ( fullText && d->mode == TuneDatabaseData::Reading )
+        d->mode = TuneDatabaseData::Advanced;
+
+    const char * mode = "mostly-reading";
+    if ( d->mode == TuneDatabaseData::Writing )
+        mode = "mostly-writing";
+    else if ( d->mode == TuneDatabaseData::Advanced )
+        mode = "advanced-reading";
+    printf( "Tuning for %s.\n", mode );
+
+    uint i = 0;
+    while ( tunableIndices[i].name ) {
+        int64 * n = scans.find( tunableIndices[i].name );
+        if ( n && !*n )
+            printf( "Index %s has not been used.\n", tunableIndices[i].name );
+        i++;
+    }
+}
+
+
+static struct {
+    const char * name;
+    const char * definition;
+} trigramIndices[] = {
+    { "b_trgm",
+      "CREATE INDEX CONCURRENTLY b_trgm ON bodyparts "
+      "USING gin (text gin_trgm_ops)" },
+    { "hf_trgm",
+      "CREATE INDEX CONCURRENTLY hf_trgm ON header_fields "
+      "USING gin (value gin_trgm_ops)" },
+    { "a_name_trgm",
+      "CREATE INDEX CONCURRENTLY a_name_trgm ON addresses "
+      "USING gin (lower(name) gin_trgm_ops)" },
+    { "a_lp_trgm",
+      "CREATE INDEX CONCURRENTLY a_lp_trgm ON addresses "
+      "USING gin (lower(localpart) gin_trgm_ops)" },
+    { "a_dom_trgm",
+      "CREATE INDEX CONCURRENTLY a_dom_trgm ON addresses "
+      "USING gin (lower(domain) gin_trgm_ops)" },
+    { "an_value_trgm",
+      "CREATE INDEX CONCURRENTLY an_value_trgm ON annotations "
+      "USING gin (value gin_trgm_ops)" },
+    { 0, 0 }
+};
+
+
+class TuneSearchData
+    : public Garbage
+{
+public:
+    TuneSearchData(): state( 0 ), q( 0 ), i( 0 ) {}
+    uint state;
+    Query * q;
+    EStringList present;
+    uint i;
+};
+
+
+static AoxFactory<TuneSearch>
+f7( "tune", "search", "Adds trigram indices for substring searches.",
+    "    Synopsis: aox tune search\n\n"
+    "    Installs the pg_trgm extension if necessary and builds trigram\n"
+    "    indices on message text, header fields, addresses and\n"
+    "    annotations, which the server uses for BODY, TEXT, SUBJECT,\n"
+    "    FROM, TO, ANNOTATION and similar searches.\n\n"
+    "    The indices are built concurrently, so the server may keep\n"
+    "    running meanwhile. This can take a long time on a large\n"
+    "    database. Indices that already exist are left alone.\n" );
+
+
+/*! \class TuneSearch db.h
+    This class handles the "aox tune search" command.
+
+    It builds the trigram indices that let Selector search for
+    substrings of message text, header fields, addresses and
+    annotation values without scanning those tables. Each index is created concurrently and outside a
+    transaction, as PostgreSQL requires.
+*/
+
+
+TuneSearch::TuneSearch( EStringList * args )
+    : AoxCommand( args ), d( new TuneSearchData )
+{
+}
+
+
+void TuneSearch::execute()
+{
+    if ( d->state == 0 ) {
+        parseOptions();
+        end();
+        database( true );
+        d->q = new Query( "create extension if not exists pg_trgm", this );
+        d->q->execute();
+        d->state = 1;
+    }
+
+    if ( d->state == 1 ) {
+        if ( !d->q->done() )
+            return;
+        if ( d->q->failed() )
+            error( "Couldn't install pg_trgm: " + d->q->error() );
+
+        EStringList names;
+        uint i = 0;
+        while ( trigramIndices[i].name )
+            names.append( trigramIndices[i++].name );
+        // an interrupted concurrent build leaves an invalid index
+        // behind, which we have to rebuild
+        d->q = new Query( "select c.relname::text as name "
+                          "from pg_class c "
+                          "join pg_index i on (c.oid=i.indexrelid) "
+                          "join pg_namespace n on (c.relnamespace=n.oid) "
+                          "where n.nspname=$1 and i.indisvalid "
+                          "and c.relname=any($2::text[])", this );
+        d->q->bind( 1, Configuration::text( Configuration::DbSchema ) );
+        d->q->bind( 2, names );
+        d->q->execute();
+        d->state = 2;
+    }
+
+    if ( d->state == 2 ) {
+        if ( !d->q->done() )
+            return;
+        if ( d->q->failed() )
+            error( "Couldn't look for indices: " + d->q->error() );
+        Row * r;
+        while ( (r=d->q->nextRow()) != 0 )
+            d->present.append( r->getEString( "name" ) );
+        d->q = 0;
+        d->state = 3;
+    }
+
+    while ( d->state == 3 || d->state == 4 ) {
+        if ( d->q ) {
+            if ( !d->q->done() )
+                return;
+            if ( d->q->failed() )
+                error( "Couldn't create index: " + d->q->error() );
+            d->q = 0;
+        }
+
+        if ( d->state == 4 ) {
+            // the invalid index (if any) is gone, so build it
+            printf( "Executing %s;\n", trigramIndices[d->i].definition );
+            d->q = new Query( trigramIndices[d->i].definition, this );
+            d->q->execute();
+            d->i++;
+            d->state = 3;
+            continue;
+        }
+
+        while ( trigramIndices[d->i].name &&
+                d->present.contains( trigramIndices[d->i].name ) )
+            d->i++;
+
+        if ( !trigramIndices[d->i].name ) {
+            d->q = new Query( "notify database_retuned", this );
+            d->q->execute();
+            d->state = 5;
+        }
+        else {
+            d->q = new Query( EString( "drop index if exists " ) +
+                              trigramIndices[d->i].name, this );
+            d->q->execute();
+            d->state = 4;
+        }
+    }
+
+    if ( !d->q->done() )
+        return;
+
     finish();
 }
 
@@ -688,6 +1294,13 @@ void CheckDatabase::execute()
                 "(message, part, position, hf, af) "
                 "select distinct message, part, position, false, true "
                 "from address_fields" );
+    t->enqueue( "insert into h "
+                "(message, part, position, hf, af) "
+                "select distinct message, part, "
+                "split_part(line, ' ', 1)::integer, true, false from "
+                "(select message, part, "
+                "regexp_split_to_table(fields, E'\\n') as line "
+                "from header_blobs) hb" );
     // if two fields have the same position...
     expectEmpty( "select message from h "
                  "group by message, part, position "
@@ -38,11 +38,13 @@ public:
     void execute();
 
 private:
-    class Query * q;
-    int qstate;
-    class Transaction * t;
-    class RetentionSelector * r;
-    class Selector * s;
+    class VacuumData * d;
+
+    void startStep( uint );
+    class Query * query();
+    void adapt( uint, uint );
+    void removeBlobs();
+    void removeAddresses();
 };
 
 
@@ -68,6 +70,20 @@ public:
 
 private:
     class TuneDatabaseData * d;
+
+    void observe();
+};
+
+
+class TuneSearch
+    : public AoxCommand
+{
+public:
+    TuneSearch( EStringList * );
+    void execute();
+
+private:
+    class TuneSearchData * d;
 };
 
 
@@ -65,6 +65,7 @@ void Help::execute()
             "    show build\n"
             "    show configuration\n"
             "    tune database\n"
+            "    tune search\n"
             "\n"
             "  Administration:\n"
             "    list <users|mailboxes|aliases|rights>\n"
@@ -11,8 +11,11 @@
 
 static AoxFactory<ShowQueue>
 f( "show", "queue", "Display the outgoing mail queue.",
-   "    Synopsis: aox show queue\n\n"
-   "    Displays a list of mail queued for delivery to a smarthost.\n" );
+   "    Synopsis: aox show queue [-s]\n\n"
+   "    Displays a list of mail queued for delivery to a smarthost.\n\n"
+   "    The -s flag displays a summary instead: the number of queued\n"
+   "    messages and the median, 90th and 99th percentile and maximum\n"
+   "    age of the queued messages.\n" );
 
 
 /*! \class ShowQueue queue.h
@@ -33,6 +36,11 @@ void ShowQueue::execute()
 
         database();
 
+        if ( opt( 's' ) ) {
+            summarise();
+            return;
+        }
+
         EString s(
             "select d.id, d.message, "
             "(a.localpart||'@'||a.domain)::text as sender, "
@@ -56,6 +64,11 @@ void ShowQueue::execute()
         q->execute();
     }
 
+    if ( opt( 's' ) ) {
+        summarise();
+        return;
+    }
+
     while ( qr || q->hasResults() ) {
         if ( !qr ) {
             Row * r = q->nextRow();
@@ -179,6 +192,12 @@ void FlushQueue::execute()
         t->enqueue( new Query( "update delivery_recipients "
                                "set last_attempt=null "
                                "where action=2", 0 ) );
+        t->enqueue( new Query( "update deliveries "
+                               "set next_attempt=coalesce(deliver_after,"
+                               "current_timestamp) "
+                               "where id in (select delivery "
+                               "from delivery_recipients where action=2)",
+                               0 ) );
         t->enqueue( new Query( "notify deliveries_updated", 0 ) );
         t->commit();
     }
@@ -188,3 +207,70 @@ void FlushQueue::execute()
 
     finish();
 }
+
+
+// formats a number of seconds as h:mm:ss
+
+static EString age( int64 s )
+{
+    if ( s < 0 )
+        s = 0;
+    char buf[32];
+    snprintf( buf, sizeof( buf ), "%d:%02d:%02d",
+              (int)( s / 3600 ), (int)( s / 60 ) % 60, (int)( s % 60 ) );
+    return buf;
+}
+
+
+/*! This private helper handles "aox show queue -s", which prints the
+    number of messages in the queue and their age percentiles.
+*/
+
+void ShowQueue::summarise()
+{
+    if ( !q ) {
+        q = new Query(
+            "select r, n, age from "
+            "(select age, row_number() over (order by age) as r,"
+            " count(*) over () as n from "
+            "(select (extract(epoch from current_timestamp)-"
+            "extract(epoch from injected_at))::bigint as age "
+            "from deliveries where id in "
+            "(select delivery from delivery_recipients"
+            " where action=$1 or action=$2)) a) p "
+            "where r=n or r=ceil(n*0.5) or r=ceil(n*0.9) or r=ceil(n*0.99) "
+            "order by r", this );
+        q->bind( 1, Recipient::Unknown );
+        q->bind( 2, Recipient::Delayed );
+        q->execute();
+    }
+
+    if ( !q->done() )
+        return;
+
+    uint n = 0;
+    EString median, p90, p99, oldest;
+    while ( q->hasResults() ) {
+        Row * r = q->nextRow();
+        int64 row = r->getBigint( "r" );
+        n = (uint)r->getBigint( "n" );
+        EString a = age( r->getBigint( "age" ) );
+        if ( median.isEmpty() && row * 2 >= n )
+            median = a;
+        if ( p90.isEmpty() && row * 10 >= n * 9 )
+            p90 = a;
+        if ( p99.isEmpty() && row * 100 >= n * 99 )
+            p99 = a;
+        oldest = a;
+    }
+
+    printf( "Queued messages: %d\n", n );
+    if ( n ) {
+        printf( "Median age: %s\n", median.cstr() );
+        printf( "90th percentile age: %s\n", p90.cstr() );
+        printf( "99th percentile age: %s\n", p99.cstr() );
+        printf( "Oldest: %s\n", oldest.cstr() );
+    }
+
+    finish();
+}
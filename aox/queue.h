@@ -16,6 +16,8 @@ public:
 private:
     class Query * q;
     class Query * qr;
+
+    void summarise();
 };
 
 
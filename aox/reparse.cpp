@@ -3,14 +3,13 @@
 #include "reparse.h"
 
 #include "file.h"
-#include "query.h"
 #include "message.h"
 #include "mailbox.h"
-#include "injector.h"
-#include "integerset.h"
-#include "transaction.h"
+#include "reparser.h"
+#include "allocator.h"
+#include "estringlist.h"
 
-#include <stdio.h>
+#include <stdio.h> // printf, rename
 #include <sys/stat.h> // mkdir
 #include <sys/types.h> // mkdir
 #include <unistd.h> // getpid
@@ -21,24 +20,37 @@ class ReparseData
 {
 public:
     ReparseData()
-        : q( 0 ), t( 0 )
+        : reparser( 0 ), started( false ), checkpoint( 0 )
     {}
 
-    Query * q;
-    Transaction * t;
+    Reparser * reparser;
+    bool started;
+    EString checkpointFile;
+    uint checkpoint;
 };
 
 
 static AoxFactory<Reparse>
 f( "reparse", "", "Retry previously-stored unparsable messages.",
-   "    Synopsis: aox reparse\n\n"
+   "    Synopsis: aox reparse [-e] [-b batch] [-j jobs] [-c checkpoint]\n\n"
    "    Looks for messages that \"arrived but could not be stored\",\n"
    "    and tries to reparse them with parsing workarounds added more\n"
-   "    recently. If it succeeds, the new messages are injected.\n" );
+   "    recently. If it succeeds, the new messages are injected.\n\n"
+   "    The messages are retried in batches of reparse-batch-size\n"
+   "    messages, or of the number given with -b, each in its own\n"
+   "    transaction. -j makes aox work on several batches at once.\n\n"
+   "    -c names a file in which aox records how far it has come\n"
+   "    after each batch. If the file exists, aox resumes from there.\n\n"
+   "    -e writes a copy of each message that still cannot be parsed\n"
+   "    to a file in the errors directory.\n" );
 
 
 /*! \class Reparse reparse.h
     This class handles the "aox reparse" command.
+
+    The work is done by a Reparser; this class parses the options,
+    prints what the Reparser reports and maintains the checkpoint
+    file.
 */
 
 Reparse::Reparse( EStringList * args )
@@ -49,111 +61,129 @@ Reparse::Reparse( EStringList * args )
 
 void Reparse::execute()
 {
-    if ( !d->q && !d->t ) {
-        parseOptions();
+    if ( !d->reparser ) {
+        uint batch = 0;
+        uint jobs = 1;
+        EString p = next();
+        while ( p[0] == '-' ) {
+            if ( p == "-e" ) {
+                setopt( 'e' );
+            }
+            else if ( p == "-v" ) {
+                setopt( 'v' );
+            }
+            else if ( p == "-b" || p == "-j" ) {
+                bool ok = false;
+                uint n = next().number( &ok );
+                if ( !ok || !n )
+                    error( p + " needs a positive number" );
+                if ( p == "-b" )
+                    batch = n;
+                else
+                    jobs = n;
+            }
+            else if ( p == "-c" ) {
+                d->checkpointFile = next();
+                if ( d->checkpointFile.isEmpty() )
+                    error( "No file name specified with -c." );
+            }
+            else {
+                error( "Bad option name: " + p.quoted() );
+            }
+            p = next();
+        }
+        if ( !p.isEmpty() )
+            error( "Unexpected argument: " + p );
         end();
 
+        if ( !d->checkpointFile.isEmpty() ) {
+            File c( d->checkpointFile );
+            if ( c.valid() ) {
+                bool ok = false;
+                EString s = c.contents().simplified();
+                d->checkpoint = s.number( &ok );
+                if ( !ok )
+                    error( "Cannot parse checkpoint file " +
+                           d->checkpointFile );
+                printf( "Resuming after bodypart %d\n", d->checkpoint );
+            }
+        }
+
         printf( "Looking for messages with parse failures\n" );
 
         database( true );
         Mailbox::setup( this );
 
-        d->t = new Transaction( this );
-        d->q = new Query( "select mm.mailbox, mm.uid, mm.modseq, "
-                          "mm.message as wrapper, "
-                          "mb.nextmodseq, "
-                          "b.id as bodypart, b.text, b.data "
-                          "from unparsed_messages u "
-                          "join bodyparts b on (u.bodypart=b.id) "
-                          "join part_numbers p on (p.bodypart=b.id) "
-                          "join mailbox_messages mm on (p.message=mm.message) "
-                          "join mailboxes mb on (mm.mailbox=mb.id) "
-                          "order by mm.mailbox "
-                          "for update",
-                          this );
-        d->t->enqueue( d->q );
-        d->t->execute();
+        d->reparser = new Reparser( this );
+        if ( batch )
+            d->reparser->setBatchSize( batch );
+        d->reparser->setConcurrency( jobs );
+        d->reparser->setStart( d->checkpoint );
+        d->reparser->setKeepFailures( opt( 'e' ) > 0 );
     }
 
     if ( !choresDone() )
         return;
 
-    if ( !d->q->done() )
-        return;
-
-    IntegerSet parsable;
-
-    List<Injectee> injectables;
-    while ( d->q && d->q->hasResults() ) {
-        Row * r = d->q->nextRow();
-
-        EString text;
-        if ( r->isNull( "data" ) )
-            text = r->getEString( "text" );
-        else
-            text = r->getEString( "data" );
-        Mailbox * mb = Mailbox::find( r->getInt( "mailbox" ) );
-        Injectee * im = new Injectee;
-        im->parse( text );
-        if ( im->valid() ) {
-            EStringList x;
-            im->setFlags( mb, &x );
-            injectables.append( im );
-
-            parsable.add( r->getInt( "bodypart" ) );
-
-            Query * q
-                = new Query( "insert into deleted_messages "
-                             "(mailbox,uid,message,modseq,deleted_by,reason) "
-                             "values ($1,$2,$3,$4,$5,$6)", this );
-            q->bind( 1, r->getInt( "mailbox" ) );
-            q->bind( 2, r->getInt( "uid" ) );
-            q->bind( 3, r->getInt( "wrapper" ) );
-            q->bind( 4, r->getBigint( "nextmodseq" ) );
-            q->bindNull( 5 );
-            q->bind( 6,
-                     EString( "reparsed by aox " ) +
-                     Configuration::compiledIn( Configuration::Version ) );
-            d->t->enqueue( q );
-            printf( "- reparsed %s:%d\n",
-                    mb->name().utf8().cstr(),
-                    r->getInt( "uid" ) );
-        }
-        else {
-            printf( "- parsing %s:%d still fails: %s\n",
-                    mb->name().utf8().cstr(), r->getInt( "uid" ),
-                    im->error().simplified().cstr() );
-            if ( opt( 'e' ) )
-                printf( "- wrote a copy to %s\n",
-                        writeErrorCopy( text ).cstr() );
-        }
-
+    if ( !d->started ) {
+        d->started = true;
+        d->reparser->execute();
     }
-    if ( !injectables.isEmpty() ) {
-        Query * q =
-            new Query( "delete from unparsed_messages where "
-                       "bodypart=any($1)", this );
-        q->bind( 1, parsable );
-        d->t->enqueue( q );
-
-        Injector * injector = new Injector( this );
-        injector->addInjection( &injectables );
-        injector->setTransaction( d->t );
-        injector->execute();
 
+    EStringList::Iterator i( d->reparser->takeReport() );
+    while ( i ) {
+        printf( "- %s\n", i->cstr() );
+        ++i;
+    }
+    EStringList::Iterator e( d->reparser->takeFailures() );
+    while ( e ) {
+        printf( "- wrote a copy to %s\n", writeErrorCopy( *e ).cstr() );
+        ++e;
     }
 
-    d->t->commit();
+    if ( d->reparser->checkpoint() != d->checkpoint ) {
+        d->checkpoint = d->reparser->checkpoint();
+        writeCheckpoint();
+    }
 
-    if ( !d->t->done() )
+    if ( !d->reparser->done() )
         return;
 
-    if ( d->t->failed() )
-        error( "Reparsing failed: " + d->t->error() );
+    if ( d->reparser->failed() )
+        error( "Reparsing failed: " + d->reparser->error() );
+    printf( "Reparsed %d messages, %d still cannot be parsed\n",
+            d->reparser->reparsed(), d->reparser->unparsable() );
     finish();
 }
 
 
+/*! Records the Reparser's checkpoint in the file named with -c, if
+    any, so that a later run can resume from there.
+*/
+
+void Reparse::writeCheckpoint()
+{
+    if ( d->checkpointFile.isEmpty() )
+        return;
+
+    // write and rename, so that a crash leaves either the old
+    // checkpoint or the new one
+    EString tmp = d->checkpointFile + ".new";
+    {
+        File f( tmp, File::Write, 0600 );
+        if ( !f.valid() ) {
+            fprintf( stderr, "Cannot write checkpoint file %s\n",
+                     tmp.cstr() );
+            return;
+        }
+        f.write( fn( d->checkpoint ) + "\n" );
+    }
+    if ( ::rename( tmp.cstr(), d->checkpointFile.cstr() ) < 0 )
+        fprintf( stderr, "Cannot rename %s to %s\n",
+                 tmp.cstr(), d->checkpointFile.cstr() );
+}
+
+
 static EString * errdir = 0;
 static uint uniq = 0;
 
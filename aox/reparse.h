@@ -17,6 +17,8 @@ public:
 
 private:
     class ReparseData * d;
+
+    void writeCheckpoint();
 };
 
 
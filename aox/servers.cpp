@@ -312,6 +312,8 @@ static void checkFilePermissions()
 
     if ( Configuration::text( Configuration::MessageCopy ).lower() != "none" )
         addPath( Path::WritableDir, Configuration::MessageCopyDir );
+    if ( !Configuration::text( Configuration::BlobDir ).isEmpty() )
+        addPath( Path::WritableDir, Configuration::BlobDir );
     addPath( Path::JailDir, Configuration::JailDir );
     if ( Configuration::toggle( Configuration::UseTls ) ) {
         EString c = Configuration::text( Configuration::TlsCertFile );
@@ -539,6 +541,10 @@ static void checkMiscellaneous()
 
     EString sA( Configuration::text( Configuration::SmartHostAddress ) );
     uint sP( Configuration::scalar( Configuration::SmartHostPort ) );
+    // with direct-delivery, the smarthost isn't used, and since no
+    // server listens on port 0, this disables the checks below
+    if ( Configuration::toggle( Configuration::DirectDelivery ) )
+        sP = 0;
 
     if ( Configuration::toggle( Configuration::UseSmtp ) &&
          Configuration::scalar( Configuration::SmtpPort ) == sP &&
@@ -1304,21 +1310,27 @@ class RestartData
 {
 public:
     RestartData()
-        : checker( 0 ), stopper( 0 ), starter( 0 )
+        : checker( 0 ), stopper( 0 ), starter( 0 ), oldPid( -1 )
     {}
 
     Checker * checker;
     Stopper * stopper;
     Starter * starter;
+    int oldPid;
 };
 
 
 static AoxFactory<Restart>
 f4( "restart", "", "Restart the servers.",
-    "    Synopsis: aox restart [-v]\n\n"
+    "    Synopsis: aox restart [-v] [-g]\n\n"
     "    Restarts Archiveopteryx and its helpers in the correct order.\n"
     "    (Currently equivalent to start && stop.)\n\n"
-    "    The -v flag enables (slightly) verbose diagnostic output.\n" );
+    "    The -v flag enables (slightly) verbose diagnostic output.\n\n"
+    "    The -g flag restarts gracefully: A new archiveopteryx is\n"
+    "    started while the old one still runs, and then the old one\n"
+    "    stops accepting connections and closes its existing ones\n"
+    "    gradually during drain-time seconds. The helpers are left\n"
+    "    running. This needs use-reuseport.\n" );
 
 
 /*! \class Restart servers.h
@@ -1346,6 +1358,11 @@ void Restart::execute()
     if ( !d->checker->done() )
         return;
 
+    if ( opt( 'g' ) ) {
+        gracefully();
+        return;
+    }
+
     if ( !d->stopper ) {
         if ( d->checker->failed() ) {
             finish();
@@ -1376,6 +1393,94 @@ void Restart::execute()
 }
 
 
+/*! Handles aox restart -g. The running archiveopteryx is left alone
+    while a new one starts and listens to the same ports, and is then
+    told to drain its connections and exit. The helpers aren't
+    restarted.
+*/
+
+void Restart::gracefully()
+{
+    if ( !d->starter ) {
+        if ( d->checker->failed() ) {
+            finish();
+            return;
+        }
+
+        if ( !Configuration::toggle( Configuration::UseReusePort ) )
+            error( "aox restart -g needs use-reuseport = true, so that "
+                   "two servers can listen at once" );
+
+        d->oldPid = serverPid( "archiveopteryx" );
+        if ( d->oldPid != -1 ) {
+            if ( kill( d->oldPid, 0 ) != 0 && errno == ESRCH )
+                d->oldPid = -1;
+            File::unlink( pidFile( "archiveopteryx" ) );
+        }
+
+        d->starter = new Starter( opt( 'v' ), this );
+        d->starter->execute();
+    }
+
+    if ( !d->starter->done() )
+        return;
+
+    if ( d->oldPid != -1 && !d->starter->failed() ) {
+        if ( opt( 'v' ) > 0 )
+            printf( "Draining the old archiveopteryx (pid %d)\n",
+                    d->oldPid );
+        kill( d->oldPid, SIGQUIT );
+    }
+
+    finish();
+}
+
+
+
+static AoxFactory<Reload>
+f10( "reload", "", "Make the servers reread archiveopteryx.conf.",
+     "    Synopsis: aox reload [-v]\n\n"
+     "    Sends SIGHUP to the running servers, which makes them reread\n"
+     "    archiveopteryx.conf and use the new values of those variables\n"
+     "    which can change without a restart, such as db-max-handles,\n"
+     "    memory-limit, message-cache-size, log-level and\n"
+     "    tls-certificate. Changes to other variables are logged and\n"
+     "    take effect at the next restart.\n\n"
+     "    The -v flag enables (slightly) verbose diagnostic output.\n" );
+
+
+/*! \class Reload servers.h
+    This class handles the "aox reload" command.
+*/
+
+Reload::Reload( EStringList * args )
+    : AoxCommand( args )
+{
+}
+
+
+void Reload::execute()
+{
+    parseOptions();
+    end();
+
+    uint n = 0;
+    int i = 0;
+    while ( i < nservers ) {
+        int pid = serverPid( servers[i] );
+        if ( pid > 0 && kill( pid, SIGHUP ) == 0 ) {
+            if ( opt( 'v' ) > 0 )
+                printf( "Sent SIGHUP to %s (pid %d)\n", servers[i], pid );
+            n++;
+        }
+        i++;
+    }
+
+    if ( !n )
+        error( "No running servers to reload" );
+
+    finish();
+}
 
 static AoxFactory<ShowStatus>
 f5( "show", "status", "Display a summary of the running servers.",
@@ -103,6 +103,17 @@ public:
 
 private:
     class RestartData * d;
+
+    void gracefully();
+};
+
+
+class Reload
+    : public AoxCommand
+{
+public:
+    Reload( EStringList * );
+    void execute();
 };
 
 
@@ -23,16 +23,25 @@ public:
 
 static AoxFactory<ShowCounts>
 f( "show", "counts", "Show number of users, messages etc..",
-   "    Synopsis: aox show counts [-f]\n\n"
+   "    Synopsis: aox show counts [-fsu]\n\n"
    "    Displays the number of rows in the most important tables,\n"
    "    as well as the total size of the mail stored.\n"
    "\n"
    "    The -f flag makes aox collect slow-but-accurate counts.\n"
-   "    Without it, by default, you get quick estimates.\n" );
+   "    Without it, by default, you get quick estimates.\n\n"
+   "    The -s flag shows how much disk space each table uses,\n"
+   "    including its indices and TOAST data.\n\n"
+   "    The -u flag shows the number of mailboxes and messages each\n"
+   "    user has, and their total size.\n\n"
+   "    Neither -s nor -u needs to look at individual messages.\n" );
 
 
 /*! \class ShowCounts stats.h
     This class handles the "aox show counts" command.
+
+    By default, it uses the planner's estimates from pg_class and the
+    per-mailbox figures in mailbox_counts, which a trigger maintains,
+    so it doesn't scan the big tables.
 */
 
 ShowCounts::ShowCounts( EStringList * args )
@@ -43,7 +52,8 @@ ShowCounts::ShowCounts( EStringList * args )
 
 static EString tuples( const EString & table )
 {
-    EString s( "select reltuples from pg_class c join "
+    // reltuples is -1 for a table that has never been analysed
+    EString s( "select greatest(reltuples,0) from pg_class c join "
               "pg_namespace n on (c.relnamespace=n.oid) "
               "where n.nspname=$1 and c.relname='" );
     s.append( table );
@@ -71,7 +81,12 @@ void ShowCounts::execute()
             "(" + tuples( "messages" ) + ")::int as messages,"
             "(" + tuples( "bodyparts" ) + ")::int as bodyparts,"
             "(" + tuples( "addresses" ) + ")::int as addresses,"
-            "(" + tuples( "deleted_messages" ) + ")::int as dm",
+            "(" + tuples( "deleted_messages" ) + ")::int as dm,"
+            "(" + tuples( "mailbox_changes" ) + ")::int as mc,"
+            "(select coalesce(sum(messages),0) from mailbox_counts)::int"
+            " as mm,"
+            "(select coalesce(sum(bytes),0) from mailbox_counts)::bigint"
+            " as totalsize",
             this
         );
 
@@ -95,24 +110,30 @@ void ShowCounts::execute()
             if ( r->getInt( "dm" ) != 0 )
                 printf( " (%d deleted)", r->getInt( "dm" ) );
             printf( " (estimated)\n" );
+            printf( "Messages in mailboxes: %d (total size: %s)\n",
+                    r->getInt( "mm" ),
+                    EString::humanNumber( r->getBigint( "totalsize" ) )
+                    .cstr() );
             printf( "Bodyparts: %d (estimated)\n",
                     r->getInt( "bodyparts" ) );
             printf( "Addresses: %d (estimated)\n",
                     r->getInt( "addresses" ) );
-            d->state = 666;
-            finish();
-            return;
+            printf( "Change journal: %d entries (estimated)\n",
+                    r->getInt( "mc" ) );
+            d->state = 5;
+        }
+        else {
+            d->query =
+                new Query( "select count(*)::int as messages, "
+                           "coalesce(sum(rfc822size)::bigint,0) "
+                           "as totalsize, "
+                           "(select count(*) from mailbox_messages)::int "
+                           "as mm, "
+                           "(select count(*) from deleted_messages)::int "
+                           "as dm from messages", this );
+            d->query->execute();
+            d->state = 2;
         }
-
-        d->query =
-            new Query( "select count(*)::int as messages, "
-                       "coalesce(sum(rfc822size)::bigint,0) as totalsize, "
-                       "(select count(*) from mailbox_messages)::int "
-                       "as mm, "
-                       "(select count(*) from deleted_messages)::int "
-                       "as dm from messages", this );
-        d->query->execute();
-        d->state = 2;
     }
 
     if ( d->state == 2 ) {
@@ -173,6 +194,91 @@ void ShowCounts::execute()
             error( "Couldn't fetch addresses counts." );
 
         printf( "Addresses: %d\n", r->getInt( "addresses" ) );
+        d->state = 5;
+    }
+
+    if ( d->state == 5 ) {
+        if ( !opt( 's' ) ) {
+            d->state = 7;
+        }
+        else {
+            d->query =
+                new Query( "select c.relname::text as name, "
+                           "pg_total_relation_size(c.oid)::bigint as total, "
+                           "pg_indexes_size(c.oid)::bigint as indices, "
+                           "greatest(c.reltuples,0)::bigint as rows "
+                           "from pg_class c "
+                           "join pg_namespace n on (c.relnamespace=n.oid) "
+                           "where n.nspname=$1 and c.relkind='r' "
+                           "order by total desc, name", this );
+            d->query->bind( 1,
+                            Configuration::text( Configuration::DbSchema ) );
+            d->query->execute();
+            d->state = 6;
+        }
+    }
+
+    if ( d->state == 6 ) {
+        if ( !d->query->done() )
+            return;
+        if ( d->query->failed() )
+            error( "Couldn't fetch table sizes: " + d->query->error() );
+
+        printf( "\n%-24s %10s %10s %12s\n",
+                "Table", "Size", "Indices", "Rows (est.)" );
+        int64 total = 0;
+        Row * r;
+        while ( (r=d->query->nextRow()) != 0 ) {
+            total += r->getBigint( "total" );
+            printf( "%-24s %10s %10s %12s\n",
+                    r->getEString( "name" ).cstr(),
+                    EString::humanNumber( r->getBigint( "total" ) ).cstr(),
+                    EString::humanNumber( r->getBigint( "indices" ) )
+                    .cstr(),
+                    fn( r->getBigint( "rows" ) ).cstr() );
+        }
+        printf( "%-24s %10s\n",
+                "Total", EString::humanNumber( total ).cstr() );
+        d->state = 7;
+    }
+
+    if ( d->state == 7 ) {
+        if ( !opt( 'u' ) ) {
+            d->state = 666;
+        }
+        else {
+            d->query =
+                new Query( "select u.login, "
+                           "count(mb.id)::bigint as mailboxes, "
+                           "coalesce(sum(c.messages),0)::bigint as messages, "
+                           "coalesce(sum(c.bytes),0)::bigint as bytes "
+                           "from users u "
+                           "left join mailboxes mb "
+                           "on (mb.owner=u.id and not mb.deleted) "
+                           "left join mailbox_counts c "
+                           "on (c.mailbox=mb.id) "
+                           "group by u.login "
+                           "order by bytes desc, u.login", this );
+            d->query->execute();
+            d->state = 8;
+        }
+    }
+
+    if ( d->state == 8 ) {
+        if ( !d->query->done() )
+            return;
+        if ( d->query->failed() )
+            error( "Couldn't fetch per-user counts: " + d->query->error() );
+
+        printf( "\n%-32s %9s %10s %10s\n",
+                "User", "Mailboxes", "Messages", "Size" );
+        Row * r;
+        while ( (r=d->query->nextRow()) != 0 )
+            printf( "%-32s %9s %10s %10s\n",
+                    r->getUString( "login" ).utf8().cstr(),
+                    fn( r->getBigint( "mailboxes" ) ).cstr(),
+                    fn( r->getBigint( "messages" ) ).cstr(),
+                    EString::humanNumber( r->getBigint( "bytes" ) ).cstr() );
         d->state = 666;
     }
 
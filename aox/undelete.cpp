@@ -8,11 +8,17 @@
 #include "selector.h"
 #include "mailbox.h"
 #include "query.h"
+#include "date.h"
 #include "map.h"
 #include "utf.h"
 
 #include <stdlib.h> // exit()
 #include <stdio.h> // printf()
+#include <time.h> // time()
+
+
+// the number of messages restored per transaction
+static const uint chunkSize = 5000;
 
 
 class UndeleteData
@@ -20,7 +26,9 @@ class UndeleteData
 {
 public:
     UndeleteData(): state( 0 ), m( 0 ), t( 0 ),
-                    find( 0 ), uidnext( 0 ), usernames( 0 ) {}
+                    find( 0 ), uidnext( 0 ), usernames( 0 ),
+                    since( 0 ), until( 0 ),
+                    first( 0 ), restored( 0 ), restore( 0 ) {}
 
     uint state;
     Mailbox * m;
@@ -29,20 +37,60 @@ public:
     Query * find;
     Query * uidnext;
     Query * usernames;
+
+    uint since;
+    uint until;
+
+    IntegerSet uids;
+    uint first;
+    uint restored;
+    Query * restore;
 };
 
 
 static AoxFactory<Undelete>
 f( "undelete", "", "Recover a message that has been deleted.",
-   "    Synopsis: undelete [-n] <mailbox> <search>\n\n"
+   "    Synopsis: undelete [-nv] [-s since] [-u until] <mailbox> "
+   "[search]\n\n"
    "    Searches for deleted messages in the specified mailbox and\n"
-   "    recovers those that match the search.\n"
-   "    The -n option causes a dummy undelete.\n"
+   "    recovers those that match the search, or all of them if there\n"
+   "    is no search.\n\n"
+   "    -s and -u restrict the search to messages deleted at or after\n"
+   "    and before the given time, e.g. 2010-04-01 or\n"
+   "    2010-04-01T09:30:00+02:00.\n\n"
+   "    The -n option causes a dummy undelete: aox only reports how\n"
+   "    many messages would be restored. -v lists the messages.\n\n"
    "    Messages can be restored after an IMAP EXPUNGE or POP3 DELE\n"
    "    until aox vacuum permanently removes them (some weeks) later.\n" );
 
+
+// parses \a s as an ISO 8601 date or date-time and returns it as a
+// unix time, or 0 if it can't be parsed.
+
+static uint parseTime( const EString & s )
+{
+    Date d;
+    if ( s.length() == 10 )
+        d.setIsoDateTime( s + "T00:00:00Z" );
+    else
+        d.setIsoDateTime( s );
+    if ( !d.valid() )
+        return 0;
+    return d.unixTime();
+}
+
+
 /*! \class Undelete Undelete.h
     This class handles the "aox undelete" command.
+
+    The messages are found with one query, and restored in chunks of
+    5000, each chunk in its own transaction so that the mailbox isn't
+    locked for long. The UIDs for all of them are allocated first, by
+    a single uidnext bump, so the restored messages get consecutive
+    UIDs in their original order even if something else adds messages
+    to the mailbox meanwhile.
+
+    With -n, only a count is fetched.
 */
 
 Undelete::Undelete( EStringList * args )
@@ -54,10 +102,34 @@ Undelete::Undelete( EStringList * args )
 void Undelete::execute()
 {
     if ( d->state == 0 ) {
+        EString p = args()->isEmpty() ? EString()
+                                      : *args()->firstElement();
+        while ( p[0] == '-' ) {
+            (void)next();
+            if ( p == "-n" ) {
+                setopt( 'n' );
+            }
+            else if ( p == "-v" ) {
+                setopt( 'v' );
+            }
+            else if ( p == "-s" || p == "-u" ) {
+                EString t = next();
+                uint u = parseTime( t );
+                if ( !u )
+                    error( "Cannot parse time: " + t.quoted() );
+                if ( p == "-s" )
+                    d->since = u;
+                else
+                    d->until = u;
+            }
+            else {
+                error( "Bad option name: " + p.quoted() );
+            }
+            p = args()->isEmpty() ? EString() : *args()->firstElement();
+        }
         database( true );
         Mailbox::setup();
         d->state = 1;
-        parseOptions();
     }
 
     if ( d->state == 1 ) {
@@ -79,20 +151,24 @@ void Undelete::execute()
         if ( !d->m )
             error( "No such mailbox: " + m.utf8() );
 
-        Selector * s = parseSelector( args() );
-        if ( !s )
-            exit( 1 );
-        s->simplify();
-
-        d->t = new Transaction( this );
-        if ( d->m->deleted() ) {
-            if ( !d->m->create( d->t, 0 ) )
-                error( "Mailbox was deleted; recreating failed: " +
-                       d->m->name().utf8() );
-            printf( "aox: Note: Mailbox %s is recreated.\n"
-                    "     Its ownership and permissions could not be restored.\n",
-                    d->m->name().utf8().cstr() );
+        Selector * s = new Selector( Selector::And );
+        if ( args()->isEmpty() ) {
+            s->add( new Selector( Selector::NoField, Selector::All, 0 ) );
+        }
+        else {
+            Selector * search = parseSelector( args() );
+            if ( !search )
+                exit( 1 );
+            s->add( search );
         }
+        uint now = (uint)::time( 0 );
+        if ( d->since )
+            s->add( new Selector( Selector::Age, Selector::Smaller,
+                                  d->since < now ? now - d->since : 0 ) );
+        if ( d->until )
+            s->add( new Selector( Selector::Age, Selector::Larger,
+                                  d->until < now ? now - d->until : 0 ) );
+        s->simplify();
 
         EStringList wanted;
         wanted.append( "uid" );
@@ -100,119 +176,218 @@ void Undelete::execute()
             wanted.append( "deleted_by" );
             wanted.append( "deleted_at::text" );
             wanted.append( "reason" );
-            d->usernames = new Query( "select id, login from users", 0 );
-            d->t->enqueue( d->usernames );
         }
 
-        d->find = s->query( 0, d->m, 0, 0, true, &wanted, true );
-        d->t->enqueue( d->find );
+        if ( opt( 'n' ) ) {
+            // count, and don't materialise anything unless asked to
+            if ( !opt( 'v' ) ) {
+                wanted.append( "deleted_at" );
+                d->find = s->query( 0, d->m, 0, this, false, &wanted, true );
+                d->find->setString( "select count(*)::integer as messages, "
+                                    "min(deleted_at)::text as first, "
+                                    "max(deleted_at)::text as last "
+                                    "from (" + d->find->string() + ") x" );
+            }
+            else {
+                d->find = s->query( 0, d->m, 0, this, true, &wanted, true );
+                d->usernames = new Query( "select id, login from users", 0 );
+                d->usernames->execute();
+            }
+            d->find->execute();
+            d->state = 10;
+        }
+        else {
+            d->t = new Transaction( this );
+            if ( d->m->deleted() ) {
+                if ( !d->m->create( d->t, 0 ) )
+                    error( "Mailbox was deleted; recreating failed: " +
+                           d->m->name().utf8() );
+                printf( "aox: Note: Mailbox %s is recreated.\n"
+                        "     Its ownership and permissions could not "
+                        "be restored.\n",
+                        d->m->name().utf8().cstr() );
+            }
+
+            if ( opt( 'v' ) ) {
+                d->usernames = new Query( "select id, login from users", 0 );
+                d->t->enqueue( d->usernames );
+            }
+
+            d->uidnext = new Query( "select uidnext "
+                                    "from mailboxes "
+                                    "where id=$1 for update", this );
+            d->uidnext->bind( 1, d->m->id() );
+            d->t->enqueue( d->uidnext );
 
-        d->uidnext = new Query( "select uidnext, nextmodseq "
-                                "from mailboxes "
-                                "where id=$1 for update", this );
-        d->uidnext->bind( 1, d->m->id() );
-        d->t->enqueue( d->uidnext );
+            d->find = s->query( 0, d->m, 0, 0, true, &wanted, true );
+            d->t->enqueue( d->find );
 
-        d->t->execute();
-        d->state = 3;
+            d->t->execute();
+            d->state = 3;
+        }
+    }
+
+    if ( d->state == 10 ) {
+        if ( !d->find->done() ||
+             ( d->usernames && !d->usernames->done() ) )
+            return;
+        if ( d->find->failed() )
+            error( "Search failed: " + d->find->error() );
+        uint n = 0;
+        if ( d->usernames ) {
+            n = list();
+        }
+        else {
+            Row * r = d->find->nextRow();
+            if ( r )
+                n = r->getInt( "messages" );
+            if ( n )
+                printf( "aox: Messages deleted between %s and %s\n",
+                        r->getEString( "first" ).cstr(),
+                        r->getEString( "last" ).cstr() );
+        }
+        if ( !n )
+            error( "No such deleted message (search returned 0 results)" );
+        printf( "aox: Would undelete %d messages into %s\n"
+                "aox: Rerun without -n to actually undelete.\n",
+                n, d->m->name().utf8().cstr() );
+        finish();
+        return;
     }
 
     if ( d->state == 3 ) {
-        if ( !d->uidnext->done() )
+        if ( !d->find->done() )
             return;
 
         Row * r = d->uidnext->nextRow();
         if ( !r )
             error( "Internal error - could not read mailbox UID" );
-        uint uidnext = r->getInt( "uidnext" );
-        int64 modseq = r->getBigint( "nextmodseq" );
+        d->first = r->getInt( "uidnext" );
 
-        Map<EString> logins;
-        if ( d->usernames ) {
-            while ( d->usernames->hasResults() ) {
-                r = d->usernames->nextRow();
-                logins.insert( r->getInt( "id" ),
-                               new EString( r->getEString( "login" ) ) );
-            }
-        }
+        list();
 
-        Map<EString> why;
-        IntegerSet s;
-        while ( d->find->hasResults() ) {
-            r = d->find->nextRow();
-            uint uid = r->getInt( "uid" );
-            s.add( uid );
-            if ( d->usernames )
-                why.insert( uid,
-                            new EString(
-                                " - Message " + fn( uid ) + " was deleted by " +
-                                (*logins.find( r->getInt( "deleted_by" ) )).quoted() +
-                                " at " + r->getEString( "deleted_at" ) +
-                                "\n   Reason: " +
-                                r->getEString( "reason" ).simplified().quoted() ) );
-        }
-
-        if ( s.isEmpty() )
+        if ( d->uids.isEmpty() )
             error( "No such deleted message (search returned 0 results)" );
 
         printf( "aox: Undeleting %d messages into %s\n",
-                s.count(), d->m->name().utf8().cstr() );
+                d->uids.count(), d->m->name().utf8().cstr() );
+
+        // allocate all the UIDs at once
+        Query * q = new Query( "update mailboxes "
+                               "set uidnext=uidnext+$1 "
+                               "where id=$2", 0 );
+        q->bind( 1, d->uids.count() );
+        q->bind( 2, d->m->id() );
+        d->t->enqueue( q );
+        Mailbox::refreshMailboxes( d->t );
+        d->t->commit();
+        d->state = 4;
+    }
 
-        Map<EString>::Iterator i( why );
-        while ( i ) {
-            printf( "%s\n", i->cstr() );
-            ++i;
+    while ( d->state == 4 ) {
+        if ( !d->t->done() )
+            return;
+
+        if ( d->t->failed() )
+            error( "Undelete failed: " + d->t->error() );
+
+        if ( d->restore ) {
+            d->restored += d->restore->rows();
+            d->restore = 0;
+            if ( d->restored < d->uids.count() )
+                printf( "aox: Restored %d of %d messages\n",
+                        d->restored, d->uids.count() );
         }
 
-        Query * q;
+        uint done = d->restored;
+        if ( done >= d->uids.count() ) {
+            d->state = 5;
+            break;
+        }
 
-        q = new Query( "create temporary sequence s start " + fn( uidnext ),
-                       0 );
-        d->t->enqueue( q );
+        // the next chunk keeps the UIDs it was allocated, even if a
+        // message vanished before we got to it
+        IntegerSet chunk;
+        uint i = done + 1;
+        while ( i <= d->uids.count() && chunk.count() < chunkSize ) {
+            chunk.add( d->uids.value( i ) );
+            i++;
+        }
 
-        q = new Query( "insert into mailbox_messages "
-                       "(mailbox,uid,message,modseq) "
-                       "select $1,nextval('s'),message,$2 "
-                       "from deleted_messages "
-                       "where mailbox=$1 and uid=any($3)", 0 );
+        d->t = new Transaction( this );
+        Query * q = new Query( "select nextmodseq from mailboxes "
+                               "where id=$1 for update", 0 );
         q->bind( 1, d->m->id() );
-        q->bind( 2, modseq );
-        q->bind( 3, s );
         d->t->enqueue( q );
 
+        d->restore = new Query( "insert into mailbox_messages "
+                                "(mailbox,uid,message,modseq) "
+                                "select $1, "
+                                "$2+(row_number() over (order by uid))-1, "
+                                "message, "
+                                "(select nextmodseq from mailboxes "
+                                "where id=$1) "
+                                "from deleted_messages "
+                                "where mailbox=$1 and uid=any($3)", 0 );
+        d->restore->bind( 1, d->m->id() );
+        d->restore->bind( 2, d->first + done );
+        d->restore->bind( 3, chunk );
+        d->t->enqueue( d->restore );
+
         q = new Query( "delete from deleted_messages "
                        "where mailbox=$1 and uid=any($2)", 0 );
         q->bind( 1, d->m->id() );
-        q->bind( 2, s );
+        q->bind( 2, chunk );
         d->t->enqueue( q );
 
         q = new Query( "update mailboxes "
-                       "set uidnext=nextval('s'), nextmodseq=$1 "
-                       "where id=$2", 0 );
-        q->bind( 1, modseq + 1 );
-        q->bind( 2, d->m->id() );
+                       "set nextmodseq=nextmodseq+1 "
+                       "where id=$1", 0 );
+        q->bind( 1, d->m->id() );
         d->t->enqueue( q );
 
-        d->t->enqueue( new Query( "drop sequence s", 0 ) );
-
         Mailbox::refreshMailboxes( d->t );
+        d->t->commit();
+    }
 
-        if ( opt( 'n' ) ) {
-            printf( "aox: Cancelling undeleting due to -n. Rerun without -n to actually undelete.\n" );
-            d->t->rollback();
-        }
-        else {
-            d->t->commit();
-        }
-        d->state = 4;
+    if ( d->state == 5 ) {
+        printf( "aox: Restored %d messages\n", d->restored );
+        finish();
     }
+}
 
-    if ( d->state == 4 ) {
-        if ( !d->t->done() )
-            return;
 
-        if ( d->t->failed() )
-            error( "Undelete failed." );
-        finish();
+/*! Reads the UIDs found into d->uids and, if -v was used, prints a
+    line about each message. Returns the number of messages found.
+*/
+
+uint Undelete::list()
+{
+    Map<EString> logins;
+    if ( d->usernames ) {
+        while ( d->usernames->hasResults() ) {
+            Row * r = d->usernames->nextRow();
+            logins.insert( r->getInt( "id" ),
+                           new EString( r->getEString( "login" ) ) );
+        }
+    }
+
+    while ( d->find->hasResults() ) {
+        Row * r = d->find->nextRow();
+        uint uid = r->getInt( "uid" );
+        d->uids.add( uid );
+        if ( !d->usernames )
+            continue;
+        EString by;
+        if ( !r->isNull( "deleted_by" ) &&
+             logins.find( r->getInt( "deleted_by" ) ) )
+            by = logins.find( r->getInt( "deleted_by" ) )->quoted();
+        else
+            by = "nobody";
+        printf( " - Message %d was deleted by %s at %s\n"
+                "   Reason: %s\n",
+                uid, by.cstr(), r->getEString( "deleted_at" ).cstr(),
+                r->getEString( "reason" ).simplified().quoted().cstr() );
     }
+    return d->uids.count();
 }
@@ -15,6 +15,8 @@ public:
 
 private:
     class UndeleteData * d;
+
+    uint list();
 };
 
 
@@ -6,9 +6,14 @@
 #include "utf.h"
 #include "dict.h"
 #include "query.h"
+#include "message.h"
 #include "ustring.h"
 #include "address.h"
+#include "injector.h"
+#include "estringlist.h"
+#include "integerset.h"
 #include "transaction.h"
+#include "configuration.h"
 #include "helperrowcreator.h"
 
 #include <stdio.h>
@@ -44,7 +49,9 @@ public:
           threader( 0 ),
           messages( 0 ), byMessageId( 0 ),
           report( 0 ), temp( 0 ), update( 0 ),
-          sofar( 0 ), threading( true )
+          sofar( 0 ), threading( true ), subjects( true ),
+          links( true ),
+          blobs( Configuration::toggle( Configuration::CompactHeaders ) )
         {}
 
     Transaction * t;
@@ -60,6 +67,9 @@ public:
     uint sofar;
 
     bool threading;
+    bool subjects;
+    bool links;
+    bool blobs;
 };
 
 
@@ -70,7 +80,9 @@ f( "update", "database", "Update the database contents.",
    "    slow for inclusion in \"aox upgrade schema\". This command is\n"
    "    meant to be used while the server is running. It does its\n"
    "    work in small chunks, so it can be restarted at any time,\n"
-   "    and is tolerant of interruptions.\n" );
+   "    and is tolerant of interruptions.\n\n"
+   "    If compact-headers is enabled, this also moves the header\n"
+   "    fields of existing messages to header_blobs.\n" );
 
 
 /*! \class UpdateDatabase updatedb.h
@@ -85,9 +97,27 @@ UpdateDatabase::UpdateDatabase( EStringList * args )
 
 void UpdateDatabase::execute()
 {
-    if ( !d->threading )
-        return;
+    if ( d->threading )
+        thread();
+    if ( !d->threading && d->subjects )
+        fillSubjects();
+    if ( !d->threading && !d->subjects && d->links )
+        fillThreadLinks();
+    if ( !d->threading && !d->subjects && !d->links ) {
+        if ( d->blobs )
+            fillHeaderBlobs();
+        else
+            finish();
+    }
+}
+
 
+/*! Gives thread roots to up to 4096 messages at a time, until all
+    messages have one.
+*/
+
+void UpdateDatabase::thread()
+{
     if ( !d->report ) {
         database( true );
         d->report
@@ -171,7 +201,9 @@ void UpdateDatabase::execute()
     if ( d->messages->isEmpty() ) {
         d->threading = false;
         printf( "All messages are now threaded.\n" );
-        finish();
+        d->t->rollback();
+        d->t = 0;
+        d->sofar = 0;
         return;
     }
 
@@ -251,3 +283,241 @@ void UpdateDatabase::execute()
         d->t->commit();
     }
 }
+
+
+/*! Fills in messages.base_subject for up to 4096 messages at a time,
+    for the messages injected before schema revision 107.
+*/
+
+void UpdateDatabase::fillSubjects()
+{
+    if ( d->t && d->t->done() ) {
+        if ( d->t->failed() )
+            error( "Transaction failed: " + d->t->error() );
+        d->t = 0;
+        if ( d->update && d->update->rows() )
+            printf( "Set %d base subjects.\nCommitted transaction.\n",
+                    d->update->rows() );
+    }
+
+    if ( !d->t ) {
+        printf( "Looking for 4096 more messages without base subjects.\n" );
+        d->t = new Transaction( this );
+        d->findMessages
+            = new Query( "select m.id, hf.value as subject "
+                         "from messages m "
+                         "join header_fields hf on"
+                         " (m.id=hf.message and hf.field=$2 and hf.part='') "
+                         "where m.base_subject is null and m.id>$1 "
+                         "order by m.id limit 4096", this );
+        d->findMessages->bind( 1, d->sofar );
+        d->findMessages->bind( 2, HeaderField::Subject );
+        d->t->enqueue( d->findMessages );
+        d->t->execute();
+        d->update = 0;
+    }
+
+    if ( !d->findMessages->done() || d->update )
+        return;
+
+    if ( !d->findMessages->hasResults() ) {
+        d->subjects = false;
+        printf( "All messages now have base subjects.\n" );
+        d->t->rollback();
+        d->t = 0;
+        d->sofar = 0;
+        return;
+    }
+
+    d->t->enqueue( "create temporary table ms ("
+                   "message integer,"
+                   "base_subject text"
+                   ")" );
+    Query * q = new Query( "copy ms( message, base_subject ) "
+                           "from stdin with binary", 0 );
+    while ( d->findMessages->hasResults() ) {
+        Row * r = d->findMessages->nextRow();
+        uint id = r->getInt( "id" );
+        if ( id > d->sofar )
+            d->sofar = id;
+        q->bind( 1, id );
+        q->bind( 2, Message::baseSubject( r->getUString( "subject" ) ) );
+        q->submitLine();
+    }
+    d->t->enqueue( q );
+    d->update = new Query( "update messages set "
+                           "base_subject=ms.base_subject "
+                           "from ms "
+                           "where id=ms.message", this );
+    d->t->enqueue( d->update );
+    d->t->enqueue( "drop table ms" );
+    d->t->commit();
+}
+
+
+/*! Fills in thread_links for up to 4096 messages at a time, for the
+    messages injected before schema revision 111.
+*/
+
+void UpdateDatabase::fillThreadLinks()
+{
+    if ( d->t && d->t->done() ) {
+        if ( d->t->failed() )
+            error( "Transaction failed: " + d->t->error() );
+        d->t = 0;
+        printf( "Committed transaction.\n" );
+    }
+
+    if ( !d->t ) {
+        printf( "Looking for 4096 more messages without thread links.\n" );
+        d->t = new Transaction( this );
+        d->findMessages
+            = new Query( "select m.id, msgid.value as messageid, "
+                         "ref.value as references "
+                         "from messages m "
+                         "left join header_fields msgid on"
+                         " (m.id=msgid.message and msgid.field=$2 and msgid.part='') "
+                         "left join header_fields ref on"
+                         " (m.id=ref.message and ref.field=$3 and ref.part='') "
+                         "left join thread_links tl on (m.id=tl.message) "
+                         "where tl.message is null and m.id>$1 "
+                         "and (msgid.value is not null or ref.value is not null) "
+                         "order by m.id limit 4096", this );
+        d->findMessages->bind( 1, d->sofar );
+        d->findMessages->bind( 2, HeaderField::MessageId );
+        d->findMessages->bind( 3, HeaderField::References );
+        d->t->enqueue( d->findMessages );
+        d->t->execute();
+        d->update = 0;
+    }
+
+    if ( !d->findMessages->done() || d->update )
+        return;
+
+    if ( !d->findMessages->hasResults() ) {
+        d->links = false;
+        printf( "All messages now have thread links.\n" );
+        d->t->rollback();
+        d->t = 0;
+        d->sofar = 0;
+        return;
+    }
+
+    Query * q = new Query( "copy thread_links "
+                           "(message, messageid, parent_messageid, "
+                           "ancestors) "
+                           "from stdin with binary", 0 );
+    IntegerSet ids;
+    while ( d->findMessages->hasResults() ) {
+        Row * r = d->findMessages->nextRow();
+        uint id = r->getInt( "id" );
+        if ( id > d->sofar )
+            d->sofar = id;
+        EStringList ancestors;
+        if ( !r->isNull( "references" ) ) {
+            AddressParser * ap
+                = AddressParser::references( r->getEString( "references" ) );
+            List<Address>::Iterator i( ap->addresses() );
+            while ( i ) {
+                if ( !i->lpdomain().isEmpty() )
+                    ancestors.append( "<" + i->lpdomain() + ">" );
+                ++i;
+            }
+        }
+        q->bind( 1, id );
+        if ( r->isNull( "messageid" ) )
+            q->bindNull( 2 );
+        else
+            q->bind( 2, r->getEString( "messageid" ) );
+        if ( ancestors.isEmpty() ) {
+            q->bindNull( 3 );
+            q->bindNull( 4 );
+        }
+        else {
+            q->bind( 3, *ancestors.lastElement() );
+            q->bind( 4, ancestors.join( " " ) );
+        }
+        q->submitLine();
+        ids.add( id );
+    }
+    printf( "Linking %d messages.\n", ids.count() );
+    d->t->enqueue( q );
+    Injector::linkThreads( d->t, ids );
+    d->update = q;
+    d->t->commit();
+}
+
+
+/*! Moves the header fields which compact-headers doesn't break out
+    (see HeaderField::isBrokenOut()) from header_fields to header_blobs,
+    for up to 4096 messages at a time. Parts which already have a
+    header_blobs row are left alone.
+*/
+
+void UpdateDatabase::fillHeaderBlobs()
+{
+    if ( d->t && d->t->done() ) {
+        if ( d->t->failed() )
+            error( "Transaction failed: " + d->t->error() );
+        d->t = 0;
+        if ( d->update && d->update->rows() )
+            printf( "Moved %d header fields.\nCommitted transaction.\n",
+                    d->update->rows() );
+    }
+
+    if ( !d->t ) {
+        printf( "Looking for 4096 more messages to compact.\n" );
+        d->t = new Transaction( this );
+        d->findMessages
+            = new Query( "select max(id) as last from "
+                         "(select id from messages where id>$1 "
+                         "order by id limit 4096) m", this );
+        d->findMessages->bind( 1, d->sofar );
+        d->t->enqueue( d->findMessages );
+        d->t->execute();
+        d->update = 0;
+    }
+
+    if ( !d->findMessages->done() || d->update )
+        return;
+
+    Row * r = d->findMessages->nextRow();
+    if ( !r || r->isNull( "last" ) ) {
+        d->blobs = false;
+        printf( "All header fields are now compact.\n" );
+        finish();
+        return;
+    }
+
+    // the escaping and format match Injector::addHeader()
+    EString moved = "(hf.field>" + fn( HeaderField::Keywords ) + " and "
+                    "lower(fn.name)<>'thread-index')";
+    d->update = new Query( "with moved as ("
+                           "insert into header_blobs (message,part,fields) "
+                           "select hf.message, hf.part, "
+                           "string_agg(hf.position || ' ' || fn.name || "
+                           "': ' || "
+                           "replace(replace(replace(coalesce(hf.value,''),"
+                           "E'\\\\',E'\\\\\\\\'),"
+                           "E'\\r',E'\\\\r'),"
+                           "E'\\n',E'\\\\n'), "
+                           "E'\\n' order by hf.position) "
+                           "from header_fields hf "
+                           "join field_names fn on (hf.field=fn.id) "
+                           "left join header_blobs hb on"
+                           " (hf.message=hb.message and hf.part=hb.part) "
+                           "where hf.message>$1 and hf.message<=$2 "
+                           "and hb.message is null and " + moved + " "
+                           "group by hf.message, hf.part "
+                           "returning message, part) "
+                           "delete from header_fields hf "
+                           "using moved, field_names fn "
+                           "where hf.message=moved.message "
+                           "and hf.part=moved.part "
+                           "and hf.field=fn.id and " + moved, this );
+    d->update->bind( 1, d->sofar );
+    d->update->bind( 2, r->getInt( "last" ) );
+    d->sofar = r->getInt( "last" );
+    d->t->enqueue( d->update );
+    d->t->commit();
+}
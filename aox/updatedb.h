@@ -15,6 +15,11 @@ public:
 
 private:
     class UpdateDatabaseData * d;
+
+    void thread();
+    void fillSubjects();
+    void fillThreadLinks();
+    void fillHeaderBlobs();
 };
 
 
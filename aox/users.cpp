@@ -8,6 +8,7 @@
 #include "address.h"
 #include "mailbox.h"
 #include "integerset.h"
+#include "passwordhash.h"
 #include "transaction.h"
 #include "helperrowcreator.h"
 
@@ -158,9 +159,13 @@ void CreateUser::execute()
         database( true );
         Mailbox::setup( this );
 
+        UString secret = PasswordHash::hashed( passwd );
+        if ( secret.isEmpty() )
+            error( "Cannot hash the password using password-hash." );
+
         d->user = new User;
         d->user->setLogin( login );
-        d->user->setSecret( passwd );
+        d->user->setSecret( secret );
         d->user->setAddress( a );
         d->user->refresh( this );
     }
@@ -401,9 +406,13 @@ void ChangePassword::execute()
 
         database( true );
 
+        UString secret = PasswordHash::hashed( passwd );
+        if ( secret.isEmpty() )
+            error( "Cannot hash the password using password-hash." );
+
         User * u = new User;
         u->setLogin( login );
-        u->setSecret( passwd );
+        u->setSecret( secret );
         q = u->changeSecret( this );
         if ( !q->failed() )
             u->execute();
@@ -0,0 +1,266 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+// aoxbench runs a mix of simulated IMAP, LMTP and POP clients against
+// a running server for a while, then reports how many operations of
+// each kind completed and their latency percentiles.
+//
+// The scenarios are:
+//
+//     mobile       login, then IDLE for a while and NOOP, repeatedly
+//     thunderbird  fetch all headers, then flags and some bodies
+//     webmail      SORT, THREAD, FETCH ENVELOPE and SEARCH
+//     lmtp         deliver ten messages per LMTP session
+//     pop          download the first message
+//
+// Each simulated client runs one session at a time, and starts a new
+// session when it's done, so the number of clients of each kind is
+// constant. The mailbox used must not be empty.
+//
+// With -f, aoxbench instead replays sessions captured by recorder(8),
+// keeping the given number of replays running at once.
+
+#include "scope.h"
+#include "event.h"
+#include "timer.h"
+#include "estring.h"
+#include "endpoint.h"
+#include "resolver.h"
+#include "allocator.h"
+#include "eventloop.h"
+#include "estringlist.h"
+#include "benchclient.h"
+#include "replayclient.h"
+
+// fprintf, printf
+#include <stdio.h>
+// exit
+#include <stdlib.h>
+// getopt
+#include <unistd.h>
+// gettimeofday
+#include <sys/time.h>
+
+
+// stops the event loop when the benchmark has run long enough
+
+class Stopper
+    : public EventHandler
+{
+public:
+    Stopper( uint s ) { (void)new Timer( this, s ); }
+
+    void execute() { EventLoop::global()->stop(); }
+};
+
+
+static void usage( const char * error )
+{
+    fprintf( stderr,
+             "Error: %s\n"
+             "Usage: aoxbench -u login -w password [-h host] [-t seconds]\n"
+             "                [-m mix] [-b mailbox] [-r recipient]\n"
+             "                [-s size] [-I idle] [-i port] [-l port] "
+             "[-p port]\n"
+             "       aoxbench -f file [-f file ...] [-c clients] "
+             "[-x speed]\n"
+             "                [-u login -w password] [-h host] "
+             "[-t seconds] [...]\n"
+             "\n"
+             "  -m mix: Comma-separated scenario=clients pairs,\n"
+             "     default mobile=8,thunderbird=4,webmail=2,lmtp=2,pop=1\n"
+             "     Scenarios: mobile, thunderbird, webmail, lmtp, pop\n"
+             "  -t seconds: How long to run, default 60.\n"
+             "  -h host: The server, default 127.0.0.1.\n"
+             "  -i, -l, -p: The IMAP, LMTP and POP ports, "
+             "default 143, 2026, 110.\n"
+             "  -b mailbox: The mailbox used by IMAP clients, "
+             "default INBOX.\n"
+             "  -r recipient: The LMTP recipient, default the login.\n"
+             "  -s size: The size of delivered messages, default 4096.\n"
+             "  -I idle: Seconds mobile clients IDLE, default 10.\n"
+             "  -f file: Replay a session recorded by recorder(8).\n"
+             "  -c clients: How many replays to run at once, "
+             "default one per file.\n"
+             "  -x speed: Replay that many times faster than recorded, "
+             "default 1.\n"
+             "     0 means send as soon as the server has answered.\n",
+             error );
+    exit( 1 );
+}
+
+
+// returns a message of about size bytes, ready to be sent after an
+// LMTP DATA command
+
+static EString message( const EString & from, const EString & to,
+                        uint size )
+{
+    EString m;
+    m.append( "From: <" + from + ">\r\n"
+              "To: <" + to + ">\r\n"
+              "Subject: aoxbench\r\n"
+              "Message-Id: <aoxbench." );
+    m.appendNumber( (uint)getpid() );
+    m.append( "@example.com>\r\n"
+              "\r\n" );
+    uint n = 0;
+    while ( m.length() < size ) {
+        m.append( "This is line " );
+        m.appendNumber( ++n );
+        m.append( " of a message sent by aoxbench, "
+                  "the Archiveopteryx benchmark.\r\n" );
+    }
+    m.append( "." );
+    return m;
+}
+
+
+static uint number( const char * s )
+{
+    bool ok = false;
+    uint n = EString( s ).number( &ok );
+    if ( !ok )
+        usage( ( EString( "Not a number: " ) + s ).cstr() );
+    return n;
+}
+
+
+int main( int argc, char ** argv )
+{
+    Scope global;
+    EventLoop::setup();
+
+    EString host( "127.0.0.1" );
+    EString login;
+    EString password;
+    EString mailbox( "INBOX" );
+    EString recipient;
+    EString mix( "mobile=8,thunderbird=4,webmail=2,lmtp=2,pop=1" );
+    uint seconds = 60;
+    uint size = 4096;
+    uint idle = 10;
+    uint imapPort = 143;
+    uint lmtpPort = 2026;
+    uint popPort = 110;
+    uint files = 0;
+    uint clients = 0;
+
+    int c;
+    while ( (c=getopt( argc, argv, "u:w:h:t:m:b:r:s:I:i:l:p:f:c:x:" )) != -1 ) {
+        switch ( c ) {
+        case 'u':
+            login = optarg;
+            break;
+        case 'w':
+            password = optarg;
+            break;
+        case 'h':
+            host = optarg;
+            break;
+        case 't':
+            seconds = number( optarg );
+            break;
+        case 'm':
+            mix = optarg;
+            break;
+        case 'b':
+            mailbox = optarg;
+            break;
+        case 'r':
+            recipient = optarg;
+            break;
+        case 's':
+            size = number( optarg );
+            break;
+        case 'I':
+            idle = number( optarg );
+            break;
+        case 'i':
+            imapPort = number( optarg );
+            break;
+        case 'l':
+            lmtpPort = number( optarg );
+            break;
+        case 'p':
+            popPort = number( optarg );
+            break;
+        case 'f':
+            if ( !ReplayClient::addRecording( optarg ) )
+                usage( ( EString( "Cannot read session from " ) +
+                         optarg ).cstr() );
+            files++;
+            break;
+        case 'c':
+            clients = number( optarg );
+            break;
+        case 'x':
+            ReplayClient::setSpeed( number( optarg ) );
+            break;
+        default:
+            usage( "Unknown option" );
+            break;
+        }
+    }
+    if ( optind < argc )
+        usage( "Too many arguments" );
+    if ( files ) {
+        if ( login.isEmpty() != password.isEmpty() )
+            usage( "-u and -w must be given together" );
+        if ( !login.isEmpty() )
+            ReplayClient::setLogin( login, password );
+    }
+    else if ( login.isEmpty() || password.isEmpty() ) {
+        usage( "-u and -w must be given" );
+    }
+    if ( recipient.isEmpty() )
+        recipient = login;
+    if ( !seconds )
+        usage( "-t must be positive" );
+
+    EStringList l = Resolver::resolve( host );
+    if ( l.isEmpty() )
+        usage( ( "Cannot resolve " + host + ": " +
+                 Resolver::errors().join( ", " ) ).cstr() );
+    BenchClient::setServer( BenchClient::Imap,
+                            Endpoint( *l.first(), imapPort ) );
+    BenchClient::setServer( BenchClient::Lmtp,
+                            Endpoint( *l.first(), lmtpPort ) );
+    BenchClient::setServer( BenchClient::Pop,
+                            Endpoint( *l.first(), popPort ) );
+
+    BenchClient::setVariable( "user", login );
+    BenchClient::setVariable( "password", password );
+    BenchClient::setVariable( "mailbox", mailbox );
+    BenchClient::setVariable( "recipient", recipient );
+    BenchClient::setVariable( "message", message( login, recipient, size ) );
+    BenchClient::setVariable( "idle", fn( idle ) );
+
+    global.setLog( new Log );
+
+    EStringList * scenarios = EStringList::split( ',', mix );
+    if ( files ) {
+        scenarios = new EStringList;
+        ReplayClient::start( clients ? clients : files );
+    }
+    EStringList::Iterator s( scenarios );
+    while ( s ) {
+        EString name = s->section( "=", 1 ).lower();
+        bool ok = true;
+        uint n = 1;
+        if ( s->contains( '=' ) )
+            n = s->section( "=", 2 ).number( &ok );
+        if ( !ok || !BenchClient::start( name, n ) )
+            usage( ( "Bad scenario: " + *s ).cstr() );
+        ++s;
+    }
+
+    (void)new Stopper( seconds );
+
+    struct timeval start, end;
+    (void)::gettimeofday( &start, 0 );
+    EventLoop::global()->start();
+    (void)::gettimeofday( &end, 0 );
+
+    BenchClient::report( end.tv_sec - start.tv_sec );
+    return 0;
+}
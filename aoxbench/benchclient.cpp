@@ -0,0 +1,652 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "benchclient.h"
+
+#include "dict.h"
+#include "event.h"
+#include "timer.h"
+#include "buffer.h"
+#include "estringlist.h"
+#include "eventloop.h"
+#include "allocator.h"
+
+// printf
+#include <stdio.h>
+// qsort, malloc, realloc
+#include <stdlib.h>
+// gettimeofday
+#include <sys/time.h>
+
+
+// what a step waits for after sending its command
+
+enum Wait {
+    Greeting, // the server's first line or reply
+    Tagged, // the tagged IMAP response to this or the last command
+    Continuation, // an IMAP continuation request
+    IdleDone, // like Tagged, but sent untagged after idling
+    Reply, // a complete SMTP/LMTP reply
+    PopLine, // a one-line POP response
+    PopMulti // a multi-line POP response
+};
+
+
+struct Step {
+    const char * name; // the operation reported, or 0
+    const char * command; // sent after substitution, or 0
+    Wait wait;
+    uint pause; // seconds to wait before sending, see IdleDone
+};
+
+
+struct Scenario {
+    const char * name;
+    BenchClient::Protocol protocol;
+    const Step * setup;
+    const Step * loop;
+    uint iterations;
+    const Step * finish;
+};
+
+
+// a mobile client: it spends most of its time in IDLE
+
+static const Step mobileSetup[] = {
+    { "connect", 0, Greeting, 0 },
+    { "login", "login $user $password", Tagged, 0 },
+    { "select", "select $mailbox", Tagged, 0 },
+    { 0, 0, Greeting, 0 }
+};
+
+static const Step mobileLoop[] = {
+    { "idle", "idle", Continuation, 0 },
+    { "idle-done", "done", IdleDone, 0 },
+    { "noop", "noop", Tagged, 0 },
+    { 0, 0, Greeting, 0 }
+};
+
+
+// a desktop client synchronising a mailbox, Thunderbird-style
+
+static const Step desktopSetup[] = {
+    { "connect", 0, Greeting, 0 },
+    { "capability", "capability", Tagged, 0 },
+    { "login", "login $user $password", Tagged, 0 },
+    { "select", "select $mailbox", Tagged, 0 },
+    { "fetch-headers",
+      "uid fetch 1:* (UID RFC822.SIZE FLAGS BODY.PEEK[HEADER.FIELDS "
+      "(From To Cc Subject Date Message-ID References In-Reply-To "
+      "Content-Type)])",
+      Tagged, 0 },
+    { 0, 0, Greeting, 0 }
+};
+
+static const Step desktopLoop[] = {
+    { "fetch-flags", "uid fetch 1:* (FLAGS)", Tagged, 0 },
+    { "fetch-bodies", "fetch 1:10 (BODY.PEEK[])", Tagged, 0 },
+    { "noop", "noop", Tagged, 2 },
+    { 0, 0, Greeting, 0 }
+};
+
+
+// a webmail backend, which sorts and threads whole mailboxes
+
+static const Step webmailSetup[] = {
+    { "connect", 0, Greeting, 0 },
+    { "login", "login $user $password", Tagged, 0 },
+    { "select", "select $mailbox", Tagged, 0 },
+    { 0, 0, Greeting, 0 }
+};
+
+static const Step webmailLoop[] = {
+    { "sort", "uid sort (reverse arrival) utf-8 all", Tagged, 0 },
+    { "thread", "uid thread references utf-8 all", Tagged, 0 },
+    { "fetch-envelopes", "fetch 1:50 (UID FLAGS ENVELOPE)", Tagged, 0 },
+    { "search", "uid search unseen", Tagged, 0 },
+    { 0, 0, Greeting, 0 }
+};
+
+static const Step imapFinish[] = {
+    { "logout", "logout", Tagged, 0 },
+    { 0, 0, Greeting, 0 }
+};
+
+
+// bulk delivery, several messages per LMTP session
+
+static const Step lmtpSetup[] = {
+    { "connect", 0, Greeting, 0 },
+    { "lhlo", "lhlo aoxbench", Reply, 0 },
+    { 0, 0, Greeting, 0 }
+};
+
+static const Step lmtpLoop[] = {
+    { 0, "mail from:<$user>", Reply, 0 },
+    { 0, "rcpt to:<$recipient>", Reply, 0 },
+    { 0, "data", Reply, 0 },
+    { "deliver", "$message", Reply, 0 },
+    { 0, 0, Greeting, 0 }
+};
+
+static const Step lmtpFinish[] = {
+    { 0, "quit", Reply, 0 },
+    { 0, 0, Greeting, 0 }
+};
+
+
+// a POP client downloading the first message each time
+
+static const Step popSetup[] = {
+    { "connect", 0, Greeting, 0 },
+    { 0, "user $user", PopLine, 0 },
+    { "pop-login", "pass $password", PopLine, 0 },
+    { "stat", "stat", PopLine, 0 },
+    { "list", "list", PopMulti, 0 },
+    { 0, 0, Greeting, 0 }
+};
+
+static const Step popLoop[] = {
+    { "retr", "retr 1", PopMulti, 0 },
+    { 0, 0, Greeting, 0 }
+};
+
+static const Step popFinish[] = {
+    { 0, "quit", PopLine, 0 },
+    { 0, 0, Greeting, 0 }
+};
+
+
+static const Scenario scenarios[] = {
+    { "mobile", BenchClient::Imap,
+      mobileSetup, mobileLoop, 3, imapFinish },
+    { "thunderbird", BenchClient::Imap,
+      desktopSetup, desktopLoop, 5, imapFinish },
+    { "webmail", BenchClient::Imap,
+      webmailSetup, webmailLoop, 5, imapFinish },
+    { "lmtp", BenchClient::Lmtp,
+      lmtpSetup, lmtpLoop, 10, lmtpFinish },
+    { "pop", BenchClient::Pop,
+      popSetup, popLoop, 1, popFinish }
+};
+
+static const uint numScenarios = sizeof( scenarios ) / sizeof( Scenario );
+
+
+// the latency samples for one operation, in microseconds. the samples
+// are not allocated by Allocator, so Operation objects must be
+// reachable from an eternal root until the program exits.
+
+class Operation
+    : public Garbage
+{
+public:
+    Operation( const EString & n )
+        : name( n ), errors( 0 ), count( 0 ), capacity( 0 ),
+          samples( 0 ) {}
+
+    void add( uint usecs, bool ok ) {
+        if ( !ok ) {
+            errors++;
+            return;
+        }
+        if ( count == capacity ) {
+            capacity = capacity ? capacity * 2 : 1024;
+            samples = (uint*)::realloc( samples, capacity * sizeof( uint ) );
+        }
+        samples[count++] = usecs;
+    }
+
+    EString name;
+    uint errors;
+    uint count;
+    uint capacity;
+    uint * samples;
+};
+
+
+static Endpoint * servers[3];
+static Dict<EString> * variables;
+static Dict<Operation> * operations;
+static EStringList * operationOrder;
+static uint sessions;
+static uint tags;
+
+
+static Operation * operation( const EString & name )
+{
+    if ( !operations ) {
+        operations = new Dict<Operation>;
+        Allocator::addEternal( operations, "benchmark operations" );
+        operationOrder = new EStringList;
+        Allocator::addEternal( operationOrder, "benchmark operation order" );
+    }
+    Operation * o = operations->find( name );
+    if ( !o ) {
+        o = new Operation( name );
+        operations->insert( name, o );
+        operationOrder->append( name );
+    }
+    return o;
+}
+
+
+static uint usecsSince( const struct timeval & t )
+{
+    struct timeval now;
+    (void)::gettimeofday( &now, 0 );
+    long r = ( now.tv_sec - t.tv_sec ) * 1000000 +
+             ( now.tv_usec - t.tv_usec );
+    if ( r < 0 )
+        return 0;
+    return (uint)r;
+}
+
+
+// starts a new client for a scenario a second from now
+
+class Restarter
+    : public EventHandler
+{
+public:
+    Restarter( uint s ): scenario( s ) { (void)new Timer( this, 1 ); }
+
+    void execute() { (void)new BenchClient( scenario ); }
+
+    uint scenario;
+};
+
+
+class BenchClientData
+    : public Garbage
+{
+public:
+    BenchClientData()
+        : scenario( 0 ), index( 0 ), steps( 0 ), step( 0 ), iteration( 0 ),
+          sent( false ), multiLine( false ), literal( 0 ), done( false )
+    {
+        started.tv_sec = 0;
+        started.tv_usec = 0;
+    }
+
+    const Scenario * scenario;
+    uint index;
+    const Step * steps;
+    uint step;
+    uint iteration;
+    EString tag;
+    struct timeval started;
+    bool sent;
+    bool multiLine;
+    uint literal;
+    bool done;
+};
+
+
+/*! \class BenchClient benchclient.h
+    The BenchClient class is one simulated client for aoxbench.
+
+    Each BenchClient runs one session of a scenario: It connects,
+    sends a fixed sequence of commands (the setup, then the loop
+    a number of times, then the finish), and waits for each
+    response before sending the next command. The time from sending
+    each command to receiving its complete response is recorded for
+    the operation named in the scenario. When the session ends, a new
+    BenchClient is started for the same scenario, so the number of
+    clients of each kind stays constant.
+
+    start() starts clients, setServer() and setVariable() configure
+    them, and report() prints the results.
+*/
+
+
+/*! Constructs a client for scenario number \a scenario and connects
+    it to the right server.
+*/
+
+BenchClient::BenchClient( uint scenario )
+    : Connection(), d( new BenchClientData )
+{
+    d->scenario = &scenarios[scenario];
+    d->index = scenario;
+    d->steps = d->scenario->setup;
+    (void)::gettimeofday( &d->started, 0 );
+    d->sent = true;
+    if ( connect( *servers[d->scenario->protocol] ) < 0 ) {
+        operation( "connect" )->add( 0, false );
+        restart( false );
+        return;
+    }
+    EventLoop::global()->addConnection( this );
+}
+
+
+void BenchClient::react( Event e )
+{
+    switch ( e ) {
+    case Read:
+        parse();
+        break;
+
+    case Timeout:
+        if ( !d->sent )
+            send();
+        break;
+
+    case Connect:
+        break;
+
+    case Error:
+    case Close:
+        if ( !d->done ) {
+            Step s = d->steps[d->step];
+            operation( s.name ? s.name : "disconnect" )->add( 0, false );
+            restart( false );
+        }
+        break;
+
+    case Shutdown:
+        break;
+    }
+}
+
+
+/*! Parses whatever the server has sent, finishing steps as their
+    responses are complete.
+*/
+
+void BenchClient::parse()
+{
+    Buffer * r = readBuffer();
+    while ( !d->done && r->size() ) {
+        if ( d->literal ) {
+            uint n = d->literal;
+            if ( n > r->size() )
+                n = r->size();
+            r->remove( n );
+            d->literal -= n;
+        }
+        else {
+            EString * l = r->removeLine();
+            if ( !l )
+                return;
+            parseLine( *l );
+        }
+    }
+}
+
+
+/*! Looks at the response line \a l and decides whether the current
+    step is finished.
+*/
+
+void BenchClient::parseLine( const EString & l )
+{
+    if ( !d->sent )
+        return;
+
+    Protocol p = d->scenario->protocol;
+    Wait w = d->steps[d->step].wait;
+
+    if ( p == Imap && l.endsWith( "}" ) ) {
+        int b = l.length() - 1;
+        while ( b >= 0 && l[b] != '{' )
+            b--;
+        bool ok = false;
+        uint n = 0;
+        if ( b >= 0 )
+            n = l.mid( b + 1, l.length() - b - 2 ).number( &ok );
+        if ( ok )
+            d->literal = n;
+    }
+
+    if ( p == Imap ) {
+        if ( w == Greeting ) {
+            finishStep( l.startsWith( "* OK" ) );
+        }
+        else if ( w == Continuation && l.startsWith( "+" ) ) {
+            finishStep( true );
+        }
+        else if ( l.startsWith( d->tag + " " ) ) {
+            EString r = l.mid( d->tag.length() + 1, 2 ).upper();
+            finishStep( ( w == Tagged || w == IdleDone ) && r == "OK" );
+        }
+    }
+    else if ( p == Lmtp ) {
+        if ( l.length() >= 4 && l[3] == ' ' )
+            finishStep( l[0] == '2' || l[0] == '3' );
+    }
+    else if ( w == PopMulti && d->multiLine ) {
+        if ( l == "." )
+            finishStep( true );
+    }
+    else if ( l.startsWith( "+OK" ) ) {
+        if ( w == PopMulti )
+            d->multiLine = true;
+        else
+            finishStep( true );
+    }
+    else {
+        finishStep( false );
+    }
+}
+
+
+/*! Records the result of the current step, success if \a ok is
+    true, and moves on to the next step.
+*/
+
+void BenchClient::finishStep( bool ok )
+{
+    const Step & s = d->steps[d->step];
+    if ( s.name )
+        operation( s.name )->add( usecsSince( d->started ), ok );
+    d->sent = false;
+    d->multiLine = false;
+    advance();
+}
+
+
+/*! Moves to the next step, and either sends its command or waits
+    for the pause it asks for. Starts a new session after the last
+    step.
+*/
+
+void BenchClient::advance()
+{
+    d->step++;
+    if ( !d->steps[d->step].name && !d->steps[d->step].command ) {
+        d->step = 0;
+        if ( d->steps == d->scenario->setup ) {
+            d->steps = d->scenario->loop;
+        }
+        else if ( d->steps == d->scenario->loop &&
+                  ++d->iteration < d->scenario->iterations ) {
+            // run the loop again
+        }
+        else if ( d->steps == d->scenario->loop ) {
+            d->steps = d->scenario->finish;
+        }
+        else {
+            sessions++;
+            restart( true );
+            return;
+        }
+    }
+
+    uint pause = d->steps[d->step].pause;
+    if ( d->steps[d->step].wait == IdleDone )
+        pause = variables->find( "idle" )->number( 0 );
+    if ( pause )
+        setTimeoutAfter( pause );
+    else
+        send();
+}
+
+
+/*! Sends the current step's command, after substituting variables. */
+
+void BenchClient::send()
+{
+    const Step & s = d->steps[d->step];
+    EString c;
+    const char * p = s.command;
+    while ( p && *p ) {
+        if ( *p == '$' ) {
+            const char * e = p + 1;
+            while ( *e >= 'a' && *e <= 'z' )
+                e++;
+            EString * v = variables->find( EString( p + 1, e - p - 1 ) );
+            if ( v )
+                c.append( *v );
+            p = e;
+        }
+        else {
+            c.append( *p );
+            p++;
+        }
+    }
+
+    if ( d->scenario->protocol == Imap && s.wait != IdleDone ) {
+        d->tag = "a" + fn( ++tags );
+        c = d->tag + " " + c;
+    }
+    enqueue( c + "\r\n" );
+    (void)::gettimeofday( &d->started, 0 );
+    d->sent = true;
+}
+
+
+/*! Ends this session and starts another for the same scenario,
+    immediately if \a ok is true and after a second if not.
+*/
+
+void BenchClient::restart( bool ok )
+{
+    d->done = true;
+    close();
+    if ( ok )
+        (void)new BenchClient( d->index );
+    else
+        (void)new Restarter( d->index );
+}
+
+
+/*! Starts \a count clients running the scenario called \a name.
+    Returns false if there is no such scenario, true otherwise.
+*/
+
+bool BenchClient::start( const EString & name, uint count )
+{
+    uint i = 0;
+    while ( i < numScenarios && name != scenarios[i].name )
+        i++;
+    if ( i >= numScenarios )
+        return false;
+    while ( count ) {
+        (void)new BenchClient( i );
+        count--;
+    }
+    return true;
+}
+
+
+/*! Records that scenarios using protocol \a p connect to \a e. */
+
+void BenchClient::setServer( Protocol p, const Endpoint & e )
+{
+    servers[p] = new Endpoint( e );
+    Allocator::addEternal( servers[p], "benchmark server" );
+}
+
+
+/*! Returns the server to which \a p clients connect. */
+
+Endpoint BenchClient::server( Protocol p )
+{
+    if ( !servers[p] )
+        return Endpoint();
+    return *servers[p];
+}
+
+
+/*! Records that \a value is to be substituted for $\a name in
+    commands. The variables used are user, password, mailbox,
+    recipient and message (the complete message body including the
+    terminating dot), and idle is the number of seconds mobile
+    clients stay in IDLE.
+*/
+
+void BenchClient::setVariable( const EString & name, const EString & value )
+{
+    if ( !variables ) {
+        variables = new Dict<EString>;
+        Allocator::addEternal( variables, "benchmark variables" );
+    }
+    variables->insert( name, new EString( value ) );
+}
+
+
+/*! Records that one \a operation took \a usecs microseconds, and
+    succeeded if \a ok is true. report() shows all the operations.
+*/
+
+void BenchClient::record( const EString & operation, uint usecs, bool ok )
+{
+    ::operation( operation )->add( usecs, ok );
+}
+
+
+/*! Records that a session has been completed. */
+
+void BenchClient::sessionDone()
+{
+    sessions++;
+}
+
+
+static int compare( const void * a, const void * b )
+{
+    uint x = *(const uint *)a;
+    uint y = *(const uint *)b;
+    if ( x < y )
+        return -1;
+    if ( x > y )
+        return 1;
+    return 0;
+}
+
+
+static double percentile( const Operation * o, uint p )
+{
+    if ( !o->count )
+        return 0;
+    uint i = ( o->count - 1 ) * p / 100;
+    return o->samples[i] / 1000.0;
+}
+
+
+/*! Prints the throughput and latency percentiles of each operation,
+    given that the benchmark ran for \a seconds.
+*/
+
+void BenchClient::report( uint seconds )
+{
+    if ( !seconds )
+        seconds = 1;
+    printf( "%-16s %8s %7s %9s %9s %9s %9s %9s\n",
+            "operation", "count", "errors", "per sec",
+            "p50 ms", "p90 ms", "p99 ms", "max ms" );
+    EStringList::Iterator i( operationOrder );
+    while ( i ) {
+        Operation * o = operations->find( *i );
+        ++i;
+        if ( o->count )
+            ::qsort( o->samples, o->count, sizeof( uint ), compare );
+        printf( "%-16s %8u %7u %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                o->name.cstr(), o->count, o->errors,
+                (double)o->count / seconds,
+                percentile( o, 50 ), percentile( o, 90 ),
+                percentile( o, 99 ), percentile( o, 100 ) );
+    }
+    printf( "%u sessions completed\n", sessions );
+}
@@ -0,0 +1,39 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef BENCHCLIENT_H
+#define BENCHCLIENT_H
+
+#include "connection.h"
+
+
+class BenchClient
+    : public Connection
+{
+public:
+    enum Protocol { Imap, Lmtp, Pop };
+
+    BenchClient( uint );
+
+    void react( Event );
+
+    static bool start( const EString &, uint );
+    static void setServer( Protocol, const Endpoint & );
+    static Endpoint server( Protocol );
+    static void setVariable( const EString &, const EString & );
+    static void record( const EString &, uint, bool );
+    static void sessionDone();
+    static void report( uint );
+
+private:
+    class BenchClientData * d;
+
+    void parse();
+    void parseLine( const EString & );
+    void finishStep( bool );
+    void advance();
+    void send();
+    void restart( bool );
+};
+
+
+#endif
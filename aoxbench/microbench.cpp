@@ -0,0 +1,635 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+// microbench times the core data structures and parsers on fixed
+// inputs, and reports nanoseconds and allocations per operation, so
+// that proposed optimisations can be compared before and after.
+//
+// Each benchmark is run with a doubling number of iterations until a
+// run takes long enough to time reliably, then that many iterations
+// are run several times. The fastest run is reported. The garbage
+// collector runs between runs, never during one.
+//
+// Messages given with -f (e.g. output from "aox anonymise") are used
+// as the corpus for the message, address and date benchmarks. A
+// small built-in message is used if none are given.
+
+#include "map.h"
+#include "dict.h"
+#include "date.h"
+#include "file.h"
+#include "list.h"
+#include "scope.h"
+#include "codec.h"
+#include "buffer.h"
+#include "vector.h"
+#include "estring.h"
+#include "ustring.h"
+#include "message.h"
+#include "address.h"
+#include "allocator.h"
+#include "integerset.h"
+#include "imapparser.h"
+#include "estringlist.h"
+
+// fprintf, printf
+#include <stdio.h>
+// exit
+#include <stdlib.h>
+// getopt
+#include <unistd.h>
+// clock_gettime
+#include <time.h>
+
+
+// the inputs, kept in one eternal object so the collector leaves
+// them alone
+
+class Inputs
+    : public Garbage
+{
+public:
+    Inputs(): codec( 0 ) {}
+
+    EStringList corpus;
+    EStringList addresses;
+    EStringList dates;
+    EStringList keys;
+    EString text;
+    EString latin1;
+    EString utf8;
+    EString base64;
+    EString qp;
+    EString lines;
+    EString imap;
+    Codec * codec;
+};
+
+
+static Inputs * in;
+static uint sink;
+
+
+static const char * builtin =
+    "Return-Path: <arnt@example.com>\r\n"
+    "Received: from mail.example.com (mail.example.com [192.0.2.17])\r\n"
+    " by mx.example.org with ESMTP id 1A2B3C4D\r\n"
+    " for <info@example.org>; Tue, 10 Mar 2009 14:03:17 +0100\r\n"
+    "From: Arnt Gulbrandsen <arnt@example.com>\r\n"
+    "To: \"Info, Example\" <info@example.org>, abhijit@example.org\r\n"
+    "Cc: =?iso-8859-1?q?Bj=F8rn_Ove?= <bo@example.net>\r\n"
+    "Subject: =?utf-8?q?R=C3=A6kker_og_tall?= and the rest\r\n"
+    "Date: Tue, 10 Mar 2009 14:03:12 +0100\r\n"
+    "Message-Id: <20090310130312.1234@mail.example.com>\r\n"
+    "References: <a1@example.com> <b2@example.com> <c3@example.com>\r\n"
+    "MIME-Version: 1.0\r\n"
+    "Content-Type: multipart/mixed; boundary=\"b1\"\r\n"
+    "\r\n"
+    "--b1\r\n"
+    "Content-Type: text/plain; charset=iso-8859-1\r\n"
+    "Content-Transfer-Encoding: quoted-printable\r\n"
+    "\r\n"
+    "Hei, dette er en pr=F8ve p=E5 en melding med litt tekst i.\r\n"
+    "Den har flere linjer, og noen av dem er ganske lange, slik at=\r\n"
+    " quoted-printable m=E5 brukes for =E5 bryte dem.\r\n"
+    "\r\n"
+    "--b1\r\n"
+    "Content-Type: application/octet-stream; name=\"data.bin\"\r\n"
+    "Content-Transfer-Encoding: base64\r\n"
+    "\r\n"
+    "AAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8gISIjJCUmJygpKissLS4v\r\n"
+    "MDEyMzQ1Njc4OTo7PD0+P0BBQkNERUZHSElKS0xNTk9QUVJTVFVWV1hZWltcXV5f\r\n"
+    "\r\n"
+    "--b1--\r\n";
+
+
+static EString header( const EString & message, const char * field )
+{
+    EStringList * l = EStringList::split( '\n', message );
+    EStringList::Iterator i( l );
+    EString f = EString( field ).lower() + ":";
+    while ( i && !i->stripCRLF().isEmpty() ) {
+        if ( i->lower().startsWith( f ) )
+            return i->mid( f.length() ).stripCRLF().simplified();
+        ++i;
+    }
+    return "";
+}
+
+
+static void setupInputs( const EStringList & files )
+{
+    in = new Inputs;
+    Allocator::addEternal( in, "microbench inputs" );
+
+    EStringList::Iterator f( files );
+    while ( f ) {
+        File m( *f );
+        if ( !m.valid() ) {
+            fprintf( stderr, "Cannot read %s\n", f->cstr() );
+            exit( 1 );
+        }
+        in->corpus.append( m.contents() );
+        ++f;
+    }
+    if ( in->corpus.isEmpty() )
+        in->corpus.append( builtin );
+
+    EStringList::Iterator m( in->corpus );
+    while ( m ) {
+        EString a = header( *m, "From" );
+        if ( !a.isEmpty() )
+            in->addresses.append( a );
+        a = header( *m, "To" );
+        if ( !a.isEmpty() )
+            in->addresses.append( a );
+        a = header( *m, "Date" );
+        if ( !a.isEmpty() )
+            in->dates.append( a );
+        ++m;
+    }
+    if ( in->addresses.isEmpty() )
+        in->addresses.append( "Arnt Gulbrandsen <arnt@example.com>" );
+    if ( in->dates.isEmpty() )
+        in->dates.append( "Tue, 10 Mar 2009 14:03:12 +0100" );
+
+    uint i = 0;
+    while ( i < 256 ) {
+        in->keys.append( "mailbox/" + fn( i * 7919 ) + "/key" );
+        i++;
+    }
+
+    in->text = "  The Quick  Brown Fox\tJumps Over\r\n the Lazy Dog, "
+               "while the dog, being lazy, does not jump at all.  ";
+    in->latin1 = "Bl\345b\346rsyltet\370y med fl\370te, "
+                 "og en r\346kke \345pne sp\370rsm\345l.";
+    in->codec = Codec::byName( "iso-8859-1" );
+    in->utf8 = in->codec->toUnicode( in->latin1 ).utf8();
+    in->base64 = EString( builtin ).e64( 76 );
+    in->qp = EString( builtin ).eQP();
+    i = 0;
+    while ( i < 100 ) {
+        in->lines.append( "* " + fn( i + 1 ) + " FETCH (UID " +
+                          fn( i + 1000 ) + " FLAGS (\\Seen))\r\n" );
+        i++;
+    }
+    in->imap = "a0042 LOGIN \"arnt@example.com\" {8}\r\nsecret77";
+}
+
+
+// the benchmarks. each does its operation n times.
+
+static void estringAppend( uint n )
+{
+    while ( n-- ) {
+        EString s;
+        uint i = 0;
+        while ( i < 16 ) {
+            s.append( "abcdefgh" );
+            i++;
+        }
+        sink += s.length();
+    }
+}
+
+
+static void estringNumber( uint n )
+{
+    while ( n-- ) {
+        EString s = fn( n );
+        sink += s.number( 0 );
+    }
+}
+
+
+static void estringLower( uint n )
+{
+    while ( n-- )
+        sink += in->text.lower().length();
+}
+
+
+static void estringSimplified( uint n )
+{
+    while ( n-- )
+        sink += in->text.simplified().length();
+}
+
+
+static void estringSection( uint n )
+{
+    while ( n-- )
+        sink += in->text.section( " ", 7 ).length();
+}
+
+
+static void base64Decode( uint n )
+{
+    while ( n-- )
+        sink += in->base64.de64().length();
+}
+
+
+static void qpDecode( uint n )
+{
+    while ( n-- )
+        sink += in->qp.deQP().length();
+}
+
+
+static void codecToUnicode( uint n )
+{
+    while ( n-- )
+        sink += in->codec->toUnicode( in->latin1 ).length();
+}
+
+
+static void ustringUtf8( uint n )
+{
+    Codec * c = Codec::byName( "utf-8" );
+    while ( n-- )
+        sink += c->toUnicode( in->utf8 ).utf8().length();
+}
+
+
+static void integerSetAdd( uint n )
+{
+    while ( n-- ) {
+        IntegerSet s;
+        uint i = 0;
+        while ( i < 1000 ) {
+            s.add( i * 3 + ( i % 7 ) );
+            i++;
+        }
+        sink += s.count();
+    }
+}
+
+
+static void integerSetContains( uint n )
+{
+    static IntegerSet * s;
+    if ( !s ) {
+        s = new IntegerSet;
+        Allocator::addEternal( s, "microbench integer set" );
+        uint i = 0;
+        while ( i < 10000 ) {
+            s->add( i * 3, i * 3 + 1 );
+            i++;
+        }
+    }
+    while ( n-- )
+        sink += s->contains( n % 30000 );
+}
+
+
+static void integerSetString( uint n )
+{
+    static IntegerSet * s;
+    if ( !s ) {
+        s = new IntegerSet;
+        Allocator::addEternal( s, "microbench integer set" );
+        uint i = 0;
+        while ( i < 1000 ) {
+            s->add( i * 5, i * 5 + ( i % 3 ) );
+            i++;
+        }
+    }
+    while ( n-- )
+        sink += s->set().length();
+}
+
+
+static void dictInsertFind( uint n )
+{
+    while ( n-- ) {
+        Dict<EString> d;
+        EStringList::Iterator k( in->keys );
+        while ( k ) {
+            d.insert( *k, k );
+            ++k;
+        }
+        k = in->keys.first();
+        while ( k ) {
+            if ( d.find( *k ) )
+                sink++;
+            ++k;
+        }
+    }
+}
+
+
+static void mapInsertFind( uint n )
+{
+    while ( n-- ) {
+        Map<EString> m;
+        uint i = 0;
+        while ( i < 256 ) {
+            m.insert( i * 7919, &in->text );
+            i++;
+        }
+        i = 0;
+        while ( i < 256 ) {
+            if ( m.find( i * 7919 ) )
+                sink++;
+            i++;
+        }
+    }
+}
+
+
+static void listAppendIterate( uint n )
+{
+    while ( n-- ) {
+        List<EString> l;
+        uint i = 0;
+        while ( i < 100 ) {
+            l.append( &in->text );
+            i++;
+        }
+        List<EString>::Iterator it( l );
+        while ( it ) {
+            sink += it->length();
+            ++it;
+        }
+    }
+}
+
+
+static void vectorAppendIterate( uint n )
+{
+    while ( n-- ) {
+        Vector<EString> v;
+        uint i = 0;
+        while ( i < 100 ) {
+            v.append( &in->text );
+            i++;
+        }
+        Vector<EString>::Iterator it( v );
+        while ( it ) {
+            sink += it->length();
+            ++it;
+        }
+    }
+}
+
+
+// append ten, shift ten, a hundred times: the pattern of Query's
+// rows and IMAP's responses
+
+static void listQueue( uint n )
+{
+    while ( n-- ) {
+        List<EString> l;
+        uint i = 0;
+        while ( i < 1000 ) {
+            l.append( &in->text );
+            if ( i % 10 == 9 )
+                while ( !l.isEmpty() )
+                    sink += l.shift()->length();
+            i++;
+        }
+    }
+}
+
+
+static void vectorQueue( uint n )
+{
+    while ( n-- ) {
+        Vector<EString> v;
+        uint i = 0;
+        while ( i < 1000 ) {
+            v.append( &in->text );
+            if ( i % 10 == 9 )
+                while ( !v.isEmpty() )
+                    sink += v.shift()->length();
+            i++;
+        }
+    }
+}
+
+
+static void bufferLines( uint n )
+{
+    while ( n-- ) {
+        Buffer b;
+        b.append( in->lines );
+        EString * l;
+        while ( (l=b.removeLine()) != 0 )
+            sink += l->length();
+    }
+}
+
+
+static void imapParser( uint n )
+{
+    while ( n-- ) {
+        ImapParser p( in->imap );
+        sink += p.tag().length();
+        p.require( " " );
+        sink += p.command().length();
+        p.require( " " );
+        sink += p.astring().length();
+        p.require( " " );
+        sink += p.astring().length();
+        p.end();
+        sink += p.ok();
+    }
+}
+
+
+static void addressParser( uint n )
+{
+    EStringList::Iterator a( in->addresses );
+    while ( n-- ) {
+        if ( !a )
+            a = in->addresses.first();
+        AddressParser p( *a );
+        sink += p.addresses()->count();
+        ++a;
+    }
+}
+
+
+static void dateParser( uint n )
+{
+    EStringList::Iterator s( in->dates );
+    while ( n-- ) {
+        if ( !s )
+            s = in->dates.first();
+        Date d;
+        d.setRfc822( *s );
+        sink += d.unixTime();
+        ++s;
+    }
+}
+
+
+static void messageParse( uint n )
+{
+    EStringList::Iterator m( in->corpus );
+    while ( n-- ) {
+        if ( !m )
+            m = in->corpus.first();
+        Message x;
+        x.parse( *m );
+        sink += x.valid();
+        ++m;
+    }
+}
+
+
+static const struct {
+    const char * name;
+    void (*run)( uint );
+} benchmarks[] = {
+    { "estring-append", estringAppend },
+    { "estring-number", estringNumber },
+    { "estring-lower", estringLower },
+    { "estring-simplified", estringSimplified },
+    { "estring-section", estringSection },
+    { "base64-decode", base64Decode },
+    { "qp-decode", qpDecode },
+    { "codec-latin1", codecToUnicode },
+    { "ustring-utf8", ustringUtf8 },
+    { "integerset-add", integerSetAdd },
+    { "integerset-contains", integerSetContains },
+    { "integerset-set", integerSetString },
+    { "dict-256", dictInsertFind },
+    { "map-256", mapInsertFind },
+    { "list-100", listAppendIterate },
+    { "vector-100", vectorAppendIterate },
+    { "list-queue", listQueue },
+    { "vector-queue", vectorQueue },
+    { "buffer-lines", bufferLines },
+    { "imapparser-login", imapParser },
+    { "addressparser", addressParser },
+    { "date-rfc822", dateParser },
+    { "message-parse", messageParse },
+};
+static const uint numBenchmarks =
+    sizeof( benchmarks ) / sizeof( benchmarks[0] );
+
+
+static double now()
+{
+    struct timespec t;
+    (void)::clock_gettime( CLOCK_MONOTONIC, &t );
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+
+// runs b n times after collecting garbage, and returns the time taken
+// in ns. allocations is set to the number of objects allocated.
+
+static double run( uint b, uint n, uint * allocations )
+{
+    Allocator::free();
+    while ( Allocator::sweepIncrementally() )
+        ;
+    uint a = Allocator::allocations();
+    double start = now();
+    benchmarks[b].run( n );
+    double ns = now() - start;
+    *allocations = Allocator::allocations() - a;
+    return ns;
+}
+
+
+static void usage( const char * error )
+{
+    fprintf( stderr,
+             "Error: %s\n"
+             "Usage: microbench [-f message ...] [-t ms] [-r runs] "
+             "[benchmark ...]\n"
+             "\n"
+             "  -f message: Use the message in this file as corpus.\n"
+             "  -t ms: Minimum time per run, default 100.\n"
+             "  -r runs: Number of timed runs, default 5.\n"
+             "  -l: List the benchmarks.\n"
+             "  benchmark: Run only the benchmarks whose names start "
+             "with this.\n",
+             error );
+    exit( 1 );
+}
+
+
+int main( int argc, char ** argv )
+{
+    Scope global;
+
+    uint ms = 100;
+    uint runs = 5;
+    EStringList files;
+
+    int c;
+    while ( (c=getopt( argc, argv, "f:t:r:l" )) != -1 ) {
+        switch ( c ) {
+        case 'f':
+            files.append( optarg );
+            break;
+        case 't':
+            ms = EString( optarg ).number( 0 );
+            break;
+        case 'r':
+            runs = EString( optarg ).number( 0 );
+            break;
+        case 'l':
+            c = 0;
+            while ( c < (int)numBenchmarks )
+                printf( "%s\n", benchmarks[c++].name );
+            exit( 0 );
+            break;
+        default:
+            usage( "Unknown option" );
+            break;
+        }
+    }
+    if ( !ms || !runs )
+        usage( "-t and -r must be positive" );
+
+    setupInputs( files );
+
+    printf( "%-20s %10s %10s %10s\n",
+            "benchmark", "iterations", "ns/op", "allocs/op" );
+
+    uint b = 0;
+    while ( b < numBenchmarks ) {
+        bool wanted = optind >= argc;
+        int i = optind;
+        while ( !wanted && i < argc )
+            if ( EString( benchmarks[b].name ).startsWith( argv[i++] ) )
+                wanted = true;
+        if ( !wanted ) {
+            b++;
+            continue;
+        }
+
+        // find an iteration count which takes at least ms, without
+        // letting a run allocate too many objects
+        uint allocations = 0;
+        uint n = 1;
+        double ns = run( b, n, &allocations );
+        while ( ns < ms * 1e6 && allocations < 1 << 20 && n < 1 << 30 ) {
+            n *= 2;
+            ns = run( b, n, &allocations );
+        }
+
+        double best = ns;
+        uint r = 1;
+        while ( r < runs ) {
+            ns = run( b, n, &allocations );
+            if ( ns < best )
+                best = ns;
+            r++;
+        }
+
+        printf( "%-20s %10u %10.1f %10.1f\n",
+                benchmarks[b].name, n, best / n,
+                (double)allocations / n );
+        b++;
+    }
+
+    if ( sink == 42 )
+        printf( "\n" );
+    return 0;
+}
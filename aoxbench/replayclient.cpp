@@ -0,0 +1,691 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "replayclient.h"
+
+#include "map.h"
+#include "file.h"
+#include "list.h"
+#include "event.h"
+#include "timer.h"
+#include "buffer.h"
+#include "estringlist.h"
+#include "eventloop.h"
+#include "allocator.h"
+#include "benchclient.h"
+
+// gettimeofday
+#include <sys/time.h>
+
+
+// one "send" or "receive" block in a recorder file
+
+class Block
+    : public Garbage
+{
+public:
+    Block(): send( false ), ms( 0 ), continuations( 0 ), replies( 0 ) {}
+
+    bool send;
+    uint ms;
+    EStringList lines;
+
+    // for send blocks: one operation name per line (empty for lines
+    // that aren't commands, e.g. literals), and the state the
+    // recorded client waited for before sending this block
+    EStringList names;
+    EStringList allowed;
+    uint continuations;
+    uint replies;
+};
+
+
+class Recording
+    : public Garbage
+{
+public:
+    Recording(): protocol( BenchClient::Imap ) {}
+
+    EString name;
+    BenchClient::Protocol protocol;
+    List<Block> blocks;
+
+    void analyse();
+};
+
+
+// a command sent by a ReplayClient, waiting for its response
+
+class Pending
+    : public Garbage
+{
+public:
+    Pending( const EString & t, const EString & n )
+        : tag( t ), name( n ) {
+        (void)::gettimeofday( &sent, 0 );
+    }
+
+    EString tag;
+    EString name;
+    struct timeval sent;
+};
+
+
+static List<Recording> * recordings;
+static uint nextRecording;
+static uint speed = 1;
+static EString * login;
+static EString * secret;
+
+
+static uint usecsSince( const struct timeval & t )
+{
+    struct timeval now;
+    (void)::gettimeofday( &now, 0 );
+    long r = ( now.tv_sec - t.tv_sec ) * 1000000 +
+             ( now.tv_usec - t.tv_usec );
+    if ( r < 0 )
+        return 0;
+    return (uint)r;
+}
+
+
+// returns the size of the literal announced at the end of l, or 0
+
+static uint literalSize( const EString & l )
+{
+    if ( !l.endsWith( "}" ) )
+        return 0;
+    int b = l.length() - 1;
+    while ( b >= 0 && l[b] != '{' )
+        b--;
+    if ( b < 0 )
+        return 0;
+    EString n = l.mid( b + 1, l.length() - b - 2 );
+    if ( n.endsWith( "+" ) )
+        n = n.mid( 0, n.length() - 1 );
+    bool ok = false;
+    uint r = n.number( &ok );
+    if ( !ok )
+        return 0;
+    return r;
+}
+
+
+// returns true if l completes a non-IMAP response
+
+static bool isReply( BenchClient::Protocol p, const EString & l )
+{
+    if ( p == BenchClient::Pop )
+        return l.startsWith( "+OK" ) || l.startsWith( "-ERR" ) ||
+            l.startsWith( "+ " );
+    return l.length() >= 4 && l[0] >= '2' && l[0] <= '5' && l[3] == ' ';
+}
+
+
+// returns the operation name for the IMAP command l, or an empty
+// string if l doesn't look like a command
+
+static EString imapName( const EString & l )
+{
+    EString c = l.section( " ", 2 ).lower();
+    if ( c.isEmpty() || l.section( " ", 1 ).lower() == "done" )
+        return "";
+    if ( c == "uid" )
+        c = "uid " + l.section( " ", 3 ).lower();
+    return c;
+}
+
+
+// records the UID in l, if l is a FETCH response which has one
+
+static void learnUid( const EString & l, Map<uint> * uids, Map<uint> * msns )
+{
+    if ( !l.startsWith( "* " ) || l.section( " ", 3 ).upper() != "FETCH" )
+        return;
+    bool ok = false;
+    uint msn = l.section( " ", 2 ).number( &ok );
+    if ( !ok )
+        return;
+    int i = l.upper().find( "UID " );
+    if ( i < 0 )
+        return;
+    uint e = i + 4;
+    while ( e < l.length() && l[e] >= '0' && l[e] <= '9' )
+        e++;
+    uint uid = l.mid( i + 4, e - i - 4 ).number( &ok );
+    if ( !ok )
+        return;
+    uids->insert( msn, new uint( uid ) );
+    if ( msns )
+        msns->insert( uid, new uint( msn ) );
+}
+
+
+/*! Works out, for each block the client sent, which operations it
+    contains and what the client had seen before sending it.
+*/
+
+void Recording::analyse()
+{
+    EStringList outstanding;
+    uint plus = 0;
+    uint replies = 0;
+    uint sendLiteral = 0;
+    uint receiveLiteral = 0;
+    bool data = false;
+
+    List<Block>::Iterator b( blocks );
+    while ( b ) {
+        EStringList::Iterator l( b->lines );
+        if ( b->send ) {
+            EStringList::Iterator o( outstanding );
+            while ( o ) {
+                b->allowed.append( *o );
+                ++o;
+            }
+            b->continuations = plus;
+            b->replies = replies;
+        }
+        while ( l ) {
+            EString n;
+            uint * literal = b->send ? &sendLiteral : &receiveLiteral;
+            if ( *literal ) {
+                uint s = l->length() + 2;
+                *literal = s > *literal ? 0 : *literal - s;
+            }
+            else if ( b->send && protocol == BenchClient::Imap ) {
+                n = imapName( *l );
+                if ( !n.isEmpty() )
+                    outstanding.append( l->section( " ", 1 ) );
+            }
+            else if ( b->send && data ) {
+                if ( *l == "." ) {
+                    n = "message";
+                    data = false;
+                }
+            }
+            else if ( b->send ) {
+                n = l->section( " ", 1 ).lower();
+                if ( n == "data" && protocol == BenchClient::Lmtp )
+                    data = true;
+            }
+            else if ( protocol == BenchClient::Imap ) {
+                if ( l->startsWith( "+" ) ) {
+                    plus++;
+                }
+                else if ( !l->startsWith( "*" ) ) {
+                    EString r = l->section( " ", 2 ).upper();
+                    EString tag = l->section( " ", 1 );
+                    EStringList::Iterator o( outstanding );
+                    while ( o && *o != tag )
+                        ++o;
+                    if ( o && ( r == "OK" || r == "NO" || r == "BAD" ) )
+                        outstanding.take( o );
+                }
+            }
+            else if ( isReply( protocol, *l ) ) {
+                replies++;
+            }
+            if ( protocol == BenchClient::Imap && !*literal )
+                *literal = literalSize( *l );
+            if ( b->send )
+                b->names.append( n );
+            ++l;
+        }
+        ++b;
+    }
+}
+
+
+// starts a new client a second from now
+
+class Restarter
+    : public EventHandler
+{
+public:
+    Restarter() { (void)new Timer( this, 1 ); }
+
+    void execute() { ReplayClient::start( 1 ); }
+};
+
+
+class ReplayClientData
+    : public Garbage
+{
+public:
+    ReplayClientData()
+        : recording( 0 ), plus( 0 ), replies( 0 ), literal( 0 ),
+          pausing( false ), done( false )
+    {
+        (void)::gettimeofday( &started, 0 );
+    }
+
+    Recording * recording;
+    List<Block>::Iterator next;
+    List<Pending> outstanding;
+    uint plus;
+    uint replies;
+    uint literal;
+    Map<uint> recordedUids;
+    Map<uint> recordedMsns;
+    Map<uint> uids;
+    struct timeval started;
+    bool pausing;
+    bool done;
+};
+
+
+/*! \class ReplayClient replayclient.h
+    The ReplayClient class replays a session recorded by recorder(8)
+    against a server, and reports the latency of each command.
+
+    The client sends each block of lines the recorded client sent,
+    after waiting for the responses the recorded client had seen at
+    that point: the tagged responses and continuation requests for
+    IMAP, and the number of replies for other protocols. The
+    responses' contents are not compared. If the recording has time
+    stamps, the client also waits until the time the block was sent,
+    scaled by setSpeed().
+
+    UIDs in IMAP UID commands are mapped to the test server's UIDs by
+    message sequence number, using the FETCH responses seen in the
+    recording and during the replay. LOGIN (and POP USER/PASS) can be
+    given a different name and password using setLogin().
+
+    As for BenchClient, new sessions are started as old ones finish,
+    so the number of concurrent sessions stays the same.
+*/
+
+
+/*! Constructs a client replaying \a r, and connects to the right
+    server.
+*/
+
+ReplayClient::ReplayClient( Recording * r )
+    : Connection(), d( new ReplayClientData )
+{
+    d->recording = r;
+    d->next = r->blocks.first();
+    if ( connect( BenchClient::server( r->protocol ) ) < 0 ) {
+        BenchClient::record( "connect", 0, false );
+        finish( false );
+        return;
+    }
+    EventLoop::global()->addConnection( this );
+}
+
+
+void ReplayClient::react( Event e )
+{
+    switch ( e ) {
+    case Read:
+        parse();
+        proceed();
+        break;
+
+    case Timeout:
+        d->pausing = false;
+        proceed();
+        break;
+
+    case Connect:
+    case Shutdown:
+        break;
+
+    case Error:
+    case Close:
+        if ( d->done )
+            break;
+        if ( d->next ) {
+            BenchClient::record( "disconnect", 0, false );
+            finish( false );
+        }
+        else {
+            finish( true );
+        }
+        break;
+    }
+}
+
+
+/*! Parses whatever the server has sent. */
+
+void ReplayClient::parse()
+{
+    Buffer * r = readBuffer();
+    while ( !d->done && r->size() ) {
+        if ( d->literal ) {
+            uint n = d->literal;
+            if ( n > r->size() )
+                n = r->size();
+            r->remove( n );
+            d->literal -= n;
+        }
+        else {
+            EString * l = r->removeLine();
+            if ( !l )
+                return;
+            parseLine( *l );
+        }
+    }
+}
+
+
+/*! Notes what the response line \a l means for the replay's progress,
+    and records the latency of any command it completes.
+*/
+
+void ReplayClient::parseLine( const EString & l )
+{
+    if ( d->recording->protocol != BenchClient::Imap ) {
+        if ( !isReply( d->recording->protocol, l ) )
+            return;
+        d->replies++;
+        Pending * p = d->outstanding.shift();
+        if ( p )
+            BenchClient::record( p->name, usecsSince( p->sent ),
+                                 l[0] == '2' || l[0] == '3' || l[0] == '+' );
+        return;
+    }
+
+    d->literal = literalSize( l );
+    if ( l.startsWith( "+" ) ) {
+        d->plus++;
+        return;
+    }
+    if ( l.startsWith( "*" ) ) {
+        learnUid( l, &d->uids, 0 );
+        return;
+    }
+
+    EString tag = l.section( " ", 1 );
+    List<Pending>::Iterator p( d->outstanding );
+    while ( p && p->tag != tag )
+        ++p;
+    if ( !p )
+        return;
+    BenchClient::record( p->name, usecsSince( p->sent ),
+                         l.section( " ", 2 ).upper() == "OK" );
+    d->outstanding.take( p );
+}
+
+
+/*! Sends as many of the recorded blocks as the server's responses
+    allow, and finishes the session when all have been sent and
+    answered.
+*/
+
+void ReplayClient::proceed()
+{
+    while ( !d->done && !d->pausing && d->next ) {
+        Block * b = d->next;
+        if ( !b->send ) {
+            EStringList::Iterator l( b->lines );
+            while ( l ) {
+                learnUid( *l, &d->recordedUids, &d->recordedMsns );
+                ++l;
+            }
+            ++d->next;
+            continue;
+        }
+
+        if ( !ready( b ) )
+            return;
+
+        if ( speed && b->ms ) {
+            long wait = (long)( b->ms / speed ) -
+                        (long)( usecsSince( d->started ) / 1000 );
+            if ( wait >= 1000 ) {
+                d->pausing = true;
+                setTimeoutAfter( wait / 1000 );
+                return;
+            }
+        }
+
+        send( b );
+        ++d->next;
+    }
+
+    if ( !d->done && !d->next && d->outstanding.isEmpty() )
+        finish( true );
+}
+
+
+/*! Returns true if the server has answered all that the recorded
+    client had seen answered before it sent \a b.
+*/
+
+bool ReplayClient::ready( Block * b )
+{
+    if ( d->recording->protocol != BenchClient::Imap )
+        return d->replies >= b->replies;
+
+    if ( d->plus < b->continuations )
+        return false;
+    List<Pending>::Iterator p( d->outstanding );
+    while ( p ) {
+        if ( !b->allowed.contains( p->tag ) )
+            return false;
+        ++p;
+    }
+    return true;
+}
+
+
+/*! Sends the lines in \a b, rewritten as necessary. */
+
+void ReplayClient::send( Block * b )
+{
+    EString s;
+    EStringList::Iterator l( b->lines );
+    EStringList::Iterator n( b->names );
+    while ( l ) {
+        if ( n->isEmpty() ) {
+            s.append( *l );
+        }
+        else {
+            EString c = rewritten( *l );
+            s.append( c );
+            d->outstanding.append( new Pending( c.section( " ", 1 ), *n ) );
+        }
+        s.append( "\r\n" );
+        ++l;
+        ++n;
+    }
+    enqueue( s );
+}
+
+
+// maps each UID in the set s using the two maps
+
+static EString mapped( const EString & s, Map<uint> * msns, Map<uint> * uids )
+{
+    EString r;
+    uint i = 0;
+    while ( i < s.length() ) {
+        uint e = i;
+        while ( e < s.length() && s[e] >= '0' && s[e] <= '9' )
+            e++;
+        if ( e > i ) {
+            bool ok = false;
+            uint uid = s.mid( i, e - i ).number( &ok );
+            uint * msn = ok ? msns->find( uid ) : 0;
+            uint * n = msn ? uids->find( *msn ) : 0;
+            if ( n )
+                r.appendNumber( *n );
+            else
+                r.append( s.mid( i, e - i ) );
+            i = e;
+        }
+        else {
+            r.append( s[i] );
+            i++;
+        }
+    }
+    return r;
+}
+
+
+/*! Returns the command line \a l as it should be sent to the test
+    server: With the UIDs mapped and the login name and password
+    replaced with those given to setLogin().
+*/
+
+EString ReplayClient::rewritten( const EString & l )
+{
+    EString c = l.section( " ", 1 ).lower();
+    if ( d->recording->protocol == BenchClient::Pop ) {
+        if ( login && c == "user" )
+            return "USER " + *login;
+        if ( secret && c == "pass" )
+            return "PASS " + *secret;
+        return l;
+    }
+    if ( d->recording->protocol != BenchClient::Imap )
+        return l;
+
+    EString tag = l.section( " ", 1 );
+    c = l.section( " ", 2 ).lower();
+    if ( c == "login" && login && secret )
+        return tag + " LOGIN " + login->quoted() + " " + secret->quoted();
+    if ( c != "uid" )
+        return l;
+
+    EStringList * w = EStringList::split( ' ', l );
+    EStringList::Iterator i( w );
+    EString r;
+    uint n = 0;
+    while ( i ) {
+        if ( n )
+            r.append( " " );
+        if ( n == 3 )
+            r.append( mapped( *i, &d->recordedMsns, &d->uids ) );
+        else
+            r.append( *i );
+        ++i;
+        n++;
+    }
+    return r;
+}
+
+
+/*! Ends this session, and starts a new one, immediately if \a ok is
+    true and a second later if not.
+*/
+
+void ReplayClient::finish( bool ok )
+{
+    d->done = true;
+    close();
+    if ( ok ) {
+        BenchClient::sessionDone();
+        start( 1 );
+    }
+    else {
+        (void)new Restarter;
+    }
+}
+
+
+/*! Reads the recorder(8) file \a name, and adds it to the sessions
+    start() can replay. Returns false if the file cannot be read or
+    contains no session.
+*/
+
+bool ReplayClient::addRecording( const EString & name )
+{
+    File f( name );
+    if ( !f.valid() )
+        return false;
+
+    Recording * r = new Recording;
+    r->name = name;
+    uint ms = 0;
+    EStringList * lines = EStringList::split( '\n', f.contents() );
+    EStringList::Iterator l( lines );
+    while ( l && *l != "end" ) {
+        EString s = *l;
+        ++l;
+        if ( s.startsWith( "# time " ) ) {
+            EString t = s.section( " ", 3 );
+            ms = t.section( ".", 1 ).number( 0 ) * 1000 +
+                 t.section( ".", 2 ).number( 0 );
+        }
+        else if ( s.startsWith( "send " ) || s.startsWith( "receive " ) ) {
+            Block * b = new Block;
+            b->send = s.startsWith( "send " );
+            b->ms = ms;
+            uint n = s.section( " ", 2 ).number( 0 );
+            while ( n && l ) {
+                b->lines.append( *l );
+                ++l;
+                n--;
+            }
+            r->blocks.append( b );
+        }
+    }
+
+    List<Block>::Iterator b( r->blocks );
+    while ( b && b->send )
+        ++b;
+    if ( !b || b->lines.isEmpty() )
+        return false;
+    EString greeting = *b->lines.first();
+    if ( greeting.startsWith( "+OK" ) )
+        r->protocol = BenchClient::Pop;
+    else if ( !greeting.startsWith( "* " ) )
+        r->protocol = BenchClient::Lmtp;
+    r->analyse();
+
+    if ( !recordings ) {
+        recordings = new List<Recording>;
+        Allocator::addEternal( recordings, "recorded sessions" );
+    }
+    recordings->append( r );
+    return true;
+}
+
+
+/*! Starts \a count sessions, using the recordings in turn. */
+
+void ReplayClient::start( uint count )
+{
+    if ( !recordings || recordings->isEmpty() )
+        return;
+    while ( count ) {
+        Recording * r = 0;
+        uint i = nextRecording++ % recordings->count();
+        List<Recording>::Iterator it( recordings );
+        while ( i ) {
+            ++it;
+            i--;
+        }
+        r = it;
+        (void)new ReplayClient( r );
+        count--;
+    }
+}
+
+
+/*! Makes replays run \a s times as fast as the recorded sessions. If
+    \a s is 0, the time stamps are ignored and each block is sent as
+    soon as the server has answered enough.
+*/
+
+void ReplayClient::setSpeed( uint s )
+{
+    speed = s;
+}
+
+
+/*! Makes replays log in as \a name with password \a password, rather
+    than using the recorded login.
+*/
+
+void ReplayClient::setLogin( const EString & name, const EString & password )
+{
+    login = new EString( name );
+    Allocator::addEternal( login, "replay login" );
+    secret = new EString( password );
+    Allocator::addEternal( secret, "replay password" );
+}
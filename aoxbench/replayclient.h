@@ -0,0 +1,35 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef REPLAYCLIENT_H
+#define REPLAYCLIENT_H
+
+#include "connection.h"
+
+
+class ReplayClient
+    : public Connection
+{
+public:
+    ReplayClient( class Recording * );
+
+    void react( Event );
+
+    static bool addRecording( const EString & );
+    static void start( uint );
+    static void setSpeed( uint );
+    static void setLogin( const EString &, const EString & );
+
+private:
+    class ReplayClientData * d;
+
+    void parse();
+    void parseLine( const EString & );
+    void proceed();
+    bool ready( class Block * );
+    void send( class Block * );
+    EString rewritten( const EString & );
+    void finish( bool );
+};
+
+
+#endif
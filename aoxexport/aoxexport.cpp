@@ -41,9 +41,13 @@ int main( int ac, char ** av )
 
     Configuration::report();
 
+    bool compress = false;
+    uint concurrency = 1;
+    EString directory;
     int i = 1;
     while( i < ac && *av[i] == '-' ) {
         uint j = 1;
+        bool argument = false;
         while ( av[i][j] ) {
             switch( av[i][j] ) {
             case 'v':
@@ -53,12 +57,35 @@ int main( int ac, char ** av )
                 if ( verbosity )
                     verbosity--;
                 break;
+            case 'z':
+                compress = true;
+                break;
+            case 'j':
+            case 'o':
+                // these take the next argument, so they must come last
+                if ( av[i][j+1] || argument || i + 1 >= ac ) {
+                    bad = true;
+                }
+                else if ( av[i][j] == 'j' ) {
+                    bool ok = false;
+                    concurrency = EString( av[i+1] ).number( &ok );
+                    if ( !ok || !concurrency )
+                        bad = true;
+                    argument = true;
+                }
+                else {
+                    directory = av[i+1];
+                    argument = true;
+                }
+                break;
             default:
                 bad = true;
                 break;
             }
             j++;
         }
+        if ( argument )
+            i++;
         i++;
     }
 
@@ -82,7 +109,8 @@ int main( int ac, char ** av )
 
     if ( bad ) {
         fprintf( stderr,
-                 "Usage: %s [-vq] [mailbox] [search]"
+                 "Usage: %s [-vqz] [-o directory [-j jobs]] "
+                 "[mailbox] [search]\n"
                  "See aoxexport(8) or "
                  "http://aox.org/aoxexport/ for details.\n", av[0] );
         exit( -1 );
@@ -99,7 +127,16 @@ int main( int ac, char ** av )
     Entropy::setup();
     Database::setup();
 
-    Exporter * e = new Exporter( source, which );
+    EventHandler * e = 0;
+    if ( directory.isEmpty() ) {
+        Exporter * x = new Exporter( source, which );
+        x->setOutput( "", compress );
+        e = x;
+    }
+    else {
+        e = new TreeExporter( source, which, directory,
+                              compress, concurrency );
+    }
 
     Mailbox::setup( e );
 
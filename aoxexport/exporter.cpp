@@ -13,7 +13,25 @@
 #include "list.h"
 #include "map.h"
 
-#include <unistd.h> // write()
+// write, close
+#include <unistd.h>
+// open
+#include <fcntl.h>
+// mkdir
+#include <sys/stat.h>
+// errno
+#include <errno.h>
+// gzdopen, gzwrite, gzclose
+#include <zlib.h>
+
+
+// the number of messages given to each Fetcher. the Fetcher sizes its
+// own batches to fit within memory-limit; this only bounds the number
+// of (mostly empty) Message objects alive at once.
+static const uint chunkSize = 4096;
+
+// the amount of output gathered before it's written.
+static const uint bufferSize = 1024 * 1024;
 
 
 class ExporterData
@@ -23,7 +41,9 @@ public:
     ExporterData()
         : find( 0 ), fetcher( 0 ),
           mailbox( 0 ), selector( 0 ),
-          messages( new List<Message> )
+          messages( new List<Message> ),
+          owner( 0 ), compress( false ), opened( false ), fd( 1 ),
+          gz( 0 ), count( 0 ), done( false )
         {}
 
     Query * find;
@@ -32,6 +52,16 @@ public:
     Mailbox * mailbox;
     Selector * selector;
     List<Message> * messages;
+    EventHandler * owner;
+
+    EString fileName;
+    bool compress;
+    bool opened;
+    int fd;
+    gzFile gz;
+    EString buffer;
+    uint count;
+    bool done;
 };
 
 
@@ -43,26 +73,77 @@ static const char * weekdays[] = { "Sun", "Mon", "Tue", "Wed", "Thu",
                                    "Fri", "Sat" };
 
 
+// creates the directories leading up to \a name, as far as possible.
+
+static void makeParents( const EString & name )
+{
+    int i = name.find( '/', 1 );
+    while ( i > 0 ) {
+        (void)::mkdir( name.mid( 0, i ).cstr(), 0700 );
+        i = name.find( '/', i + 1 );
+    }
+}
+
+
 /*! Constructs an Exporter object which will read those messages in \a
-    source which match \a selector and write them to stdout.
+    source which match \a selector and write them to stdout (or
+    wherever setOutput() says).
 
     If \a source is empty, the entire database is searched.
 
     If \a source is nonempty, but not a valid name, then the Exporter
     will kill the program with a disaster.
+
+    If \a owner is nonnull, the Exporter notifies it when done()
+    becomes true. If not, the Exporter stops the EventLoop when it's
+    done.
+
+    The messages are fetched and written a chunk at a time, so an
+    Exporter's memory use doesn't depend on the number of messages it
+    exports.
 */
 
-Exporter::Exporter( const UString & source, Selector * selector )
+Exporter::Exporter( const UString & source, Selector * selector,
+                    EventHandler * owner )
     : d( new ExporterData )
 {
     d->sourceName = source;
     d->selector = selector;
+    d->owner = owner;
     setLog( new Log );
 }
 
 
+/*! Instructs this Exporter to write to the file \a name instead of
+    stdout, and to compress its output using gzip if \a compress is
+    true. If \a name is empty, the output goes to stdout.
+
+    The file is created (along with any missing parent directories)
+    when the Exporter starts, and an existing file is overwritten.
+*/
+
+void Exporter::setOutput( const EString & name, bool compress )
+{
+    d->fileName = name;
+    d->compress = compress;
+}
+
+
+/*! Returns true if this Exporter has written and closed its output,
+    and false if it's still working.
+*/
+
+bool Exporter::done() const
+{
+    return d->done;
+}
+
+
 void Exporter::execute()
 {
+    if ( d->done )
+        return;
+
     if ( Mailbox::refreshing() ) {
         Database::notifyWhenIdle( this );
         return;
@@ -77,6 +158,29 @@ void Exporter::execute()
         }
     }
 
+    if ( !d->opened ) {
+        d->opened = true;
+        if ( !d->fileName.isEmpty() ) {
+            makeParents( d->fileName );
+            d->fd = ::open( d->fileName.cstr(),
+                            O_WRONLY | O_CREAT | O_TRUNC, 0600 );
+            if ( d->fd < 0 ) {
+                log( "Cannot open " + d->fileName, Log::Disaster );
+                return;
+            }
+        }
+        if ( d->compress ) {
+            d->gz = ::gzdopen( d->fd, "wb" );
+            if ( !d->gz ) {
+                log( "Cannot compress output to " +
+                     ( d->fileName.isEmpty() ? EString( "stdout" )
+                                             : d->fileName ),
+                     Log::Disaster );
+                return;
+            }
+        }
+    }
+
     if ( !d->find ) {
         EStringList wanted;
         wanted.append( "message" );
@@ -88,23 +192,7 @@ void Exporter::execute()
     if ( !d->find->done() )
         return;
 
-    if ( !d->fetcher ) {
-        d->messages = new List<Message>;
-        while ( d->find->hasResults() ) {
-            Row * r = d->find->nextRow();
-            Message * m = new Message;
-            m->setDatabaseId( r->getInt( "message" ) );
-            d->messages->append( m );
-        }
-        d->fetcher = new Fetcher( d->messages, this, 0 );
-        d->fetcher->fetch( Fetcher::Addresses );
-        d->fetcher->fetch( Fetcher::OtherHeader );
-        d->fetcher->fetch( Fetcher::Body );
-        d->fetcher->fetch( Fetcher::Trivia );
-        d->fetcher->execute();
-    }
-
-    while ( !d->messages->isEmpty() ) {
+    while ( !d->messages->isEmpty() || startChunk() ) {
         Message * m = d->messages->firstElement();
         if ( !m->hasAddresses() )
             return;
@@ -154,14 +242,228 @@ void Exporter::execute()
         from.append( " " );
         from.appendNumber( id.year() );
         from.append( "\r\n" );
-        EString rfc822 = m->rfc822( false );
-        int r = ::write( 1, from.data(), from.length() ) +
-                ::write( 1, rfc822.data(), rfc822.length() );
-        // we don't really care whether the write succeeds or not, so
-        // just fool the compiler.
-        r = r;
+        write( from );
+        write( m->rfc822( false ) );
+        d->count++;
     }
 
-    EventLoop::global()->stop();
+    finish();
+}
+
+
+/*! Gives the Fetcher the next chunk of messages from the search
+    results. Returns true if there was anything left to fetch, and
+    false if all the messages have been fetched.
+*/
+
+bool Exporter::startChunk()
+{
+    if ( !d->find->hasResults() )
+        return false;
+
+    d->messages = new List<Message>;
+    while ( d->find->hasResults() && d->messages->count() < chunkSize ) {
+        Row * r = d->find->nextRow();
+        Message * m = new Message;
+        m->setDatabaseId( r->getInt( "message" ) );
+        d->messages->append( m );
+    }
+    d->fetcher = new Fetcher( d->messages, this, 0 );
+    d->fetcher->fetch( Fetcher::Addresses );
+    d->fetcher->fetch( Fetcher::OtherHeader );
+    d->fetcher->fetch( Fetcher::Body );
+    d->fetcher->fetch( Fetcher::Trivia );
+    d->fetcher->execute();
+    return true;
+}
+
+
+/*! Appends \a s to the output, and writes the output if enough has
+    been gathered.
+*/
+
+void Exporter::write( const EString & s )
+{
+    d->buffer.append( s );
+    if ( d->buffer.length() >= bufferSize )
+        flush();
+}
+
+
+/*! Writes all the gathered output, and dies with a disaster if that
+    isn't possible.
+*/
+
+void Exporter::flush()
+{
+    uint n = 0;
+    while ( n < d->buffer.length() ) {
+        int r;
+        if ( d->gz )
+            r = ::gzwrite( d->gz, d->buffer.data() + n,
+                           d->buffer.length() - n );
+        else
+            r = ::write( d->fd, d->buffer.data() + n,
+                         d->buffer.length() - n );
+        if ( r > 0 ) {
+            n += r;
+        }
+        else if ( r < 0 && !d->gz && errno == EINTR ) {
+            // try again
+        }
+        else {
+            log( "Cannot write " +
+                 ( d->fileName.isEmpty() ? EString( "to stdout" )
+                                         : d->fileName ),
+                 Log::Disaster );
+            return;
+        }
+    }
+    d->buffer.truncate();
+}
+
+
+/*! Writes the remaining output, closes the output file and tells the
+    owner (or the EventLoop) that this Exporter is done.
+*/
+
+void Exporter::finish()
+{
+    flush();
+    if ( d->gz )
+        ::gzclose( d->gz );
+    else if ( !d->fileName.isEmpty() )
+        ::close( d->fd );
+    d->gz = 0;
+    d->done = true;
+
+    if ( !d->fileName.isEmpty() )
+        log( "Wrote " + fn( d->count ) + " messages to " + d->fileName );
+
+    if ( d->owner )
+        d->owner->execute();
+    else
+        EventLoop::global()->stop();
 }
 
+
+class TreeExporterData
+    : public Garbage
+{
+public:
+    TreeExporterData()
+        : selector( 0 ), compress( false ), concurrency( 1 ),
+          queue( 0 ), total( 0 )
+        {}
+
+    UString sourceName;
+    Selector * selector;
+    EString directory;
+    bool compress;
+    uint concurrency;
+    List<Mailbox> * queue;
+    List<Exporter> working;
+    uint total;
+};
+
+
+// appends \a m and all its descendants to \a l, parents first.
+
+static void addTree( List<Mailbox> * l, Mailbox * m )
+{
+    if ( m->ordinary() )
+        l->append( m );
+    List<Mailbox>::Iterator c( m->children() );
+    while ( c ) {
+        addTree( l, c );
+        ++c;
+    }
+}
+
+
+/*! \class TreeExporter exporter.h
+    The TreeExporter class exports a tree of mailboxes, each to its own
+    mbox file.
+
+    Each mailbox is exported by an Exporter, and up to a configurable
+    number of Exporters run at once. Since each has its own queries,
+    the database can work on several mailboxes in parallel using
+    separate handles.
+*/
+
+
+/*! Constructs a TreeExporter which exports \a source and its
+    descendants (or all mailboxes, if \a source is empty) to files in
+    \a directory, exporting the messages which match \a selector and
+    running up to \a concurrency Exporters at once.
+
+    Each file is named after its mailbox, with ".mbox" appended, or
+    ".mbox.gz" if \a compress is true, in which case the files are
+    compressed.
+*/
+
+TreeExporter::TreeExporter( const UString & source, Selector * selector,
+                            const EString & directory, bool compress,
+                            uint concurrency )
+    : d( new TreeExporterData )
+{
+    d->sourceName = source;
+    d->selector = selector;
+    d->directory = directory;
+    while ( d->directory.endsWith( "/" ) )
+        d->directory.truncate( d->directory.length() - 1 );
+    d->compress = compress;
+    d->concurrency = concurrency;
+    if ( !d->concurrency )
+        d->concurrency = 1;
+    setLog( new Log );
+}
+
+
+void TreeExporter::execute()
+{
+    if ( Mailbox::refreshing() ) {
+        Database::notifyWhenIdle( this );
+        return;
+    }
+
+    if ( !d->queue ) {
+        Mailbox * m = Mailbox::root();
+        if ( !d->sourceName.isEmpty() )
+            m = Mailbox::find( d->sourceName );
+        if ( !m ) {
+            log( "No such mailbox: " + d->sourceName.utf8(),
+                 Log::Disaster );
+            return;
+        }
+        d->queue = new List<Mailbox>;
+        addTree( d->queue, m );
+        d->total = d->queue->count();
+    }
+
+    List<Exporter>::Iterator i( d->working );
+    while ( i ) {
+        if ( i->done() )
+            d->working.take( i );
+        else
+            ++i;
+    }
+
+    while ( d->working.count() < d->concurrency &&
+            !d->queue->isEmpty() ) {
+        Mailbox * m = d->queue->shift();
+        EString name = d->directory + m->name().utf8() + ".mbox";
+        if ( d->compress )
+            name.append( ".gz" );
+        Exporter * e = new Exporter( m->name(), d->selector, this );
+        e->setOutput( name, d->compress );
+        d->working.append( e );
+        e->execute();
+    }
+
+    if ( !d->working.isEmpty() || !d->queue->isEmpty() )
+        return;
+
+    log( "Exported " + fn( d->total ) + " mailboxes to " + d->directory );
+    EventLoop::global()->stop();
+}
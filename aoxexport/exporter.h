@@ -7,18 +7,43 @@
 
 class Selector;
 class UString;
+class EString;
 
 
 class Exporter
     : public EventHandler
 {
 public:
-    Exporter( const UString &, Selector * );
+    Exporter( const UString &, Selector *, EventHandler * = 0 );
+
+    void setOutput( const EString &, bool );
 
     void execute();
 
+    bool done() const;
+
 private:
     class ExporterData * d;
+
+    bool startChunk();
+    void write( const EString & );
+    void flush();
+    void finish();
+};
+
+
+class TreeExporter
+    : public EventHandler
+{
+public:
+    TreeExporter( const UString &, Selector *,
+                  const EString &, bool, uint );
+
+    void execute();
+
+private:
+    class TreeExporterData * d;
 };
 
+
 #endif
@@ -36,9 +36,13 @@ int main( int ac, char ** av )
 
     Configuration::report();
 
+    uint concurrency = 1;
+    bool bulk = false;
+    EString checkpoints;
     int i = 1;
     while( i < ac && *av[i] == '-' ) {
         uint j = 1;
+        bool argument = false;
         while ( av[i][j] ) {
             switch( av[i][j] ) {
             case 'v':
@@ -50,12 +54,35 @@ int main( int ac, char ** av )
             case 'e':
                 Migrator::setErrorCopies( true );
                 break;
+            case 'b':
+                bulk = true;
+                break;
+            case 'j':
+            case 'c':
+                // these take the next argument, so they must come last
+                if ( av[i][j+1] || argument || i + 1 >= ac ) {
+                    bad = true;
+                }
+                else if ( av[i][j] == 'j' ) {
+                    bool ok = false;
+                    concurrency = EString( av[i+1] ).number( &ok );
+                    if ( !ok || !concurrency )
+                        bad = true;
+                    argument = true;
+                }
+                else {
+                    checkpoints = av[i+1];
+                    argument = true;
+                }
+                break;
             default:
                 bad = true;
                 break;
             }
             j++;
         }
+        if ( argument )
+            i++;
         i++;
     }
 
@@ -81,20 +108,27 @@ int main( int ac, char ** av )
         Allocator::addEternal( m, "migrator" );
         Utf8Codec c;
         m->setDestination( c.toUnicode( destination ) );
+        m->setConcurrency( concurrency );
+        m->setBulkLoad( bulk );
+        if ( !checkpoints.isEmpty() )
+            m->setCheckpointFile( checkpoints );
         while ( i < ac )
             m->addSource( av[i++] );
     }
 
     if ( bad ) {
         fprintf( stderr,
-                 "Usage: %s [-vq] "
+                 "Usage: %s [-vqeb] [-j jobs] [-c checkpoints] "
                  "<mailbox> <type> <source [, source ...]>\n"
                  "See aoximport(8) for details.\n", av[0] );
         exit( -1 );
     }
 
     Entropy::setup();
-    Database::setup();
+    if ( bulk )
+        Database::setup( 0, Database::DbOwner );
+    else
+        Database::setup();
     Mailbox::setup( m );
 
     Flag::setup();
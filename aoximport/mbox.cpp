@@ -9,6 +9,14 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <stdio.h>
+// open, O_RDONLY
+#include <fcntl.h>
+// close
+#include <unistd.h>
+// mmap, munmap, madvise
+#include <sys/mman.h>
+// memchr, memcmp, memmem
+#include <string.h>
 
 
 /*! \class MboxDirectory mbox.h
@@ -45,10 +53,14 @@ class MboxMailboxData
     : public Garbage
 {
 public:
-    MboxMailboxData(): file( 0 ), msn( 1 ) {}
+    MboxMailboxData()
+        : opened( false ), map( 0 ), size( 0 ), pos( 0 ), msn( 1 ) {}
 
     EString path;
-    FILE * file;
+    bool opened;
+    const char * map;
+    size_t size;
+    size_t pos;
     uint msn;
 };
 
@@ -75,16 +87,16 @@ MboxMailbox::MboxMailbox( const EString & path, uint n )
 }
 
 
-static bool isFrom( const char * s )
+// returns true if the line \a s looks like an mbox separator, i.e.
+// "From " followed by something that includes "11:22:33 4567".
+
+static bool isFrom( const EString & s )
 {
-    if ( s[0] != 'F' || s[1] != 'r' || s[2] != 'o' || s[3] != 'm' ||
-         s[4] != ' ' )
+    if ( !s.startsWith( "From " ) )
         return false;
 
-    EString f( s );
-
     uint n = 5;
-    while ( n < f.length() &&
+    while ( n < s.length() &&
             !( s[n] == ' ' &&
                ( s[n+1] >= '0' && s[n+1] <= '9' ) &&
                ( s[n+2] >= '0' && s[n+2] <= '9' ) &&
@@ -104,13 +116,37 @@ static bool isFrom( const char * s )
     }
 
     // Did we find "11:22:33 4567" in the line?
-    if ( f[n] == '\0' )
+    if ( n >= s.length() )
         return false;
 
     return true;
 }
 
 
+// returns the offset of the first line at or after \a from in the
+// \a size bytes at \a b that passes isFrom(), or \a size if there is
+// none. \a from must be the start of a line. memmem() does the work
+// of skipping the lines that don't start with "From ".
+
+static size_t separator( const char * b, size_t size, size_t from )
+{
+    size_t f = from;
+    while ( f < size ) {
+        if ( size - f >= 5 && !memcmp( b + f, "From ", 5 ) ) {
+            const char * lf = (const char *)memchr( b + f, '\n', size - f );
+            size_t l = lf ? lf + 1 - b : size;
+            if ( isFrom( EString( b + f, l - f ) ) )
+                return f;
+        }
+        const char * n = (const char *)memmem( b + f, size - f, "\nFrom ", 6 );
+        if ( !n )
+            return size;
+        f = n + 1 - b;
+    }
+    return size;
+}
+
+
 /*! This reimplementation does a rough parsing of mbox files. It's
     difficult to know how to parse those things - how flexible should
     we be? Should we insist on a correct date, for example?
@@ -121,26 +157,53 @@ static bool isFrom( const char * s )
 
 MigratorMessage * MboxMailbox::nextMessage()
 {
-    char s[65537];
-
-    if ( !d->file ) {
-        d->file = fopen( d->path.cstr(), "r" );
-        // If we can't read a "From " line at the very beginning, we
-        // assume this isn't an mbox, and give up.
-        if ( !d->file || fgets( s, 128, d->file ) == 0 ||
-             !( s[0] == 'F' && s[1] == 'r' && s[2] == 'o' && s[3] == 'm' &&
-                s[4] == ' ' ) )
-            return 0;
+    if ( !d->opened ) {
+        d->opened = true;
+        int fd = ::open( d->path.cstr(), O_RDONLY );
+        struct stat st;
+        if ( fd >= 0 && ::fstat( fd, &st ) == 0 && st.st_size > 0 ) {
+            void * m = ::mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+            if ( m != MAP_FAILED ) {
+                d->map = (const char *)m;
+                d->size = st.st_size;
+                ::madvise( m, d->size, MADV_SEQUENTIAL );
+            }
+        }
+        if ( fd >= 0 )
+            ::close( fd );
+        // If there's no "From " line at the very beginning, we
+        // assume this isn't an mbox, and give up. Otherwise we skip
+        // that line.
+        if ( d->map && d->size >= 5 && !memcmp( d->map, "From ", 5 ) ) {
+            const char * lf = (const char *)memchr( d->map, '\n', d->size );
+            d->pos = lf ? lf + 1 - d->map : d->size;
+        }
+        else {
+            d->pos = d->size;
+        }
     }
 
+    // The message is everything up to the next "From " line. Only
+    // the message itself is copied out of the mapping.
+
     EString contents;
-    bool done = false;
-    while ( !done ) {
-        s[65536] = '\0';
-        if ( fgets( s, 65536, d->file ) != 0 && !isFrom( s ) )
-            contents.append( s );
-        else
-            done = true;
+    while ( contents.isEmpty() && d->pos < d->size ) {
+        size_t start = d->pos;
+        size_t end = separator( d->map, d->size, start );
+        d->pos = d->size;
+        if ( end < d->size ) {
+            const char * lf
+                = (const char *)memchr( d->map + end, '\n', d->size - end );
+            if ( lf )
+                d->pos = lf + 1 - d->map;
+        }
+        if ( end > start )
+            contents = EString( d->map + start, end - start );
+    }
+
+    if ( d->map && d->pos >= d->size ) {
+        ::munmap( (void *)d->map, d->size );
+        d->map = 0;
     }
 
     if ( contents.isEmpty() )
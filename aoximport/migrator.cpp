@@ -4,6 +4,7 @@
 
 #include "file.h"
 #include "list.h"
+#include "dict.h"
 #include "flag.h"
 #include "timer.h"
 #include "scope.h"
@@ -13,6 +14,9 @@
 #include "transaction.h"
 #include "recipient.h"
 #include "eventloop.h"
+#include "tunableindex.h"
+#include "configuration.h"
+#include "query.h"
 #include "injector.h"
 #include "dirtree.h"
 #include "maildir.h"
@@ -21,11 +25,12 @@
 #include "utf.h"
 #include "mh.h"
 
-#include <stdio.h>
+#include <stdio.h> // rename
 #include <sys/stat.h> // mkdir
 #include <sys/types.h> // mkdir
 #include <unistd.h> // getpid
 #include <time.h> // time
+#include <stdlib.h> // exit
 
 
 class MigratorData
@@ -33,20 +38,39 @@ class MigratorData
 {
 public:
     MigratorData()
-        : working( 0 ),
-          messagesDone( 0 ), mailboxesDone( 0 ),
+        : messagesDone( 0 ), mailboxesDone( 0 ), sourcesDone( 0 ),
+          concurrency( 1 ),
           mode( Migrator::Mbox ),
-          startup( (uint)time( 0 ) )
+          startup( (uint)time( 0 ) ), reported( 0 ),
+          bulk( false ), bulkState( 0 ), dropping( 0 ), findIndexes( 0 ),
+          analyse( 0 ), loaded( 0 ), built( 0 )
     {}
 
     UString destination;
     List< MigratorSource > sources;
-    MailboxMigrator * working;
+    List< MailboxMigrator > working;
 
     uint messagesDone;
     uint mailboxesDone;
+    uint sourcesDone;
+    uint concurrency;
     Migrator::Mode mode;
     uint startup;
+    uint reported;
+
+    EString checkpointFile;
+    Dict<EString> checkpoints;
+    EStringList checkpointKeys;
+
+    bool bulk;
+    uint bulkState;
+    Transaction * dropping;
+    Query * findIndexes;
+    EStringList deferred;
+    List<Query> building;
+    Query * analyse;
+    uint loaded;
+    uint built;
 };
 
 
@@ -57,8 +81,13 @@ public:
 
     Its API consists of the two functions start() and running(). The
     execute() function does the heavy loading, by ensuring that the
-    Migrator always has four MailboxMigrator objects working. (The
-    MailboxMigrator objects must call execute() when they're done.)
+    Migrator always has concurrency() MailboxMigrator objects working.
+    (The MailboxMigrator objects must call execute() when they're
+    done.)
+
+    If setCheckpointFile() has been called, the Migrator records its
+    progress in that file, so that an interrupted migration can be
+    restarted with the same arguments and continue where it stopped.
 */
 
 
@@ -110,34 +139,76 @@ void Migrator::addSource( const EString &s )
 }
 
 
-/*! Finds another mailbox to migrate.
+/*! Finds other mailboxes to migrate, until concurrency() are being
+    migrated at once.
+
+    Only one MailboxMigrator at a time may be creating its destination
+    mailbox, since two concurrent creations of the same new parent
+    mailbox would clash.
 */
 
 void Migrator::execute()
 {
-    if ( d->working && d->working->done() ) {
-        d->messagesDone += d->working->migrated();
-        d->mailboxesDone++;
-        d->working = 0;
+    if ( d->bulk && d->bulkState == 0 && !dropIndexes() )
+        return;
+
+    List<MailboxMigrator>::Iterator w( d->working );
+    while ( w ) {
+        if ( w->done() ) {
+            d->messagesDone += w->migrated();
+            d->mailboxesDone++;
+            d->working.take( w );
+        }
+        else {
+            ++w;
+        }
+    }
+
+    bool creating = false;
+    w = d->working.first();
+    while ( w && !creating ) {
+        if ( w->creating() )
+            creating = true;
+        ++w;
     }
 
-    while ( !d->working && !d->sources.isEmpty() ) {
+    while ( !creating && d->working.count() < d->concurrency &&
+            !d->sources.isEmpty() ) {
         MigratorSource * source = d->sources.first();
         MigratorMailbox * m( source->nextMailbox() );
         if ( m ) {
-            MailboxMigrator * n = new MailboxMigrator( m, this );
-            if ( n->valid() ) {
-                d->working = n;
+            EString key = fn( d->sourcesDone + 1 ) + " " + m->partialName();
+            EString * c = d->checkpoints.find( key );
+            uint skip = 0;
+            if ( c && *c == "done" ) {
+                if ( verbosity() > 1 )
+                    fprintf( stdout, "Skipping %s, migrated earlier\n",
+                             m->partialName().cstr() );
+                m = 0;
+            }
+            else if ( c ) {
+                skip = c->number( 0 );
+            }
+            MailboxMigrator * n = 0;
+            if ( m )
+                n = new MailboxMigrator( m, this );
+            if ( n && n->valid() ) {
+                n->setCheckpoint( key, skip );
+                d->working.append( n );
                 n->execute();
-                return;
+                creating = n->creating();
             }
         }
         else {
             d->sources.shift();
+            d->sourcesDone++;
         }
     }
 
-    if ( d->working )
+    if ( !d->working.isEmpty() )
+        return;
+
+    if ( d->bulk && !buildIndexes() )
         return;
 
     if ( Database::idle() )
@@ -352,8 +423,9 @@ public:
         : source( 0 ), destination( 0 ),
           migrator( 0 ),
           validated( false ), valid( false ),
-          injector( 0 ),
-          migrated( 0 ), migrating( 0 )
+          injector( 0 ), creation( 0 ),
+          migrated( 0 ), migrating( 0 ), skip( 0 ), skipped( 0 ),
+          done( false )
     {}
 
     MigratorMailbox * source;
@@ -363,8 +435,13 @@ public:
     bool validated;
     bool valid;
     Injector * injector;
+    Transaction * creation;
     uint migrated;
     uint migrating;
+    uint skip;
+    uint skipped;
+    bool done;
+    EString checkpoint;
     EString error;
     Log log;
 };
@@ -424,11 +501,18 @@ void MailboxMigrator::execute()
 {
     if ( d->injector && !d->injector->done() )
         return;
+    if ( d->creation && !d->creation->done() )
+        return;
 
     Scope x( &d->log );
 
     if ( d->injector && d->injector->failed() ) {
         d->error = "Database error: " + d->injector->error();
+        if ( Migrator::verbosity() > 0 )
+            fprintf( stdout, "Mailbox %s: %s\n",
+                     d->source->partialName().cstr(), d->error.cstr() );
+        d->injector = 0;
+        d->done = true;
         d->migrator->execute();
         return;
     }
@@ -436,6 +520,24 @@ void MailboxMigrator::execute()
         d->migrated += d->migrating;
         d->migrating = 0;
         d->injector = 0;
+        d->migrator->checkpoint( d->checkpoint, d->skipped + d->migrated,
+                                 false );
+        d->migrator->report();
+    }
+    else if ( d->creation ) {
+        if ( d->creation->failed() ) {
+            d->error = "Cannot create mailbox: " + d->creation->error();
+            if ( Migrator::verbosity() > 0 )
+                fprintf( stdout, "Mailbox %s: %s\n",
+                         d->source->partialName().cstr(), d->error.cstr() );
+            d->messages.clear();
+            d->done = true;
+        }
+        d->creation = 0;
+        // let the Migrator start the next mailbox while we work
+        d->migrator->execute();
+        if ( d->done )
+            return;
     }
     else if ( !d->destination ) {
         UString tmp = d->migrator->destination();
@@ -446,9 +548,30 @@ void MailboxMigrator::execute()
             tmp.append( u.toUnicode( d->source->partialName() ) );
         }
         d->destination = Mailbox::obtain( tmp, true );
+
+        // a resumed migration starts after the messages that were
+        // migrated last time
+        while ( d->skipped < d->skip ) {
+            if ( !d->messages.isEmpty() )
+                d->messages.shift();
+            else if ( !d->source->nextMessage() )
+                d->skip = d->skipped;
+            if ( d->skipped < d->skip )
+                d->skipped++;
+        }
+
+        if ( d->destination &&
+             ( d->destination->deleted() || !d->destination->id() ) ) {
+            d->creation = new Transaction( this );
+            d->destination->create( d->creation, 0 );
+            Mailbox::refreshMailboxes( d->creation );
+            d->creation->commit();
+            return;
+        }
     }
 
-    uint limit = EventLoop::global()->memoryUsage();
+    uint limit = EventLoop::global()->memoryUsage() /
+                 d->migrator->concurrency();
     uint before = Allocator::allocated();
     MigratorMessage * mm = 0;
     do {
@@ -457,17 +580,6 @@ void MailboxMigrator::execute()
             d->messages.append( mm );
     } while ( mm && Allocator::allocated() * 2 - before < limit );
 
-    uint done = d->migrator->messagesMigrated();
-    if ( done && d->migrator->uptime() ) {
-        fprintf( stdout,
-                 "Processed %d messages, %.1f/s",
-                 done, ((double)done) / d->migrator->uptime() );
-        if ( !d->messages.isEmpty() )
-            fprintf( stdout, ", next chunk %d messages",
-                     d->messages.count() );
-        fprintf( stdout, "\n" );
-    }
-
     if ( !d->messages.isEmpty() ) {
         Scope x( new Log );
         log( "Starting migration of " + fn ( d->messages.count() ) +
@@ -487,23 +599,45 @@ void MailboxMigrator::execute()
         d->messages.clear();
     }
     else {
+        d->done = true;
+        d->migrator->checkpoint( d->checkpoint, d->skipped + d->migrated,
+                                 true );
         d->migrator->execute();
     }
 }
 
 
 /*! Returns true if this mailbox has processed every message in its
-    source to completion, and false if there may be something left to
-    do.
+    source to completion (or given up), and false if there may be
+    something left to do.
 */
 
 bool MailboxMigrator::done() const
 {
-    if ( !d->validated )
-        return false;
-    if ( !d->messages.isEmpty() )
-        return false;
-    return true;
+    return d->done;
+}
+
+
+/*! Returns true if this MailboxMigrator is creating its destination
+    mailbox, and false otherwise.
+*/
+
+bool MailboxMigrator::creating() const
+{
+    return d->creation != 0;
+}
+
+
+/*! Records that this MailboxMigrator's progress is recorded in the
+    Migrator's checkpoint file as \a key, and that the first \a skip
+    messages in the source have been migrated already and should be
+    skipped.
+*/
+
+void MailboxMigrator::setCheckpoint( const EString & key, uint skip )
+{
+    d->checkpoint = key;
+    d->skip = skip;
 }
 
 
@@ -530,8 +664,11 @@ EString MailboxMigrator::error() const
 uint Migrator::messagesMigrated() const
 {
     uint n = d->messagesDone;
-    if ( d->working )
-        n += d->working->migrated();
+    List<MailboxMigrator>::Iterator w( d->working );
+    while ( w ) {
+        n += w->migrated();
+        ++w;
+    }
     return n;
 }
 
@@ -617,3 +754,265 @@ uint Migrator::uptime()
 {
     return (uint)time( 0 ) - d->startup;
 }
+
+
+/*! Instructs this Migrator to migrate \a n mailboxes at once, each
+    with its own Injector. The initial value is 1.
+*/
+
+void Migrator::setConcurrency( uint n )
+{
+    if ( n < 1 )
+        n = 1;
+    d->concurrency = n;
+}
+
+
+/*! Returns the number of mailboxes migrated at once, as set by
+    setConcurrency().
+*/
+
+uint Migrator::concurrency() const
+{
+    return d->concurrency;
+}
+
+
+/*! Instructs this Migrator to record its progress in \a name, and
+    reads the progress recorded there by an earlier run, if any.
+
+    Each line in the file is either "done", or the number of messages
+    migrated so far, followed by a space and the mailbox's key (see
+    checkpoint()).
+*/
+
+void Migrator::setCheckpointFile( const EString & name )
+{
+    d->checkpointFile = name;
+    File f( name );
+    if ( !f.valid() )
+        return;
+    EStringList::Iterator l( f.lines() );
+    while ( l ) {
+        EString line = l->stripCRLF();
+        int i = line.find( ' ' );
+        if ( i > 0 && !d->checkpoints.contains( line.mid( i + 1 ) ) ) {
+            d->checkpointKeys.append( line.mid( i + 1 ) );
+            d->checkpoints.insert( line.mid( i + 1 ),
+                                   new EString( line.mid( 0, i ) ) );
+        }
+        ++l;
+    }
+}
+
+
+/*! Records that \a count messages of the mailbox identified by \a
+    key have been migrated, and that all of them have if \a done is
+    true, and rewrites the checkpoint file. Does nothing unless
+    setCheckpointFile() has been called.
+
+    \a key is the number of the source (counting each argument from
+    1) followed by a space and the MigratorMailbox::partialName(),
+    so a resumed migration must use the same sources in the same
+    order, and the sources must not have changed.
+*/
+
+void Migrator::checkpoint( const EString & key, uint count, bool done )
+{
+    if ( d->checkpointFile.isEmpty() || key.isEmpty() )
+        return;
+
+    if ( !d->checkpoints.contains( key ) )
+        d->checkpointKeys.append( key );
+    if ( done )
+        d->checkpoints.insert( key, new EString( "done" ) );
+    else
+        d->checkpoints.insert( key, new EString( fn( count ) ) );
+
+    EString c;
+    EStringList::Iterator i( d->checkpointKeys );
+    while ( i ) {
+        c.append( *d->checkpoints.find( *i ) );
+        c.append( " " );
+        c.append( *i );
+        c.append( "\n" );
+        ++i;
+    }
+
+    // write and rename, so that a crash leaves either the old
+    // checkpoints or the new ones
+    EString tmp = d->checkpointFile + ".new";
+    {
+        File f( tmp, File::Write, 0600 );
+        if ( !f.valid() ) {
+            fprintf( stderr, "Cannot write checkpoint file %s\n",
+                     tmp.cstr() );
+            return;
+        }
+        f.write( c );
+    }
+    if ( ::rename( tmp.cstr(), d->checkpointFile.cstr() ) < 0 )
+        fprintf( stderr, "Cannot rename %s to %s\n",
+                 tmp.cstr(), d->checkpointFile.cstr() );
+}
+
+
+/*! Shows the progress of all the MailboxMigrator objects on stdout,
+    at most once per second.
+*/
+
+void Migrator::report()
+{
+    uint now = (uint)time( 0 );
+    if ( now == d->reported || !uptime() || !verbosity() )
+        return;
+    d->reported = now;
+
+    uint done = messagesMigrated();
+    fprintf( stdout,
+             "Processed %d messages, %.1f/s, %d mailboxes done, "
+             "%d in progress\n",
+             done, ((double)done) / uptime(),
+             d->mailboxesDone, d->working.count() );
+}
+
+
+/*! Instructs this Migrator to drop the indexes listed in
+    tunableIndices before it starts migrating, if \a bulk is true, and
+    to build them again when it's done. This makes a large migration
+    into a new database much faster, but searching slow while it runs.
+    The initial value is false.
+*/
+
+void Migrator::setBulkLoad( bool bulk )
+{
+    d->bulk = bulk;
+}
+
+
+/*! Returns what setBulkLoad() set. */
+
+bool Migrator::bulkLoad() const
+{
+    return d->bulk;
+}
+
+
+/*! Drops the indexes that bulk loading defers, remembering which ones
+    existed, and returns true once that's done.
+
+    hf_msgid is kept, since the Injector uses it to find the parents
+    of each message it threads.
+*/
+
+bool Migrator::dropIndexes()
+{
+    if ( !d->dropping ) {
+        EStringList names;
+        uint i = 0;
+        while ( tunableIndices[i].name ) {
+            if ( EString( tunableIndices[i].name ) != "hf_msgid" )
+                names.append( tunableIndices[i].name );
+            i++;
+        }
+        d->dropping = new Transaction( this );
+        d->findIndexes = new Query( "select indexname::text from pg_indexes "
+                                    "where schemaname=$1 "
+                                    "and indexname=any($2::text[])", this );
+        d->findIndexes->bind( 1,
+                              Configuration::text( Configuration::DbSchema ) );
+        d->findIndexes->bind( 2, names );
+        d->dropping->enqueue( d->findIndexes );
+        d->dropping->execute();
+    }
+
+    if ( d->findIndexes ) {
+        if ( !d->findIndexes->done() )
+            return false;
+        while ( d->findIndexes->hasResults() ) {
+            Row * r = d->findIndexes->nextRow();
+            EString name = r->getEString( "indexname" );
+            d->deferred.append( name );
+            d->dropping->enqueue( new Query( "drop index " + name, 0 ) );
+            if ( verbosity() > 0 )
+                fprintf( stdout, "Dropping index %s until the end\n",
+                         name.cstr() );
+        }
+        d->findIndexes = 0;
+        d->dropping->commit();
+    }
+
+    if ( !d->dropping->done() )
+        return false;
+
+    if ( d->dropping->failed() ) {
+        fprintf( stderr, "Cannot drop indexes: %s\n",
+                 d->dropping->error().cstr() );
+        exit( 1 );
+    }
+
+    d->bulkState = 1;
+    d->startup = (uint)time( 0 );
+    return true;
+}
+
+
+/*! Builds the indexes dropped by dropIndexes() again, all at once so
+    that the database server can use several cores, then analyses the
+    database. Returns true when that's done.
+*/
+
+bool Migrator::buildIndexes()
+{
+    if ( d->bulkState == 1 ) {
+        d->bulkState = 2;
+        d->loaded = uptime();
+        d->built = (uint)time( 0 );
+        uint done = messagesMigrated();
+        fprintf( stdout, "Migrated %d messages in %d seconds, %.1f/s\n",
+                 done, d->loaded,
+                 d->loaded ? ((double)done) / d->loaded : (double)done );
+        EStringList::Iterator n( d->deferred );
+        while ( n ) {
+            uint i = 0;
+            while ( tunableIndices[i].name && *n != tunableIndices[i].name )
+                i++;
+            if ( tunableIndices[i].name ) {
+                if ( verbosity() > 0 )
+                    fprintf( stdout, "Executing %s;\n",
+                             tunableIndices[i].definition );
+                Query * q = new Query( tunableIndices[i].definition, this );
+                q->allowFailure();
+                d->building.append( q );
+                q->execute();
+            }
+            ++n;
+        }
+    }
+
+    if ( d->bulkState == 2 ) {
+        List<Query>::Iterator q( d->building );
+        while ( q ) {
+            if ( !q->done() )
+                return false;
+            if ( q->failed() )
+                fprintf( stderr, "%s failed: %s\n",
+                         q->string().cstr(), q->error().cstr() );
+            ++q;
+        }
+        d->bulkState = 3;
+        d->analyse = new Query( "analyze", this );
+        d->analyse->execute();
+        (new Query( "notify database_retuned", 0 ))->execute();
+    }
+
+    if ( !d->analyse->done() )
+        return false;
+
+    if ( d->bulkState == 3 ) {
+        d->bulkState = 4;
+        fprintf( stdout, "Built %d indexes in %d seconds\n",
+                 d->building.count(), (uint)time( 0 ) - d->built );
+    }
+    return true;
+}
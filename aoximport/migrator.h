@@ -25,6 +25,17 @@ public:
     uint messagesMigrated() const;
     uint mailboxesMigrated() const;
 
+    void setConcurrency( uint );
+    uint concurrency() const;
+
+    void setCheckpointFile( const EString & );
+    void checkpoint( const EString &, uint, bool );
+
+    void setBulkLoad( bool );
+    bool bulkLoad() const;
+
+    void report();
+
     static void setVerbosity( uint );
     static uint verbosity();
 
@@ -35,6 +46,9 @@ public:
 
 private:
     class MigratorData * d;
+
+    bool dropIndexes();
+    bool buildIndexes();
 };
 
 
@@ -96,12 +110,15 @@ public:
 
     bool valid() const;
     bool done() const;
+    bool creating() const;
     EString error() const;
 
     void execute();
 
     uint migrated() const;
 
+    void setCheckpoint( const EString &, uint );
+
 private:
     class MailboxMigratorData * d;
 };
@@ -8,7 +8,7 @@
 #include "smtp.h"
 #include "graph.h"
 
-#include "tlsthread.h"
+#include "tlsengine.h"
 #include "flag.h"
 #include "event.h"
 #include "cache.h"
@@ -16,11 +16,14 @@
 #include "listener.h"
 #include "database.h"
 #include "dbsignal.h"
+#include "clusterbus.h"
 #include "selector.h"
 #include "managesieve.h"
 #include "spoolmanager.h"
+#include "reparser.h"
 #include "entropy.h"
 #include "egd.h"
+#include "span.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -158,8 +161,22 @@ int main( int argc, char *argv[] )
     }
 
 
+    EString bd( Configuration::text( Configuration::BlobDir ) );
+    if ( !bd.isEmpty() ) {
+        struct stat st;
+        if ( ::stat( bd.cstr(), &st ) < 0 || !S_ISDIR( st.st_mode ) )
+            log( "Inaccessible blob-directory: " + bd, Log::Disaster );
+        else if ( security && !bd.startsWith( root ) )
+            log( "blob-directory must be under jail directory " + root,
+                 Log::Disaster );
+    }
+
     EString sA( Configuration::text( Configuration::SmartHostAddress ) );
     uint sP( Configuration::scalar( Configuration::SmartHostPort ) );
+    // with direct-delivery, the smarthost isn't used, and since no
+    // server listens on port 0, this disables the checks below
+    if ( Configuration::toggle( Configuration::DirectDelivery ) )
+        sP = 0;
 
     if ( Configuration::toggle( Configuration::UseSmtp ) &&
          Configuration::scalar( Configuration::SmtpPort ) == sP &&
@@ -272,7 +289,7 @@ int main( int argc, char *argv[] )
     );
 
     if ( Configuration::toggle( Configuration::UseTls ) ) {
-        TlsThread::setup();
+        TlsEngine::setup();
     }
 
     s.setup( Server::LogStartup );
@@ -281,13 +298,20 @@ int main( int argc, char *argv[] )
         "Statistics", Configuration::toggle( Configuration::UseStatistics ),
         Configuration::StatisticsAddress, Configuration::StatisticsPort
     );
+    Listener< MetricsServer >::create(
+        "Metrics", Configuration::toggle( Configuration::UseMetrics ),
+        Configuration::MetricsAddress, Configuration::MetricsPort
+    );
 
     EventLoop::global()->setMemoryUsage(
         1024 * 1024 * Configuration::scalar( Configuration::MemoryLimit ) );
 
+    Span::setup();
+
     s.setup( Server::Finish );
 
     Database::setup();
+    ClusterBus::setup();
 
     StartupWatcher * w = new StartupWatcher;
 
@@ -298,6 +322,7 @@ int main( int argc, char *argv[] )
     Mailbox::setup( w );
 
     SpoolManager::setup();
+    Reparser::setup();
     Selector::setup();
     Flag::setup();
     IMAP::setup();
@@ -4,6 +4,7 @@
 
 #include "cache.h"
 #include "estring.h"
+#include "estringlist.h"
 #include "log.h"
 
 // fprintf
@@ -30,6 +31,11 @@
 static uint BlockShift = 19;
 static uint BlockSize = 1 << BlockShift;
 
+// objects bigger than this get an Allocator each, sized to fit
+static uint LargeLimit = BlockSize / 2;
+// ... and all those Allocators are kept in the last size class
+static const uint LargeClass = 31;
+
 
 
 class AllocatorMapTable // NOT a Garbage class
@@ -87,9 +93,9 @@ public:
     static void insert( Allocator * a ) {
         Allocator::ulong v = ((Allocator::ulong)a->buffer) >> BlockShift;
         Allocator::ulong i = 0;
-        while ( i < a->step * a->capacity ) {
+        while ( i * BlockSize < a->step * a->capacity ) {
             insert( v + i, a );
-            i += BlockSize;
+            i++;
         }
     }
 
@@ -101,9 +107,9 @@ public:
     static void remove( Allocator * a ) {
         Allocator::ulong v = ((Allocator::ulong)a->buffer) >> BlockShift;
         Allocator::ulong i = 0;
-        while ( i < a->step * a->capacity ) {
+        while ( i * BlockSize < a->step * a->capacity ) {
             remove( v + i, a );
-            i += BlockSize;
+            i++;
         }
     }
 
@@ -142,13 +148,59 @@ struct AllocationBlock
 
 const uint SizeLimit = 512 * 1024 * 1024;
 
+const uint bytes = sizeof(void*);
+const uint bits = 8 * sizeof(void*);
+const uint magic = 0x7d34;
+
+
+static Allocator * allocators[32];
+static uint live[32];
+static uint liveBytes[32];
+
+
+/* Returns the chunk size of size class \a i. The classes go up by
+   half a power of two at a time: 16, 24, 32, 48, 64, 96 and so on
+   (8, 12, 16... on 32-bit systems), so no object wastes more than a
+   third of its chunk.
+*/
+
+static uint classChunk( uint i )
+{
+    uint c = 8;
+    if ( bits == 64 )
+        c = 16;
+    c = c << ( i / 2 );
+    if ( i % 2 )
+        c = c + c / 2;
+    return c;
+}
+
+
+/* Returns the size class that can hold \a size bytes, including
+   the management word, or LargeClass if none of them can.
+*/
+
+static uint classOf( uint size )
+{
+    if ( size > LargeLimit )
+        return LargeClass;
+    uint i = 0;
+    while ( classChunk( i ) < size )
+        i++;
+    return i;
+}
+
 
 static int total;
 static uint allocated;
+static uint allocations;
 static uint objects;
 static uint marked;
 static uint tos;
 static uint peak;
+static uint lastPause;
+static uint lastFreed;
+static uint sweepCursor = 32;
 static AllocationBlock ** stack;
 
 
@@ -180,13 +232,26 @@ void * Allocator::alloc( uint s, uint n )
         fprintf( stderr, "%s", "" );
     }
     Allocator * a = Allocator::allocator( s );
-    while ( a->taken == a->capacity && a->next )
+    if ( !a ) {
+        // a large object gets an Allocator of its own, which is
+        // unmapped as soon as a sweep finds the object dead
+        a = new Allocator( Allocator::rounded( s ) + bytes );
+        a->next = allocators[LargeClass];
+        allocators[LargeClass] = a;
+    }
+    if ( a->unswept )
+        a->sweep();
+    while ( a->taken == a->capacity && a->next ) {
         a = a->next;
+        if ( a->unswept )
+            a->sweep();
+    }
     void * p = a->allocate( s, n );
     if ( ( ( ::total + ::allocated + s ) & 0xfff00000 ) >
          ( ( ::total + ::allocated ) & 0xfff00000 ) )
         ::oneMegabyteAllocated();
     ::allocated += a->chunkSize();
+    ::allocations++;
     return p;
 }
 
@@ -208,12 +273,6 @@ void Allocator::dealloc( void * p )
 }
 
 
-const uint bytes = sizeof(void*);
-const uint bits = 8 * sizeof(void*);
-const uint magic = 0x7d34;
-
-
-static Allocator * allocators[32];
 
 
 static const uint maxRoots = 4096;
@@ -232,18 +291,18 @@ static bool verbose;
 
 /*! Returns a pointer to the Allocator responsible for \a size. \a
     size need not be rounded.
+
+    Returns a null pointer if \a size is too large for any size
+    class. Such objects get an Allocator each; see alloc().
 */
 
 Allocator * Allocator::allocator( uint size )
 {
-    uint i = 0;
-    uint b = 8;
-    if ( bits == 64 )
-        b = 16;
-    while ( size + bytes > b << i )
-        i++;
+    uint i = classOf( size + bytes );
+    if ( i == LargeClass )
+        return 0;
     if ( !allocators[i] )
-        allocators[i] = new Allocator( b << i );
+        allocators[i] = new Allocator( classChunk( i ) );
     return allocators[i];
 }
 
@@ -265,6 +324,11 @@ Allocator * Allocator::allocator( uint size )
     reachable. It can be called whenever there are no pointers into
     the heap, ie. only during the main event loop.
 
+    Only the marking is done while free() runs. Each Allocator is
+    swept lazily, either when it's next asked for memory or when
+    sweepIncrementally() reaches it, so the time free() takes depends
+    on the amount of live memory, not on the size of the heap.
+
     Each single instance of the Allocator class allocates memory blocks
     of a given size. There are static functions to the heavy loading,
     such as free() to free all unreachable memory, allocate() to
@@ -285,7 +349,7 @@ Allocator * Allocator::allocator( uint size )
 Allocator::Allocator( uint s )
     : base( 0 ), step( s ), taken( 0 ), capacity( 0 ),
       used( 0 ), marked( 0 ), buffer( 0 ),
-      next( 0 )
+      next( 0 ), unswept( false )
 {
     if ( s < ( BlockSize ) )
         capacity = ( BlockSize ) / ( s );
@@ -358,6 +422,8 @@ Allocator::~Allocator()
 
 void * Allocator::allocate( uint size, uint pointers )
 {
+    if ( unswept )
+        sweep();
     if ( taken < capacity ) {
         while ( base < capacity ) {
             ulong bm = used[base/bits];
@@ -422,6 +488,13 @@ void Allocator::deallocate( void * p )
         base = i;
     if ( ::allocated > step )
         ::allocated -= step;
+
+#if defined( MADV_DONTNEED )
+    // the Allocator itself goes away at the next sweep, but the
+    // pages of a large object can be given back at once.
+    if ( step > LargeLimit )
+        ::madvise( buffer, step, MADV_DONTNEED );
+#endif
 }
 
 
@@ -538,21 +611,41 @@ void Allocator::mark()
     Returns null if entries is null or empty, returns an object in
     entries else. The returned object is (in some sense) the one
     that's responsible for the largest share of allocated memory.
+
+    free() finishes sweeping whatever the previous call left unswept,
+    then marks everything reachable. The unmarked memory is swept
+    later; see sweepIncrementally().
 */
 
 Garbage * Allocator::free( List<Garbage> * entries )
 {
-    struct timeval start, afterMark, afterSweep;
+    struct timeval start, afterSweep, afterMark;
     start.tv_sec = 0;
     start.tv_usec = 0;
-    afterMark.tv_sec = 0;
-    afterMark.tv_usec = 0;
     afterSweep.tv_sec = 0;
     afterSweep.tv_usec = 0;
+    afterMark.tv_sec = 0;
+    afterMark.tv_usec = 0;
     gettimeofday( &start, 0 );
 
     Cache::clearAllCaches( false );
 
+    // finish the sweep begun by the last collection. mark() must
+    // not see stale mark bits.
+    uint i = 0;
+    uint before = 0;
+    while ( i < 32 ) {
+        sweep( i );
+        Allocator * a = allocators[i];
+        while ( a ) {
+            before = before + a->taken * a->step;
+            a = a->next;
+        }
+        i++;
+    }
+    ::sweepCursor = 32;
+    gettimeofday( &afterSweep, 0 );
+
     total = 0;
     peak = 0;
     uint freed = 0;
@@ -576,7 +669,7 @@ Garbage * Allocator::free( List<Garbage> * entries )
             ++i;
         }
     }
-    uint i = 0;
+    i = 0;
     while ( i < ::numRoots ) {
         if ( ::roots[i].root ) {
             uint o = objects;
@@ -589,48 +682,44 @@ Garbage * Allocator::free( List<Garbage> * entries )
 
         i++;
     }
-    gettimeofday( &afterMark, 0 );
 
-    // and sweep
+    // the marked objects are the ones that survive, so we know the
+    // result of the sweep before doing it.
+    total = ::marked;
+    if ( before > (uint)total )
+        freed = before - total;
     i = 0;
     uint blocks = 0;
     while ( i < 32 ) {
+        ::live[i] = 0;
+        ::liveBytes[i] = 0;
         Allocator * a = allocators[i];
         while ( a ) {
-            uint taken = a->taken;
-            if ( a->taken )
-                a->sweep();
-            freed = freed + ( taken - a->taken ) * a->step;
-            total = total + a->taken * a->step;
+            uint n = 0;
+            uint b = 0;
+            while ( b * bits < a->capacity )
+                n += __builtin_popcountl( a->marked[b++] );
+            ::live[i] += n;
+            ::liveBytes[i] += n * a->step;
+            a->unswept = true;
+            blocks++;
             a = a->next;
         }
-        Allocator * s = 0;
-        a = allocators[i];
-        while ( a ) {
-            Allocator * n = a->next;
-            if ( a->taken ) {
-                a->next = s;
-                s = a;
-                blocks++;
-            }
-            else {
-                delete a;
-            }
-            a = n;
-        }
-        allocators[i] = s;
         i++;
     }
-    gettimeofday( &afterSweep, 0 );
+    ::sweepCursor = 0;
+    gettimeofday( &afterMark, 0 );
 
-    uint timeToMark = 0;
     uint timeToSweep = 0;
+    uint timeToMark = 0;
     if ( start.tv_sec ) {
-        timeToMark = ( afterMark.tv_sec - start.tv_sec ) * 1000000 +
-                     ( afterMark.tv_usec - start.tv_usec );
-        timeToSweep = ( afterSweep.tv_sec - afterMark.tv_sec ) * 1000000 +
-                      ( afterSweep.tv_usec - afterMark.tv_usec );
+        timeToSweep = ( afterSweep.tv_sec - start.tv_sec ) * 1000000 +
+                      ( afterSweep.tv_usec - start.tv_usec );
+        timeToMark = ( afterMark.tv_sec - afterSweep.tv_sec ) * 1000000 +
+                     ( afterMark.tv_usec - afterSweep.tv_usec );
     }
+    ::lastPause = timeToMark + timeToSweep;
+    ::lastFreed = freed;
     // dumpRandomObject();
 
     if ( !freed )
@@ -652,19 +741,18 @@ Garbage * Allocator::free( List<Garbage> * entries )
              EString::humanNumber( BlockSize ) +
              " blocks. Recursion depth: " +//
              fn( peak ) + ". Time needed to mark: " +
-             fn( (timeToMark+500)/1000 ) + "ms. To sweep: " +
+             fn( (timeToMark+500)/1000 ) + "ms. To finish sweeping: " +
              fn( (timeToSweep+500)/1000 ) + "ms.",
              Log::Info );
     if ( verbose && total > 8 * 1024 * 1024 ) {
         EString objects;
         i = 0;
         while ( i < 32 ) {
-            uint n = 0;
-            uint max = 0;
+            uint n = ::live[i];
+            uint mapped = 0;
             Allocator * a = allocators[i];
             while ( a ) {
-                n = n + a->taken;
-                max = max + a->capacity;
+                mapped = mapped + a->capacity * a->step;
                 a = a->next;
             }
             if ( n ) {
@@ -672,11 +760,15 @@ Garbage * Allocator::free( List<Garbage> * entries )
                     objects = "Objects:";
                 else
                     objects.append( "," );
-                uint size = allocators[i]->step;
-                objects.append( " size " + fn( size-bytes ) + ": " +
-                                fn( n ) + " (" +
-                                EString::humanNumber( size * n ) + " used, " +
-                                EString::humanNumber( size * max ) +
+                if ( i == LargeClass )
+                    objects.append( " large" );
+                else
+                    objects.append( " size " +
+                                    fn( allocators[i]->step - bytes ) );
+                objects.append( ": " + fn( n ) + " (" +
+                                EString::humanNumber( ::liveBytes[i] ) +
+                                " used, " +
+                                EString::humanNumber( mapped ) +
                                 " allocated)" );
             }
             i++;
@@ -707,6 +799,100 @@ Garbage * Allocator::free( List<Garbage> * entries )
 }
 
 
+/*! Sweeps the allocators for one size class, if the last call to
+    free() left any unswept, and returns true if there is more to
+    sweep. Returns false if there's nothing left to do.
+
+    EventLoop calls this between rounds of I/O, so that the sweep is
+    spread out rather than done while all connections wait.
+*/
+
+bool Allocator::sweepIncrementally()
+{
+    while ( ::sweepCursor < 32 && !allocators[::sweepCursor] )
+        ::sweepCursor++;
+    if ( ::sweepCursor >= 32 )
+        return false;
+    sweep( ::sweepCursor++ );
+    return ::sweepCursor < 32;
+}
+
+
+/*! Returns the number of microseconds the last call to free() took. */
+
+uint Allocator::pauseTime()
+{
+    return ::lastPause;
+}
+
+
+/*! Returns the number of bytes the last call to free() found to be
+    garbage. (The memory is actually reclaimed by the sweep that
+    follows, see sweepIncrementally().)
+*/
+
+uint Allocator::freedBytes()
+{
+    return ::lastFreed;
+}
+
+
+/*! Returns the number of bytes the last call to free() found to be
+    still in use.
+*/
+
+uint Allocator::survivingBytes()
+{
+    return (uint)::total;
+}
+
+
+/*! Returns the number of allocation roots currently registered using
+    addEternal().
+*/
+
+uint Allocator::eternals()
+{
+    uint n = 0;
+    uint i = 0;
+    while ( i < ::numRoots ) {
+        if ( ::roots[i].root )
+            n++;
+        i++;
+    }
+    return n;
+}
+
+
+/*! Sweeps all unswept allocators in size class \a i, and returns
+    those that are left completely empty to the operating system.
+*/
+
+void Allocator::sweep( uint i )
+{
+    Allocator * a = allocators[i];
+    while ( a ) {
+        if ( a->unswept )
+            a->sweep();
+        a = a->next;
+    }
+    Allocator * s = 0;
+    a = allocators[i];
+    while ( a ) {
+        Allocator * n = a->next;
+        if ( a->taken ) {
+            a->next = s;
+            s = a;
+        }
+        else {
+            delete a;
+        }
+        a = n;
+    }
+    allocators[i] = s;
+}
+
+
 /*! Sweeps this allocator, freeing all unmarked memory blocks and
     unmarking all memory blocks.
 */
@@ -734,6 +920,7 @@ void Allocator::sweep()
         b++;
     }
     base = 0;
+    unswept = false;
 }
 
 
@@ -780,12 +967,10 @@ void * Allocator::block( uint i )
 
 uint Allocator::rounded( uint size )
 {
-    uint i = 3;
-    if ( bits == 64 )
-        i = 4;
-    while ( 1UL << i < size + bytes )
-        i++;
-    return (1UL << i) - bytes;
+    uint i = classOf( size + bytes );
+    if ( i == LargeClass )
+        return ( ( size + bytes - 1 ) | 4095 ) + 1 - bytes;
+    return classChunk( i ) - bytes;
 }
 
 
@@ -873,6 +1058,17 @@ uint Allocator::allocated()
 }
 
 
+/*! Returns the number of objects alloc() has allocated since the
+    program started. The count wraps at 2^32, so callers should only
+    use the difference between two calls.
+*/
+
+uint Allocator::allocations()
+{
+    return ::allocations;
+}
+
+
 /*! Returns the number of bytes in use after the last sweep. */
 
 uint Allocator::inUse()
@@ -962,7 +1158,7 @@ uint Allocator::allocatedFromOS()
     while ( i < 32 ) {
         Allocator * a = allocators[i];
         while ( a ) {
-            r += BlockSize;
+            r += ( ( a->capacity * a->step - 1 ) | 4095 ) + 1;
             a = a->next;
         }
         ++i;
@@ -970,3 +1166,104 @@ uint Allocator::allocatedFromOS()
 
     return r;
 }
+
+
+/*! Returns the number of size classes. Each size class is served by
+    its own list of Allocator objects. sizeClass() and liveObjects()
+    describe each class.
+*/
+
+uint Allocator::sizeClasses()
+{
+    return 32;
+}
+
+
+/*! Returns the chunk size used by size class \a i, or 0 if the class
+    isn't in use. The last class holds large objects of varying size,
+    and sizeClass() always returns 0 for it.
+*/
+
+uint Allocator::sizeClass( uint i )
+{
+    if ( i >= LargeClass || !allocators[i] )
+        return 0;
+    return allocators[i]->step;
+}
+
+
+/*! Returns the number of objects in size class \a i that survived
+    the last call to free(). The count is cheap to produce, since
+    free() takes it from the mark bitmaps.
+*/
+
+uint Allocator::liveObjects( uint i )
+{
+    if ( i >= 32 )
+        return 0;
+    return ::live[i];
+}
+
+
+/*! Returns the number of bytes used by the objects in size class \a
+    i that survived the last call to free().
+*/
+
+uint Allocator::liveBytes( uint i )
+{
+    if ( i >= 32 )
+        return 0;
+    return ::liveBytes[i];
+}
+
+
+/*! Returns a description of the heap as it was after the last call
+    to free(), suitable for logging: One line for each size class in
+    use, and one for each root that reaches a noticeable part of the
+    heap.
+*/
+
+EStringList * Allocator::profile()
+{
+    EStringList * r = new EStringList;
+    uint i = 0;
+    while ( i < 32 ) {
+        Allocator * a = allocators[i];
+        uint mapped = 0;
+        while ( a ) {
+            mapped = mapped + a->capacity * a->step;
+            a = a->next;
+        }
+        if ( allocators[i] ) {
+            EString l;
+            if ( i == LargeClass )
+                l = "Large objects: ";
+            else
+                l = "Size " + fn( allocators[i]->step - bytes ) + ": ";
+            r->append( l + fn( ::live[i] ) + " live objects (" +
+                       EString::humanNumber( ::liveBytes[i] ) +
+                       " used, " +
+                       EString::humanNumber( mapped ) +
+                       " allocated)" );
+        }
+        i++;
+    }
+    i = 0;
+    while ( i < numRoots ) {
+        if ( roots[i].root && roots[i].size >= (uint)total / 100 &&
+             roots[i].objects ) {
+            EString l = "Root ";
+            l.appendNumber( i );
+            l.append( " (" );
+            l.append( roots[i].name );
+            l.append( ") reaches " );
+            l.appendNumber( roots[i].objects );
+            l.append( " objects, total size " );
+            l.append( EString::humanNumber( roots[i].size ) );
+            l.append( "b" );
+            r->append( l );
+        }
+        i++;
+    }
+    return r;
+}
@@ -21,6 +21,11 @@ public:
     static Allocator * allocator( uint size );
 
     static Garbage * free( List<Garbage> * = 0 );
+    static bool sweepIncrementally();
+    static uint pauseTime();
+    static uint freedBytes();
+    static uint survivingBytes();
+    static uint eternals();
     static void addEternal( const void *, const char * );
 
     static void removeEternal( void * );
@@ -29,6 +34,7 @@ public:
     static void setReporting( bool );
 
     static uint allocated();
+    static uint allocations();
     static uint inUse();
 
     static void * alloc( uint, uint = UINT_MAX );
@@ -45,6 +51,12 @@ public:
 
     static uint allocatedFromOS();
 
+    static uint sizeClasses();
+    static uint sizeClass( uint );
+    static uint liveObjects( uint );
+    static uint liveBytes( uint );
+    static class EStringList * profile();
+
 private:
     typedef unsigned long int ulong;
 
@@ -56,6 +68,7 @@ private:
     ulong * marked;
     void * buffer;
     Allocator * next;
+    bool unswept;
 
     friend void pointers( void * );
     friend class AllocatorMapTable;
@@ -64,6 +77,7 @@ private:
     static void mark( void * );
     static void mark();
     void sweep();
+    static void sweep( uint );
 };
 
 
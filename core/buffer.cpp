@@ -5,6 +5,7 @@
 #include "list.h"
 #include "estring.h"
 #include "allocator.h"
+#include "configuration.h"
 
 // open, O_CREAT|O_RDWR|O_EXCL
 #include <fcntl.h>
@@ -12,6 +13,12 @@
 #include <unistd.h>
 // strlen, memmove
 #include <string.h>
+// writev, struct iovec
+#include <sys/uio.h>
+// IOV_MAX
+#include <limits.h>
+// clock_gettime
+#include <time.h>
 
 #include <zlib.h>
 
@@ -19,6 +26,32 @@
 static const uint bufsiz = 8192;
 static char buffer[bufsiz];
 
+// strings at least this long are referenced rather than copied by
+// append(), if possible
+static const uint referenceLimit = 16384;
+
+#if !defined( IOV_MAX )
+#define IOV_MAX 16
+#endif
+static struct iovec iov[IOV_MAX];
+
+// true while the event loop has more work than it can comfortably do
+static bool busy;
+
+// adaptive compression looks at the output of this many input bytes
+// before deciding whether the data compresses well
+static const uint adaptWindow = 65536;
+
+
+// returns the CPU time used by this thread, in microseconds
+static int64 cpuTime()
+{
+    struct timespec t;
+    if ( ::clock_gettime( CLOCK_THREAD_CPUTIME_ID, &t ) < 0 )
+        return 0;
+    return (int64)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
 
 
 /*! \class Buffer buffer.h
@@ -41,7 +74,9 @@ static char buffer[bufsiz];
 Buffer::Buffer()
     : filter( None ), zs( 0 ),
       firstused( 0 ), firstfree( 0 ),
-      bytes( 0 )
+      bytes( 0 ), level( 9 ),
+      zin( 0 ), zout( 0 ), zcpu( 0 ),
+      win( 0 ), wout( 0 ), incompressible( false )
 {
 }
 
@@ -72,26 +107,37 @@ void Buffer::append( const char * s, uint l, bool f )
 
     switch ( filter ) {
     case Compressing:
-        zs->avail_in = l;
-        zs->next_in = (Bytef*)s;
-        while ( zs->avail_in && progress && r == Z_OK ) {
-            zs->next_out = (Bytef*)buffer;
-            zs->avail_out = bufsiz;
-            r = ::deflate( zs, Z_NO_FLUSH );
-            if ( zs->avail_out < bufsiz )
-                append2( buffer, bufsiz - zs->avail_out );
-            else
-                progress = false;
-        }
-        if ( f ) {
-            zs->next_out = (Bytef*)buffer;
-            zs->avail_out = bufsiz;
-            r = ::deflate( zs, Z_SYNC_FLUSH );
-            if ( zs->avail_out < bufsiz )
-                append2( buffer, bufsiz - zs->avail_out );
-        }
-        if ( zs->avail_in ) {
-            // should not happen
+        {
+            int64 started = cpuTime();
+            uint before = bytes;
+            zs->avail_in = l;
+            zs->next_in = (Bytef*)s;
+            while ( zs->avail_in && progress && r == Z_OK ) {
+                zs->next_out = (Bytef*)buffer;
+                zs->avail_out = bufsiz;
+                r = ::deflate( zs, Z_NO_FLUSH );
+                if ( zs->avail_out < bufsiz )
+                    append2( buffer, bufsiz - zs->avail_out );
+                else
+                    progress = false;
+            }
+            if ( f ) {
+                zs->next_out = (Bytef*)buffer;
+                zs->avail_out = bufsiz;
+                r = ::deflate( zs, Z_SYNC_FLUSH );
+                if ( zs->avail_out < bufsiz )
+                    append2( buffer, bufsiz - zs->avail_out );
+            }
+            if ( zs->avail_in ) {
+                // should not happen
+            }
+            zcpu += cpuTime() - started;
+            zin += l;
+            zout += bytes - before;
+            win += l;
+            wout += bytes - before;
+            if ( f )
+                adaptCompression();
         }
         break;
 
@@ -167,12 +213,53 @@ void Buffer::append2( const char * s, uint l )
 
 /*! \overload
     Appends the EString \a s to a Buffer.
+
+    If \a s is large, and this Buffer doesn't compress, \a s is
+    referenced rather than copied, as for appendReference().
 */
 
 void Buffer::append( const EString &s )
 {
-    if ( s.length() > 0 )
+    if ( s.length() >= referenceLimit && filter == None )
+        appendReference( s );
+    else if ( s.length() > 0 )
+        append( s.data(), s.length() );
+}
+
+
+/*! Appends \a s to the Buffer without copying its contents. The
+    Buffer keeps a shallow copy of \a s, so the caller may go on
+    using \a s as usual; EString detaches before modifying shared
+    data.
+
+    If the Buffer compresses or decompresses, the data has to pass
+    through zlib and so this function copies.
+*/
+
+void Buffer::appendReference( const EString &s )
+{
+    if ( s.isEmpty() )
+        return;
+    if ( filter != None ) {
         append( s.data(), s.length() );
+        return;
+    }
+
+    Vector * f = new Vector;
+    f->ref = s;
+    f->base = (char*)f->ref.data();
+    f->len = f->ref.length();
+
+    // only the last vector may be partly used, so the current last
+    // vector has to be trimmed to its contents
+    if ( vecs.isEmpty() )
+        firstused = 0;
+    else if ( firstfree < vecs.lastElement()->len )
+        vecs.lastElement()->len = firstfree;
+
+    vecs.append( f );
+    firstfree = f->len;
+    bytes += f->len;
 }
 
 
@@ -201,22 +288,40 @@ void Buffer::write( int fd )
 {
     int written = 1;
 
-    while ( written > 0 ) {
-        Vector * v = vecs.firstElement();
-
-        int max = 0;
-        if ( v )
-            max = v->len;
-        if ( vecs.count() == 1 )
-            max = firstfree;
-        int n = max - firstused;
+    while ( written > 0 && bytes > 0 ) {
+        // gather up to IOV_MAX vectors and write them with one
+        // syscall
+        uint n = 0;
+        uint total = 0;
+        List< Vector >::Iterator it( vecs );
+        while ( it && n < IOV_MAX ) {
+            Vector * v = it;
+            ++it;
+            uint start = 0;
+            uint end = v->len;
+            if ( n == 0 )
+                start = firstused;
+            if ( !it )
+                end = firstfree;
+            if ( end > start ) {
+                iov[n].iov_base = v->base + start;
+                iov[n].iov_len = end - start;
+                total += end - start;
+                n++;
+            }
+        }
 
-        if ( n <= 0 || !v )
+        if ( n == 0 )
             written = 0;
+        else if ( n == 1 )
+            written = ::write( fd, iov[0].iov_base, iov[0].iov_len );
         else
-            written = ::write( fd, v->base+firstused, n );
+            written = ::writev( fd, iov, n );
         if ( written > 0 )
             remove( written );
+        // if the kernel didn't take everything, it's full
+        if ( written > 0 && (uint)written < total )
+            written = 0;
     }
 }
 
@@ -241,7 +346,7 @@ void Buffer::remove( uint n )
     if ( bytes == 0 ) {
         firstused = firstfree = 0;
         vecs.clear();
-        if ( v && ( v->len > 100 && v->len < 20000 ) )
+        if ( v && v->ref.isEmpty() && ( v->len > 100 && v->len < 20000 ) )
             vecs.append( v );
         return;
     }
@@ -301,13 +406,25 @@ char Buffer::at( uint i ) const
 EString Buffer::string( uint num ) const
 {
     EString result;
+    appendTo( result, num );
+    return result;
+}
+
+
+/*! Appends the first \a num bytes in the buffer (or all of them, if
+    there are fewer) to \a target. This function does not remove()
+    the data.
+*/
+
+void Buffer::appendTo( EString & target, uint num ) const
+{
     uint n = size();
 
     if ( n == 0 )
-        return result;
+        return;
     if ( num < n )
         n = num;
-    result.reserve( n );
+    target.reserve( target.length() + n );
 
     List< Vector >::Iterator it( vecs );
     Vector *v = it;
@@ -322,18 +439,16 @@ EString Buffer::string( uint num ) const
     if ( copied > n )
         copied = n;
 
-    result.append( v->base + firstused, copied );
+    target.append( v->base + firstused, copied );
 
     while ( copied < n ) {
         v = ++it;
         uint l = v->len;
         if ( copied + l > n )
             l = n - copied;
-        result.append( v->base, l );
+        target.append( v->base, l );
         copied += l;
     }
-
-    return result;
 }
 
 
@@ -347,27 +462,59 @@ EString Buffer::string( uint num ) const
 
 EString * Buffer::removeLine( uint s )
 {
-    uint i = 0, n = 0;
-    EString * r;
+    EString * r = new EString;
+    if ( !removeLine( *r, s ) )
+        return 0;
+    return r;
+}
 
+
+/*! This version of removeLine() appends the line to \a line instead
+    of allocating a new string, and returns true if there was a
+    complete line of at most \a s bytes and false if not. \a line is
+    not modified if false is returned.
+*/
+
+bool Buffer::removeLine( EString & line, uint s )
+{
     if ( s == 0 || s > size() )
         s = size();
 
-    while ( i < s && (*this)[i] != '\012' )
-        i++;
+    // look for the LF using memchr() on each vector in turn;
+    // operator[] would have to find the right vector for each byte
+    uint i = 0;
+    uint offset = firstused;
+    bool found = false;
+    List< Vector >::Iterator it( vecs );
+    while ( it && i < s && !found ) {
+        uint l = it->len - offset;
+        if ( l > s - i )
+            l = s - i;
+        const char * b = it->base + offset;
+        const char * lf = (const char *)memchr( b, '\012', l );
+        if ( lf ) {
+            i += lf - b;
+            found = true;
+        }
+        else {
+            i += l;
+            offset = 0;
+            ++it;
+        }
+    }
 
-    if ( i == s )
-        return 0;
+    if ( !found )
+        return false;
 
-    n = 1;
+    uint n = 1;
     if ( i > 0 && (*this)[i-1] == '\015' ) {
         i--;
         n++;
     }
 
-    r = new EString( string( i ) );
+    appendTo( line, i );
     remove( i+n );
-    return r;
+    return true;
 }
 
 
@@ -384,9 +531,13 @@ void Buffer::setCompression( Compression c )
     zs->zalloc = 0;
     zs->zfree = 0;
     zs->opaque = 0;
-    if ( c == Compressing )
-        ::deflateInit2( zs, 9, Z_DEFLATED,
+    if ( c == Compressing ) {
+        level = Configuration::scalar( Configuration::DeflateLevel );
+        if ( level > 9 )
+            level = 9;
+        ::deflateInit2( zs, level, Z_DEFLATED,
                         -15, 9, Z_DEFAULT_STRATEGY );
+    }
     else if ( c == Decompressing )
         ::inflateInit2( zs, -15 );
     filter = c;
@@ -403,6 +554,103 @@ Buffer::Compression Buffer::compression() const
 }
 
 
+/*! Returns the size of the compressed output as a percentage of the
+    input, or 100 if nothing has been compressed. Only meaningful if
+    compression() is Compressing.
+*/
+
+uint Buffer::compressionRatio() const
+{
+    if ( !zin )
+        return 100;
+    return (uint)( ( zout * 100 + zin / 2 ) / zin );
+}
+
+
+/*! Returns the number of microseconds of CPU time spent compressing
+    data for this Buffer.
+*/
+
+uint Buffer::compressionTime() const
+{
+    return (uint)zcpu;
+}
+
+
+/*! Records whether the server is \a busy. If the adaptive-deflate
+    toggle is set, a compressing Buffer uses the fastest compression
+    level while the server is busy, so that a few large responses
+    don't starve everyone else.
+*/
+
+void Buffer::setBusy( bool busy )
+{
+    ::busy = busy;
+}
+
+
+/*! This private helper looks at what recent input compressed to,
+    and changes the deflate level if adaptive-deflate
+    is enabled.
+
+    If the past adaptWindow bytes compressed to more than 90% of their
+    size, the data is most likely already compressed (an image or zip
+    attachment, say), and spending CPU on it is a waste. In that case,
+    or if the server is busy, level 1 is used until the data is
+    compressible again and the server has time to spare.
+
+    This is only called right after a Z_SYNC_FLUSH, when changing the
+    level cannot produce more than a few bytes of output.
+*/
+
+void Buffer::adaptCompression()
+{
+    if ( !Configuration::toggle( Configuration::AdaptiveDeflate ) )
+        return;
+
+    if ( win >= adaptWindow ) {
+        incompressible = ( (int64)wout * 10 > (int64)win * 9 );
+        win = 0;
+        wout = 0;
+    }
+
+    uint target = Configuration::scalar( Configuration::DeflateLevel );
+    if ( target > 9 )
+        target = 9;
+    if ( ( busy || incompressible ) && target > 1 )
+        target = 1;
+    if ( target == level )
+        return;
+
+    zs->avail_in = 0;
+    zs->next_out = (Bytef*)buffer;
+    zs->avail_out = bufsiz;
+    if ( ::deflateParams( zs, target, Z_DEFAULT_STRATEGY ) != Z_OK )
+        return;
+    if ( zs->avail_out < bufsiz ) {
+        zout += bufsiz - zs->avail_out;
+        append2( buffer, bufsiz - zs->avail_out );
+    }
+    level = target;
+}
+
+
+/*! Frees the storage an empty Buffer keeps for reuse. remove()
+    keeps the last Vector when the Buffer becomes empty, which saves
+    an allocation when more data arrives soon, and is a waste of
+    memory for a connection which sees no traffic for minutes or
+    hours. If the Buffer isn't empty, this function does nothing.
+*/
+
+void Buffer::release()
+{
+    if ( bytes )
+        return;
+    vecs.clear();
+    firstused = firstfree = 0;
+}
+
+
 /*! Zlib needs to be closed down properly; it will not fit properly
     into garbage collections.
 */
@@ -5,10 +5,9 @@
 
 #include "global.h"
 #include "list.h"
+#include "estring.h"
 
 
-class EString;
-
 
 class Buffer
     : public Garbage
@@ -19,9 +18,14 @@ public:
     enum Compression{ None, Compressing, Decompressing };
     void setCompression( Compression );
     Compression compression() const;
+    uint compressionRatio() const;
+    uint compressionTime() const;
+
+    static void setBusy( bool );
 
     void append( const EString & );
     void append( const char *, uint );
+    void appendReference( const EString & );
 
     void read( int );
     void write( int );
@@ -29,7 +33,9 @@ public:
     uint size() const { return bytes; }
     void remove( uint );
     EString string( uint ) const;
+    void appendTo( EString &, uint ) const;
     EString * removeLine( uint = 0 );
+    bool removeLine( EString &, uint = 0 );
 
     char operator[]( uint i ) const {
         if ( i >= bytes )
@@ -44,6 +50,7 @@ public:
     }
 
     void close();
+    void release();
 
 private:
     char at( uint ) const;
@@ -51,6 +58,7 @@ private:
 private:
     void append( const char *, uint, bool );
     void append2( const char *, uint );
+    void adaptCompression();
 
     struct Vector
         : public Garbage
@@ -59,6 +67,7 @@ private:
             setFirstNonPointer( &len );
         }
         char *base;
+        EString ref;
         // no pointers after this line
         uint len;
     };
@@ -68,6 +77,10 @@ private:
     struct z_stream_s * zs;
     uint firstused, firstfree;
     uint bytes;
+    uint level;
+    int64 zin, zout, zcpu;
+    uint win, wout;
+    bool incompressible;
 };
 
 
@@ -7,6 +7,7 @@
 
 
 static List<Cache> * caches;
+static uint clears;
 
 
 /*! \class Cache cache.h
@@ -22,7 +23,12 @@ static List<Cache> * caches;
 
     Subclasses of Cache have to provide cache insertion and
     retrieval. This class provides only one bit of core functionality,
-    namely clearing the cache at GC time.
+    namely clearing (or shrinking, see shrink()) the cache at GC time.
+
+    A subclass that can estimate the memory it uses may implement
+    cost() and call setBudget(). Such a cache isn't cleared every few
+    collections, but shrunk whenever it costs more than its budget, no
+    matter how often garbage is collected for other reasons.
 */
 
 
@@ -37,7 +43,7 @@ static List<Cache> * caches;
 */
 
 Cache::Cache( uint f )
-    : Garbage(), factor( f ), n( 0 )
+    : Garbage(), factor( f ), n( 0 ), bytes( 0 )
 {
     if ( !::caches ) {
         ::caches = new List<Cache>;
@@ -62,6 +68,7 @@ Cache::~Cache()
 /*! Calls clear() for each currently extant Cache. Called from
     Allocator::free(). If \a harder is set, then all caches are
     cleared completely, no matter how high their duration factors are.
+    Otherwise, caches with a budget() are shrunk if they exceed it.
 */
 
 void Cache::clearAllCaches( bool harder)
@@ -71,14 +78,118 @@ void Cache::clearAllCaches( bool harder)
         Cache * c = i;
         ++i;
         c->n++;
-        if ( harder || c->n > c->factor ) {
+        if ( harder ) {
             c->n = 0;
+            ::clears++;
             c->clear(); // careful: no iterator pointing to c meanwhile
         }
+        else if ( c->bytes ) {
+            c->n = 0;
+            if ( c->cost() > c->bytes ) {
+                ::clears++;
+                c->shrink();
+            }
+        }
+        else if ( c->n > c->factor ) {
+            c->n = 0;
+            ::clears++;
+            c->shrink();
+        }
+    }
+}
+
+
+/*! Calls reconfigure() for each currently extant Cache. Called
+    when the configuration has been reread.
+*/
+
+void Cache::reconfigureAll()
+{
+    List<Cache>::Iterator i( ::caches );
+    while ( i ) {
+        i->reconfigure();
+        ++i;
     }
 }
 
 
+/*! Returns the number of times clearAllCaches() has cleared or shrunk
+    a cache since the program started.
+*/
+
+uint Cache::clears()
+{
+    return ::clears;
+}
+
+
 /*! \fn virtual void Cache::clear() = 0;
     Implemented by subclasses to discards the contents of the cache.
 */
+
+
+/*! Called by clearAllCaches() once every few garbage collections (see
+    the constructor) to let the cache release memory. The default
+    implementation calls clear(). Subclasses that know what their
+    contents cost may instead discard only what exceeds their budget.
+*/
+
+void Cache::shrink()
+{
+    clear();
+}
+
+
+/*! Returns an estimate of the number of bytes used by the objects in
+    this cache. The default implementation returns 0, meaning that the
+    cost isn't known.
+*/
+
+uint Cache::cost() const
+{
+    return 0;
+}
+
+
+/*! Called by reconfigureAll() after the configuration has been
+    reread, so that a cache can e.g. set a new budget. The default
+    implementation does nothing.
+*/
+
+void Cache::reconfigure()
+{
+}
+
+
+/*! Instructs clearAllCaches() to shrink() this cache whenever its
+    cost() exceeds \a limit bytes, rather than every few garbage
+    collections. 0 (the default) restores the duration factor given
+    to the constructor.
+*/
+
+void Cache::setBudget( uint limit )
+{
+    bytes = limit;
+}
+
+
+/*! Returns the budget set by setBudget(), or 0 if there is none. */
+
+uint Cache::budget() const
+{
+    return bytes;
+}
+
+
+/*! Returns the sum of cost() for all current caches. */
+
+uint Cache::totalCost()
+{
+    uint t = 0;
+    List<Cache>::Iterator i( ::caches );
+    while ( i ) {
+        t += i->cost();
+        ++i;
+    }
+    return t;
+}
@@ -14,12 +14,23 @@ public:
     virtual ~Cache();
 
     static void clearAllCaches( bool );
+    static void reconfigureAll();
+    static uint clears();
 
     virtual void clear() = 0;
+    virtual void shrink();
+    virtual uint cost() const;
+    virtual void reconfigure();
+
+    void setBudget( uint );
+    uint budget() const;
+
+    static uint totalCost();
 
 private:
     uint factor;
     uint n;
+    uint bytes;
 };
 
 
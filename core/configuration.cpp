@@ -22,6 +22,8 @@
 #include <errno.h>
 // memmove()
 #include <string.h>
+// open(), openat()
+#include <fcntl.h>
 
 
 class ConfigurationData
@@ -53,9 +55,28 @@ public:
             return true;
         return false;
     }
+    void setSeen( const EString & s, bool b )
+    {
+        EStringList::Iterator i( seen );
+        while ( i && *i != s )
+            ++i;
+        if ( i && !b )
+            seen.take( i );
+        else if ( !i && b )
+            seen.append( s );
+    }
 };
 
 
+// the file read by setup(), and the directory containing it, opened
+// by retainDirectory() so that reread() works after chroot().
+
+static EString * fileName = 0;
+static EString * baseName = 0;
+static int directory = -1;
+static bool ipv6Guessed = false;
+
+
 /*! \class Configuration configuration.h
     The Configuration class contains all configuration variables.
 
@@ -119,7 +140,16 @@ void Configuration::read( const EString & file, bool allowFailure )
 
     log( "Using configuration file " + file, Log::Debug );
 
-    EString buffer( f.contents() );
+    parse( f.contents() );
+}
+
+
+/*! Parses \a buffer, which contains the lines of a configuration
+    file, and adds each variable to the configuration data.
+*/
+
+void Configuration::parse( const EString & buffer )
+{
     // we now want to loop across buffer, picking up entire lines and
     // parsing them as variables.
     uint i = 0;
@@ -163,8 +193,40 @@ static struct {
     { "undelete-time", Configuration::UndeleteTime, 49 },
     { "smarthost-port", Configuration::SmartHostPort, 25 },
     { "statistics-port", Configuration::StatisticsPort, 17220 },
+    { "metrics-port", Configuration::MetricsPort, 17221 },
     { "ldap-server-port", Configuration::LdapServerPort, 390 },
-    { "memory-limit", Configuration::MemoryLimit, 64 }
+    { "memory-limit", Configuration::MemoryLimit, 64 },
+    { "db-min-handles", Configuration::DbMinHandles, 1 },
+    { "db-max-queue-wait", Configuration::DbMaxQueueWait, 100 },
+    { "db-max-query-wait", Configuration::DbMaxQueryWait, 60 },
+    { "db-slow-query-time", Configuration::DbSlowQueryTime, 2000 },
+    { "db-group-commit", Configuration::DbGroupCommit, 0 },
+    { "injection-batch-size", Configuration::InjectionBatchSize, 32 },
+    { "compress-bodyparts", Configuration::CompressBodyparts, 0 },
+    { "blob-threshold", Configuration::BlobThreshold, 1048576 },
+    { "shared-cache-size", Configuration::SharedCacheSize, 0 },
+    { "change-journal-window", Configuration::ChangeJournalWindow, 100000 },
+    { "deflate-level", Configuration::DeflateLevel, 9 },
+    { "smarthost-connections", Configuration::SmartHostConnections, 4 },
+    { "mx-connections", Configuration::MxConnections, 2 },
+    { "direct-deliveries", Configuration::DirectDeliveries, 16 },
+    { "smtp-max-connections", Configuration::SmtpMaxConnections, 256 },
+    { "smtp-connection-rate", Configuration::SmtpConnectionRate, 60 },
+    { "smtp-tarpit", Configuration::SmtpTarpit, 15 },
+    { "db-reserved-handles", Configuration::DbReservedHandles, 1 },
+    { "imap-slow-command-time", Configuration::ImapSlowCommandTime, 5000 },
+    { "logfile-size", Configuration::LogfileSize, 0 },
+    { "trace-sampling", Configuration::TraceSampling, 1 },
+    { "event-loop-stall-time", Configuration::EventLoopStallTime, 500 },
+    { "tls-session-lifetime", Configuration::TlsSessionLifetime, 3600 },
+    { "password-hash-threads", Configuration::PasswordHashThreads, 2 },
+    { "ldap-connections", Configuration::LdapConnections, 4 },
+    { "ldap-cache-lifetime", Configuration::LdapCacheLifetime, 60 },
+    { "db-max-client-queries", Configuration::DbMaxClientQueries, 8 },
+    { "reparse-batch-size", Configuration::ReparseBatchSize, 256 },
+    { "drain-time", Configuration::DrainTime, 120 },
+    { "message-cache-size", Configuration::MessageCacheSize, 0 },
+    { "cluster-port", Configuration::ClusterPort, 17222 }
 };
 
 
@@ -211,7 +273,15 @@ static struct {
     { "smarthost-address", Configuration::SmartHostAddress, "127.0.0.1" },
     { "address-separator", Configuration::AddressSeparator, "" },
     { "statistics-address", Configuration::StatisticsAddress, "127.0.0.1" },
-    { "ldap-server-address", Configuration::LdapServerAddress, "127.0.0.1" }
+    { "metrics-address", Configuration::MetricsAddress, "127.0.0.1" },
+    { "ldap-server-address", Configuration::LdapServerAddress, "127.0.0.1" },
+    { "db-replicas", Configuration::DbReplicas, "" },
+    { "blob-directory", Configuration::BlobDir, "" },
+    { "trace-file", Configuration::TraceFile, "" },
+    { "password-hash", Configuration::PasswordHash, "" },
+    { "mailbox-snapshot", Configuration::MailboxSnapshot, "" },
+    { "cluster-group", Configuration::ClusterGroup, "" },
+    { "cluster-secret", Configuration::ClusterSecret, "" }
 };
 
 
@@ -241,9 +311,18 @@ static struct {
     { "use-sieve", Configuration::UseSieve, true },
     { "use-subaddressing", Configuration::UseSubaddressing, false },
     { "use-statistics", Configuration::UseStatistics, false },
+    { "use-metrics", Configuration::UseMetrics, false },
     { "soft-bounce", Configuration::SoftBounce, true },
     { "check-sender-addresses", Configuration::CheckSenderAddresses, false },
-    { "use-imap-quota", Configuration::UseImapQuota, true }
+    { "use-imap-quota", Configuration::UseImapQuota, true },
+    { "adaptive-deflate", Configuration::AdaptiveDeflate, false },
+    { "direct-delivery", Configuration::DirectDelivery, false },
+    { "use-tls-thread", Configuration::UseTlsThread, false },
+    { "use-kernel-tls", Configuration::UseKernelTls, false },
+    { "use-reuseport", Configuration::UseReusePort, false },
+    { "use-cpu-affinity", Configuration::UseCpuAffinity, false },
+    { "background-reparse", Configuration::BackgroundReparse, false },
+    { "compact-headers", Configuration::CompactHeaders, false }
 };
 
 
@@ -641,11 +720,23 @@ void Configuration::setup( const EString & global, bool allowFailure )
 
     if ( global.isEmpty() )
         return;
-    else if ( global[0] == '/' )
-        read( global, allowFailure );
+
+    if ( !fileName ) {
+        fileName = new EString;
+        baseName = new EString;
+        Allocator::addEternal( fileName, "configuration file name" );
+        Allocator::addEternal( baseName, "configuration file name" );
+    }
+    if ( global[0] == '/' )
+        *fileName = global;
     else
-        read( EString( compiledIn( ConfigDir ) ) + "/" + global,
-              allowFailure );
+        *fileName = EString( compiledIn( ConfigDir ) ) + "/" + global;
+    uint slash = fileName->length();
+    while ( slash > 0 && (*fileName)[slash-1] != '/' )
+        slash--;
+    *baseName = fileName->mid( slash );
+
+    read( *fileName, allowFailure );
 
     EString hn = text( Hostname );
     if ( hn.find( '.' ) < 0 )
@@ -690,6 +781,7 @@ void Configuration::setup( const EString & global, bool allowFailure )
         if ( bad ) {
             log( "Setting default use-ipv6=off", Log::Info );
             add( "use-ipv6 = false" );
+            ipv6Guessed = true;
         }
     }
 }
@@ -767,3 +859,211 @@ List<Configuration::Text> * Configuration::addressVariables()
     }
     return r;
 }
+
+
+// the variables reread() may change in a running server. the others
+// are used only at startup, or to make decisions which cannot be
+// revisited.
+
+static const int reloadableScalars[] = {
+    Configuration::DbMaxHandles,
+    Configuration::DbMinHandles,
+    Configuration::DbHandleInterval,
+    Configuration::DbMaxQueueWait,
+    Configuration::DbMaxQueryWait,
+    Configuration::DbSlowQueryTime,
+    Configuration::DbMaxClientQueries,
+    Configuration::MemoryLimit,
+    Configuration::MessageCacheSize,
+    Configuration::InjectionBatchSize,
+    Configuration::SmtpMaxConnections,
+    Configuration::SmtpConnectionRate,
+    Configuration::SmtpTarpit,
+    Configuration::ImapSlowCommandTime,
+    Configuration::EventLoopStallTime,
+    Configuration::LdapCacheLifetime,
+    Configuration::DeflateLevel,
+    Configuration::DrainTime,
+    -1
+};
+
+static const int reloadableTexts[] = {
+    Configuration::LogLevel,
+    Configuration::TlsCertFile,
+    -1
+};
+
+static const int reloadableToggles[] = {
+    Configuration::SoftBounce,
+    Configuration::CheckSenderAddresses,
+    -1
+};
+
+
+static bool listed( const int * l, uint n )
+{
+    while ( *l >= 0 && *l != (int)n )
+        l++;
+    return *l >= 0;
+}
+
+
+/*! Opens the directory containing the configuration file read by
+    setup(), so that reread() can read the file again after the server
+    has chrooted and given up root.
+
+    Server calls this after closing its inherited files. The file
+    itself is opened anew each time, so that editing it by replacing
+    it works.
+*/
+
+void Configuration::retainDirectory()
+{
+    if ( !fileName )
+        return;
+    if ( directory >= 0 )
+        ::close( directory );
+    EString dir = fileName->mid( 0, fileName->length() - baseName->length() );
+    if ( dir.isEmpty() )
+        dir = ".";
+    directory = ::open( dir.cstr(), O_RDONLY | O_DIRECTORY );
+}
+
+
+/*! Reads the configuration file again, and applies those variables
+    which can safely be changed in a running server, e.g. db-max-handles,
+    memory-limit, message-cache-size, log-level and tls-certificate.
+    Changes to other variables are logged and ignored until the server
+    is restarted.
+
+    If the file cannot be read or contains serious errors, the current
+    configuration is kept. Returns true if the file was reread, and
+    false if not.
+
+    The caller is responsible for making the subsystems that cache
+    configuration values, e.g. the log level, pick up the new values.
+*/
+
+bool Configuration::reread()
+{
+    if ( !fileName || directory < 0 ) {
+        ::log( "Cannot reread the configuration file", Log::Error );
+        return false;
+    }
+
+    int fd = ::openat( directory, baseName->cstr(), O_RDONLY );
+    if ( fd < 0 ) {
+        ::log( "Cannot reread configuration file " + *fileName +
+               " (error " + fn( errno ) + ")", Log::Error );
+        return false;
+    }
+    EString contents;
+    char buffer[4096];
+    int n = ::read( fd, buffer, sizeof( buffer ) );
+    while ( n > 0 ) {
+        contents.append( buffer, n );
+        n = ::read( fd, buffer, sizeof( buffer ) );
+    }
+    ::close( fd );
+
+    ConfigurationData * old = d;
+    d = new ConfigurationData;
+    parse( contents );
+    if ( ipv6Guessed && !present( UseIPv6 ) )
+        add( "use-ipv6 = false" );
+    ConfigurationData * current = d;
+    d = old;
+
+    bool bad = false;
+    List<ConfigurationData::Error>::Iterator e( current->errors );
+    while ( e ) {
+        if ( e->s == Log::Disaster )
+            bad = true;
+        ::log( *fileName + ": " + e->e,
+               e->s == Log::Disaster ? Log::Error : e->s );
+        ++e;
+    }
+    if ( bad ) {
+        ::log( "Keeping the old configuration", Log::Error );
+        return false;
+    }
+    current->errors = 0;
+
+    // variables that cannot change now keep their old values
+    EStringList changed;
+    EStringList ignored;
+    uint i = 0;
+    while ( i < NumScalars ) {
+        EString name( scalarDefaults[i].name );
+        bool was = old->contains( name );
+        bool is = current->contains( name );
+        uint a = was ? old->scalar[i] : scalarDefaults[i].value;
+        uint b = is ? current->scalar[i] : scalarDefaults[i].value;
+        if ( a == b ) {
+            // nothing changed
+        }
+        else if ( listed( reloadableScalars, i ) ) {
+            changed.append( name );
+        }
+        else {
+            ignored.append( name );
+            current->scalar[i] = old->scalar[i];
+            current->setSeen( name, was );
+        }
+        i++;
+    }
+    i = 0;
+    while ( i < NumTexts ) {
+        EString name( textDefaults[i].name );
+        bool was = old->contains( name );
+        bool is = current->contains( name );
+        EString a = was ? old->text[i] : EString( textDefaults[i].value );
+        EString b = is ? current->text[i] : EString( textDefaults[i].value );
+        if ( a == b ) {
+            // nothing changed
+        }
+        else if ( listed( reloadableTexts, i ) ) {
+            changed.append( name );
+        }
+        else {
+            ignored.append( name );
+            current->text[i] = old->text[i];
+            current->setSeen( name, was );
+        }
+        i++;
+    }
+    i = 0;
+    while ( i < NumToggles ) {
+        EString name( toggleDefaults[i].name );
+        bool was = old->contains( name );
+        bool is = current->contains( name );
+        bool a = was ? old->toggle[i] : toggleDefaults[i].value;
+        bool b = is ? current->toggle[i] : toggleDefaults[i].value;
+        if ( a == b ) {
+            // nothing changed
+        }
+        else if ( listed( reloadableToggles, i ) ) {
+            changed.append( name );
+        }
+        else {
+            ignored.append( name );
+            current->toggle[i] = old->toggle[i];
+            current->setSeen( name, was );
+        }
+        i++;
+    }
+
+    Allocator::addEternal( current, "configuration data" );
+    Allocator::removeEternal( old );
+    d = current;
+
+    if ( changed.isEmpty() )
+        ::log( "Reread " + *fileName + "; nothing changed" );
+    else
+        ::log( "Reread " + *fileName + "; changed " +
+               changed.join( ", " ) );
+    if ( !ignored.isEmpty() )
+        ::log( "Restart the server to change " + ignored.join( ", " ),
+               Log::Significant );
+    return true;
+}
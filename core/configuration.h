@@ -55,8 +55,40 @@ public:
         UndeleteTime,
         SmartHostPort,
         StatisticsPort,
+        MetricsPort,
         LdapServerPort,
         MemoryLimit,
+        DbMinHandles,
+        DbMaxQueueWait,
+        DbMaxQueryWait,
+        DbSlowQueryTime,
+        DbGroupCommit,
+        InjectionBatchSize,
+        CompressBodyparts,
+        BlobThreshold,
+        SharedCacheSize,
+        ChangeJournalWindow,
+        DeflateLevel,
+        SmartHostConnections,
+        MxConnections,
+        DirectDeliveries,
+        SmtpMaxConnections,
+        SmtpConnectionRate,
+        SmtpTarpit,
+        DbReservedHandles,
+        ImapSlowCommandTime,
+        LogfileSize,
+        TraceSampling,
+        EventLoopStallTime,
+        TlsSessionLifetime,
+        PasswordHashThreads,
+        LdapConnections,
+        LdapCacheLifetime,
+        DbMaxClientQueries,
+        ReparseBatchSize,
+        DrainTime,
+        MessageCacheSize,
+        ClusterPort,
         // additional scalars go ABOVE THIS LINE
         NumScalars
     };
@@ -101,7 +133,15 @@ public:
         SmartHostAddress,
         AddressSeparator,
         StatisticsAddress,
+        MetricsAddress,
         LdapServerAddress,
+        DbReplicas,
+        BlobDir,
+        TraceFile,
+        PasswordHash,
+        MailboxSnapshot,
+        ClusterGroup,
+        ClusterSecret,
         // additional texts go ABOVE THIS LINE
         NumTexts
     };
@@ -131,9 +171,18 @@ public:
         UseSieve,
         UseSubaddressing,
         UseStatistics,
+        UseMetrics,
         SoftBounce,
         CheckSenderAddresses,
         UseImapQuota,
+        AdaptiveDeflate,
+        DirectDelivery,
+        UseTlsThread,
+        UseKernelTls,
+        UseReusePort,
+        UseCpuAffinity,
+        BackgroundReparse,
+        CompactHeaders,
         // additional toggles go ABOVE THIS LINE
         NumToggles
     };
@@ -147,12 +196,16 @@ public:
 
     static void read( const EString &, bool );
 
+    static void retainDirectory();
+    static bool reread();
+
     static List<Text> * addressVariables();
 
 private:
     static EString osHostname();
 
     static void log( const EString &, Log::Severity );
+    static void parse( const EString & );
 
     static void parseScalar( uint, const EString & );
     static void parseText( uint, const EString & );
@@ -41,13 +41,19 @@ public:
     UDict(): PatriciaTree<T>() {}
 
     T * find( const UString & s ) const {
-        return PatriciaTree<T>::find( (const char *)s.data(), s.length() * 8 * sizeof( uint ) );
+        uint l;
+        const char * k = s.dictKey( &l );
+        return PatriciaTree<T>::find( k, l );
     }
     void insert( const UString & s, T* r ) {
-        PatriciaTree<T>::insert( (const char *)s.data(), s.length() * 8 * sizeof( uint ), r );
+        uint l;
+        const char * k = s.dictKey( &l );
+        PatriciaTree<T>::insert( k, l, r );
     }
     T* remove( const UString & s ) {
-        return PatriciaTree<T>::remove( (const char *)s.data(), s.length() * 8 * sizeof( uint ) );
+        uint l;
+        const char * k = s.dictKey( &l );
+        return PatriciaTree<T>::remove( k, l );
     }
     bool contains( const UString & s ) const {
         return find( s ) != 0;
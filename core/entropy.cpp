@@ -14,6 +14,12 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+// memset()
+#include <string.h>
+
+// time()
+#include <time.h>
+
 
 
 /*! \class Entropy entropy.h
@@ -23,13 +29,164 @@
     When someone in Archiveopteryx needs entropy, Entropy provides it, in
     the form of a string or a number.
 
-    If true entropy isn't available, Entropy provides
-    cryptographically strong pseudorandom numbers.
+    Entropy doesn't read entropy-source for each request. It keys a
+    ChaCha20 keystream generator with 32 bytes from entropy-source,
+    and hands out that keystream, so requests never block and usually
+    cost no system call. After each refill of its output buffer, the
+    generator rekeys itself from its own output, so what was handed
+    out earlier cannot be reconstructed from the state, and it mixes
+    in fresh bytes from entropy-source every few minutes and after
+    each megabyte of output.
 */
 
 
 static int fd = -1;
 
+// the generator's state: the current key, a buffer of keystream
+// (whose first 32 bytes were used for the next key), how much of the
+// buffer has been handed out, and when and how much since the last
+// time entropy-source was read.
+
+static uint32 key[8];
+static unsigned char pool[16 * 64];
+static uint used = sizeof( pool );
+static bool seeded = false;
+static uint sinceSeed = 0;
+static time_t seededAt = 0;
+
+static const uint reseedBytes = 1048576;
+static const uint reseedSeconds = 300;
+
+
+static uint32 rotated( uint32 v, uint n )
+{
+    return ( v << n ) | ( v >> ( 32 - n ) );
+}
+
+
+static void quarterRound( uint32 * x, uint a, uint b, uint c, uint d )
+{
+    x[a] += x[b]; x[d] = rotated( x[d] ^ x[a], 16 );
+    x[c] += x[d]; x[b] = rotated( x[b] ^ x[c], 12 );
+    x[a] += x[b]; x[d] = rotated( x[d] ^ x[a], 8 );
+    x[c] += x[d]; x[b] = rotated( x[b] ^ x[c], 7 );
+}
+
+
+static uint32 littleEndian( const unsigned char * p )
+{
+    return p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( (uint32)p[3] << 24 );
+}
+
+
+// writes the 64-byte ChaCha20 block (RFC 8439) for key and block
+// number n, with an all-zero nonce, to out.
+
+static void block( unsigned char * out, uint32 n )
+{
+    uint32 in[16];
+    in[0] = 0x61707865;
+    in[1] = 0x3320646e;
+    in[2] = 0x79622d32;
+    in[3] = 0x6b206574;
+    uint i = 0;
+    while ( i < 8 ) {
+        in[4 + i] = key[i];
+        i++;
+    }
+    in[12] = n;
+    in[13] = 0;
+    in[14] = 0;
+    in[15] = 0;
+
+    uint32 x[16];
+    memcpy( x, in, sizeof( x ) );
+    i = 0;
+    while ( i < 10 ) {
+        quarterRound( x, 0, 4, 8, 12 );
+        quarterRound( x, 1, 5, 9, 13 );
+        quarterRound( x, 2, 6, 10, 14 );
+        quarterRound( x, 3, 7, 11, 15 );
+        quarterRound( x, 0, 5, 10, 15 );
+        quarterRound( x, 1, 6, 11, 12 );
+        quarterRound( x, 2, 7, 8, 13 );
+        quarterRound( x, 3, 4, 9, 14 );
+        i++;
+    }
+
+    i = 0;
+    while ( i < 16 ) {
+        uint32 v = x[i] + in[i];
+        out[i * 4] = v & 0xff;
+        out[i * 4 + 1] = ( v >> 8 ) & 0xff;
+        out[i * 4 + 2] = ( v >> 16 ) & 0xff;
+        out[i * 4 + 3] = ( v >> 24 ) & 0xff;
+        i++;
+    }
+    memset( x, 0, sizeof( x ) );
+    memset( in, 0, sizeof( in ) );
+}
+
+
+// mixes 32 bytes from entropy-source into the key. Not getting them
+// is fatal the first time, but merely an error later, since the key
+// is still good.
+
+static void seed()
+{
+    unsigned char s[32];
+    int r = -1;
+    if ( fd >= 0 )
+        r = ::read( fd, s, sizeof( s ) );
+    if ( r < (int)sizeof( s ) ) {
+        EString source( Configuration::text( Configuration::EntropySource ) );
+        if ( fd < 0 )
+            ::log( "Entropy requested, but " + source + " is not available",
+                   seeded ? Log::Error : Log::Disaster );
+        else
+            ::log( "Wanted 32 bytes of entropy from " + source +
+                   ", but received only " + fn( r < 0 ? 0 : r ),
+                   seeded ? Log::Error : Log::Disaster );
+        if ( !seeded )
+            die( FD );
+    }
+    else {
+        uint i = 0;
+        while ( i < 8 ) {
+            key[i] ^= littleEndian( s + i * 4 );
+            i++;
+        }
+        seeded = true;
+    }
+    memset( s, 0, sizeof( s ) );
+    sinceSeed = 0;
+    seededAt = time( 0 );
+}
+
+
+// fills the pool with keystream and takes the next key from its
+// start.
+
+static void refill()
+{
+    if ( !seeded || sinceSeed >= reseedBytes ||
+         time( 0 ) >= seededAt + (time_t)reseedSeconds )
+        seed();
+
+    uint n = 0;
+    while ( n < sizeof( pool ) / 64 ) {
+        block( pool + n * 64, n );
+        n++;
+    }
+    uint i = 0;
+    while ( i < 8 ) {
+        key[i] = littleEndian( pool + i * 4 );
+        i++;
+    }
+    memset( pool, 0, sizeof( key ) );
+    used = sizeof( key );
+}
+
 
 /*! Sets up the entropy gatherer. */
 
@@ -40,6 +197,20 @@ void Entropy::setup()
 
     EString source( Configuration::text( Configuration::EntropySource ) );
     fd = ::open( source.cstr(), O_RDONLY );
+    reseed();
+}
+
+
+/*! Makes Entropy read entropy-source again before it provides any
+    more entropy. This must be called in a child process after fork(),
+    or else parent and child would provide the same bytes.
+*/
+
+void Entropy::reseed()
+{
+    seeded = false;
+    memset( pool, 0, sizeof( pool ) );
+    used = sizeof( pool );
 }
 
 
@@ -52,25 +223,17 @@ EString Entropy::asString( uint bytes )
     EString r;
     if ( bytes == 0 )
         return r;
-    if ( fd < 0 ) {
-        EString source( Configuration::text( Configuration::EntropySource ) );
-        ::log( "Entropy requested, but " + source + " is not available",
-               Log::Disaster );
-        die( FD );
-    }
-    uint i = 0;
-    while ( i < bytes ) {
-        r.append( " " );
-        i++;
-    }
-    i = ::read( fd, (void*)(r.data()), bytes );
-    r.truncate( i );
-    if ( i < bytes ) {
-        log( "Wanted " + fn( bytes ) +
-             " bytes of entropy, but received only " + fn( i ),
-             i > 0 ? Log::Error : Log::Disaster );
-        if ( i == 0 )
-            die( FD );
+    r.reserve( bytes );
+    while ( r.length() < bytes ) {
+        if ( used >= sizeof( pool ) )
+            refill();
+        uint n = bytes - r.length();
+        if ( n > sizeof( pool ) - used )
+            n = sizeof( pool ) - used;
+        r.append( (const char *)pool + used, n );
+        memset( pool + used, 0, n );
+        used += n;
+        sinceSeed += n;
     }
     return r;
 }
@@ -11,6 +11,7 @@ class Entropy
 {
 public:
     static void setup();
+    static void reseed();
     static EString asString( uint );
     static uint asNumber( uint );
 };
@@ -40,6 +40,18 @@ void * EStringData::operator new( size_t ownSize, uint extra )
 }
 
 
+// When append() runs out of room in a string that already contains
+// something, it reserves half as much again as the string holds, so
+// that building a long string piece by piece copies each byte only a
+// few times. For small strings, Allocator::rounded() does much the
+// same already.
+
+static inline uint grown( uint length, uint needed )
+{
+    return needed + length / 2;
+}
+
+
 /*! \class EString estring.h
     An email-oriented 8-bit string class.
 
@@ -334,6 +346,35 @@ int EString::find( const EString & s, int i ) const
 }
 
 
+/*! Returns the position of the first line on or after \a i in this
+    string which starts with \a s, or -1 if there is none. A line
+    starts at the beginning of the string and after each CR or LF.
+
+    This uses memchr() to look for the first character of \a s, so
+    it's much faster than looking at each line in turn when \a s is
+    rare, e.g. a MIME boundary in a large base64 bodypart.
+*/
+
+int EString::findLine( const EString & s, int i ) const
+{
+    uint l = s.length();
+    if ( !l || i < 0 )
+        return -1;
+    while ( (uint)i + l <= length() ) {
+        const char * p = (const char *)memchr( d->str + i, s.d->str[0],
+                                               length() - l + 1 - i );
+        if ( !p )
+            return -1;
+        i = p - d->str;
+        if ( ( i == 0 || d->str[i-1] == 10 || d->str[i-1] == 13 ) &&
+             !memcmp( p, s.d->str, l ) )
+            return i;
+        i++;
+    }
+    return -1;
+}
+
+
 /*! Returns section \a n of this string, where a section is defined as
     a run of sequences separated by \a s. If \a s is the empty string
     or \a n is 0, section() returns this entire string. If this string
@@ -375,7 +416,9 @@ void EString::append( const EString & other )
         *this = other;
         return;
     }
-    reserve( length() + other.length() );
+    uint n = length() + other.length();
+    if ( !modifiable() || d->max < n )
+        reserve( grown( length(), n ) );
     memmove( d->str+d->len, other.d->str, other.d->len );
     d->len += other.d->len;
 }
@@ -391,7 +434,9 @@ void EString::append( const char * base, uint num )
     if ( !base || !num )
         return;
 
-    reserve( length() + num );
+    uint n = length() + num;
+    if ( !modifiable() || d->max < n )
+        reserve( grown( length(), n ) );
     memmove( d->str + d->len, base, num );
     d->len += num;
 }
@@ -416,7 +461,8 @@ void EString::append( const char * s )
 
 void EString::append( char c )
 {
-    reserve( length() + 1 );
+    if ( !modifiable() || d->max <= d->len )
+        reserve( grown( length(), length() + 1 ) );
     d->str[d->len] = c;
     d->len++;
 }
@@ -437,21 +483,12 @@ void EString::prepend( const EString & other )
 
 void EString::appendNumber( int n, int base )
 {
-    if ( n < 0 ) {
-        append( '-' );
-        n = -n;
-    }
-    appendNumber( (uint)n, base );
+    appendNumber( (int64)n, (uint)base );
 }
 
 void EString::appendNumber( uint n, int base )
 {
-    EString s( fromNumber( n, base ) );
-
-    if ( n > 0 )
-        append( s );
-    else
-        append( "0" );
+    appendNumber( (int64)n, (uint)base );
 }
 
 /*! Ensures that there is at least \a num bytes available in this
@@ -946,15 +983,7 @@ uint EString::number( bool * ok, uint base ) const
 EString EString::fromNumber( int64 n, uint base )
 {
     EString r;
-    if (0 == n) {
-        r.append("0");        // Short-circuit, 0 is 0 in any base, no need for extra processing
-    } else {
-        if (n < 0) {
-            n = -n;        // Negate, otherwise negative numbers get messed up
-            r.append("-");    // But we remember we need a - sign
-        }
-        r.appendNumber( n, base );
-    }
+    r.appendNumber( n, base );
     return r;
 }
 
@@ -968,17 +997,27 @@ EString EString::fromNumber( int64 n, uint base )
 
 void EString::appendNumber( int64 n, uint base )
 {
-    int64 top = 1;
-    while ( top * base <= n )
-        top = base * top;
-    while ( top ) {
-        uint d = ( n / top ) % base;
-        char  c = '0' + d;
+    // the digits are produced backwards into a buffer big enough for
+    // base 2, then appended in one go
+    char buf[65];
+    uint i = sizeof( buf );
+    // -n would overflow for the smallest int64, so we work on the
+    // magnitude as an unsigned number
+    bool negative = n < 0;
+    unsigned long long int u = n;
+    if ( negative )
+        u = 0 - u;
+    do {
+        uint d = u % base;
+        char c = '0' + d;
         if ( d > 9 )
             c = 'a' + d - 10;
-        append( c );
-        top = top / base;
-    }
+        buf[--i] = c;
+        u = u / base;
+    } while ( u && i > 1 );
+    if ( negative )
+        buf[--i] = '-';
+    append( buf + i, sizeof( buf ) - i );
 }
 
 
@@ -1162,6 +1201,35 @@ static char from64[128] =
 
 
 
+// from64 extended to all byte values, and to64 for each 12-bit value
+// (i.e. two characters), so that de64() and e64() can handle a group
+// of four characters with four and two lookups respectively. made on
+// first use by makeTables().
+
+static unsigned char from64x[256];
+static char to64pairs[8192];
+static bool tables = false;
+static char to64[65] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+static void makeTables()
+{
+    uint i = 0;
+    while ( i < 256 ) {
+        from64x[i] = i < 128 ? from64[i] : 99;
+        i++;
+    }
+    i = 0;
+    while ( i < 4096 ) {
+        to64pairs[i*2] = to64[i >> 6];
+        to64pairs[i*2+1] = to64[i & 63];
+        i++;
+    }
+    tables = true;
+}
+
+
 /*! Decodes this string using the base-64 algorithm and returns the result. */
 
 EString EString::de64() const
@@ -1169,16 +1237,36 @@ EString EString::de64() const
     // this code comes from mailchen, adapted for EString.
     EString result;
     result.reserve( length() * 3 / 4 + 20 ); // 20 = fudge
-    EString body;
+    if ( !tables )
+        makeTables();
+    const unsigned char * in = (const unsigned char *)( d ? d->str : 0 );
+    char * out = result.d->str;
+    uint l = length();
     uint bp = 0;
     uint decoded = 0;
     int m = 0;
     uint p = 0;
     bool done = false;
-    while ( p < length() && !done ) {
-        uint c = d->str[p++];
-        if ( c <= 'z' )
-            c = from64[c];
+    while ( p < l && !done ) {
+        // the common case: four base64 characters at the start of a
+        // group become three bytes.
+        while ( m == 0 && p + 4 <= l ) {
+            uint a = from64x[in[p]];
+            uint b = from64x[in[p+1]];
+            uint c = from64x[in[p+2]];
+            uint e = from64x[in[p+3]];
+            if ( ( a | b | c | e ) >= 64 )
+                break;
+            uint n = ( a << 18 ) | ( b << 12 ) | ( c << 6 ) | e;
+            out[bp++] = n >> 16;
+            out[bp++] = n >> 8;
+            out[bp++] = n;
+            p += 4;
+        }
+        if ( p >= l )
+            break;
+
+        uint c = from64x[in[p++]];
         if ( c < 64 ) {
             switch ( m ) {
             case 0:
@@ -1218,9 +1306,6 @@ EString EString::de64() const
 }
 
 
-static char to64[65] =
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
 /*! Encodes this string using the base-64 algorithm and returns the
     result in lines of at most \a lineLength characters. If \a
     lineLength is not supplied, e64() returns a single line devoid of
@@ -1233,14 +1318,22 @@ EString EString::e64( uint lineLength ) const
     int l = length();
     int i = 0;
     EString r;
-    r.reserve( l*2 );
+    // four characters per three bytes, plus CRLF and padding
+    r.reserve( l*2 + 6 );
+    if ( !tables )
+        makeTables();
+    const unsigned char * in = (const unsigned char *)( d ? d->str : 0 );
+    char * out = r.d->str;
     int p = 0;
     uint c = 0;
     while ( i <= l-3 ) {
-        r.d->str[p++] = to64[ ((d->str[i]>>2))&63 ];
-        r.d->str[p++] = to64[ ((d->str[i]<<4)&48) + ((d->str[i+1]>>4)&15) ];
-        r.d->str[p++] = to64[ ((d->str[i+1]<<2)&60) + ((d->str[i+2]>>6)&3) ];
-        r.d->str[p++] = to64[ (d->str[i+2]&63) ];
+        uint n = ( in[i] << 16 ) | ( in[i+1] << 8 ) | in[i+2];
+        const char * h = to64pairs + ( ( n >> 12 ) << 1 );
+        const char * t = to64pairs + ( ( n & 4095 ) << 1 );
+        out[p++] = h[0];
+        out[p++] = h[1];
+        out[p++] = t[0];
+        out[p++] = t[1];
         i += 3;
         c += 4;
         if ( lineLength > 0 && c >= lineLength ) {
@@ -1274,6 +1367,43 @@ EString EString::e64( uint lineLength ) const
 }
 
 
+/*! Returns the length of e64( \a lineLength ) applied to a string of
+    \a length bytes, without encoding anything. Useful when only the
+    size of the encoded form is needed.
+*/
+
+uint EString::e64Length( uint length, uint lineLength )
+{
+    uint groups = length / 3;
+    uint r = groups * 4;
+    if ( length % 3 )
+        r += 4;
+    if ( !lineLength )
+        return r;
+    // e64() ends a line once it has at least lineLength characters,
+    // and ends the last line only if a full group is on it
+    uint perLine = ( lineLength + 3 ) / 4;
+    r += 2 * ( groups / perLine );
+    if ( groups % perLine )
+        r += 2;
+    return r;
+}
+
+
+// returns the value of the hex digit c, or -1 if c isn't one.
+
+static inline int hexDigit( char c )
+{
+    if ( c >= '0' && c <= '9' )
+        return c - '0';
+    if ( c >= 'A' && c <= 'F' )
+        return c - 'A' + 10;
+    if ( c >= 'a' && c <= 'f' )
+        return c - 'a' + 10;
+    return -1;
+}
+
+
 /*! Decodes this string according to the quoted-printable algorithm,
     and returns the result. Errors are overlooked, to cope with all
     the mail-munging brokenware in the great big world.
@@ -1288,7 +1418,16 @@ EString EString::deQP( bool underscore ) const
     EString r;
     r.reserve( length() );
     while ( i < length() ) {
-        if ( d->str[i] != '=' ) {
+        if ( !underscore && d->str[i] != '=' ) {
+            // copy everything up to the next = in one go
+            const char * e = (const char *)memchr( d->str + i, '=',
+                                                   d->len - i );
+            uint n = e ? e - ( d->str + i ) : d->len - i;
+            memcpy( r.d->str + r.d->len, d->str + i, n );
+            r.d->len += n;
+            i += n;
+        }
+        else if ( d->str[i] != '=' ) {
             char c = d->str[i++];
             if ( underscore && c == '_' )
                 c = ' ';
@@ -1315,7 +1454,12 @@ EString EString::deQP( bool underscore ) const
             }
             else if ( i + 2 < d->len ) {
                 // ... and one common case: a two-digit hex number, not EOL
-                c = mid( i+1, 2 ).number( &ok, 16 );
+                int h = hexDigit( d->str[i+1] );
+                int l = hexDigit( d->str[i+2] );
+                if ( h >= 0 && l >= 0 ) {
+                    c = h * 16 + l;
+                    ok = true;
+                }
             }
 
             // write the proper decoded string and increase i.
@@ -1450,14 +1594,14 @@ EString EString::eQP( bool underscore, bool from ) const
                           ( d->str[i] >= 'a' && d->str[i] <= 'z' ) ||
                           ( d->str[i] >= 'A' && d->str[i] <= 'Z' ) ) ) {
                 r.d->str[r.d->len++] = '=';
-                r.d->str[r.d->len++] = qphexdigits[d->str[i]/16];
-                r.d->str[r.d->len++] = qphexdigits[d->str[i]%16];
+                r.d->str[r.d->len++] = qphexdigits[(uint)(d->str[i]&0xff)>>4];
+                r.d->str[r.d->len++] = qphexdigits[d->str[i]&15];
                 c += 3;
             }
             else if ( from && c == 0 && maybeBoundary( *this, i ) ) {
                 r.d->str[r.d->len++] = '=';
-                r.d->str[r.d->len++] = qphexdigits[d->str[i]/16];
-                r.d->str[r.d->len++] = qphexdigits[d->str[i]%16];
+                r.d->str[r.d->len++] = qphexdigits[(uint)(d->str[i]&0xff)>>4];
+                r.d->str[r.d->len++] = qphexdigits[d->str[i]&15];
                 c += 3;
             }
             else if ( from && c == 0 && d->len >= i + 4 &&
@@ -1465,8 +1609,8 @@ EString EString::eQP( bool underscore, bool from ) const
                       d->str[i+2] == 'o' && d->str[i+3] == 'm' &&
                       d->str[i+4] == ' ' ) {
                 r.d->str[r.d->len++] = '=';
-                r.d->str[r.d->len++] = qphexdigits[d->str[i]/16];
-                r.d->str[r.d->len++] = qphexdigits[d->str[i]%16];
+                r.d->str[r.d->len++] = qphexdigits[(uint)(d->str[i]&0xff)>>4];
+                r.d->str[r.d->len++] = qphexdigits[d->str[i]&15];
                 c += 3;
             }
             else if ( ( d->str[i] >= ' ' && d->str[i] < 127 &&
@@ -1477,8 +1621,8 @@ EString EString::eQP( bool underscore, bool from ) const
             }
             else {
                 r.d->str[r.d->len++] = '=';
-                r.d->str[r.d->len++] = qphexdigits[d->str[i]/16];
-                r.d->str[r.d->len++] = qphexdigits[d->str[i]%16];
+                r.d->str[r.d->len++] = qphexdigits[(uint)(d->str[i]&0xff)>>4];
+                r.d->str[r.d->len++] = qphexdigits[d->str[i]&15];
                 c += 3;
             }
         }
@@ -88,6 +88,7 @@ public:
 
     int find( char, int=0 ) const;
     int find( const EString &, int=0 ) const;
+    int findLine( const EString &, int=0 ) const;
     bool contains( const EString & ) const;
     bool contains( const char ) const;
     bool containsWord( const EString & ) const;
@@ -118,6 +119,7 @@ public:
     EString de64() const;
     EString deUue() const;
     EString e64( uint = 0 ) const;
+    static uint e64Length( uint, uint = 0 );
     EString deQP( bool = false ) const;
     EString eQP( bool = false, bool = false ) const;
     bool needsQP() const;
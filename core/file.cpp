@@ -265,6 +265,27 @@ void File::write( const EString & s )
 }
 
 
+/*! Asks the operating system to commit everything written to this
+    file to disk, and returns when that's done.
+*/
+
+void File::sync()
+{
+    if ( d->fd >= 0 )
+        (void)::fsync( d->fd );
+}
+
+
+/*! Returns the file descriptor of this file, or -1 if it isn't
+    open. The File still owns the descriptor.
+*/
+
+int File::fd() const
+{
+    return d->fd;
+}
+
+
 static EString * root = 0;
 
 /*! Records that the root directory is now \a d. The initial value is
@@ -29,6 +29,8 @@ public:
     uint modificationTime() const;
 
     void write( const EString & );
+    void sync();
+    int fd() const;
 
     static void setRoot( const EString & );
     static EString root();
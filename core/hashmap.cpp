@@ -0,0 +1,78 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "hashmap.h"
+
+
+/*! \class HashMap hashmap.h
+    The HashMap template maps from uint to a pointer, like Map, but
+    keeps its contents in a hash table.
+
+    Map is a PatriciaTree, so find() follows up to 32 pointers to
+    separately allocated nodes. HashMap uses open addressing with
+    linear probing in two flat arrays, so find() usually touches one
+    or two cache lines, and insert() allocates only when the table
+    grows.
+
+    The price is order: HashMap::Iterator visits the objects in no
+    particular order. Code that iterates over a Map and relies on
+    ascending keys (IntegerSet, for example) must keep using Map.
+    HashMap suits caches and lookup tables keyed by database ID,
+    such as MessageCache and the Mailbox tree.
+
+    A null pointer can't be stored; inserting one removes the key.
+    insert() and remove() invalidate all iterators.
+*/
+
+
+/*! \fn HashMap::HashMap()
+    Creates a new empty HashMap. No memory is allocated until the
+    first insert().
+*/
+
+/*! \fn T * HashMap::find( uint i ) const
+    Returns a pointer to the object at index \a i, or a null pointer
+    if there is no such object. This function does not allocate any
+    memory.
+*/
+
+/*! \fn void HashMap::insert( uint i, T * r )
+    Inserts \a r into the HashMap at index \a i, replacing any object
+    already there. If \a r is null, this is equivalent to remove( \a
+    i ). The table doubles in size when it becomes three-quarters
+    full.
+*/
+
+/*! \fn void HashMap::remove( uint i )
+    Removes the object at index \a i from the HashMap, if there is
+    one. This never allocates memory.
+*/
+
+/*! \fn bool HashMap::contains( uint i ) const
+    Returns true if this map has an object at index \a i, and false if
+    not.
+*/
+
+/*! \fn uint HashMap::count() const
+    Returns the number of objects in the HashMap. Unlike Map::count(),
+    this is cheap.
+*/
+
+/*! \fn bool HashMap::isEmpty() const
+    Returns true if the HashMap contains no objects, and false if it
+    contains at least one.
+*/
+
+/*! \fn void HashMap::clear()
+    Removes everything in the map.
+*/
+
+/*! \fn uint HashMap::hash( uint i )
+    Returns a hash of \a i whose low bits depend on all the bits of \a
+    i, so that the sequential IDs common in the database don't cluster
+    in the table.
+*/
+
+/*! \fn void HashMap::resize( uint n )
+    Moves the contents of this map to a new table with \a n slots,
+    which must be a power of two larger than count().
+*/
@@ -0,0 +1,156 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include "global.h"
+#include "allocator.h"
+
+
+template<class T>
+class HashMap
+    : public Garbage
+{
+public:
+    HashMap(): keys( 0 ), values( 0 ), size( 0 ), used( 0 ) {}
+
+    T * find( uint i ) const {
+        if ( !used )
+            return 0;
+        uint m = size - 1;
+        uint h = hash( i ) & m;
+        while ( values[h] ) {
+            if ( keys[h] == i )
+                return values[h];
+            h = ( h + 1 ) & m;
+        }
+        return 0;
+    }
+
+    void insert( uint i, T * r ) {
+        if ( !r ) {
+            remove( i );
+            return;
+        }
+        if ( ( used + 1 ) * 4 > size * 3 )
+            resize( size ? size * 2 : 16 );
+        uint m = size - 1;
+        uint h = hash( i ) & m;
+        while ( values[h] && keys[h] != i )
+            h = ( h + 1 ) & m;
+        if ( !values[h] )
+            used++;
+        keys[h] = i;
+        values[h] = r;
+    }
+
+    void remove( uint i ) {
+        if ( !used )
+            return;
+        uint m = size - 1;
+        uint h = hash( i ) & m;
+        while ( values[h] && keys[h] != i )
+            h = ( h + 1 ) & m;
+        if ( !values[h] )
+            return;
+        values[h] = 0;
+        used--;
+        // move any later entries in the same run back, so that
+        // find() needn't skip over holes
+        uint j = ( h + 1 ) & m;
+        while ( values[j] ) {
+            uint b = hash( keys[j] ) & m;
+            if ( ( j > h && ( b <= h || b > j ) ) ||
+                 ( j < h && ( b <= h && b > j ) ) ) {
+                keys[h] = keys[j];
+                values[h] = values[j];
+                values[j] = 0;
+                h = j;
+            }
+            j = ( j + 1 ) & m;
+        }
+    }
+
+    bool contains( uint i ) const { return find( i ) != 0; }
+
+    uint count() const { return used; }
+    bool isEmpty() const { return used == 0; }
+
+    void clear() {
+        keys = 0;
+        values = 0;
+        size = 0;
+        used = 0;
+    }
+
+    class Iterator
+        : public Garbage
+    {
+    public:
+        Iterator( const HashMap<T> & m ): map( &m ), i( 0 ) { skip(); }
+        Iterator( const HashMap<T> * m ): map( m ), i( 0 ) { skip(); }
+
+        operator bool() { return map && i < map->size; }
+        operator T *() { return *this ? map->values[i] : 0; }
+        T * operator ->() { ok(); return map->values[i]; }
+        T & operator *() { ok(); return *map->values[i]; }
+        Iterator & operator ++() { ok(); i++; skip(); return *this; }
+
+        uint key() { ok(); return map->keys[i]; }
+
+    private:
+        void skip() {
+            while ( map && i < map->size && !map->values[i] )
+                i++;
+        }
+        void ok() {
+            if ( !*this )
+                die( Invariant );
+        }
+
+        const HashMap<T> * map;
+        uint i;
+    };
+
+private:
+    static uint hash( uint i ) {
+        i = ( ( i >> 16 ) ^ i ) * 0x45d9f3b;
+        i = ( ( i >> 16 ) ^ i ) * 0x45d9f3b;
+        return ( i >> 16 ) ^ i;
+    }
+
+    void resize( uint n ) {
+        uint * oldKeys = keys;
+        T ** oldValues = values;
+        uint oldSize = size;
+        keys = (uint*)Allocator::alloc( n * sizeof( uint ), 0 );
+        values = (T**)Allocator::alloc( n * sizeof( T * ) );
+        size = n;
+        used = 0;
+        uint j = 0;
+        while ( j < oldSize ) {
+            if ( oldValues[j] )
+                insert( oldKeys[j], oldValues[j] );
+            j++;
+        }
+        if ( oldKeys ) {
+            Allocator::dealloc( oldKeys );
+            Allocator::dealloc( oldValues );
+        }
+    }
+
+    // operators explicitly undefined because there is no single
+    // correct way to implement them.
+    HashMap< T > &operator =( const HashMap< T > & ) { return *this; }
+    bool operator ==( const HashMap< T > & ) const { return false; }
+    bool operator !=( const HashMap< T > & ) const { return false; }
+
+private:
+    uint * keys;
+    T ** values;
+    uint size;
+    uint used;
+};
+
+
+#endif
@@ -176,3 +176,21 @@ void Log::setLogLevel( Severity s )
 {
     logLevel = s;
 }
+
+
+/*! Returns true if messages with severity \a s are logged, and false
+    if log() would discard them.
+
+    Code that builds a log message by concatenation or formatting can
+    use this to skip the work, e.g.
+
+    \code
+    if ( Log::enabled( Log::Debug ) )
+        log( "Matched " + fn( n ) + " messages", Log::Debug );
+    \endcode
+*/
+
+bool Log::enabled( Severity s )
+{
+    return s >= logLevel;
+}
@@ -8,15 +8,30 @@
 
 #include "../encodings/utf.h"
 
-#include <string.h> // strlen, memmove
+#include <string.h> // strlen, memmove, memcpy
+
+
+// appending to a string that's full makes room for half as much
+// again, like EString, so a long run of append() calls copies the
+// string only a few times.
+
+static inline uint grown( uint length, uint needed )
+{
+    return needed + length / 2;
+}
 
 
 /*! \class UStringData ustring.h
 
     This private helper class contains the actual string data. It has
-    three fields, all accessible only to UString. The only noteworthy
-    field is max, which is 0 in the case of a shared/read-only string,
-    and nonzero in the case of a string which can be modified.
+    four fields, all accessible only to UString. max is 0 in the case
+    of a shared/read-only string, and nonzero in the case of a string
+    which can be modified.
+
+    wide is false if str holds one byte per character, which is the
+    case as long as the string contains only ISO-8859-1 characters,
+    and true if str holds a uint per character. Both len and max count
+    characters, not bytes.
 */
 
 
@@ -28,16 +43,16 @@
 /*! Creates a new EString with \a words capacity. */
 
 UStringData::UStringData( int words )
-    : str( 0 ), len( 0 ), max( words )
+    : str( 0 ), len( 0 ), max( words ), wide( false )
 {
     if ( str )
-        str = (uint*)Allocator::alloc( words*sizeof(uint), 0 );
+        str = (char*)Allocator::alloc( words, 0 );
 }
 
 
 void * UStringData::operator new( size_t ownSize, uint extra )
 {
-    return Allocator::alloc( ownSize + extra*sizeof(uint), 1 );
+    return Allocator::alloc( ownSize + extra, 1 );
 }
 
 
@@ -49,6 +64,13 @@ void * UStringData::operator new( size_t ownSize, uint extra )
     those limited to US-ASCII, but such strings are sparingly
     manipulated.
 
+    Internally, a string uses one byte per character for as long as
+    all its characters are in ISO-8859-1, and switches to four bytes
+    per character when the first character beyond U+00FF is
+    appended. Most header fields, addresses and mailbox names thus
+    use a quarter of the memory they would otherwise use. The
+    representation is not visible through the API.
+
     Most of the functionality of UString is concerned with conversion
     to/from other encodings, such as ISO-8859-15, KOI-U, etc, etc. Other
     functionality is intentionally kept to a minimum, to lighten the
@@ -181,8 +203,24 @@ void UString::append( const UString & other )
         *this = other;
         return;
     }
-    reserve( length() + other.length() );
-    memmove( d->str+d->len, other.d->str, sizeof(uint)*other.d->len );
+    uint n = length() + other.length();
+    if ( other.d->wide && !( d && d->wide ) )
+        widen( n );
+    else if ( !modifiable() || d->max < n )
+        reserve( grown( length(), n ) );
+    if ( d->wide == other.d->wide ) {
+        uint si = d->wide ? sizeof( uint ) : 1;
+        memmove( d->str + d->len * si, other.d->str, other.d->len * si );
+    }
+    else {
+        uint * p = ((uint*)d->str) + d->len;
+        const unsigned char * c = (const unsigned char *)other.d->str;
+        uint i = 0;
+        while ( i < other.d->len ) {
+            p[i] = c[i];
+            i++;
+        }
+    }
     d->len += other.d->len;
 }
 
@@ -191,8 +229,14 @@ void UString::append( const UString & other )
 
 void UString::append( const uint cp )
 {
-    reserve( length() + 1 );
-    d->str[d->len] = cp;
+    if ( cp > 255 && !( d && d->wide ) )
+        widen( length() + 1 );
+    else if ( !modifiable() || d->max <= d->len )
+        reserve( grown( length(), length() + 1 ) );
+    if ( d->wide )
+        ((uint*)d->str)[d->len] = cp;
+    else
+        d->str[d->len] = (char)cp;
     d->len++;
 }
 
@@ -205,9 +249,33 @@ void UString::append( const char * s )
 {
     if ( !s || !*s )
         return;
-    reserve( length() + strlen( s ) );
-    while ( s && *s )
-        d->str[d->len++] = (uint)*s++; // I feel naughty today
+    append( s, strlen( s ) );
+}
+
+
+/*! Appends the \a n ASCII characters at \a s to the end of this
+    string.
+*/
+
+void UString::append( const char * s, uint n )
+{
+    if ( !s || !n )
+        return;
+    if ( !modifiable() || d->max < length() + n )
+        reserve( grown( length(), length() + n ) );
+    if ( !d->wide ) {
+        memcpy( d->str + d->len, s, n );
+    }
+    else {
+        uint * p = ((uint*)d->str) + d->len;
+        const unsigned char * c = (const unsigned char *)s;
+        uint i = 0;
+        while ( i < n ) {
+            p[i] = c[i];
+            i++;
+        }
+    }
+    d->len += n;
 }
 
 
@@ -235,17 +303,19 @@ void UString::reserve( uint num )
 
 void UString::reserve2( uint num )
 {
+    bool wide = d && d->wide;
     const uint std = sizeof( UStringData );
-    const uint si = sizeof( uint );
+    const uint si = wide ? sizeof( uint ) : 1;
     num = ( Allocator::rounded( num * si + std ) - std ) / si;
 
     UStringData * freeable = 0;
     if ( d && d->max )
         freeable = d;
 
-    UStringData * nd = new( num ) UStringData( 0 );
+    UStringData * nd = new( num * si ) UStringData( 0 );
     nd->max = num;
-    nd->str = (uint*)(std + (char*)nd);
+    nd->wide = wide;
+    nd->str = std + (char*)nd;
     if ( d )
         nd->len = d->len;
     if ( nd->len > num )
@@ -259,6 +329,46 @@ void UString::reserve2( uint num )
 }
 
 
+/*! Switches this string to four bytes per character, making room
+    for at least \a num characters, or as many as were reserved. append() calls this when it first
+    sees a character that doesn't fit in one byte.
+*/
+
+void UString::widen( uint num )
+{
+    if ( num < length() )
+        num = length();
+    if ( modifiable() && num < d->max )
+        num = d->max;
+    const uint std = sizeof( UStringData );
+    const uint si = sizeof( uint );
+    num = ( Allocator::rounded( num * si + std ) - std ) / si;
+
+    UStringData * freeable = 0;
+    if ( d && d->max )
+        freeable = d;
+
+    UStringData * nd = new( num * si ) UStringData( 0 );
+    nd->max = num;
+    nd->wide = true;
+    nd->str = std + (char*)nd;
+    if ( d ) {
+        nd->len = d->len;
+        uint * p = (uint*)nd->str;
+        const unsigned char * c = (const unsigned char *)d->str;
+        uint i = 0;
+        while ( i < nd->len ) {
+            p[i] = c[i];
+            i++;
+        }
+    }
+    d = nd;
+
+    if ( freeable )
+        Allocator::dealloc( freeable );
+}
+
+
 /*! Truncates this string to \a l characters. If the string is shorter,
     truncate() does nothing. If \a l is 0 (the default), the string will
     be empty after this function is called.
@@ -284,9 +394,8 @@ bool UString::isAscii() const
         return true;
     uint i = 0;
     while ( i < d->len ) {
-        if ( d->str[i] >= 128 ||
-             ( d->str[i] < 32 &&
-               d->str[i] != 9 && d->str[i] != 10 && d->str[i] != 13 ) )
+        uint c = at( i );
+        if ( c >= 128 || ( c < 32 && c != 9 && c != 10 && c != 13 ) )
             return false;
         i++;
     }
@@ -310,8 +419,9 @@ EString UString::ascii() const
     r.reserve( length() );
     uint i = 0;
     while ( i < length() ) {
-        if ( d->str[i] >= ' ' && d->str[i] < 127 )
-            r.append( (char)(d->str[i]) );
+        uint c = at( i );
+        if ( c >= ' ' && c < 127 )
+            r.append( (char)c );
         else
             r.append( '?' );
         i++;
@@ -342,7 +452,8 @@ UString UString::mid( uint start, uint num ) const
 
     d->max = 0;
     result.d = new UStringData;
-    result.d->str = d->str + start;
+    result.d->wide = d->wide;
+    result.d->str = d->str + start * ( d->wide ? sizeof( uint ) : 1 );
     result.d->len = num;
     return result;
 }
@@ -395,7 +506,7 @@ UString UString::simplified() const
     uint i = 0;
     uint first = 0;
     while ( i < length() && first == i ) {
-        if ( isSpace( d->str[i] ) )
+        if ( isSpace( at( i ) ) )
             first++;
         i++;
     }
@@ -407,7 +518,7 @@ UString UString::simplified() const
     uint spaces = 0;
     bool identity = true;
     while ( identity && i < length() ) {
-        if ( isSpace( d->str[i] ) ) {
+        if ( isSpace( at( i ) ) ) {
             spaces++;
         }
         else {
@@ -428,7 +539,7 @@ UString UString::simplified() const
     bool ogham = false;
     bool zwnbsp = true;
     while ( i < length() ) {
-        int c = d->str[i];
+        int c = at( i );
         if ( isSpace( c ) ) {
             if ( c == 0x1680 )
                 ogham = true;
@@ -466,7 +577,7 @@ UString UString::trimmed() const
     uint first = length();
     uint last = 0;
     while ( i < length() ) {
-        if ( !isSpace( d->str[i] ) ) {
+        if ( !isSpace( at( i ) ) ) {
             if ( i < first )
                 first = i;
             if ( i > last )
@@ -513,7 +624,7 @@ int UString::compare( const UString & other ) const
         return 0;
     uint i = 0;
     while ( i < length() && i < other.length() &&
-            d->str[i] == other.d->str[i] )
+            at( i ) == other.at( i ) )
         i++;
     if ( i >= length() && i >= other.length() )
         return 0;
@@ -521,7 +632,7 @@ int UString::compare( const UString & other ) const
         return -1;
     if ( i >= other.length() )
         return 1;
-    if ( d->str[i] < other.d->str[i] )
+    if ( at( i ) < other.at( i ) )
         return -1;
     return 1;
 }
@@ -573,7 +684,7 @@ bool UString::startsWith( const char * prefix ) const
     if ( !length() )
         return false;
     uint i = 0;
-    while ( i < d->len && prefix[i] && prefix[i] == d->str[i] )
+    while ( i < d->len && prefix[i] && prefix[i] == at( i ) )
         i++;
     if ( i > d->len )
         return false;
@@ -606,7 +717,7 @@ bool UString::endsWith( const char * suffix ) const
     if ( l > length() )
         return false;
     uint i = 0;
-    while ( i < l && suffix[i] == d->str[d->len - l + i] )
+    while ( i < l && suffix[i] == at( d->len - l + i ) )
         i++;
     if ( i < l )
         return false;
@@ -620,7 +731,7 @@ bool UString::endsWith( const char * suffix ) const
 
 int UString::find( char c, int i ) const
 {
-    while ( i < (int)length() && d->str[i] != c )
+    while ( i < (int)length() && at( i ) != c )
         i++;
     if ( i < (int)length() )
         return i;
@@ -636,7 +747,7 @@ int UString::find( const UString & s, int i ) const
 {
     uint j = 0;
     while ( j < s.length() && i+j < length() ) {
-        if ( d->str[i+j] == s.d->str[j] ) {
+        if ( at( i+j ) == s.at( j ) ) {
             j++;
         }
         else {
@@ -681,7 +792,7 @@ bool UString::contains( const char * s ) const
         uint l = strlen( s );
         uint j = 0;
         while ( j < l && i + j < length() &&
-                d->str[i+j] == s[j] )
+                at( i+j ) == s[j] )
             j++;
         if ( j == l )
             return true;
@@ -703,12 +814,19 @@ UString UString::titlecased() const
     UString r = *this;
     uint i = 0;
     while ( i < length() ) {
-        uint cp = d->str[i];
+        uint cp = at( i );
         if ( cp < numTitlecaseCodepoints &&
              titlecaseCodepoints[cp] &&
              cp != titlecaseCodepoints[cp] ) {
-            r.detach();
-            r.d->str[i] = titlecaseCodepoints[cp];
+            uint tc = titlecaseCodepoints[cp];
+            if ( tc > 255 && !r.d->wide )
+                r.widen( r.length() );
+            else
+                r.detach();
+            if ( r.d->wide )
+                ((uint*)r.d->str)[i] = tc;
+            else
+                r.d->str[i] = (char)tc;
         }
         i++;
     }
@@ -781,3 +899,37 @@ UString UString::section( const UString & s, uint n ) const
     }
     return UString();
 }
+
+
+/*! Returns a pointer to the UTF-8 form of this string, for use as a
+    PatriciaTree key, and sets \a *bits to its length in bits.
+
+    If the string is ASCII and stored one byte per character, which
+    is almost always the case for the keys UDict sees, this is the
+    string's own storage and nothing is copied. Otherwise the pointer
+    is valid until the next garbage collection.
+*/
+
+const char * UString::dictKey( uint * bits ) const
+{
+    if ( !d || !d->len ) {
+        *bits = 0;
+        return 0;
+    }
+    if ( !d->wide ) {
+        const unsigned char * c = (const unsigned char *)d->str;
+        uint i = 0;
+        while ( i < d->len && c[i] < 128 )
+            i++;
+        if ( i == d->len ) {
+            *bits = d->len * 8;
+            return d->str;
+        }
+    }
+
+    EString u = utf8();
+    char * k = (char*)Allocator::alloc( u.length(), 0 );
+    memcpy( k, u.data(), u.length() );
+    *bits = u.length() * 8;
+    return k;
+}
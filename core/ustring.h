@@ -12,7 +12,7 @@ class UStringData
     : public Garbage
 {
 private:
-    UStringData(): str( 0 ), len( 0 ), max( 0 ) {
+    UStringData(): str( 0 ), len( 0 ), max( 0 ), wide( false ) {
         setFirstNonPointer( &len );
     }
     UStringData( int );
@@ -23,9 +23,10 @@ private:
     void * operator new( size_t, uint );
     void * operator new( size_t s ) { return Garbage::operator new( s); }
 
-    uint * str;
+    char * str;
     uint len;
     uint max;
+    bool wide;
 };
 
 
@@ -46,7 +47,7 @@ public:
     uint operator[]( uint i ) const {
         if ( !d || i >= d->len )
             return 0;
-        return d->str[i];
+        return at( i );
     }
 
     bool isEmpty() const { return !d || d->len == 0; }
@@ -55,6 +56,7 @@ public:
     void append( const UString & );
     void append( const uint );
     void append( const char * );
+    void append( const char *, uint );
 
     void reserve( uint );
     void truncate( uint = 0 );
@@ -77,7 +79,7 @@ public:
     UString simplified() const;
     UString trimmed() const;
 
-    inline const uint * data() const { return d ? (const uint*)d->str : 0; }
+    const char * dictKey( uint * ) const;
 
     UString titlecased() const;
 
@@ -105,6 +107,13 @@ public:
 
 private:
     void reserve2( uint );
+    void widen( uint );
+
+    uint at( uint i ) const {
+        if ( d->wide )
+            return ((const uint *)d->str)[i];
+        return (unsigned char)d->str[i];
+    }
 
 
 private:
@@ -0,0 +1,105 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "vector.h"
+
+
+/*! \class Vector vector.h
+    The Vector template keeps a sequence of pointers-to-T in one
+    contiguous array, like List but without a node per element.
+
+    append() adds at the end, and shift() and pop() remove from the
+    start and end respectively, so a Vector works as a FIFO queue as
+    well as a stack. at() and operator[]() are constant-time. Space
+    freed by shift() is reused before the array grows, and the array
+    doubles when it is full.
+
+    List is still the right choice when elements are inserted or
+    taken from the middle, or kept in sorted order, or when Iterators
+    must survive changes. Vector::Iterator is invalidated by any
+    change to the Vector.
+
+    Like List, Vector never deletes the objects it points to.
+
+    SmallVector is a Vector with room for a few pointers inside the
+    object itself, so that short sequences cost no allocation at all.
+*/
+
+
+/*! \fn Vector::Vector()
+    Creates an empty Vector. No memory is allocated until the first
+    append().
+*/
+
+/*! \fn Vector::Vector( T ** buffer, uint n )
+    Creates an empty Vector which uses the \a n pointers at \a buffer
+    until it needs more. SmallVector uses this.
+*/
+
+/*! \fn bool Vector::isEmpty() const
+    Returns true if the Vector contains no elements, and false if it
+    contains at least one.
+*/
+
+/*! \fn uint Vector::count() const
+    Returns the number of elements in the Vector. This is cheap.
+*/
+
+/*! \fn T * Vector::at( uint i ) const
+    Returns element \a i, counting from 0, or a null pointer if \a i
+    is not less than count().
+*/
+
+/*! \fn T * Vector::operator[]( uint i ) const
+    Returns at( \a i ).
+*/
+
+/*! \fn T * Vector::firstElement() const
+    Returns the first element, or a null pointer if the Vector is
+    empty.
+*/
+
+/*! \fn T * Vector::lastElement() const
+    Returns the last element, or a null pointer if the Vector is
+    empty.
+*/
+
+/*! \fn void Vector::append( T * t )
+    Adds \a t at the end of the Vector.
+*/
+
+/*! \fn T * Vector::shift()
+    Removes the first element and returns it, or returns a null
+    pointer if the Vector is empty.
+*/
+
+/*! \fn T * Vector::pop()
+    Removes the last element and returns it, or returns a null
+    pointer if the Vector is empty.
+*/
+
+/*! \fn void Vector::clear()
+    Removes all the elements. A SmallVector returns to its inline
+    buffer.
+*/
+
+/*! \fn void Vector::grow()
+    Makes room for at least one more element at the end, either by
+    moving the elements to the start of the array (if shift() has
+    freed at least half of it) or by doubling the array.
+*/
+
+
+/*! \class SmallVector vector.h
+    The SmallVector template is a Vector with an inline buffer of N
+    pointers.
+
+    A SmallVector that never holds more than N elements never
+    allocates memory. If it grows beyond that, it moves its elements
+    to the heap like any other Vector. SmallVector is meant to be a
+    member of another object or a local variable; it can't be copied.
+*/
+
+
+/*! \fn SmallVector::SmallVector()
+    Creates an empty SmallVector using its inline buffer.
+*/
@@ -0,0 +1,173 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef VECTOR_H
+#define VECTOR_H
+
+#include "global.h"
+#include "allocator.h"
+
+
+template<class T>
+class Vector
+    : public Garbage
+{
+public:
+    Vector()
+        : data( 0 ), start( 0 ), end( 0 ), size( 0 ),
+          inlined( 0 ), inlinedSize( 0 )
+    {}
+
+    bool isEmpty() const { return start == end; }
+    uint count() const { return end - start; }
+
+    T * at( uint i ) const {
+        if ( i >= count() )
+            return 0;
+        return data[start + i];
+    }
+    T * operator[]( uint i ) const { return at( i ); }
+
+    T * firstElement() const { return isEmpty() ? 0 : data[start]; }
+    T * lastElement() const { return isEmpty() ? 0 : data[end-1]; }
+
+    void append( T * t ) {
+        if ( end == size )
+            grow();
+        data[end++] = t;
+    }
+
+    T * shift() {
+        if ( isEmpty() )
+            return 0;
+        T * r = data[start];
+        data[start] = 0;
+        start++;
+        if ( start == end )
+            start = end = 0;
+        return r;
+    }
+
+    T * pop() {
+        if ( isEmpty() )
+            return 0;
+        end--;
+        T * r = data[end];
+        data[end] = 0;
+        if ( start == end )
+            start = end = 0;
+        return r;
+    }
+
+    void clear() {
+        if ( data == inlined ) {
+            while ( start < end )
+                data[start++] = 0;
+        }
+        else {
+            data = inlined;
+            size = inlinedSize;
+        }
+        start = end = 0;
+    }
+
+    class Iterator
+        : public Garbage
+    {
+    public:
+        Iterator( const Vector<T> & v ): vector( &v ), i( 0 ) {}
+        Iterator( const Vector<T> * v ): vector( v ), i( 0 ) {}
+
+        operator bool() { return vector && i < vector->count(); }
+        operator T *() { return *this ? vector->at( i ) : 0; }
+        T * operator ->() { ok(); return vector->at( i ); }
+        T & operator *() { ok(); return *vector->at( i ); }
+        Iterator & operator ++() { ok(); i++; return *this; }
+
+    private:
+        void ok() {
+            if ( !*this )
+                die( Invariant );
+        }
+
+        const Vector<T> * vector;
+        uint i;
+    };
+
+protected:
+    Vector( T ** buffer, uint n )
+        : data( buffer ), start( 0 ), end( 0 ), size( n ),
+          inlined( buffer ), inlinedSize( n )
+    {}
+
+private:
+    void grow() {
+        uint n = count();
+        if ( start && n <= size / 2 ) {
+            // a queue which has been shifted a lot; reuse the space
+            uint i = 0;
+            while ( i < n ) {
+                data[i] = data[start + i];
+                i++;
+            }
+            while ( i < end )
+                data[i++] = 0;
+            start = 0;
+            end = n;
+            return;
+        }
+        uint s = size ? size * 2 : 8;
+        T ** d = (T**)Allocator::alloc( s * sizeof( T * ) );
+        uint i = 0;
+        while ( i < n ) {
+            d[i] = data[start + i];
+            i++;
+        }
+        if ( data == inlined ) {
+            i = 0;
+            while ( i < size )
+                data[i++] = 0;
+        }
+        else if ( data ) {
+            Allocator::dealloc( data );
+        }
+        data = d;
+        size = s;
+        start = 0;
+        end = n;
+    }
+
+    // operators explicitly undefined because there is no single
+    // correct way to implement them, and copying a SmallVector would
+    // share its inline buffer.
+    Vector( const Vector< T > & ) {}
+    Vector< T > &operator =( const Vector< T > & ) { return *this; }
+    bool operator ==( const Vector< T > & ) const { return false; }
+    bool operator !=( const Vector< T > & ) const { return false; }
+
+private:
+    T ** data;
+    uint start;
+    uint end;
+    uint size;
+    T ** inlined;
+    uint inlinedSize;
+};
+
+
+template<class T, uint N>
+class SmallVector
+    : public Vector<T>
+{
+public:
+    SmallVector(): Vector<T>( buffer, N ) {
+        uint i = 0;
+        while ( i < N )
+            buffer[i++] = 0;
+    }
+
+private:
+    T * buffer[N];
+};
+
+
+#endif
@@ -4,6 +4,10 @@
 
 #include "list.h"
 #include "estring.h"
+#include "estringlist.h"
+#include "integerset.h"
+#include "hashmap.h"
+#include "dict.h"
 #include "allocator.h"
 #include "configuration.h"
 #include "eventloop.h"
@@ -12,6 +16,7 @@
 #include "graph.h"
 #include "event.h"
 #include "query.h"
+#include "timer.h"
 #include "file.h"
 #include "log.h"
 
@@ -26,16 +31,22 @@ List< Query > *Database::queries;
 static GraphableNumber * queryQueueLength = 0;
 static GraphableNumber * busyDbConnections = 0;
 static GraphableNumber * totalDbConnections = 0;
+static GraphableDataSet * queueWait = 0;
+static GraphableDataSet * queueWaitMedian = 0;
+static GraphableDataSet * queueWait95 = 0;
+static GraphableDataSet * queueWaitMax = 0;
 static List< Database > *handles;
 static time_t lastExecuted;
 static time_t lastCreated;
+static time_t lastReplicaCreated;
 static Database::User loginAs;
 static EString * username;
 static EString * password;
 static List<EventHandler> * whenIdle;
+static List<Query> * running;
 
 
-static void newHandle()
+static void newHandle( const Endpoint * replica = 0 )
 {
     Scope x;
     if ( handles && !handles->isEmpty() ) {
@@ -45,7 +56,170 @@ static void newHandle()
         if ( l )
             x.setLog( l );
     }
-    (void)new Postgres;
+    if ( replica )
+        (void)new Postgres( *replica );
+    else
+        (void)new Postgres;
+}
+
+
+static uint primaryHandles()
+{
+    uint n = 0;
+    List<Database>::Iterator it( ::handles );
+    while ( it ) {
+        if ( !it->isReplica() )
+            n++;
+        ++it;
+    }
+    return n;
+}
+
+
+class ReplicaPosition
+    : public Garbage
+{
+public:
+    ReplicaPosition(): nextModSeq( 0 ) {}
+    int64 nextModSeq;
+};
+
+
+class ReplicaData
+    : public Garbage
+{
+public:
+    ReplicaData( const Endpoint & e ): server( e ) {}
+
+    Endpoint server;
+    HashMap<ReplicaPosition> seen;
+};
+
+
+class ReplicaProbe
+    : public EventHandler
+{
+public:
+    ReplicaProbe( Database * handle, const IntegerSet & mailboxes )
+        : EventHandler(), h( handle ), stale( mailboxes ), q( 0 )
+    {
+        q = new Query( "select id, nextmodseq from mailboxes "
+                       "where id=any($1)", this );
+        q->bind( 1, stale );
+    }
+
+    void execute()
+    {
+        while ( q->hasResults() ) {
+            Row * r = q->nextRow();
+            uint id = r->getInt( "id" );
+            ReplicaPosition * p = h->replica->seen.find( id );
+            if ( !p ) {
+                p = new ReplicaPosition;
+                h->replica->seen.insert( id, p );
+            }
+            p->nextModSeq = r->getBigint( "nextmodseq" );
+        }
+
+        if ( !q->done() )
+            return;
+
+        // whatever this replica still cannot serve goes to the primary
+        List<Query>::Iterator i( Database::queries );
+        while ( i ) {
+            if ( i->replicaAllowed() && stale.contains( i->replicaMailbox() ) &&
+                 !h->accepts( i, false ) )
+                i->forbidReplica();
+            ++i;
+        }
+        Database::runQueue();
+    }
+
+    Database * h;
+    IntegerSet stale;
+    Query * q;
+};
+
+
+// Queries are shared out between client connections, so that one
+// busy client cannot occupy all the handles. A client connection's
+// Log is made by its Listener and so is a grandchild of the process's
+// own Log, and every query issued for the client has a Log below it.
+// Queries issued by the server itself belong to no client.
+
+static EString clientOf( Query * q )
+{
+    Log * l = q->log();
+    while ( l && l->parent() && l->parent()->parent() &&
+            l->parent()->parent()->parent() )
+        l = l->parent();
+    if ( !l || !l->parent() || !l->parent()->parent() )
+        return "";
+    return l->id();
+}
+
+
+class ClientLoad
+    : public Garbage
+{
+public:
+    ClientLoad(): queries( 0 ) {}
+    uint queries;
+};
+
+
+// returns the number of queries each client has running, forgetting
+// the queries that have finished
+
+static Dict<ClientLoad> * clientLoad()
+{
+    Dict<ClientLoad> * r = new Dict<ClientLoad>;
+    List<Query>::Iterator i( ::running );
+    while ( i ) {
+        if ( i->done() ) {
+            ::running->take( i );
+        }
+        else {
+            EString c = clientOf( i );
+            ClientLoad * l = r->find( c );
+            if ( !l ) {
+                l = new ClientLoad;
+                r->insert( c, l );
+            }
+            l->queries++;
+            ++i;
+        }
+    }
+    return r;
+}
+
+
+// returns the number of queries \a client is running according to
+// \a load, or 0 if the limit doesn't apply to \a client
+
+static uint queriesFor( Dict<ClientLoad> * load, const EString & client )
+{
+    if ( client.isEmpty() )
+        return 0;
+    ClientLoad * l = load->find( client );
+    if ( !l )
+        return 0;
+    return l->queries;
+}
+
+
+// notes that \a q, issued by \a client, is about to run
+
+static void startRunning( Dict<ClientLoad> * load, const EString & client,
+                          Query * q )
+{
+    ::running->append( q );
+    ClientLoad * l = load->find( client );
+    if ( !l ) {
+        l = new ClientLoad;
+        load->insert( client, l );
+    }
+    l->queries++;
 }
 
 
@@ -62,7 +236,7 @@ static void newHandle()
 */
 
 Database::Database()
-    : Connection()
+    : Connection(), replica( 0 )
 {
     number = ++::backendNumber;
     setType( Connection::DatabaseClient );
@@ -71,6 +245,22 @@ Database::Database()
 }
 
 
+/*! Constructs a handle for the read-only replica at \a server. Such a
+    handle only processes queries for which Query::allowReplica() has
+    been called, and only if it has caught up with the modseq the
+    query requires.
+*/
+
+Database::Database( const Endpoint & server )
+    : Connection(), replica( new ReplicaData( server ) )
+{
+    number = ++::backendNumber;
+    setType( Connection::DatabaseClient );
+    setState( Database::Connecting );
+    lastReplicaCreated = time( 0 );
+}
+
+
 /*! This setup function reads and validates the database configuration
     to the best of its limited ability (since connection negotiation
     must be left to subclasses). It logs a disaster if it fails.
@@ -114,6 +304,7 @@ void Database::setup( uint desired, const EString & user,
     }
 
     addInitialHandles( desired );
+    addReplicaHandles();
 }
 
 
@@ -130,6 +321,9 @@ void Database::addInitialHandles( uint desired )
         if ( Configuration::toggle( Configuration::Security ) &&
              srv.protocol() == Endpoint::Unix )
             desired = max;
+        uint min = Configuration::scalar( Configuration::DbMinHandles );
+        if ( desired < min )
+            desired = min;
         if ( desired > max )
             desired = max;
     }
@@ -141,6 +335,38 @@ void Database::addInitialHandles( uint desired )
 }
 
 
+/*! Opens a handle to each replica listed in db-replicas to which no
+    handle is currently open.
+*/
+
+void Database::addReplicaHandles()
+{
+    lastReplicaCreated = time( 0 );
+    EString replicas = Configuration::text( Configuration::DbReplicas );
+    if ( replicas.simplified().isEmpty() )
+        return;
+
+    uint port = Configuration::scalar( Configuration::DbPort );
+    EStringList::Iterator a( EStringList::split( ' ',
+                                                 replicas.simplified() ) );
+    while ( a ) {
+        Endpoint e( *a, port );
+        bool open = false;
+        List<Database>::Iterator it( handles );
+        while ( it && !open ) {
+            if ( it->replica && it->replica->server.address() == e.address() )
+                open = true;
+            ++it;
+        }
+        if ( !e.valid() )
+            ::log( "Cannot parse replica address: " + *a, Log::Error );
+        else if ( !open )
+            newHandle( &e );
+        ++a;
+    }
+}
+
+
 /*! \overload
     This function is provided as a convenience for the (majority of)
     callers that use the default values for \a desired (0) and \a login
@@ -221,6 +447,76 @@ void Database::disconnect()
 
 
 
+// runs the queue when the oldest query reaches db-max-queue-wait, so
+// that another handle is opened even if nothing else happens, and
+// fails the queries that have waited longer than db-max-query-wait.
+
+class QueueTimer
+    : public EventHandler
+{
+public:
+    QueueTimer(): timer( 0 ), due( 0 ) {}
+
+    void execute()
+    {
+        timer = 0;
+        due = 0;
+        uint limit =
+            Configuration::scalar( Configuration::DbMaxQueryWait ) * 1000;
+        if ( limit ) {
+            List<Query>::Iterator i( Database::queries );
+            while ( i ) {
+                Query * q = i;
+                if ( q->queueTime() >= limit ) {
+                    Database::queries->take( i );
+                    q->setError( "Waited too long for a database handle" );
+                    q->notify();
+                }
+                else {
+                    ++i;
+                }
+            }
+        }
+        Database::runQueue();
+    }
+
+    // makes sure execute() is called when the oldest query reaches
+    // its next deadline
+    void arm()
+    {
+        Query * q = Database::queries->firstElement();
+        if ( !q )
+            return;
+        uint waited = q->queueTime();
+        uint wait = Configuration::scalar( Configuration::DbMaxQueueWait );
+        uint limit =
+            Configuration::scalar( Configuration::DbMaxQueryWait ) * 1000;
+        uint next = 0;
+        if ( waited < wait )
+            next = wait;
+        else if ( limit && waited < limit )
+            next = limit;
+        else
+            return;
+        // timers count seconds
+        uint delay = ( next - waited + 999 ) / 1000;
+        uint at = (uint)time( 0 ) + delay;
+        if ( timer && due <= at )
+            return;
+        if ( timer )
+            EventLoop::global()->removeTimer( timer );
+        timer = new Timer( this, delay );
+        due = at;
+    }
+
+    Timer * timer;
+    uint due;
+};
+
+
+static QueueTimer * queueTimer = 0;
+
+
 /*! This private function is used to make idle handles process the queue
     of queries, and is called by the two variants of submit().
 */
@@ -230,6 +526,12 @@ void Database::runQueue()
     int connecting = 0;
     int busy = 0;
 
+    if ( !queueTimer ) {
+        queueTimer = new QueueTimer;
+        Allocator::addEternal( queueTimer, "database queue timer" );
+    }
+    queueTimer->arm();
+
     if ( !queryQueueLength )
         queryQueueLength = new GraphableNumber( "query-queue-length" );
     if ( !busyDbConnections )
@@ -237,13 +539,14 @@ void Database::runQueue()
 
     // First, we give each idle handle a Query to process
 
-    Query * first = queries->firstElement();
+    Query * first = firstRunnableQuery();
 
     List< Database >::Iterator it( handles );
     while ( it ) {
         State st = it->state();
 
-        if ( st != Connecting && // connecting isn't working
+        if ( !it->isReplica() && // replicas are counted separately
+             st != Connecting && // connecting isn't working
              st != Broken && // broken isn't working
              ( !it->usable() || // processing a query is working
                st == InTransaction || // occupied by a transaction is, too
@@ -268,9 +571,15 @@ void Database::runQueue()
     queryQueueLength->setValue( queries->count() );
     busyDbConnections->setValue( busy );
 
+    // Replicas which have gone away are reopened once per interval.
+    if ( time( 0 ) - lastReplicaCreated >=
+         Configuration::scalar( Configuration::DbHandleInterval ) )
+        addReplicaHandles();
+
     // If there's nothing to do, or we did get something done, then we
-    // don't even consider opening a new database connection.
-    if ( queries->isEmpty() || first != queries->firstElement() )
+    // don't even consider opening a new database connection. Queries
+    // held back by db-max-client-queries don't need more handles.
+    if ( !first || first != firstRunnableQuery() )
         return;
 
     // Even if we want to, we cannot create unix-domain handles when
@@ -284,18 +593,46 @@ void Database::runQueue()
     if ( EventLoop::global()->inShutdown() )
         return;
 
-    // We create at most one new handle per interval.
-    int interval = Configuration::scalar( Configuration::DbHandleInterval );
-    if ( time( 0 ) - lastCreated < interval )
+    // We open one handle at a time, since a handle that's still
+    // connecting will soon be able to take some of the load.
+    if ( connecting )
         return;
 
+    // If queries are waiting too long, we create a new handle at
+    // once. Otherwise we create at most one new handle per interval.
+    uint wait = Configuration::scalar( Configuration::DbMaxQueueWait );
+    if ( first->queueTime() < wait ) {
+        int interval =
+            Configuration::scalar( Configuration::DbHandleInterval );
+        if ( time( 0 ) - lastCreated < interval )
+            return;
+    }
+
     // If we don't have too many, we can create another handle!
     uint max = Configuration::scalar( Configuration::DbMaxHandles );
-    if ( handles->count() < max )
+    if ( primaryHandles() < max )
         newHandle();
 }
 
 
+/*! Returns the first query in the queue whose client may run another
+    query now (see db-max-client-queries), or a null pointer if there
+    is none.
+*/
+
+Query * Database::firstRunnableQuery()
+{
+    uint limit = Configuration::scalar( Configuration::DbMaxClientQueries );
+    if ( !limit || !::running )
+        return queries->firstElement();
+    Dict<ClientLoad> * load = clientLoad();
+    List<Query>::Iterator i( queries );
+    while ( i && queriesFor( load, clientOf( i ) ) >= limit )
+        ++i;
+    return i;
+}
+
+
 /*! \fn virtual void Database::processQueue()
     Instructs the Database object to send any queries whose state is
     Query::Submitted to the server.
@@ -342,7 +679,7 @@ void Database::removeHandle( Database * d )
     if ( !totalDbConnections )
         totalDbConnections = new GraphableNumber( "total-db-connections" );
     totalDbConnections->setValue( handles->count() );
-    if ( !handles->isEmpty() )
+    if ( primaryHandles() )
         return;
 
     if ( !EventLoop::global()->inShutdown() )
@@ -420,7 +757,7 @@ EString Database::password()
 
 
 /*! Returns the number of database handles currently connected to the
-    database.
+    primary database server. Replicas are not counted.
 */
 
 uint Database::numHandles()
@@ -430,7 +767,7 @@ uint Database::numHandles()
     uint n = 0;
     List<Database>::Iterator it( ::handles );
     while ( it ) {
-        if ( it->state() != Connecting )
+        if ( it->state() != Connecting && !it->isReplica() )
             n++;
         ++it;
     }
@@ -472,6 +809,28 @@ uint Database::connectionNumber() const
 }
 
 
+/*! Returns true if this handle is connected to a read-only replica
+    rather than to the primary database server.
+*/
+
+bool Database::isReplica() const
+{
+    return replica != 0;
+}
+
+
+/*! Returns the server to which this handle connects: server() for the
+    primary, or one of the db-replicas.
+*/
+
+Endpoint Database::endpoint() const
+{
+    if ( replica )
+        return replica->server;
+    return server();
+}
+
+
 /*! This function returns DbOwner or DbUser, as specified in the call to
     Database::setup().
 */
@@ -654,7 +1013,10 @@ uint Database::handlesNeeded()
     if ( needed < recently - 1 )
         needed = recently - 1;
 
-    // we do need a handle
+    // we keep at least as many as configured, and always one
+    uint min = Configuration::scalar( Configuration::DbMinHandles );
+    if ( needed < min )
+        needed = min;
     if ( needed < 1 )
         needed = 1;
 
@@ -663,14 +1025,16 @@ uint Database::handlesNeeded()
 }
 
 
-/*! Returns the number of completely idle handles at the moment. */
+/*! Returns the number of completely idle handles to the primary
+    database server at the moment.
+*/
 
 uint Database::idleHandles()
 {
     uint r = 0;
     List< Database >::Iterator it( handles );
     while ( it ) {
-        if ( it->state() == Idle )
+        if ( it->state() == Idle && !it->isReplica() )
             r++;
         ++it;
     }
@@ -698,35 +1062,211 @@ void Database::cancelQuery( Query * q )
 }
 
 
+/*! \fn void Database::resume( class Query * query )
+    Fetches the next batch of rows for \a query if this database
+    object is streaming its result and waiting for the query's owner
+    to read the rows it has. Does nothing otherwise.
+*/
+
+
+/*! This function asks the handle streaming the result of \a q (see
+    Query::setBatchSize()) to fetch more rows. If no handle is waiting
+    for \a q, it does nothing.
+*/
+
+void Database::resumeQuery( Query * q )
+{
+    List<Database>::Iterator it( handles );
+    while ( it ) {
+        it->resume( q );
+        ++it;
+    }
+}
+
+
 /*! This static function returns the schema revision current at the time
     this server was compiled.
 */
 
 uint Database::currentRevision()
 {
-    return 98;
+    return 115;
 }
 
 
-/*! Removes a submitted transaction from the global list and returns a
-    list contains just that transaction.
+/*! This private helper records how long \a q waited in the queue
+    before a handle picked it up.
+*/
+
+void Database::recordQueueTime( Query * q )
+{
+    if ( !queueWait ) {
+        queueWait = new GraphableDataSet( "query-queue-wait" );
+        queueWaitMedian = new GraphableDataSet( "query-queue-wait-50", 50 );
+        queueWait95 = new GraphableDataSet( "query-queue-wait-95", 95 );
+        queueWaitMax = new GraphableDataSet( "query-queue-wait-max", 100 );
+    }
+    uint ms = q->queueTime();
+    queueWait->addNumber( ms );
+    queueWaitMedian->addNumber( ms );
+    queueWait95->addNumber( ms );
+    queueWaitMax->addNumber( ms );
+}
+
+
+/*! Returns true if this handle may process \a q now, and false if
+    it should be left for another. \a transactionOK is as for
+    firstSubmittedQuery().
+
+    A replica accepts only queries that allow it and for which it has
+    seen the required modseq. The primary leaves such queries to the
+    replicas, but only if an idle replica accepts the query now, and
+    only until the query has waited longer than db-max-queue-wait. A
+    query that no replica can take goes to the primary at once.
+*/
+
+bool Database::accepts( Query * q, bool transactionOK ) const
+{
+    if ( replica ) {
+        if ( !q->replicaAllowed() )
+            return false;
+        if ( !q->replicaMailbox() )
+            return true;
+        ReplicaPosition * p = replica->seen.find( q->replicaMailbox() );
+        return p && p->nextModSeq >= q->replicaModSeq();
+    }
+
+    if ( q->transaction() )
+        return transactionOK;
+    if ( !q->replicaAllowed() ||
+         q->queueTime() >=
+         Configuration::scalar( Configuration::DbMaxQueueWait ) )
+        return true;
+    List<Database>::Iterator it( ::handles );
+    while ( it ) {
+        if ( it->isReplica() && it->usable() && it->accepts( q, false ) )
+            return false;
+        ++it;
+    }
+    return true;
+}
+
+
+/*! Removes submitted queries from the global list and returns a
+    list of queries the caller can send to the server in one go.
 
     If \a transactionOK is true, the list is permitted to start a
-    Transaction. If not, only standalone queries are considered.
+    Transaction, in which case it contains just the first query of
+    that transaction. If not, only standalone queries are considered.
+
+    Standalone queries are pipelined: the list may contain several of
+    them, so that the handle sends them all without waiting for a
+    round trip between each. Each still gets its own Sync, so an error
+    in one does not affect the others. The queue is shared out between
+    this handle and the idle handles, so that an idle pool still runs
+    queries in parallel, and copies and streamed queries (see
+    Query::setBatchSize()) are always sent alone.
+
+    The first query is taken from the client with the fewest queries
+    running, and no client may have more than db-max-client-queries
+    running at once, so that a client which issues many queries cannot
+    starve the others.
 
     Returns an empty list if no suitable queries can be found.
 */
 
 List< Query > * Database::firstSubmittedQuery( bool transactionOK )
 {
+    if ( !::running ) {
+        ::running = new List<Query>;
+        Allocator::addEternal( ::running, "list of running queries" );
+    }
+    uint limit = Configuration::scalar( Configuration::DbMaxClientQueries );
+    Dict<ClientLoad> * load = clientLoad();
+
+    Query * q = 0;
+    EString client;
+    uint fewest = 0;
     List<Query>::Iterator i( queries );
-    if ( !transactionOK )
-        while ( i && i->transaction() )
-            ++i;
+    while ( i ) {
+        if ( accepts( i, transactionOK ) ) {
+            EString c = clientOf( i );
+            uint n = queriesFor( load, c );
+            if ( ( !limit || n < limit ) && ( !q || n < fewest ) ) {
+                q = i;
+                client = c;
+                fewest = n;
+                if ( !n )
+                    break;
+            }
+        }
+        ++i;
+    }
     List<Query> * r = new List<Query>();
-    if ( i ) {
-        r->append( i );
-        queries->take( i );
+    if ( !q )
+        return r;
+
+    r->append( q );
+    queries->remove( q );
+    startRunning( load, client, q );
+    recordQueueTime( q );
+    if ( q->transaction() || q->inputLines() || q->batchSize() )
+        return r;
+
+    uint others = 0;
+    if ( !replica ) {
+        others = idleHandles();
+        if ( others && state() == Idle )
+            others--;
+    }
+    uint n = queries->count() / ( others + 1 );
+    if ( n > 31 )
+        n = 31;
+    List<Query>::Iterator j( queries );
+    while ( j && n ) {
+        q = j;
+        client = clientOf( q );
+        if ( !accepts( q, false ) ||
+             ( limit && queriesFor( load, client ) >= limit ) ) {
+            ++j;
+        }
+        else if ( q->inputLines() || q->batchSize() ) {
+            n = 0;
+        }
+        else {
+            r->append( q );
+            queries->take( j );
+            startRunning( load, client, q );
+            recordQueueTime( q );
+            n--;
+        }
     }
     return r;
 }
+
+
+/*! Returns a query that asks this replica how far it has caught up
+    with the mailboxes needed by the queries it cannot process yet, or
+    0 if there are no such queries or this isn't a replica. When the
+    query completes, the queries this replica still cannot serve are
+    handed over to the primary.
+*/
+
+Query * Database::replicaProbe()
+{
+    if ( !replica )
+        return 0;
+
+    IntegerSet stale;
+    List<Query>::Iterator i( queries );
+    while ( i ) {
+        if ( i->replicaAllowed() && i->replicaMailbox() &&
+             !accepts( i, false ) )
+            stale.add( i->replicaMailbox() );
+        ++i;
+    }
+    if ( stale.isEmpty() )
+        return 0;
+
+    return ( new ReplicaProbe( this, stale ) )->q;
+}
@@ -15,6 +15,7 @@ class Database
 {
 public:
     Database();
+    Database( const Endpoint & );
 
     enum User {
         Superuser, DbOwner, DbUser
@@ -40,6 +41,7 @@ public:
     static EString type();
 
     uint connectionNumber() const;
+    bool isReplica() const;
 
     static uint currentRevision();
 
@@ -50,24 +52,31 @@ public:
     static bool idle();
 
     virtual void cancel( Query * ) = 0;
+    virtual void resume( Query * ) = 0;
 
     static void cancelQuery( Query * );
+    static void resumeQuery( Query * );
 
 protected:
     static List< Query > *queries;
 
     List< Query > * firstSubmittedQuery( bool transactionOK );
+    static void recordQueueTime( Query * );
+    Query * replicaProbe();
 
     void setState( State );
     State state() const;
 
     static void runQueue();
+    static Query * firstRunnableQuery();
 
     static void addHandle( Database * );
     static void removeHandle( Database * );
     static void addInitialHandles( uint = 3);
+    static void addReplicaHandles();
 
     static Endpoint server();
+    Endpoint endpoint() const;
     static EString address();
     static uint port();
 
@@ -82,6 +91,12 @@ protected:
 private:
     State st;
     uint number;
+    class ReplicaData * replica;
+
+    bool accepts( Query *, bool ) const;
+
+    friend class ReplicaProbe;
+    friend class QueueTimer;
 };
 
 
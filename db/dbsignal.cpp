@@ -8,18 +8,84 @@
 #include "scope.h"
 #include "log.h"
 
+// time
+#include <time.h>
+
 
 static List<DatabaseSignal> * signals = 0;
 
 
+// A notification that arrived from one source (PostgreSQL or the
+// ClusterBus) and is expected to arrive from the other as well.
+
+class Arrival
+    : public Garbage
+{
+public:
+    Arrival(): fromPeer( false ), at( 0 ) {}
+    EString name;
+    EString payload;
+    bool fromPeer;
+    uint at;
+};
+
+static List<Arrival> * arrivals = 0;
+
+
+// Returns true if the notification name with payload has
+// already been delivered via the other source, and forgets that
+// delivery. Returns false and remembers this one otherwise. Neither
+// source is reliable enough to do without: PostgreSQL is slower, and
+// ClusterBus datagrams can be lost.
+
+static bool seen( const EString & name, const EString & payload,
+                  bool fromPeer )
+{
+    if ( !arrivals ) {
+        if ( !fromPeer )
+            return false;
+        arrivals = new List<Arrival>;
+        Allocator::addEternal( arrivals, "recent database signals" );
+    }
+
+    uint now = (uint)::time( 0 );
+    List<Arrival>::Iterator i( arrivals );
+    while ( i ) {
+        if ( i->at + 10 < now ) {
+            arrivals->take( i );
+        }
+        else if ( i->fromPeer != fromPeer &&
+                  i->name == name && i->payload == payload ) {
+            arrivals->take( i );
+            return true;
+        }
+        else {
+            ++i;
+        }
+    }
+
+    Arrival * a = new Arrival;
+    a->name = name;
+    a->payload = payload;
+    a->fromPeer = fromPeer;
+    a->at = now;
+    arrivals->append( a );
+    if ( arrivals->count() > 1024 )
+        arrivals->shift();
+    return false;
+}
+
+
 class DatabaseSignalData
     : public Garbage
 {
 public:
-    DatabaseSignalData(): o( 0 ), l( new Log ) {}
+    DatabaseSignalData(): o( 0 ), l( new Log ), p( 0 ), all( false ) {}
     EString n;
     EventHandler * o;
     Log * l;
+    EStringList * p;
+    bool all;
 };
 
 
@@ -57,21 +123,89 @@ DatabaseSignal::DatabaseSignal( const EString & name, EventHandler * owner )
 
 /*! This command should be called only by Postgres. It notifies those
     event handlers who have created DatabaseSignal objects for \a
-    name.
+    name, after recording \a payload for payloads().
+*/
+
+void DatabaseSignal::notifyAll( const EString & name,
+                                const EString & payload )
+{
+    if ( seen( name, payload, false ) )
+        return;
+    deliver( name, payload );
+}
+
+
+/*! This command should be called only by ClusterBus, when another
+    process has told it that \a name was notified with \a payload.
+
+    Such notifications usually arrive before PostgreSQL's, which are
+    then ignored. If PostgreSQL's copy arrives first, this one is
+    ignored instead.
+*/
+
+void DatabaseSignal::notifyFromPeer( const EString & name,
+                                     const EString & payload )
+{
+    if ( seen( name, payload, true ) )
+        return;
+    deliver( name, payload );
+}
+
+
+/*! Notifies those event handlers who have created DatabaseSignal
+    objects for \a name, after recording \a payload for payloads().
 */
 
-void DatabaseSignal::notifyAll( const EString & name )
+void DatabaseSignal::deliver( const EString & name,
+                              const EString & payload )
 {
     List<DatabaseSignal>::Iterator i( signals );
     while ( i ) {
         DatabaseSignal * s = i;
         ++i;
-        if ( name == s->d->n && s->d->o )
+        if ( name == s->d->n && s->d->o ) {
+            if ( payload.isEmpty() ) {
+                s->d->all = true;
+            }
+            else if ( !s->d->all ) {
+                if ( !s->d->p )
+                    s->d->p = new EStringList;
+                if ( s->d->p->count() < 1024 )
+                    s->d->p->append( payload );
+                else
+                    s->d->all = true;
+            }
             s->d->o->notify();
+        }
     }
 }
 
 
+/*! Returns the distinct payloads received since the last call to
+    payloads(), and forgets them. An owner that handles notifications
+    in batches can use this to do only the work each payload calls
+    for.
+
+    Returns a null pointer if at least one notification without a
+    payload arrived (or too many arrived to keep track of), since the
+    sender then didn't say what changed.
+*/
+
+EStringList * DatabaseSignal::payloads()
+{
+    EStringList * r = d->p;
+    if ( !r )
+        r = new EStringList;
+    if ( d->all )
+        r = 0;
+    else
+        r->removeDuplicates();
+    d->p = 0;
+    d->all = false;
+    return r;
+}
+
+
 /*! This destructor is private, so noone can ever call it. Objects of
     this class are indestructible by nature.
 */
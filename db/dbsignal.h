@@ -14,10 +14,16 @@ class DatabaseSignal
 public:
     DatabaseSignal( const EString &, EventHandler * );
 
-    static void notifyAll( const EString & );
+    static void notifyAll( const EString &, const EString & = "" );
+    static void notifyFromPeer( const EString &, const EString & );
 
     static EStringList * names();
 
+    EStringList * payloads();
+
+private:
+    static void deliver( const EString &, const EString & );
+
 private: // noone can destroy this
     ~DatabaseSignal();
 
@@ -7,6 +7,10 @@
 #include "estring.h"
 #include "buffer.h"
 #include "query.h"
+#include "allocator.h"
+
+// strlen
+#include <string.h>
 
 
 static bool haveAskedForCitext;
@@ -798,9 +802,17 @@ PgParameterDescription::PgParameterDescription( Buffer *b )
 */
 
 PgRowDescription::PgRowDescription( Buffer * b )
-    : PgServerMessage( b )
+    : PgServerMessage( b ), byNumber( 0 )
 {
+    uint h = 0;
+    while ( h < 16 ) {
+        hints[h].name = 0;
+        hints[h].number = 0;
+        h++;
+    }
+
     count = decodeInt16();
+    byNumber = (Column**)Allocator::alloc( ( count + 1 ) * sizeof( Column * ) );
     uint c = 0;
     while ( c < count ) {
         Column *col = new Column;
@@ -819,6 +831,7 @@ PgRowDescription::PgRowDescription( Buffer * b )
         columns.append( col );
         names.insert( col->name.data(), 8 * col->name.length(),
                       &col->column2 );
+        byNumber[c] = col;
 
         c++;
     }
@@ -826,6 +839,30 @@ PgRowDescription::PgRowDescription( Buffer * b )
 }
 
 
+/*! Returns the number of the column named \a f, or -1 if there is no
+    such column.
+
+    Row calls this for every column of every row, nearly always with
+    the same string literals, so this remembers where each pointer was
+    found last time. The name is compared each time anyway, so an
+    unlucky pointer can't return the wrong column.
+*/
+
+int PgRowDescription::columnNumber( const char * f ) const
+{
+    Hint & h = hints[( (unsigned long)f >> 2 ) % 16];
+    if ( h.name == f && byNumber[h.number]->name == f )
+        return h.number;
+
+    int * x = names.find( f, strlen( f ) * 8 );
+    if ( !x )
+        return -1;
+    h.name = f;
+    h.number = *x;
+    return *x;
+}
+
+
 
 /*! \class PgExecute pgmessage.h
     C: A request to execute a portal.
@@ -1054,6 +1091,59 @@ void PgFlush::encodeData()
 
 
 
+/*! \class PgClose pgmessage.h
+    C: Closes a prepared statement, so that its name may be reused.
+
+    This message consists of one byte ('S' for a prepared statement)
+    followed by the statement name (EString).
+*/
+
+/*! Creates a Close message for the prepared statement named \a n. */
+
+PgClose::PgClose( const EString &n )
+    : PgClientMessage( 'C' ),
+      name( n )
+{
+}
+
+
+void PgClose::encodeData()
+{
+    appendByte( 'S' );
+    appendString( name );
+}
+
+
+
+/*! \class PgCloseComplete pgmessage.h
+    S: This indicates that a Close message was successfully processed.
+
+    This message contains no data.
+*/
+
+PgCloseComplete::PgCloseComplete( Buffer *b )
+    : PgServerMessage( b )
+{
+    end();
+}
+
+
+
+/*! \class PgPortalSuspended pgmessage.h
+    S: This indicates that an Execute message reached its row limit
+    before the portal ran out of rows. Another Execute fetches more.
+
+    This message contains no data.
+*/
+
+PgPortalSuspended::PgPortalSuspended( Buffer *b )
+    : PgServerMessage( b )
+{
+    end();
+}
+
+
+
 /*! \class PgSync pgmessage.h
     C: The client sends this to mark the end of a query cycle.
 
@@ -1215,9 +1305,58 @@ void PgCopyData::encodeText()
 }
 
 
-/*! Encodes the default binary-format CopyData message. */
+/*! Appends this CopyData message to \a buf, like
+    PgClientMessage::enqueue().
+
+    In binary format, the message length is computed beforehand, so
+    that large values (such as bodyparts) can be handed to \a buf as
+    they are instead of being copied into the message first.
+*/
 
-void PgCopyData::encodeBinary()
+void PgCopyData::enqueue( Buffer * buf )
+{
+    if ( query->format() == Query::Text ) {
+        PgClientMessage::enqueue( buf );
+        return;
+    }
+
+    // Header and trailer, then each tuple's field count and fields.
+    uint n = 4 + 19 + 2;
+    List< Query::InputLine >::Iterator it( *query->inputLines() );
+    while ( it ) {
+        n += 2;
+        Query::InputLine::Iterator v( it );
+        while ( v ) {
+            n += 4;
+            if ( v->length() > 0 )
+                n += v->length();
+            ++v;
+        }
+        ++it;
+    }
+
+    char h[5];
+    h[0] = type;
+    h[1] = (n >> 24);
+    h[2] = (n >> 16);
+    h[3] = (n >>  8);
+    h[4] =  n;
+    buf->append( h, 5 );
+
+    encodeBinary( buf );
+    buf->append( msg );
+}
+
+
+static const int largeValue = 4096;
+
+
+/*! Encodes the default binary-format CopyData message. If \a buf is
+    non-null, large values are appended directly to \a buf (after
+    whatever has been encoded so far) rather than to the message.
+*/
+
+void PgCopyData::encodeBinary( Buffer * buf )
 {
     // Header: Signature, flags, extension length.
     appendByten( "PGCOPY\n\377\r\n" );
@@ -1234,8 +1373,14 @@ void PgCopyData::encodeBinary()
         while ( v ) {
             int n = v->length();
             appendInt32( n );
-            if ( n > 0 )
+            if ( buf && n >= largeValue ) {
+                buf->append( msg );
+                msg.truncate();
+                buf->append( v->data() );
+            }
+            else if ( n > 0 ) {
                 appendByten( v->data() );
+            }
             ++v;
         }
 
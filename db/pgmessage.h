@@ -271,6 +271,16 @@ public:
     List<Column> columns;
     PatriciaTree<int> names;
     uint count;
+
+    int columnNumber( const char * ) const;
+
+private:
+    Column ** byNumber;
+    struct Hint {
+        const char * name;
+        int number;
+    };
+    mutable Hint hints[16];
 };
 
 
@@ -321,6 +331,35 @@ private:
 };
 
 
+class PgClose
+    : public PgClientMessage
+{
+public:
+    PgClose( const EString & );
+
+private:
+    void encodeData();
+
+    EString name;
+};
+
+
+class PgCloseComplete
+    : public PgServerMessage
+{
+public:
+    PgCloseComplete( Buffer * );
+};
+
+
+class PgPortalSuspended
+    : public PgServerMessage
+{
+public:
+    PgPortalSuspended( Buffer * );
+};
+
+
 class PgSync
     : public PgClientMessage
 {
@@ -396,10 +435,12 @@ class PgCopyData
 public:
     PgCopyData( const Query * );
 
+    void enqueue( Buffer * );
+
 private:
     void encodeData();
     void encodeText();
-    void encodeBinary();
+    void encodeBinary( Buffer * = 0 );
     const Query *query;
 };
 
@@ -40,10 +40,11 @@ public:
         : active( false ), startup( false ), authenticated( false ),
           unknownMessage( false ), identBreakageSeen( false ),
           setSessionAuthorisation( false ),
-          sendingCopy( false ), error( false ),
+          sendingCopy( false ), error( false ), warmedUp( false ),
+          suspended( false ),
           keydata( 0 ),
           description( 0 ), transaction( 0 ),
-          needNotify( 0 ), backendPid( 0 )
+          needNotify( 0 ), streaming( 0 ), backendPid( 0 )
         {}
 
     bool active;
@@ -54,16 +55,20 @@ public:
     bool setSessionAuthorisation;
     bool sendingCopy;
     bool error;
+    bool warmedUp;
+    bool suspended;
     EStringList listening;
 
     PgKeyData *keydata;
     PgRowDescription *description;
     Dict<Postgres> prepared;
     EStringList preparesPending;
+    List< Query > warmups;
 
     List< Query > queries;
     Transaction *transaction;
     Query * needNotify;
+    Query * streaming;
 
     EString user;
 
@@ -147,21 +152,44 @@ public:
 Postgres::Postgres()
     : Database(), d( new PgData )
 {
+    start();
+}
+
+
+/*! Creates a Postgres object connected to the read-only replica at
+    \a replica. Otherwise like the default constructor.
+*/
+
+Postgres::Postgres( const Endpoint & replica )
+    : Database( replica ), d( new PgData )
+{
+    start();
+}
+
+
+/*! This private helper initiates the connection for the
+    constructors.
+*/
+
+void Postgres::start()
+{
+    Endpoint e = endpoint();
     d->user = Database::user();
     struct passwd * p = getpwnam( d->user.cstr() );
     if ( p && getuid() != p->pw_uid ) {
         // Try to cooperate with ident authentication.
-        uid_t e = geteuid();
+        uid_t euid = geteuid();
         setreuid( 0, p->pw_uid );
-        connect( address(), port() );
-        setreuid( 0, e );
+        connect( e );
+        setreuid( 0, euid );
     }
     else {
-        connect( address(), port() );
+        connect( e );
     }
 
-    log( "Connecting to PostgreSQL server at " +
-         address() + ":" + fn( port() ) + " "
+    log( "Connecting to PostgreSQL " +
+         EString( isReplica() ? "replica" : "server" ) + " at " +
+         e.address() + ":" + fn( e.port() ) + " "
          "(backend " + fn( connectionNumber() ) + ", fd " + fn( fd() ) +
          ", user " + d->user + ")", Log::Debug );
 
@@ -191,15 +219,29 @@ void Postgres::processQueue()
            d->transaction->state() == Transaction::RolledBack ) )
         d->transaction = 0;
 
-    if ( !::listener && !d->transaction )
+    if ( !::listener && !d->transaction && !isReplica() )
         ::listener = this;
     if ( ::listener == this )
         sendListen();
 
+    if ( !d->warmedUp ) {
+        d->warmedUp = true;
+        if ( !isReplica() )
+            warmUp();
+    }
+
     List< Query > * l = 0;
     if ( d->transaction ) {
         l = d->transaction->submittedQueries();
     }
+    else if ( isReplica() ) {
+        l = Database::firstSubmittedQuery( false );
+        if ( l->isEmpty() ) {
+            Query * p = replicaProbe();
+            if ( p )
+                l->append( p );
+        }
+    }
     else {
         if ( listener == this && numHandles() > 1 )
             l = Database::firstSubmittedQuery( false );
@@ -231,6 +273,39 @@ void Postgres::processQueue()
 }
 
 
+/*! Prepares the statements other handles have already used, so that
+    a new handle doesn't have to parse each hot statement when it
+    first needs it. The Parse messages are pipelined ahead of whatever
+    the handle does first.
+*/
+
+void Postgres::warmUp()
+{
+    uint n = 0;
+    List<PreparedStatement>::Iterator ps( PreparedStatement::statements() );
+    while ( ps ) {
+        if ( ps->executions() && !d->prepared.contains( ps->name() ) ) {
+            Query * q = new Query( *ps, 0 );
+            q->allowFailure();
+            q->setState( Query::Executing );
+            d->queries.append( q );
+            d->warmups.append( q );
+            PgParse a( queryString( q ), q->name() );
+            a.enqueue( writeBuffer() );
+            PgSync s;
+            s.enqueue( writeBuffer() );
+            d->prepared.insert( q->name(), this );
+            d->preparesPending.append( q->name() );
+            n++;
+        }
+        ++ps;
+    }
+    if ( n && Log::enabled( Log::Debug ) )
+        log( "Preparing " + fn( n ) + " statements on backend " +
+             fn( connectionNumber() ), Log::Debug );
+}
+
+
 /*! Sends whatever messages are required to make the backend process the
     query \a q.
 */
@@ -261,21 +336,62 @@ void Postgres::processQuery( Query * q )
     PgDescribe c;
     c.enqueue( writeBuffer() );
 
-    PgExecute ex;
+    PgExecute ex( "", q->batchSize() );
     ex.enqueue( writeBuffer() );
 
-    PgSync e;
-    e.enqueue( writeBuffer() );
+    if ( q->batchSize() ) {
+        // we don't sync until the last row has arrived, since the
+        // sync would close the portal.
+        PgFlush f;
+        f.enqueue( writeBuffer() );
+        d->streaming = q;
+        d->suspended = false;
+        s.append( "streaming " );
+    }
+    else {
+        PgSync e;
+        e.enqueue( writeBuffer() );
+    }
 
-    s.append( "execute for " );
-    s.append( q->description() );
-    s.append( " on backend " );
-    s.appendNumber( connectionNumber() );
-    ::log( s, Log::Debug );
+    if ( Log::enabled( Log::Debug ) ) {
+        s.append( "execute for " );
+        s.append( q->description() );
+        s.append( " on backend " );
+        s.appendNumber( connectionNumber() );
+        ::log( s, Log::Debug );
+    }
     recordExecution();
 }
 
 
+/*! Asks the server for the next batch of rows for the query whose
+    result is being streamed, and flushes the request.
+*/
+
+void Postgres::fetchMore()
+{
+    d->suspended = false;
+    PgExecute ex( "", d->streaming->batchSize() );
+    ex.enqueue( writeBuffer() );
+    PgFlush f;
+    f.enqueue( writeBuffer() );
+}
+
+
+/*! Finishes streaming the current query's result, by sending the Sync
+    that processQuery() withheld. The server closes the portal, if it
+    is still open, and becomes ready for the next query.
+*/
+
+void Postgres::endStream()
+{
+    d->streaming = 0;
+    d->suspended = false;
+    PgSync s;
+    s.enqueue( writeBuffer() );
+}
+
+
 void Postgres::react( Event e )
 {
     switch ( e ) {
@@ -355,6 +471,7 @@ void Postgres::react( Event e )
         }
         else if ( d->queries.isEmpty() &&
                   ::listener != this &&
+                  !isReplica() &&
                   server().protocol() != Endpoint::Unix &&
                   handlesNeeded() < numHandles() ) {
             log( "Closing idle database backend " + fn( connectionNumber() ) +
@@ -511,6 +628,35 @@ void Postgres::process( char type )
             PgParseComplete msg( readBuffer() );
             if ( q && q->name() != "" )
                 d->preparesPending.shift();
+            if ( q && q == d->warmups.firstElement() ) {
+                d->warmups.shift();
+                d->queries.shift();
+                q->setState( Query::Completed );
+            }
+        }
+        break;
+
+    case '3':
+        {
+            PgCloseComplete msg( readBuffer() );
+        }
+        break;
+
+    case 's':
+        {
+            PgPortalSuspended msg( readBuffer() );
+            // if the owner hasn't read the rows we have, we wait for
+            // it (see resume()); if it has, we ask for more at once.
+            if ( q && q == d->streaming ) {
+                if ( q->done() ) {
+                    d->queries.shift();
+                    endStream();
+                }
+                else if ( q->hasResults() )
+                    d->suspended = true;
+                else
+                    fetchMore();
+            }
         }
         break;
 
@@ -609,6 +755,8 @@ void Postgres::process( char type )
                     q->setState( Query::Completed );
                     countQueries( q );
                 }
+                if ( q == d->streaming )
+                    endStream();
                 d->queries.shift();
                 q->notify();
                 d->needNotify = 0;
@@ -626,12 +774,15 @@ void Postgres::process( char type )
     case 'A':
         {
             PgNotificationResponse msg( readBuffer() );
-            EString s;
-            if ( !msg.source().isEmpty() )
-                s = " (" + msg.source() + ")";
-            log( "Received notify " + msg.name().quoted() +
-                 " from server pid " + fn( msg.pid() ) + s, Log::Debug );
-            DatabaseSignal::notifyAll( msg.name() );
+            if ( Log::enabled( Log::Debug ) ) {
+                EString s;
+                if ( !msg.source().isEmpty() )
+                    s = " (" + msg.source() + ")";
+                log( "Received notify " + msg.name().quoted() +
+                     " from server pid " + fn( msg.pid() ) + s,
+                     Log::Debug );
+            }
+            DatabaseSignal::notifyAll( msg.name(), msg.source() );
         }
         break;
 
@@ -907,7 +1058,34 @@ void Postgres::serverMessage()
         }
         if ( q->inputLines() )
             d->sendingCopy = false;
+        if ( q == d->streaming )
+            endStream();
         d->queries.shift();
+        if ( q == d->warmups.firstElement() )
+            d->warmups.shift();
+
+        // If the server has forgotten a prepared statement, or its
+        // plan went stale because the schema changed, we prepare it
+        // again and resubmit the query. That's only possible outside
+        // transactions, since the error aborts a transaction.
+        if ( q->name() != "" && !q->transaction() && !q->inputLines() &&
+             ( code == "26000" ||
+               ( code == "0A000" && m.contains( "cached plan" ) ) ) ) {
+            if ( d->prepared.contains( q->name() ) ) {
+                d->prepared.remove( q->name() );
+                if ( code == "0A000" ) {
+                    PgClose c( q->name() );
+                    c.enqueue( writeBuffer() );
+                    PgSync y;
+                    y.enqueue( writeBuffer() );
+                }
+            }
+            ::log( "Preparing statement " + q->name() + " again: " + m,
+                   Log::Info );
+            Database::submit( q );
+            return;
+        }
+
         m = mapped( m );
         if ( !msg.detail().isEmpty() )
             s.append( " (" + msg.detail() + ")" );
@@ -1121,6 +1299,10 @@ bool Postgres::usable() const
 
 static GraphableCounter * goodQueries = 0;
 static GraphableCounter * badQueries = 0;
+static GraphableDataSet * queryTime = 0;
+static GraphableDataSet * queryTimeMedian = 0;
+static GraphableDataSet * queryTime95 = 0;
+static GraphableDataSet * queryTimeMax = 0;
 
 
 /*! Updates the statistics when \a q is done. */
@@ -1130,6 +1312,42 @@ void Postgres::countQueries( class Query * q )
     if ( !goodQueries ) {
         goodQueries = new GraphableCounter( "queries-executed" ); // bad name?
         badQueries = new GraphableCounter( "queries-failed" ); // bad name?
+        queryTime = new GraphableDataSet( "query-time" );
+        queryTimeMedian = new GraphableDataSet( "query-time-50", 50 );
+        queryTime95 = new GraphableDataSet( "query-time-95", 95 );
+        queryTimeMax = new GraphableDataSet( "query-time-max", 100 );
+    }
+
+    uint ms = q->executionTime();
+    queryTime->addNumber( ms );
+    queryTimeMedian->addNumber( ms );
+    queryTime95->addNumber( ms );
+    queryTimeMax->addNumber( ms );
+
+    PreparedStatement * ps = PreparedStatement::find( q->name() );
+    if ( ps )
+        ps->recordExecution( ms );
+
+    uint waited = q->queueTime();
+    uint slow = Configuration::scalar( Configuration::DbSlowQueryTime );
+    if ( slow && waited + ms >= slow ) {
+        EString s( "Slow query (" );
+        s.appendNumber( waited + ms );
+        s.append( "ms: " );
+        s.appendNumber( waited );
+        s.append( "ms waiting, " );
+        s.appendNumber( ms );
+        s.append( "ms executing" );
+        if ( ps ) {
+            s.append( ", usually " );
+            s.appendNumber( ps->percentile( 50 ) );
+            s.append( "ms or less over " );
+            s.appendNumber( ps->executions() );
+            s.append( " runs" );
+        }
+        s.append( "): " );
+        s.append( q->description() );
+        log( s, Log::Significant );
     }
 
     if ( !q->failed() )
@@ -1137,9 +1355,6 @@ void Postgres::countQueries( class Query * q )
     else if ( !q->canFail() )
         badQueries->tick();
     ; // a query which fails but canFail is not counted anywhere.
-
-    // later also use GraphableDataSet to keep track of query
-    // execution times, but not right now.
 }
 
 
@@ -1235,6 +1450,29 @@ public:
 
 void Postgres::cancel( Query * q )
 {
-    if ( d->queries.find( q ) )
+    if ( q == d->streaming && d->suspended ) {
+        // the server isn't doing anything for q, so we just close
+        // the portal.
+        d->queries.remove( q );
+        endStream();
+        if ( !q->done() ) {
+            q->setError( "Cancelled" );
+            q->notify();
+        }
+    }
+    else if ( d->queries.find( q ) ) {
         (void)new PgCanceller( d->keydata );
+    }
+}
+
+
+/*! Fetches the next batch of rows for \a q if this handle is
+    streaming its result and has been waiting for the owner to read
+    the rows it already has. If not, it does nothing.
+*/
+
+void Postgres::resume( Query * q )
+{
+    if ( q == d->streaming && d->suspended )
+        fetchMore();
 }
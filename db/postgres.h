@@ -13,6 +13,7 @@ class Postgres
 {
 public:
     Postgres();
+    Postgres( const Endpoint & );
     ~Postgres();
 
     void processQueue();
@@ -25,11 +26,16 @@ public:
     void sendListen();
 
     void cancel( Query * );
+    void resume( Query * );
 
 private:
     class PgData *d;
 
+    void start();
+    void warmUp();
     void processQuery( Query * );
+    void fetchMore();
+    void endStream();
     void authentication( char );
     void backendStartup( char );
     void process( char );
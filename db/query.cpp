@@ -6,14 +6,21 @@
 #include "utf.h"
 #include "event.h"
 #include "scope.h"
+#include "span.h"
 #include "estring.h"
 #include "ustring.h"
 #include "database.h"
+#include "dict.h"
+#include "vector.h"
 #include "eventloop.h"
 #include "pgmessage.h"
 #include "integerset.h"
 #include "estringlist.h"
 #include "transaction.h"
+#include "graph.h"
+
+// gettimeofday, struct timeval
+#include <sys/time.h>
 
 
 class QueryData
@@ -24,8 +31,17 @@ public:
         : state( Query::Inactive ), format( Query::Text ),
           values( new Query::InputLine ), inputLines( 0 ),
           transaction( 0 ), owner( 0 ), totalRows( 0 ),
-          canFail( false )
-    {}
+          canFail( false ),
+          replica( false ), replicaMailbox( 0 ), replicaModSeq( 0 ),
+          batchSize( 0 ), span( 0 )
+    {
+        submitted.tv_sec = 0;
+        submitted.tv_usec = 0;
+        started.tv_sec = 0;
+        started.tv_usec = 0;
+        finished.tv_sec = 0;
+        finished.tv_usec = 0;
+    }
 
     Query::State state;
     Query::Format format;
@@ -38,13 +54,25 @@ public:
 
     Transaction * transaction;
     EventHandler * owner;
-    List< Row > rows;
+    Vector< Row > rows;
     uint totalRows;
 
     EString error;
 
     bool canFail;
     bool canBeSlow;
+
+    bool replica;
+    uint replicaMailbox;
+    int64 replicaModSeq;
+
+    uint batchSize;
+
+    struct timeval submitted;
+    struct timeval started;
+    struct timeval finished;
+
+    Span * span;
 };
 
 
@@ -110,8 +138,8 @@ Query::Query( const PreparedStatement &ps, EventHandler *ev )
     : d( new QueryData )
 {
     d->owner = ev;
-    d->name = ps.name();
     setString( ps.query() );
+    d->name = ps.name();
 }
 
 
@@ -145,6 +173,72 @@ Query::State Query::state() const
 void Query::setState( State s )
 {
     d->state = s;
+    if ( s == Submitted ) {
+        (void)::gettimeofday( &d->submitted, 0 );
+        if ( !d->span ) {
+            if ( d->transaction && d->transaction->span() )
+                d->span = Span::start( "query", d->transaction->span() );
+            else
+                d->span = Span::start( "query", log() );
+            if ( d->span )
+                d->span->setArgument( "sql", string().mid( 0, 256 ) );
+        }
+    }
+    else if ( s == Executing ) {
+        (void)::gettimeofday( &d->started, 0 );
+    }
+    else if ( ( s == Completed || s == Failed ) && !d->finished.tv_sec ) {
+        (void)::gettimeofday( &d->finished, 0 );
+        QueryAccount::record( this );
+        if ( d->span ) {
+            d->span->setArgument( "queue-ms", fn( queueTime() ) );
+            d->span->setArgument( "rows", fn( d->totalRows ) );
+            if ( s == Failed )
+                d->span->setArgument( "error", d->error );
+            d->span->end();
+        }
+    }
+}
+
+
+// returns the number of milliseconds from a to b, or to now if b
+// hasn't happened yet, or 0 if a hasn't happened
+
+static uint msBetween( const struct timeval & a, const struct timeval & b )
+{
+    if ( !a.tv_sec )
+        return 0;
+    struct timeval now = b;
+    if ( !now.tv_sec )
+        (void)::gettimeofday( &now, 0 );
+    long elapsed = ( now.tv_sec - a.tv_sec ) * 1000000 +
+                   ( now.tv_usec - a.tv_usec );
+    if ( elapsed < 0 )
+        return 0;
+    return (uint)( elapsed / 1000 );
+}
+
+
+/*! Returns the number of milliseconds this Query has spent waiting
+    for a Database handle since it was submitted, or 0 if it never was
+    submitted. The Database uses this to decide whether queries are
+    waiting too long.
+*/
+
+uint Query::queueTime() const
+{
+    return msBetween( d->submitted, d->started );
+}
+
+
+/*! Returns the number of milliseconds this Query has spent executing,
+    ie. from the time a Database handle sent it until it completed (or
+    until now if it hasn't completed), or 0 if no handle has sent it.
+*/
+
+uint Query::executionTime() const
+{
+    return msBetween( d->started, d->finished );
 }
 
 
@@ -198,6 +292,91 @@ void Query::allowFailure()
 }
 
 
+/*! Records that this Query only reads, so the Database may send it to
+    a read-only replica (see db-replicas) instead of the primary
+    server. Queries that are part of a Transaction are always sent to
+    the primary.
+
+    If \a mailbox is nonzero, the replica must have seen all changes
+    to that mailbox below \a modseq, ie. its mailboxes.nextmodseq must
+    be at least \a modseq. Callers should pass the nextModSeq() they
+    have announced to a client, so the client never sees data older
+    than what it already knows about.
+*/
+
+void Query::allowReplica( uint mailbox, int64 modseq )
+{
+    d->replica = true;
+    d->replicaMailbox = mailbox;
+    d->replicaModSeq = modseq;
+}
+
+
+/*! Records that this Query must be sent to the primary server after
+    all, even if allowReplica() was called. The Database calls this
+    when no replica is fresh enough.
+*/
+
+void Query::forbidReplica()
+{
+    d->replica = false;
+}
+
+
+/*! Returns true if allowReplica() has been called (and forbidReplica()
+    hasn't), and false otherwise.
+*/
+
+bool Query::replicaAllowed() const
+{
+    return d->replica && !d->transaction;
+}
+
+
+/*! Returns the mailbox ID passed to allowReplica(), or 0. */
+
+uint Query::replicaMailbox() const
+{
+    return d->replicaMailbox;
+}
+
+
+/*! Returns the modseq passed to allowReplica(), or 0. */
+
+int64 Query::replicaModSeq() const
+{
+    return d->replicaModSeq;
+}
+
+
+/*! Asks the Database to deliver the result of this Query in batches
+    of at most \a rows rows, and to fetch the next batch only once the
+    owner has read the previous one using nextRow(). This bounds the
+    memory used by huge result sets, at the price of keeping a
+    database handle busy until the last row has been read.
+
+    The default, 0, means to fetch all rows at once. Queries that are
+    part of a Transaction are always fetched at once.
+*/
+
+void Query::setBatchSize( uint rows )
+{
+    d->batchSize = rows;
+}
+
+
+/*! Returns the batch size set by setBatchSize(), or 0 if the Query
+    isn't to be streamed (which is the default).
+*/
+
+uint Query::batchSize() const
+{
+    if ( d->transaction || d->inputLines )
+        return 0;
+    return d->batchSize;
+}
+
+
 /*! Returns a pointer to the Transaction that this Query is associated
     with, or 0 if this Query is self-contained.
 */
@@ -485,6 +664,10 @@ EString Query::string() const
     (e.g. by Selector) when arguments need to be bound before the SQL
     statement is completely constructed.
 
+    If this Query was made from a PreparedStatement and \a s differs
+    from the statement's text, the Query is no longer executed as that
+    statement.
+
     It has no effect on queries that have already been submitted to
     the database.
 */
@@ -494,6 +677,8 @@ void Query::setString( const EString &s )
     if ( d->state != Inactive )
         return;
 
+    if ( s != d->query )
+        d->name.truncate();
     d->query = s;
     if ( s.lower().endsWith( "with binary" ) )
         d->format = Binary;
@@ -502,6 +687,22 @@ void Query::setString( const EString &s )
 }
 
 
+/*! Makes this Query execute \a ps, whose text replaces the current
+    one. Like setString(), this is meant for queries whose arguments
+    are bound before the SQL is known, and has no effect once the
+    Query has been submitted.
+*/
+
+void Query::setPreparedStatement( const PreparedStatement & ps )
+{
+    if ( d->state != Inactive )
+        return;
+
+    setString( ps.query() );
+    d->name = ps.name();
+}
+
+
 /*! Returns a pointer to the list of Values bound to this Query. */
 
 Query::InputLine *Query::values() const
@@ -560,6 +761,7 @@ void Query::notify()
 
     Scope s( d->owner->log() );
     try {
+        EventClock clock( d->owner );
         d->owner->execute();
     }
     catch ( const Exception& e ) {
@@ -743,7 +945,10 @@ void Query::addRow( Row *r )
 
 Row *Query::nextRow()
 {
-    return d->rows.shift();
+    Row * r = d->rows.shift();
+    if ( d->rows.isEmpty() && d->batchSize && !done() )
+        Database::resumeQuery( this );
+    return r;
 }
 
 
@@ -785,19 +990,19 @@ extern "C" {
 
 const Column * Row::fetch( const char * f, Column::Type type, bool warn ) const
 {
-    int * x = layout->names.find( f, strlen( f ) * 8 );
-    if ( !x ) {
+    int x = layout->columnNumber( f );
+    if ( x < 0 ) {
         if ( warn )
             log( "Note: Column " + EString( f ).quoted() + " does not exist",
                  Log::Error );
         return 0;
     }
 
-    if ( warn && type != data[*x].type )
+    if ( warn && type != data[x].type )
         log( "Note: Expected type " + Column::typeName( type ) +
              " for column " + EString( f ).quoted() + ", but received " +
-             Column::typeName( data[*x].type ), Log::Error );
-    return &data[*x];
+             Column::typeName( data[x].type ), Log::Error );
+    return &data[x];
 }
 
 
@@ -937,6 +1142,22 @@ EStringList * Row::columnNames() const
 }
 
 
+/*! Returns a rough estimate of the number of bytes used by this Row,
+    including the contents of its columns.
+*/
+
+uint Row::cost() const
+{
+    uint n = sizeof( Row );
+    uint i = 0;
+    while ( i < layout->count ) {
+        n += sizeof( Column ) + data[i].s.length();
+        i++;
+    }
+    return n;
+}
+
+
 /*! \class PreparedStatement query.h
     This class represents an SQL prepared statement.
 
@@ -950,6 +1171,7 @@ EStringList * Row::columnNames() const
 
 static int prepareCounter = 0;
 List<PreparedStatement> * preparedStatementRoot = 0;
+static Dict<PreparedStatement> * preparedStatementNames = 0;
 
 
 /*! Creates a PreparedStatement containing the SQL statement \a s, and
@@ -957,13 +1179,122 @@ List<PreparedStatement> * preparedStatementRoot = 0;
 */
 
 PreparedStatement::PreparedStatement( const EString &s )
-    : n( fn( prepareCounter++ ) ), q( s )
+    : n( fn( prepareCounter++ ) ), q( s ), executed( 0 ), elapsed( 0 ),
+      graph( 0 )
+{
+    uint i = 0;
+    while ( i < 16 )
+        histogram[i++] = 0;
+    statements()->append( this );
+    preparedStatementNames->insert( n, this );
+}
+
+
+/*! Records that this statement has been executed once more, taking
+    \a ms milliseconds.
+*/
+
+void PreparedStatement::recordExecution( uint ms )
+{
+    executed++;
+    elapsed += ms;
+    if ( graph )
+        graph->addNumber( ms );
+
+    // bucket i holds times below 2^i ms, the last one everything else
+    uint i = 0;
+    while ( i < 15 && ms >= ( 1u << i ) )
+        i++;
+    histogram[i]++;
+}
+
+
+/*! Returns the number of times recordExecution() has been called, ie.
+    how often this statement has been executed in this process.
+*/
+
+uint PreparedStatement::executions() const
+{
+    return executed;
+}
+
+
+/*! Returns the average execution time of this statement, in
+    milliseconds, or 0 if it has never been executed.
+*/
+
+uint PreparedStatement::averageTime() const
+{
+    if ( !executed )
+        return 0;
+    return ( elapsed + executed / 2 ) / executed;
+}
+
+
+/*! Returns an upper bound for the \a p'th percentile of this
+    statement's execution times, in milliseconds. The bound is a power
+    of two, since the figures are kept in a logarithmic histogram. If
+    the statement has never been executed, percentile() returns 0.
+*/
+
+uint PreparedStatement::percentile( uint p ) const
+{
+    if ( !executed )
+        return 0;
+    if ( p > 100 )
+        p = 100;
+    uint wanted = ( executed * p + 99 ) / 100;
+    uint seen = 0;
+    uint i = 0;
+    while ( i < 15 ) {
+        seen += histogram[i];
+        if ( seen >= wanted )
+            return 1 << i;
+        i++;
+    }
+    return 1 << 15;
+}
+
+
+/*! Makes recordExecution() report each execution time to a
+    GraphableDataSet called \a name, so the statement's timings are
+    visible as statistics and metrics. This should be used sparingly,
+    since each such statement keeps its own history.
+*/
+
+void PreparedStatement::setGraph( const EString & name )
+{
+    if ( !graph )
+        graph = new GraphableDataSet( name );
+}
+
+
+/*! Returns a pointer to the PreparedStatement called \a name, or 0 if
+    there is no such statement.
+*/
+
+PreparedStatement * PreparedStatement::find( const EString & name )
+{
+    if ( !preparedStatementNames || name.isEmpty() )
+        return 0;
+    return preparedStatementNames->find( name );
+}
+
+
+/*! Returns a list of all PreparedStatement objects created so far, in
+    order of creation. The list is shared and must not be modified.
+*/
+
+List<PreparedStatement> * PreparedStatement::statements()
 {
     if ( !preparedStatementRoot ) {
         preparedStatementRoot = new List<PreparedStatement>;
         Allocator::addEternal( preparedStatementRoot, "prepared statements" );
+        preparedStatementNames = new Dict<PreparedStatement>;
+        Allocator::addEternal( preparedStatementNames,
+                               "prepared statements by name" );
     }
-    preparedStatementRoot->append( this );
+    return preparedStatementRoot;
 }
 
 
@@ -1055,7 +1386,7 @@ void Query::cancel()
         setError( "Cancelled" );
     notify();
 
-    if ( d->canBeSlow && s == Executing )
+    if ( ( d->canBeSlow || batchSize() ) && s == Executing )
         Database::cancelQuery( this );
     else if ( d->transaction )
         d->transaction->rollback();
@@ -1098,3 +1429,97 @@ void Query::checkParameters()
     //
     // Later.
 }
+
+
+static Dict<QueryAccount> * openAccounts = 0;
+
+
+/*! \class QueryAccount query.h
+    The QueryAccount class sums up the queries issued on behalf of a
+    Log object, so that e.g. an IMAP command can learn how many queries
+    it caused and how long it spent waiting for the database.
+
+    A query belongs to an account if its log() is the account's Log or
+    one of that Log's descendants, so queries issued by helpers (a
+    Fetcher, a Transaction's owner) are counted as long as they log
+    via the right Log. The account counts until close() is called.
+*/
+
+
+/*! Opens an account for queries logged via \a log or its children. */
+
+QueryAccount::QueryAccount( Log * log )
+    : count( 0 ), waited( 0 ), elapsed( 0 )
+{
+    if ( !log )
+        return;
+    id = log->id();
+    if ( !openAccounts ) {
+        openAccounts = new Dict<QueryAccount>;
+        Allocator::addEternal( openAccounts, "open query accounts" );
+    }
+    openAccounts->insert( id, this );
+}
+
+
+/*! Stops counting queries. The totals remain available. */
+
+void QueryAccount::close()
+{
+    if ( openAccounts && !id.isEmpty() &&
+         openAccounts->find( id ) == this )
+        openAccounts->remove( id );
+    id.truncate();
+}
+
+
+/*! Returns the number of queries that have completed or failed while
+    this account was open.
+*/
+
+uint QueryAccount::queries() const
+{
+    return count;
+}
+
+
+/*! Returns the total number of milliseconds this account's queries
+    spent waiting for a database handle.
+*/
+
+uint QueryAccount::queueTime() const
+{
+    return waited;
+}
+
+
+/*! Returns the total number of milliseconds this account's queries
+    spent executing.
+*/
+
+uint QueryAccount::executionTime() const
+{
+    return elapsed;
+}
+
+
+/*! Adds \a q to the open account belonging to its log(), if there is
+    one. Query calls this when \a q is done.
+*/
+
+void QueryAccount::record( const Query * q )
+{
+    if ( !openAccounts || openAccounts->isEmpty() )
+        return;
+    Log * l = q->log();
+    while ( l ) {
+        QueryAccount * a = openAccounts->find( l->id() );
+        if ( a ) {
+            a->count++;
+            a->waited += q->queueTime();
+            a->elapsed += q->executionTime();
+            return;
+        }
+        l = l->parent();
+    }
+}
@@ -31,6 +31,8 @@ public:
     };
     void setState( State );
     State state() const;
+    uint queueTime() const;
+    uint executionTime() const;
     bool failed() const;
     bool done() const;
 
@@ -39,6 +41,15 @@ public:
     bool canFail() const;
     void allowFailure();
 
+    void allowReplica( uint = 0, int64 = 0 );
+    void forbidReplica();
+    bool replicaAllowed() const;
+    uint replicaMailbox() const;
+    int64 replicaModSeq() const;
+
+    void setBatchSize( uint );
+    uint batchSize() const;
+
     Transaction *transaction() const;
     void setTransaction( Transaction * );
 
@@ -95,6 +106,7 @@ public:
     virtual EString name() const;
     virtual EString string() const;
     virtual void setString( const EString & );
+    void setPreparedStatement( const PreparedStatement & );
 
     typedef SortedList< Query::Value > InputLine;
 
@@ -158,6 +170,8 @@ public:
 
     EStringList * columnNames() const;
 
+    uint cost() const;
+
 private:
     const Column * data;
     const class PgRowDescription * layout;
@@ -174,8 +188,41 @@ public:
     EString name() const;
     EString query() const;
 
+    void recordExecution( uint );
+    uint executions() const;
+    uint averageTime() const;
+    uint percentile( uint ) const;
+
+    void setGraph( const EString & );
+
+    static PreparedStatement * find( const EString & );
+    static List<PreparedStatement> * statements();
+
 private:
     EString n, q;
+    uint executed, elapsed;
+    uint histogram[16];
+    class GraphableDataSet * graph;
+};
+
+
+class QueryAccount
+    : public Garbage
+{
+public:
+    QueryAccount( class Log * );
+
+    void close();
+
+    uint queries() const;
+    uint queueTime() const;
+    uint executionTime() const;
+
+    static void record( const Query * );
+
+private:
+    EString id;
+    uint count, waited, elapsed;
 };
 
 
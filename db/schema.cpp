@@ -19,6 +19,25 @@
 #include "mailbox.h"
 
 #include <stdio.h>
+#include <time.h> // time()
+
+
+// The indices which an online upgrade builds concurrently after
+// committing the rest, rather than inside the upgrade transaction,
+// where building them would lock their tables for a long time.
+
+static const struct {
+    const char * name;
+    const char * definition;
+} deferrableIndices[] = {
+    { "b_h", "bodyparts(hash)" },
+    { "dm_mm", "deleted_messages(mailbox,modseq)" },
+    { "b_e", "bodyparts(hash) where external" },
+    { "d_na", "deliveries(next_attempt) where next_attempt is not null" },
+    { "dm_md", "deleted_messages(mailbox,deleted_at)" },
+    { "m_ib", "messages using brin(idate)" },
+    { 0, 0 }
+};
 
 
 class SchemaData
@@ -32,7 +51,8 @@ public:
           t( 0 ),
           result( 0 ), unparsed( 0 ), upgrade( false ), commit( true ),
           quid( 0 ), undel( 0 ), row( 0 ), lastMailbox( 0 ), count( 0 ),
-          uidnext( 0 ), nextmodseq( 0 ), granter( 0 )
+          uidnext( 0 ), nextmodseq( 0 ), granter( 0 ),
+          online( false ), build( 0 ), built( 0 ), started( 0 )
     {
         schema = Configuration::text( Configuration::DbSchema );
         dbuser = Configuration::text( Configuration::DbUser ).quoted();
@@ -63,6 +83,12 @@ public:
     int64 nextmodseq;
 
     Granter * granter;
+
+    bool online;
+    EStringList deferred;
+    Query * build;
+    uint built;
+    uint started;
 };
 
 
@@ -97,6 +123,24 @@ Schema::Schema( EventHandler * owner, bool upgrade, bool commit )
 }
 
 
+/*! Makes the upgrade suitable for running while the servers are live
+    if \a online is true, and makes it an ordinary upgrade if \a online
+    is false (the default). Must be called before execute().
+
+    An online upgrade refuses to wait long for locks, so that mail
+    traffic isn't queued up behind an upgrade step that waits for a
+    busy table, and it builds the big indices concurrently after the
+    rest of the upgrade has been committed. Until they are built, the
+    server works, but some searches are slower. If a build is
+    interrupted, running the online upgrade again finishes it.
+*/
+
+void Schema::setOnline( bool online )
+{
+    d->online = online;
+}
+
+
 /*! Returns a Query object that can be used to track the progress of the
     Schema verification or upgradation. The Query's owner is set by the
     constructor when the Schema is created.
@@ -185,6 +229,12 @@ void Schema::execute()
             d->result->setState( Query::Completed );
             d->state = 7;
         }
+        else if ( d->upgrade && d->online && !d->commit ) {
+            fail( "An online upgrade cannot be combined with -n." );
+            d->revision = Database::currentRevision();
+            d->t->commit();
+            d->state = 7;
+        }
         else if ( d->upgrade && d->revision > Database::currentRevision() &&
                   d->revision >= 85 && Database::currentRevision() >= 80 ) {
             d->l->log( "Downgrading schema from revision " +
@@ -224,6 +274,11 @@ void Schema::execute()
             d->t->commit();
             d->state = 7;
         }
+
+        // a statement waiting for a lock makes everything else that
+        // wants the same table wait too, so we give up instead
+        if ( d->state == 2 && d->online && Postgres::version() >= 90300 )
+            d->t->enqueue( "set local lock_timeout='10s'" );
     }
 
     if ( d->upgrade &&
@@ -334,6 +389,9 @@ void Schema::execute()
             else
                 s = "The schema could not be validated.";
             fail( s, d->t->failedQuery() );
+            if ( d->online && d->t->error().contains( "lock timeout" ) )
+                d->l->log( "A table was too busy. Please try again later.",
+                           Log::Significant );
         }
         else if ( d->upgrade ) {
             EString s( "Schema upgraded to revision " );
@@ -348,6 +406,97 @@ void Schema::execute()
         }
 
         d->state = 8;
+        if ( d->online && d->upgrade && !d->result->failed() )
+            d->state = 9;
+    }
+
+    if ( d->state == 9 ) {
+        // look for builds that were interrupted, by us or by an
+        // earlier online upgrade
+        EStringList names;
+        uint i = 0;
+        while ( deferrableIndices[i].name )
+            names.append( deferrableIndices[i++].name );
+        d->build = new Query( "select c.relname::text as name "
+                              "from pg_class c "
+                              "join pg_index i on (c.oid=i.indexrelid) "
+                              "join pg_namespace n "
+                              "on (c.relnamespace=n.oid) "
+                              "where n.nspname=$1 and not i.indisvalid "
+                              "and c.relname=any($2::text[])", this );
+        d->build->bind( 1, d->schema );
+        d->build->bind( 2, names );
+        d->build->execute();
+        d->state = 10;
+    }
+
+    if ( d->state == 10 ) {
+        if ( !d->build->done() )
+            return;
+        Row * r;
+        while ( (r=d->build->nextRow()) != 0 ) {
+            EString n = r->getEString( "name" );
+            if ( !d->deferred.contains( n ) )
+                d->deferred.append( n );
+        }
+        d->build = 0;
+        d->state = 11;
+    }
+
+    while ( d->state == 11 || d->state == 12 ) {
+        if ( d->build ) {
+            if ( !d->build->done() )
+                return;
+            if ( d->build->failed() ) {
+                fail( "Could not build index " +
+                      d->deferred.firstElement()->quoted() + ".",
+                      d->build );
+                d->l->log( "The schema upgrade itself is committed. "
+                           "Run 'aox upgrade schema -o' again to finish "
+                           "building " + d->deferred.join( ", " ) + ".",
+                           Log::Significant );
+                d->state = 8;
+                break;
+            }
+            d->build = 0;
+            if ( d->state == 11 ) {
+                d->l->log( "Built index " +
+                           d->deferred.firstElement()->quoted() + " in " +
+                           fn( (uint)::time( 0 ) - d->started ) +
+                           " seconds.", Log::Significant );
+                d->deferred.shift();
+            }
+        }
+
+        if ( d->deferred.isEmpty() ) {
+            d->state = 8;
+            break;
+        }
+
+        EString n = *d->deferred.firstElement();
+        if ( d->state == 11 ) {
+            // an interrupted concurrent build leaves an invalid index
+            // behind, which we have to drop before we can build it
+            d->build = new Query( "drop index if exists " + n, this );
+            d->build->execute();
+            d->state = 12;
+        }
+        else {
+            uint i = 0;
+            while ( deferrableIndices[i].name &&
+                    n != deferrableIndices[i].name )
+                i++;
+            d->built++;
+            d->l->log( "Building index " + n.quoted() + " concurrently (" +
+                       fn( d->built ) + " of " +
+                       fn( d->built + d->deferred.count() - 1 ) + ").",
+                       Log::Significant );
+            d->started = (uint)::time( 0 );
+            d->build = new Query( "create index concurrently " + n + " on " +
+                                  deferrableIndices[i].definition, this );
+            d->build->execute();
+            d->state = 11;
+        }
     }
 
     if ( d->state == 8 ) {
@@ -368,6 +517,35 @@ void Schema::describeStep( const EString & description )
 }
 
 
+/*! This private helper creates the index called \a name, which must be
+    listed in deferrableIndices. In an online upgrade, the index is
+    built after the upgrade transaction has been committed; otherwise
+    within it.
+*/
+
+void Schema::createIndex( const EString & name )
+{
+    uint i = 0;
+    while ( deferrableIndices[i].name && name != deferrableIndices[i].name )
+        i++;
+    if ( !deferrableIndices[i].name ) {
+        // it's a bug, but one we can survive
+        d->l->log( "Unknown index: " + name, Log::Error );
+        return;
+    }
+
+    if ( d->online ) {
+        d->l->log( "Will build index " + name.quoted() + " after "
+                   "committing the upgrade.", Log::Debug );
+        d->deferred.append( name );
+    }
+    else {
+        d->t->enqueue( "create index " + name + " on " +
+                       deferrableIndices[i].definition );
+    }
+}
+
+
 /*! Given an error message \a s and, optionally, the query \a q that
     caused the error, this private helper function logs a suitable set
     of Disaster messages (including the Query::description()) and sets
@@ -592,6 +770,40 @@ bool Schema::singleStep()
         c = stepTo97(); break;
     case 97:
         c = stepTo98(); break;
+    case 98:
+        c = stepTo99(); break;
+    case 99:
+        c = stepTo100(); break;
+    case 100:
+        c = stepTo101(); break;
+    case 101:
+        c = stepTo102(); break;
+    case 102:
+        c = stepTo103(); break;
+    case 103:
+        c = stepTo104(); break;
+    case 104:
+        c = stepTo105(); break;
+    case 105:
+        c = stepTo106(); break;
+    case 106:
+        c = stepTo107(); break;
+    case 107:
+        c = stepTo108(); break;
+    case 108:
+        c = stepTo109(); break;
+    case 109:
+        c = stepTo110(); break;
+    case 110:
+        c = stepTo111(); break;
+    case 111:
+        c = stepTo112(); break;
+    case 112:
+        c = stepTo113(); break;
+    case 113:
+        c = stepTo114(); break;
+    case 114:
+        c = stepTo115(); break;
     default:
         d->l->log( "Internal error. Reached impossible revision " +
                    fn( d->revision ) + ".", Log::Disaster );
@@ -3775,7 +3987,7 @@ bool Schema::stepTo75()
     if ( d->substate == 0 ) {
         describeStep( "Create an index on bodyparts.hash" );
         d->substate = 1;
-        d->t->enqueue( new Query( "create index b_h on bodyparts(hash)", 0 ) );
+        createIndex( "b_h" );
         d->t->execute();
     }
 
@@ -3804,8 +4016,7 @@ bool Schema::stepTo76()
         if ( !d->q->done() )
             return false;
         if ( !d->q->hasResults() ) {
-            d->t->enqueue( new Query( "create index dm_mm on deleted_messages "
-                                      "(mailbox,modseq)", 0 ) );
+            createIndex( "dm_mm" );
             d->t->execute();
         }
         d->substate = 2;
@@ -4420,3 +4631,452 @@ bool Schema::stepTo98()
     d->t->enqueue( "alter table mailboxes add flag text" );
     return true;
 }
+
+
+/*! Make the mailbox trigger say which mailbox changed, so that the
+    servers can reread just that one.
+*/
+
+bool Schema::stepTo99()
+{
+    describeStep( "Adding the mailbox ID to mailboxes_updated." );
+    d->t->enqueue(
+        new Query( "create or replace function check_mailbox_update() "
+                   "returns trigger as $$"
+                   "declare address text; "
+                   "begin "
+                   "perform pg_notify('mailboxes_updated', "
+                   "new.id::text || ' ' || new.nextmodseq::text); "
+                   "if new.deleted='t' and old.deleted='f' then "
+                   // check that the mailbox contains no extant messages
+                   "perform * from mailbox_messages where mailbox=new.id; "
+                   "if found then "
+                   "raise exception '% is not empty', new.name;"
+                   "end if; "
+                   // check that the mailbox isn't a target of an alias
+                   "select a.localpart||'@'||a.domain into address"
+                   " from addresses a join aliases al on (a.id=al.address)"
+                   " where al.mailbox=new.id;"
+                   "if address is not null then "
+                   "raise exception '% used by alias %', new.name, address; "
+                   "end if; "
+                   // check that the mailbox isn't a target of fileinto
+                   "perform * from fileinto_targets where mailbox=new.id; "
+                   "if found then "
+                   "raise exception '% is used by sieve fileinto', new.name;"
+                   "end if; "
+                   "end if; "
+                   "return new;"
+                   "end;$$ language 'plpgsql'", 0 ) );
+    return true;
+}
+
+
+/*! Adds bodyparts.compressed, which is true for rows whose data is
+    stored zlib-compressed (see compress-bodyparts).
+*/
+
+bool Schema::stepTo100()
+{
+    describeStep( "Allowing compressed bodyparts." );
+    d->t->enqueue( "alter table bodyparts add compressed boolean" );
+    return true;
+}
+
+
+/*! Adds bodyparts.external, which is true for rows whose data is
+    kept in blob-directory rather than in the database.
+*/
+
+bool Schema::stepTo101()
+{
+    describeStep( "Allowing bodyparts to be stored outside the database." );
+    d->t->enqueue( "alter table bodyparts add external boolean" );
+    createIndex( "b_e" );
+    return true;
+}
+
+
+/*! Adds message_summaries, where Fetch keeps the ENVELOPE and
+    BODYSTRUCTURE of messages it has already described to a client.
+*/
+
+bool Schema::stepTo102()
+{
+    describeStep( "Adding message_summaries table." );
+    d->t->enqueue( "create table message_summaries ("
+                   "message integer primary key "
+                   "references messages(id) on delete cascade, "
+                   "envelope text not null, "
+                   "bodystructure text not null)" );
+    return true;
+}
+
+
+/*! Adds the mailbox_changes journal, which lets Select answer QRESYNC
+    by scanning a small table. Changes from before this step aren't
+    journalled, so each existing mailbox gets a uid 0 row at its
+    current nextmodseq.
+*/
+
+bool Schema::stepTo103()
+{
+    describeStep( "Adding mailbox_changes journal." );
+    d->t->enqueue( "create table mailbox_changes ("
+                   "mailbox integer not null references mailboxes(id), "
+                   "uid integer not null, "
+                   "modseq bigint not null, "
+                   "expunged boolean not null default false, "
+                   "primary key (mailbox, uid))" );
+    d->t->enqueue( "create index mc_mm on mailbox_changes(mailbox,modseq)" );
+    d->t->enqueue( "insert into mailbox_changes "
+                   "(mailbox, uid, modseq, expunged) "
+                   "select id, 0, nextmodseq, true from mailboxes" );
+    d->t->enqueue( "create function record_mailbox_change() "
+                   "returns trigger as $$ "
+                   "declare gone boolean; "
+                   "begin "
+                   "gone := TG_TABLE_NAME = 'deleted_messages'; "
+                   "if TG_OP = 'UPDATE' then "
+                   "if NEW.modseq = OLD.modseq then "
+                   "return NULL; "
+                   "end if; "
+                   "end if; "
+                   "update mailbox_changes "
+                   "set modseq=NEW.modseq, expunged=gone "
+                   "where mailbox=NEW.mailbox and uid=NEW.uid; "
+                   "if not found then "
+                   "insert into mailbox_changes "
+                   "(mailbox, uid, modseq, expunged) "
+                   "values (NEW.mailbox, NEW.uid, NEW.modseq, gone); "
+                   "end if; "
+                   "return NULL; "
+                   "end;$$ language plpgsql" );
+    d->t->enqueue( "create trigger mailbox_messages_changes_trigger "
+                   "after insert or update on mailbox_messages "
+                   "for each row execute procedure record_mailbox_change()" );
+    d->t->enqueue( "create trigger deleted_messages_changes_trigger "
+                   "after insert on deleted_messages "
+                   "for each row execute procedure record_mailbox_change()" );
+    return true;
+}
+
+
+/*! Adds mailbox_counts and the trigger that maintains it. */
+
+bool Schema::stepTo104()
+{
+    describeStep( "Adding mailbox_counts." );
+    d->t->enqueue( "create table mailbox_counts ("
+                   "mailbox integer primary key references mailboxes(id), "
+                   "messages integer not null default 0, "
+                   "unseen integer not null default 0, "
+                   "bytes bigint not null default 0)" );
+    d->t->enqueue( "lock mailbox_messages in exclusive mode" );
+    d->t->enqueue( "insert into mailbox_counts "
+                   "(mailbox, messages, unseen, bytes) "
+                   "select mm.mailbox, count(*), "
+                   "count(nullif(mm.seen,true)), sum(m.rfc822size) "
+                   "from mailbox_messages mm "
+                   "join messages m on (mm.message=m.id) "
+                   "group by mm.mailbox" );
+    d->t->enqueue( "create function count_mailbox_messages() "
+                   "returns trigger as $$ "
+                   "declare "
+                   "box integer; "
+                   "m integer := 0; "
+                   "u integer := 0; "
+                   "b bigint := 0; "
+                   "begin "
+                   "if TG_OP = 'INSERT' then "
+                   "box := NEW.mailbox; "
+                   "m := 1; "
+                   "if not NEW.seen then "
+                   "u := 1; "
+                   "end if; "
+                   "select rfc822size into b from messages "
+                   "where id=NEW.message; "
+                   "elsif TG_OP = 'DELETE' then "
+                   "box := OLD.mailbox; "
+                   "m := -1; "
+                   "if not OLD.seen then "
+                   "u := -1; "
+                   "end if; "
+                   "select -rfc822size into b from messages "
+                   "where id=OLD.message; "
+                   "else "
+                   "if NEW.seen = OLD.seen then "
+                   "return NULL; "
+                   "end if; "
+                   "box := NEW.mailbox; "
+                   "if NEW.seen then "
+                   "u := -1; "
+                   "else "
+                   "u := 1; "
+                   "end if; "
+                   "end if; "
+                   "update mailbox_counts "
+                   "set messages=messages+m, unseen=unseen+u, bytes=bytes+b "
+                   "where mailbox=box; "
+                   "if not found then "
+                   "insert into mailbox_counts "
+                   "(mailbox, messages, unseen, bytes) "
+                   "values (box, m, u, b); "
+                   "end if; "
+                   "return NULL; "
+                   "end;$$ language plpgsql" );
+    d->t->enqueue( "create trigger mailbox_messages_count_trigger "
+                   "after insert or delete or update of seen "
+                   "on mailbox_messages "
+                   "for each row execute procedure count_mailbox_messages()" );
+    return true;
+}
+
+
+/*! Adds deliveries.next_attempt, so that SpoolManager can find the
+    deliveries that are due without looking at delivery_recipients.
+*/
+
+bool Schema::stepTo105()
+{
+    describeStep( "Adding deliveries.next_attempt." );
+    d->t->enqueue( "alter table deliveries "
+                   "add next_attempt timestamp with time zone" );
+    d->t->enqueue( "update deliveries set next_attempt=n.t "
+                   "from (select dr.delivery, "
+                   "min(coalesce(dr.last_attempt+interval '900 s',"
+                   " d.deliver_after, current_timestamp)) as t "
+                   "from delivery_recipients dr "
+                   "join deliveries d on (dr.delivery=d.id) "
+                   "where dr.action=0 or dr.action=2 "
+                   "group by dr.delivery) n "
+                   "where deliveries.id=n.delivery" );
+    createIndex( "d_na" );
+    return true;
+}
+
+
+/*! Adds triggers that notify aliases_updated whenever aliases,
+    scripts, users or mailboxes change in a way that may affect
+    delivery, so that Sieve can cache recipient lookups. Existing
+    triggers of the same names are replaced, since a database
+    installed from a schema.pg that already had them may still claim
+    revision 105.
+*/
+
+bool Schema::stepTo106()
+{
+    describeStep( "Adding aliases_updated notifications." );
+    d->t->enqueue( "create or replace function notify_aliases() "
+                   "returns trigger as $$ "
+                   "begin "
+                   "notify aliases_updated; return NULL; "
+                   "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "drop trigger if exists aliases_trigger "
+                   "on aliases" );
+    d->t->enqueue( "create trigger aliases_trigger "
+                   "after insert or update or delete on aliases "
+                   "for each statement execute procedure notify_aliases()" );
+    d->t->enqueue( "drop trigger if exists scripts_aliases_trigger "
+                   "on scripts" );
+    d->t->enqueue( "create trigger scripts_aliases_trigger "
+                   "after insert or update or delete on scripts "
+                   "for each statement execute procedure notify_aliases()" );
+    d->t->enqueue( "drop trigger if exists users_aliases_trigger "
+                   "on users" );
+    d->t->enqueue( "create trigger users_aliases_trigger "
+                   "after update or delete on users "
+                   "for each statement execute procedure notify_aliases()" );
+    d->t->enqueue( "drop trigger if exists mailboxes_aliases_trigger "
+                   "on mailboxes" );
+    d->t->enqueue( "create trigger mailboxes_aliases_trigger "
+                   "after update of deleted, owner on mailboxes "
+                   "for each statement execute procedure notify_aliases()" );
+    return true;
+}
+
+
+/*! Adds messages.base_subject, so that SORT and THREAD can use a
+    precomputed base subject instead of computing one per message. The
+    column is null for existing messages until "aox update database"
+    fills it in.
+*/
+
+bool Schema::stepTo107()
+{
+    describeStep( "Adding messages.base_subject." );
+    d->t->enqueue( "alter table messages add base_subject text" );
+    return true;
+}
+
+
+/*! Adds triggers that notify permissions_updated whenever the
+    permissions, groups or group members change, or a mailbox is
+    deleted or changes owner, so that Permissions can cache ACLs.
+*/
+
+bool Schema::stepTo108()
+{
+    describeStep( "Adding permissions_updated notifications." );
+    d->t->enqueue( "create or replace function notify_permissions() "
+                   "returns trigger as $$ "
+                   "begin "
+                   "notify permissions_updated; return NULL; "
+                   "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "create trigger permissions_trigger "
+                   "after insert or update or delete on permissions "
+                   "for each statement "
+                   "execute procedure notify_permissions()" );
+    d->t->enqueue( "create trigger groups_permissions_trigger "
+                   "after insert or update or delete on groups "
+                   "for each statement "
+                   "execute procedure notify_permissions()" );
+    d->t->enqueue( "create trigger group_members_permissions_trigger "
+                   "after insert or update or delete on group_members "
+                   "for each statement "
+                   "execute procedure notify_permissions()" );
+    d->t->enqueue( "create trigger mailboxes_permissions_trigger "
+                   "after update of deleted, owner on mailboxes "
+                   "for each statement "
+                   "execute procedure notify_permissions()" );
+    return true;
+}
+
+
+/*! Adds mailboxes.changeseq, which a trigger sets from a sequence
+    whenever a mailbox is inserted or updated, so that the servers can
+    reread only the mailboxes that have changed.
+*/
+
+bool Schema::stepTo109()
+{
+    describeStep( "Adding mailboxes.changeseq." );
+    d->t->enqueue( "alter table mailboxes add "
+                   "changeseq bigint not null default 0" );
+    d->t->enqueue( "create sequence mailbox_changeseq" );
+    d->t->enqueue( "create index mb_cs on mailboxes(changeseq)" );
+    d->t->enqueue( "create function set_mailbox_changeseq() "
+                   "returns trigger as $$ "
+                   "begin "
+                   "new.changeseq := nextval('mailbox_changeseq'); "
+                   "return new; "
+                   "end;$$ language 'plpgsql'" );
+    d->t->enqueue( "create trigger mailbox_changeseq_trigger "
+                   "before insert or update on mailboxes for each row "
+                   "execute procedure set_mailbox_changeseq()" );
+    return true;
+}
+
+
+/*! Adds an index on deleted_messages by mailbox and deletion time, so
+    that aox undelete can find the messages deleted from a mailbox
+    during a given period quickly.
+*/
+
+bool Schema::stepTo110()
+{
+    describeStep( "Indexing deleted_messages by deletion time." );
+    createIndex( "dm_md" );
+    return true;
+}
+
+
+/*! Adds thread_links, which records each message's parent for THREAD,
+    so that THREAD need not parse References fields. "aox update
+    database" fills it in for existing messages.
+*/
+
+bool Schema::stepTo111()
+{
+    describeStep( "Adding thread_links." );
+    d->t->enqueue( "create table thread_links ("
+                   "message integer primary key references messages(id) "
+                   "on delete cascade, "
+                   "messageid text, "
+                   "parent_messageid text, "
+                   "parent integer)" );
+    d->t->enqueue( "create index tl_mid on thread_links(messageid)" );
+    d->t->enqueue( "create index tl_pmid on thread_links(parent_messageid) "
+                   "where parent is null" );
+    return true;
+}
+
+
+/*! Adds header_blobs, where compact-headers stores the header fields
+    of each part which aren't broken out into header_fields. "aox
+    update database" moves the existing fields there once
+    compact-headers is enabled.
+*/
+
+bool Schema::stepTo112()
+{
+    describeStep( "Adding header_blobs." );
+    d->t->enqueue( "create table header_blobs ("
+                   "message integer not null, "
+                   "part text not null, "
+                   "fields text not null, "
+                   "primary key (message, part), "
+                   "foreign key (message, part) "
+                   "references part_numbers(message, part) "
+                   "on delete cascade)" );
+    return true;
+}
+
+
+/*! Adds m_ib, a block range index on messages.idate. Messages are
+    mostly stored in internal date order, so it lets date searches and
+    retention skip the parts of an archive which are too old or too
+    new, as partitioning by date would, while costing next to nothing
+    to maintain. BRIN needs PostgreSQL 9.5; on older servers this step
+    does nothing, and "aox vacuum" builds the index after a later
+    PostgreSQL upgrade.
+*/
+
+bool Schema::stepTo113()
+{
+    describeStep( "Adding a block range index on messages.idate." );
+    if ( Postgres::version() >= 90500 )
+        createIndex( "m_ib" );
+    return true;
+}
+
+
+/*! Makes the part columns compare bytewise. Part numbers such as
+    "2.1.3" are keys, and comparing them according to the database's
+    locale made every index lookup and sort on (message, part) call
+    strcoll(). Changing the collation doesn't rewrite the tables, but
+    it rebuilds the indices on those columns.
+*/
+
+bool Schema::stepTo114()
+{
+    describeStep( "Making part numbers compare bytewise." );
+    d->t->enqueue( "alter table part_numbers "
+                   "alter part type text collate \"C\"" );
+    d->t->enqueue( "alter table header_fields "
+                   "alter part type text collate \"C\"" );
+    d->t->enqueue( "alter table address_fields "
+                   "alter part type text collate \"C\"" );
+    d->t->enqueue( "alter table header_blobs "
+                   "alter part type text collate \"C\"" );
+    return true;
+}
+
+
+/*! Adds thread_links.ancestors, which holds every Message-ID in the
+    References field, oldest first, so that THREAD can link through
+    ancestors which aren't among the messages threaded, as RFC 5256
+    requires. The column is filled in from header_fields for the
+    messages which already have thread links.
+*/
+
+bool Schema::stepTo115()
+{
+    describeStep( "Recording all ancestors in thread_links." );
+    d->t->enqueue( "alter table thread_links add ancestors text" );
+    d->t->enqueue( "update thread_links tl set ancestors=hf.value "
+                   "from header_fields hf "
+                   "where hf.message=tl.message and hf.part='' "
+                   "and hf.field=" + fn( HeaderField::References ) );
+    return true;
+}
@@ -16,6 +16,7 @@ class Schema
 public:
     Schema( EventHandler *, bool = false, bool = true );
     Query * result() const;
+    void setOnline( bool );
     void execute();
 
     EString serverVersion() const;
@@ -123,8 +124,26 @@ private:
     bool stepTo96();
     bool stepTo97();
     bool stepTo98();
+    bool stepTo99();
+    bool stepTo100();
+    bool stepTo101();
+    bool stepTo102();
+    bool stepTo103();
+    bool stepTo104();
+    bool stepTo105();
+    bool stepTo106();
+    bool stepTo107();
+    bool stepTo108();
+    bool stepTo109();
+    bool stepTo110();
+    bool stepTo111();
+    bool stepTo112();
+    bool stepTo113();
+    bool stepTo114();
+    bool stepTo115();
 
     void describeStep( const EString & );
+    void createIndex( const EString & );
 };
 
 
@@ -8,6 +8,13 @@
 #include "event.h"
 #include "scope.h"
 #include "list.h"
+#include "span.h"
+#include "clusterbus.h"
+#include "estringlist.h"
+#include "configuration.h"
+
+
+class GroupCommit;
 
 
 class TransactionData
@@ -18,8 +25,9 @@ public:
         : state( Transaction::Inactive ), parent( 0 ), activeChild( 0 ),
           children( 0 ),
           submittedCommit( false ), submittedBegin( false ),
-          committing( false ),
-          owner( 0 ), db( 0 ), queries( 0 ), failedQuery( 0 )
+          committing( false ), groupable( false ), released( false ),
+          owner( 0 ), db( 0 ), queries( 0 ), failedQuery( 0 ), group( 0 ),
+          span( 0 ), notifications( 0 )
     {}
 
     Transaction::State state;
@@ -30,6 +38,8 @@ public:
     bool submittedCommit;
     bool submittedBegin;
     bool committing;
+    bool groupable;
+    bool released;
     EventHandler * owner;
     Database *db;
 
@@ -38,6 +48,12 @@ public:
     Query * failedQuery;
     EString error;
 
+    GroupCommit * group;
+
+    Span * span;
+
+    EStringList * notifications;
+
     class CommitBouncer
         : public EventHandler
     {
@@ -72,6 +88,87 @@ public:
 };
 
 
+// The group commit currently accepting members, if any.
+static GroupCommit * openGroup = 0;
+
+
+// A GroupCommit merges the transactions that call allowGroupCommit()
+// into one database transaction, each as a savepoint, and commits
+// them all at once. A member's release savepoint doesn't make it
+// Completed; the group's commit does. The group accepts members while
+// it still has work in progress, and commits as soon as every member
+// has either been released or failed.
+
+class GroupCommit
+    : public EventHandler
+{
+public:
+    GroupCommit(): t( 0 ), finished( false ) {
+        t = new Transaction( this );
+    }
+
+    static void join( Transaction * m ) {
+        if ( !openGroup )
+            openGroup = new GroupCommit;
+        GroupCommit * g = openGroup;
+        Transaction * p = g->t;
+        p->d->children++;
+        m->d->parent = p;
+        m->d->savepoint = p->d->savepoint + "_" + fn( p->d->children );
+        m->d->group = g;
+        g->members.append( m );
+        if ( g->members.count() >=
+             Configuration::scalar( Configuration::DbGroupCommit ) )
+            openGroup = 0;
+    }
+
+    void execute() {
+        if ( finished )
+            return;
+
+        if ( !t->done() ) {
+            if ( t->d->submittedCommit )
+                return;
+            List<Transaction>::Iterator i( members );
+            while ( i ) {
+                if ( !i->done() && !i->d->released )
+                    return;
+                ++i;
+            }
+            if ( openGroup == this )
+                openGroup = 0;
+            if ( Log::enabled( Log::Debug ) )
+                log( "Committing " + fn( members.count() ) +
+                     " transactions together", Log::Debug );
+            t->commit();
+            return;
+        }
+
+        finished = true;
+        if ( openGroup == this )
+            openGroup = 0;
+        List<Transaction>::Iterator i( members );
+        while ( i ) {
+            Transaction * m = i;
+            ++i;
+            if ( m->done() )
+                continue;
+            if ( t->state() == Transaction::Completed )
+                m->setState( Transaction::Completed );
+            else if ( t->failed() )
+                m->setError( t->failedQuery(), t->error() );
+            else
+                m->setError( 0, "Group commit rolled back" );
+            m->notify();
+        }
+    }
+
+    Transaction * t;
+    List<Transaction> members;
+    bool finished;
+};
+
+
 /*! \class Transaction transaction.h
     This class manages a single database transaction.
 
@@ -104,6 +201,9 @@ public:
     subtransaction will wait. The parent executes its queries in the
     order submitted, including the "savepoint" queries that activate a
     subtransaction.
+
+    Small transactions can call allowGroupCommit() to share a COMMIT
+    with those of other sessions (see db-group-commit).
 */
 
 
@@ -165,8 +265,9 @@ void Transaction::setDatabase( Database *db )
     d->db = db;
 
     Scope x( d->owner->log() );
-    log( "Using database connection " + fn( db->connectionNumber() ),
-         Log::Debug );
+    if ( Log::enabled( Log::Debug ) )
+        log( "Using database connection " + fn( db->connectionNumber() ),
+             Log::Debug );
 
     if ( d->queries )
         return;
@@ -189,6 +290,27 @@ void Transaction::setDatabase( Database *db )
 void Transaction::setState( State s )
 {
     d->state = s;
+    if ( d->span && done() )
+        d->span->end();
+    if ( s != Completed || !d->notifications )
+        return;
+
+    EStringList * n = d->notifications;
+    d->notifications = 0;
+    if ( d->parent && !d->group ) {
+        // a released savepoint isn't durable; the parent's commit is
+        if ( !d->parent->d->notifications )
+            d->parent->d->notifications = new EStringList;
+        d->parent->d->notifications->append( *n );
+        return;
+    }
+    n->removeDuplicates();
+    EStringList::Iterator i( n );
+    while ( i ) {
+        int sp = i->find( ' ' );
+        ClusterBus::send( i->mid( 0, sp ), i->mid( sp + 1 ) );
+        ++i;
+    }
 }
 
 
@@ -255,6 +377,10 @@ void Transaction::setError( Query * query, const EString &s )
     d->failedQuery = query;
     d->error = s;
     d->state = Failed;
+    if ( d->span ) {
+        d->span->setArgument( "error", s );
+        d->span->end();
+    }
     if ( !query )
         return;
     EString qs = query->string();
@@ -345,6 +471,33 @@ void Transaction::enqueue( const EString & text )
 }
 
 
+/*! Enqueues a NOTIFY \a name with \a payload, and arranges for the
+    ClusterBus to send the same notification to the other servers as
+    soon as this Transaction commits. PostgreSQL sends its own copy of
+    the notification on commit as usual.
+*/
+
+void Transaction::enqueueNotification( const EString & name,
+                                       const EString & payload )
+{
+    Query * q = 0;
+    if ( payload.isEmpty() ) {
+        q = new Query( "notify " + name, 0 );
+    }
+    else {
+        q = new Query( "select pg_notify($1,$2)", 0 );
+        q->bind( 1, name );
+        q->bind( 2, payload );
+    }
+    enqueue( q );
+    if ( q->failed() )
+        return;
+    if ( !d->notifications )
+        d->notifications = new EStringList;
+    d->notifications->append( name + " " + payload );
+}
+
+
 /*! Issues a ROLLBACK to abandon the Transaction, and fails any
     queries that still haven't been sent to the server. The owner is
     notified of completion.
@@ -435,6 +588,8 @@ void Transaction::finalizeBegin( Query * q )
         notify();
         if ( d->parent )
             d->parent->execute();
+        if ( d->group )
+            d->group->execute();
     }
     else {
         setState( Executing );
@@ -459,6 +614,17 @@ void Transaction::finalizeBegin( Query * q )
 
 void Transaction::finalizeTransaction( Query * q )
 {
+    if ( !q->failed() && d->group && d->committing && d->state != Failed ) {
+        // our work is released into the group's transaction, and
+        // becomes durable when the group commits.
+        d->released = true;
+        if ( d->parent->d->activeChild == this )
+            d->parent->d->activeChild = 0;
+        d->parent->execute();
+        d->group->execute();
+        return;
+    }
+
     if ( !q->failed() ) {
         if ( !d->committing )
             setState( RolledBack );
@@ -484,6 +650,9 @@ void Transaction::finalizeTransaction( Query * q )
         notify();
         // a rollback failed. how is this even possible? what to do?
     }
+
+    if ( d->group && done() )
+        d->group->execute();
 }
 
 
@@ -535,7 +704,17 @@ void Transaction::execute()
     if ( !d->queries || d->queries->isEmpty() )
         return;
 
+    if ( !d->span && !d->submittedBegin ) {
+        if ( d->parent && d->parent->d->span )
+            d->span = Span::start( "subtransaction", d->parent->d->span );
+        else if ( d->owner )
+            d->span = Span::start( "transaction", d->owner->log() );
+    }
+
     // we may need to set up queries in order to start
+    if ( !d->submittedBegin && !d->parent && d->groupable &&
+         Configuration::scalar( Configuration::DbGroupCommit ) )
+        GroupCommit::join( this );
     if ( !d->submittedBegin ) {
         // if not, we have to obtain one
         bool parentDone = false;
@@ -587,6 +766,16 @@ void Transaction::execute()
 }
 
 
+/*! Returns the Span recording this Transaction's progress, or a null
+    pointer if it isn't being traced.
+*/
+
+Span * Transaction::span() const
+{
+    return d->span;
+}
+
+
 /*! Returns a pointer to the owner of this query, as specified to the
     constructor. Transactions MUST have owners, so this function may
     not return 0. There is an exception: If the owner is severely
@@ -607,6 +796,7 @@ void Transaction::notify()
         return;
     Scope s( d->owner->log() );
     try {
+        EventClock clock( d->owner );
         d->owner->execute();
     }
     catch ( const Exception& e ) {
@@ -643,6 +833,26 @@ void Transaction::notify()
 }
 
 
+/*! Permits this Transaction to be merged with other short
+    transactions into a single commit, if db-group-commit is nonzero.
+    It then runs as a savepoint within a transaction shared with other
+    sessions, so its own failure doesn't affect them, and it becomes
+    Completed only when the shared transaction commits.
+
+    This is meant for small, frequent writes such as flag changes. It
+    has no effect on a subTransaction(), or after execute().
+
+    Members of a group run one after another, so the transactions of a
+    session reach the database, and allocate their modseqs, in the
+    order they were executed.
+*/
+
+void Transaction::allowGroupCommit()
+{
+    d->groupable = true;
+}
+
+
 /*! Returns a pointer to the currently active subtransaction, or to
     this transaction is no subtransaction is active.
 */
@@ -10,6 +10,7 @@ class Query;
 class EString;
 class Database;
 class EventHandler;
+class Span;
 
 
 class Transaction
@@ -34,6 +35,7 @@ public:
     void enqueue( Query * );
     void enqueue( const char * );
     void enqueue( const EString & );
+    void enqueueNotification( const EString &, const EString & = "" );
     void execute();
     void rollback();
     void restart();
@@ -41,6 +43,7 @@ public:
 
     List< Query > * submittedQueries();
     EventHandler * owner() const;
+    Span * span() const;
     void notify();
 
     Transaction * subTransaction( EventHandler * );
@@ -51,8 +54,11 @@ public:
 
     Transaction * activeSubTransaction();
 
+    void allowGroupCommit();
+
 private:
     class TransactionData *d;
+    friend class GroupCommit;
 };
 
 
@@ -0,0 +1,73 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tunableindex.h"
+
+
+/*! \class TunableIndex tunableindex.h
+
+    The TunableIndex struct describes an index that "aox tune
+    database" may add or drop, and which aoximport -b drops while it
+    loads messages.
+
+    tunableIndices is a list of them, ending with an entry whose name
+    is a null pointer. writing, reading and advanced say whether the
+    index is wanted for each of the modes of "aox tune database".
+*/
+
+const TunableIndex tunableIndices[] = {
+    { "pn_b", "part_numbers",
+      "CREATE INDEX pn_b ON part_numbers "
+      "USING btree (bodypart)",
+      false, true, true },
+    { "af_mp", "address_fields",
+      "CREATE INDEX af_mp ON address_fields "
+      "USING btree (message, part)",
+      false, true, true },
+    { "fl_mu", "flags",
+      "CREATE INDEX fl_mu ON flags "
+      "USING btree (mailbox, uid)",
+      false, true, true },
+    { "dm_mud", "deleted_messages",
+      "CREATE INDEX dm_mud ON deleted_messages "
+      "USING btree (mailbox, uid, deleted_at)",
+      false, true, true },
+    { "mm_m", "mailbox_messages",
+      "CREATE INDEX mm_m ON mailbox_messages "
+      "USING btree (message)",
+      false, true, true },
+    { "dm_m", "deleted_messages",
+      "CREATE INDEX dm_m ON deleted_messages "
+      "USING btree (message)",
+      false, true, true },
+    { "df_m", "date_fields",
+      "CREATE INDEX df_m ON date_fields "
+      "USING btree (message)",
+      false, true, true },
+    { "hf_msgid", "header_fields",
+      "CREATE INDEX hf_msgid ON header_fields "
+      "USING btree (value) WHERE (field = 13)",
+      false, true, true },
+    { "dm_mm", "deleted_messages",
+      "CREATE INDEX dm_mm ON deleted_messages "
+      "USING btree (mailbox, modseq)",
+      false, true, true },
+    { "m_idate", "messages",
+      "CREATE INDEX m_idate ON messages "
+      "USING btree (idate)",
+      false, true, true },
+    { "mm_unseen", "mailbox_messages",
+      "CREATE INDEX mm_unseen ON mailbox_messages "
+      "USING btree (mailbox, uid) WHERE (NOT seen)",
+      false, false, true },
+    { "b_text", "bodyparts",
+      "CREATE INDEX b_text ON bodyparts "
+      "USING gin (to_tsvector('simple'::regconfig, text)) "
+      "WHERE (octet_length(text) < (640000))",
+      false, false, true },
+    { "hf_subject", "header_fields",
+      "CREATE INDEX hf_subject ON header_fields "
+      "USING gin (to_tsvector('simple'::regconfig, value)) "
+      "WHERE (octet_length(value) < (640000) and field=20)",
+      false, false, true },
+    { 0, 0, 0, false, false, false }
+};
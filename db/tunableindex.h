@@ -0,0 +1,22 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef TUNABLEINDEX_H
+#define TUNABLEINDEX_H
+
+#include "global.h"
+
+
+struct TunableIndex {
+    const char * name;
+    const char * table;
+    const char * definition;
+    bool writing;
+    bool reading;
+    bool advanced;
+};
+
+
+extern const TunableIndex tunableIndices[];
+
+
+#endif
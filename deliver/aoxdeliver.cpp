@@ -14,6 +14,7 @@
 #include "query.h"
 #include "file.h"
 #include "user.h"
+#include "estringlist.h"
 #include "log.h"
 #include "utf.h"
 
@@ -24,6 +25,10 @@
 #include <time.h>
 // all the exit codes
 #include <sysexits.h>
+// opendir, readdir, closedir
+#include <dirent.h>
+// stat, S_ISREG
+#include <sys/stat.h>
 
 
 static void quit( uint s, const EString & m )
@@ -34,24 +39,42 @@ static void quit( uint s, const EString & m )
 }
 
 
+// The Deliverator looks up the destination mailbox once, then reads,
+// parses and stores the messages in batches of injection-batch-size,
+// one transaction per batch, all using the same database connection.
+
 class Deliverator
     : public EventHandler
 {
 public:
     Query * q;
     Injector * i;
-    Injectee * m;
+    EStringList files;
+    List<Injectee> batch;
+    EStringList batchFiles;
     UString mbn;
     EString un;
     Permissions * p;
     Mailbox * mb;
-
-    Deliverator( Injectee * message,
+    bool remove;
+    int verbose;
+    uint stored;
+    uint unreadable;
+    uint unparsable;
+    bool done;
+
+    Deliverator( Injectee * message, EStringList * filenames,
                  const UString & mailbox, const EString & user )
-        : q( 0 ), i( 0 ), m( message ), mbn( mailbox ), un( user ),
-          p( 0 ), mb( 0 )
+        : q( 0 ), i( 0 ), mbn( mailbox ), un( user ),
+          p( 0 ), mb( 0 ), remove( false ), verbose( 0 ),
+          stored( 0 ), unreadable( 0 ), unparsable( 0 ), done( false )
     {
         Allocator::addEternal( this, "deliver object" );
+        if ( message ) {
+            batch.append( message );
+            batchFiles.append( "" );
+        }
+        files.append( *filenames );
         q = new Query( "select al.mailbox, n.name as namespace, u.login "
                        "from aliases al "
                        "join addresses a on (al.address=a.id) "
@@ -118,28 +141,127 @@ public:
                   "User 'anyone' does not have 'p' right on mailbox " +
                   mbn.ascii().quoted( '\'' ) );
 
-        if ( !i ) {
-            EStringList x;
-            m->setFlags( mb, &x );
-            i = new Injector( this );
-            List<Injectee> y;
-            y.append( m );
-            i->addInjection( &y );
-            i->execute();
-        }
+        while ( !done ) {
+            if ( !i ) {
+                fillBatch();
+                if ( batch.isEmpty() ) {
+                    done = true;
+                    break;
+                }
+                EStringList x;
+                List<Injectee>::Iterator m( batch );
+                while ( m ) {
+                    m->setFlags( mb, &x );
+                    ++m;
+                }
+                i = new Injector( this );
+                i->addInjection( &batch );
+                i->execute();
+            }
 
-        if ( !i->done() )
-            return;
+            if ( !i->done() )
+                return;
 
-        if ( i->failed() )
-            quit( EX_SOFTWARE, "Injection error: " + i->error() );
+            if ( i->failed() ) {
+                EString e = "Injection error: " + i->error();
+                if ( stored )
+                    e.append( " (" + fn( stored ) +
+                              " messages were stored before the error)" );
+                quit( EX_SOFTWARE, e );
+            }
+
+            i = 0;
+            finishBatch();
+        }
 
-        i = 0;
         EventLoop::shutdown();
     }
+
+    // reads and parses the next messages, reporting and skipping
+    // those that cannot be read or parsed.
+
+    void fillBatch()
+    {
+        uint max = Configuration::scalar( Configuration::InjectionBatchSize );
+        if ( max < 1 )
+            max = 1;
+        while ( batch.count() < max && !files.isEmpty() ) {
+            EString f = *files.shift();
+            File file( f );
+            if ( !file.valid() ) {
+                fprintf( stderr,
+                         "aoxdeliver: Unable to open message file %s\n",
+                         f.cstr() );
+                unreadable++;
+                continue;
+            }
+            Injectee * m = new Injectee;
+            m->parse( file.contents() );
+            if ( !m->error().isEmpty() ) {
+                fprintf( stderr,
+                         "aoxdeliver: %s: Message parsing failed: %s\n",
+                         f.cstr(), m->error().cstr() );
+                unparsable++;
+                continue;
+            }
+            batch.append( m );
+            batchFiles.append( f );
+        }
+    }
+
+    // reports, and if requested removes, the messages in a batch that
+    // has just been committed.
+
+    void finishBatch()
+    {
+        List<Injectee>::Iterator m( batch );
+        EStringList::Iterator f( batchFiles );
+        while ( m ) {
+            if ( verbose && f->isEmpty() )
+                fprintf( stderr, "aoxdeliver: Stored in %s as UID %d\n",
+                         mb->name().utf8().cstr(), m->uid( mb ) );
+            else if ( verbose )
+                fprintf( stderr, "aoxdeliver: Stored %s in %s as UID %d\n",
+                         f->cstr(), mb->name().utf8().cstr(), m->uid( mb ) );
+            if ( remove && !f->isEmpty() )
+                File::unlink( *f );
+            stored++;
+            ++m;
+            ++f;
+        }
+        batch.clear();
+        batchFiles.clear();
+    }
 };
 
 
+// adds \a name to \a files, or if \a name is a directory, each file
+// in that directory whose name doesn't start with a dot, in order.
+
+static void addFiles( EStringList * files, const EString & name )
+{
+    DIR * dir = opendir( name.cstr() );
+    if ( !dir ) {
+        files->append( name );
+        return;
+    }
+
+    EStringList entries;
+    struct dirent * de = readdir( dir );
+    while ( de ) {
+        if ( de->d_name[0] != '.' ) {
+            EString f = name + "/" + de->d_name;
+            struct stat st;
+            if ( stat( f.cstr(), &st ) == 0 && S_ISREG( st.st_mode ) )
+                entries.append( f );
+        }
+        de = readdir( dir );
+    }
+    closedir( dir );
+    files->append( *entries.sorted() );
+}
+
+
 int main( int argc, char *argv[] )
 {
     Scope global;
@@ -147,7 +269,9 @@ int main( int argc, char *argv[] )
     EString sender;
     UString mailbox;
     EString recipient;
-    EString filename;
+    EStringList filenames;
+    bool fromStdin = true;
+    bool remove = false;
     int verbose = 0;
     bool error = false;
 
@@ -169,6 +293,12 @@ int main( int argc, char *argv[] )
                 }
                 break;
 
+            case 'r':
+                remove = true;
+                if ( argv[n][2] != '\0' )
+                    error = true;
+                break;
+
             case 'v':
                 {
                     int i = 1;
@@ -189,45 +319,35 @@ int main( int argc, char *argv[] )
         else if ( recipient.isEmpty() ) {
             recipient = argv[n];
         }
-        else if ( filename.isEmpty() ) {
-            filename = argv[n];
-        }
         else {
-            error = true;
+            addFiles( &filenames, argv[n] );
+            fromStdin = false;
         }
         n++;
     }
 
     if ( error || recipient.isEmpty() ) {
         fprintf( stderr,
-                 "Syntax: aoxdeliver [-v] [-f sender] recipient [filename]\n" );
+                 "Syntax: aoxdeliver [-v] [-r] [-f sender] [-t mailbox] "
+                 "recipient [filename|directory ...]\n" );
         exit( -1 );
     }
 
-    EString contents;
-    if ( filename.isEmpty() ) {
+    Configuration::setup( "archiveopteryx.conf" );
+
+    Injectee * message = 0;
+    if ( fromStdin ) {
+        EString contents;
         char s[128];
         while ( fgets( s, 128, stdin ) != 0 )
             contents.append( s );
-    }
-    else {
-        File message( filename );
-        if ( !message.valid() ) {
-            fprintf( stderr, "Unable to open message file %s\n",
-                     filename.cstr() );
-            exit( -1 );
+        message = new Injectee;
+        message->parse( contents );
+        if ( !message->error().isEmpty() ) {
+            fprintf( stderr,
+                     "Message parsing failed: %s", message->error().cstr( ) );
+            exit( EX_DATAERR );
         }
-        contents = message.contents();
-    }
-
-    Configuration::setup( "archiveopteryx.conf" );
-
-    Injectee * message = new Injectee;
-    message->parse( contents );
-    if ( !message->error().isEmpty() ) {
-        fprintf( stderr,
-                 "Message parsing failed: %s", message->error().cstr( ) );
-        exit( EX_DATAERR );
     }
 
     if ( verbose > 0 )
@@ -243,15 +363,20 @@ int main( int argc, char *argv[] )
 
     Configuration::report();
     Mailbox::setup();
-    Deliverator * d = new Deliverator( message, mailbox, recipient );
+    Deliverator * d = new Deliverator( message, &filenames,
+                                       mailbox, recipient );
+    d->remove = remove;
+    d->verbose = verbose;
     EventLoop::global()->start();
-    if ( !d->i || d->i->failed() )
+    if ( !d->done )
         return EX_UNAVAILABLE;
 
-    if ( verbose )
-        fprintf( stderr,
-                 "aoxdeliver: Stored in %s as UID %d\n",
-                 d->mb->name().utf8().cstr(),
-                 d->m->uid( d->mb ) );
+    if ( verbose && !fromStdin )
+        fprintf( stderr, "aoxdeliver: Stored %d messages in %s\n",
+                 d->stored, d->mb->name().utf8().cstr() );
+    if ( d->unreadable )
+        return EX_NOINPUT;
+    if ( d->unparsable )
+        return EX_DATAERR;
     return 0;
 }
@@ -24,6 +24,9 @@
 #include "euckr.h"
 #include "gbk.h"
 
+// memcpy
+#include <string.h>
+
 
 /*! \class Codec codec.h
     The Codec class describes a mapping between UString and anything else.
@@ -618,6 +621,29 @@ void Codec::append( UString & u, uint c )
 }
 
 
+/*! Returns the number of ASCII characters (those below 128) in \a s
+    starting at \a i, or 0 if \a s[i] is not ASCII. Looks at eight
+    bytes at a time, so codecs can handle runs of ASCII in bulk.
+*/
+
+uint Codec::asciiSpan( const EString & s, uint i )
+{
+    uint l = s.length();
+    const char * p = s.data();
+    uint j = i;
+    while ( j + 8 <= l ) {
+        unsigned long long w;
+        memcpy( &w, p + j, 8 );
+        if ( w & 0x8080808080808080ULL )
+            break;
+        j += 8;
+    }
+    while ( j < l && !( p[j] & 0x80 ) )
+        j++;
+    return j - i;
+}
+
+
 /*! Checks whether the last codepoint in \a u is a leading surrogate,
     and flags an error if so.
 */
@@ -680,6 +706,16 @@ UString AsciiCodec::toUnicode( const EString & s )
     u.reserve( s.length() );
     uint i = 0;
     while ( i < s.length() ) {
+        // copy printable ASCII in bulk
+        uint j = i;
+        while ( j < s.length() && s[j] >= 32 && s[j] < 128 )
+            j++;
+        if ( j > i + 1 ) {
+            mangleTrailingSurrogate( u );
+            u.append( s.data() + i, j - i );
+            i = j;
+            continue;
+        }
         if ( s[i] == 0 || s[i] > 127 ) {
             recordError( i, s[i] );
             append( u, 0xFFFD );
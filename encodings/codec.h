@@ -44,6 +44,8 @@ public:
 
     static class EStringList * allCodecNames();
 
+    static uint asciiSpan( const EString &, uint );
+
 private:
     State s;
     EString n;
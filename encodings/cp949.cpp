@@ -5,11 +5,11 @@
 #include "ustring.h"
 
 
-static const uint toU[65536] = {
+static const ushort toU[65536] = {
 #include "cp949.inc"
 };
 
-static const uint toE[65536] = {
+static const ushort toE[65536] = {
 #include "cp949-rev.inc"
 };
 
@@ -53,7 +53,7 @@ EString Cp949Codec::fromUnicode( const UString &u )
         if ( n < 128 ) {
             s.append( (char)n );
         }
-        else if ( toE[n] != 0 ) {
+        else if ( n < 65536 && toE[n] != 0 ) {
             n = toE[n];
             if ( n >> 8 != 0 )
                 s.append( n >> 8 );
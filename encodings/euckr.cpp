@@ -5,15 +5,6 @@
 #include "ustring.h"
 
 
-static const uint toU[94][94] = {
-#include "ksc5601.inc"
-};
-
-static const uint toE[65536] = {
-#include "ksc5601-rev.inc"
-};
-
-
 /*! \class EucKrCodec euckr.h
 
     This codec translates between Unicode and KS C 5601-1992 (apparently
@@ -5,11 +5,11 @@
 #include "ustring.h"
 
 
-static const uint gbToUnicode[94][94] = {
+static const ushort gbToUnicode[94][94] = {
 #include "gb2312.inc"
 };
 
-static const uint unicodeToGb[65536] = {
+static const ushort unicodeToGb[65536] = {
 #include "gb2312-rev.inc"
 };
 
@@ -5,11 +5,11 @@
 #include "ustring.h"
 
 
-static const uint gbkToUnicode[65536] = {
+static const ushort gbkToUnicode[65536] = {
 #include "gbk.inc"
 };
 
-static const uint unicodeToGbk[65536] = {
+static const ushort unicodeToGbk[65536] = {
 #include "gbk-rev.inc"
 };
 
@@ -40,7 +40,7 @@ EString GbkCodec::fromUnicode( const UString &u )
         if ( n < 128 ) {
             s.append( (char)n );
         }
-        else if ( unicodeToGbk[n] != 0 ) {
+        else if ( n < 65536 && unicodeToGbk[n] != 0 ) {
             n = unicodeToGbk[n];
             if ( n != 0x80 )
                 s.append( n >> 8 );
@@ -5,11 +5,11 @@
 #include "ustring.h"
 
 
-static const uint toU[94][94] = {
+static const ushort toU[94][94] = {
 #include "jisx0208.inc"
 };
 
-static const uint toE[65536] = {
+static const ushort toE[65536] = {
 #include "jisx0208-rev.inc"
 };
 
@@ -43,7 +43,21 @@ EString Utf8Codec::fromUnicode( const UString & u )
     uint i = 0;
     while ( i < u.length() ) {
         int c = u[i];
-        if ( pgutf && !c ) {
+        if ( c > 0 && c < 0x80 ) {
+            // copy a run of ASCII in chunks
+            char buf[128];
+            uint n = 0;
+            while ( i < u.length() && u[i] > 0 && u[i] < 0x80 ) {
+                buf[n++] = (char)u[i++];
+                if ( n == sizeof( buf ) ) {
+                    r.append( buf, n );
+                    n = 0;
+                }
+            }
+            r.append( buf, n );
+            continue;
+        }
+        else if ( pgutf && !c ) {
             // append U+ED00 since postgres cannot store 0 bytes
             r.append( 0xEE );
             r.append( 0xB4 );
@@ -120,6 +134,14 @@ UString Utf8Codec::toUnicode( const EString & s )
     u.reserve( s.length() );
     uint i = 0;
     while ( i < s.length() ) {
+        uint n = asciiSpan( s, i );
+        if ( n > 1 ) {
+            mangleTrailingSurrogate( u );
+            u.append( s.data() + i, n );
+            i += n;
+            continue;
+        }
+
         int c = 0;
         if ( s[i] < 0x80 ) {
             // 0000 0000-0000 007F   0xxxxxxx
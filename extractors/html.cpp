@@ -17,12 +17,64 @@
 */
 
 
+// returns the code point of the entity named \a n, or 0 if there
+// isn't any such entity. entities[] is sorted, so a binary search
+// will do.
+
+static uint entity( const UString & n )
+{
+    int b = 0;
+    int e = ents;
+    while ( b < e ) {
+        int m = ( b + e ) / 2;
+        const char * name = entities[m].name;
+        uint l = 0;
+        while ( l < n.length() && name[l] && n[l] == (uint)name[l] )
+            l++;
+        int c;
+        if ( l < n.length() )
+            c = name[l] ? (int)n[l] - (int)name[l] : 1;
+        else
+            c = name[l] ? -1 : 0;
+        if ( c == 0 )
+            return entities[m].chr;
+        if ( c < 0 )
+            e = m;
+        else
+            b = m + 1;
+    }
+    return 0;
+}
+
+
+// returns true if \a c needs the attention of HTML::asText()'s
+// switch, and false if it's just text.
+
+static bool special( uint c )
+{
+    switch ( c ) {
+    case '<':
+    case '>':
+    case '-':
+    case '"':
+    case '\'':
+    case ' ':
+    case '\t':
+    case '\r':
+    case '\n':
+    case '&':
+        return true;
+    }
+    return c >= 0xD800 && c <= 0xDFFF;
+}
+
+
 /*! Returns indexable text extracted from \a h. */
 
 UString HTML::asText( const UString &h )
 {
     UString r;
-    UString t, s, qs, a;
+    UString t, s;
     char last = 0;
     char quote = 0;
     char c;
@@ -34,6 +86,9 @@ UString HTML::asText( const UString &h )
     int sgml = 0;       /* 1 inside <[!?]...> */
     int quoted = 0;     /* 1 inside <foo bar="..."> */
 
+    // the text is rarely longer than the HTML
+    r.reserve( h.length() );
+
     uint i = 0;
     while ( i < h.length() ) {
         /* Each case below sets i to the position of the last character
@@ -90,7 +145,6 @@ UString HTML::asText( const UString &h )
             } else if ( !quoted && last == '=' ) {
                 quoted = 1;
                 quote = h[i];
-                qs.truncate();
             }
             break;
 
@@ -103,7 +157,6 @@ UString HTML::asText( const UString &h )
             if ( !tag && s.isEmpty() )
                 s.append( ' ' );
             tagname = false;
-            a.truncate();
             i++;
             continue;
             break;
@@ -157,30 +210,14 @@ UString HTML::asText( const UString &h )
                 mark = i++;
                 while ( isalnum( h[i] ) )
                     i++;
-                UString ent( h.mid( mark, i-mark ) );
+                uint chr = entity( h.mid( mark, i-mark ) );
                 if ( h[i] != ';' )
                     i--;
 
-                int n = 0;
-                while ( n < ents ) {
-                    uint l = 0;
-                    bool match = true;
-                    while ( l < ent.length() ) {
-                        if ( ent[l] != entities[n].name[l] ) {
-                            match = false;
-                            break;
-                        }
-                        l++;
-                    }
-
-                    if ( match && entities[n].name[l] == '\0' ) {
-                        r.append( s );
-                        r.append( entities[n].chr );
-                        s.truncate();
-                        break;
-                    }
-
-                    n++;
+                if ( chr ) {
+                    r.append( s );
+                    r.append( chr );
+                    s.truncate();
                 }
             }
             else {
@@ -197,12 +234,15 @@ UString HTML::asText( const UString &h )
                 r.append( s );
                 dc.append( r, h[i] );
                 s.truncate();
+                // the rest of a run of ordinary text can go straight
+                // into r
+                while ( !special( h[i] ) && i + 1 < h.length() &&
+                        h[i+1] < 0x110000 && !special( h[i+1] ) ) {
+                    i++;
+                    r.append( h[i] );
+                }
             } else if ( tagname ) {
                 t.append( h[i] );
-            } else if ( !quoted && h[i] == '=' ) {
-                a.truncate();
-            } else {
-                a.append( h[i] );
             }
             break;
         }
@@ -4,10 +4,16 @@
 
 #include "log.h"
 #include "utf.h"
+#include "dict.h"
 #include "imap.h"
 #include "user.h"
+#include "graph.h"
+#include "query.h"
 #include "buffer.h"
 #include "mailbox.h"
+#include "allocator.h"
+#include "span.h"
+#include "configuration.h"
 #include "integerset.h"
 #include "imapparser.h"
 #include "transaction.h"
@@ -75,9 +81,13 @@ public:
           imap( 0 ), session( 0 ), checker( 0 ),
           mailbox( 0 ), mailboxGroup( 0 ),
           checkedMailboxGroup( false ),
-          transaction( 0 )
+          transaction( 0 ),
+          parseTime( 0 ), queries( 0 ),
+          span( 0 ), executing( 0 )
     {
         (void)::gettimeofday( &started, 0 );
+        created = started;
+        finished = started;
     }
 
     EString tag;
@@ -101,7 +111,9 @@ public:
 
     uint permittedStates;
 
+    struct timeval created;
     struct timeval started;
+    struct timeval finished;
 
     IMAP * imap;
     ImapSession * session;
@@ -112,9 +124,50 @@ public:
     bool checkedMailboxGroup;
 
     Transaction * transaction;
+
+    long parseTime;
+    QueryAccount * queries;
+    Span * span;
+    Span * executing;
+};
+
+
+// returns the number of microseconds from a to b
+
+static long usecsBetween( const struct timeval & a,
+                          const struct timeval & b )
+{
+    long elapsed = ( b.tv_sec - a.tv_sec ) * 1000000 +
+                   ( b.tv_usec - a.tv_usec );
+    if ( elapsed < 0 )
+        return 0;
+    return elapsed;
+}
+
+
+// the statistics kept for each command name
+
+class CommandTimes
+    : public Garbage
+{
+public:
+    CommandTimes( const EString & name )
+        : parse( new GraphableDataSet( name + "-parse-time" ) ),
+          queue( new GraphableDataSet( name + "-queue-time" ) ),
+          db( new GraphableDataSet( name + "-db-time" ) ),
+          emit( new GraphableDataSet( name + "-emit-time" ) )
+    {}
+
+    GraphableDataSet * parse;
+    GraphableDataSet * queue;
+    GraphableDataSet * db;
+    GraphableDataSet * emit;
 };
 
 
+static Dict<CommandTimes> * commandTimes = 0;
+
+
 /*! \class Command command.h
     The Command class represents a single IMAP command.
 
@@ -252,6 +305,8 @@ Command * Command::create( IMAP * imap,
             c = new UrlFetch;
         else if ( n == "notify" )
             c = new Notify;
+        else if ( n == "esearch" )
+            c = new Search( true, true );
         else if ( n == "compress" )
             c = new Compress;
         else if ( n == "getquota" )
@@ -339,6 +394,13 @@ Command * Command::create( IMAP * imap,
     c->setLog( new Log );
     c->log( "IMAP Command: " + tag + " " + name );
 
+    c->d->span = Span::start( "imap command", c->log() );
+    if ( c->d->span ) {
+        c->d->span->setName( "imap " + name );
+        c->d->span->setArgument( "tag", tag );
+        c->d->span->setLog( c->log() );
+    }
+
     return c;
 }
 
@@ -374,6 +436,24 @@ void Command::parse()
 */
 
 
+/*! Calls parse() and notes how long it took, so that the time can be
+    reported when the command is retired together with the time spent
+    waiting, in the database and emitting responses.
+*/
+
+void Command::runParser()
+{
+    struct timeval before, after;
+    Span * span = Span::start( "parse", d->span );
+    (void)::gettimeofday( &before, 0 );
+    parse();
+    (void)::gettimeofday( &after, 0 );
+    if ( span )
+        span->end();
+    d->parseTime += usecsBetween( before, after );
+}
+
+
 /*! This virtual function is responsible for reading from the IMAP
     stream and eventually releasing a reservation. Most subclasses
     will not need to implement this; only those that call
@@ -454,6 +534,12 @@ void Command::setState( State s )
     switch( s ) {
     case Retired:
         log( "Retired", Log::Debug );
+        recordTimes();
+        if ( d->span ) {
+            if ( d->executing )
+                d->executing->end();
+            d->span->end();
+        }
         break;
     case Unparsed:
         // this is the initial state, it should never be called.
@@ -463,6 +549,10 @@ void Command::setState( State s )
         break;
     case Executing:
         (void)::gettimeofday( &d->started, 0 );
+        if ( !d->queries )
+            d->queries = new QueryAccount( log() );
+        if ( !d->executing )
+            d->executing = Span::start( "execute", d->span );
         if ( d->permittedStates & ( 1 << imap()->state() ) ) {
             log( "Executing", Log::Debug );
             d->session = (ImapSession*)(imap()->session());
@@ -474,20 +564,21 @@ void Command::setState( State s )
         }
         break;
     case Finished:
+        (void)::gettimeofday( &d->finished, 0 );
+        if ( d->executing )
+            d->executing->end();
         if ( d->name != "idle" ) {
-            struct timeval end;
-            (void)::gettimeofday( &end, 0 );
-            long elapsed =
-                ( end.tv_sec - d->started.tv_sec ) * 1000000 +
-                ( end.tv_usec - d->started.tv_usec );
+            long elapsed = usecsBetween( d->started, d->finished );
             Log::Severity level = Log::Debug;
             if ( elapsed > 3000 )
                 level = Log::Info;
-            EString m;
-            m.append( "Execution time " );
-            m.append( fn( ( elapsed + 499 ) / 1000 ) );
-            m.append( "ms" );
-            log( m, level );
+            if ( Log::enabled( level ) ) {
+                EString m;
+                m.append( "Execution time " );
+                m.append( fn( ( elapsed + 499 ) / 1000 ) );
+                m.append( "ms" );
+                log( m, level );
+            }
         }
         log( "Finished", Log::Debug );
         break;
@@ -496,6 +587,96 @@ void Command::setState( State s )
 }
 
 
+/*! This private helper adds the time this command spent being parsed,
+    waiting to execute, waiting for the database and waiting for its
+    responses to be sent to the statistics for its name(), and logs a
+    summary if the command took longer than imap-slow-command-time.
+
+    Implicit commands (those without a tag) aren't counted.
+*/
+
+void Command::recordTimes()
+{
+    QueryAccount * a = d->queries;
+    d->queries = 0;
+    if ( a )
+        a->close();
+    if ( d->tag.isEmpty() )
+        return;
+
+    struct timeval retired;
+    (void)::gettimeofday( &retired, 0 );
+
+    // all in milliseconds, rounded up so that nothing counts as free
+    uint parse = ( d->parseTime + 999 ) / 1000;
+    long waited = usecsBetween( d->created, d->started ) - d->parseTime;
+    uint queue = 0;
+    if ( waited > 0 )
+        queue = ( waited + 999 ) / 1000;
+    uint execution = ( usecsBetween( d->started, d->finished ) + 999 ) / 1000;
+    uint emit = ( usecsBetween( d->finished, retired ) + 999 ) / 1000;
+    uint total = ( usecsBetween( d->created, retired ) + 999 ) / 1000;
+    uint queries = 0;
+    uint db = 0;
+    if ( a ) {
+        queries = a->queries();
+        db = a->queueTime() + a->executionTime();
+    }
+
+    if ( !::commandTimes ) {
+        ::commandTimes = new Dict<CommandTimes>;
+        Allocator::addEternal( ::commandTimes, "imap command statistics" );
+    }
+    CommandTimes * t = ::commandTimes->find( d->name );
+    if ( !t ) {
+        EString n = "imap-" + d->name;
+        n.replace( " ", "-" );
+        t = new CommandTimes( n );
+        ::commandTimes->insert( d->name, t );
+    }
+    t->parse->addNumber( parse );
+    t->queue->addNumber( queue );
+    t->db->addNumber( db );
+    t->emit->addNumber( emit );
+
+    uint slow = Configuration::scalar( Configuration::ImapSlowCommandTime );
+    if ( !slow || total < slow || d->name == "idle" )
+        return;
+
+    EString s( "Slow command (" );
+    s.appendNumber( total );
+    s.append( "ms: " );
+    s.appendNumber( parse );
+    s.append( "ms parsing, " );
+    s.appendNumber( queue );
+    s.append( "ms waiting, " );
+    s.appendNumber( execution );
+    s.append( "ms executing, of which " );
+    s.appendNumber( db );
+    s.append( "ms in " );
+    s.appendNumber( queries );
+    s.append( " queries, " );
+    s.appendNumber( emit );
+    s.append( "ms sending responses): " );
+    s.append( d->tag );
+    s.append( " " );
+    s.append( d->name );
+    User * u = imap()->user();
+    if ( u ) {
+        s.append( ", user " );
+        s.append( u->login().utf8() );
+    }
+    Mailbox * m = d->mailbox;
+    if ( !m && imap()->session() )
+        m = imap()->session()->mailbox();
+    if ( m ) {
+        s.append( ", mailbox " );
+        s.append( m->name().utf8() );
+    }
+    log( s, Log::Significant );
+}
+
+
 /*! Returns the tag of this command. Useful for logging. */
 
 EString Command::tag() const
@@ -558,6 +739,9 @@ uint Command::group() const
     4) STATUS, LIST. Perhaps other read-only commands that look at
        mailboxes.
 
+    5) APPEND, so that pipelined APPEND commands can be injected
+       together.
+
     The initial value is 0.
 */
 
@@ -997,6 +1181,10 @@ UString Command::listMailbox()
 /*! Parses an IMAP set and returns the corresponding IntegerSet object.
     The set always contains UIDs; this function creates an UID set even
     if \a parseMsns is true.
+
+    "$" (RFC 5182) is the result saved by the last SEARCH RETURN
+    (SAVE). IMAP doesn't parse a command until any earlier saving
+    search has finished, so the saved result is current.
 */
 
 IntegerSet Command::set( bool parseMsns = false )
@@ -1006,6 +1194,15 @@ IntegerSet Command::set( bool parseMsns = false )
     if ( imap() )
         s = (ImapSession*)imap()->session();
 
+    if ( nextChar() == '$' ) {
+        step();
+        if ( s )
+            result = s->searchResult();
+        else
+            error( Bad, "Need a mailbox session to use $" );
+        return result;
+    }
+
     uint n1 = 0, n2 = 0;
     bool done = false;
     while ( ok() && !done ) {
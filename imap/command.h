@@ -26,6 +26,7 @@ public:
                              ImapParser * );
 
     virtual void parse();
+    void runParser();
     virtual void read();
     bool ok() const;
 
@@ -109,6 +110,8 @@ public:
 private:
     class CommandData *d;
 
+    void recordTimes();
+
     friend class CommandTest;
 };
 
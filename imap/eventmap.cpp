@@ -26,6 +26,7 @@ public:
         }
     EventFilterSpec::Type type;
     List<Mailbox> mailboxes;
+    IntegerSet ids;
     Fetch * fetcher;
     bool notify[EventFilterSpec::Subscription + 1];
 };
@@ -79,6 +80,14 @@ void EventFilterSpec::setMailboxes( List<Mailbox> * mailboxes )
 {
     d->mailboxes.clear();
     d->mailboxes.append( mailboxes );
+    d->ids.clear();
+    List<Mailbox>::Iterator i( mailboxes );
+    while ( i ) {
+        Mailbox * m = i;
+        if ( m )
+            d->ids.add( m->id() );
+        ++i;
+    }
 }
 
 
@@ -135,15 +144,16 @@ bool EventFilterSpec::notificationWanted( Event type )
 /*! Returns true if \a mailbox is the list recorded by setMailboxes(),
     or if type() is Subtree and one of its parents is on that
     list. Returns false in all other cases.
+
+    The list is kept as a set of mailbox IDs too, so this costs one
+    lookup per level of \a mailbox's hierarchy, no matter how many
+    mailboxes a Personal or Subscribed spec covers.
 */
 
 bool EventFilterSpec::appliesTo( Mailbox * mailbox )
 {
     while ( mailbox ) {
-        List<Mailbox>::Iterator i( d->mailboxes );
-        while ( i && i != mailbox )
-            ++i;
-        if ( i )
+        if ( d->ids.contains( mailbox->id() ) )
             return true;
         if ( type() == Subtree )
             mailbox = mailbox->parent();
@@ -62,12 +62,15 @@ class AppendData
 {
 public:
     AppendData()
-        : mailbox( 0 ), injector( 0 )
+        : mailbox( 0 ), injector( 0 ), leader( 0 ), alone( false )
     {}
 
     Mailbox * mailbox;
     List<Appendage> messages;
     Injector * injector;
+    Append * leader;
+    List<Append> followers;
+    bool alone;
 };
 
 
@@ -84,6 +87,13 @@ public:
     given by RFC 4466.
 
     We now use the syntax given by RFC 4466.
+
+    APPEND commands are in command group 5, so that the IMAP class
+    may execute several pipelined ones at once. When they are ready,
+    the first injects its messages and those of the following APPEND
+    commands using a single Injector, and thus a single transaction
+    and uidnext update. If that fails, each command tries again on
+    its own.
 */
 
 Append::Append()
@@ -279,6 +289,7 @@ void Append::parse()
 
     requireRight( d->mailbox, Permissions::Insert );
     requireRight( d->mailbox, Permissions::Write );
+    setGroup( 5 );
 }
 
 
@@ -298,42 +309,57 @@ void Append::execute()
     if ( !permitted() || !ok() || state() != Executing )
         return;
 
-    List<Appendage>::Iterator h( d->messages );
-    bool allDone = true;
-    while ( h && ok() ) {
-        if ( !h->message )
-            process( h );
-        if ( !h->message )
-            allDone = false;
-        ++h;
-    }
-
-    if ( !allDone )
+    if ( !prepare() )
         return;
 
     if ( !d->injector ) {
         List<Injectee> * m = new List<Injectee>;
-        h = d->messages.first();
+        List<Appendage>::Iterator h( d->messages );
         while ( h ) {
             m->append( h->message );
             ++h;
         }
+        if ( !d->alone )
+            join( m );
 
         d->injector = new Injector( this );
         d->injector->addInjection( m );
+        List<Append>::Iterator f( d->followers );
+        while ( f ) {
+            f->d->injector = d->injector;
+            ++f;
+        }
         d->injector->execute();
     }
 
     if ( !d->injector->done() )
         return;
 
+    bool batched = d->leader || !d->followers.isEmpty();
+    if ( d->injector->failed() && batched ) {
+        // one command's message may have spoilt it for all; try
+        // again without the others.
+        d->injector = 0;
+        d->leader = 0;
+        d->alone = true;
+    }
+
+    while ( !d->followers.isEmpty() )
+        d->followers.shift()->execute();
+
+    if ( !d->injector ) {
+        log( "Batched append failed; retrying alone" );
+        execute();
+        return;
+    }
+
     if ( d->injector->failed() ) {
         error( No, "Could not append to " + d->mailbox->name().ascii() );
         return;
     }
 
     IntegerSet uids;
-    h = d->messages.first();
+    List<Appendage>::Iterator h( d->messages );
     while ( h ) {
         uids.add( h->message->uid( d->mailbox ) );
         ++h;
@@ -345,6 +371,59 @@ void Append::execute()
 }
 
 
+/*! This private execute() helper processes each message, and returns
+    true if all of them are ready to be injected.
+*/
+
+bool Append::prepare()
+{
+    List<Appendage>::Iterator h( d->messages );
+    bool allDone = true;
+    while ( h && ok() ) {
+        if ( !h->message )
+            process( h );
+        if ( !h->message )
+            allDone = false;
+        ++h;
+    }
+    return allDone && ok();
+}
+
+
+/*! This private execute() helper looks for APPEND commands that
+    follow this one and are ready to be injected, and adds their
+    messages to \a m, so that one Injector can do the work of all.
+    The search stops at the first command that isn't such an APPEND,
+    so that the messages get UIDs in the order the client sent them.
+*/
+
+void Append::join( List<Injectee> * m )
+{
+    List<Command>::Iterator c( imap()->commands() );
+    while ( c && c != this )
+        ++c;
+    if ( c )
+        ++c;
+    while ( c && c->state() == Executing && c->name() == "append" ) {
+        Append * a = (Append *)((Command *)c);
+        if ( a->d->injector || a->d->leader || a->d->alone ||
+             !a->ok() || !a->permitted() || !a->prepare() )
+            return;
+        a->d->leader = this;
+        d->followers.append( a );
+        List<Appendage>::Iterator h( a->d->messages );
+        while ( h ) {
+            m->append( h->message );
+            ++h;
+        }
+        ++c;
+    }
+    if ( !d->followers.isEmpty() )
+        log( "Injecting the messages of " + fn( d->followers.count() ) +
+             " following APPEND commands too" );
+}
+
+
 /*! This private execute() helper processes the single message \a h. It
     can be executed in parallel.
 */
@@ -406,4 +485,10 @@ void Append::process( class Appendage * h )
         error( Bad, h->message->error() );
         return;
     }
+
+    List<Message>::Iterator m( h->urlFetcher->messages() );
+    while ( m ) {
+        h->message->reuseBodyparts( m );
+        ++m;
+    }
 }
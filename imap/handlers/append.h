@@ -18,6 +18,8 @@ public:
 private:
     uint number( uint );
     void process( class Appendage * );
+    bool prepare();
+    void join( List<class Injectee> * );
 
     class AppendData * d;
 };
@@ -39,14 +39,18 @@
     RFC 4959: SASL-IR,
     RFC 4978: COMPRESS=DEFLATE,
     RFC 5032: WITHIN,
+    RFC 5182: SEARCHRES,
     RFC 5255: I18NLEVEL=1,
     RFC 5256: SORT,
     RFC 5257: ANNOTATE-EXPERIMENT-1,
     RFC 5258: LISTEXT,
+    RFC 5267: ESORT,
     RFC 5465: NOTIFY,
     RFC 6154: SPECIAL-USE,
     RFC 6855: UTF=ACCEPT,
-    RFC 7162: QRESYNC.
+    RFC 7377: MULTISEARCH,
+    RFC 7162: QRESYNC,
+    RFC 8438: STATUS=SIZE.
 */
 
 void Capability::execute()
@@ -94,6 +98,7 @@ EString Capability::capabilities( IMAP * i, bool all )
     c.append( "ENABLE" );
     if ( all || login ) {
         c.append( "ESEARCH" );
+        c.append( "ESORT" );
         c.append( "I18NLEVEL=1" );
     }
     c.append( "ID" );
@@ -108,6 +113,7 @@ EString Capability::capabilities( IMAP * i, bool all )
     if ( all || login ) {
         c.append( "MOVE" );
         c.append( "MULTIAPPEND" );
+        c.append( "MULTISEARCH" );
         c.append( "NAMESPACE" );
         //c.append( "NOTIFY" );
     }
@@ -120,12 +126,15 @@ EString Capability::capabilities( IMAP * i, bool all )
     if ( all || !login )
         c.append( "SASL-IR" );
     if ( all || login ) {
+        c.append( "SEARCHRES" );
         c.append( "SORT" );
         c.append( "SORT=DISPLAY" ); // draft-ietf-morg-sortdisplay
         c.append( "SPECIAL-USE" );
     }
     if ( Configuration::toggle( Configuration::UseTls ) && !i->hasTls() )
         c.append( "STARTTLS" );
+    if ( all || login )
+        c.append( "STATUS=SIZE" );
     if ( all || login ) {
         c.append( "THREAD=ORDEREDSUBJECT" );
         c.append( "THREAD=REFS" );
@@ -6,32 +6,104 @@
 #include "transaction.h"
 #include "integerset.h"
 #include "mailbox.h"
+#include "mailboxchange.h"
 #include "query.h"
 #include "user.h"
 
 
+// COPY and MOVE work on at most this many messages per transaction
+static const uint ChunkSize = 8192;
+
+
 class CopyData
     : public Garbage
 {
 public:
     CopyData() :
-        uid( false ), move( false ),
+        uid( false ), move( false ), started( false ),
         mailbox( 0 ),
         findUid( 0 ),
-        report( 0 )
+        report( 0 ), t( 0 ), cleanup( 0 ),
+        toUid( 0 ), toMs( 0 ), fromMs( 0 )
     {}
     bool uid;
     bool move;
+    bool started;
     IntegerSet set;
+    IntegerSet remaining;
+    IntegerSet from;
+    IntegerSet to;
     Mailbox * mailbox;
     Query * findUid;
     Query * report;
+    Transaction * t;
+    Transaction * cleanup;
+    EString failure;
     uint toUid;
     int64 toMs;
     int64 fromMs;
+
+    // the source UIDs in the current chunk
+    IntegerSet chunk;
+
+    void pickChunk();
+    IntegerSet newUids() const;
+    uint oldUid( uint ) const;
 };
 
 
+/*! Picks the next chunk of messages to copy: the first ChunkSize of
+    the remaining ones, however scattered their UIDs are.
+*/
+
+void CopyData::pickChunk()
+{
+    if ( remaining.count() <= ChunkSize ) {
+        chunk = remaining;
+        return;
+    }
+    IntegerSet first;
+    first.add( remaining.smallest(), remaining.value( ChunkSize ) );
+    chunk = remaining.intersection( first );
+}
+
+
+/*! Returns the UIDs the messages in the current chunk get in the
+    target mailbox, numbered consecutively from toUid. The n'th
+    smallest of these belongs to the n'th smallest UID in chunk.
+*/
+
+IntegerSet CopyData::newUids() const
+{
+    IntegerSet r;
+    r.add( toUid, toUid + chunk.count() - 1 );
+    return r;
+}
+
+
+/*! Returns the source uid that was copied to \a nuid in the target
+    mailbox, in the current chunk.
+*/
+
+uint CopyData::oldUid( uint nuid ) const
+{
+    if ( nuid < toUid )
+        return 0;
+    return chunk.value( nuid - toUid + 1 );
+}
+
+
+// Returns a subquery pairing each UID in the chunk, bound as
+// parameter o, with its new UID, bound as n. Both arrays are
+// sorted, so unnest() pairs them up.
+
+static EString pairs( uint o, uint n )
+{
+    return "(select unnest($" + fn( o ) + "::integer[]) as uid, "
+        "unnest($" + fn( n ) + "::integer[]) as nuid) c";
+}
+
+
 /*! \class Copy copy.h
 
     The Copy class implements the IMAP COPY command (RFC 3501 section
@@ -39,6 +111,16 @@ public:
 
     Copy copies all elements of a message, including such things as
     flags.
+
+    Large sets are copied (or moved) in chunks of a few thousand
+    messages, each in its own short transaction, so that neither
+    mailbox is locked for long. Each message's new UID is chosen
+    before the chunk is copied and passed along with the old UIDs as
+    arrays, so no temporary tables are needed and a scattered set
+    costs no more transactions than a contiguous one. If a COPY fails
+    after some chunks have been committed, the messages copied so far
+    are removed again. A MOVE that fails keeps the messages it has
+    moved, so that repeating it finishes the job.
 */
 
 
@@ -101,155 +183,267 @@ void Copy::execute()
     if ( !permitted() )
         return;
 
-    if ( !transaction() ) {
-        setTransaction( new Transaction( this ) );
-
-        d->findUid = new Query( "select id,uidnext,nextmodseq from mailboxes "
-                                "where id=$1 or id=$2 order by id for update",
-                                this );
-        d->findUid->bind( 1, d->mailbox->id() );
-        if ( d->move )
-            d->findUid->bind( 2, session()->mailbox()->id() );
+    if ( d->cleanup ) {
+        if ( !d->cleanup->done() )
+            return;
+        if ( d->cleanup->failed() )
+            error( No, d->failure + " (and could not remove the messages "
+                   "copied so far: " + d->cleanup->error() + ")" );
         else
-            d->findUid->bind( 2, d->mailbox->id() );
-        transaction()->enqueue( d->findUid );
-        transaction()->execute();
+            error( No, d->failure );
+        return;
     }
 
-    while ( d->findUid->hasResults() ) {
-        Row * r = d->findUid->nextRow();
-        if ( (uint)r->getInt( "id" ) == d->mailbox->id() ) {
-            d->toUid = r->getInt( "uidnext" );
-            d->toMs = r->getBigint( "nextmodseq" );
-            if ( session()->mailbox() == d->mailbox )
-                d->fromMs = d->toMs;
+    if ( !d->started ) {
+        d->started = true;
+        d->remaining = d->set;
+    }
+
+    while ( true ) {
+        if ( !d->t ) {
+            if ( d->remaining.isEmpty() )
+                break;
+            d->pickChunk();
+            d->report = 0;
+            d->toMs = 0;
+            d->t = new Transaction( this );
+            d->findUid = new Query( "select id,uidnext,nextmodseq "
+                                    "from mailboxes "
+                                    "where id=$1 or id=$2 "
+                                    "order by id for update", this );
+            d->findUid->bind( 1, d->mailbox->id() );
+            if ( d->move )
+                d->findUid->bind( 2, session()->mailbox()->id() );
+            else
+                d->findUid->bind( 2, d->mailbox->id() );
+            d->t->enqueue( d->findUid );
+            d->t->execute();
         }
-        else {
-            d->fromMs = r->getBigint( "nextmodseq" );
+
+        while ( d->findUid->hasResults() ) {
+            Row * r = d->findUid->nextRow();
+            if ( (uint)r->getInt( "id" ) == d->mailbox->id() ) {
+                d->toUid = r->getInt( "uidnext" );
+                d->toMs = r->getBigint( "nextmodseq" );
+                if ( session()->mailbox() == d->mailbox )
+                    d->fromMs = d->toMs;
+            }
+            else {
+                d->fromMs = r->getBigint( "nextmodseq" );
+            }
         }
-    }
 
-    if ( !d->findUid->done() )
-        return;
+        if ( !d->findUid->done() )
+            return;
+
+        if ( !d->report ) {
+            if ( !d->toMs ) {
+                d->t->rollback();
+                undo( "Could not allocate UID and modseq in "
+                      "target mailbox" );
+                return;
+            }
+            copyChunk();
+        }
 
-    if ( !d->report ) {
-        if ( !d->toMs )
-            error( No, "Could not allocate UID and modseq in target mailbox" );
+        if ( !d->t->done() )
+            return;
 
-        Query * q;
+        if ( d->t->failed() ) {
+            undo( "Database failure: " + d->t->error() );
+            return;
+        }
 
-        q = new Query( "create temporary table t ("
-                       "mailbox integer,"
-                       "uid integer,"
-                       "message integer,"
-                       "nuid integer,"
-                       "seen boolean"
-                       ")", 0 );
-        transaction()->enqueue( q );
+        Row * r;
+        while ( (r=d->report->nextRow()) != 0 ) {
+            uint nuid = r->getInt( "uid" );
+            d->from.add( d->oldUid( nuid ) );
+            d->to.add( nuid );
+        }
+        d->remaining.remove( d->chunk );
+        d->t = 0;
+    }
 
-        q = new Query( "create temporary sequence s start " + fn( d->toUid ),
-                       0 );
-        transaction()->enqueue( q );
+    if ( imap() && imap()->session() &&
+         imap()->session()->mailbox() == d->mailbox &&
+         !imap()->session()->initialised() )
+        return;
 
-        q = new Query( "insert into t "
-                       "(mailbox, uid, message, nuid, seen) "
-                       "select mailbox, uid, message, nextval('s'), seen "
-                       "from mailbox_messages "
-                       "where mailbox=$1 and uid=any($2) order by uid", 0 );
-        q->bind( 1, session()->mailbox()->id() );
-        q->bind( 2, d->set );
-        transaction()->enqueue( q );
+    if ( !d->from.isEmpty() )
+        setRespTextCode( "COPYUID " +
+                         fn( d->mailbox->uidvalidity() ) + " " +
+                         d->from.set() + " " + d->to.set() );
+    finish();
+}
 
-        q = new Query( "update mailboxes "
-                       "set uidnext=nextval('s'), nextmodseq=$1 "
-                       "where id=$2",
-                       this );
-        q->bind( 1, d->toMs+1 );
-        q->bind( 2, d->mailbox->id() );
-        transaction()->enqueue( q );
-
-        transaction()->enqueue( new Query( "drop sequence s", 0 ) );
-
-        q = new Query( "insert into mailbox_messages "
-                       "(mailbox, uid, message, modseq, seen, deleted) "
-                       "select $1, t.nuid, message, $2, t.seen, false "
-                       "from t", 0 );
-        q->bind( 1, d->mailbox->id() );
-        q->bind( 2, d->toMs );
-        transaction()->enqueue( q );
-
-        q = new Query( "insert into flags "
-                       "(mailbox, uid, flag) "
-                       "select $1, t.nuid, f.flag "
-                       "from flags f join t using (mailbox, uid)", 0 );
-        q->bind( 1, d->mailbox->id() );
-        transaction()->enqueue( q );
-
-        q = new Query( "insert into annotations "
-                       "(mailbox, uid, owner, name, value) "
-                       "select $1, t.nuid, a.owner, a.name, a.value "
-                       "from annotations a join t using (mailbox, uid) "
-                       "where a.owner is null or a.owner=$2", 0 );
-        q->bind( 1, d->mailbox->id() );
-        q->bind( 2, imap()->user()->id() );
-        transaction()->enqueue( q );
-
-        d->report = new Query( "select uid, nuid from t", 0 );
-        transaction()->enqueue( d->report );
-
-        if ( d->move ) {
-            q = new Query(
-                "insert into deleted_messages "
-                "(mailbox,uid,message,modseq,deleted_by,reason) "
-                "select $1, t.uid, t.message, $2, $3, "
-                " 'moved to mailbox '||$4||' uid '||t.nuid "
-                "from t", 0 );
-            q->bind( 1, session()->mailbox()->id() );
-            q->bind( 2, d->fromMs );
-            q->bind( 3, imap()->user()->id() );
-            q->bind( 4, d->mailbox->name() );
-            transaction()->enqueue( q );
-            q = new Query( "update mailboxes "
-                           "set nextmodseq=$1 "
-                           "where id=$2",
-                           0 );
-            q->bind( 1, d->fromMs+1 );
-            q->bind( 2, session()->mailbox()->id() );
-            transaction()->enqueue( q );
-        }
 
-        transaction()->enqueue( new Query( "drop table t", 0 ) );
+/*! This private helper enqueues the queries that copy (or move) the
+    current chunk, and commits its transaction.
+*/
 
-        Mailbox::refreshMailboxes( transaction() );
+void Copy::copyChunk()
+{
+    uint source = session()->mailbox()->id();
+    uint target = d->mailbox->id();
+    IntegerSet nuids = d->newUids();
+    uint size = nuids.count();
+
+    Query * q;
+
+    q = new Query( "insert into mailbox_messages "
+                   "(mailbox, uid, message, modseq, seen, deleted) "
+                   "select $1, c.nuid, mm.message, $2, mm.seen, false "
+                   "from mailbox_messages mm join " + pairs( 4, 5 ) + " "
+                   "on (mm.uid=c.uid) "
+                   "where mm.mailbox=$3 and mm.uid=any($4)", 0 );
+    q->bind( 1, target );
+    q->bind( 2, d->toMs );
+    q->bind( 3, source );
+    q->bind( 4, d->chunk );
+    q->bind( 5, nuids );
+    d->t->enqueue( q );
+
+    q = new Query( "insert into flags (mailbox, uid, flag) "
+                   "select $1, c.nuid, f.flag "
+                   "from flags f join " + pairs( 3, 4 ) + " "
+                   "on (f.uid=c.uid) "
+                   "where f.mailbox=$2 and f.uid=any($3)", 0 );
+    q->bind( 1, target );
+    q->bind( 2, source );
+    q->bind( 3, d->chunk );
+    q->bind( 4, nuids );
+    d->t->enqueue( q );
+
+    q = new Query( "insert into annotations "
+                   "(mailbox, uid, owner, name, value) "
+                   "select $1, c.nuid, a.owner, a.name, a.value "
+                   "from annotations a join " + pairs( 4, 5 ) + " "
+                   "on (a.uid=c.uid) "
+                   "where a.mailbox=$2 and a.uid=any($4) "
+                   "and (a.owner is null or a.owner=$3)", 0 );
+    q->bind( 1, target );
+    q->bind( 2, source );
+    q->bind( 3, imap()->user()->id() );
+    q->bind( 4, d->chunk );
+    q->bind( 5, nuids );
+    d->t->enqueue( q );
+
+    q = new Query( "update mailboxes "
+                   "set uidnext=$1, nextmodseq=$2 "
+                   "where id=$3", 0 );
+    q->bind( 1, d->toUid + size );
+    q->bind( 2, d->toMs+1 );
+    q->bind( 3, target );
+    d->t->enqueue( q );
+
+    d->report = new Query( "select uid from mailbox_messages "
+                           "where mailbox=$1 and uid>=$2 and uid<$3 "
+                           "order by uid", 0 );
+    d->report->bind( 1, target );
+    d->report->bind( 2, d->toUid );
+    d->report->bind( 3, d->toUid + size );
+    d->t->enqueue( d->report );
+
+    // tell the other processes which messages arrived, as long as the
+    // list fits in a notification
+    q = new Query( "select pg_notify('mailbox_change', $1||"
+                   "string_agg(uid::text, ',' order by uid)) "
+                   "from mailbox_messages "
+                   "where mailbox=$2 and uid>=$3 and uid<$4 "
+                   "having count(*) between 1 and 500", 0 );
+    q->bind( 1, MailboxChange::header( d->mailbox, MailboxChange::New,
+                                       d->toMs, d->toUid + size ) );
+    q->bind( 2, target );
+    q->bind( 3, d->toUid );
+    q->bind( 4, d->toUid + size );
+    d->t->enqueue( q );
 
-        transaction()->commit();
+    if ( d->move ) {
+        q = new Query(
+            "insert into deleted_messages "
+            "(mailbox,uid,message,modseq,deleted_by,reason) "
+            "select $1, mm.uid, mm.message, $2, $3, "
+            " 'moved to mailbox '||$4||' uid '||c.nuid "
+            "from mailbox_messages mm join " + pairs( 5, 6 ) + " "
+            "on (mm.uid=c.uid) "
+            "where mm.mailbox=$1 and mm.uid=any($5)", 0 );
+        q->bind( 1, source );
+        q->bind( 2, d->fromMs );
+        q->bind( 3, imap()->user()->id() );
+        q->bind( 4, d->mailbox->name() );
+        q->bind( 5, d->chunk );
+        q->bind( 6, nuids );
+        d->t->enqueue( q );
+        q = new Query( "update mailboxes "
+                       "set nextmodseq=$1 "
+                       "where id=$2",
+                       0 );
+        q->bind( 1, d->fromMs+1 );
+        q->bind( 2, source );
+        d->t->enqueue( q );
+        q = new Query( "select pg_notify('mailbox_change', $1||"
+                       "string_agg(uid::text, ',' order by uid)) "
+                       "from deleted_messages "
+                       "where mailbox=$2 and modseq=$3 "
+                       "having count(*) between 1 and 500", 0 );
+        q->bind( 1, MailboxChange::header( session()->mailbox(),
+                                           MailboxChange::Expunged,
+                                           d->fromMs, 0 ) );
+        q->bind( 2, source );
+        q->bind( 3, d->fromMs );
+        d->t->enqueue( q );
     }
 
-    if ( !transaction()->done() )
-        return;
+    Mailbox::refreshMailboxes( d->t );
 
-    if ( transaction()->failed() ) {
-        error( No, "Database failure: " + transaction()->error() );
-        return;
-    }
+    d->t->commit();
+}
 
-    if ( imap() && imap()->session() &&
-         imap()->session()->mailbox() == d->mailbox &&
-         !imap()->session()->initialised() )
-        return;
 
-    IntegerSet from;
-    IntegerSet to;
+/*! This private helper reports \a message as an error. If a COPY has
+    already committed some chunks, their messages are removed from
+    the target mailbox first, since RFC 3501 says a failed COPY must
+    leave the target mailbox as it was, and execute() reports the
+    error once that's done.
+*/
 
-    while ( d->report->hasResults() ) {
-        Row * r = d->report->nextRow();
-        from.add( r->getInt( "uid" ) );
-        to.add( r->getInt( "nuid" ) );
+void Copy::undo( const EString & message )
+{
+    if ( d->move || d->to.isEmpty() ) {
+        if ( d->move && !d->from.isEmpty() )
+            setRespTextCode( "COPYUID " +
+                             fn( d->mailbox->uidvalidity() ) + " " +
+                             d->from.set() + " " + d->to.set() );
+        error( No, message );
+        return;
     }
 
-    if ( !from.isEmpty() )
-        setRespTextCode( "COPYUID " +
-                         fn( d->mailbox->uidvalidity() ) + " " +
-                         from.set() + " " + to.set() );
-    finish();
+    Transaction * t = new Transaction( this );
+    Query * q;
+    q = new Query( "select nextmodseq from mailboxes "
+                   "where id=$1 for update", 0 );
+    q->bind( 1, d->mailbox->id() );
+    t->enqueue( q );
+    q = new Query( "insert into deleted_messages "
+                   "(mailbox,uid,message,modseq,deleted_by,reason) "
+                   "select mailbox, uid, message, "
+                   "(select nextmodseq from mailboxes where id=$1), "
+                   "$2, 'incomplete copy' "
+                   "from mailbox_messages "
+                   "where mailbox=$1 and uid=any($3)", 0 );
+    q->bind( 1, d->mailbox->id() );
+    q->bind( 2, imap()->user()->id() );
+    q->bind( 3, d->to );
+    t->enqueue( q );
+    q = new Query( "update mailboxes set nextmodseq=nextmodseq+1 "
+                   "where id=$1", 0 );
+    q->bind( 1, d->mailbox->id() );
+    t->enqueue( q );
+    Mailbox::refreshMailboxes( t );
+    t->commit();
+
+    log( "Removing " + fn( d->to.count() ) + " messages copied to " +
+         d->mailbox->name().ascii() + " before the error" );
+    d->cleanup = t;
+    d->failure = message;
 }
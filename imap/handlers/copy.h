@@ -20,6 +20,9 @@ protected:
 
 private:
     class CopyData * d;
+
+    void copyChunk();
+    void undo( const EString & );
 };
 
 
@@ -6,8 +6,11 @@
 #include "imap.h"
 #include "user.h"
 #include "query.h"
+#include "scope.h"
 #include "mailbox.h"
 #include "session.h"
+#include "expunger.h"
+#include "integerset.h"
 #include "transaction.h"
 
 
@@ -15,10 +18,14 @@ class DeleteData
     : public Garbage
 {
 public:
-    DeleteData(): m( 0 ), messages( 0 ), first( true ) {}
+    DeleteData()
+        : m( 0 ), messages( 0 ), uids( 0 ), expunger( 0 ), first( true )
+    {}
 
     Mailbox * m;
     Query * messages;
+    Query * uids;
+    Expunger * expunger;
     bool first;
 };
 
@@ -26,9 +33,18 @@ public:
 /*! \class Delete delete.h
     Deletes an existing mailbox (RFC 3501 section 6.3.4)
 
-    Mailboxes cannot be deleted until they're empty of messages and
+    Mailboxes cannot be deleted while they contain recent, unseen
+    messages, since someone is probably about to read those. Any other
+    messages are first moved to deleted_messages by an Expunger, in
+    chunks of their own transactions, so deleting a very large mailbox
+    doesn't produce one enormous transaction or lock the mailbox for
+    long. The mailbox itself is marked deleted afterwards, in a small
+    transaction. While the messages are being removed, the mailbox's
+    shrinking message count is visible to other clients and to aox
+    show counts -u.
 
-    (Really deletes? What happens to the mail there?)
+    If the retention policy keeps some of the messages, the mailbox
+    is not deleted.
 
     RFC 2180 section 3 is tricky. For the moment we disallow DELETE of
     an active mailbox. That's not practical to do on a cluster, so
@@ -73,13 +89,7 @@ void Delete::execute()
     if ( !permitted() )
         return;
 
-    if ( !transaction() ) {
-        setTransaction( new Transaction( this ) );
-        Query * lock = new Query( "select * from mailboxes "
-                                  "where id=$1 for update", 0 );
-        lock->bind( 1, d->m->id() );
-        transaction()->enqueue( lock );
-
+    if ( !d->messages && !d->expunger && !transaction() ) {
         d->messages = new Query( "select count(mm.uid)::bigint as messages "
                                  "from mailbox_messages mm "
                                  "join messages m on (mm.message=m.id) "
@@ -91,28 +101,74 @@ void Delete::execute()
         Date now;
         now.setCurrentTime();
         d->messages->bind( 2, now.unixTime() - 20 );
-        transaction()->enqueue( d->messages );
-        transaction()->execute();
+        d->messages->execute();
+
+        d->uids = new Query( "select uid from mailbox_messages "
+                             "where mailbox=$1", this );
+        d->uids->bind( 1, d->m->id() );
+        d->uids->execute();
     }
 
     if ( d->messages ) {
-        if ( !d->messages->done() )
+        if ( !d->messages->done() || !d->uids->done() )
             return;
 
         int64 messages = 0;
 
         Row * r = d->messages->nextRow();
-        if ( d->messages->failed() || !r )
+        if ( d->messages->failed() || !r || d->uids->failed() )
             error( No, "Could not determine if any messages exist" );
         else
             messages = r->getBigint( "messages" );
 
         if ( messages )
             error( No, "Cannot delete mailbox: " + fn( messages ) +
-                   " messages exist" );
+                   " recent messages exist" );
+
+        IntegerSet uids;
+        while ( d->uids->hasResults() )
+            uids.add( d->uids->nextRow()->getInt( "uid" ) );
         d->messages = 0;
+        d->uids = 0;
+
+        if ( !ok() )
+            return;
+
+        if ( !uids.isEmpty() ) {
+            log( "Removing " + fn( uids.count() ) + " messages from " +
+                 d->m->name().ascii() );
+            d->expunger = new Expunger( d->m, uids, imap()->user(),
+                                        "IMAP delete " +
+                                        Scope::current()->log()->id(),
+                                        this );
+            d->expunger->execute();
+        }
+    }
+
+    if ( d->expunger ) {
+        if ( !d->expunger->done() )
+            return;
+
+        if ( d->expunger->failed() )
+            error( No, "Database error. Mailbox not deleted: " +
+                   d->expunger->error() );
+        else if ( d->expunger->retained() )
+            error( No, "Cannot delete mailbox: " +
+                   fn( d->expunger->retained() ) +
+                   " messages must be retained" );
+        d->expunger = 0;
+        if ( !ok() )
+            return;
+    }
+
+    if ( !transaction() ) {
+        setTransaction( new Transaction( this ) );
+        Query * lock = new Query( "select * from mailboxes "
+                                  "where id=$1 for update", 0 );
+        lock->bind( 1, d->m->id() );
+        transaction()->enqueue( lock );
 
-        if ( ok() && d->m->remove( transaction() ) == 0 )
+        if ( d->m->remove( transaction() ) == 0 )
             error( No, "Cannot delete mailbox " + d->m->name().ascii() );
 
         Mailbox::refreshMailboxes( transaction() );
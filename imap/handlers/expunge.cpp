@@ -10,9 +10,9 @@
 #include "mailbox.h"
 #include "selector.h"
 #include "integerset.h"
+#include "expunger.h"
 #include "imapsession.h"
 #include "permissions.h"
-#include "transaction.h"
 
 
 class ExpungeData
@@ -20,20 +20,15 @@ class ExpungeData
 {
 public:
     ExpungeData()
-        : uid( false ), commit( false ), modseq( 0 ), s( 0 ),
-          findUids( 0 ), findModseq( 0 ), expunge( 0 ), r( 0 )
+        : uid( false ), s( 0 ), findUids( 0 ), expunger( 0 )
     {}
 
     bool uid;
-    bool commit;
-    int64 modseq;
     Session * s;
     Query * findUids;
-    Query * findModseq;
-    Query * expunge;
+    Expunger * expunger;
     IntegerSet requested;
     IntegerSet marked;
-    RetentionSelector * r;
 };
 
 
@@ -52,6 +47,10 @@ public:
 
     The UID of an expunged message may still exist in different
     sessions, although the message itself is no longer accessible.
+
+    The work is done by an Expunger, which POP shares. It removes
+    large sets of messages in several transactions, so an EXPUNGE
+    that fails part-way may have removed some of the messages.
 */
 
 /*! Creates a new EXPUNGE handler if \a u is false, or a UID EXPUNGE
@@ -104,19 +103,7 @@ void Expunge::execute()
         return;
     }
 
-    if ( !d->r ) {
-        d->r = new RetentionSelector( d->s->mailbox(), this );
-        d->r->execute();
-    }
-
-    if ( !transaction() ) {
-        setTransaction( new Transaction( this ) );
-
-        d->findModseq = new Query( "select nextmodseq from mailboxes "
-                                   "where id=$1 for update", this );
-        d->findModseq->bind( 1, d->s->mailbox()->id() );
-        transaction()->enqueue( d->findModseq );
-
+    if ( !d->findUids ) {
         d->findUids = new Query( "", this );
         d->findUids->bind( 1, d->s->mailbox()->id() );
         EString query( "select uid from mailbox_messages "
@@ -125,11 +112,8 @@ void Expunge::execute()
             query.append( " and uid=any($2)" );
             d->findUids->bind( 2, d->requested );
         }
-        query.append( " order by uid for update" );
         d->findUids->setString( query );
-        transaction()->enqueue( d->findUids );
-
-        transaction()->execute();
+        d->findUids->execute();
     }
 
     while ( d->findUids->hasResults() ) {
@@ -137,100 +121,35 @@ void Expunge::execute()
         d->marked.add( r->getInt( "uid" ) );
     }
 
-    if ( d->findModseq->hasResults() ) {
-        Row * r = d->findModseq->nextRow();
-        d->modseq = r->getBigint( "nextmodseq" );
-    }
-
     if ( !d->findUids->done() )
         return;
 
-    if ( !d->r->done() )
-        return;
-
     if ( d->marked.isEmpty() ) {
-        transaction()->commit();
         finish();
         return;
     }
 
-    if ( !d->expunge ) {
+    if ( !d->expunger ) {
         log( "Expunge " + fn( d->marked.count() ) + " messages: " +
              d->marked.set() );
-
-        Selector * s = new Selector;
-        s->add( new Selector( d->marked ) );
-        if ( d->r->retains() ) {
-            Selector * n = new Selector( Selector::Not );
-            s->add( n );
-            n->add( d->r->retains() );
-        }
-        s->simplify();
-
-        EStringList wanted;
-        wanted.append( "mailbox" );
-        wanted.append( "uid" );
-        wanted.append( "message" );
-
-        d->expunge = s->query( imap()->user(), d->s->mailbox(),
-                               d->s, this, false, &wanted,
-                               false );
-
-        int i = d->expunge->string().find( " from " );
-        uint msb = s->placeHolder();
-        uint ub = s->placeHolder();
-        uint rb = s->placeHolder();
-        d->expunge->setString(
-            "insert into deleted_messages "
-            "(mailbox,uid,message,modseq,deleted_by,reason) " +
-            d->expunge->string().mid( 0, i ) + ", $" + fn( msb ) +", $" +
-            fn( ub ) + ", $" + fn( rb ) + d->expunge->string().mid( i ) );
-        d->expunge->bind( msb, d->modseq );
-        d->expunge->bind( ub, imap()->user()->id() );
-        d->expunge->bind( rb,
-                          "IMAP expunge " + Scope::current()->log()->id() );
-        transaction()->enqueue( d->expunge );
-        transaction()->execute();
+        d->expunger = new Expunger( d->s->mailbox(), d->marked,
+                                    imap()->user(),
+                                    "IMAP expunge " +
+                                    Scope::current()->log()->id(),
+                                    this );
+        d->expunger->setDeletedOnly( true );
+        d->expunger->execute();
     }
 
-    if ( !d->expunge->done() )
+    if ( !d->expunger->done() )
         return;
 
-    if ( !d->commit ) {
-        d->commit = true;
-        if ( d->expunge->rows() < d->marked.count() ) {
-            log( "User requested expunging " + fn( d->marked.count() ) +
-                 " messages, of which " +
-                 fn ( d->marked.count() - d->expunge->rows() ) +
-                 " must be retained" );
-            // there was something we were asked to expunge, but which
-            // must be retained due to a configured policy. clear the
-            // deleted flag on those messages, so the retention policy
-            // is clearly visible.
-            Query * q = new Query( "update mailbox_messages "
-                                   "set modseq=$1, deleted=false "
-                                   "where mailbox=$2 and uid=any($3)",
-                                   0 );
-            q->bind( 1, d->modseq );
-            q->bind( 2, d->s->mailbox()->id() );
-            q->bind( 3, d->marked );
-            transaction()->enqueue( q );
-        }
-
-        Query * q = new Query( "update mailboxes set nextmodseq=$1 "
-                               "where id=$2", 0 );
-        q->bind( 1, d->modseq + 1 );
-        q->bind( 2, d->s->mailbox()->id() );
-        transaction()->enqueue( q );
-        Mailbox::refreshMailboxes( transaction() );
-        transaction()->commit();
-    }
-
-    if ( !transaction()->done() )
-        return;
+    if ( d->expunger->retained() )
+        log( "User requested expunging " + fn( d->marked.count() ) +
+             " messages, of which " + fn( d->expunger->retained() ) +
+             " must be retained" );
 
-    if ( transaction()->failed() ||
-         transaction()->state() == Transaction::RolledBack )
+    if ( d->expunger->failed() )
         error( No, "Database error. Messages not expunged." );
     finish();
 }
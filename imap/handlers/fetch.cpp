@@ -3,8 +3,10 @@
 #include "fetch.h"
 
 #include "messagecache.h"
+#include "configuration.h"
 #include "imapsession.h"
 #include "transaction.h"
+#include "allocator.h"
 #include "annotation.h"
 #include "integerset.h"
 #include "estringlist.h"
@@ -17,8 +19,14 @@
 #include "ustring.h"
 #include "section.h"
 #include "listext.h"
+#include "server.h"
+#include "sharedcache.h"
+#include "buffer.h"
+#include "cache.h"
 #include "fetcher.h"
+#include "postgres.h"
 #include "iso8859.h"
+#include "flag.h"
 #include "codec.h"
 #include "query.h"
 #include "scope.h"
@@ -60,8 +68,12 @@ public:
           databaseId( false ), threadId( false ), vanished( false ),
           needsHeader( false ), needsAddresses( false ),
           needsBody( false ), needsPartNumbers( false ),
+          summaries( false ), summaryFetcher( 0 ), headerFields( 0 ),
           seenDeletedFetcher( 0 ), flagFetcher( 0 ),
-          annotationFetcher( 0 ), modseqFetcher( 0 )
+          annotationFetcher( 0 ), modseqFetcher( 0 ),
+          annotationModSeq( 0 ), annotationsCached( 0 ),
+          flagNameFetcher( 0 ),
+          unsolicited( false ), snapshot( 0 )
     {}
 
     int state;
@@ -98,6 +110,24 @@ public:
     bool needsBody;
     bool needsPartNumbers;
 
+    // ENVELOPE and BODYSTRUCTURE may come from message_summaries
+    struct Summary
+        : public Garbage
+    {
+    public:
+        EString envelope;
+        EString bodystructure;
+    };
+    bool summaries;
+    Query * summaryFetcher;
+    Map<Summary> summaryCache;
+    EStringList newSummaryIds;
+    EStringList newEnvelopes;
+    EStringList newBodystructures;
+
+    // if all we need are a few top-level fields, these are they
+    EStringList * headerFields;
+
     EStringList entries;
     EStringList attribs;
 
@@ -105,9 +135,11 @@ public:
         : public Garbage
     {
     public:
-        DynamicData(): modseq( 0 ) {}
+        DynamicData(): modseq( 0 ), seen( false ), deleted( false ) {}
         int64 modseq;
-        Dict<EString> flags;
+        bool seen;
+        bool deleted;
+        IntegerSet flags;
         List<Annotation> annotations;
     };
     Map<DynamicData> dynamics;
@@ -115,9 +147,311 @@ public:
     Query * flagFetcher;
     Query * annotationFetcher;
     Query * modseqFetcher;
+
+    // the annotations of each mailbox's messages, as of a modseq
+    class AnnotationCache
+        : public Cache
+    {
+    public:
+        AnnotationCache(): Cache( 10 ) {}
+
+        struct MailboxInfo
+            : public Garbage
+        {
+        public:
+            MailboxInfo(): Garbage(), ms( 0 ) {}
+            int64 ms;
+            IntegerSet known;
+            Map< List<Annotation> > annotations;
+        };
+
+        Map<MailboxInfo> c;
+
+        MailboxInfo * provide( Mailbox * m ) {
+            MailboxInfo * mi = c.find( m->id() );
+            if ( !mi ) {
+                mi = new MailboxInfo;
+                mi->ms = m->nextModSeq();
+                c.insert( m->id(), mi );
+            }
+            return mi;
+        }
+
+        void clear() {
+            c.clear();
+        }
+    };
+
+    int64 annotationModSeq;
+    AnnotationCache::MailboxInfo * annotationsCached;
+    IntegerSet annotated;
+
+    // the FLAGS text for each combination of flags seen recently
+    class FlagListCache
+        : public Cache
+    {
+    public:
+        FlagListCache(): Cache( 10 ) {}
+
+        Dict<EString> c;
+
+        void clear() {
+            c.clear();
+        }
+    };
+
+    // names of flags that Flag didn't know yet
+    Query * flagNameFetcher;
+    IntegerSet unknownFlags;
+    Map<EString> flagNames;
+
+    // unsolicited flag updates may share one FlagSnapshot
+    bool unsolicited;
+    class FlagSnapshot * snapshot;
+
+    // the session's streamed section, if streamed() relied on it
+    EString streamedKey;
+    EString streamedItem;
+    EString streamedData;
+};
+
+
+static FetchData::AnnotationCache * annotationCache = 0;
+static FetchData::FlagListCache * flagListCache = 0;
+
+
+// When a client changes the flags of many messages, every session on
+// the mailbox needs the new flags. The first of those sessions' flag
+// updates loads the flags, modseqs etc. of the messages all the
+// sessions need, using a single query, and the others use the
+// result. A snapshot is valid until the mailbox's nextModSeq changes.
+
+class FlagSnapshot
+    : public EventHandler
+{
+public:
+    FlagSnapshot( Mailbox * m, const IntegerSet & s, int64 l )
+        : mailbox( m ), uids( s ), since( l ), ms( m->nextModSeq() ),
+          q( 0 ), names( 0 ), done( false ), failed( false ) {
+        q = new Query( "select mm.uid, mm.message, mm.modseq, "
+                       "mm.seen, mm.deleted, f.flag "
+                       "from mailbox_messages mm "
+                       "left join flags f on "
+                       "(mm.mailbox=f.mailbox and mm.uid=f.uid) "
+                       "where mm.mailbox=$1 and mm.uid=any($2) "
+                       "and mm.modseq>$3", this );
+        q->bind( 1, m->id() );
+        q->bind( 2, s );
+        q->bind( 3, l );
+        q->execute();
+    }
+
+    void execute() {
+        if ( q ) {
+            while ( q->hasResults() ) {
+                Row * r = q->nextRow();
+                uint uid = r->getInt( "uid" );
+                Item * i = items.find( uid );
+                if ( !i ) {
+                    i = new Item;
+                    i->message = r->getInt( "message" );
+                    i->modseq = r->getBigint( "modseq" );
+                    i->seen = r->getBoolean( "seen" );
+                    i->deleted = r->getBoolean( "deleted" );
+                    items.insert( uid, i );
+                }
+                if ( r->isNull( "flag" ) )
+                    continue;
+                uint f = r->getInt( "flag" );
+                i->flags.add( f );
+                if ( Flag::name( f ).isEmpty() )
+                    unknown.add( f );
+            }
+            if ( !q->done() )
+                return;
+            failed = q->failed();
+            q = 0;
+            if ( !failed && !unknown.isEmpty() ) {
+                names = new Query( "select id, name from flag_names "
+                                   "where id=any($1)", this );
+                names->bind( 1, unknown );
+                names->execute();
+            }
+        }
+        if ( names ) {
+            while ( names->hasResults() ) {
+                Row * r = names->nextRow();
+                flagNames.insert( r->getInt( "id" ),
+                                  new EString( r->getEString( "name" ) ) );
+            }
+            if ( !names->done() )
+                return;
+            names = 0;
+        }
+        done = true;
+        List<EventHandler>::Iterator i( waiting );
+        while ( i ) {
+            i->notify();
+            ++i;
+        }
+        waiting.clear();
+    }
+
+    bool covers( Mailbox * m, const IntegerSet & s, int64 l ) {
+        return !failed && mailbox == m && ms == m->nextModSeq() &&
+            since <= l &&
+            uids.intersection( s ).count() == s.count();
+    }
+
+    class Item
+        : public Garbage
+    {
+    public:
+        Item(): message( 0 ), modseq( 0 ), seen( false ), deleted( false ) {}
+        uint message;
+        int64 modseq;
+        bool seen;
+        bool deleted;
+        IntegerSet flags;
+    };
+
+    Mailbox * mailbox;
+    IntegerSet uids;
+    int64 since;
+    int64 ms;
+    Query * q;
+    Query * names;
+    Map<Item> items;
+    IntegerSet unknown;
+    Map<EString> flagNames;
+    List<EventHandler> waiting;
+    bool done;
+    bool failed;
+};
+
+
+class FlagSnapshotCache
+    : public Cache
+{
+public:
+    FlagSnapshotCache(): Cache( 10 ) {}
+
+    Map<FlagSnapshot> c;
+
+    void clear() {
+        c.clear();
+    }
+};
+
+
+static FlagSnapshotCache * flagSnapshots = 0;
+
+
+// Returns a FlagSnapshot of the messages in \a uids in \a m that have
+// changed since \a since, creating one if necessary. A new snapshot
+// also includes whatever the other sessions on \a m need to announce.
+
+static FlagSnapshot * flagSnapshot( Mailbox * m, const IntegerSet & uids,
+                                    int64 since )
+{
+    if ( !::flagSnapshots )
+        ::flagSnapshots = new FlagSnapshotCache;
+    FlagSnapshot * fs = ::flagSnapshots->c.find( m->id() );
+    if ( fs && fs->covers( m, uids, since ) )
+        return fs;
+
+    IntegerSet all( uids );
+    List<Session>::Iterator i( m->sessions() );
+    while ( i ) {
+        all.add( i->unannounced().intersection( i->messages() ) );
+        ++i;
+    }
+    fs = new FlagSnapshot( m, all, since );
+    ::flagSnapshots->c.remove( m->id() );
+    ::flagSnapshots->c.insert( m->id(), fs );
+    return fs;
+}
+
+
+// Loads the messages following those a sequential FETCH sent into
+// the MessageCache, so they're ready when the client asks for them.
+
+class ReadAhead
+    : public EventHandler
+{
+public:
+    ReadAhead( ImapSession * session, const IntegerSet & uids,
+               FetchData * fd )
+        : EventHandler(), s( session ), q( 0 ), f( 0 ),
+          addresses( fd->needsAddresses ), header( fd->needsHeader ),
+          partNumbers( fd->needsPartNumbers ),
+          trivia( fd->rfc822size || fd->internaldate ||
+                  fd->databaseId || fd->threadId ),
+          fields( fd->headerFields )
+    {
+        setLog( new Log );
+        Mailbox * mb = s->mailbox();
+        q = new Query( "select uid, message from mailbox_messages "
+                       "where mailbox=$1 and uid=any($2)", this );
+        q->bind( 1, mb->id() );
+        q->bind( 2, uids );
+        q->allowReplica( mb->id(), s->nextModSeq() );
+        q->execute();
+    }
+
+    void execute();
+
+    ImapSession * s;
+    Query * q;
+    Fetcher * f;
+    bool addresses;
+    bool header;
+    bool partNumbers;
+    bool trivia;
+    EStringList * fields;
 };
 
 
+void ReadAhead::execute()
+{
+    if ( f || !q->done() )
+        return;
+
+    // if the client has selected another mailbox meanwhile, it won't
+    // want these.
+    if ( s->imap()->session() != s )
+        return;
+
+    Mailbox * mb = s->mailbox();
+    List<Message> * l = new List<Message>;
+    while ( q->hasResults() ) {
+        Row * r = q->nextRow();
+        Message * m = MessageCache::provide( mb, r->getInt( "uid" ) );
+        m->setDatabaseId( r->getInt( "message" ) );
+        l->append( m );
+    }
+    if ( l->isEmpty() )
+        return;
+
+    f = new Fetcher( l, 0, s->imap() );
+    f->allowReplica( mb->id(), s->nextModSeq() );
+    if ( fields ) {
+        f->fetchHeaderFields( *fields );
+    }
+    else {
+        if ( addresses )
+            f->fetch( Fetcher::Addresses );
+        if ( header )
+            f->fetch( Fetcher::OtherHeader );
+    }
+    if ( partNumbers )
+        f->fetch( Fetcher::PartNumbers );
+    if ( trivia )
+        f->fetch( Fetcher::Trivia );
+    f->execute();
+}
+
+
 /*! \class Fetch fetch.h
 
     Returns message data (RFC 3501, section 6.4.5, extended by RFC
@@ -167,6 +501,7 @@ Fetch::Fetch( bool f, bool a, bool v, const IntegerSet & set,
     d->changedSince = limit;
     d->modseq = i->clientSupports( IMAP::Condstore );
     d->vanished = v;
+    d->unsolicited = true;
     if ( t )
         setTransaction( t->subTransaction( this ) );
 
@@ -247,11 +582,17 @@ void Fetch::parse()
         require( ")" );
     }
     end();
-    if ( d->envelope ) {
+    // ENVELOPE and BODYSTRUCTURE alone can usually be answered from
+    // message_summaries, without fetching what they're made of.
+    if ( ( d->envelope || d->bodystructure ) && !d->body &&
+         d->sections.isEmpty() &&
+         !imap()->clientSupports( IMAP::Unicode ) )
+        d->summaries = true;
+    if ( d->envelope && !d->summaries ) {
         d->needsHeader = true;
         d->needsAddresses = true;
     }
-    if ( d->body || d->bodystructure ) {
+    if ( d->body || ( d->bodystructure && !d->summaries ) ) {
         // message/rfc822 body[structure] includes envelope in some
         // cases, so we need both here too.
         d->needsHeader = true;
@@ -263,6 +604,20 @@ void Fetch::parse()
         d->needsHeader = true; // Bodypart::asText() needs mime type etc
     if ( !ok() )
         return;
+    // mobile clients often want just a few fields of many messages,
+    // and there's no need to fetch the entire header for that.
+    if ( !d->sections.isEmpty() && !d->needsBody && !d->needsPartNumbers &&
+         !d->envelope && !d->body && !d->bodystructure ) {
+        d->headerFields = new EStringList;
+        List<Section>::Iterator i( d->sections );
+        while ( i && d->headerFields ) {
+            if ( i->id == "header.fields" && i->part.isEmpty() )
+                d->headerFields->append( i->fields );
+            else
+                d->headerFields = 0;
+            ++i;
+        }
+    }
     EStringList l;
     l.append( new EString( "Fetch <=" + fn( d->set.count() ) + " messages: " ) );
     if ( d->needsAddresses )
@@ -277,6 +632,10 @@ void Fetch::parse()
         l.append( "trivia" );
     if ( d->needsPartNumbers )
         l.append( "bytes/lines" );
+    if ( d->headerFields )
+        l.append( "fields " + d->headerFields->join( "," ) );
+    if ( d->summaries )
+        l.append( "summaries" );
     if ( d->annotation )
         l.append( "annotations" );
     log( l.join( " " ) );
@@ -393,6 +752,17 @@ void Fetch::parseAttribute( bool alsoMacro )
             error( Bad, "Fetching partial BINARY.SIZE is not meaningful" );
         if ( s->part.isEmpty() )
             d->rfc822size = true;
+        else
+            d->needsPartNumbers = true;
+        // the sizes are stored, so the bodies needn't be loaded
+        s->needsBody = false;
+        d->needsBody = false;
+        List<Section>::Iterator i( d->sections );
+        while ( i ) {
+            if ( i->needsBody )
+                d->needsBody = true;
+            ++i;
+        }
     }
     else if ( keyword == "modseq" ) {
         d->modseq = true;
@@ -675,11 +1045,32 @@ void Fetch::execute()
     if ( !d->peek && s->readOnly() )
         d->peek = true;
 
+    if ( d->state == 0 && d->unsolicited && !transaction() &&
+         !d->vanished && d->flags ) {
+        if ( !d->snapshot ) {
+            d->snapshot = flagSnapshot( s->mailbox(), d->set,
+                                        d->changedSince );
+            if ( !d->snapshot->done )
+                d->snapshot->waiting.append( this );
+        }
+        if ( !d->snapshot->done )
+            return;
+        if ( d->snapshot->failed )
+            d->snapshot = 0;
+        else
+            useSnapshot();
+    }
+
     if ( d->state == 0 ) {
         if ( !transaction() &&
              ( !d->peek ||
-               ( d->modseq && ( d->flags || d->annotation || d->vanished ) ) ) )
+               ( d->modseq && ( d->flags || d->annotation || d->vanished ) ) ) ) {
             setTransaction( new Transaction( this ) );
+            // setting \seen is a small write that other sessions may
+            // share a commit with.
+            if ( !d->peek )
+                transaction()->allowGroupCommit();
+        }
 
         if ( d->vanished && d->changedSince > 0 && !d->deleted ) {
             d->deleted = new Query( "select uid from deleted_messages "
@@ -706,7 +1097,7 @@ void Fetch::execute()
                 d->those->bind( 1, s->mailbox()->id() );
                 d->those->bind( 2, d->set );
             }
-            else if ( d->modseq ||
+            else if ( d->modseq || d->summaries ||
                       d->needsAddresses || d->needsHeader ||
                       d->needsBody || d->needsPartNumbers ||
                       d->rfc822size || d->internaldate ||
@@ -837,12 +1228,15 @@ void Fetch::execute()
 
     if ( d->state == 3 ) {
         d->state = 4;
-        sendFetchQueries();
-        if ( d->flags )
+        if ( d->summaries )
+            sendSummaryQuery();
+        else
+            sendFetchQueries();
+        if ( d->flags && !d->snapshot )
             sendFlagQuery();
         if ( d->annotation )
             sendAnnotationsQuery();
-        if ( d->modseq )
+        if ( d->modseq && !d->snapshot )
             sendModSeqQuery();
         if ( transaction() )
             transaction()->commit();
@@ -860,10 +1254,79 @@ void Fetch::execute()
         s->recordExpungedFetch( d->expunged );
         error( No, "UID(s) " + d->expunged.set() + " has/have been expunged" );
     }
+    startReadAhead();
     finish();
 }
 
 
+/*! Starts loading the messages after those this command fetched, if
+    the client seems to be paging through the mailbox and memory
+    permits. Bodies aren't read ahead, only what this command needed
+    apart from them.
+*/
+
+void Fetch::startReadAhead()
+{
+    if ( d->summaries || d->needsBody || d->set.isEmpty() ||
+         !Server::useCache() )
+        return;
+    bool trivia = d->rfc822size || d->internaldate ||
+                  d->databaseId || d->threadId;
+    if ( !d->needsAddresses && !d->needsHeader && !d->needsPartNumbers &&
+         !trivia )
+        return;
+
+    ImapSession * s = session();
+    uint first = s->msn( d->set.smallest() );
+    uint last = s->msn( d->set.largest() );
+    if ( !first || last - first + 1 != d->set.count() ) {
+        s->recordFetchedRange( 0, 0 );
+        return;
+    }
+    if ( !s->recordFetchedRange( first, last ) )
+        return;
+
+    uint limit = 1024 * 1024 *
+                 Configuration::scalar( Configuration::MemoryLimit );
+    if ( Allocator::inUse() + Allocator::allocated() > limit / 2 )
+        return;
+
+    uint n = last - first + 1;
+    if ( n > 256 )
+        n = 256;
+    IntegerSet next;
+    uint msn = last + 1;
+    while ( msn <= last + n && msn <= s->count() ) {
+        uint uid = s->uid( msn );
+        Message * m = MessageCache::find( s->mailbox(), uid );
+        if ( !m || !m->hasTrivia() || !m->hasHeaders() )
+            next.add( uid );
+        msn++;
+    }
+    if ( next.isEmpty() )
+        return;
+
+    if ( Log::enabled( Log::Debug ) )
+        log( "Reading ahead " + fn( next.count() ) + " messages", Log::Debug );
+    (void)new ReadAhead( s, next, d );
+}
+
+
+/* Returns the key under which ImapSession keeps the whole of the
+   body section \a s of \a m while a client fetches it in pieces.
+*/
+
+static EString streamingKey( Section * s, Message * m, bool unicode )
+{
+    EString k = fn( m->databaseId() ) + " " + s->id + " " + s->part;
+    if ( s->binary )
+        k.append( " binary" );
+    if ( unicode )
+        k.append( " unicode" );
+    return k;
+}
+
+
 /*! Issues queries to resolve any questions this FETCH needs to answer.
 */
 
@@ -874,6 +1337,9 @@ void Fetch::sendFetchQueries()
     bool haveBody = true;
     bool havePartNumbers = true;
     bool haveTrivia = true;
+    bool haveFields = true;
+    bool trivia = d->rfc822size || d->internaldate ||
+                  d->databaseId || d->threadId;
 
     List<Message> * l = new List<Message>;
 
@@ -881,28 +1347,48 @@ void Fetch::sendFetchQueries()
     while ( i ) {
         Message * m = i;
         ++i;
+        if ( d->summaries && d->summaryCache.contains( m->databaseId() ) ) {
+            // the summary covers everything but the trivia, which
+            // execute() waits for, so we must fetch that if needed
+            if ( trivia && !m->hasTrivia() ) {
+                haveTrivia = false;
+                l->append( m );
+            }
+            continue;
+        }
         if ( !m->hasAddresses() )
             haveAddresses = false;
         if ( !m->hasHeaders() )
             haveHeader = false;
         if ( !m->hasBytesAndLines() )
             havePartNumbers = false;
-        if ( !m->hasBodies() )
+        if ( !m->hasBodies() && !streamed( m ) )
             haveBody = false;
         if ( !m->hasTrivia() )
             haveTrivia = false;
+        if ( d->headerFields && haveFields && !hasHeaderFields( m ) )
+            haveFields = false;
         l->append( m );
     }
 
+    if ( l->isEmpty() )
+        return;
+
     Fetcher * f = new Fetcher( l, this, imap() );
-    if ( d->needsAddresses && !haveAddresses )
-        f->fetch( Fetcher::Addresses );
-    if ( d->needsHeader && !haveHeader )
-        f->fetch( Fetcher::OtherHeader );
+    f->allowReplica( session()->mailbox()->id(), session()->nextModSeq() );
+    if ( d->headerFields ) {
+        if ( !haveFields )
+            f->fetchHeaderFields( *d->headerFields );
+    }
+    else {
+        if ( d->needsAddresses && !haveAddresses )
+            f->fetch( Fetcher::Addresses );
+        if ( d->needsHeader && !haveHeader )
+            f->fetch( Fetcher::OtherHeader );
+    }
     if ( d->needsBody && !haveBody )
         f->fetch( Fetcher::Body );
-    if ( ( d->rfc822size || d->internaldate ||
-           d->databaseId || d->threadId ) && !haveTrivia )
+    if ( trivia && !haveTrivia )
         f->fetch( Fetcher::Trivia );
     if ( d->needsPartNumbers && !havePartNumbers )
         f->fetch( Fetcher::PartNumbers );
@@ -910,6 +1396,154 @@ void Fetch::sendFetchQueries()
 }
 
 
+/*! Returns true if every body section this command needs from \a m
+    is a piece of the section the session is streaming, so that \a
+    m's bodies needn't be loaded.
+
+    Only single-message fetches are considered. Since another
+    command may replace the session's copy before \a m's response is
+    made, the copy is remembered, and fetchResponse() restores it if
+    need be.
+*/
+
+bool Fetch::streamed( Message * m )
+{
+    if ( !m->databaseId() || d->set.count() != 1 )
+        return false;
+    ImapSession * s = session();
+    bool unicode = imap()->clientSupports( IMAP::Unicode );
+    EString key;
+    List< Section >::Iterator it( d->sections );
+    while ( it ) {
+        if ( it->needsBody ) {
+            key = streamingKey( it, m, unicode );
+            if ( !it->partial || !s->hasStreamedSection( key ) )
+                return false;
+        }
+        ++it;
+    }
+    if ( !key.isEmpty() ) {
+        d->streamedKey = key;
+        d->streamedItem = s->streamedItem();
+        d->streamedData = s->streamedData();
+    }
+    return true;
+}
+
+
+/*! Returns true if \a m has all the header fields this command needs
+    to send, if it needs only some specific fields.
+*/
+
+bool Fetch::hasHeaderFields( Message * m ) const
+{
+    EStringList::Iterator i( d->headerFields );
+    while ( i ) {
+        if ( !m->hasHeaderField( *i ) )
+            return false;
+        ++i;
+    }
+    return true;
+}
+
+
+// The SharedCache holds summaries as the envelope's length, a colon,
+// the envelope and the bodystructure.
+
+static EString shared( FetchData::Summary * s )
+{
+    EString r;
+    r.reserve( s->envelope.length() + s->bodystructure.length() + 8 );
+    r.appendNumber( s->envelope.length() );
+    r.append( ':' );
+    r.append( s->envelope );
+    r.append( s->bodystructure );
+    return r;
+}
+
+
+static FetchData::Summary * unshare( const EString & s )
+{
+    int colon = s.find( ':' );
+    if ( colon < 1 )
+        return 0;
+    bool ok = false;
+    uint l = s.mid( 0, colon ).number( &ok );
+    if ( !ok || colon + 1 + l >= s.length() )
+        return 0;
+    FetchData::Summary * r = new FetchData::Summary;
+    r->envelope = s.mid( colon + 1, l );
+    r->bodystructure = s.mid( colon + 1 + l );
+    return r;
+}
+
+
+/*! Asks the SharedCache and then message_summaries for the ENVELOPE
+    and BODYSTRUCTURE of the messages to be fetched. pickup() fetches
+    the rest the usual way once the answer is in.
+*/
+
+void Fetch::sendSummaryQuery()
+{
+    IntegerSet ids;
+    Map<Message>::Iterator i( d->messages );
+    while ( i ) {
+        uint id = i->databaseId();
+        ++i;
+        if ( !id )
+            continue;
+        FetchData::Summary * s = unshare( SharedCache::find( id ) );
+        if ( s )
+            d->summaryCache.insert( id, s );
+        else
+            ids.add( id );
+    }
+
+    if ( ids.isEmpty() ) {
+        // everything came from the shared cache
+        sendFetchQueries();
+        return;
+    }
+
+    d->summaryFetcher =
+        new Query( "select message, envelope, bodystructure "
+                   "from message_summaries where message=any($1)", this );
+    d->summaryFetcher->bind( 1, ids );
+    enqueue( d->summaryFetcher );
+}
+
+
+/*! Computes the ENVELOPE and BODYSTRUCTURE of \a m, which must have
+    its addresses, header and part numbers, and remembers them both
+    for this command and (if they're plain ASCII) in the database.
+*/
+
+void Fetch::summarize( Message * m )
+{
+    if ( !m->databaseId() )
+        return;
+
+    FetchData::Summary * s = new FetchData::Summary;
+    s->envelope = envelope( m );
+    s->bodystructure = bodyStructure( m, true );
+    d->summaryCache.insert( m->databaseId(), s );
+    SharedCache::insert( m->databaseId(), shared( s ) );
+
+    // text columns want valid UTF-8, and 8-bit envelopes are rare
+    // enough that we needn't bother with them.
+    EString both = s->envelope + s->bodystructure;
+    uint i = 0;
+    while ( i < both.length() && !( both[i] & 0x80 ) )
+        i++;
+    if ( i < both.length() )
+        return;
+
+    d->newSummaryIds.append( fn( m->databaseId() ) );
+    d->newEnvelopes.append( s->envelope );
+    d->newBodystructures.append( s->bodystructure );
+}
+
+
 /*! This function returns the text of that portion of the Message \a m
     that is described by the Section \a s. It is publicly available so
     that Append may use it for CATENATE.
@@ -1015,6 +1649,7 @@ EString Fetch::sectionData( Section * s, Message * m, bool unicodable )
 
     else if ( s->id.isEmpty() || s->id == "size" ) {
         item = "BODY";
+        bool sized = false;
         Bodypart * bp = m->bodypart( s->part, false );
         if ( !bp ) {
             // nonexistent part number
@@ -1024,6 +1659,19 @@ EString Fetch::sectionData( Section * s, Message * m, bool unicodable )
             // sent anyway.
             // error( No, "No such bodypart: " + s->part );
         }
+        else if ( s->id == "size" && !bp->message() &&
+                  bp->children()->isEmpty() &&
+                  ( bp->numBytes() || !m->hasBodies() ) ) {
+            // leaf part; bodyparts.bytes is the decoded size
+            data = fn( bp->numBytes() );
+            sized = true;
+        }
+        else if ( s->id == "size" && !m->hasBodies() ) {
+            // message/rfc822 and multipart parts have no
+            // content-transfer-encoding to speak of
+            data = fn( bp->numEncodedBytes() );
+            sized = true;
+        }
         else if ( bp->message() ) {
             // message/rfc822 part
             data = bp->message()->rfc822( !unicodable );
@@ -1067,7 +1715,8 @@ EString Fetch::sectionData( Section * s, Message * m, bool unicodable )
 
         if ( s->id == "size" ) {
             item = "BINARY.SIZE";
-            data = fn( data.length() );
+            if ( !sized )
+                data = fn( data.length() );
         }
 
         item = item + "[" + s->part + "]";
@@ -1083,23 +1732,68 @@ EString Fetch::sectionData( Section * s, Message * m, bool unicodable )
 }
 
 
-/* This function returns the response data for an element in
-   d->sections, to be included in the FETCH response by
-   fetchResponses() below. If \a unicode is false, the result will be
-   downgraded rather than contain unicode.
+// Literals at least this large are kept as separate strings in
+// fetchResponse(), so that the Buffer can reference rather than copy
+// them.
+static const uint largeLiteral = 16384;
+
+
+/* Returns the data for the partial body section \a s of \a m. Clients
+   often fetch a large part in windows of e.g. 64KB, so \a session
+   keeps the whole section, and the next window is cut from that
+   instead of rendering the section (and loading its bodyparts)
+   again. Only the most recently streamed section is kept.
 */
 
-static EString sectionResponse( Section * s, Message * m, bool unicode )
+static EString streamedData( Section * s, Message * m, bool unicode,
+                             ImapSession * session )
 {
-    EString data( Fetch::sectionData( s, m, unicode ) );
-    if ( !s->item.startsWith( "BINARY.SIZE" ) )
-        data = Command::imapQuoted( data, Command::NString );
-    EString r;
-    r.reserve( data.length() + s->item.length() + 1 );
+    EString key = streamingKey( s, m, unicode );
+    if ( !session->hasStreamedSection( key ) ) {
+        s->partial = false;
+        EString data = Fetch::sectionData( s, m, unicode );
+        s->partial = true;
+        session->setStreamedSection( key, s->item, data );
+    }
+    s->item = session->streamedItem() + "<" + fn( s->offset ) + ">";
+    return session->streamedData().mid( s->offset, s->length );
+}
+
+
+/* This function appends the response data for an element in
+   d->sections to \a r, to be included in the FETCH response by
+   fetchResponse() below. If the data is large, only the literal's
+   length is appended to \a r, and \a large is set to the literal
+   itself. If \a unicode is false, the result will be downgraded
+   rather than contain unicode. Partial body sections are cut from
+   the copy in \a session, if that isn't null.
+*/
+
+static void sectionResponse( EString & r, EString & large,
+                             Section * s, Message * m, bool unicode,
+                             ImapSession * session )
+{
+    EString data;
+    if ( session && s->partial && s->needsBody && m->databaseId() )
+        data = streamedData( s, m, unicode, session );
+    else
+        data = Fetch::sectionData( s, m, unicode );
     r.append( s->item );
     r.append( " " );
-    r.append( data );
-    return r;
+    if ( s->item.startsWith( "BINARY.SIZE" ) ) {
+        r.append( data );
+    }
+    else if ( data.length() < largeLiteral ) {
+        r.append( Command::imapQuoted( data, Command::NString ) );
+    }
+    else {
+        if ( data.contains( 0 ) )
+            r.append( '~' );
+        r.append( '{' );
+        r.appendNumber( data.length() );
+        r.append( "}\r\n" );
+        large = data;
+    }
 }
 
 
@@ -1110,6 +1804,21 @@ static EString sectionResponse( Section * s, Message * m, bool unicode )
 */
 
 EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
+{
+    return fetchResponse( m, uid, msn )->join( "" );
+}
+
+
+/*! Returns the FETCH response for the message \a m, which is trusted
+    to have UID \a uid and MSN \a msn, as a list of strings to be
+    sent one after another. Large literals are separate elements in
+    the list, so they can be sent without being copied into a single
+    response string.
+
+    The message must have all necessary content.
+*/
+
+EStringList * Fetch::fetchResponse( Message * m, uint uid, uint msn )
 {
     EStringList l;
     if ( d->uid )
@@ -1124,11 +1833,18 @@ EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
         l.append( "FLAGS (" + flagList( uid ) + ")" );
     if ( d->internaldate )
         l.append( "INTERNALDATE " + internalDate( m ) );
-    if ( d->envelope )
+    FetchData::Summary * summary = 0;
+    if ( d->summaries )
+        summary = d->summaryCache.find( m->databaseId() );
+    if ( d->envelope && summary )
+        l.append( "ENVELOPE " + summary->envelope );
+    else if ( d->envelope )
         l.append( "ENVELOPE " + envelope( m ) );
     if ( d->body )
         l.append( "BODY " + bodyStructure( m, false ) );
-    if ( d->bodystructure )
+    if ( d->bodystructure && summary )
+        l.append( "BODYSTRUCTURE " + summary->bodystructure );
+    else if ( d->bodystructure )
         l.append( "BODYSTRUCTURE " + bodyStructure( m, true ) );
     if ( d->annotation )
         l.append( "ANNOTATION " + annotation( imap()->user(), uid,
@@ -1139,44 +1855,105 @@ EString Fetch::makeFetchResponse( Message * m, uint uid, uint msn )
             l.append( "MODSEQ (" + fn( dd->modseq ) + ")" );
     }
 
+    EStringList * r = new EStringList;
+    EString payload = l.join( " " );
+    EString head;
+    head.reserve( payload.length() + 30 );
+    head.appendNumber( msn );
+    head.append( " FETCH (" );
+    head.append( payload );
+
+    // if streamed() let us skip the bodies, but another command has
+    // since replaced the session's copy, we put ours back.
+    ImapSession * session = (ImapSession *)imap()->session();
+    if ( session && !d->streamedKey.isEmpty() &&
+         !session->hasStreamedSection( d->streamedKey ) )
+        session->setStreamedSection( d->streamedKey, d->streamedItem,
+                                     d->streamedData );
+
     List< Section >::Iterator it( d->sections );
     bool unicode = imap()->clientSupports( IMAP::Unicode );
+    bool first = l.isEmpty();
     while ( it ) {
-        l.append( sectionResponse( it, m, unicode ) );
+        if ( !first )
+            head.append( " " );
+        first = false;
+        EString large;
+        sectionResponse( head, large, it, m, unicode, session );
+        if ( !large.isEmpty() ) {
+            r->append( head );
+            r->append( large );
+            head.truncate();
+        }
         ++it;
     }
 
-    EString r;
-    EString payload = l.join( " " );
-    r.reserve( payload.length() + 30 );
-    r.appendNumber( msn );
-    r.append( " FETCH (" );
-    r.append( payload );
-    r.append( ")" );
+    head.append( ")" );
+    r->append( head );
     return r;
 }
 
 
 /*! Returns a string containing all the flags that are set for the
     message with \a uid.
+
+    Messages only have the flag ids, which Flag maps to names. Since
+    most messages in a mailbox share a few combinations of flags, the
+    text for each combination is made once and shared by all
+    sessions.
 */
 
 EString Fetch::flagList( uint uid )
 {
-    EStringList r;
-
     FetchData::DynamicData * dd = d->dynamics.find( uid );
-    if ( dd ) {
-        if ( session()->isRecent( uid ) )
-            dd->flags.insert( "\\recent", new EString( "\\Recent" ) );
-        Dict<EString>::Iterator i( dd->flags );
-        while ( i ) {
-            r.append( *i );
-            ++i;
+    if ( !dd )
+        return "";
+
+    EString key;
+    if ( dd->seen )
+        key.append( "s" );
+    if ( dd->deleted )
+        key.append( "d" );
+    if ( session()->isRecent( uid ) )
+        key.append( "r" );
+    key.append( ":" );
+    key.append( dd->flags.set() );
+
+    if ( !::flagListCache )
+        ::flagListCache = new FetchData::FlagListCache;
+    EString * cached = ::flagListCache->c.find( key );
+    if ( cached )
+        return *cached;
+
+    EStringList r;
+    if ( dd->seen )
+        r.append( "\\Seen" );
+    if ( dd->deleted )
+        r.append( "\\Deleted" );
+    bool complete = true;
+    uint n = 1;
+    while ( n <= dd->flags.count() ) {
+        uint id = dd->flags.value( n );
+        n++;
+        if ( Flag::isSeen( id ) || Flag::isDeleted( id ) )
+            continue;
+        EString name = Flag::name( id );
+        if ( name.isEmpty() ) {
+            complete = false;
+            EString * s = d->flagNames.find( id );
+            if ( s )
+                name = *s;
         }
+        if ( !name.isEmpty() )
+            r.append( name );
     }
+    if ( session()->isRecent( uid ) )
+        r.append( "\\Recent" );
 
-    return r.join( " " );
+    EString * s = new EString( r.join( " " ) );
+    if ( complete )
+        ::flagListCache->c.insert( key, s );
+    return *s;
 }
 
 
@@ -1356,7 +2133,8 @@ EString Fetch::bodyStructure( Multipart * m, bool extended )
     if ( ancestor->isMessage() ) {
         Message *msg = (Message *)ancestor;
         if ( msg->hasPGPsignedPart() ) {
-            ::log( "Fetch::bodyStructure - signed message", Log::Debug );
+            if ( Log::enabled( Log::Debug ) )
+                ::log( "Fetch::bodyStructure - signed message", Log::Debug );
             isSigned = true;
         }
     }
@@ -1368,13 +2146,16 @@ EString Fetch::bodyStructure( Multipart * m, bool extended )
         List< Bodypart >::Iterator it( m->children() );
         if ( ( m == ancestor ) && isSigned ) {  // if top level, consider raw part
             if ( !extended ) {
-                log( "Fetch::bodyStructure - append raw part", Log::Debug );
+                if ( Log::enabled( Log::Debug ) )
+                    log( "Fetch::bodyStructure - append raw part",
+                         Log::Debug );
                 children.append( bodyStructure( it, extended ) );
                 uint i;
                 for ( i = 1; i <= m->children()->count(); i++ )
                     ++it;
             } else {  // skip raw part
-                log( "Fetch::bodyStructure - skip raw part", Log::Debug );
+                if ( Log::enabled( Log::Debug ) )
+                    log( "Fetch::bodyStructure - skip raw part", Log::Debug );
                 ++it;
             }
         }
@@ -1637,11 +2418,27 @@ void Fetch::pickup()
     if ( !s )
         return;
 
+    if ( d->summaryFetcher ) {
+        if ( !d->summaryFetcher->done() )
+            return;
+        while ( d->summaryFetcher->hasResults() ) {
+            Row * r = d->summaryFetcher->nextRow();
+            FetchData::Summary * sm = new FetchData::Summary;
+            sm->envelope = r->getEString( "envelope" );
+            sm->bodystructure = r->getEString( "bodystructure" );
+            d->summaryCache.insert( r->getInt( "message" ), sm );
+            SharedCache::insert( r->getInt( "message" ), shared( sm ) );
+        }
+        d->summaryFetcher = 0;
+
+        // the others need everything to make them from
+        d->needsHeader = true;
+        d->needsAddresses = true;
+        d->needsPartNumbers = true;
+        sendFetchQueries();
+    }
+
     if ( d->seenDeletedFetcher ) {
-        EString seenl( "\\seen" );
-        EString * seen = new EString( "\\Seen" );
-        EString deletedl( "\\deleted" );
-        EString * deleted = new EString( "\\Deleted" );
         while ( d->seenDeletedFetcher->hasResults() ) {
             Row * r = d->seenDeletedFetcher->nextRow();
             uint uid = r->getInt( "uid" );
@@ -1650,10 +2447,8 @@ void Fetch::pickup()
                 dd = new FetchData::DynamicData;
                 d->dynamics.insert( uid, dd );
             }
-            if ( r->getBoolean( "seen" ) )
-                dd->flags.insert( seenl, seen );
-            if ( r->getBoolean( "deleted" ) )
-                dd->flags.insert( deletedl, deleted );
+            dd->seen = r->getBoolean( "seen" );
+            dd->deleted = r->getBoolean( "deleted" );
         }
         while ( d->flagFetcher->hasResults() ) {
             Row * r = d->flagFetcher->nextRow();
@@ -1663,14 +2458,32 @@ void Fetch::pickup()
                 dd = new FetchData::DynamicData;
                 d->dynamics.insert( uid, dd );
             }
-            EString f = r->getEString( "name" );
-            if ( !f.isEmpty() )
-                dd->flags.insert( f.lower(), new EString( f ) );
+            uint f = r->getInt( "flag" );
+            dd->flags.add( f );
+            // a flag created by another server may not have reached
+            // Flag yet, so we ask for its name
+            if ( Flag::name( f ).isEmpty() )
+                d->unknownFlags.add( f );
         }
         if ( d->seenDeletedFetcher->done() &&
              d->flagFetcher->done() ) {
             d->seenDeletedFetcher = 0;
             d->flagFetcher = 0;
+            if ( !d->unknownFlags.isEmpty() ) {
+                d->flagNameFetcher =
+                    new Query( "select id, name from flag_names "
+                               "where id=any($1)", this );
+                d->flagNameFetcher->bind( 1, d->unknownFlags );
+                d->flagNameFetcher->execute();
+            }
+        }
+    }
+
+    if ( d->flagNameFetcher ) {
+        while ( d->flagNameFetcher->hasResults() ) {
+            Row * r = d->flagNameFetcher->nextRow();
+            d->flagNames.insert( r->getInt( "id" ),
+                                 new EString( r->getEString( "name" ) ) );
         }
     }
 
@@ -1684,6 +2497,21 @@ void Fetch::pickup()
                 d->dynamics.insert( uid, dd );
             }
 
+            // the first row for a message replaces what the cache had
+            FetchData::AnnotationCache::MailboxInfo * mi
+                = d->annotationsCached;
+            List<Annotation> * l = mi->annotations.find( uid );
+            if ( !d->annotated.contains( uid ) ) {
+                d->annotated.add( uid );
+                dd->annotations.clear();
+                l = new List<Annotation>;
+                mi->annotations.insert( uid, l );
+                mi->known.add( uid );
+            }
+
+            if ( r->isNull( "name" ) )
+                continue;
+
             EString n = r->getEString( "name" );
             EString v( r->getEString( "value" ) );
 
@@ -1691,8 +2519,13 @@ void Fetch::pickup()
             if ( !r->isNull( "owner" ) )
                 owner = r->getInt( "owner" );
 
-            dd->annotations.append( new Annotation( n, v, owner ) );
+            Annotation * a = new Annotation( n, v, owner );
+            dd->annotations.append( a );
+            l->append( a );
         }
+        if ( d->annotationFetcher->done() &&
+             d->annotationsCached->ms < d->annotationModSeq )
+            d->annotationsCached->ms = d->annotationModSeq;
     }
 
     if ( d->modseqFetcher ) {
@@ -1714,6 +2547,9 @@ void Fetch::pickup()
     if ( d->flagFetcher && !d->flagFetcher->done() )
         return;
 
+    if ( d->flagNameFetcher && !d->flagNameFetcher->done() )
+        return;
+
     if ( d->annotationFetcher && !d->annotationFetcher->done() )
         return;
 
@@ -1725,18 +2561,28 @@ void Fetch::pickup()
     while ( ok && !d->remaining.isEmpty() ) {
         uint uid = d->remaining.smallest();
         Message * m = d->messages.find( uid );
-        if ( d->needsAddresses && !m->hasAddresses() )
-            ok = false;
-        if ( d->needsHeader && !m->hasHeaders() )
-            ok = false;
-        if ( d->needsPartNumbers && !m->hasBytesAndLines() )
-            ok = false;
-        if ( d->needsBody && !m->hasBodies() )
-            ok = false;
+        bool summarized = d->summaries &&
+                          d->summaryCache.contains( m->databaseId() );
+        if ( d->headerFields ) {
+            if ( !hasHeaderFields( m ) )
+                ok = false;
+        }
+        else if ( !summarized ) {
+            if ( d->needsAddresses && !m->hasAddresses() )
+                ok = false;
+            if ( d->needsHeader && !m->hasHeaders() )
+                ok = false;
+            if ( d->needsPartNumbers && !m->hasBytesAndLines() )
+                ok = false;
+            if ( d->needsBody && !m->hasBodies() )
+                ok = false;
+        }
         if ( ( d->rfc822size || d->internaldate ||
                d->databaseId || d->threadId ) && !m->hasTrivia() )
             ok = false;
         if ( ok ) {
+            if ( d->summaries && !summarized )
+                summarize( m );
             d->processed = uid;
             d->remaining.remove( uid );
             done++;
@@ -1744,9 +2590,37 @@ void Fetch::pickup()
         }
     }
 
+    if ( !d->newSummaryIds.isEmpty() ) {
+        // another session may be doing the same. "not exists" alone
+        // still races, so let postgres drop duplicates where it can,
+        // and otherwise expect the loser to hit the primary key.
+        EString sql( "insert into message_summaries "
+                     "(message,envelope,bodystructure) "
+                     "select s.m::integer, s.e, s.b from "
+                     "(select unnest($1::text[]) as m,"
+                     " unnest($2::text[]) as e,"
+                     " unnest($3::text[]) as b) s " );
+        if ( Postgres::version() >= 90500 )
+            sql.append( "on conflict (message) do nothing" );
+        else
+            sql.append( "where not exists "
+                        "(select message from message_summaries "
+                        "where message=s.m::integer)" );
+        Query * q = new Query( sql, 0 );
+        q->allowFailure();
+        q->bind( 1, d->newSummaryIds );
+        q->bind( 2, d->newEnvelopes );
+        q->bind( 3, d->newBodystructures );
+        q->execute();
+        d->newSummaryIds.clear();
+        d->newEnvelopes.clear();
+        d->newBodystructures.clear();
+    }
+
     if ( !done )
         return;
-    log( "Processed " + fn( done ) + " messages", Log::Debug );
+    if ( Log::enabled( Log::Debug ) )
+        log( "Processed " + fn( done ) + " messages", Log::Debug );
     imap()->emitResponses();
 }
 
@@ -1779,6 +2653,29 @@ EString ImapFetchResponse::text() const
 }
 
 
+/*! This reimplementation of emit() appends the response to \a buffer
+    piece by piece, so that large literals are referenced by \a
+    buffer instead of being copied into one big response string.
+*/
+
+bool ImapFetchResponse::emit( Buffer * buffer ) const
+{
+    uint msn = session()->msn( u );
+    if ( !u || !msn )
+        return false;
+
+    EStringList * l = f->fetchResponse( f->message( u ), u, msn );
+    buffer->append( "* ", 2 );
+    EStringList::Iterator i( l );
+    while ( i ) {
+        buffer->append( *i );
+        ++i;
+    }
+    buffer->append( "\r\n", 2 );
+    return true;
+}
+
+
 /*! This reimplementation of setSent() frees up memory... that
     shouldn't be necessary when using garbage collection, but in this
     case it's important to remove messages from the data structures
@@ -1802,6 +2699,9 @@ void ImapFetchResponse::setSent()
 
 void Fetch::forget( uint uid )
 {
+    Message * m = d->messages.find( uid );
+    if ( m && d->summaries )
+        d->summaryCache.remove( m->databaseId() );
     d->messages.remove( uid );
 }
 
@@ -1816,6 +2716,51 @@ Message * Fetch::message( uint uid ) const
 }
 
 
+/*! Takes the UIDs, flags and modseqs for this unsolicited flag update
+    from the FlagSnapshot it shares with other sessions, instead of
+    querying the database, and skips ahead to state 1.
+*/
+
+void Fetch::useSnapshot()
+{
+    Mailbox * mb = session()->mailbox();
+    FlagSnapshot * fs = d->snapshot;
+    IntegerSet found;
+    uint n = 1;
+    while ( n <= d->set.count() ) {
+        uint uid = d->set.value( n );
+        n++;
+        FlagSnapshot::Item * i = fs->items.find( uid );
+        if ( !i || i->modseq <= d->changedSince )
+            continue;
+        found.add( uid );
+        Message * m = d->messages.find( uid );
+        if ( !m ) {
+            m = MessageCache::provide( mb, uid );
+            d->messages.insert( uid, m );
+        }
+        m->setDatabaseId( i->message );
+        FetchData::DynamicData * dd = new FetchData::DynamicData;
+        dd->modseq = i->modseq;
+        dd->seen = i->seen;
+        dd->deleted = i->deleted;
+        dd->flags = i->flags;
+        d->dynamics.insert( uid, dd );
+    }
+    d->set = found;
+
+    n = 1;
+    while ( n <= fs->unknown.count() ) {
+        uint id = fs->unknown.value( n );
+        n++;
+        EString * name = fs->flagNames.find( id );
+        if ( name )
+            d->flagNames.insert( id, name );
+    }
+    d->state = 1;
+}
+
+
 /*! Sends a query to retrieve all flags. */
 
 void Fetch::sendFlagQuery()
@@ -1829,9 +2774,8 @@ void Fetch::sendFlagQuery()
     enqueue( d->seenDeletedFetcher );
 
     d->flagFetcher = new Query(
-        "select f.uid, fn.name from flags f "
-        "join flag_names fn on (f.flag=fn.id) "
-        "where f.mailbox=$1 and f.uid=any($2)",
+        "select uid, flag from flags "
+        "where mailbox=$1 and uid=any($2)",
         this );
     d->flagFetcher->bind( 1, session()->mailbox()->id() );
     d->flagFetcher->bind( 2, d->set );
@@ -1839,20 +2783,65 @@ void Fetch::sendFlagQuery()
 }
 
 
-/*! Sends a query to retrieve all annotations. */
+/*! Sends a query to retrieve all annotations.
+
+    The annotations are cached per mailbox. Since changing an
+    annotation gives the message a new modseq, the query returns only
+    the messages that aren't cached or have changed since the
+    annotations were cached; the others are answered from the cache.
+    Each message yields at least one row, so that messages without
+    annotations can be cached too.
+*/
 
 void Fetch::sendAnnotationsQuery()
 {
+    Mailbox * m = session()->mailbox();
+    if ( !::annotationCache )
+        ::annotationCache = new FetchData::AnnotationCache;
+    FetchData::AnnotationCache::MailboxInfo * mi
+        = ::annotationCache->provide( m );
+    d->annotationsCached = mi;
+    d->annotationModSeq = m->nextModSeq();
+
+    // messages we don't look at now can't be checked, so they
+    // have to be forgotten if anything might have changed
+    if ( mi->ms < d->annotationModSeq )
+        mi->known = mi->known.intersection( d->set );
+
+    IntegerSet cached( mi->known.intersection( d->set ) );
+    uint n = 1;
+    while ( n <= cached.count() ) {
+        uint uid = cached.value( n );
+        n++;
+        FetchData::DynamicData * dd = d->dynamics.find( uid );
+        if ( !dd ) {
+            dd = new FetchData::DynamicData;
+            d->dynamics.insert( uid, dd );
+        }
+        List<Annotation>::Iterator a( mi->annotations.find( uid ) );
+        while ( a ) {
+            dd->annotations.append( a );
+            ++a;
+        }
+    }
+
+    if ( mi->ms >= d->annotationModSeq && cached.count() == d->set.count() )
+        return;
+
     d->annotationFetcher = new Query(
-        "select a.uid, "
+        "select mm.uid, "
         "a.owner, a.value, an.name "
-        "from annotations a "
-        "join annotation_names an on (a.name=an.id) "
-        "where a.mailbox=$1 and a.uid=any($2) "
+        "from mailbox_messages mm "
+        "left join annotations a on (mm.mailbox=a.mailbox and mm.uid=a.uid) "
+        "left join annotation_names an on (a.name=an.id) "
+        "where mm.mailbox=$1 and mm.uid=any($2) "
+        "and (not mm.uid=any($3) or mm.modseq>=$4) "
         "order by an.name",
         this );
-    d->annotationFetcher->bind( 1, session()->mailbox()->id() );
+    d->annotationFetcher->bind( 1, m->id() );
     d->annotationFetcher->bind( 2, d->set );
+    d->annotationFetcher->bind( 3, cached );
+    d->annotationFetcher->bind( 4, mi->ms );
     enqueue( d->annotationFetcher );
 }
 
@@ -34,6 +34,7 @@ public:
                        const EStringList &, const EStringList & );
 
     EString makeFetchResponse( Message *, uint, uint );
+    EStringList * fetchResponse( Message *, uint, uint );
 
     Message * message( uint ) const;
     void forget( uint );
@@ -43,6 +44,11 @@ private:
     void parseBody( bool );
     void parseAnnotation();
     void sendFetchQueries();
+    void sendSummaryQuery();
+    void summarize( Message * );
+    bool hasHeaderFields( Message * ) const;
+    bool streamed( Message * );
+    void useSnapshot();
     void sendFlagQuery();
     void sendAnnotationsQuery();
     void sendModSeqQuery();
@@ -53,6 +59,7 @@ private:
     EString singlePartStructure( Multipart *, bool );
 
     void pickup();
+    void startReadAhead();
 
     void enqueue( Query * q );
 
@@ -67,6 +74,7 @@ class ImapFetchResponse
 public:
     ImapFetchResponse( ImapSession *, Fetch *, uint );
     EString text() const;
+    bool emit( class Buffer * ) const;
     void setSent();
 
 private:
@@ -3,6 +3,7 @@
 #include "idle.h"
 
 #include "imap.h"
+#include "timer.h"
 #include "buffer.h"
 #include "mailbox.h"
 #include "imapsession.h"
@@ -21,6 +22,12 @@
 
     For some reason, RFC 2177 permits IDLE to be called in
     authenticated state. We must be careful not to assume otherwise.
+
+    Clients may idle for hours, and a server may have many thousands
+    of them. When nothing has been read from the client for half a
+    minute, Idle releases what the connection and session can
+    recreate later (see becomeDormant()), and does so again after
+    later activity.
 */
 
 
@@ -30,6 +37,9 @@
 
 void Idle::execute()
 {
+    if ( state() != Executing )
+        return;
+
     // find the mailbox we're looking at, if any
     Mailbox * m = 0;
     if ( imap()->session() )
@@ -39,12 +49,35 @@ void Idle::execute()
     if ( !m || imap()->Connection::state() != Connection::Connected )
         read();
 
-    if ( idling )
+    if ( idling ) {
+        if ( !dormancy ) {
+            dormancy = new Timer( this, 30 );
+        }
+        else if ( !dormancy->active() ) {
+            dormancy = 0;
+            becomeDormant();
+        }
         return;
+    }
 
     imap()->reserve( this );
     imap()->enqueue( "+ idling\r\n" );
     idling = true;
+    dormancy = new Timer( this, 30 );
+}
+
+
+/*! Releases the buffer storage and session data that aren't needed
+    while the client is idle. Everything released is recreated when
+    it's next needed.
+*/
+
+void Idle::becomeDormant()
+{
+    imap()->readBuffer()->release();
+    imap()->writeBuffer()->release();
+    if ( imap()->session() )
+        imap()->session()->compact();
 }
 
 
@@ -10,13 +10,16 @@ class Idle
     : public Command
 {
 public:
-    Idle(): idling( false ) {}
+    Idle(): idling( false ), dormancy( 0 ) {}
 
     void execute();
     void read();
 
 private:
     bool idling;
+    class Timer * dormancy;
+
+    void becomeDormant();
 };
 
 
@@ -7,8 +7,10 @@
 #include "estringlist.h"
 #include "ustringlist.h"
 #include "imapparser.h"
+#include "integerset.h"
 #include "address.h"
 #include "mailbox.h"
+#include "mailboxgroup.h"
 #include "query.h"
 #include "dict.h"
 #include "user.h"
@@ -20,7 +22,7 @@ class ListextData
 {
 public:
     ListextData():
-        selectQuery( 0 ), permissionsQuery( 0 ),
+        subscriptionsQuery( 0 ), permissionsQuery( 0 ),
         reference( 0 ),
         state( 0 ),
         extended( false ),
@@ -31,13 +33,40 @@ public:
         selectSpecialUse( false )
     {}
 
-    Query * selectQuery;
+    Query * subscriptionsQuery;
     Query * permissionsQuery;
     Mailbox * reference;
     EString referenceName;
     UStringList patterns;
     uint state;
 
+    // a pattern, prepared once so that it can be matched against
+    // many mailboxes
+    class Pattern
+        : public Garbage
+    {
+    public:
+        Pattern(): start( 0 ) {}
+        Mailbox * start;
+        UString pattern;
+    };
+
+    List<Pattern> compiled;
+
+    class Match
+        : public Garbage
+    {
+    public:
+        Match( Mailbox * m, const UString & k ): mailbox( m ), key( k ) {}
+        Mailbox * mailbox;
+        UString key;
+    };
+
+    List<Match> matches;
+    IntegerSet matched;
+    IntegerSet subscribed;
+    IntegerSet childSubscribed;
+
     class Permissions
         : public Garbage
     {
@@ -165,6 +194,84 @@ void Listext::parse()
 }
 
 
+/*! Prepares each pattern for matching against the mailbox tree, and
+    finds the deepest mailbox below which all its matches must lie.
+*/
+
+void Listext::compilePatterns()
+{
+    UStringList::Iterator i( d->patterns );
+    while ( i ) {
+        ListextData::Pattern * c = new ListextData::Pattern;
+
+        // the pattern as it applies to whole mailbox names
+        UString p = *i;
+        if ( (*i)[0] != '*' && (*i)[0] != '/' ) {
+            p = d->reference->name();
+            if ( !i->isEmpty() && !p.endsWith( "/" ) )
+                p.append( "/" );
+            p.append( *i );
+        }
+        c->pattern = p.titlecased();
+
+        // everything that matches lies below the last complete name
+        // before the first wildcard
+        uint n = 0;
+        uint slash = 0;
+        while ( n < c->pattern.length() &&
+                c->pattern[n] != '*' && c->pattern[n] != '%' ) {
+            if ( c->pattern[n] == '/' )
+                slash = n;
+            n++;
+        }
+        if ( slash )
+            c->start = Mailbox::obtain( c->pattern.mid( 0, slash ), false );
+        else
+            c->start = Mailbox::root();
+
+        d->compiled.append( c );
+        ++i;
+    }
+}
+
+
+// adds \a m and its descendants to d->matches if they match \a p,
+// skipping subtrees that cannot contain any match.
+
+static void addMatches( ListextData * d, Mailbox * m,
+                        ListextData::Pattern * p )
+{
+    uint r = 1;
+    if ( m != Mailbox::root() ) {
+        UString n = m->name().titlecased();
+        r = Mailbox::match( p->pattern, 0, n, 0 );
+        if ( !r )
+            return;
+
+        if ( r == 2 && m->id() && !d->matched.contains( m->id() ) &&
+             ( !d->selectSpecialUse || !m->flag().isEmpty() ) ) {
+            d->matched.add( m->id() );
+            n.append( ' ' );
+            d->matches.append( new ListextData::Match( m, n ) );
+        }
+    }
+
+    List<Mailbox>::Iterator c( m->children() );
+    while ( c ) {
+        addMatches( d, c, p );
+        ++c;
+    }
+}
+
+
+static int byName( const void * a, const void * b )
+{
+    ListextData::Match * x = *(ListextData::Match **)a;
+    ListextData::Match * y = *(ListextData::Match **)b;
+    return x->key.compare( y->key );
+}
+
+
 void Listext::execute()
 {
     if ( d->state == 0 && d->patterns.count() == 1 &&
@@ -181,127 +288,50 @@ void Listext::execute()
     }
 
     if ( d->state == 0 ) {
-        d->selectQuery = new Query( "", this );
-        uint bn = 1;
-        EString sel;
-        if ( d->selectSubscribed && d->selectRecursiveMatch ) {
-            sel = "select mb.id, mb.name, s.id as sid, "
-                  "exists(select cmb.id from mailboxes cmb "
-                  "join subscriptions cs on"
-                  " (cmb.id=cs.mailbox and cs.owner=$1) "
-                  "where lower(mb.name)||'/'="
-                  "lower(substring(cmb.name from 1 for length(mb.name)+1)))"
-                  " as csub "
-                  "from mailboxes mb "
-                  "left join subscriptions s on"
-                  " (mb.id=s.mailbox and s.owner=$1) "
-                  "where ";
-            d->selectQuery->bind( 1, imap()->user()->id() );
-            bn = 2;
-        }
-        else if ( d->selectSubscribed ) {
-            sel = "select mb.id, mb.name, s.id as sid from mailboxes mb "
-                  "join subscriptions s on (mb.id=s.mailbox and s.owner=$1) "
-                  "where ";
-            d->selectQuery->bind( 1, imap()->user()->id() );
-            bn = 2;
-        }
-        else {
-            sel = "select mb.id, mb.name";
-            if ( d->returnSubscribed ) {
-                sel.append( ", s.id as sid from mailboxes mb "
-                            "left join subscriptions s on"
-                            " (mb.id=s.mailbox and s.owner=$1)" );
-                d->selectQuery->bind( 1, imap()->user()->id() );
-                bn = 2;
-            }
-            else {
-                sel.append( " from mailboxes mb" );
-            }
-            sel.append( " where " );
-        }
-        if ( d->selectSpecialUse ) {
-            sel.append( "flag is not null" );
-        }
-        EStringList conditions;
-        UStringList::Iterator i( d->patterns );
-        bool first = true;
-        while ( i ) {
-            if ( !first )
-                sel.append( " or " );
-            first = false;
-            UString p = *i;
-            if ( !p.startsWith( "/" ) ) {
-                p = d->reference->name();
-                if ( !i->isEmpty() ) {
-                    p.append( "/" );
-                    p.append( *i );
-                }
-            }
-            UStringList constparts;
-            uint n = 0;
-            uint wn = 0;
-            while ( n <= p.length() ) {
-                if ( n >= p.length() || p[n] == '%' || p[n] == '*' ) {
-                    constparts.append( p.mid( wn, n-wn ) );
-                    n++;
-                    while ( p[n] == '%' || p[n] == '*' )
-                        n++;
-                    wn = n;
-                }
-                else {
-                    n++;
-                }
-            }
-            if ( constparts.isEmpty() ) {
-                sel.append( "true" );
-            }
-            else {
-                sel.append( "mb.name ilike " );
-                UStringList::Iterator constpart( constparts );
-                while ( constpart ) {
-                    sel.append( "$" );
-                    sel.appendNumber( bn );
-                    d->selectQuery->bind( bn, *constpart );
-                    bn++;
-                    ++constpart;
-                    if ( constpart )
-                        sel.append( "||'%'||" );
-                }
-            }
-            ++i;
+        if ( d->returnSubscribed ) {
+            d->subscriptionsQuery
+                = new Query( "select mailbox from subscriptions "
+                             "where owner=$1", this );
+            d->subscriptionsQuery->bind( 1, imap()->user()->id() );
+            d->subscriptionsQuery->execute();
         }
-        sel.append( " order by lower(mb.name)||' '" );
-        d->selectQuery->setString( sel );
-        d->selectQuery->execute();
-
+        compilePatterns();
         d->state = 1;
     }
 
     if ( d->state == 1 ) {
-        while ( d->selectQuery->hasResults() ) {
-            Row * r = d->selectQuery->nextRow();
-            UString mn = r->getUString( "name" );
-            bool matches = false;
-
-            UStringList::Iterator i( d->patterns );
-            while ( i && !matches ) {
-                uint s = 0;
-                if ( (*i)[0] != '*' && (*i)[0] != '/' ) {
-                    s = d->reference->name().length();
-                    if ( !i->isEmpty() && !d->reference->name().endsWith( "/" ) )
-                        s++;
-                }
-                if ( Mailbox::match( i->titlecased(), 0,
-                                     mn.titlecased(), s ) == 2 )
-                    matches = true;
-                ++i;
+        Query * q = d->subscriptionsQuery;
+        while ( q && q->hasResults() ) {
+            Row * r = q->nextRow();
+            uint id = r->getInt( "mailbox" );
+            d->subscribed.add( id );
+            // RECURSIVEMATCH wants to know about subscribed children
+            Mailbox * m = Mailbox::find( id );
+            if ( m )
+                m = m->parent();
+            while ( m && d->selectRecursiveMatch ) {
+                if ( m->id() )
+                    d->childSubscribed.add( m->id() );
+                m = m->parent();
             }
-            if ( matches )
-                makeResponse( r );
         }
-        if ( d->selectQuery->done() )
-            d->state = 2;
+        if ( q && !q->done() )
+            return;
+
+        List<ListextData::Pattern>::Iterator p( d->compiled );
+        while ( p ) {
+            if ( p->start )
+                addMatches( d, p->start, p );
+            ++p;
+        }
+
+        List<ListextData::Match> * sorted = d->matches.sorted( byName );
+        List<ListextData::Match>::Iterator m( sorted );
+        while ( m ) {
+            makeResponse( m->mailbox );
+            ++m;
+        }
+        d->state = 2;
     }
 
     if ( d->state == 2 ) {
@@ -359,9 +389,13 @@ void Listext::execute()
     }
 
     if ( d->state == 3 ) {
+        // clients often STATUS or SELECT each mailbox they've listed
+        List<Mailbox> listed;
         List<ListextData::Response>::Iterator i( d->responses );
         while ( i ) {
             Mailbox * m = i->mailbox;
+            if ( !m->deleted() )
+                listed.append( m );
             if ( m->owner() == imap()->user()->id() ) {
                 respond( i->response );
             }
@@ -381,9 +415,13 @@ void Listext::execute()
                 }
                 if ( r.contains( 'l' ) || !set )
                     respond( i->response );
+                else
+                    listed.remove( i->mailbox );
             }
             ++i;
         }
+        if ( listed.count() > 1 )
+            (void)new MailboxGroup( &listed, imap() );
         finish();
     }
 }
@@ -423,15 +461,11 @@ void Listext::addSelectOption( const EString & option )
 }
 
 
-/*! Sends a LIST or LSUB response for \a row.
+/*! Sends a LIST or LSUB response for \a mailbox.
 */
 
-void Listext::makeResponse( Row * row )
+void Listext::makeResponse( Mailbox * mailbox )
 {
-    Mailbox * mailbox = Mailbox::find( row->getInt( "id" ) );
-    if ( !mailbox )
-        return;
-
     EStringList a;
 
     // add the easy mailbox attributes
@@ -451,11 +485,11 @@ void Listext::makeResponse( Row * row )
     // then there's subscription
     bool include = false;
     EString ext = "";
-    if ( row->hasColumn( "sid" ) && !row->isNull( "sid" ) ) {
+    if ( d->subscribed.contains( mailbox->id() ) ) {
         a.append( "\\subscribed" );
         include = true;
     }
-    if ( row->hasColumn( "csub" ) && row->getBoolean( "csub" ) ) {
+    if ( d->childSubscribed.contains( mailbox->id() ) ) {
         ext = ( " ((\"childinfo\" (\"subscribed\")))" );
         include = true;
     }
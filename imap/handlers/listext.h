@@ -21,7 +21,8 @@ private:
     void addReturnOption( const EString & );
     void addSelectOption( const EString & );
 
-    void makeResponse( class Row * );
+    void compilePatterns();
+    void makeResponse( Mailbox * );
 
     void reference();
 
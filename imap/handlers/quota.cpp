@@ -17,6 +17,11 @@
     usually much bigger than the actual number of kilobytes used by
     the database for storing the mail (at one site by a factor of
     four), but it'll do for reporting usage.
+
+    The figures come from mailbox_counts, which a trigger keeps up to
+    date as messages are injected, copied and expunged, so GETQUOTA
+    costs one row per mailbox the user owns rather than one per
+    message.
 */
 
 void GetQuota::parse()
@@ -32,11 +37,10 @@ void GetQuota::parse()
 void GetQuota::execute()
 {
     if ( !q ) {
-        q = new Query( "select count(rfc822size) as c, "
-                       "coalesce(sum(rfc822size::bigint),0)::bigint/1024 as s "
-                       "from messages m"
-                       " join mailbox_messages mm on (m.id=mm.message)"
-                       " join mailboxes mb on (mm.mailbox=mb.id)"
+        q = new Query( "select coalesce(sum(c.messages),0)::bigint as c, "
+                       "coalesce(sum(c.bytes),0)::bigint/1024 as s "
+                       "from mailbox_counts c"
+                       " join mailboxes mb on (c.mailbox=mb.id)"
                        " where mb.owner=$1", this );
         q->bind( 1, imap()->user()->id() );
         q->execute();
@@ -3,8 +3,13 @@
 #include "search.h"
 
 #include "imapsession.h"
+#include "sessionindex.h"
 #include "imapparser.h"
+#include "searchcache.h"
 #include "annotation.h"
+#include "permissions.h"
+#include "transaction.h"
+#include "eventmap.h"
 #include "integerset.h"
 #include "listext.h"
 #include "mailbox.h"
@@ -12,7 +17,9 @@
 #include "codec.h"
 #include "query.h"
 #include "date.h"
+#include "dict.h"
 #include "imap.h"
+#include "user.h"
 #include "list.h"
 #include "log.h"
 #include "utf.h"
@@ -31,16 +38,22 @@ class SearchData
 {
 public:
     SearchData()
-        : uid( false ), done( false ), codec( 0 ), root( 0 ),
-          query( 0 ), highestmodseq( 1 ),
+        : uid( false ), done( false ), indexing( false ),
+          codec( 0 ), root( 0 ),
+          query( 0 ), changes( 0 ), incremental( false ), cacheModSeq( 0 ),
+          highestmodseq( 1 ),
           firstmodseq( 1 ), lastmodseq( 1 ),
           returnModseq( false ),
           returnAll( false ), returnCount( false ),
-          returnMax( false ), returnMin( false )
+          returnMax( false ), returnMin( false ), returnSave( false ),
+          aggregate( false ), count( 0 ),
+          multi( false ), selected( false ), resolved( false ),
+          sources( 0 )
     {}
 
     bool uid;
     bool done;
+    bool indexing;
 
     EString charset;
     Codec * codec;
@@ -48,7 +61,13 @@ public:
     Selector * root;
 
     Query * query;
+    Query * changes;
     IntegerSet matches;
+
+    EString cacheKey;
+    bool incremental;
+    IntegerSet base;
+    int64 cacheModSeq;
     int64 highestmodseq;
     int64 firstmodseq;
     int64 lastmodseq;
@@ -58,35 +77,95 @@ public:
     bool returnCount;
     bool returnMax;
     bool returnMin;
+    bool returnSave;
+
+    bool aggregate;
+    uint count;
+
+    // RFC 5182 says to save only MIN and MAX if those are all that's
+    // returned, and otherwise everything
+    IntegerSet saved( const IntegerSet & m ) const {
+        if ( returnAll || returnCount || !( returnMin || returnMax ) ||
+             m.isEmpty() )
+            return m;
+        IntegerSet r;
+        if ( returnMin )
+            r.add( m.smallest() );
+        if ( returnMax )
+            r.add( m.largest() );
+        return r;
+    }
+    bool onlySave() const {
+        return returnSave &&
+            !returnAll && !returnCount && !returnMin && !returnMax;
+    }
+
+    bool multi;
+    bool selected;
+    bool resolved;
+    EventMap * sources;
+    List<Permissions> permissions;
+
+    class MailboxResult
+        : public Garbage
+    {
+    public:
+        MailboxResult()
+            : id( 0 ), highestmodseq( 0 ), firstmodseq( 0 ), lastmodseq( 0 )
+        {}
+        uint id;
+        IntegerSet uids;
+        int64 highestmodseq;
+        int64 firstmodseq;
+        int64 lastmodseq;
+    };
+    List<MailboxResult> results;
+
+    class CacheItem
+        : public SearchCache::Item
+    {
+    public:
+        CacheItem(): SearchCache::Item() {}
+        IntegerSet matches;
+    };
 };
 
 
+static SearchCache * cache = 0;
+
+
 /*! \class Search search.h
     Finds messages matching some criteria (RFC 3501 section 6.4.4)
 
     The entirety of the basic syntax is handled, as well as ESEARCH
     (RFC 4731 and RFC 4466), of CONDSTORE (RFC 4551), ANNOTATE (RFC
-    5257) and WITHIN (RFC 5032).
+    5257), WITHIN (RFC 5032), SEARCHRES (RFC 5182) and MULTISEARCH
+    (RFC 7377).
 
     Searches are first run against the RAM cache, rudimentarily. If
     the comparison is difficult, expensive or unsuccessful, it gives
     up and uses the database.
 
-    If ESEARCH with only MIN, only MAX or only COUNT is used, we could
-    generate better SQL than we do. Let's do that optimisation when a
-    client benefits from it.
+    If ESEARCH asks for only some of MIN, MAX and COUNT, the database
+    computes those aggregates, so that the matching UIDs needn't be
+    sent to us. A MULTISEARCH uses one query for all the mailboxes,
+    restricted by MailboxTree selectors.
 */
 
 
 /*! Constructs an empty Search. If \a u is true, it's a UID SEARCH,
-    otherwise it's the MSN variety.
+    otherwise it's the MSN variety. If \a multi is true, it's the
+    ESEARCH command from RFC 7377, which always uses UIDs.
 */
 
-Search::Search( bool u )
+Search::Search( bool u, bool multi )
     : d( new SearchData )
 {
-    d->uid = u;
-    if ( u )
+    d->uid = u || multi;
+    d->multi = multi;
+    if ( multi )
+        ; // may search other mailboxes, and doesn't use MSNs
+    else if ( u )
         setGroup( 1 );
     else
         setGroup( 2 );
@@ -98,6 +177,21 @@ Search::Search( bool u )
 void Search::parse()
 {
     space();
+    if ( d->multi && present( "in (" ) ) {
+        // esearch-source-opts from RFC 7377
+        parseSource();
+        while ( ok() && present( " " ) ) {
+            if ( nextChar() == '(' )
+                error( Bad, "No scope options are supported" );
+            else
+                parseSource();
+        }
+        require( ")" );
+        space();
+    }
+    else if ( d->multi ) {
+        d->selected = true;
+    }
     if ( present( "return" ) ) {
         // RFC 4731 and RFC 4466 define ESEARCH together.
         space();
@@ -115,6 +209,8 @@ void Search::parse()
                 d->returnMax = true;
             else if ( modifier == "count" )
                 d->returnCount = true;
+            else if ( modifier == "save" )
+                d->returnSave = true;
             else
                 error( Bad, "Unknown search modifier option: " + modifier );
             if ( nextChar() != ')' )
@@ -125,6 +221,16 @@ void Search::parse()
             d->returnAll = true;
         space();
     }
+    else if ( d->multi ) {
+        d->returnAll = true;
+    }
+    if ( d->returnSave ) {
+        if ( d->sources )
+            error( Bad, "SAVE cannot be used when searching other "
+                   "mailboxes" );
+        // later commands may use $, so they must wait for this one
+        setGroup( 0 );
+    }
     if ( present ( "charset" ) ) {
         space();
         setCharset( astring() );
@@ -144,6 +250,66 @@ void Search::parse()
 }
 
 
+/*! Parses one filter-mailboxes item from RFC 5465 (or RFC 7377's
+    subtree-one) and records it in the list of mailboxes to search.
+*/
+
+void Search::parseSource()
+{
+    if ( present( "selected-delayed" ) || present( "selected" ) ) {
+        d->selected = true;
+        return;
+    }
+
+    if ( !d->sources )
+        d->sources = new EventMap;
+    EventFilterSpec * s = new EventFilterSpec;
+    bool one = false;
+    if ( present( "inboxes" ) ) {
+        s->setType( EventFilterSpec::Inboxes );
+    }
+    else if ( present( "personal" ) ) {
+        s->setType( EventFilterSpec::Personal );
+    }
+    else if ( present( "subscribed" ) ) {
+        s->setType( EventFilterSpec::Subscribed );
+    }
+    else if ( present( "subtree-one" ) ) {
+        s->setType( EventFilterSpec::Mailboxes );
+        one = true;
+    }
+    else if ( present( "subtree" ) ) {
+        s->setType( EventFilterSpec::Subtree );
+    }
+    else if ( present( "mailboxes" ) ) {
+        s->setType( EventFilterSpec::Mailboxes );
+    }
+    else {
+        error( Bad, "Expected SELECTED, INBOXES, etc." );
+        return;
+    }
+
+    if ( s->type() == EventFilterSpec::Subtree ||
+         s->type() == EventFilterSpec::Mailboxes ) {
+        space();
+        List<Mailbox> * l = new List<Mailbox>;
+        bool list = present( "(" );
+        do {
+            Mailbox * m = mailbox();
+            if ( m )
+                l->append( m );
+            // subtree-one covers the mailbox and its immediate children
+            if ( m && one && m->children() )
+                l->append( m->children() );
+        } while ( ok() && list && present( " " ) );
+        if ( list )
+            require( ")" );
+        s->setMailboxes( l );
+    }
+    d->sources->add( s );
+}
+
+
 /*! Parse one search key (IMAP search-key) and returns a pointer to
     the corresponding Selector. Leaves the cursor on the first
     character following the search-key.
@@ -163,8 +329,11 @@ Selector * Search::parseKey()
         }
         return s;
     }
-    else if ( c == '*' || ( c >= '0' && c <= '9' ) ) {
+    else if ( c == '*' || c == '$' || ( c >= '0' && c <= '9' ) ) {
         // it's a pure set
+        if ( d->sources )
+            error( Bad, "MSNs cannot be used when searching other "
+                   "mailboxes" );
         return new Selector( set( true ) );
     }
     else if ( present( "older" ) ) {
@@ -437,31 +606,71 @@ void Search::execute()
         }
     }
 
+    if ( d->multi ) {
+        executeMulti();
+        return;
+    }
+
     ImapSession * s = session();
 
     if ( !d->query ) {
+        // if this search fails, $ must be empty afterwards
+        if ( d->returnSave )
+            s->setSearchResult( IntegerSet() );
         considerCache();
         if ( d->done ) {
             sendResponse();
             finish();
             return;
         }
+        if ( d->indexing )
+            return;
+
+        considerResultCache();
+        if ( d->done ) {
+            sendResponse();
+            finish();
+            return;
+        }
 
-        d->query = d->root->query( imap()->user(), s->mailbox(),
-                                   s, this, false );
+        considerNarrowing();
+        if ( d->done ) {
+            sendResponse();
+            finish();
+            return;
+        }
+        if ( d->indexing )
+            return;
+
+        if ( !considerAggregate() )
+            d->query = d->root->query( imap()->user(), s->mailbox(),
+                                       s, this, false );
+        d->query->allowReplica( s->mailbox()->id(), s->nextModSeq() );
         d->query->execute();
     }
 
-    if ( !d->query->done() )
+    if ( !d->query->done() || ( d->changes && !d->changes->done() ) )
         return;
 
     if ( d->query->failed() ) {
         error( No, "Database error: " + d->query->error() );
         return;
     }
+    if ( d->changes && d->changes->failed() ) {
+        error( No, "Database error: " + d->changes->error() );
+        return;
+    }
 
     bool firstRow = true;
     Row * r;
+    if ( d->aggregate && (r=d->query->nextRow()) != 0 ) {
+        if ( d->returnCount )
+            d->count = r->getInt( "count" );
+        if ( d->returnMin && !r->isNull( "min" ) )
+            d->matches.add( r->getInt( "min" ) );
+        if ( d->returnMax && !r->isNull( "max" ) )
+            d->matches.add( r->getInt( "max" ) );
+    }
     while ( (r=d->query->nextRow()) != 0 ) {
         d->matches.add( r->getInt( "uid" ) );
         if ( d->returnModseq ) {
@@ -475,17 +684,307 @@ void Search::execute()
         }
     }
 
+    if ( d->incremental ) {
+        IntegerSet m = d->base;
+        while ( d->changes && (r=d->changes->nextRow()) != 0 )
+            m.remove( r->getInt( "uid" ) );
+        m.add( d->matches );
+        d->matches = m;
+    }
+    storeResult();
+
     sendResponse();
     finish();
 }
 
 
+/*! Looks for the result of an identical earlier search in the same
+    mailbox. If the mailbox hasn't changed since, this uses the cached
+    result and sets done. If it has changed, this rewrites the search
+    so it looks only at messages that have changed since, and execute()
+    merges that with the cached result.
+
+    Searches that depend on the time, on this session's \recent
+    flags or that need per-message modseqs are never cached.
+*/
+
+void Search::considerResultCache()
+{
+    if ( !d->cacheKey.isEmpty() )
+        return;
+    Session * s = imap()->session();
+    if ( !s || d->returnModseq ||
+         d->root->timeSensitive() || d->root->needSession() )
+        return;
+
+    d->cacheModSeq = s->nextModSeq();
+    d->cacheKey = SearchCache::key( s, imap()->user(), d->root->string() );
+
+    SearchData::CacheItem * i = 0;
+    if ( ::cache )
+        i = (SearchData::CacheItem *)::cache->find( d->cacheKey,
+                                                    d->cacheModSeq );
+    if ( !i )
+        return;
+
+    if ( i->modseq == d->cacheModSeq ) {
+        d->matches = i->matches.intersection( s->messages() );
+        d->done = true;
+        if ( Log::enabled( Log::Debug ) )
+            log( "Search matched " + fn( d->matches.count() ) +
+                 " messages using cached result", Log::Debug );
+        return;
+    }
+
+    // only messages with modseq >= i->modseq can match differently
+    // now, so search those and merge. if the search doesn't involve
+    // flags, annotations or the like, a message can only start
+    // matching by being added, so we needn't look for old messages
+    // that stopped matching.
+    bool dynamic = d->root->dynamic();
+    d->incremental = true;
+    d->base = i->matches.intersection( s->messages() );
+    d->root = SearchCache::changedSince( i, d->root );
+    if ( Log::enabled( Log::Debug ) )
+        log( "Searching messages changed since modseq " + fn( i->modseq ) +
+             " and merging with cached result", Log::Debug );
+
+    if ( !dynamic )
+        return;
+    d->changes = new Query( "select uid from mailbox_messages "
+                            "where mailbox=$1 and modseq>=$2", this );
+    d->changes->bind( 1, s->mailbox()->id() );
+    d->changes->bind( 2, i->modseq );
+    d->changes->allowReplica( s->mailbox()->id(), s->nextModSeq() );
+    d->changes->execute();
+}
+
+
+/*! Considers whether part of this search can be solved in RAM, so
+    that the database only needs to look at fewer messages. If the
+    cheap part of the search matches no messages, this sets done.
+
+    Like considerCache(), this may have to refresh the session's
+    SessionIndex first, in which case it returns without doing
+    anything else and execute() is called again later.
+*/
+
+void Search::considerNarrowing()
+{
+    d->indexing = false;
+    Session * s = imap()->session();
+    if ( !s || !s->initialised() || !d->root->canNarrow() )
+        return;
+
+    if ( d->root->narrowingUsesIndex() ) {
+        SessionIndex * i = s->index();
+        if ( !i->ready() )
+            i->refresh( this );
+        if ( i->failed() )
+            return;
+        if ( !i->ready() ) {
+            d->indexing = true;
+            return;
+        }
+    }
+
+    if ( !d->root->narrow( s ) )
+        return;
+    if ( Log::enabled( Log::Debug ) )
+        log( "Narrowed search of " + fn( s->count() ) +
+             " messages using session data", Log::Debug );
+    if ( d->root->action() == Selector::None )
+        d->done = true;
+}
+
+
+/*! Considers whether the database can compute the MIN, MAX and COUNT
+    result options itself, so that we needn't fetch every matching
+    UID only to compute those. If so, this creates the query and
+    returns true.
+
+    The aggregates only cover messages the session knows about, since
+    the response cannot refer to others. The result isn't cached,
+    since storeResult() needs every match.
+*/
+
+bool Search::considerAggregate()
+{
+    if ( d->returnAll || d->returnModseq || d->incremental ||
+         !( d->returnMin || d->returnMax || d->returnCount ) )
+        return false;
+    // SAVE together with COUNT saves every match
+    if ( d->returnSave && d->returnCount )
+        return false;
+
+    Session * s = imap()->session();
+    IntegerSet known;
+    if ( s->uidnext() > 1 )
+        known.add( 1, s->uidnext() - 1 );
+    Selector * a = new Selector( Selector::And );
+    a->add( new Selector( known ) );
+    a->add( d->root );
+
+    EStringList * wanted = new EStringList;
+    if ( d->returnMin )
+        wanted->append( "min(mm.uid) as min" );
+    if ( d->returnMax )
+        wanted->append( "max(mm.uid) as max" );
+    if ( d->returnCount )
+        wanted->append( "count(distinct mm.uid)::int as count" );
+    d->query = a->query( imap()->user(), s->mailbox(), s, this,
+                         false, wanted );
+    d->aggregate = true;
+    d->cacheKey.truncate();
+    if ( Log::enabled( Log::Debug ) )
+        log( "Search computes result options in the database",
+             Log::Debug );
+    return true;
+}
+
+
+/*! Executes the ESEARCH command from RFC 7377: Finds the mailboxes
+    to search, checks which of them the user may read, and searches
+    those using a single query.
+
+    Mailboxes the user cannot read are silently left out.
+*/
+
+void Search::executeMulti()
+{
+    User * u = imap()->user();
+    if ( d->sources && !transaction() ) {
+        setTransaction( new Transaction( this ) );
+        d->sources->refresh( transaction(), u );
+        transaction()->commit();
+    }
+    if ( transaction() && !transaction()->done() )
+        return;
+
+    if ( !d->resolved ) {
+        d->resolved = true;
+        if ( d->returnSave && imap()->state() == IMAP::Selected )
+            session()->setSearchResult( IntegerSet() );
+        IntegerSet ids;
+        if ( d->selected ) {
+            if ( imap()->state() != IMAP::Selected ) {
+                error( Bad, "No mailbox selected" );
+                return;
+            }
+            Session * s = imap()->session();
+            Permissions * p = s->permissions();
+            if ( !p )
+                p = new Permissions( s->mailbox(), u, this );
+            ids.add( s->mailbox()->id() );
+            d->permissions.append( p );
+        }
+        List<Mailbox> * l = 0;
+        if ( d->sources )
+            l = d->sources->mailboxes();
+        List<Mailbox>::Iterator i( l );
+        while ( i ) {
+            if ( i->id() && !ids.contains( i->id() ) ) {
+                ids.add( i->id() );
+                d->permissions.append( new Permissions( i, u, this ) );
+            }
+            ++i;
+        }
+    }
+
+    List<Permissions>::Iterator p( d->permissions );
+    while ( p && p->ready() )
+        ++p;
+    if ( p )
+        return;
+
+    if ( !d->query ) {
+        Selector * in = new Selector( Selector::Or );
+        List<Permissions>::Iterator i( d->permissions );
+        while ( i ) {
+            if ( i->allowed( Permissions::Read ) )
+                in->add( new Selector( i->mailbox(), false ) );
+            ++i;
+        }
+        if ( in->children()->isEmpty() ) {
+            finish();
+            return;
+        }
+
+        Selector * s = new Selector( Selector::And );
+        s->add( in );
+        s->add( d->root );
+        EStringList * wanted = new EStringList;
+        wanted->append( "mailbox" );
+        wanted->append( "uid" );
+        if ( d->returnModseq )
+            wanted->append( "modseq" );
+        d->query = s->query( u, 0, 0, this, true, wanted );
+        d->query->execute();
+    }
+
+    if ( !d->query->done() )
+        return;
+
+    if ( d->query->failed() ) {
+        error( No, "Database error: " + d->query->error() );
+        return;
+    }
+
+    SearchData::MailboxResult * mr = 0;
+    Row * r;
+    while ( (r=d->query->nextRow()) != 0 ) {
+        uint id = r->getInt( "mailbox" );
+        if ( !mr || mr->id != id ) {
+            mr = new SearchData::MailboxResult;
+            mr->id = id;
+            d->results.append( mr );
+        }
+        mr->uids.add( r->getInt( "uid" ) );
+        if ( d->returnModseq ) {
+            int64 ms = r->getBigint( "modseq" );
+            if ( !mr->firstmodseq )
+                mr->firstmodseq = ms;
+            mr->lastmodseq = ms;
+            if ( ms > mr->highestmodseq )
+                mr->highestmodseq = ms;
+        }
+    }
+
+    sendMultiResponses();
+    finish();
+}
+
+
+/*! Records the result of this search in the cache, so that
+    considerResultCache() can use it next time.
+*/
+
+void Search::storeResult()
+{
+    if ( d->cacheKey.isEmpty() )
+        return;
+
+    if ( !::cache )
+        ::cache = new SearchCache;
+    SearchData::CacheItem * i = new SearchData::CacheItem;
+    i->modseq = d->cacheModSeq;
+    i->matches = d->matches;
+    ::cache->store( d->cacheKey, i );
+}
+
+
 /*! Considers whether this search can and should be solved using this
     cache, and if so, finds all the matches.
+
+    If the search can be solved using the session's SessionIndex, but
+    the index isn't ready, this starts refreshing it and returns
+    without setting done; execute() is called again when the index is
+    ready.
 */
 
 void Search::considerCache()
 {
+    d->indexing = false;
     if ( d->returnModseq )
         return;
     Session * s = imap()->session();
@@ -496,19 +995,51 @@ void Search::considerCache()
     else if ( d->root->field() == Selector::Uid &&
               d->root->action() == Selector::Contains ) {
         d->matches = s->messages().intersection( d->root->messageSet() );
-        log( "UID-only search matched " +
-             fn( d->matches.count() ) + " messages",
-             Log::Debug );
+        if ( Log::enabled( Log::Debug ) )
+            log( "UID-only search matched " +
+                 fn( d->matches.count() ) + " messages",
+                 Log::Debug );
+    }
+    else if ( s->initialised() && d->root->usesIndex() ) {
+        SessionIndex * i = s->index();
+        if ( !i->ready() )
+            i->refresh( this );
+        if ( i->failed() ) {
+            needDb = true;
+        }
+        else if ( !i->ready() ) {
+            d->indexing = true;
+            return;
+        }
+        else {
+            d->matches = d->root->matches( s, s->messages() );
+            if ( Log::enabled( Log::Debug ) )
+                log( "Search matched " + fn( d->matches.count() ) + " of " +
+                     fn( s->count() ) + " messages using the session index",
+                     Log::Debug );
+        }
     }
     else {
-        uint max = s->count();
+        // a search such as "$ subject x" need only consider the
+        // messages in the saved result
+        IntegerSet candidates = s->messages();
+        if ( d->root->action() == Selector::And ) {
+            List<Selector>::Iterator i( d->root->children() );
+            while ( i ) {
+                if ( i->field() == Selector::Uid &&
+                     i->action() == Selector::Contains )
+                    candidates = candidates.intersection( i->messageSet() );
+                ++i;
+            }
+        }
+        uint max = candidates.count();
          // don't consider more than 300 messages - pg does it better
         if ( max > 300 )
             needDb = true;
         uint c = 0;
         while ( c < max && !needDb ) {
             c++;
-            uint uid = s->uid( c );
+            uint uid = candidates.value( c );
             switch ( d->root->match( s, uid ) ) {
             case Selector::Yes:
                 d->matches.add( uid );
@@ -516,16 +1047,18 @@ void Search::considerCache()
             case Selector::No:
                 break;
             case Selector::Punt:
-                log( "Search must go to database: message " + fn( uid ) +
-                     " could not be tested in RAM",
-                     Log::Debug );
+                if ( Log::enabled( Log::Debug ) )
+                    log( "Search must go to database: message " + fn( uid ) +
+                         " could not be tested in RAM",
+                         Log::Debug );
                 needDb = true;
                 d->matches.clear();
                 break;
             }
         }
-        log( "Search considered " + fn( c ) + " of " + fn( max ) +
-             " messages using cache", Log::Debug );
+        if ( Log::enabled( Log::Debug ) )
+            log( "Search considered " + fn( c ) + " of " + fn( max ) +
+                 " messages using cache", Log::Debug );
     }
     if ( !needDb )
         d->done = true;
@@ -683,6 +1216,11 @@ static uint max( uint a, uint b )
 
 void Search::sendResponse()
 {
+    if ( d->returnSave )
+        session()->setSearchResult( d->saved( d->matches ) );
+    if ( d->onlySave() )
+        return;
+
     int64 ms = d->highestmodseq;
     if ( !d->returnModseq )
         ms = 0; // means to send none
@@ -694,12 +1232,60 @@ void Search::sendResponse()
         ms = d->firstmodseq;
     else if ( d->returnMax )
         ms = d->lastmodseq;
-    waitFor( new ImapSearchResponse( session(), d->matches, ms, tag(),
-                                     d->uid,
-                                     d->returnMin,
-                                     d->returnMax,
-                                     d->returnCount,
-                                     d->returnAll ) );
+    ImapSearchResponse * r
+        = new ImapSearchResponse( session(), d->matches, ms, tag(),
+                                  d->uid,
+                                  d->returnMin,
+                                  d->returnMax,
+                                  d->returnCount,
+                                  d->returnAll );
+    if ( d->aggregate )
+        r->setCount( d->count );
+    waitFor( r );
+}
+
+
+/*! Sends one ESEARCH response for each mailbox with matches, as
+    RFC 7377 requires. UIDs are always used.
+*/
+
+void Search::sendMultiResponses()
+{
+    List<SearchData::MailboxResult>::Iterator i( d->results );
+    while ( i ) {
+        Mailbox * m = Mailbox::find( i->id );
+        // SAVE is only permitted when searching the selected mailbox
+        if ( d->returnSave && m )
+            session()->setSearchResult( d->saved( i->uids ) );
+        if ( m && !i->uids.isEmpty() && !d->onlySave() ) {
+            EString r = "ESEARCH (tag " + tag().quoted() +
+                        " mailbox " + imapQuoted( m ) +
+                        " uidvalidity " + fn( m->uidvalidity() ) +
+                        ") uid";
+            if ( d->returnCount )
+                r.append( " count " + fn( i->uids.count() ) );
+            if ( d->returnMin )
+                r.append( " min " + fn( i->uids.smallest() ) );
+            if ( d->returnMax )
+                r.append( " max " + fn( i->uids.largest() ) );
+            if ( d->returnAll )
+                r.append( " all " + i->uids.set() );
+            if ( d->returnModseq ) {
+                int64 ms = i->highestmodseq;
+                if ( d->returnAll || d->returnCount )
+                    ;
+                else if ( d->returnMin && d->returnMax )
+                    ms = max( i->firstmodseq, i->lastmodseq );
+                else if ( d->returnMin )
+                    ms = i->firstmodseq;
+                else if ( d->returnMax )
+                    ms = i->lastmodseq;
+                r.append( " modseq " + fn( ms ) );
+            }
+            respond( r );
+        }
+        ++i;
+    }
 }
 
 
@@ -729,12 +1315,23 @@ ImapSearchResponse::ImapSearchResponse( ImapSession * session,
                                         bool u,
                                         bool rmin, bool rmax,
                                         bool rcount, bool rall )
-    : ImapResponse( session ), r( set ), ms( modseq ), t( tag ),
+    : ImapResponse( session ), r( set ), n( -1 ), ms( modseq ), t( tag ),
       uid( u ), min( rmin ), max( rmax ), count( rcount ), all( rall )
 {
 }
 
 
+/*! Records that the search matched \a c messages. If this isn't
+    called, the number of messages in the result is used. Only needed
+    when the result doesn't contain all the matches.
+*/
+
+void ImapSearchResponse::setCount( uint c )
+{
+    n = c;
+}
+
+
 static void appendUid( EString & r, Session * s, bool u, uint uid )
 {
     if ( u ) {
@@ -763,7 +1360,10 @@ EString ImapSearchResponse::text() const
             result.append( " uid" );
         if ( count ) {
             result.append( " count " );
-            result.appendNumber( r.count() );
+            if ( n >= 0 )
+                result.appendNumber( n );
+            else
+                result.appendNumber( r.count() );
         }
         if ( r.isEmpty() )
             return result;
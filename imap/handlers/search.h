@@ -16,7 +16,7 @@ class Search
     : public Command
 {
 public:
-    Search( bool u );
+    Search( bool u, bool multi = false );
 
     void parse();
     void execute();
@@ -33,6 +33,14 @@ private:
     EString date();
 
     void considerCache();
+    void considerResultCache();
+    void storeResult();
+    void considerNarrowing();
+    bool considerAggregate();
+
+    void parseSource();
+    void executeMulti();
+    void sendMultiResponses();
 
     UString ustring( Command::QuoteMode stringType );
 
@@ -54,8 +62,11 @@ public:
                         bool, bool, bool, bool );
     EString text() const;
 
+    void setCount( uint );
+
 private:
     IntegerSet r;
+    int n;
     int64 ms;
     EString t;
     bool uid, min, max, count, all;
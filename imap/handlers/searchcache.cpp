@@ -0,0 +1,102 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "searchcache.h"
+
+#include "selector.h"
+#include "session.h"
+#include "mailbox.h"
+#include "user.h"
+
+
+/*! \class SearchCache searchcache.h
+
+    The SearchCache class keeps the results of recent SEARCH, SORT
+    and THREAD commands, so that an identical later command can reuse
+    them.
+
+    Each result is an Item (or rather an instance of a subclass
+    holding the command's result), stored under a key() naming the
+    mailbox, the user and the command's search keys, along with the
+    mailbox's modseq when the result was computed. If the modseq is
+    still the same, the result is still correct. If not, only
+    messages changedSince() the stored modseq can match differently,
+    so a command may search just those and merge.
+
+    Each command has its own SearchCache. At most 256 results are
+    kept in each, and the cache is emptied every few garbage
+    collections.
+*/
+
+
+/*! Constructs an empty SearchCache. */
+
+SearchCache::SearchCache()
+    : Cache( 10 ), n( 0 )
+{
+}
+
+
+/*! Returns the key for the result of a command that searches the
+    mailbox selected in \a s on behalf of \a u. \a what must describe
+    the rest of the command, e.g. its search keys, completely.
+*/
+
+EString SearchCache::key( Session * s, User * u, const EString & what )
+{
+    return fn( s->mailbox()->id() ) + "/" + fn( u->id() ) + " " + what;
+}
+
+
+/*! Returns the result stored under \a key, provided that it can be
+    used when the mailbox's modseq is \a modseq. Returns a null
+    pointer if there is no such result, or if it was computed later
+    than \a modseq, or so late that changedSince() can't express it.
+*/
+
+SearchCache::Item * SearchCache::find( const EString & key,
+                                       int64 modseq ) const
+{
+    Item * i = c.find( key );
+    if ( !i || i->modseq > modseq || i->modseq > UINT_MAX )
+        return 0;
+    return i;
+}
+
+
+/*! Stores \a item under \a key, unless a result computed later is
+    stored already. Empties the cache first if it's full.
+*/
+
+void SearchCache::store( const EString & key, Item * item )
+{
+    Item * i = c.find( key );
+    if ( i && i->modseq > item->modseq )
+        return;
+    if ( !i ) {
+        if ( n >= 256 )
+            clear();
+        n++;
+    }
+    c.insert( key, item );
+}
+
+
+/*! Returns a Selector that matches the messages matched by \a s and
+    changed since \a i was stored.
+*/
+
+Selector * SearchCache::changedSince( Item * i, Selector * s )
+{
+    Selector * r = new Selector( Selector::And );
+    r->add( new Selector( Selector::Modseq, Selector::Larger,
+                          (uint)i->modseq ) );
+    r->add( s );
+    return r;
+}
+
+
+void SearchCache::clear()
+{
+    c.clear();
+    n = 0;
+}
@@ -0,0 +1,44 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef SEARCHCACHE_H
+#define SEARCHCACHE_H
+
+#include "cache.h"
+#include "dict.h"
+
+
+class Session;
+class Selector;
+class User;
+
+
+class SearchCache
+    : public Cache
+{
+public:
+    SearchCache();
+
+    class Item
+        : public Garbage
+    {
+    public:
+        Item(): Garbage(), modseq( 0 ) {}
+        int64 modseq;
+    };
+
+    static EString key( Session *, User *, const EString & );
+
+    Item * find( const EString &, int64 ) const;
+    void store( const EString &, Item * );
+
+    static Selector * changedSince( Item *, Selector * );
+
+    void clear();
+
+private:
+    Dict<Item> c;
+    uint n;
+};
+
+
+#endif
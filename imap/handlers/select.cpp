@@ -16,6 +16,7 @@
 #include "permissions.h"
 #include "transaction.h"
 #include "mailboxgroup.h"
+#include "graph.h"
 
 
 class SelectData
@@ -24,17 +25,20 @@ class SelectData
 public:
     SelectData()
         : readOnly( false ), annotate( false ), condstore( false ),
-          needFirstUnseen( false ), unicode( false ), qresync( false ),
+          needFirstUnseen( false ), checkedFirstUnseen( false ),
+          unicode( false ), qresync( false ),
           firstUnseen( 0 ), allFlags( 0 ), updated( 0 ),
           mailbox( 0 ), session( 0 ), permissions( 0 ),
           cacheFirstUnseen( 0 ),
-          lastUidValidity( 0 ), lastModSeq( 0 ), firstFetch( 0 )
+          lastUidValidity( 0 ), lastModSeq( 0 ), firstFetch( 0 ),
+          journal( true ), journalRead( false )
     {}
 
     bool readOnly;
     bool annotate;
     bool condstore;
     bool needFirstUnseen;
+    bool checkedFirstUnseen;
     bool unicode;
     bool qresync;
     Query * firstUnseen;
@@ -48,6 +52,9 @@ public:
     uint lastModSeq;
     IntegerSet knownUids;
     Fetch * firstFetch;
+    bool journal;
+    bool journalRead;
+    IntegerSet changes;
 
     class FirstUnseenCache
         : public Cache
@@ -101,6 +108,10 @@ public:
 
 
 static SelectData::FirstUnseenCache * firstUnseenCache = 0;
+static GraphableCounter * journalHits = 0;
+static GraphableCounter * journalMisses = 0;
+static GraphableCounter * firstUnseenHits = 0;
+static GraphableCounter * firstUnseenMisses = 0;
 
 
 /*! \class Select select.h
@@ -248,15 +259,77 @@ void Select::execute()
     if ( !d->session->initialised() )
         return;
 
-    if ( d->session->isEmpty() )
+    if ( !::firstUnseenHits ) {
+        ::firstUnseenHits = new GraphableCounter( "first-unseen-cache-hits" );
+        ::firstUnseenMisses
+            = new GraphableCounter( "first-unseen-cache-misses" );
+    }
+
+    if ( d->checkedFirstUnseen ) {
+        // we've already decided
+    }
+    else if ( d->session->isEmpty() ) {
         d->needFirstUnseen = false;
+    }
     else if ( ::firstUnseenCache &&
-              ::firstUnseenCache->find( d->mailbox, d->session->nextModSeq() ) )
+              ::firstUnseenCache->find( d->mailbox,
+                                        d->session->nextModSeq() ) ) {
         d->needFirstUnseen = false;
-    else
+        ::firstUnseenHits->tick();
+    }
+    else {
         d->needFirstUnseen = true;
+        ::firstUnseenMisses->tick();
+    }
+
+    d->checkedFirstUnseen = true;
+
+    // this also lets the group count the SELECT as a hit
+    MailboxGroup * group = mailboxGroup();
 
     if ( d->lastModSeq < d->mailbox->nextModSeq() - 1 && !d->updated ) {
+        // the journal has one row per changed message, plus one with
+        // uid 0 if changes before some modseq have been forgotten
+        EString q = "select uid, modseq from mailbox_changes "
+                    "where mailbox=$1 and (modseq > $2 or uid=0)";
+        if ( !d->knownUids.isEmpty() )
+            q.append( " and (uid=0 or uid=any($3))" );
+        d->updated = new Query( q, this );
+        if ( !d->knownUids.isEmpty() )
+            d->updated->bind( 3, d->knownUids );
+        d->updated->bind( 1, d->mailbox->id() );
+        d->updated->bind( 2, d->lastModSeq );
+        transaction()->enqueue( d->updated );
+    }
+
+    if ( d->updated && d->journal && !d->journalRead &&
+         d->updated->done() ) {
+        d->journalRead = true;
+        if ( !::journalHits ) {
+            ::journalHits = new GraphableCounter( "qresync-journal-hits" );
+            ::journalMisses
+                = new GraphableCounter( "qresync-journal-misses" );
+        }
+        IntegerSet s;
+        Row * r;
+        while ( d->journal && (r=d->updated->nextRow()) != 0 ) {
+            uint uid = r->getInt( "uid" );
+            if ( uid )
+                s.add( uid );
+            else if ( r->getBigint( "modseq" ) > d->lastModSeq + 1 )
+                d->journal = false;
+        }
+        if ( d->journal ) {
+            d->changes = s;
+            ::journalHits->tick();
+        }
+        else {
+            ::journalMisses->tick();
+            d->updated = 0;
+        }
+    }
+
+    if ( !d->journal && !d->updated ) {
         if ( d->knownUids.isEmpty() ) {
             d->updated = new Query( "select uid from deleted_messages "
                                     "where mailbox=$1 and modseq > $2"
@@ -282,11 +355,28 @@ void Select::execute()
     }
 
     if ( d->needFirstUnseen && !d->firstUnseen ) {
+        // if the client seems to be selecting a group of mailboxes
+        // in turn, as synchronising clients do, we look up the first
+        // unseen message in the rest of the group too, so that their
+        // SELECTs need only the session's own queries.
+        IntegerSet mailboxes;
+        mailboxes.add( d->mailbox->id() );
+        if ( group ) {
+            List<Mailbox>::Iterator m( group->contents() );
+            while ( m ) {
+                if ( !m->deleted() &&
+                     !::firstUnseenCache->find( m, m->nextModSeq() ) )
+                    mailboxes.add( m->id() );
+                ++m;
+            }
+        }
         d->firstUnseen
-            = new Query( "select uid from mailbox_messages mm "
-                         "where mailbox=$1 and not seen "
-                         "order by uid limit 1", this );
-        d->firstUnseen->bind( 1, d->mailbox->id() );
+            = new Query( "select mb.id as mailbox, "
+                         "(select uid from mailbox_messages mm "
+                         "where mm.mailbox=mb.id and not mm.seen "
+                         "order by uid limit 1) as uid "
+                         "from mailboxes mb where mb.id=any($1)", this );
+        d->firstUnseen->bind( 1, mailboxes );
         transaction()->enqueue( d->firstUnseen );
     }
 
@@ -297,8 +387,8 @@ void Select::execute()
         return;
 
     if ( d->updated && !d->firstFetch ) {
-        IntegerSet s;
-        while ( d->updated->hasResults() ) {
+        IntegerSet s = d->changes;
+        while ( !d->journal && d->updated->hasResults() ) {
             Row * r = d->updated->nextRow();
             s.add( r->getInt( "uid" ) );
         }
@@ -332,10 +422,16 @@ void Select::execute()
     if ( d->firstUnseen ) {
         if ( !::firstUnseenCache )
             ::firstUnseenCache = new SelectData::FirstUnseenCache;
-        Row * r = d->firstUnseen->nextRow();
-        if ( r )
-            ::firstUnseenCache->insert( d->mailbox, d->session->nextModSeq(),
-                                        r->getInt( "uid" ) );
+        Row * r;
+        while ( (r=d->firstUnseen->nextRow()) != 0 ) {
+            Mailbox * m = Mailbox::find( r->getInt( "mailbox" ) );
+            if ( !m || r->isNull( "uid" ) )
+                continue;
+            int64 ms = m->nextModSeq();
+            if ( m == d->mailbox )
+                ms = d->session->nextModSeq();
+            ::firstUnseenCache->insert( m, ms, r->getInt( "uid" ) );
+        }
     }
 
     if ( ::firstUnseenCache ) {
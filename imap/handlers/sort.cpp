@@ -3,18 +3,28 @@
 #include "sort.h"
 
 #include "user.h"
+#include "searchcache.h"
 #include "field.h"
 #include "codec.h"
 #include "mailbox.h"
+#include "allocator.h"
 #include "imapparser.h"
 #include "imapsession.h"
 
+// memmove
+#include <string.h>
+
 
 class SortData
     : public Garbage
 {
 public:
-    SortData(): Garbage(), s( 0 ), q( 0 ), u( false ) {}
+    SortData()
+        : Garbage(), s( 0 ), q( 0 ), u( false ),
+          uids( 0 ), keys( 0 ), n( 0 ), base( 0 ), cacheModSeq( 0 ),
+          esort( false ), rMin( false ), rMax( false ),
+          rCount( false ), rAll( false ), pFrom( 0 ), pTo( 0 )
+    {}
 
     enum SortCriterionType {
         Arrival,
@@ -51,7 +61,36 @@ public:
     Query * q;
     bool u;
 
+    uint * uids;
+    uint * keys;
+    uint n;
+
+    class SortItem
+        : public SearchCache::Item
+    {
+    public:
+        SortItem(): SearchCache::Item(), uids( 0 ), keys( 0 ), n( 0 ) {}
+        uint * uids;
+        uint * keys;
+        uint n;
+    };
+
+    EString cacheKey;
+    SortItem * base;
+    int64 cacheModSeq;
+
+    bool esort;
+    bool rMin;
+    bool rMax;
+    bool rCount;
+    bool rAll;
+    uint pFrom;
+    uint pTo;
+
     bool usingCriterionType( SortCriterionType );
+    const char * keyColumn() const;
+    EString criteria() const;
+    void merge( const IntegerSet &, const IntegerSet & );
 
     void addCondition( EString &, class SortCriterion * );
     void addJoin( EString &, const EString &, const EString &, bool );
@@ -66,9 +105,25 @@ public:
     This class subclasses Search in order to take advantage of its
     parser, and operates quite nastily on the Query generated by
     Selector.
+
+    ESORT (RFC 5267 section 3) is supported, as is the PARTIAL return
+    option from section 4.4 of the same RFC, so that a client can ask
+    for just one page of a large sorted result.
+
+    Each result is cached per mailbox, user, sort criteria and search
+    keys, along with the modseq at the time. A later SORT returns the
+    cached ordering if nothing has changed since. If the order only
+    depends on one numeric criterion (ARRIVAL or SIZE, reversed or
+    not) and the search keys don't depend on flags, annotations or
+    the like, a later SORT fetches just the messages that have
+    changed and merges them into the cached ordering. Expunged
+    messages are simply dropped.
 */
 
 
+static SearchCache * cache = 0;
+
+
 
 /*! Constructs an empty Sort handler. If \a u is true, the SORT
     response will use UIDs, if it's false it will use MSNs.
@@ -83,8 +138,53 @@ Sort::Sort( bool u )
 
 void Sort::parse()
 {
-    // sort-criteria
     space();
+    if ( present( "return" ) ) {
+        // sort-return-opts from RFC 5267
+        space();
+        require( "(" );
+        d->esort = true;
+        bool any = false;
+        while ( ok() && nextChar() != ')' &&
+                nextChar() >= 'A' && nextChar() <= 'z' ) {
+            EString modifier = letters( 3, 7 ).lower();
+            any = true;
+            if ( modifier == "all" ) {
+                d->rAll = true;
+            }
+            else if ( modifier == "min" ) {
+                d->rMin = true;
+            }
+            else if ( modifier == "max" ) {
+                d->rMax = true;
+            }
+            else if ( modifier == "count" ) {
+                d->rCount = true;
+            }
+            else if ( modifier == "partial" ) {
+                space();
+                d->pFrom = nzNumber();
+                require( ":" );
+                d->pTo = nzNumber();
+                if ( d->pTo < d->pFrom ) {
+                    uint x = d->pTo;
+                    d->pTo = d->pFrom;
+                    d->pFrom = x;
+                }
+            }
+            else {
+                error( Bad, "Unknown sort modifier option: " + modifier );
+            }
+            if ( nextChar() != ')' )
+                space();
+        }
+        require( ")" );
+        if ( !any )
+            d->rAll = true;
+        space();
+    }
+
+    // sort-criteria
     require( "(" );
     bool x = true;
     while ( x ) {
@@ -181,16 +281,36 @@ void Sort::execute()
 
     if ( !d->q ) {
         d->s->simplify();
-        d->q = d->s->query( imap()->user(), session()->mailbox(),
-                            session(), this, true );
+        considerCache();
+        if ( !d->cacheKey.isEmpty() && d->base &&
+             d->base->modseq == d->cacheModSeq ) {
+            d->merge( session()->messages(), IntegerSet() );
+            if ( Log::enabled( Log::Debug ) )
+                log( "Sorted " + fn( d->n ) +
+                     " messages using cached result", Log::Debug );
+            sendResponse();
+            finish();
+            return;
+        }
+
+        Selector * s = d->s;
+        if ( d->base ) {
+            s = SearchCache::changedSince( d->base, d->s );
+            if ( Log::enabled( Log::Debug ) )
+                log( "Sorting messages changed since modseq " +
+                     fn( d->base->modseq ) +
+                     " and merging with cached result", Log::Debug );
+        }
+        d->q = s->query( imap()->user(), session()->mailbox(),
+                         session(), this, true );
         EString t = d->q->string();
         List<SortData::SortCriterion>::Iterator c( d->c );
         while ( c ) {
             if ( c->t == SortData::Annotation ) {
-                c->b1 = d->s->placeHolder();
+                c->b1 = s->placeHolder();
                 d->q->bind( c->b1, c->annotationEntry );
                 if ( c->priv ) {
-                    c->b2 = d->s->placeHolder();
+                    c->b2 = s->placeHolder();
                     d->q->bind( c->b2, imap()->user()->id() );
                 }
             }
@@ -204,18 +324,194 @@ void Sort::execute()
     if ( !d->q->done() )
         return;
 
-    List<uint> * result = new List<uint>;
+    uint rows = d->q->rows();
+    d->uids = (uint*)Allocator::alloc( rows * sizeof( uint ), 0 );
+    const char * k = d->keyColumn();
+    if ( k )
+        d->keys = (uint*)Allocator::alloc( rows * sizeof( uint ), 0 );
+    d->n = 0;
+    IntegerSet changed;
     Row * r;
-    while ( (r=d->q->nextRow()) != 0 ) {
-        uint * tmp = (uint *)Allocator::alloc( sizeof(uint), 0 );
-        *tmp = r->getInt( "uid" );
-        result->append( tmp );
+    while ( d->n < rows && (r=d->q->nextRow()) != 0 ) {
+        d->uids[d->n] = r->getInt( "uid" );
+        if ( k )
+            d->keys[d->n] = r->getInt( k );
+        changed.add( d->uids[d->n] );
+        d->n++;
     }
-    waitFor( new ImapSortResponse( session(), result, d->u ) );
+
+    if ( d->base )
+        d->merge( session()->messages(), changed );
+    storeResult();
+    sendResponse();
     finish();
 }
 
 
+/*! Looks for a cached result for this command, and decides whether
+    it can be used. Sets up cacheKey if this command's result can be
+    cached, and base if the cached result can be used, either as-is
+    or merged with the messages changed since it was stored.
+*/
+
+void Sort::considerCache()
+{
+    Session * s = session();
+    if ( !s || d->s->timeSensitive() || d->s->needSession() ||
+         d->c.isEmpty() )
+        return;
+
+    d->cacheModSeq = s->nextModSeq();
+    d->cacheKey = SearchCache::key( s, imap()->user(),
+                                    d->criteria() + " " + d->s->string() );
+
+    SortData::SortItem * i = 0;
+    if ( ::cache )
+        i = (SortData::SortItem *)::cache->find( d->cacheKey,
+                                                 d->cacheModSeq );
+    if ( !i )
+        return;
+
+    // an ordering can be reused if nothing has changed. a numeric
+    // one can be merged with the changes if changes can't make a
+    // message stop matching.
+    if ( i->modseq == d->cacheModSeq ||
+         ( i->keys && !d->s->dynamic() ) )
+        d->base = i;
+}
+
+
+/*! Records the result of this command in the cache, so that
+    considerCache() can use it next time.
+*/
+
+void Sort::storeResult()
+{
+    if ( d->cacheKey.isEmpty() )
+        return;
+
+    if ( !::cache )
+        ::cache = new SearchCache;
+    SortData::SortItem * i = new SortData::SortItem;
+    i->modseq = d->cacheModSeq;
+    i->uids = d->uids;
+    i->keys = d->keys;
+    i->n = d->n;
+    ::cache->store( d->cacheKey, i );
+}
+
+
+/*! Sends the SORT or ESEARCH response, as appropriate. */
+
+void Sort::sendResponse()
+{
+    ImapSortResponse * r
+        = new ImapSortResponse( session(), d->uids, d->n, d->u );
+    if ( d->esort )
+        r->setReturn( tag(), d->rMin, d->rMax, d->rCount, d->rAll,
+                      d->pFrom, d->pTo );
+    waitFor( r );
+}
+
+
+/*! Replaces uids and keys with the cached ordering in base, leaving
+    out messages that aren't in \a live. If uids already contains
+    some rows, they're the rows for the messages in \a changed, and
+    are merged into the cached ordering, which is used for any other
+    message.
+*/
+
+void SortData::merge( const IntegerSet & live, const IntegerSet & changed )
+{
+    bool reverse = c.firstElement()->reverse;
+    uint * nu = (uint*)Allocator::alloc( ( base->n + n ) * sizeof( uint ),
+                                         0 );
+    uint * nk = 0;
+    if ( base->keys )
+        nk = (uint*)Allocator::alloc( ( base->n + n ) * sizeof( uint ),
+                                      0 );
+    uint i = 0;
+    uint j = 0;
+    uint m = 0;
+    while ( i < base->n || j < n ) {
+        if ( i < base->n &&
+             ( !live.contains( base->uids[i] ) ||
+               changed.contains( base->uids[i] ) ) ) {
+            i++;
+        }
+        else {
+            bool old = false;
+            if ( j >= n )
+                old = true;
+            else if ( i >= base->n )
+                old = false;
+            else if ( base->keys[i] != keys[j] )
+                old = ( base->keys[i] < keys[j] ) != reverse;
+            else
+                old = base->uids[i] < uids[j];
+            if ( old ) {
+                nu[m] = base->uids[i];
+                if ( nk )
+                    nk[m] = base->keys[i];
+                i++;
+            }
+            else {
+                nu[m] = uids[j];
+                if ( nk )
+                    nk[m] = keys[j];
+                j++;
+            }
+            m++;
+        }
+    }
+    uids = nu;
+    keys = nk;
+    n = m;
+}
+
+
+/*! Returns the name of the column that contains the single numeric
+    sort key, or a null pointer if the sort order depends on more
+    than one thing, or on something other than a number.
+*/
+
+const char * SortData::keyColumn() const
+{
+    if ( c.count() != 1 )
+        return 0;
+    if ( c.firstElement()->t == Arrival )
+        return "idate";
+    if ( c.firstElement()->t == Size )
+        return "rfc822size";
+    return 0;
+}
+
+
+/*! Returns a string describing the sort criteria, suitable for use
+    in cache keys.
+*/
+
+EString SortData::criteria() const
+{
+    EString r;
+    List<SortCriterion>::Iterator i( c );
+    while ( i ) {
+        if ( !r.isEmpty() )
+            r.append( " " );
+        if ( i->reverse )
+            r.append( "reverse " );
+        r.appendNumber( (int)i->t );
+        if ( i->t == Annotation ) {
+            r.append( " " );
+            r.append( i->annotationEntry.quoted() );
+            r.append( i->priv ? " p" : " s" );
+        }
+        ++i;
+    }
+    return "(" + r + ")";
+}
+
+
 void SortData::addCondition( EString & t, class SortData::SortCriterion * c )
 {
     switch ( c->t ) {
@@ -282,11 +578,14 @@ void SortData::addCondition( EString & t, class SortData::SortCriterion * c )
                  c->reverse );
         break;
     case Subject:
+        // base_subject is null only for messages injected before
+        // schema revision 107 and not yet updated
         addJoin( t,
+                 "join messages msbj on (msbj.id=mm.message) "
                  "left join header_fields sshf on "
                  "(mm.message=sshf.message and sshf.field=" +
                  fn( HeaderField::Subject ) + ") ",
-                 "sshf.value",
+                 "coalesce(msbj.base_subject,sshf.value)",
                  c->reverse );
         break;
     case To:
@@ -373,38 +672,140 @@ bool SortData::usingCriterionType( SortCriterionType t )
 /*! \class ImapSortResponse sort.h
 
     The ImapSortResponse models the SORT response, and has to make
-    sure old MSNs aren't accidentally included.
+    sure old MSNs aren't accidentally included. If setReturn() is
+    called, it sends the ESEARCH response described in RFC 5267
+    instead.
 */
 
 
 
-/*! Constructs a SORT response which will return \a result within \a
-    session, using UIDs if \a uid is true and MSNs if \a uid is false.
+/*! Constructs a SORT response which will return the first \a results
+    UIDs in \a result within \a session, using UIDs if \a uid is true
+    and MSNs if \a uid is false.
 */
 
 ImapSortResponse::ImapSortResponse( ImapSession * session,
-                                    List<uint> * result, bool uid )
-    : ImapResponse( session ),r( result ), u( uid )
+                                    const uint * result, uint results,
+                                    bool uid )
+    : ImapResponse( session ), r( result ), n( results ), u( uid ),
+      esort( false ), min( false ), max( false ),
+      count( false ), all( false ), from( 0 ), to( 0 )
 {
 }
 
 
+/*! Instructs this response to send an ESEARCH response tagged with \a
+    tag. \a rmin, \a rmax, \a rcount and \a rall correspond to the
+    MIN, MAX, COUNT and ALL return options, which refer to the sort
+    order rather than to numeric order. If \a pfrom is nonzero, the
+    response includes the messages from position \a pfrom to \a pto in
+    the sorted result (counting from 1), as specified for PARTIAL in
+    RFC 5267 section 4.4.
+*/
+
+void ImapSortResponse::setReturn( const EString & tag,
+                                  bool rmin, bool rmax,
+                                  bool rcount, bool rall,
+                                  uint pfrom, uint pto )
+{
+    esort = true;
+    t = tag;
+    min = rmin;
+    max = rmax;
+    count = rcount;
+    all = rall;
+    from = pfrom;
+    to = pto;
+}
+
+
+/*! Returns \a v[\a b] to \a v[\a e-1] as a sequence set, in the
+    same order. Only ascending runs are written as ranges.
+*/
+
+static EString orderedSet( const uint * v, uint b, uint e )
+{
+    EString r;
+    uint i = b;
+    while ( i < e ) {
+        uint j = i;
+        while ( j + 1 < e && v[j+1] == v[j] + 1 )
+            j++;
+        if ( !r.isEmpty() )
+            r.append( "," );
+        r.appendNumber( v[i] );
+        if ( j > i ) {
+            r.append( ":" );
+            r.appendNumber( v[j] );
+        }
+        i = j + 1;
+    }
+    return r;
+}
+
+
 EString ImapSortResponse::text() const
 {
     Session * s = session();
-    EString result;
-    result.reserve( r->count() * 10 );
-    result.append( "SORT" );
-    List<uint>::Iterator i( r );
-    while ( i ) {
-        uint x = *i;
-        ++i;
+    uint * v = (uint*)Allocator::alloc( ( n + 1 ) * sizeof( uint ), 0 );
+    uint m = 0;
+    uint i = 0;
+    while ( i < n ) {
+        uint x = r[i];
+        i++;
         if ( !u )
             x = s->msn( x );
-        if ( x ) {
+        if ( x )
+            v[m++] = x;
+    }
+
+    EString result;
+    result.reserve( m * 10 );
+    if ( !esort ) {
+        result.append( "SORT" );
+        i = 0;
+        while ( i < m ) {
             result.append( " " );
-            result.appendNumber( x );
+            result.appendNumber( v[i] );
+            i++;
         }
+        return result;
+    }
+
+    result.append( "ESEARCH (tag " );
+    result.append( t.quoted() );
+    result.append( ")" );
+    if ( u )
+        result.append( " uid" );
+    if ( count ) {
+        result.append( " count " );
+        result.appendNumber( m );
+    }
+    if ( m && min ) {
+        result.append( " min " );
+        result.appendNumber( v[0] );
+    }
+    if ( m && max ) {
+        result.append( " max " );
+        result.appendNumber( v[m-1] );
+    }
+    if ( m && all ) {
+        result.append( " all " );
+        result.append( orderedSet( v, 0, m ) );
+    }
+    if ( from ) {
+        result.append( " partial (" );
+        result.appendNumber( from );
+        result.append( ":" );
+        result.appendNumber( to );
+        result.append( " " );
+        if ( from > m )
+            result.append( "nil" );
+        else if ( to > m )
+            result.append( orderedSet( v, from - 1, m ) );
+        else
+            result.append( orderedSet( v, from - 1, to ) );
+        result.append( ")" );
     }
     return result;
 }
@@ -17,6 +17,10 @@ public:
 
 private:
     class SortData * d;
+
+    void considerCache();
+    void storeResult();
+    void sendResponse();
 };
 
 
@@ -24,12 +28,20 @@ class ImapSortResponse
     : public ImapResponse
 {
 public:
-    ImapSortResponse( ImapSession *, List<uint> *, bool );
+    ImapSortResponse( ImapSession *, const uint *, uint, bool );
+
+    void setReturn( const EString &, bool, bool, bool, bool, uint, uint );
+
     EString text() const;
 
 private:
-    List<uint> * r;
+    const uint * r;
+    uint n;
     bool u;
+    bool esort;
+    bool min, max, count, all;
+    uint from, to;
+    EString t;
 };
 
 
@@ -18,34 +18,30 @@ class StatusData
 public:
     StatusData() :
         messages( false ), uidnext( false ), uidvalidity( false ),
-        recent( false ), unseen( false ),
-        modseq( false ),
+        recent( false ), unseen( false ), size( false ),
+        modseq( false ), counted( false ),
         mailbox( 0 ),
-        unseenCount( 0 ), messageCount( 0 ), recentCount( 0 ),
-        cacheState( 0 )
+        counts( 0 )
         {}
-    bool messages, uidnext, uidvalidity, recent, unseen, modseq;
+    bool messages, uidnext, uidvalidity, recent, unseen, size, modseq;
+    bool counted;
     Mailbox * mailbox;
-    Query * unseenCount;
-    Query * messageCount;
-    Query * recentCount;
-    uint cacheState;
+    Query * counts;
 
     class CacheItem
         : public Garbage
     {
     public:
         CacheItem():
-            hasMessages( false ), hasUnseen( false ), hasRecent( false ),
-            messages( 0 ), unseen( 0 ), recent( 0 ),
+            known( false ),
+            messages( 0 ), unseen( 0 ), recent( 0 ), bytes( 0 ),
             nextmodseq( 0 ), mailbox( 0 )
             {}
-        bool hasMessages;
-        bool hasUnseen;
-        bool hasRecent;
+        bool known;
         uint messages;
         uint unseen;
         uint recent;
+        int64 bytes;
         int64 nextmodseq;
         Mailbox * mailbox;
     };
@@ -70,9 +66,7 @@ public:
             }
             if ( i->nextmodseq < m->nextModSeq() ) {
                 i->nextmodseq = m->nextModSeq();
-                i->hasMessages = false;
-                i->hasUnseen = false;
-                i->hasRecent = false;
+                i->known = false;
             }
             return i;
         }
@@ -90,6 +84,12 @@ static StatusData::StatusCache * cache = 0;
 
 /*! \class Status status.h
     Returns the status of the specified mailbox (RFC 3501 section 6.3.10)
+
+    The MESSAGES, UNSEEN and SIZE (RFC 8438) numbers come from the
+    mailbox_counts table, which a database trigger keeps up to date,
+    so STATUS never has to count messages. When several STATUS
+    commands are pipelined (as clients do after LIST), the first one
+    fetches the numbers for all of them using a single query.
 */
 
 Status::Status()
@@ -152,6 +152,8 @@ void Status::parse()
             d->uidvalidity = true;
         else if ( item == "unseen" )
             d->unseen = true;
+        else if ( item == "size" )
+            d->size = true;
         else if ( item == "highestmodseq" )
             d->modseq = true;
         else
@@ -187,196 +189,74 @@ void Status::execute()
     if ( session )
         current = session->mailbox();
 
-    // second part. see if anything has happened, and feed the cache if
-    // so. make sure we feed the cache at once.
-    if ( d->unseenCount || d->recentCount || d->messageCount ) {
-        if ( d->unseenCount && !d->unseenCount->done() )
-            return;
-        if ( d->messageCount && !d->messageCount->done() )
-            return;
-        if ( d->recentCount && !d->recentCount->done() )
-            return;
-    }
     if ( !::cache )
         ::cache = new StatusData::StatusCache;
 
-    if ( d->unseenCount ) {
-        while ( d->unseenCount->hasResults() ) {
-            Row * r = d->unseenCount->nextRow();
+    // second part. if we've asked for the numbers, feed the cache.
+    if ( d->counts ) {
+        if ( !d->counts->done() )
+            return;
+        Row * r;
+        while ( (r=d->counts->nextRow()) != 0 ) {
             StatusData::CacheItem * ci =
                 ::cache->find( r->getInt( "mailbox" ) );
             if ( ci ) {
-                ci->hasUnseen = true;
+                ci->known = true;
+                ci->messages = r->getInt( "messages" );
                 ci->unseen = r->getInt( "unseen" );
-            }
-        }
-    }
-    if ( d->recentCount ) {
-        while ( d->recentCount->hasResults() ) {
-            Row * r = d->recentCount->nextRow();
-            StatusData::CacheItem * ci =
-                ::cache->find( r->getInt( "mailbox" ) );
-            if ( ci ) {
-                ci->hasRecent = true;
                 ci->recent = r->getInt( "recent" );
+                ci->bytes = r->getBigint( "bytes" );
             }
         }
-    }
-    if ( d->messageCount ) {
-        while ( d->messageCount->hasResults() ) {
-            Row * r = d->messageCount->nextRow();
-            StatusData::CacheItem * ci =
-                ::cache->find( r->getInt( "mailbox" ) );
-            if ( ci ) {
-                ci->hasMessages = true;
-                ci->messages = r->getInt( "messages" );
-            }
-        }
-    }
-
-    // third part. are we processing the first command in a STATUS
-    // loop? if so, see if we ought to preload the cache.
-    if ( mailboxGroup() && d->cacheState < 3 ) {
-        IntegerSet mailboxes;
-        if ( d->cacheState < 1 ) {
-            // cache state 0: decide which messages
-            List<Mailbox>::Iterator i( mailboxGroup()->contents() );
-            while ( i ) {
-                StatusData::CacheItem * ci = ::cache->provide( i );
-                bool need = false;
-                if ( d->unseen || d->recent || d->messages )
-                    need = true;
-                if ( ci->hasUnseen || ci->hasRecent || ci->hasMessages )
-                    need = false;
-                if ( need )
-                    mailboxes.add( i->id() );
-                ++i;
-            }
-            if ( mailboxes.count() < 3 )
-                d->cacheState = 3;
-        }
-        if ( d->cacheState == 1 ) {
-            // state 1: send queries
-            if ( d->unseen ) {
-                d->unseenCount
-                    = new Query( "select mailbox, count(uid)::int as unseen "
-                                 "from mailbox_messages "
-                                 "where mailbox=any($1) and not seen "
-                                 "group by mailbox", this );
-                d->unseenCount->bind( 1, mailboxes );
-                d->unseenCount->execute();
-            }
-            if ( d->recent ) {
-                d->recentCount
-                    = new Query( "select id as mailbox, "
-                                 "uidnext-first_recent as recent "
-                                 "from mailboxes where id=any($1)", this );
-                d->recentCount->bind( 1, mailboxes );
-                d->recentCount->execute();
-            }
-            if ( d->messages ) {
-                d->messageCount
-                    = new Query( "select count(*)::int as messages, mailbox "
-                                 "from mailbox_messages where mailbox=any($1) "
-                                 "group by mailbox", this );
-                d->messageCount->bind( 1, mailboxes );
-                d->messageCount->execute();
-            }
-            d->cacheState = 2;
-        }
-        if ( d->cacheState == 2 ) {
-            // state 2: mark the cache as complete.
-            IntegerSet mailboxes;
-            List<Mailbox>::Iterator i( mailboxGroup()->contents() );
-            while ( i ) {
-                StatusData::CacheItem * ci = ::cache->find( i->id() );
-                if ( ci && d->unseenCount )
-                    ci->hasUnseen = true;
-                if ( ci && d->recentCount )
-                    ci->hasRecent = true;
-                if ( ci && d->messageCount )
-                    ci->hasMessages = true;
-                ++i;
-            }
-            // and drop the queries
-            d->cacheState = 3;
-            d->unseenCount = 0;
-            d->recentCount = 0;
-            d->messageCount = 0;
-        }
+        d->counts = 0;
+        d->counted = true;
     }
 
     // the cache item we'll actually read from
     StatusData::CacheItem * i = ::cache->provide( d->mailbox );
 
-    // fourth part: send individual queries if there's anything we need
-    if ( d->unseen && !d->unseenCount && !i->hasUnseen ) {
-        d->unseenCount
-            = new Query( "select $1::int as mailbox, "
-                         "count(uid)::int as unseen "
-                         "from mailbox_messages "
-                         "where mailbox=$1 and not seen", this );
-        d->unseenCount->bind( 1, d->mailbox->id() );
-        d->unseenCount->execute();
-    }
-
-    if ( !d->recent ) {
-        // nothing doing
-    }
-    else if ( d->mailbox == current ) {
-        // we'll pick it up from the session
-    }
-    else if ( i->hasRecent ) {
-        // the cache has it
-    }
-    else if ( !d->recentCount ) {
-        d->recentCount
-            = new Query( "select id as mailbox, "
-                         "uidnext-first_recent as recent "
-                         "from mailboxes where id=$1", this );
-        d->recentCount->bind( 1, d->mailbox->id() );
-        d->recentCount->execute();
-    }
-
-    if ( !d->messages ) {
-        // we don't need to collect
-    }
-    else if ( d->mailbox == current ) {
-        // we'll pick it up
-    }
-    else if ( i->hasMessages ) {
-        // the cache has it
-    }
-    else if ( d->messages && !d->messageCount ) {
-        d->messageCount
-            = new Query( "select count(*)::int as messages, "
-                         "$1::int as mailbox "
-                         "from mailbox_messages where mailbox=$1", this );
-        d->messageCount->bind( 1, d->mailbox->id() );
-        d->messageCount->execute();
-    }
-
-    if ( d->unseenCount || d->recentCount || d->messageCount ) {
-        if ( d->unseenCount && !d->unseenCount->done() )
-            return;
-        if ( d->messageCount && !d->messageCount->done() )
-            return;
-        if ( d->recentCount && !d->recentCount->done() )
-            return;
+    // third part. ask for the numbers if we need them. if this is the
+    // first command in a STATUS loop, ask for those the rest of the
+    // loop will need, too.
+    if ( ( d->messages || d->unseen || d->recent || d->size ) &&
+         !i->known && !d->counted ) {
+        IntegerSet mailboxes;
+        mailboxes.add( d->mailbox->id() );
+        if ( mailboxGroup() ) {
+            List<Mailbox>::Iterator m( mailboxGroup()->contents() );
+            while ( m ) {
+                StatusData::CacheItem * ci = ::cache->provide( m );
+                if ( !ci->known )
+                    mailboxes.add( m->id() );
+                ++m;
+            }
+        }
+        d->counts = new Query( "select m.id as mailbox, "
+                               "coalesce(c.messages,0) as messages, "
+                               "coalesce(c.unseen,0) as unseen, "
+                               "coalesce(c.bytes,0)::bigint as bytes, "
+                               "m.uidnext-m.first_recent as recent "
+                               "from mailboxes m "
+                               "left join mailbox_counts c "
+                               "on (m.id=c.mailbox) "
+                               "where m.id=any($1)", this );
+        d->counts->bind( 1, mailboxes );
+        d->counts->execute();
+        return;
     }
 
-    // fifth part: return the payload.
+    // fourth part: return the payload.
     EStringList status;
 
-    if ( d->messages && i->hasMessages )
-        status.append( "MESSAGES " + fn( i->messages ) );
-    else if ( d->messages && d->mailbox == current )
+    if ( d->messages && d->mailbox == current )
         status.append( "MESSAGES " + fn( session->messages().count() ) );
+    else if ( d->messages && i->known )
+        status.append( "MESSAGES " + fn( i->messages ) );
 
-    if ( d->recent && i->hasRecent )
-        status.append( "RECENT " + fn( i->recent ) );
-    else if ( d->recent && d->mailbox == current )
+    if ( d->recent && d->mailbox == current )
         status.append( "RECENT " + fn( session->recent().count() ) );
+    else if ( d->recent && i->known )
+        status.append( "RECENT " + fn( i->recent ) );
 
     if ( d->uidnext )
         status.append( "UIDNEXT " + fn( d->mailbox->uidnext() ) );
@@ -384,9 +264,12 @@ void Status::execute()
     if ( d->uidvalidity )
         status.append( "UIDVALIDITY " + fn( d->mailbox->uidvalidity() ) );
 
-    if ( d->unseen && i->hasUnseen )
+    if ( d->unseen && i->known )
         status.append( "UNSEEN " + fn( i->unseen ) );
 
+    if ( d->size && i->known )
+        status.append( "SIZE " + fn( i->bytes ) );
+
     if ( d->modseq ) {
         int64 hms = d->mailbox->nextModSeq();
         // don't like this. an empty mailbox will have a STATUS HMS of
@@ -11,18 +11,75 @@
 #include "integerset.h"
 #include "selector.h"
 #include "mailbox.h"
+#include "mailboxchange.h"
 #include "message.h"
 #include "fetcher.h"
 #include "estring.h"
 #include "query.h"
 #include "scope.h"
 #include "flag.h"
+#include "dict.h"
 #include "list.h"
 #include "imap.h"
 #include "user.h"
 #include "map.h"
 
 
+// a set of UIDs with at most this many ranges is sent to the database
+// as range conditions rather than as an array
+static const uint MaxRanges = 16;
+
+
+// returns an SQL condition restricting \a column to the numbers in
+// \a s. If \a s consists of a few ranges, the condition compares
+// \a column to those (which the database can answer with an index
+// range scan, and which needn't send a huge array), otherwise \a s
+// is bound to \a q as parameter \a n, and \a n is incremented.
+static EString uidCondition( const IntegerSet & s, const EString & column,
+                             Query * q, uint & n )
+{
+    uint first[MaxRanges];
+    uint last[MaxRanges];
+    uint r = s.ranges( first, last, MaxRanges );
+    EString c;
+    if ( !r ) {
+        c = "false";
+    }
+    else if ( r > MaxRanges ) {
+        q->bind( n, s );
+        c.append( column );
+        c.append( "=any($" );
+        c.appendNumber( n );
+        c.append( ")" );
+        n++;
+    }
+    else {
+        if ( r > 1 )
+            c.append( "(" );
+        uint i = 0;
+        while ( i < r ) {
+            if ( i )
+                c.append( " or " );
+            c.append( column );
+            if ( first[i] == last[i] ) {
+                c.append( "=" );
+                c.appendNumber( first[i] );
+            }
+            else {
+                c.append( " between " );
+                c.appendNumber( first[i] );
+                c.append( " and " );
+                c.appendNumber( last[i] );
+            }
+            i++;
+        }
+        if ( r > 1 )
+            c.append( ")" );
+    }
+    return c;
+}
+
+
 class StoreData
     : public Garbage
 {
@@ -371,8 +428,10 @@ void Store::execute()
         return;
 
     if ( !d->obtainModSeq ) {
-        if ( !transaction() )
+        if ( !transaction() ) {
             setTransaction( new Transaction( this ) );
+            transaction()->allowGroupCommit();
+        }
 
         d->obtainModSeq
             = new Query( "select nextmodseq from mailboxes "
@@ -410,14 +469,16 @@ void Store::execute()
                 }
             }
             if ( !s.isEmpty() ) {
-                d->presentFlags =
-                    new Query(
-                        "select mailbox, uid, flag from flags "
-                        "where mailbox=$1 and uid=any($2) and flag=any($3)",
-                        this );
+                d->presentFlags = new Query( "", this );
                 d->presentFlags->bind( 1, m->id() );
-                d->presentFlags->bind( 2, d->specified );
-                d->presentFlags->bind( 3, s );
+                uint n = 2;
+                EString c = uidCondition( d->specified, "uid",
+                                          d->presentFlags, n );
+                d->presentFlags->bind( n, s );
+                d->presentFlags->setString(
+                    "select mailbox, uid, flag from flags "
+                    "where mailbox=$1 and " + c +
+                    " and flag=any($" + fn( n ) + ")" );
                 transaction()->enqueue( d->presentFlags );
             }
         }
@@ -518,7 +579,7 @@ void Store::execute()
         d->modseqUpdate = new Query( "", this );
         d->modseqUpdate->bind( 1, d->modseq );
         d->modseqUpdate->bind( 2, m->id() );
-        d->modseqUpdate->bind( 3, d->s );
+        uint n = 3;
         EString uq(  "update mailbox_messages set modseq=$1" );
         if ( d->changeSeen ) {
             uq.append( ",seen=" );
@@ -534,7 +595,8 @@ void Store::execute()
             else
                 uq.append( "false" );
         }
-        uq.append( " where mailbox=$2 and uid=any($3)" );
+        uq.append( " where mailbox=$2 and " );
+        uq.append( uidCondition( d->s, "uid", d->modseqUpdate, n ) );
         EStringList extraConditions;
         bool checkSeenDeleted = true;
         if ( d->changedUids.isEmpty() ) {
@@ -548,8 +610,8 @@ void Store::execute()
         else {
             // we change flags on some messages, but maybe
             // seen/deleted on more?
-            extraConditions.append( "uid=any($4)" );
-            d->modseqUpdate->bind( 4, d->changedUids );
+            extraConditions.append( uidCondition( d->changedUids, "uid",
+                                                  d->modseqUpdate, n ) );
         }
         if ( checkSeenDeleted ) {
             if ( d->changeSeen ) {
@@ -600,6 +662,8 @@ void Store::execute()
         q->bind( 1, d->modseq + 1 );
         q->bind( 2, m->id() );
         transaction()->enqueue( q );
+        MailboxChange::publish( transaction(), m, MailboxChange::Changed,
+                                d->s, d->modseq );
 
         if ( d->silent )
             d->session->ignoreModSeq( d->modseq );
@@ -727,15 +791,19 @@ bool Store::removeFlags( bool opposite )
     if ( flags.isEmpty() && !opposite )
         return false;
 
-    EString s = "delete from flags where mailbox=$1 and uid=any($2) and ";
+    Query * q = new Query( "", 0 );
+    q->bind( 1, d->session->mailbox()->id() );
+    uint n = 2;
+    EString s = "delete from flags where mailbox=$1 and ";
+    s.append( uidCondition( d->s, "uid", q, n ) );
+    s.append( " and " );
     if ( opposite )
         s.append( "not " );
-    s.append( "flag=any($3)" );
-
-    Query * q = new Query( s, 0 );
-    q->bind( 1, d->session->mailbox()->id() );
-    q->bind( 2, d->s );
-    q->bind( 3, flags );
+    s.append( "flag=any($" );
+    s.appendNumber( n );
+    s.append( ")" );
+    q->bind( n, flags );
+    q->setString( s );
     transaction()->enqueue( q );
     return true;
 }
@@ -743,13 +811,19 @@ bool Store::removeFlags( bool opposite )
 
 /*! Adds all the necessary flags to the database. Returns true if it
     sends any queries.
+
+    If the messages form a few UID ranges, each flag is added using
+    one insert ... select, so that neither the UIDs nor the new rows
+    need to be sent to the database. Otherwise the rows are copied.
 */
 
 bool Store::addFlags()
 {
     uint mailbox = d->session->mailbox()->id();
+    bool bulk = d->s.ranges( 0, 0, 0 ) <= MaxRanges;
 
     bool work = false;
+    bool copy = false;
     Query * q = new Query( "copy flags (mailbox, uid, flag) "
                            "from stdin with binary", this );
 
@@ -774,8 +848,25 @@ bool Store::addFlags()
             IntegerSet * p = d->present->find( flag );
             if ( p )
                 s.remove( *p );
-            if ( !s.isEmpty() ) {
+            if ( !s.isEmpty() && bulk ) {
                 work = true;
+                Query * i = new Query( "", 0 );
+                i->bind( 1, mailbox );
+                i->bind( 2, flag );
+                uint n = 3;
+                EString c = uidCondition( d->s, "mm.uid", i, n );
+                i->setString( "insert into flags (mailbox, uid, flag) "
+                              "select mm.mailbox, mm.uid, $2 "
+                              "from mailbox_messages mm "
+                              "where mm.mailbox=$1 and " + c +
+                              " and not exists (select 1 from flags f "
+                              "where f.mailbox=$1 and f.uid=mm.uid "
+                              "and f.flag=$2)" );
+                transaction()->enqueue( i );
+            }
+            else if ( !s.isEmpty() ) {
+                work = true;
+                copy = true;
                 int c = s.count();
                 while ( c ) {
                     uint uid = s.value( c );
@@ -788,7 +879,7 @@ bool Store::addFlags()
             }
         }
     }
-    if ( work )
+    if ( copy )
         transaction()->enqueue( q );
 
     return work;
@@ -810,79 +901,91 @@ bool Store::replaceFlags()
 }
 
 
-static void bind( Query * q, uint i, const EString & n )
-{
-    if ( n.isEmpty() )
-        q->bindNull( i );
-    else
-        q->bind( i, n );
-}
-
+/*! Replaces one or more annotations with the provided replacements.
 
-/*! Replaces one or more annotations with the provided replacements. */
+    However many entries and messages there are, this uses one delete
+    and at most one insert: The delete removes the old values of all
+    the entries, and the insert adds the new ones to every message
+    using arrays of entry names, values and owners.
+*/
 
 void Store::replaceAnnotations()
 {
     Mailbox * m = d->session->mailbox();
-    IntegerSet s( d->s );
+    User * u = imap()->user();
 
+    IntegerSet shared;
+    IntegerSet owned;
+    Dict<Annotation> replacements;
+    List<Annotation> l;
     List<Annotation>::Iterator it( d->annotations );
-    User * u = imap()->user();
     while ( it ) {
-        Query * q;
-
         uint aid = d->annotationNameCreator->id( it->entryName() );
-
-        if ( it->value().isEmpty() ) {
-            EString o = "owner=$4";
-            if ( !it->ownerId() )
-                o = "owner is null";
-            q = new Query( "delete from annotations where "
-                           "mailbox=$1 and uid=any($2) and "
-                           "name=$3 and " + o, 0 );
-            q->bind( 1, m->id() );
-            q->bind( 2, d->s );
-            q->bind( 3, aid );
-            if ( it->ownerId() )
-                q->bind( 4, u->id() );
-            transaction()->enqueue( q );
+        EString k = fn( aid );
+        if ( it->ownerId() ) {
+            owned.add( aid );
+            k.append( "p" );
         }
         else {
-            EString o( "owner=$5" );
-            if ( !it->ownerId() )
-                o = "owner is null";
-            EString existing( "where mailbox=$2 and uid=any($3) and "
-                             "name=$4 and " + o );
-            q = new Query( "update annotations set value=$1 " + existing, 0 );
-            bind( q, 1, it->value() );
-            q->bind( 2, m->id() );
-            q->bind( 3, d->s );
-            q->bind( 4, aid );
-            if ( it->ownerId() )
-                q->bind( 5, u->id() );
-            transaction()->enqueue( q );
-
-            q = new Query( "insert into annotations "
-                           "(mailbox, uid, name, value, owner) "
-                           "select $2,uid,$4,$1,$5 "
-                           "from mailbox_messages where "
-                           "mailbox=$2 and uid=any($3) and uid not in "
-                           "(select uid from annotations " + existing + ")",
-                           0 );
-            bind( q, 1, it->value() );
-            q->bind( 2, m->id() );
-            q->bind( 3, d->s );
-            q->bind( 4, aid );
-            if ( it->ownerId() )
-                q->bind( 5, it->ownerId() );
+            shared.add( aid );
+        }
+        // if an entry is named twice, the last value counts
+        if ( !replacements.contains( k ) )
+            l.append( it );
+        replacements.insert( k, it );
+        ++it;
+    }
+
+    Query * q = new Query( "delete from annotations where "
+                           "mailbox=$1 and uid=any($2) and "
+                           "((owner is null and name=any($3)) or "
+                           "(owner=$4 and name=any($5)))", 0 );
+    q->bind( 1, m->id() );
+    q->bind( 2, d->s );
+    q->bind( 3, shared );
+    q->bind( 4, u->id() );
+    q->bind( 5, owned );
+    transaction()->enqueue( q );
+
+    EStringList names;
+    EStringList values;
+    EStringList owners;
+    it = l.first();
+    while ( it ) {
+        uint aid = d->annotationNameCreator->id( it->entryName() );
+        EString k = fn( aid );
+        if ( it->ownerId() )
+            k.append( "p" );
+        Annotation * a = replacements.find( k );
+        if ( !a->value().isEmpty() ) {
+            names.append( fn( aid ) );
+            values.append( a->value() );
+            if ( a->ownerId() )
+                owners.append( fn( a->ownerId() ) );
             else
-                q->bindNull( 5 );
-            transaction()->enqueue( q );
+                owners.append( "" );
         }
         ++it;
     }
-}
+    if ( names.isEmpty() )
+        return;
 
+    q = new Query( "insert into annotations "
+                   "(mailbox, uid, name, value, owner) "
+                   "select $1, mm.uid, e.name::integer, e.value, "
+                   "nullif(e.owner,'')::integer "
+                   "from mailbox_messages mm, "
+                   "(select unnest($3::text[]) as name,"
+                   " unnest($4::text[]) as value,"
+                   " unnest($5::text[]) as owner) e "
+                   "where mm.mailbox=$1 and mm.uid=any($2)", 0 );
+    q->bind( 1, m->id() );
+    q->bind( 2, d->s );
+    q->bind( 3, names );
+    q->bind( 4, values );
+    q->bind( 5, owners );
+    transaction()->enqueue( q );
+}
 
 /*! As listMailbox(), but ASCII only. Checks that and emits an error
     if necessary.
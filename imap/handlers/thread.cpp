@@ -12,6 +12,9 @@
 #include "dict.h"
 #include "list.h"
 #include "map.h"
+#include "user.h"
+#include "searchcache.h"
+#include "mailbox.h"
 
 
 class ThreadData
@@ -20,7 +23,8 @@ class ThreadData
 public:
     ThreadData(): Garbage(), uid( true ), s( 0 ),
                   session( 0 ),
-                  find( 0 ) {}
+                  find( 0 ), messages( new List<Node> ),
+                  base( 0 ), cacheModSeq( 0 ) {}
 
     bool uid;
     enum Algorithm { OrderedSubject, Refs, References };
@@ -36,17 +40,18 @@ public:
     public:
         Node()
             : Garbage(),
-              uid( 0 ), threadRoot( 0 ),
+              uid( 0 ), message( 0 ), threadRoot( 0 ),
               idate( 0 ),
               reported( false ), added( false ),
               parent( 0 ) {}
 
         uint uid;
+        uint message;
         uint threadRoot;
         UString subject;
         uint idate;
-        EString references;
         EString messageId;
+        EString ancestors;
 
         bool reported;
         bool added;
@@ -60,9 +65,35 @@ public:
                 r = r->parent;
             return r;
         }
+
+        Node * copy() const {
+            Node * n = new Node;
+            n->uid = uid;
+            n->message = message;
+            n->threadRoot = threadRoot;
+            n->subject = subject;
+            n->idate = idate;
+            n->messageId = messageId;
+            n->ancestors = ancestors;
+            return n;
+        }
     };
 
-    Dict<Node> nodes;
+    class ThreadItem
+        : public SearchCache::Item
+    {
+    public:
+        ThreadItem(): SearchCache::Item(), messages( 0 ) {}
+        List<Node> * messages;
+    };
+
+    List<Node> * messages;
+
+    EString cacheKey;
+    ThreadItem * base;
+    int64 cacheModSeq;
+
+    List<Node> nodes;
     List<Node> roots;
 
     List<Node> result;
@@ -76,9 +107,27 @@ public:
 
     The Thread class implements the IMAP THREAD command, specified in
     RFC 5256 section BASE.6.4.THREAD.
+
+    The messages fetched from the database are cached per mailbox,
+    user, algorithm and search keys, along with the modseq at the
+    time, and the threads are built from that in RAM. If the search
+    keys don't depend on flags, annotations or the like, a later
+    THREAD fetches only the messages that have changed and adds them
+    to the cached ones, leaving out any that have been expunged.
+
+    REFS and REFERENCES don't parse header fields. The Injector
+    records each message's Message-ID and the Message-IDs in its
+    References field in thread_links, and Thread links each message
+    to its parent and each ancestor to its own parent in turn, using
+    dummies for the ancestors that haven't been selected, as RFC 5256
+    says. Threads whose messages aren't linked that way are joined
+    using thread_root.
 */
 
 
+static SearchCache * cache = 0;
+
+
 
 /*! Constructs an empty Thread command. Will return UIDs if \a u is
     true, otherwise MSNs.
@@ -140,68 +189,56 @@ void Thread::execute()
         d->session = session();
 
     if ( !d->find ) {
-        EStringList * want = new EStringList;
-        want->append( "uid" );
-        want->append( "message" );
-        want->append( "m.idate" );
-        want->append( "m.thread_root" );
-        want->append( "tmid.value as messageid" );
-        want->append( "tref.value as references" );
-        EString ts;
-        if ( d->threadAlg == ThreadData::References ) {
-            want->append( "tsubj.value as subject" );
-            ts = "left join header_fields tsubj on"
-                 " (m.id=tsubj.message and"
-                 " tsubj.field=" + fn( HeaderField::Subject ) +
-                 " and tsubj.part='') ";
+        considerCache();
+        if ( d->base && d->base->modseq == d->cacheModSeq ) {
+            if ( Log::enabled( Log::Debug ) )
+                log( "Threading " + fn( d->base->messages->count() ) +
+                     " cached messages", Log::Debug );
+            merge( IntegerSet() );
+        }
+        else {
+            find();
+            return;
         }
-
-        d->find = d->s->query( imap()->user(),
-                               d->session->mailbox(), d->session,
-                               this, false, want );
-        EString j = d->find->string();
-
-        // we need to get the References and Message-Id fields as well
-        const char * x = "left join";
-        if ( !j.contains( x ) )
-            x = "where";
-        j.replace( x,
-                   "left join header_fields tref on"
-                   " (m.id=tref.message and"
-                   " tref.field=" + fn( HeaderField::References ) +
-                   " and tref.part='') "
-                   "left join header_fields tmid on"
-                   " (m.id=tmid.message and"
-                   " tmid.field=" + fn( HeaderField::MessageId ) +
-                   " and tmid.part='') " + ts + x );
-
-        d->find->setString( j );
-
-        d->find->execute();
-        return;
     }
+    else {
+        IntegerSet changed;
+        while ( d->find->hasResults() ) {
+            Row * r = d->find->nextRow();
+            ThreadData::Node * n = new ThreadData::Node;
+            n->uid = r->getInt( "uid" );
+            n->message = r->getInt( "message" );
+            n->idate = r->getInt( "idate" );
+            if ( !r->isNull( "thread_root" ) )
+                n->threadRoot = r->getInt( "thread_root" );
+            if ( !r->isNull( "messageid" ) )
+                n->messageId = r->getEString( "messageid" );
+            if ( !r->isNull( "ancestors" ) )
+                n->ancestors = r->getEString( "ancestors" );
+            if ( !r->isNull( "base_subject" ) )
+                n->subject = r->getUString( "base_subject" );
+            else if ( !r->isNull( "subject" ) )
+                n->subject
+                    = Message::baseSubject( r->getUString( "subject" ) );
+            changed.add( n->uid );
+            d->messages->append( n );
+        }
 
-    while ( d->find->hasResults() ) {
-        Row * r = d->find->nextRow();
-        ThreadData::Node * n = new ThreadData::Node;
-        n->uid = r->getInt( "uid" );
-        n->idate = r->getInt( "idate" );
-        if ( !r->isNull( "thread_root" ) )
-            n->threadRoot = r->getInt( "thread_root" );
-        if ( !r->isNull( "references" ) )
-            n->references = r->getEString( "references" );
-        if ( !r->isNull( "messageid" ) )
-            n->messageId = r->getEString( "messageid" );
-        if ( !r->isNull( "subject" ) )
-            n->subject = Message::baseSubject( r->getUString( "subject" ) );
+        if ( !d->find->done() )
+            return;
 
-        d->result.append( n );
-        if ( !n->messageId.isEmpty() )
-            d->nodes.insert( n->messageId, n );
+        if ( d->base )
+            merge( changed );
+        storeResult();
     }
 
-    if ( !d->find->done() )
-        return;
+    List<ThreadData::Node>::Iterator m( d->messages );
+    while ( m ) {
+        ThreadData::Node * n = m->copy();
+        ++m;
+        d->result.append( n );
+        d->nodes.append( n );
+    }
 
     List<ThreadData::Node>::Iterator ri( d->result );
     if ( d->threadAlg == ThreadData::OrderedSubject ) {
@@ -218,45 +255,58 @@ void Thread::execute()
         }
     }
     else {
+        // link each message to its parent and each ancestor to its
+        // own parent, using dummies for the ancestors which aren't
+        // among the messages, so that siblings and cousins stay
+        // together
+        Dict<ThreadData::Node> ids;
+        while ( ri ) {
+            if ( !ri->messageId.isEmpty() && !ids.find( ri->messageId ) )
+                ids.insert( ri->messageId, ri );
+            ++ri;
+        }
+
+        ri = d->result.first();
         while ( ri ) {
             ThreadData::Node * n = ri;
             ++ri;
 
-            EStringList l;
+            List<ThreadData::Node> chain;
             int lt = 0;
             while ( lt >= 0 ) {
-                lt = n->references.find( '<', lt );
+                lt = n->ancestors.find( '<', lt );
                 if ( lt >= 0 ) {
-                    int gt = n->references.find( '>', lt );
-                    if ( gt > 0 )
-                        l.append( n->references.mid( lt, gt + 1 - lt ) );
+                    int gt = n->ancestors.find( '>', lt );
+                    if ( gt > 0 ) {
+                        EString id = n->ancestors.mid( lt, gt + 1 - lt );
+                        ThreadData::Node * a = ids.find( id );
+                        if ( !a ) {
+                            a = new ThreadData::Node;
+                            a->messageId = id;
+                            a->threadRoot = n->threadRoot;
+                            ids.insert( id, a );
+                            d->nodes.append( a );
+                        }
+                        chain.append( a );
+                    }
                     lt = gt;
                 }
             }
-            l.append( n->messageId );
+            chain.append( n );
 
-            EStringList::Iterator s( l );
             ThreadData::Node * parent = 0;
-            while ( s ) {
-                if ( !s->isEmpty() ) {
-                    ThreadData::Node * n = d->nodes.find( *s );
-                    if ( !n ) {
-                        n = new ThreadData::Node;
-                        n->messageId = *s;
-                        n->threadRoot = n->threadRoot;
-                        d->nodes.insert( *s, n );
-                    }
-                    if ( parent && !n->parent && parent->root() != n )
-                        n->parent = parent;
-                    parent = n;
-                }
-                ++s;
-            };
+            List<ThreadData::Node>::Iterator c( chain );
+            while ( c ) {
+                if ( parent && !c->parent && parent->root() != c )
+                    c->parent = parent;
+                parent = c;
+                ++c;
+            }
         }
 
         // merge big threads where the start has been deleted, or
         // isn't part of the search expression.
-        Dict<ThreadData::Node>::Iterator i( d->nodes );
+        List<ThreadData::Node>::Iterator i( d->nodes );
         Map<ThreadData::Node> roots;
         while ( i ) {
             ThreadData::Node * n = i;
@@ -272,7 +322,7 @@ void Thread::execute()
 
         // if thread=references is used, we need to jump through extra hoops
         if ( d->threadAlg == ThreadData::References ) {
-            Dict<ThreadData::Node>::Iterator i( d->nodes );
+            List<ThreadData::Node>::Iterator i( d->nodes );
             UDict<ThreadData::Node> subjects;
             while ( i ) {
                 if ( !i->parent ) {
@@ -288,7 +338,7 @@ void Thread::execute()
     }
 
     // set up child lists and the root list
-    Dict<ThreadData::Node>::Iterator i( d->nodes );
+    List<ThreadData::Node>::Iterator i( d->nodes );
     while ( i ) {
         ThreadData::Node * n = i;
         ++i;
@@ -307,7 +357,7 @@ void Thread::execute()
     // we need to sort root nodes (and children) by idate, so we
     // extend the definition until sorting works: a non-message's
     // idate is the oldest idate of a direct descendant.
-    i = Dict<ThreadData::Node>::Iterator( d->nodes );
+    i = List<ThreadData::Node>::Iterator( d->nodes );
     while ( i ) {
         ThreadData::Node * n = i;
         ++i;
@@ -327,6 +377,119 @@ void Thread::execute()
 }
 
 
+/*! Looks for cached messages for this command, and decides whether
+    they can be used. Sets up cacheKey if the messages can be cached,
+    and base if the cached messages can be used, either as-is or
+    together with the messages changed since they were stored.
+*/
+
+void Thread::considerCache()
+{
+    if ( d->s->timeSensitive() || d->s->needSession() )
+        return;
+
+    d->cacheModSeq = d->session->nextModSeq();
+    d->cacheKey = SearchCache::key( d->session, imap()->user(),
+                                    fn( (uint)d->threadAlg ) + " " +
+                                    d->s->string() );
+
+    ThreadData::ThreadItem * i = 0;
+    if ( ::cache )
+        i = (ThreadData::ThreadItem *)::cache->find( d->cacheKey,
+                                                     d->cacheModSeq );
+    if ( !i )
+        return;
+
+    if ( i->modseq == d->cacheModSeq || !d->s->dynamic() )
+        d->base = i;
+}
+
+
+/*! Starts the query to find the messages to be threaded, or if base
+    is set, the messages that have changed since it was cached.
+*/
+
+void Thread::find()
+{
+    EStringList * want = new EStringList;
+    want->append( "uid" );
+    want->append( "message" );
+    want->append( "m.idate" );
+    want->append( "m.thread_root" );
+    want->append( "tl.messageid" );
+    // stepTo115() may not have found the ancestors of older messages
+    want->append( "coalesce(tl.ancestors,tl.parent_messageid) "
+                  "as ancestors" );
+    EString ts;
+    if ( d->threadAlg != ThreadData::Refs ) {
+        want->append( "m.base_subject" );
+        want->append( "tsubj.value as subject" );
+        ts = "left join header_fields tsubj on"
+             " (m.id=tsubj.message and"
+             " tsubj.field=" + fn( HeaderField::Subject ) +
+             " and tsubj.part='') ";
+    }
+
+    Selector * s = d->s;
+    if ( d->base ) {
+        s = SearchCache::changedSince( d->base, d->s );
+        if ( Log::enabled( Log::Debug ) )
+            log( "Fetching messages changed since modseq " +
+                 fn( d->base->modseq ) + " for threading", Log::Debug );
+    }
+
+    d->find = s->query( imap()->user(),
+                        d->session->mailbox(), d->session,
+                        this, false, want );
+    EString j = d->find->string();
+
+    // we need the thread links (and perhaps the subject) as well
+    const char * x = "left join";
+    if ( !j.contains( x ) )
+        x = "where";
+    j.replace( x,
+               "left join thread_links tl on (m.id=tl.message) " + ts + x );
+
+    d->find->setString( j );
+
+    d->find->execute();
+}
+
+
+/*! Adds the cached messages in base to the messages to be threaded,
+    except those that have been expunged or are in \a changed.
+*/
+
+void Thread::merge( const IntegerSet & changed )
+{
+    const IntegerSet & live = d->session->messages();
+    List<ThreadData::Node>::Iterator i( d->base->messages );
+    while ( i ) {
+        if ( live.contains( i->uid ) && !changed.contains( i->uid ) )
+            d->messages->append( i );
+        ++i;
+    }
+}
+
+
+/*! Records the messages fetched by this command in the cache, so
+    that considerCache() can use them next time.
+*/
+
+void Thread::storeResult()
+{
+    if ( d->cacheKey.isEmpty() )
+        return;
+
+    if ( !::cache )
+        ::cache = new SearchCache;
+    ThreadData::ThreadItem * i = new ThreadData::ThreadItem;
+    i->modseq = d->cacheModSeq;
+    i->messages = d->messages;
+    ::cache->store( d->cacheKey, i );
+}
+
+
 /*! \class ThreadResponse thread.h
 
     The Thread class formats the IMAP THREAD response, as specified in
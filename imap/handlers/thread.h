@@ -17,6 +17,11 @@ public:
 
 private:
     class ThreadData * d;
+
+    void considerCache();
+    void find();
+    void merge( const IntegerSet & );
+    void storeResult();
 };
 
 
@@ -5,9 +5,11 @@
 #include "log.h"
 #include "list.h"
 #include "timer.h"
+#include "vector.h"
 #include "query.h"
 #include "scope.h"
 #include "buffer.h"
+#include "allocator.h"
 #include "estring.h"
 #include "mailbox.h"
 #include "selector.h"
@@ -28,7 +30,13 @@
 #include "time.h"
 
 
-static bool endsWithLiteral( const EString *, uint *, bool * );
+static bool endsWithLiteral( const EString &, uint, uint *, bool * );
+
+
+// the number of literal bytes all IMAP connections together have
+// been allowed to read, and the connections waiting for permission
+static uint literalBytes;
+static List<IMAP> * literalQueue;
 
 
 class IMAPData
@@ -39,8 +47,9 @@ public:
         : state( IMAP::NotAuthenticated ), reader( 0 ),
           prefersAbsoluteMailboxes( false ),
           runningCommands( false ), runCommandsAgain( false ),
-          readingLiteral( false ),
-          literalSize( 0 ), mailbox( 0 ),
+          readingLiteral( false ), literalQueued( false ),
+          literalPlus( false ),
+          literalSize( 0 ), literalReserved( 0 ), mailbox( 0 ),
           bytesArrived( 0 ),
           eventMap( new EventMap ),
           lastBadTime( 0 ),
@@ -69,10 +78,14 @@ public:
     bool runningCommands;
     bool runCommandsAgain;
     bool readingLiteral;
+    bool literalQueued;
+    bool literalPlus;
     uint literalSize;
+    uint literalReserved;
 
     List<Command> commands;
-    List<ImapResponse> responses;
+    Vector<ImapResponse> responses;
+    Vector<ImapResponse> held;
 
     Mailbox *mailbox;
 
@@ -265,25 +278,23 @@ void IMAP::parse()
     while ( true ) {
         // We read a line of client input, possibly including literals,
         // and create a Command to deal with it.
-        if ( !d->readingLiteral && !d->reader ) {
+        if ( !d->readingLiteral && !d->literalQueued && !d->reader ) {
             bool plus = false;
-            EString * s;
             uint n;
 
-            // Do we have a complete line yet?
-            s = r->removeLine();
-            if ( !s )
+            // Do we have a complete line yet? If so, move it straight
+            // into the command.
+            uint start = d->str.length();
+            if ( !r->removeLine( d->str ) )
                 return;
 
-            d->str.append( *s );
-
-            if ( endsWithLiteral( s, &n, &plus ) ) {
+            if ( endsWithLiteral( d->str, start, &n, &plus ) ) {
                 d->str.append( "\r\n" );
                 if ( n <= ImapParser::literalSizeLimit() ) {
-                    d->readingLiteral = true;
                     d->literalSize = n;
-                    if ( !plus )
-                        enqueue( "+ reading literal\r\n" );
+                    d->literalPlus = plus;
+                    if ( !startLiteral() )
+                        return;
                 }
             }
 
@@ -291,15 +302,27 @@ void IMAP::parse()
             if ( !d->readingLiteral ) {
                 addCommand();
                 d->str.truncate();
+                releaseLiterals();
             }
         }
+        else if ( d->literalQueued ) {
+            // Has another connection released enough memory?
+            if ( !startLiteral() )
+                return;
+        }
         else if ( d->readingLiteral ) {
-            // Have we finished reading a complete literal?
-            if ( r->size() < d->literalSize )
+            // We move the literal into the command as it arrives, so
+            // it's never held in both the Buffer and the command.
+            uint n = r->size();
+            if ( n > d->literalSize )
+                n = d->literalSize;
+            if ( n ) {
+                r->appendTo( d->str, n );
+                r->remove( n );
+                d->literalSize -= n;
+            }
+            if ( d->literalSize )
                 return;
-
-            d->str.append( r->string( d->literalSize ) );
-            r->remove( d->literalSize );
             d->readingLiteral = false;
         }
         else if ( d->reader ) {
@@ -313,6 +336,106 @@ void IMAP::parse()
 }
 
 
+/*! This private helper starts reading a literal of d->literalSize
+    bytes, and returns true if it may do so.
+
+    All IMAP connections together may read literals amounting to half
+    of the memory-limit setting. If reading this literal would exceed
+    that, the connection is queued and this function returns false;
+    canRead() keeps the rest of the client's input in the kernel's
+    buffers until releaseLiterals() lets the connection continue. A
+    client that uses a synchronising literal is told to go ahead only
+    then. A connection may always read one literal if no one else is.
+*/
+
+bool IMAP::startLiteral()
+{
+    uint budget = Configuration::scalar( Configuration::MemoryLimit )
+                  * 512 * 1024;
+    uint n = d->literalSize;
+    if ( ::literalBytes > d->literalReserved &&
+         ::literalBytes + n > budget ) {
+        if ( !d->literalQueued ) {
+            if ( !::literalQueue ) {
+                ::literalQueue = new List<IMAP>;
+                Allocator::addEternal( ::literalQueue,
+                                       "IMAP connections waiting to "
+                                       "read literals" );
+            }
+            ::literalQueue->append( this );
+            d->literalQueued = true;
+            if ( Log::enabled( Log::Debug ) )
+                log( "Waiting for memory to read " + fn( n ) +
+                     "-byte literal", Log::Debug );
+        }
+        return false;
+    }
+
+    if ( d->literalQueued ) {
+        ::literalQueue->remove( this );
+        d->literalQueued = false;
+    }
+    ::literalBytes += n;
+    d->literalReserved += n;
+    d->readingLiteral = true;
+    d->str.reserve( d->str.length() + n );
+    if ( !d->literalPlus )
+        enqueue( "+ reading literal\r\n" );
+    return true;
+}
+
+
+/*! Releases the literal memory reserved by startLiteral(), and lets
+    any waiting connections read their literals.
+*/
+
+void IMAP::releaseLiterals()
+{
+    if ( d->literalQueued ) {
+        ::literalQueue->remove( this );
+        d->literalQueued = false;
+    }
+    if ( !d->literalReserved )
+        return;
+
+    ::literalBytes -= d->literalReserved;
+    d->literalReserved = 0;
+    if ( !::literalQueue )
+        return;
+
+    // first come, first served
+    IMAP * c = ::literalQueue->firstElement();
+    while ( c ) {
+        c->react( Read );
+        if ( c == ::literalQueue->firstElement() )
+            c = 0;
+        else
+            c = ::literalQueue->firstElement();
+    }
+}
+
+
+/*! Returns false while this connection is waiting for permission to
+    read a literal (see startLiteral()), and true otherwise.
+*/
+
+bool IMAP::canRead()
+{
+    return !d->literalQueued;
+}
+
+
+/*! Releases any literal memory this connection holds, then closes it
+    as Connection::close() does.
+*/
+
+void IMAP::close()
+{
+    releaseLiterals();
+    Connection::close();
+}
+
+
 /*! This function parses enough of the command line to create a Command,
     and then uses it to parse the rest of the input.
 */
@@ -382,7 +505,8 @@ void IMAP::addCommand()
     d->nextOkTime = time( 0 ) + 117;
 
     Scope x( cmd->log() );
-    if ( name.lower() != "login" && name.lower() != "authenticate" )
+    if ( Log::enabled( Log::Debug ) &&
+         name.lower() != "login" && name.lower() != "authenticate" )
         ::log( "First line: " + p->firstLine(), Log::Debug );
 }
 
@@ -421,7 +545,8 @@ void IMAP::setState( State s )
         name = "logout";
         break;
     };
-    log( "Changed to " + name + " state", Log::Debug );
+    if ( Log::enabled( Log::Debug ) )
+        log( "Changed to " + name + " state", Log::Debug );
 }
 
 
@@ -527,8 +652,9 @@ void IMAP::runCommands()
 
     while ( d->runCommandsAgain ) {
         d->runCommandsAgain = false;
-        log( "IMAP::runCommands, " + fn( d->commands.count() ) + " commands",
-             Log::Debug );
+        if ( Log::enabled( Log::Debug ) )
+            log( "IMAP::runCommands, " + fn( d->commands.count() ) +
+                 " commands", Log::Debug );
 
         // run all currently executing commands once
         uint n = 0;
@@ -588,7 +714,7 @@ void IMAP::runCommands()
             Scope x( first->log() );
             ++i;
             if ( first->state() == Command::Unparsed )
-                first->parse();
+                first->runParser();
             if ( !first->ok() )
                 first->setState( Command::Finished );
             else if ( first->state() == Command::Unparsed ||
@@ -599,14 +725,21 @@ void IMAP::runCommands()
         }
 
         // if we have a leading command, we can parse and execute
-        // followers in the same group.
+        // followers in the same group. followers that are already
+        // executing (or even finished) don't stop us from starting
+        // more, but their responses are still sent in order, since
+        // only the first command is ever retired.
         if ( first && first->group() ) {
-            while ( first && i && first->state() == i->state() ) {
+            while ( first && i ) {
                 Command * c = i;
                 Scope x( c->log() );
                 ++i;
+                if ( c->state() == Command::Executing ||
+                     c->state() == Command::Finished ||
+                     c->state() == Command::Retired )
+                    continue;
                 if ( c->state() == Command::Unparsed )
-                    c->parse();
+                    c->runParser();
                 if ( !c->ok() )
                     c->setState( Command::Finished );
                 else if ( c->state() == Command::Unparsed ||
@@ -659,31 +792,33 @@ void IMAP::run( Command * c )
 
 
 /*  This static helper function returns true if \a s ends with an IMAP
-    literal specification. If so, it sets \a *n to the number of bytes
-    in the literal, and \a *plus to true if the number had a trailing
-    '+' (for LITERAL+). Returns false if it couldn't find a literal.
+    literal specification starting at or after \a start. If so, it
+    sets \a *n to the number of bytes in the literal, and \a *plus to
+    true if the number had a trailing '+' (for LITERAL+). Returns
+    false if it couldn't find a literal.
 */
 
-static bool endsWithLiteral( const EString *s, uint *n, bool *plus )
+static bool endsWithLiteral( const EString & s, uint start,
+                             uint *n, bool *plus )
 {
-    if ( !s->endsWith( "}" ) )
+    if ( s.length() < start + 3 || !s.endsWith( "}" ) )
         return false;
 
-    uint i = s->length() - 2;
-    if ( (*s)[i] == '+' ) {
+    uint i = s.length() - 2;
+    if ( s[i] == '+' ) {
         *plus = true;
         i--;
     }
 
     uint j = i;
-    while ( i > 0 && (*s)[i] >= '0' && (*s)[i] <= '9' )
+    while ( i > start && s[i] >= '0' && s[i] <= '9' )
         i--;
 
-    if ( (*s)[i] != '{' )
+    if ( s[i] != '{' )
         return false;
 
     bool ok;
-    *n = s->mid( i+1, j-i ).number( &ok );
+    *n = s.mid( i+1, j-i ).number( &ok );
 
     return ok;
 }
@@ -839,6 +974,8 @@ void IMAP::emitResponses()
 {
     if ( clientHasBug( NoUnsolicitedResponses ) && commands()->isEmpty() )
         return;
+    if ( d->responses.isEmpty() && d->held.isEmpty() )
+        return;
 
     // first, see if expunges are permitted
     bool can = false;
@@ -873,28 +1010,38 @@ void IMAP::emitResponses()
 
     bool any = false;
 
+    // Responses that change MSNs and had to wait are kept in a list
+    // of their own, so that we needn't look at them again until they
+    // may be sent. They're older than anything in d->responses.
+
     Buffer * w = writeBuffer();
-    List<ImapResponse>::Iterator r( d->responses );
-    uint n = 0;
-    while ( r ) {
+    if ( can ) {
+        while ( !d->held.isEmpty() ) {
+            ImapResponse * r = d->held.shift();
+            if ( r->meaningful() && !r->sent() ) {
+                r->emit( w );
+                any = true;
+            }
+            r->setSent();
+        }
+    }
+
+    while ( !d->responses.isEmpty() ) {
+        ImapResponse * r = d->responses.shift();
         if ( !r->meaningful() ) {
             r->setSent();
         }
-        else if ( !r->sent() && ( can || !r->changesMsn() ) ) {
-            EString t = r->text();
-            if ( !t.isEmpty() ) {
-                w->append( "* ", 2 );
-                w->append( t );
-                w->append( "\r\n", 2 );
-                n++;
-            }
+        else if ( r->sent() ) {
+            // nothing to do
+        }
+        else if ( can || !r->changesMsn() ) {
+            r->emit( w );
             r->setSent();
             any = true;
         }
-        if ( r->sent() )
-            d->responses.take( r );
-        else
-            ++r;
+        else {
+            d->held.append( r );
+        }
     }
 
     if ( !any )
@@ -21,6 +21,8 @@ public:
 
     void parse();
     virtual void react( Event );
+    virtual bool canRead();
+    virtual void close();
     void reserve( Command * );
 
     enum State { NotAuthenticated, Authenticated, Selected, Logout };
@@ -70,6 +72,8 @@ private:
     class IMAPData *d;
 
     void addCommand();
+    bool startLiteral();
+    void releaseLiterals();
     void runCommands();
     void run( Command * );
 };
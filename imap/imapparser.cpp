@@ -12,6 +12,11 @@
 
     This subclass of AbnfParser provides functions like nil(), string(),
     and literal() for use by IMAP and individual IMAP Commands.
+
+    Like AbnfParser's, most of the tokens returned share memory with
+    the command, so that a command with a large literal is never
+    copied piecemeal. Only quoted strings that contain escapes or
+    8-bit characters are built anew.
 */
 
 /*! Creates a new ImapParser for the string \a s.
@@ -47,21 +52,20 @@ EString ImapParser::firstLine()
 
 EString ImapParser::tag()
 {
-    EString r;
+    uint start = pos();
 
     char c = nextChar();
     while ( c > ' ' && c < 127 && c != '(' && c != ')' && c != '{' &&
             c != '%' && c != '*' && c != '"' && c != '\\' && c != '+' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
-    if ( r.isEmpty() )
+    if ( pos() == start )
         setError( "Expected IMAP tag, but saw: " + following().quoted() );
 
-    return r;
+    return str.mid( start, pos() - start );
 }
 
 
@@ -73,24 +77,24 @@ EString ImapParser::tag()
 
 EString ImapParser::command()
 {
-    EString r;
-
-    if ( present( "uid " ) )
-        r.append( "uid " );
+    bool uid = present( "uid " );
+    uint start = pos();
 
     char c = nextChar();
     while ( c > ' ' && c < 127 && c != '(' && c != ')' && c != '{' &&
             c != '%' && c != '*' && c != '"' && c != '\\' && c != ']' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
-    if ( r.isEmpty() || r == "uid " )
+    if ( pos() == start )
         setError( "Expected IMAP command name, but saw: '" +
                   following() + "'" );
 
+    EString r = str.mid( start, pos() - start );
+    if ( uid )
+        return "uid " + r;
     return r;
 }
 
@@ -117,7 +121,7 @@ uint ImapParser::nzNumber()
 
 EString ImapParser::atom()
 {
-    EString r;
+    uint start = pos();
 
     char c = nextChar();
     while ( c > ' ' && c < 127 &&
@@ -125,14 +129,13 @@ EString ImapParser::atom()
             c != '"' && c != '\\' && c != '%' && c != '*' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
-    if ( r.isEmpty() )
+    if ( pos() == start )
         setError( "Expected IMAP atom, but saw: " + following() );
 
-    return r;
+    return str.mid( start, pos() - start );
 }
 
 
@@ -144,21 +147,20 @@ EString ImapParser::atom()
 
 EString ImapParser::listChars()
 {
-    EString r;
+    uint start = pos();
 
     char c = nextChar();
     while ( c > ' ' && c < 127 && c != '(' && c != ')' && c != '{' &&
             c != '"' && c != '\\' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
-    if ( r.isEmpty() )
+    if ( pos() == start )
         setError( "Expected 1*list-char, but saw: " + following() );
 
-    return r;
+    return str.mid( start, pos() - start );
 }
 
 
@@ -181,34 +183,55 @@ void ImapParser::nil()
 
 EString ImapParser::quoted()
 {
-    EString r;
-
     char c = nextChar();
     if ( c != '"' ) {
         setError( "Expected quoted string, but saw: " + following() );
-        return r;
+        return "";
     }
 
     step();
+    uint start = pos();
+
+    // the common case is plain ASCII without escapes, which we can
+    // return as it stands
+    bool plain = true;
     c = nextChar();
     while ( c != '"' && c > 0 && c != 10 && c != 13 ) {
         if ( c == '\\' ) {
+            plain = false;
             step();
             c = nextChar();
             if ( c == 0 || c == 10 || c == 13 )
                 setError( "Quoted string contained bad char: " +
                           following() );
         }
+        else if ( (unsigned char)c >= 128 ) {
+            plain = false;
+        }
         step();
-        r.append( c );
         c = nextChar();
     }
+    uint end = pos();
 
     if ( c != '"' )
         setError( "Quoted string incorrectly terminated: " + following() );
     else
         step();
 
+    if ( plain )
+        return str.mid( start, end - start );
+
+    EString r;
+    r.reserve( end - start );
+    uint i = start;
+    while ( i < end ) {
+        if ( str[i] == '\\' )
+            i++;
+        if ( i < end )
+            r.append( str[i] );
+        i++;
+    }
+
     Utf8Codec utf8;
     UString u( utf8.toUnicode( r ) );
 
@@ -310,21 +333,20 @@ EString ImapParser::astring()
     if ( c == '"' || c == '{' )
         return string();
 
-    EString r;
+    uint start = pos();
     while ( c > ' ' && c < 128 &&
             c != '(' && c != ')' && c != '{' &&
             c != '"' && c != '\\' &&
             c != '%' && c != '*' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
-    if ( r.isEmpty() )
+    if ( pos() == start )
         setError( "Expected astring, but saw: " + following() );
 
-    return r;
+    return str.mid( start, pos() - start );
 }
 
 
@@ -336,25 +358,23 @@ EString ImapParser::astring()
 
 EString ImapParser::listMailbox()
 {
-    EString r;
-
     char c = nextChar();
     if ( c == '"' || c == '{' )
         return string();
 
+    uint start = pos();
     while ( c > ' ' &&
             c != '(' && c != ')' && c != '{' &&
             c != '"' && c != '\\' )
     {
         step();
-        r.append( c );
         c = nextChar();
     }
 
-    if ( r.isEmpty() )
+    if ( pos() == start )
         setError( "Expected list-mailbox, but saw: " + following() );
 
-    return r;
+    return str.mid( start, pos() - start );
 }
 
 
@@ -364,10 +384,12 @@ EString ImapParser::listMailbox()
 
 EString ImapParser::flag()
 {
+    uint start = pos();
     if ( !present( "\\" ) )
         return atom();
 
-    EString r = "\\" + atom();
+    (void)atom();
+    EString r = str.mid( start, pos() - start );
     EString l = r.lower();
     if ( l == "\\answered" || l == "\\flagged" || l == "\\deleted" ||
          l == "\\seen" || l == "\\draft" )
@@ -386,7 +408,7 @@ EString ImapParser::flag()
 
 EString ImapParser::dotLetters( uint min, uint max )
 {
-    EString r;
+    uint start = pos();
     uint i = 0;
     char c = nextChar();
     while ( i < max &&
@@ -394,7 +416,6 @@ EString ImapParser::dotLetters( uint min, uint max )
               ( c >= '0' && c <= '9' ) || ( c == '.' ) ) )
     {
         step();
-        r.append( c );
         c = nextChar();
         i++;
     }
@@ -403,7 +424,7 @@ EString ImapParser::dotLetters( uint min, uint max )
         setError( "Expected at least " + fn( min-i ) + " more "
                   "letters/digits/dots, but saw: " + following() );
 
-    return r;
+    return str.mid( start, i );
 }
 
 
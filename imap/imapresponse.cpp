@@ -4,6 +4,7 @@
 
 #include "imapsession.h"
 #include "imap.h"
+#include "buffer.h"
 
 
 
@@ -145,6 +146,28 @@ EString ImapResponse::text() const
 }
 
 
+/*! Appends this response to \a buffer, including the leading "* "
+    and trailing CRLF, and returns true. If there is nothing to send,
+    emit() appends nothing and returns false.
+
+    The default implementation sends text(). Subclasses whose
+    responses may be very large can reimplement this to hand the
+    large parts to \a buffer separately, so that they are referenced
+    rather than copied.
+*/
+
+bool ImapResponse::emit( Buffer * buffer ) const
+{
+    EString t = text();
+    if ( t.isEmpty() )
+        return false;
+    buffer->append( "* ", 2 );
+    buffer->append( t );
+    buffer->append( "\r\n", 2 );
+    return true;
+}
+
+
 /*! Returns true if this response has meaning, and false if it may be
     discarded.
 
@@ -20,6 +20,7 @@ public:
     virtual void setSent();
 
     virtual EString text() const;
+    virtual bool emit( class Buffer * ) const;
 
     virtual bool meaningful() const;
     bool changesMsn() const;
@@ -11,6 +11,10 @@
 #include "scope.h"
 #include "imap.h"
 #include "flag.h"
+#include "buffer.h"
+
+// memcpy
+#include <string.h>
 
 
 class ImapSessionData
@@ -23,12 +27,17 @@ public:
                        emitting( false ), unicode( false ),
                        existsResponse( 0 ), recentResponse( 0 ),
                        uidnextResponse( 0 ), highestModseqResponse( 0 ),
-                       flagUpdate( 0 ), permaFlagUpdate( 0 ) {}
+                       flagUpdate( 0 ), permaFlagUpdate( 0 ),
+                       lastFetched( 0 ) {}
 
     class IMAP * i;
     Log * l;
     IntegerSet expungesReported;
     IntegerSet expungedFetched;
+    IntegerSet searchResult;
+    EString streamedKey;
+    EString streamedItem;
+    EString streamedData;
     uint exists;
     uint recent;
     uint uidnext;
@@ -136,6 +145,8 @@ public:
     uint flagUpdate;
     uint permaFlagUpdate;
 
+    uint lastFetched;
+
     class FlagUpdateResponse
         : public ImapResponse
     {
@@ -251,11 +262,8 @@ void ImapSession::emitUpdates( Transaction * t )
             work = true;
         }
         else {
-            while ( !e.isEmpty() ) {
-                (void)new ImapExpungeResponse( e.smallest(), this );
-                work = true;
-                e.remove( e.smallest() );
-            }
+            (void)new ImapExpungeResponse( e, this );
+            work = true;
         }
     }
 
@@ -323,8 +331,9 @@ void ImapSession::emitFlagUpdates( Transaction * t )
                 d->ignorable.take( i );
             }
             else if ( d->cms == *i ) {
-                log( "Not sending flag updates about modseq " + fn( d->cms ),
-                     Log::Debug );
+                if ( Log::enabled( Log::Debug ) )
+                    log( "Not sending flag updates about modseq " +
+                         fn( d->cms ), Log::Debug );
                 d->ignorable.take( i );
                 f = true;
             }
@@ -403,31 +412,49 @@ EString ImapVanishedResponse::text() const
 }
 
 
+/*! This reimplementation of emit() appends the response to \a
+    buffer without building a separate response string first.
+*/
+
+bool ImapVanishedResponse::emit( Buffer * buffer ) const
+{
+    if ( s->isEmpty() )
+        return false;
+    buffer->append( "* VANISHED ", 11 );
+    buffer->append( s->set() );
+    buffer->append( "\r\n", 2 );
+    return true;
+}
+
+
 void ImapVanishedResponse::setSent()
 {
-    while ( !s->isEmpty() ) {
-        int i = s->smallest();
-        session()->clearExpunged( i );
-        s->remove( i );
-    }
+    session()->clearExpunged( *s );
+    s->clear();
     ImapResponse::setSent();
 }
 
 
 /*! \class ImapExpungeResponse imapsession.h
 
-    The ImapExpungeResponse provides a single Expunge response. It can
-    formulate the right text and modify the session to account for the
-    response's having been sent.
+    The ImapExpungeResponse provides the Expunge responses for a set of
+    messages. It can formulate the right text and modify the session
+    to account for the responses' having been sent.
+
+    The responses are sent for the highest UID first. Since expunging
+    a message doesn't change the MSNs of the messages before it, each
+    MSN can be computed before any of the messages is removed from
+    the session, and the session is updated once, by setSent().
 */
 
 
-/*! Constructs an ImapExpungeResponse for \a uid in \a session.
+/*! Constructs an ImapExpungeResponse for \a uids in \a session.
 
 */
 
-ImapExpungeResponse::ImapExpungeResponse( uint uid, ImapSession * session )
-    : ImapResponse( session ), u( uid )
+ImapExpungeResponse::ImapExpungeResponse( const IntegerSet & uids,
+                                          ImapSession * session )
+    : ImapResponse( session ), s( new IntegerSet( uids ) )
 {
     setChangesMsn();
 }
@@ -436,21 +463,63 @@ ImapExpungeResponse::ImapExpungeResponse( uint uid, ImapSession * session )
 EString ImapExpungeResponse::text() const
 {
     EString r;
-    uint msn = session()->msn( u );
-    if ( !msn ) {
-        log( "Warning: No MSN for UID " + fn( u ), Log::Error );
-        return r; // can this happen? no?
+    uint n = s->count();
+    while ( n ) {
+        uint u = s->value( n );
+        n--;
+        uint msn = session()->msn( u );
+        if ( !msn ) {
+            log( "Warning: No MSN for UID " + fn( u ), Log::Error );
+            continue; // can this happen? no?
+        }
+        if ( !r.isEmpty() )
+            r.append( "\r\n* " );
+        r.appendNumber( msn );
+        r.append( " EXPUNGE" );
     }
-
-    r.appendNumber( msn );
-    r.append( " EXPUNGE" );
     return r;
 }
 
 
+/*! This reimplementation of emit() formats each response on the
+    stack and appends it to \a buffer, since one EXPUNGE command can
+    lead to very many of these responses.
+*/
+
+bool ImapExpungeResponse::emit( Buffer * buffer ) const
+{
+    bool any = false;
+    uint n = s->count();
+    while ( n ) {
+        uint u = s->value( n );
+        n--;
+        uint msn = session()->msn( u );
+        if ( !msn ) {
+            log( "Warning: No MSN for UID " + fn( u ), Log::Error );
+            continue;
+        }
+
+        // "* ", at most ten digits, " EXPUNGE\r\n"
+        char b[32];
+        uint i = 12;
+        do {
+            b[--i] = '0' + msn % 10;
+            msn /= 10;
+        } while ( msn );
+        b[--i] = ' ';
+        b[--i] = '*';
+        memcpy( b + 12, " EXPUNGE\r\n", 10 );
+        buffer->append( b + i, 22 - i );
+        any = true;
+    }
+    return any;
+}
+
+
 void ImapExpungeResponse::setSent()
 {
-    session()->clearExpunged( u );
+    session()->clearExpunged( *s );
+    s->clear();
     ImapResponse::setSent();
 }
 
@@ -469,6 +538,21 @@ void ImapSession::clearExpunged( uint u )
 }
 
 
+/*! This version updates the EXISTS number once for all of \a uids.
+*/
+
+void ImapSession::clearExpunged( const IntegerSet & uids )
+{
+    Session::clearExpunged( uids );
+    d->expungesReported.remove( uids );
+    uint n = uids.count();
+    if ( d->exists > n )
+        d->exists -= n;
+    else
+        d->exists = 0;
+}
+
+
 /*! Sends a FLAG blah, used by Flag whenever the flag list grows. */
 
 void ImapSession::sendFlagUpdate()
@@ -499,3 +583,94 @@ bool ImapSession::unicode() const
 {
     return d->unicode;
 }
+
+
+/*! Returns the UIDs saved by the last SEARCH RETURN (SAVE) in this
+    session (RFC 5182), which commands can refer to as "$". The set
+    is empty if there was no such search, or if it failed. Expunged
+    messages are not removed from the set.
+*/
+
+IntegerSet ImapSession::searchResult() const
+{
+    return d->searchResult;
+}
+
+
+/*! Saves \a uids as the search result for later commands to refer
+    to, replacing any earlier result.
+*/
+
+void ImapSession::setSearchResult( const IntegerSet & uids )
+{
+    d->searchResult = uids;
+}
+
+
+/*! Records that a FETCH command is sending the body section
+    described by \a key in pieces, and keeps its response item name
+    \a item and its entire \a data until another section is
+    streamed.
+*/
+
+void ImapSession::setStreamedSection( const EString & key,
+                                      const EString & item,
+                                      const EString & data )
+{
+    d->streamedKey = key;
+    d->streamedItem = item;
+    d->streamedData = data;
+}
+
+
+/*! Returns true if setStreamedSection() was last called with \a key,
+    and false otherwise.
+*/
+
+bool ImapSession::hasStreamedSection( const EString & key ) const
+{
+    return !d->streamedKey.isEmpty() && d->streamedKey == key;
+}
+
+
+/*! Returns the item name recorded by setStreamedSection(). */
+
+EString ImapSession::streamedItem() const
+{
+    return d->streamedItem;
+}
+
+
+/*! Returns the data recorded by setStreamedSection(). */
+
+EString ImapSession::streamedData() const
+{
+    return d->streamedData;
+}
+
+
+/*! Forgets the section recorded by setStreamedSection(), in addition
+    to what Session::compact() releases.
+*/
+
+void ImapSession::compact()
+{
+    Session::compact();
+    d->streamedKey.truncate();
+    d->streamedItem.truncate();
+    d->streamedData.truncate();
+}
+
+
+/*! Records that a FETCH command has sent the messages with MSNs \a
+    first to \a last, and returns true if that range starts right
+    after the one recorded previously. Fetch uses this to notice
+    clients paging through the mailbox.
+*/
+
+bool ImapSession::recordFetchedRange( uint first, uint last )
+{
+    bool sequential = d->lastFetched && first == d->lastFetched + 1;
+    d->lastFetched = last;
+    return sequential;
+}
@@ -4,11 +4,11 @@
 #define IMAPSESSION_H
 
 #include "imapresponse.h"
+#include "integerset.h"
 #include "estringlist.h"
 #include "session.h"
 #include "list.h"
 
-class IntegerSet;
 class Mailbox;
 class Message;
 class IMAP;
@@ -30,6 +30,7 @@ public:
     void ignoreModSeq( int64 );
 
     void clearExpunged( uint );
+    void clearExpunged( const IntegerSet & );
 
     void sendFlagUpdate();
     void sendFlagUpdate( class FlagCreator * );
@@ -38,6 +39,19 @@ public:
 
     void addChangedMessage( uint );
 
+    bool recordFetchedRange( uint, uint );
+
+    IntegerSet searchResult() const;
+    void setSearchResult( const IntegerSet & );
+
+    void setStreamedSection( const EString &, const EString &,
+                             const EString & );
+    bool hasStreamedSection( const EString & ) const;
+    EString streamedItem() const;
+    EString streamedData() const;
+
+    void compact();
+
 private:
     class ImapSessionData * d;
 
@@ -49,13 +63,14 @@ class ImapExpungeResponse
     : public ImapResponse
 {
 public:
-    ImapExpungeResponse( uint, ImapSession * );
+    ImapExpungeResponse( const IntegerSet &, ImapSession * );
 
     EString text() const;
+    bool emit( class Buffer * ) const;
     void setSent();
 
 private:
-    uint u;
+    IntegerSet * s;
 };
 
 
@@ -66,6 +81,7 @@ public:
     ImapVanishedResponse( const IntegerSet &, ImapSession * );
 
     EString text() const;
+    bool emit( class Buffer * ) const;
     void setSent();
 
 private:
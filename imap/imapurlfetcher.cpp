@@ -325,7 +325,7 @@ void ImapUrlFetcher::execute()
                             al->append( m );
                     }
                     else {
-                        if ( m->hasBodies() )
+                        if ( !m->hasBodies() )
                             bl->append( m );
                     }
                     List<UrlLink>::Iterator it( d->urls );
@@ -346,12 +346,12 @@ void ImapUrlFetcher::execute()
             d->fetchers->append( f );
         }
         if ( !hl->isEmpty() ) {
-            Fetcher * f = new Fetcher( al, this, 0 );
+            Fetcher * f = new Fetcher( hl, this, 0 );
             f->fetch( Fetcher::OtherHeader );
             d->fetchers->append( f );
         }
         if ( !bl->isEmpty() ) {
-            Fetcher * f = new Fetcher( al, this, 0 );
+            Fetcher * f = new Fetcher( bl, this, 0 );
             f->fetch( Fetcher::Body );
             d->fetchers->append( f );
         }
@@ -499,6 +499,26 @@ EString ImapUrlFetcher::error() const
 }
 
 
+/*! Returns the messages the ImapUrls refer to, each once, or an
+    empty list if the fetcher isn't done(). The messages' bodyparts
+    have database ids if their bodies were fetched.
+*/
+
+List<Message> * ImapUrlFetcher::messages() const
+{
+    List<Message> * l = new List<Message>;
+    if ( !d->done || failed() )
+        return l;
+    List<UrlLink>::Iterator it( d->urls );
+    while ( it ) {
+        if ( it->message && !l->find( it->message ) )
+            l->append( it->message );
+        ++it;
+    }
+    return l;
+}
+
+
 /*! Records the given error \a msg for the \a url. After the first call,
     done() and failed() will return true, error() will return \a msg,
     and badUrl() will return \a url. Subsequent calls are ignored.
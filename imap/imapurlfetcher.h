@@ -20,6 +20,8 @@ public:
     EString badUrl() const;
     EString error() const;
 
+    List<class Message> * messages() const;
+
 private:
     class IufData *d;
 
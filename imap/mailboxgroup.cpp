@@ -5,6 +5,11 @@
 #include "mailbox.h"
 #include "imap.h"
 #include "map.h"
+#include "graph.h"
+
+
+static GraphableCounter * groupHits = 0;
+static GraphableCounter * groupMisses = 0;
 
 
 class MailboxGroupData
@@ -59,20 +64,28 @@ MailboxGroup::MailboxGroup( List<Mailbox> * mailboxes, IMAP * imap )
 /*! Returns true if this group contains \a m, and false if not.
 
     Also updates the hits() and misses counters, and removes itself if
-    the number of misses is too large.
+    the number of misses is too large. The mailbox-group-hits and
+    mailbox-group-misses metrics show how well the guesses work.
 */
 
 bool MailboxGroup::contains( const Mailbox * m )
 {
+    if ( !::groupHits ) {
+        ::groupHits = new GraphableCounter( "mailbox-group-hits" );
+        ::groupMisses = new GraphableCounter( "mailbox-group-misses" );
+    }
+
     bool c = d->mailboxes.contains( m->id() );
     bool r = false;
     if ( c ) {
+        ::groupHits->tick();
         d->hits++;
         d->mailboxes.remove( m->id() );
         if ( d->mailboxes.isEmpty() )
             r = true;
     }
     else {
+        ::groupMisses->tick();
         d->misses++;
         if ( d->misses > 2 )
             r = true;
@@ -7,15 +7,26 @@
 #include "dict.h"
 #include "list.h"
 #include "file.h"
+#include "timer.h"
+#include "event.h"
 #include "eventloop.h"
+#include "configuration.h"
 #include "log.h"
 
-// fprintf, stderr
+// fprintf, stderr, snprintf
 #include <stdio.h>
+// atexit
+#include <stdlib.h>
 // dup
 #include <unistd.h>
 // openlog, syslog
 #include <syslog.h>
+// stat
+#include <sys/stat.h>
+// localtime, strftime
+#include <time.h>
+
+#include <pthread.h>
 
 
 static uint id;
@@ -23,6 +34,208 @@ static File *logFile;
 static Log::Severity logLevel;
 static bool useSyslog;
 
+// output() collects lines here, and flush() writes them
+static EString * pending;
+static uint logSize;
+static uint logMode = 0644;
+static bool unsynced;
+
+// the largest frame LogServer::parse() accepts
+static const uint maxFrame = 16 * 1024 * 1024;
+
+
+// fsync() can take a long time on a busy disk, and logd can't read
+// from its clients meanwhile, so the once-per-second sync is done by
+// a thread. It touches nothing but a file descriptor, so it never
+// sees memory the allocator might free. waitForSync() must be called
+// before the log file is closed.
+
+static pthread_mutex_t syncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t syncWanted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t syncDone = PTHREAD_COND_INITIALIZER;
+static int syncFd = -1;
+static bool syncing = false;
+static bool syncerStarted = false;
+static bool syncerBroken = false;
+
+
+static void * syncer( void * )
+{
+    pthread_mutex_lock( &syncLock );
+    while ( true ) {
+        while ( syncFd < 0 ) {
+            syncing = false;
+            pthread_cond_broadcast( &syncDone );
+            pthread_cond_wait( &syncWanted, &syncLock );
+        }
+        int fd = syncFd;
+        syncFd = -1;
+        syncing = true;
+        pthread_mutex_unlock( &syncLock );
+        (void)::fsync( fd );
+        pthread_mutex_lock( &syncLock );
+    }
+    return 0;
+}
+
+
+// asks the syncer thread to commit \a f to disk, or does it at once
+// if there is no thread.
+
+static void syncInBackground( File * f )
+{
+    pthread_mutex_lock( &syncLock );
+    if ( !syncerStarted && !syncerBroken ) {
+        pthread_t t;
+        if ( pthread_create( &t, 0, syncer, 0 ) == 0 ) {
+            pthread_detach( t );
+            syncerStarted = true;
+        }
+        else {
+            syncerBroken = true;
+        }
+    }
+    bool queued = false;
+    if ( syncerStarted ) {
+        syncFd = f->fd();
+        syncing = true;
+        pthread_cond_signal( &syncWanted );
+        queued = true;
+    }
+    pthread_mutex_unlock( &syncLock );
+    if ( !queued )
+        f->sync();
+}
+
+
+// waits until the syncer thread isn't using any file descriptor.
+
+static void waitForSync()
+{
+    pthread_mutex_lock( &syncLock );
+    while ( syncFd >= 0 || syncing )
+        pthread_cond_wait( &syncDone, &syncLock );
+    pthread_mutex_unlock( &syncLock );
+}
+
+
+// writes whatever output() has collected to the log file, and
+// rotates the file if it has grown too large.
+
+static void flush()
+{
+    if ( !pending || pending->isEmpty() )
+        return;
+
+    if ( !logFile ) {
+        fprintf( stderr, "%s", pending->cstr() );
+        pending->truncate();
+        return;
+    }
+
+    logFile->write( *pending );
+    logSize += pending->length();
+    pending->truncate();
+    unsynced = true;
+
+    uint limit = Configuration::scalar( Configuration::LogfileSize );
+    if ( !limit || logSize < limit * 1024 * 1024 ||
+         logFile->name().isEmpty() )
+        return;
+
+    EString name = File::chrooted( logFile->name() );
+    uint n = 4;
+    while ( n > 1 ) {
+        EString from = name + "." + fn( n - 1 );
+        EString to = name + "." + fn( n );
+        (void)::rename( from.cstr(), to.cstr() );
+        n--;
+    }
+    EString first = name + ".1";
+    (void)::rename( name.cstr(), first.cstr() );
+
+    File * l = new File( logFile->name(), File::Append, logMode );
+    if ( !l->valid() )
+        return;
+    waitForSync();
+    logFile->sync();
+    Allocator::addEternal( l, "logfile name" );
+    File * old = logFile;
+    logFile = l;
+    Allocator::removeEternal( old );
+    delete old;
+    logSize = 0;
+    unsynced = false;
+}
+
+
+// writes and commits whatever is left when logd exits.
+
+static void flushAtExit()
+{
+    ::flush();
+    waitForSync();
+    if ( unsynced && logFile )
+        logFile->sync();
+}
+
+
+// This eternal helper flushes the output once per second, and asks
+// the OS to commit what's been written in the past second to disk
+// with a single fsync() in the background.
+
+class LogFlusher
+    : public EventHandler
+{
+public:
+    LogFlusher(): t( new Timer( this, 1 ) ) { t->setRepeating( true ); }
+
+    void execute()
+    {
+        ::flush();
+        if ( unsynced && logFile )
+            syncInBackground( logFile );
+        unsynced = false;
+    }
+
+    Timer * t;
+};
+
+
+static LogFlusher * flusher;
+
+
+// returns a timestamp for \a seconds and \a ms in the format
+// LogClient used to send. localtime() is called just once per second.
+
+static EString timestamp( uint seconds, uint ms )
+{
+    static uint cachedSecond = 0;
+    static char cached[32];
+    if ( seconds != cachedSecond || !cachedSecond ) {
+        time_t tt = seconds;
+        struct tm * t = localtime( &tt );
+        strftime( cached, sizeof( cached ), "%Y-%m-%d %H:%M:%S.", t );
+        cachedSecond = seconds;
+    }
+    char result[40];
+    snprintf( result, sizeof( result ), "%s%03d", cached, ms % 1000 );
+    return result;
+}
+
+
+// returns the \a bytes-byte big-endian number at \a i in \a s.
+
+static uint binary( const EString & s, uint i, uint bytes )
+{
+    uint n = 0;
+    while ( bytes ) {
+        n = ( n << 8 ) + (unsigned char)s[i++];
+        bytes--;
+    }
+    return n;
+}
+
 
 /*! \class LogServer logserver.h
     The LogServer listens for log items on a TCP socket and commits
@@ -82,13 +295,84 @@ void LogServer::react( Event e )
 }
 
 
-/*! Parses log messages from the input buffer. */
+/*! Parses log messages from the input buffer.
+
+    Clients may send text lines (see processLine()) or binary frames.
+    A frame starts with a byte with value 1, followed by the length of
+    the rest of the frame as a four-byte big-endian number. The rest
+    is a sequence of records, each of which consists of a one-byte
+    Log::Severity, the time (four bytes of seconds since the epoch and
+    two of milliseconds), the two-byte length of the client
+    identifier, the identifier, the four-byte length of the message
+    and finally the message. All numbers are big-endian.
+
+    Whatever is parsed is written to the log file at the end.
+*/
 
 void LogServer::parse()
 {
-    EString *s;
-    while ( ( s = readBuffer()->removeLine() ) != 0 )
-        processLine( *s );
+    Buffer * r = readBuffer();
+    while ( r->size() > 0 ) {
+        if ( (*r)[0] == '\001' ) {
+            if ( r->size() < 5 )
+                break;
+            uint l = 0;
+            uint i = 1;
+            while ( i < 5 )
+                l = ( l << 8 ) + (unsigned char)(*r)[i++];
+            if ( l > maxFrame ) {
+                output( 0, Log::Error,
+                        "Overlong frame from " + d->name );
+                r->remove( r->size() );
+                close();
+                break;
+            }
+            if ( r->size() < 5 + l )
+                break;
+            r->remove( 5 );
+            processBatch( r->string( l ) );
+            r->remove( l );
+        }
+        else {
+            EString * s = r->removeLine();
+            if ( !s )
+                break;
+            processLine( *s );
+        }
+    }
+    ::flush();
+}
+
+
+/*! Adds each record in the binary frame \a b to the log output. The
+    format is described in parse().
+*/
+
+void LogServer::processBatch( const EString & b )
+{
+    uint i = 0;
+    while ( i + 13 <= b.length() ) {
+        Log::Severity s = (Log::Severity)b[i];
+        uint seconds = binary( b, i + 1, 4 );
+        uint ms = binary( b, i + 5, 2 );
+        uint il = binary( b, i + 7, 2 );
+        i += 9;
+        if ( i + il + 4 > b.length() )
+            return;
+        EString tag = b.mid( i, il );
+        i += il;
+        uint ml = binary( b, i, 4 );
+        i += 4;
+        if ( i + ml > b.length() )
+            return;
+        if ( s >= logLevel && s <= Log::Disaster ) {
+            EString m( timestamp( seconds, ms ) );
+            m.append( " " );
+            m.append( b.mid( i, ml ).simplified() );
+            output( tag, s, m );
+        }
+        i += ml;
+    }
 }
 
 
@@ -179,8 +463,13 @@ void LogServer::output( EString tag, Log::Severity s,
         return;
     }
 
-    EString msg;
-    msg.reserve( line.length() );
+    if ( !pending ) {
+        pending = new EString;
+        Allocator::addEternal( pending, "unwritten log lines" );
+    }
+
+    EString & msg = *pending;
+    msg.reserve( msg.length() + line.length() + tag.length() + 32 );
 
     msg.append( Log::severity( s ) );
     msg.append( ": " );
@@ -191,10 +480,14 @@ void LogServer::output( EString tag, Log::Severity s,
     msg.append( line );
     msg.append( "\n" );
 
-    if ( logFile )
-        logFile->write( msg );
-    else
-        fprintf( stderr, "%s", msg.cstr() );
+    // until there's an event loop to drive the LogFlusher, we write
+    // everything at once.
+    if ( !flusher && logFile && EventLoop::global() ) {
+        flusher = new LogFlusher;
+        Allocator::addEternal( flusher, "log flusher" );
+    }
+    if ( s >= Log::Error || msg.length() >= 65536 || !flusher )
+        ::flush();
 }
 
 
@@ -296,8 +589,16 @@ void LogServer::setLogFile( const EString &name, const EString &mode )
         return;
     }
 
+    ::flush();
     logFile = l;
+    logMode = m;
+    logSize = 0;
+    struct stat st;
+    if ( !name.isEmpty() && name != "-" &&
+         ::stat( File::chrooted( name ).cstr(), &st ) == 0 )
+        logSize = st.st_size;
     Allocator::addEternal( logFile, "logfile name" );
+    ::atexit( flushAtExit );
 }
 
 
@@ -361,8 +662,9 @@ void LogServer::reopen( int unused )
     if ( useSyslog )
         return;
 
+    ::flush();
     File::unlink( logFile->name() );
-    File * l = new File( logFile->name(), File::Append );
+    File * l = new File( logFile->name(), File::Append, logMode );
     if ( !l->valid() ) {
         ::log( "SIGHUP handler was unable to open new log file" +
                l->name(),
@@ -374,7 +676,10 @@ void LogServer::reopen( int unused )
            Log::Info );
     File * old = logFile;
     logFile = l;
+    logSize = 0;
     Allocator::removeEternal( old );
+    ::flush();
+    waitForSync();
     delete old;
     ::log( "SIGHUP caught. Reopened log file " + logFile->name(),
            Log::Info );
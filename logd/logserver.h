@@ -16,6 +16,7 @@ public:
     void react(Event e);
 
     void processLine( const EString & );
+    void processBatch( const EString & );
 
     static void setLogFile( const EString &, const EString & );
     static void setLogLevel( const EString & );
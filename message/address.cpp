@@ -11,6 +11,8 @@
 #include "cache.h"
 #include "dict.h"
 #include "utf.h"
+#include "event.h"
+#include "dbsignal.h"
 
 
 class AddressData
@@ -113,42 +115,84 @@ Address::Address( const UString & n, const UString & l, const UString & o )
 }
 
 
+// The table of known addresses, keyed by key(). Equal addresses share
+// one AddressData, and so one id(), as soon as any of them learns it.
+// The table survives garbage collection, and is only emptied when it
+// grows past its limit, or when the database is obliterated.
+
 class AddressCache
     : public Cache
 {
 public:
-    AddressCache(): Cache( 8 ) {}
-    void clear() { step1.clear(); }
-    UDict< UDict< UDict<AddressData> > > step1;
+    AddressCache(): Cache( 8 ), entries( 0 ) { setBudget( 65536 * 128 ); }
+    void clear() { addresses.clear(); entries = 0; }
+    uint cost() const { return entries * 128; }
+
+    UDict<AddressData> addresses;
+    uint entries;
 };
 
 static AddressCache * cache = 0;
 
 
+// empties the AddressCache when the database is obliterated, since
+// none of the ids it knows is valid any more.
+
+class AddressCacheFlusher
+    : public EventHandler
+{
+public:
+    AddressCacheFlusher(): EventHandler() {}
+    void execute() { if ( ::cache ) ::cache->clear(); }
+};
+
+
+// returns the key used for the address with display-name n, localpart
+// l and domain o in the AddressCache. the domain is case-insensitive;
+// plain ASCII domains, by far the most common, are lowercased without
+// titlecasing a copy.
+
+static UString key( const UString & n, const UString & l, const UString & o )
+{
+    UString k;
+    k.reserve( n.length() + l.length() + o.length() + 2 );
+    if ( o.isAscii() ) {
+        uint i = 0;
+        while ( i < o.length() ) {
+            uint c = o[i];
+            if ( c >= 'A' && c <= 'Z' )
+                c += 'a' - 'A';
+            k.append( c );
+            i++;
+        }
+    }
+    else {
+        k.append( o.titlecased() );
+    }
+    k.append( (uint)0 );
+    k.append( l );
+    k.append( (uint)0 );
+    k.append( n );
+    return k;
+}
+
+
 /*! This private function contains the shared part of the
     constructors, initialising the object with the display-name \a n,
     localpart \a l, and domain \a o and an appropriate type(). Uses a
-    cache to try to share the id() with other instances of the same
-    address.
+    process-wide table to share the id() with other instances of the
+    same address.
 */
 
 void Address::init( const UString &n, const UString &l, const UString &o )
 {
-    if ( !::cache )
+    if ( !::cache ) {
         ::cache = new AddressCache;
-
-    UString dl( o.titlecased() );
-    UDict< UDict<AddressData> > * step2 = ::cache->step1.find( dl );
-    if ( !step2 ) {
-        step2 = new UDict< UDict<AddressData> >;
-        ::cache->step1.insert( dl, step2 );
+        (void)new DatabaseSignal( "obliterated", new AddressCacheFlusher );
     }
-    UDict<AddressData> * step3 = step2->find( l );
-    if ( !step3 ) {
-        step3 = new UDict<AddressData>;
-        step2->insert( l, step3 );
-    }
-    d = step3->find( n );
+
+    UString k( key( n, l, o ) );
+    d = ::cache->addresses.find( k );
     if ( !d ) {
         d = new AddressData;
         d->name = n;
@@ -164,7 +208,29 @@ void Address::init( const UString &n, const UString &l, const UString &o )
                   d->localpart.isEmpty() &&
                   d->domain.isEmpty() )
             d->type = Bounce;
-        step3->insert( n, d );
+        if ( ::cache->entries >= 65536 )
+            ::cache->clear();
+        ::cache->addresses.insert( k, d );
+        ::cache->entries++;
+    }
+}
+
+
+/*! Removes this address from the table of known addresses, so that
+    equal addresses constructed later start without an id(). Existing
+    copies are not affected. The Injector calls this for the
+    addresses it used when its transaction fails, since an id() it
+    learned may belong to a row that was rolled back.
+*/
+
+void Address::uncache()
+{
+    if ( !::cache )
+        return;
+    UString k( key( d->name, d->localpart, d->domain ) );
+    if ( ::cache->addresses.find( k ) == d ) {
+        ::cache->addresses.remove( k );
+        ::cache->entries--;
     }
 }
 
@@ -458,6 +524,11 @@ AddressParser::AddressParser( EString s )
     : d( new AddressParserData )
 {
     d->s = s;
+    if ( simpleList() ) {
+        Address::uniquify( &d->a );
+        return;
+    }
+
     int i = s.length()-1;
     int j = i+1;
     bool colon = s.contains( ':' );
@@ -559,6 +630,202 @@ AddressParser::AddressParser( EString s )
 }
 
 
+// returns true if c is one of the characters atom() accepts, except
+// 8-bit ones.
+
+static bool isAtext( char c )
+{
+    return ( c >= 'a' && c <= 'z' ) ||
+        ( c >= 'A' && c <= 'Z' ) ||
+        ( c >= '0' && c <= '9' ) ||
+        c == '!' || c == '#' || c == '$' || c == '%' ||
+        c == '&' || c == '\'' || c == '*' || c == '+' ||
+        c == '-' || c == '/' || c == '=' || c == '?' ||
+        c == '^' || c == '_' || c == '`' || c == '{' ||
+        c == '|' || c == '}' || c == '~';
+}
+
+
+static bool isSpace( char c )
+{
+    return c == ' ' || c == 9 || c == 10 || c == 13;
+}
+
+
+// parses the addr-spec in s from i to (but not including) e, which
+// must be a dot-atom localpart and a domain containing only letters,
+// digits, '-' and '_', and sets lp and dom. returns false for
+// anything else, including domains that look like IPv4 addresses.
+
+static bool simpleAddrSpec( const EString & s, uint i, uint e,
+                            UString & lp, UString & dom )
+{
+    uint a = i;
+    while ( a < e && s[a] != '@' )
+        a++;
+    if ( a == i || a >= e - 1 || a - i > 256 )
+        return false;
+    uint j = i;
+    while ( j < a ) {
+        if ( s[j] == '.' ) {
+            if ( j == i || j == a - 1 || s[j+1] == '.' )
+                return false;
+        }
+        else if ( !isAtext( s[j] ) || ( s[j] == '%' ) ) {
+            return false;
+        }
+        j++;
+    }
+    j = a + 1;
+    while ( j < e ) {
+        char c = s[j];
+        if ( c == '.' ) {
+            if ( j == a + 1 || j == e - 1 || s[j+1] == '.' )
+                return false;
+        }
+        else if ( !( ( c >= 'a' && c <= 'z' ) ||
+                     ( c >= 'A' && c <= 'Z' ) ||
+                     ( c >= '0' && c <= '9' ) ||
+                     c == '-' || c == '_' ) ) {
+            return false;
+        }
+        j++;
+    }
+    if ( s[e-1] >= '0' && s[e-1] <= '9' )
+        return false;
+    lp.truncate();
+    lp.append( s.data() + i, a - i );
+    dom.truncate();
+    dom.append( s.data() + a + 1, e - a - 1 );
+    return true;
+}
+
+
+class SimpleAddress
+    : public Garbage
+{
+public:
+    UString name;
+    UString localpart;
+    UString domain;
+};
+
+
+/*! This private helper parses the whole of d->s in a single forward
+    pass, provided that it's a plain list of addr-spec and
+    display-name <addr-spec> entries, which most address fields
+    are. If so, it adds the addresses just as the full parser would
+    and returns true. If the field contains anything else, such as
+    comments, groups, encoded-words, 8-bit text, quoted-pairs or
+    dots in a display-name, simpleList() returns false without
+    having added anything, and the full parser has to do the work.
+*/
+
+bool AddressParser::simpleList()
+{
+    const EString & s = d->s;
+    uint l = s.length();
+    if ( !l || s.contains( "=?" ) )
+        return false;
+
+    List<SimpleAddress> found;
+    uint i = 0;
+    while ( i < l && isSpace( s[i] ) )
+        i++;
+    while ( i < l ) {
+        SimpleAddress * a = new SimpleAddress;
+        EString name;
+        bool angle = false;
+        bool bare = false;
+        while ( !angle && !bare ) {
+            if ( i >= l ) {
+                return false;
+            }
+            else if ( s[i] == '<' ) {
+                uint e = i + 1;
+                while ( e < l && s[e] != '>' )
+                    e++;
+                if ( e >= l ||
+                     !simpleAddrSpec( s, i + 1, e, a->localpart,
+                                      a->domain ) )
+                    return false;
+                i = e + 1;
+                angle = true;
+            }
+            else if ( s[i] == '"' ) {
+                uint e = i + 1;
+                while ( e < l && s[e] != '"' ) {
+                    if ( s[e] < 32 || s[e] >= 127 || s[e] == '\\' )
+                        return false;
+                    e++;
+                }
+                if ( e >= l )
+                    return false;
+                if ( !name.isEmpty() )
+                    name.append( ' ' );
+                name.append( s.mid( i + 1, e - i - 1 ) );
+                i = e + 1;
+            }
+            else if ( isAtext( s[i] ) ) {
+                uint e = i;
+                bool at = false;
+                bool dot = false;
+                while ( e < l &&
+                        ( isAtext( s[e] ) || s[e] == '.' || s[e] == '@' ) ) {
+                    if ( s[e] == '@' )
+                        at = true;
+                    else if ( s[e] == '.' )
+                        dot = true;
+                    e++;
+                }
+                if ( at ) {
+                    if ( !name.isEmpty() ||
+                         !simpleAddrSpec( s, i, e, a->localpart,
+                                          a->domain ) )
+                        return false;
+                    bare = true;
+                }
+                else if ( dot ) {
+                    return false;
+                }
+                else {
+                    if ( !name.isEmpty() )
+                        name.append( ' ' );
+                    name.append( s.mid( i, e - i ) );
+                }
+                i = e;
+            }
+            else {
+                return false;
+            }
+            while ( i < l && isSpace( s[i] ) )
+                i++;
+        }
+        if ( i < l ) {
+            if ( s[i] != ',' )
+                return false;
+            i++;
+            while ( i < l && isSpace( s[i] ) )
+                i++;
+            if ( i >= l )
+                return false;
+        }
+        if ( angle )
+            a->name.append( name.data(), name.length() );
+        a->name = a->name.simplified();
+        found.prepend( a );
+    }
+
+    // add() prepends, so we add the last address first
+    List<SimpleAddress>::Iterator a( found );
+    while ( a ) {
+        add( a->name, a->localpart, a->domain );
+        ++a;
+    }
+    return true;
+}
+
+
 /*! Finds the point between \a left and \a right which is most likely
     to be the border between two addresses. Mucho heuristics. Never
     used for correct addresses, only when we're grasping at straws.
@@ -1708,7 +1975,18 @@ void AddressParser::route( int & i )
 
 void Address::setError( const EString & message )
 {
-    d->error = message;
+    if ( message == d->error )
+        return;
+    // d may be shared with every other instance of this address, so
+    // the error must go into a private copy
+    AddressData * c = new AddressData;
+    c->id = d->id;
+    c->name = d->name;
+    c->localpart = d->localpart;
+    c->domain = d->domain;
+    c->type = d->type;
+    c->error = message;
+    d = c;
 }
 
 
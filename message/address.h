@@ -26,6 +26,7 @@ public:
 
     uint id() const;
     void setId( uint );
+    void uncache();
 
     EString name( bool ) const;
     UString uname() const;
@@ -81,6 +82,7 @@ private:
     void route( int & );
     int findBorder( int, int );
 
+    bool simpleList();
     void error( const char *, int );
 
     void add( UString, const UString &, const UString & );
@@ -163,6 +163,7 @@ void AddressField::parse( const EString &s )
 
 EString AddressField::rfc822( bool avoidUtf8 ) const
 {
+    parseIfNeeded();
     EString s;
     s.reserve( 30 * addresses()->count() );
     HeaderField::Type t = type();
@@ -248,6 +249,7 @@ EString AddressField::rfc822( bool avoidUtf8 ) const
 
 UString AddressField::value() const
 {
+    parseIfNeeded();
     if ( addresses()->isEmpty() )
         return HeaderField::value();
     // and for message-id, content-id and references:
@@ -371,6 +373,7 @@ void AddressField::parseContentId( const EString & s )
 
 List< Address > *AddressField::addresses() const
 {
+    parseIfNeeded();
     return a;
 }
 
@@ -379,6 +382,7 @@ List< Address > *AddressField::addresses() const
 
 void AddressField::setAddresses( List<Address>* addr )
 {
+    parseIfNeeded();
     a->clear();
     a->append( addr );
 }
@@ -407,6 +411,7 @@ void AddressField::outlawBounce()
 
 bool AddressField::needsUnicode() const
 {
+    parseIfNeeded();
     List< Address >::Iterator it( a );
     while ( it ) {
         if ( it->needsUnicode() )
@@ -0,0 +1,218 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "blobstore.h"
+
+#include "configuration.h"
+#include "file.h"
+#include "log.h"
+
+// stat, mkdir
+#include <sys/stat.h>
+#include <sys/types.h>
+// opendir, readdir
+#include <dirent.h>
+// getpid, link
+#include <unistd.h>
+// errno
+#include <errno.h>
+// utime
+#include <utime.h>
+// time
+#include <time.h>
+// SHA256
+#include <openssl/sha.h>
+
+
+/*! \class BlobStore blobstore.h
+
+    The BlobStore class keeps large bodyparts in the file system
+    instead of in the database.
+
+    If blob-directory is set, Injector hands each bodypart whose data
+    is at least blob-threshold bytes long to store(), and the
+    bodyparts row records only that the data is external. The file
+    is named by key(), a SHA-256 hash of the data, which the row
+    stores in place of the usual MD5 hash. Identical attachments
+    share a file just as they share a row, and Fetcher uses fetch()
+    to read it back when the data is needed. (Rows written before
+    key() existed name their files by MD5, which is harmless since
+    the names can't clash.)
+
+    A file is never overwritten once it exists, since other rows may
+    refer to it.
+
+    Files are written before the injecting transaction commits, so a
+    failed injection can leave a file nothing refers to. "aox vacuum"
+    removes such files along with those of deleted bodyparts.
+*/
+
+
+/*! Returns true if data \a size bytes long should be stored in the
+    BlobStore, and false if it belongs in the database.
+*/
+
+bool BlobStore::wanted( uint size )
+{
+    if ( Configuration::text( Configuration::BlobDir ).isEmpty() )
+        return false;
+    uint threshold = Configuration::scalar( Configuration::BlobThreshold );
+    return size >= threshold;
+}
+
+
+/*! Returns the hex SHA-256 hash of \a data, which is what names the
+    file holding \a data. Unlike MD5, nobody can make two different
+    attachments with the same SHA-256 hash, so a file with this name
+    is known to hold \a data.
+*/
+
+EString BlobStore::key( const EString & data )
+{
+    unsigned char h[SHA256_DIGEST_LENGTH];
+    ::SHA256( (const unsigned char *)data.data(), data.length(), h );
+    return EString( (const char *)h, SHA256_DIGEST_LENGTH ).hex();
+}
+
+
+/*! Returns the name of the file that holds the blob whose key() (or,
+    for old rows, hex MD5 hash) is \a hash. The first two digits of
+    the hash name a subdirectory, so that no single directory grows
+    too large.
+*/
+
+EString BlobStore::fileName( const EString & hash )
+{
+    EString f = Configuration::text( Configuration::BlobDir );
+    f.append( '/' );
+    f.append( hash.mid( 0, 2 ) );
+    f.append( '/' );
+    f.append( hash );
+    return f;
+}
+
+
+/*! Writes \a data to the file for \a hash, which should be
+    key( \a data ), unless that file exists already. Returns true if
+    the file holds \a data afterwards, and false (after logging the
+    reason) if \a data could not be written, or if an existing file
+    of that name has different contents. An existing file is never
+    overwritten.
+
+    The data is written to a temporary file and linked into place,
+    so that a concurrent fetch() never sees a partial file, and so
+    that a file created by another process meanwhile isn't replaced.
+*/
+
+bool BlobStore::store( const EString & hash, const EString & data )
+{
+    EString name = fileName( hash );
+    EString chn = File::chrooted( name );
+
+    // if the file exists, touching it stops removeUnused() from
+    // deleting it before our row is committed.
+
+    struct stat st;
+    if ( ::stat( chn.cstr(), &st ) == 0 ) {
+        if ( (uint)st.st_size != data.length() ) {
+            log( name + " exists, but does not hold the data to be "
+                 "stored", Log::Error );
+            return false;
+        }
+        ::utime( chn.cstr(), 0 );
+        return true;
+    }
+
+    EString dir = chn.mid( 0, chn.length() - hash.length() - 1 );
+    ::mkdir( dir.cstr(), 0700 );
+
+    EString tmp = name;
+    tmp.append( ".new-" );
+    tmp.appendNumber( getpid() );
+
+    File f( tmp, File::Write, 0600 );
+    if ( !f.valid() ) {
+        log( "Could not open " + tmp + " for writing", Log::Error );
+        return false;
+    }
+    f.write( data );
+
+    EString cht = File::chrooted( tmp );
+    bool ok = ::stat( cht.cstr(), &st ) == 0 &&
+              (uint)st.st_size == data.length();
+    if ( ok && ::link( cht.cstr(), chn.cstr() ) < 0 ) {
+        // if another process stored the same key meanwhile, its file
+        // holds the same data
+        ok = errno == EEXIST && ::stat( chn.cstr(), &st ) == 0 &&
+             (uint)st.st_size == data.length();
+    }
+    File::unlink( tmp );
+    if ( !ok )
+        log( "Could not write " + name, Log::Error );
+    return ok;
+}
+
+
+/*! Returns the contents of the blob whose hex MD5 hash is \a hash,
+    or an empty string (after logging an error) if it cannot be read.
+*/
+
+EString BlobStore::fetch( const EString & hash )
+{
+    File f( fileName( hash ) );
+    if ( !f.valid() ) {
+        log( "Could not read " + fileName( hash ), Log::Error );
+        return "";
+    }
+    return f.contents();
+}
+
+
+/*! Deletes each file in the blob directory whose name isn't in \a
+    used and which hasn't been modified for \a age seconds, and
+    returns the number of files deleted.
+
+    The age limit protects files written by injections that haven't
+    committed yet.
+*/
+
+uint BlobStore::removeUnused( const Dict<void> & used, uint age )
+{
+    EString root = File::chrooted(
+        Configuration::text( Configuration::BlobDir ) );
+    uint limit = (uint)::time( 0 ) - age;
+    uint removed = 0;
+
+    DIR * top = opendir( root.cstr() );
+    if ( !top )
+        return 0;
+
+    struct dirent * sub = readdir( top );
+    while ( sub ) {
+        EString dir = root;
+        dir.append( '/' );
+        dir.append( sub->d_name );
+        DIR * dp = 0;
+        if ( sub->d_name[0] != '.' )
+            dp = opendir( dir.cstr() );
+        struct dirent * de = dp ? readdir( dp ) : 0;
+        while ( de ) {
+            EString name( de->d_name );
+            EString f = dir;
+            f.append( '/' );
+            f.append( name );
+            struct stat st;
+            if ( name[0] != '.' && !used.contains( name ) &&
+                 ::stat( f.cstr(), &st ) == 0 && S_ISREG( st.st_mode ) &&
+                 (uint)st.st_mtime < limit &&
+                 ::unlink( f.cstr() ) == 0 )
+                removed++;
+            de = readdir( dp );
+        }
+        if ( dp )
+            closedir( dp );
+        sub = readdir( top );
+    }
+    closedir( top );
+
+    return removed;
+}
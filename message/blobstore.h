@@ -0,0 +1,26 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef BLOBSTORE_H
+#define BLOBSTORE_H
+
+#include "estring.h"
+#include "dict.h"
+
+
+class BlobStore
+    : public Garbage
+{
+public:
+    static bool wanted( uint );
+
+    static EString key( const EString & );
+    static EString fileName( const EString & );
+
+    static bool store( const EString &, const EString & );
+    static EString fetch( const EString & );
+
+    static uint removeUnused( const Dict<void> &, uint );
+};
+
+
+#endif
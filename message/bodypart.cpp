@@ -12,8 +12,14 @@
 #include "unknown.h"
 #include "iso2022jp.h"
 #include "mimefields.h"
+#include "blobstore.h"
 #include "log.h"
 
+// deflate, inflate
+#include <zlib.h>
+// memcmp
+#include <string.h>
+
 
 class BodypartData
     : public Garbage
@@ -22,7 +28,7 @@ public:
     BodypartData()
         : id( 0 ), number( 0 ), message( 0 ),
           numBytes( 0 ), numEncodedBytes(), numEncodedLines( 0 ),
-          hasText( false )
+          hasText( false ), compressed( false )
     {}
 
     uint id;
@@ -37,6 +43,8 @@ public:
     EString data;
     UString text;
     bool hasText;
+    bool compressed;
+    EString blob;
     EString error;
 };
 
@@ -162,6 +170,14 @@ EString::Encoding Bodypart::contentTransferEncoding() const
 
 EString Bodypart::data() const
 {
+    if ( !d->blob.isEmpty() ) {
+        d->data = BlobStore::fetch( d->blob );
+        d->blob.truncate();
+    }
+    else if ( d->compressed ) {
+        d->data = uncompressed( d->data );
+        d->compressed = false;
+    }
     return d->data;
 }
 
@@ -173,6 +189,95 @@ EString Bodypart::data() const
 void Bodypart::setData( const EString &s )
 {
     d->data = s;
+    d->compressed = false;
+    d->blob.truncate();
+}
+
+
+/*! Sets the data of this Bodypart to the uncompressed() form of \a
+    s. Decompression is deferred until data() is called, so parts that
+    aren't used needn't be decompressed at all.
+*/
+
+void Bodypart::setCompressedData( const EString &s )
+{
+    d->data = s;
+    d->compressed = true;
+    d->blob.truncate();
+}
+
+
+/*! Records that the data of this Bodypart is kept in the BlobStore
+    under \a hash. The file is read only when data() is called.
+*/
+
+void Bodypart::setExternalData( const EString & hash )
+{
+    d->data.truncate();
+    d->compressed = false;
+    d->blob = hash;
+}
+
+
+/*! Returns \a s compressed using zlib, or an empty string if zlib
+    fails for some reason.
+*/
+
+EString Bodypart::compressed( const EString & s )
+{
+    EString r;
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    if ( ::deflateInit( &zs, Z_DEFAULT_COMPRESSION ) != Z_OK )
+        return r;
+
+    uint max = ::deflateBound( &zs, s.length() );
+    r.reserve( max );
+    zs.next_in = (Bytef *)s.data();
+    zs.avail_in = s.length();
+    zs.next_out = (Bytef *)r.data();
+    zs.avail_out = max;
+    int e = ::deflate( &zs, Z_FINISH );
+    if ( e == Z_STREAM_END )
+        r.setLength( zs.total_out );
+    else
+        r.setLength( 0 );
+    ::deflateEnd( &zs );
+    return r;
+}
+
+
+/*! Returns the uncompressed form of \a s, which must have been
+    produced by compressed(). Returns as much as could be decompressed
+    if \a s is damaged.
+*/
+
+EString Bodypart::uncompressed( const EString & s )
+{
+    EString r;
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    zs.next_in = (Bytef *)s.data();
+    zs.avail_in = s.length();
+    if ( ::inflateInit( &zs ) != Z_OK )
+        return r;
+
+    uint max = s.length() * 4 + 1024;
+    int e = Z_OK;
+    while ( e == Z_OK ) {
+        r.reserve( max );
+        zs.next_out = (Bytef *)r.data() + zs.total_out;
+        zs.avail_out = max - zs.total_out;
+        e = ::inflate( &zs, Z_NO_FLUSH );
+        r.setLength( zs.total_out );
+        max = max * 2;
+    }
+    ::inflateEnd( &zs );
+    return r;
 }
 
 
@@ -186,7 +291,7 @@ UString Bodypart::text() const
         return d->text;
 
     Utf8Codec c;
-    return c.toUnicode( d->data );
+    return c.toUnicode( data() );
 }
 
 
@@ -295,7 +400,7 @@ EString Bodypart::asText( bool avoidUtf8 ) const
               header()->contentType()->type() == "text" )
         r = c->fromUnicode( text() );
     else
-        r = d->data.e64( 72 );
+        r = data().e64( 72 );
     return r;
 }
 
@@ -319,81 +424,108 @@ void Bodypart::parseMultipart( uint i, uint end,
     uint start = 0;
     bool last = false;
     uint pn = 1;
+    EString boundary = "--" + divider;
     while ( !last && i <= end ) {
-        if ( i >= end ||
-             ( rfc2822[i] == '-' && rfc2822[i+1] == '-' &&
-               ( i == 0 || rfc2822[i-1] == 13 || rfc2822[i-1] == 10 ) &&
-               rfc2822[i+2] == divider[0] &&
-               rfc2822.mid( i+2, divider.length() ) == divider ) )
-        {
-            uint j = i;
-            bool l = false;
-            if ( i >= end ) {
+        // skip straight to the next line that may be a boundary line
+        int b = -1;
+        if ( i < end && !divider.isEmpty() )
+            b = rfc2822.findLine( boundary, i );
+        if ( b < 0 || (uint)b >= end )
+            i = end;
+        else
+            i = b;
+
+        uint j = i;
+        bool l = false;
+        bool found = false;
+        if ( i >= end ) {
+            l = true;
+        }
+        else {
+            j = i + 2 + divider.length();
+            if ( rfc2822[j] == '-' && rfc2822[j+1] == '-' ) {
+                j += 2;
                 l = true;
             }
-            else {
-                j = i + 2 + divider.length();
-                if ( rfc2822[j] == '-' && rfc2822[j+1] == '-' ) {
-                    j += 2;
-                    l = true;
-                }
-            }
-            while ( rfc2822[j] == ' ' || rfc2822[j] == '\t' )
+        }
+        while ( rfc2822[j] == ' ' || rfc2822[j] == '\t' )
+            j++;
+        if ( rfc2822[j] == 13 || rfc2822[j] == 10 ||
+             j >= rfc2822.length() ) {
+            // finally. we accept that as a boundary line.
+            found = true;
+            if ( rfc2822[j] == 13 )
+                j++;
+            if ( rfc2822[j] == 10 )
                 j++;
-            if ( rfc2822[j] == 13 || rfc2822[j] == 10 ||
-                 j >= rfc2822.length() ) {
-                // finally. we accept that as a boundary line.
-                if ( rfc2822[j] == 13 )
-                    j++;
-                if ( rfc2822[j] == 10 )
-                    j++;
-                if ( start > 0 ) {
-                    Header * h = Message::parseHeader( start, j,
-                                                       rfc2822,
-                                                       Header::Mime );
-                    if ( digest )
-                        h->setDefaultType( Header::MessageRfc822 );
-                    h->repair();
-                    ContentType * ct = h->contentType();
-                    if ( ct && ct->type() == "multipart" && ct->subtype() == "signed" ) {
-                        Multipart * ancestor = parent;
-                        while ( ancestor->parent() != NULL )
-                            ancestor = ancestor->parent();  
-                        if ( ancestor->isMessage() ) {
-                            ::log( "Bodypart::parseMultipart - mark message signed", Log::Debug );
-                            Message *msg = (Message *)ancestor;
-                            msg->setPGPsignedPart( true );
-                        } else
-                            ::log( "Bodypart::parseMultipart - problem, no parent message found", Log::Error );
-                    }
-
-                    // Strip the [CR]LF that belongs to the boundary.
-                    if ( rfc2822[i-1] == 10 ) {
+            if ( start > 0 ) {
+                Header * h = Message::parseHeader( start, j,
+                                                   rfc2822,
+                                                   Header::Mime );
+                if ( digest )
+                    h->setDefaultType( Header::MessageRfc822 );
+                h->repair();
+                ContentType * ct = h->contentType();
+                if ( ct && ct->type() == "multipart" && ct->subtype() == "signed" ) {
+                    Multipart * ancestor = parent;
+                    while ( ancestor->parent() != NULL )
+                        ancestor = ancestor->parent();  
+                    if ( ancestor->isMessage() ) {
+                        ::log( "Bodypart::parseMultipart - mark message signed", Log::Debug );
+                        Message *msg = (Message *)ancestor;
+                        msg->setPGPsignedPart( true );
+                    } else
+                        ::log( "Bodypart::parseMultipart - problem, no parent message found", Log::Error );
+                }
+
+                // Strip the [CR]LF that belongs to the boundary.
+                if ( rfc2822[i-1] == 10 ) {
+                    i--;
+                    if ( rfc2822[i-1] == 13 )
                         i--;
-                        if ( rfc2822[i-1] == 13 )
-                            i--;
-                    }
+                }
   
-                    Bodypart * bp = parseBodypart( start, i, rfc2822, h, parent );
-                    bp->d->number = pn;
-                    children->append( bp );
-                    pn++;
+                Bodypart * bp = parseBodypart( start, i, rfc2822, h, parent );
+                bp->d->number = pn;
+                children->append( bp );
+                pn++;
 
-                    h->repair( bp, "" );
-                }
-                last = l;
-                start = j;
-                i = j;
+                h->repair( bp, "" );
             }
+            last = l;
+            start = j;
+            i = j;
         }
-        while ( i < end && rfc2822[i] != 13 && rfc2822[i] != 10 )
-            i++;
-        while ( i < end && ( rfc2822[i] == 13 || rfc2822[i] == 10 ) )
+        // the line at i cannot be a boundary line, so look past
+        // it. (if there's no boundary at end, this ends the loop.)
+        if ( i < end || !found )
             i++;
     }
 }
 
 
+// returns the state AsciiCodec::toUnicode() would leave behind for
+// \a s, without building the UString. this stops at the first 8-bit
+// byte, so it's cheap for the bodies which need a guess.
+
+static Codec::State asciiState( const EString & s )
+{
+    if ( Codec::asciiSpan( s, 0 ) < s.length() )
+        return Codec::Invalid;
+    Codec::State r = Codec::Valid;
+    uint i = 0;
+    while ( i < s.length() ) {
+        char c = s[i];
+        if ( c == 0 )
+            return Codec::Invalid;
+        if ( c < 32 && c != 10 && c != 13 && c != 9 )
+            r = Codec::BadlyFormed;
+        i++;
+    }
+    return r;
+}
+
+
 static Codec * guessTextCodec( const EString & body )
 {
     // step 1. try iso-2022-jp. this goes first because it's so
@@ -410,7 +542,7 @@ static Codec * guessTextCodec( const EString & body )
 
     // step 2. could it be pure ascii?
     Codec * a = new AsciiCodec;
-    (void)a->toUnicode( body );
+    a->setState( asciiState( body ) );
     if ( a->wellformed() )
         return a;
 
@@ -601,10 +733,12 @@ Bodypart * Bodypart::parseBodypart( uint start, uint end,
                 // Some MTAs appear to say this in case there is no
                 // Content-Type field - without checking whether the
                 // body actually is ASCII. If it isn't, we'd better
-                // call our charset guesser.
-                (void)c->toUnicode( body );
-                if ( !c->valid() )
+                // call our charset guesser. (The conversion is only
+                // for the sake of c->error().)
+                if ( asciiState( body ) == Codec::Invalid ) {
+                    (void)c->toUnicode( body );
                     specified = false;
+                }
                 // Not pretty.
             }
         }
@@ -792,12 +926,20 @@ Bodypart * Bodypart::parseBodypart( uint start, uint end,
         body = m->rfc822( false );
     }
 
+    bool countLines = bp->d->hasText ||
+                      ( ct->type() == "message" && ct->subtype() == "rfc822" );
     bp->d->numBytes = body.length();
-    if ( cte )
-        body = body.encoded( cte->encoding(), 72 );
-    bp->d->numEncodedBytes = body.length();
-    if ( bp->d->hasText ||
-         ( ct->type() == "message" && ct->subtype() == "rfc822" ) ) {
+    if ( cte && cte->encoding() == EString::Base64 && !countLines ) {
+        // don't make a base64 copy of an attachment just to learn
+        // its size
+        bp->d->numEncodedBytes = EString::e64Length( body.length(), 72 );
+    }
+    else {
+        if ( cte )
+            body = body.encoded( cte->encoding(), 72 );
+        bp->d->numEncodedBytes = body.length();
+    }
+    if ( countLines ) {
         uint n = 0;
         uint i = 0;
         uint l = body.length();
@@ -29,6 +29,11 @@ public:
 
     EString data() const;
     void setData( const EString & );
+    void setCompressedData( const EString & );
+    void setExternalData( const EString & );
+
+    static EString compressed( const EString & );
+    static EString uncompressed( const EString & );
 
     Message * message() const;
     void setMessage( Message * );
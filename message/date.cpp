@@ -295,19 +295,133 @@ static bool weekday( const EString & name )
 }
 
 
+// parses \a n digits at \a i in \a s and returns their value, or -1
+// if any of them isn't a digit.
+static int digits( const EString & s, uint i, uint n )
+{
+    int r = 0;
+    uint e = i + n;
+    if ( e > s.length() )
+        return -1;
+    while ( i < e ) {
+        char c = s[i];
+        if ( c < '0' || c > '9' )
+            return -1;
+        r = r * 10 + c - '0';
+        i++;
+    }
+    return r;
+}
+
+
+// parses \a s into \a d if it's in the form every sane mailer uses,
+// "Tue, 13 Dec 2003 12:34:56 +0100 (CET)", with or without the day of
+// week and zone name. returns true if it did, and false (leaving d
+// partly filled in) if the general parser has to look at s.
+
+static bool canonical( const EString & s, DateData * d )
+{
+    uint i = 0;
+    uint e = s.length();
+    while ( i < e && ( s[i] == ' ' || s[i] == '\t' ) )
+        i++;
+    while ( e > i && ( s[e-1] == ' ' || s[e-1] == '\t' ) )
+        e--;
+
+    if ( i + 4 < e && s[i] > '9' && s[i+3] == ',' && s[i+4] == ' ' ) {
+        uint w = 0;
+        while ( w < 7 &&
+                ( s[i] != weekdays[w][0] ||
+                  s[i+1] != weekdays[w][1] ||
+                  s[i+2] != weekdays[w][2] ) )
+            w++;
+        if ( w == 7 )
+            return false;
+        i += 5;
+    }
+
+    uint n = ( i + 1 < e && s[i+1] == ' ' ) ? 1 : 2;
+    d->day = digits( s, i, n );
+    i += n;
+    if ( d->day < 0 || i + 24 > e || s[i] != ' ' || s[i+4] != ' ' )
+        return false;
+    d->month = 0;
+    while ( d->month < 12 &&
+            ( s[i+1] != months[d->month][0] ||
+              s[i+2] != months[d->month][1] ||
+              s[i+3] != months[d->month][2] ) )
+        d->month++;
+    if ( d->month == 12 )
+        return false;
+    d->month++;
+    i += 5;
+
+    // "2003 12:34:56 +0100", exactly
+    if ( s[i] == '0' || s[i+4] != ' ' || s[i+7] != ':' ||
+         s[i+10] != ':' || s[i+13] != ' ' ||
+         ( s[i+14] != '+' && s[i+14] != '-' ) )
+        return false;
+    d->year = digits( s, i, 4 );
+    d->hour = digits( s, i+5, 2 );
+    d->minute = digits( s, i+8, 2 );
+    d->second = digits( s, i+11, 2 );
+    int zh = digits( s, i+15, 2 );
+    int zm = digits( s, i+17, 2 );
+    if ( d->year < 0 || d->hour < 0 || d->hour > 23 ||
+         d->minute < 0 || d->minute > 59 ||
+         d->second < 0 || d->second > 60 ||
+         zh < 0 || zh > 29 || zm < 0 || zm > 59 )
+        return false;
+    d->tz = zh * 60 + zm;
+    if ( s[i+14] == '-' ) {
+        d->tz = 0 - d->tz;
+        if ( d->tz == 0 )
+            d->minus0 = true;
+    }
+    i += 19;
+
+    if ( i == e )
+        return true;
+
+    // " (cet)", which we use if it agrees with the numeric zone
+    if ( i + 3 > e || s[i] != ' ' || s[i+1] != '(' || s[e-1] != ')' )
+        return false;
+    EString tzn = s.mid( i + 2, e - i - 3 ).lower();
+    uint j = 0;
+    while ( j < tzn.length() && tzn[j] >= 'a' && tzn[j] <= 'z' )
+        j++;
+    if ( j == 0 || j < tzn.length() )
+        return false;
+    if ( d->minus0 )
+        return true;
+    j = 0;
+    while ( zones[j].name != 0 && zones[j].name != tzn )
+        j++;
+    if ( zones[j].name != 0 && zones[j].offset == d->tz )
+        d->tzn = zones[j].name;
+    return true;
+}
+
+
 /*! Sets this date object to reflect the RFC 2822-format date \a s. If
     there are any syntax errors, the date is set to be invalid.
 
-    A number of common syntax errors are accepted.
+    A number of common syntax errors are accepted. The common, correct
+    form is recognised without the help of a Parser.
 */
 
 void Date::setRfc822( const EString & s )
 {
+    d->reset();
+    if ( ::canonical( s, d ) ) {
+        setParsed();
+        return;
+    }
+    d->reset();
+
     EmailParser p( s );
     EString a;
 
-    d->reset();
-
     // we'll understand 2822, but a bit kinder.
 
     // perhaps this is all bad. perhaps we should scan the string for
@@ -528,6 +642,16 @@ void Date::setRfc822( const EString & s )
             d->year += 1900;
     }
 
+    setParsed();
+}
+
+
+/*! Marks the newly parsed date as valid, and then checks that it
+    really is, and that its time zone is one we can store.
+*/
+
+void Date::setParsed()
+{
     d->valid = true;
     checkHarder();
     if ( !d->valid )
@@ -46,6 +46,8 @@ public:
 
 private:
     class DateData * d;
+
+    void setParsed();
 };
 
 
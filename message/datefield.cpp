@@ -6,6 +6,17 @@
 #include "codec.h"
 
 
+class DateFieldData
+    : public Garbage
+{
+public:
+    DateFieldData(): date( 0 ) {}
+
+    ::Date * date;
+    UString value;
+};
+
+
 /*! \class DateField datefield.h
     Represents a single Date field (inherits from HeaderField).
 
@@ -16,27 +27,42 @@
 
 
 DateField::DateField( HeaderField::Type t )
-    : HeaderField( t )
+    : HeaderField( t ), d( new DateFieldData )
 {
 }
 
 
 void DateField::parse( const EString &s )
 {
-    ::Date d;
-    d.setRfc822( s );
+    ::Date * date = new ::Date;
+    date->setRfc822( s );
     AsciiCodec a;
-    setValue( a.toUnicode( d.rfc822() ) );
-    if ( !date()->valid() )
+    setValue( a.toUnicode( date->rfc822() ) );
+    if ( !date->valid() ) {
         setError( "Could not parse " + s.quoted() );
+    }
+    else {
+        // the value is date's own rfc822(), so date() needn't
+        // parse it again
+        d->date = date;
+        d->value = value();
+    }
 }
 
 
-/*! Returns a pointer to the Date object contained by this field. */
+/*! Returns a pointer to the Date object contained by this field.
+
+    The date is parsed from value() the first time it's needed, and
+    again only if the value has changed since.
+*/
 
 ::Date * DateField::date() const
 {
-    ::Date * r = new ::Date;
-    r->setRfc822( value().ascii() );
-    return r;
+    UString v = value();
+    if ( !d->date || v != d->value ) {
+        d->date = new ::Date;
+        d->date->setRfc822( v.ascii() );
+        d->value = v;
+    }
+    return d->date;
 }
@@ -16,6 +16,9 @@ public:
     void parse( const EString & );
 
     ::Date *date() const;
+
+private:
+    class DateFieldData * d;
 };
 
 
@@ -3,7 +3,9 @@
 #include "fetcher.h"
 
 #include "addressfield.h"
+#include "configuration.h"
 #include "transaction.h"
+#include "estringlist.h"
 #include "integerset.h"
 #include "allocator.h"
 #include "bodypart.h"
@@ -13,14 +15,187 @@
 #include "message.h"
 #include "ustring.h"
 #include "buffer.h"
+#include "server.h"
+#include "hashmap.h"
+#include "cache.h"
 #include "query.h"
 #include "scope.h"
-#include "timer.h"
 #include "utf.h"
 #include "map.h"
 #include "log.h"
+#include "graph.h"
 
-#include <time.h> // time()
+// gettimeofday
+#include <sys/time.h>
+
+
+// the first batch should produce responses quickly, later batches
+// should each take about this long, so that the per-query overhead
+// doesn't matter.
+static const uint firstBatchSize = 512;
+static const uint batchTarget = 3000; // ms
+
+static GraphableDataSet * batchSizes = 0;
+static GraphableDataSet * batchTimes = 0;
+
+
+// Remembers the rows the decoders have seen for recently fetched
+// messages, keyed by message id and Fetcher::Type. A message's
+// bodyparts, header fields, address fields and part numbers never
+// change once it has been injected, so the rows never become stale
+// and are never invalidated. Instead, the least recently used
+// entries are discarded when the rows cost more than an eighth of
+// memory-limit. Trivia and projected fetches aren't cached.
+
+class FetchedRowCache
+    : public Cache
+{
+public:
+    FetchedRowCache()
+        : Cache( 1 ), bytes( 0 ), newest( 0 ), oldest( 0 ) {
+        reconfigure();
+    }
+
+    class Entry
+        : public Garbage
+    {
+    public:
+        Entry(): Garbage(), message( 0 ), type( Fetcher::Body ),
+                 rows( 0 ), cost( 0 ), newer( 0 ), older( 0 ) {}
+        uint message;
+        Fetcher::Type type;
+        List<Row> * rows;
+        uint cost;
+        Entry * newer;
+        Entry * older;
+    };
+
+    void clear();
+    void shrink();
+    uint cost() const { return bytes; }
+    void reconfigure();
+
+    List<Row> * find( uint, Fetcher::Type );
+    void insert( uint, Fetcher::Type, List<Row> * );
+
+    HashMap<Entry> entries[Fetcher::Trivia + 1];
+    uint bytes;
+    Entry * newest;
+    Entry * oldest;
+
+    void unlink( Entry * );
+    void use( Entry * );
+};
+
+static FetchedRowCache * rowCache = 0;
+static GraphableCounter * rowCacheHits = 0;
+static GraphableCounter * rowCacheMisses = 0;
+
+
+void FetchedRowCache::clear()
+{
+    uint i = 0;
+    while ( i <= Fetcher::Trivia )
+        entries[i++].clear();
+    bytes = 0;
+    newest = 0;
+    oldest = 0;
+}
+
+
+// discards the oldest entries until the rest use at most half the
+// budget, so that we don't come back here at every collection.
+
+void FetchedRowCache::shrink()
+{
+    uint limit = budget() / 2;
+    while ( oldest && bytes > limit ) {
+        Entry * e = oldest;
+        unlink( e );
+        entries[e->type].remove( e->message );
+        bytes -= e->cost;
+    }
+}
+
+
+void FetchedRowCache::reconfigure()
+{
+    uint mb = Configuration::scalar( Configuration::MemoryLimit ) / 8;
+    if ( !mb )
+        mb = 1;
+    setBudget( 1024 * 1024 * mb );
+}
+
+
+// returns the rows of type t for message id, or a null pointer.
+
+List<Row> * FetchedRowCache::find( uint id, Fetcher::Type t )
+{
+    Entry * e = entries[t].find( id );
+    if ( !e )
+        return 0;
+    use( e );
+    return e->rows;
+}
+
+
+// remembers a copy of rows, the rows of type t for message id. a
+// message that would use a sizable part of the budget on its own
+// isn't worth keeping.
+
+void FetchedRowCache::insert( uint id, Fetcher::Type t, List<Row> * rows )
+{
+    if ( entries[t].find( id ) )
+        return;
+
+    Entry * e = new Entry;
+    e->message = id;
+    e->type = t;
+    e->rows = new List<Row>;
+    List<Row>::Iterator i( rows );
+    while ( i ) {
+        e->cost += i->cost();
+        e->rows->append( i );
+        ++i;
+    }
+    if ( e->cost > budget() / 16 )
+        return;
+
+    entries[t].insert( id, e );
+    bytes += e->cost;
+    use( e );
+    if ( bytes > budget() )
+        shrink();
+}
+
+
+void FetchedRowCache::unlink( Entry * e )
+{
+    if ( e->newer )
+        e->newer->older = e->older;
+    else if ( newest == e )
+        newest = e->older;
+    if ( e->older )
+        e->older->newer = e->newer;
+    else if ( oldest == e )
+        oldest = e->newer;
+    e->newer = 0;
+    e->older = 0;
+}
+
+
+void FetchedRowCache::use( Entry * e )
+{
+    if ( newest == e )
+        return;
+    unlink( e );
+    e->older = newest;
+    if ( newest )
+        newest->newer = e;
+    newest = e;
+    if ( !oldest )
+        oldest = e;
+}
 
 
 enum State { NotStarted, Fetching, Done };
@@ -39,11 +214,12 @@ public:
           maxBatchSize( 32768 ),
           batchSize( 0 ),
           uniqueDatabaseIds( true ),
-          lastBatchStarted( 0 ),
+          batches( 0 ), waited( false ),
           addresses( 0 ), otherheader( 0 ),
           body( 0 ), trivia( 0 ),
           partnumbers( 0 ),
-          throttler( 0 )
+          throttler( 0 ),
+          replicaMailbox( 0 ), replicaModSeq( 0 ), replica( false )
     {}
 
     List<Message> messages;
@@ -57,26 +233,36 @@ public:
     uint maxBatchSize;
     uint batchSize;
     bool uniqueDatabaseIds;
-    uint lastBatchStarted;
+    uint batches;
+    struct timeval lastBatchStarted;
+    bool waited;
 
     class Decoder
         : public EventHandler
     {
     public:
-        Decoder( FetcherData * fd )
-            : q( 0 ), d( fd ) {
+        Decoder( FetcherData * fd, Fetcher::Type t )
+            : q( 0 ), d( fd ), type( t ), projected( false ) {
             setLog( new Log );
         }
         void execute();
         void process();
+        void useCache();
         virtual void decode( Message *, List<Row> * ) = 0;
         virtual void setDone( Message * ) = 0;
         virtual bool isDone( Message * ) const = 0;
         Query * q;
         FetcherData * d;
+        Fetcher::Type type;
         List<Row> mr;
+        bool projected;
     };
 
+    // what a projected Decoder fetches (see fetchHeaderFields())
+    EStringList headerFields;
+    EStringList addressFields;
+    bool hasAll( Message *, const EStringList & ) const;
+
     Decoder * addresses;
     Decoder * otherheader;
     Decoder * body;
@@ -88,7 +274,7 @@ public:
     {
     public:
         TriviaDecoder( FetcherData * fd )
-            : Decoder( fd ) {}
+            : Decoder( fd, Fetcher::Trivia ) {}
         void decode( Message *, List<Row> * );
         void setDone( Message * );
         bool isDone( Message * ) const;
@@ -98,7 +284,8 @@ public:
         : public Decoder
     {
     public:
-        AddressDecoder( FetcherData * fd ): Decoder( fd ) {}
+        AddressDecoder( FetcherData * fd )
+            : Decoder( fd, Fetcher::Addresses ) {}
         void decode( Message *, List<Row> * );
         void setDone( Message * );
         bool isDone( Message * ) const;
@@ -108,7 +295,8 @@ public:
         : public Decoder
     {
     public:
-        HeaderDecoder( FetcherData * fd ): Decoder( fd ) {}
+        HeaderDecoder( FetcherData * fd )
+            : Decoder( fd, Fetcher::OtherHeader ) {}
         void decode( Message *, List<Row> * );
         void setDone( Message * );
         bool isDone( Message * ) const;
@@ -118,7 +306,9 @@ public:
         : public Decoder
     {
     public:
-        PartNumberDecoder( FetcherData * fd ): Decoder( fd ) {}
+        PartNumberDecoder( FetcherData * fd,
+                           Fetcher::Type t = Fetcher::PartNumbers )
+            : Decoder( fd, t ) {}
         void decode( Message *, List<Row> * );
         void setDone( Message * );
         bool isDone( Message * ) const;
@@ -128,13 +318,18 @@ public:
         : public PartNumberDecoder
     {
     public:
-        BodyDecoder( FetcherData * fd ): PartNumberDecoder( fd ) {}
+        BodyDecoder( FetcherData * fd )
+            : PartNumberDecoder( fd, Fetcher::Body ) {}
         void decode( Message *, List<Row> * );
         void setDone( Message * );
         bool isDone( Message * ) const;
     };
 
     Connection * throttler;
+
+    uint replicaMailbox;
+    int64 replicaModSeq;
+    bool replica;
 };
 
 
@@ -293,8 +488,8 @@ void Fetcher::start()
          what.join( " " ) );
 
     // we'll use two steps. first, we find a good size for the first
-    // batch.
-    d->batchSize = 4096;
+    // batch, which is small so the client sees responses soon.
+    d->batchSize = firstBatchSize;
     if ( d->body )
         d->batchSize = d->batchSize / 2;
     if ( d->otherheader )
@@ -361,10 +556,9 @@ void Fetcher::waitForEnd()
         d->messages.clear();
         d->throttler = 0;
     }
-    else if ( d->throttler &&
-              d->throttler->writeBuffer() &&
-              d->throttler->writeBuffer()->size() > 1024*1024 ) {
-        (void)new Timer( this, 2 );
+    else if ( d->throttler && d->throttler->writeBufferFull() ) {
+        d->waited = true;
+        d->throttler->waitForRoom( this );
     }
     else {
         prepareBatch();
@@ -376,38 +570,51 @@ void Fetcher::waitForEnd()
 
 
 /*! Messages are fetched in batches, so that we can deliver some rows
-    early on. This function adjusts the size of the batches so we'll
-    get about one batch every 6 seconds, and updates the tables so we
-    have a batch ready for reading.
+    early on. This function adjusts the size of the batches and
+    updates the tables so we have a batch ready for reading.
+
+    The first batch is small, so that an interactive client sees the
+    first responses quickly. After that the batch size is adjusted so
+    each batch takes about three seconds, which keeps the per-query
+    overhead low for clients that fetch whole mailboxes. If the
+    client didn't read the previous batch's responses as fast as the
+    database produced them (ie. the write buffer filled up), the
+    batch size isn't increased, since larger batches would only use
+    more memory.
+
+    The batch sizes and times are recorded in the fetcher-batch-size
+    and fetcher-batch-time data sets.
 */
 
 
 void Fetcher::prepareBatch()
 {
-    uint now = (uint)time( 0 );
-    if ( d->lastBatchStarted ) {
+    struct timeval now;
+    (void)::gettimeofday( &now, 0 );
+    if ( d->batches ) {
         uint prevBatchSize = d->batchSize;
-        if ( now == d->lastBatchStarted ) {
-            // if we took zero time, let's do a small batch size
-            // increase, because that's suspiciously fast.
-            d->batchSize = d->batchSize * 2;
-        }
-        else if ( now < d->lastBatchStarted ) {
+        long ms = ( now.tv_sec - d->lastBatchStarted.tv_sec ) * 1000 +
+                  ( now.tv_usec - d->lastBatchStarted.tv_usec ) / 1000;
+        if ( ms < 0 ) {
             // if time went backwards we're very, very careful.
             d->batchSize = 128;
         }
         else {
             // we adjust the batch size so the next batch could take
-            // something in the approximate region of 6 seconds.
-            uint diff = now - d->lastBatchStarted;
-            d->batchSize = d->batchSize * 6 / diff;
+            // something in the approximate region of batchTarget.
+            long t = ms < 10 ? 10 : ms;
+            d->batchSize = (uint)( (double)d->batchSize * batchTarget / t );
         }
 
-        // the batch size can't increase too much
+        // the batch size can't increase too much, or at all if the
+        // client reads more slowly than the database answers
         if ( d->batchSize > prevBatchSize * 3 )
             d->batchSize = prevBatchSize * 3;
         if ( d->batchSize > prevBatchSize + 2000 )
             d->batchSize = prevBatchSize + 2000;
+        if ( d->waited && d->batchSize > prevBatchSize )
+            d->batchSize = prevBatchSize;
+        d->waited = false;
 
         // and we generally don't want it to be too large or small
         if ( d->batchSize < 128 )
@@ -433,11 +640,19 @@ void Fetcher::prepareBatch()
         if ( d->batchSize > batchSizeLimit )
             d->batchSize = batchSizeLimit;
 
-        if ( prevBatchSize != d->batchSize )
-            log( "Batch time was " + fn ( now - d->lastBatchStarted ) +
-                 " for " + fn( prevBatchSize ) + " messages, adjusting to " +
+        if ( !::batchTimes ) {
+            ::batchTimes = new GraphableDataSet( "fetcher-batch-time" );
+            ::batchSizes = new GraphableDataSet( "fetcher-batch-size" );
+        }
+        ::batchTimes->addNumber( ms < 0 ? 0 : (uint)ms );
+        ::batchSizes->addNumber( prevBatchSize );
+
+        if ( prevBatchSize != d->batchSize && Log::enabled( Log::Debug ) )
+            log( "Batch time was " + fn( ms ) + "ms for " +
+                 fn( prevBatchSize ) + " messages, adjusting to " +
                  fn( d->batchSize ), Log::Debug );
     }
+    d->batches++;
     d->lastBatchStarted = now;
 
     // Find out which messages we're going to fetch, and fill in the
@@ -461,10 +676,12 @@ void Fetcher::prepareBatch()
 
 
 /*! Finds out which messages need information of \a type, and binds a
-    list of their database IDs to parameter \a n of \a query.
+    list of their database IDs to parameter \a n of \a query. Returns
+    true if there is at least one such message, and false if \a query
+    needn't be sent at all.
 */
 
-void Fetcher::bindIds( Query * query, uint n, Type type )
+bool Fetcher::bindIds( Query * query, uint n, Type type )
 {
     IntegerSet l;
     Map< List<Message> >::Iterator bi( d->batch );
@@ -479,10 +696,16 @@ void Fetcher::bindIds( Query * query, uint n, Type type )
             case Addresses:
                 if ( m->hasAddresses() )
                     need = false;
+                else if ( d->addresses->projected &&
+                          d->hasAll( m, d->addressFields ) )
+                    need = false;
                 break;
             case OtherHeader:
                 if ( m->hasHeaders() )
                     need = false;
+                else if ( d->otherheader->projected &&
+                          d->hasAll( m, d->headerFields ) )
+                    need = false;
                 break;
             case Body:
                 if ( m->hasBodies() )
@@ -502,12 +725,16 @@ void Fetcher::bindIds( Query * query, uint n, Type type )
         }
     }
     query->bind( n, l );
+    return !l.isEmpty();
 }
 
 
 /*! Issues the necessary selects to retrieve data and feed the
     decoders. This function does some optimisation of the generated
     SQL.
+
+    Rows found in the cache of recently fetched rows are decoded
+    first, so that the selects only ask for the other messages.
 */
 
 void Fetcher::makeQueries()
@@ -517,66 +744,153 @@ void Fetcher::makeQueries()
     wanted.append( "uid" );
     wanted.append( "message" );
 
+    List<FetcherData::Decoder> decoders;
+    if ( d->addresses )
+        decoders.append( d->addresses );
+    if ( d->otherheader )
+        decoders.append( d->otherheader );
+    if ( d->body )
+        decoders.append( d->body );
+    if ( d->partnumbers )
+        decoders.append( d->partnumbers );
+    List<FetcherData::Decoder>::Iterator i( decoders );
+    while ( i ) {
+        i->useCache();
+        ++i;
+    }
+
     Query * q = 0;
     EString r;
+    uint queries = 0;
 
     if ( d->partnumbers && !d->body ) {
         // body (below) will handle this as a side effect
-        q = new Query( "select message, part, bytes, lines "
-                       "from part_numbers where message=any($1) "
-                       "order by message, part",
+        // bp.bytes is the decoded size, which BINARY.SIZE needs
+        q = new Query( "select pn.message, pn.part, pn.bytes, pn.lines, "
+                       "bp.bytes as rawbytes "
+                       "from part_numbers pn "
+                       "left join bodyparts bp on (pn.bodypart=bp.id) "
+                       "where pn.message=any($1) "
+                       "order by pn.message, pn.part",
                        d->partnumbers );
-        bindIds( q, 1, PartNumbers );
-        submit( q );
-        d->partnumbers->q = q;
+        if ( bindIds( q, 1, PartNumbers ) ) {
+            submit( q );
+            d->partnumbers->q = q;
+            queries++;
+        }
     }
 
     if ( d->trivia ) {
         // don't need to order this - just one row per message
         q = new Query( "select id as message, idate, rfc822size, thread_root "
                        "from messages where id=any($1)", d->trivia );
-        bindIds( q, 1, Trivia );
-        submit( q );
-        d->trivia->q = q;
+        if ( bindIds( q, 1, Trivia ) ) {
+            submit( q );
+            d->trivia->q = q;
+            queries++;
+        }
     }
 
     if ( d->addresses ) {
-        q = new Query( "select af.message, "
-                       "af.part, af.position, af.field, af.number, "
-                       "a.name, a.localpart::text, a.domain::text "
-                       "from address_fields af "
-                       "join addresses a on (af.address=a.id) "
-                       "where af.message=any($1) "
-                       "order by af.message, af.part, af.field, af.number",
-                       d->addresses );
-        bindIds( q, 1, Addresses );
-        submit( q );
-        d->addresses->q = q;
+        r = "select af.message, "
+            "af.part, af.position, af.field, af.number, "
+            "a.name, a.localpart::text, a.domain::text "
+            "from address_fields af "
+            "join addresses a on (af.address=a.id) "
+            "where af.message=any($1) ";
+        IntegerSet fields;
+        if ( d->addresses->projected ) {
+            r.append( "and af.part='' and af.field=any($2) " );
+            EStringList::Iterator i( d->addressFields );
+            while ( i ) {
+                fields.add( HeaderField::fieldType( *i ) );
+                ++i;
+            }
+        }
+        r.append( "order by af.message, af.part, af.field, af.number" );
+        q = new Query( r, d->addresses );
+        if ( d->addresses->projected )
+            q->bind( 2, fields );
+        if ( bindIds( q, 1, Addresses ) ) {
+            submit( q );
+            d->addresses->q = q;
+            queries++;
+        }
     }
 
     if ( d->otherheader ) {
-        q = new Query( "select hf.message, hf.part, hf.position, "
-                       "fn.name, hf.value from header_fields hf "
-                       "join field_names fn on (hf.field=fn.id) "
-                       "where hf.message=any($1) "
-                       "order by hf.message, hf.part",
-                       d->otherheader );
-        bindIds( q, 1, OtherHeader );
-        submit( q );
-        d->otherheader->q = q;
+        r = "select hf.message, hf.part, hf.position, "
+            "fn.name, hf.value from header_fields hf "
+            "join field_names fn on (hf.field=fn.id) "
+            "where hf.message=any($1) ";
+        if ( d->otherheader->projected )
+            r.append( "and hf.part='' and lower(fn.name)=any($2) " );
+        // the fields compact-headers stored in header_blobs come as
+        // one row per part, with a null name
+        bool blobs = true;
+        if ( d->otherheader->projected ) {
+            blobs = false;
+            EStringList::Iterator i( d->headerFields );
+            while ( i && !blobs ) {
+                if ( !HeaderField::isBrokenOut( *i ) )
+                    blobs = true;
+                ++i;
+            }
+        }
+        if ( blobs ) {
+            r.append( "union all "
+                      "select hb.message, hb.part, 0, null::text, "
+                      "hb.fields from header_blobs hb "
+                      "where hb.message=any($1) " );
+            if ( d->otherheader->projected )
+                r.append( "and hb.part='' " );
+        }
+        r.append( "order by message, part" );
+        q = new Query( r, d->otherheader );
+        if ( d->otherheader->projected )
+            q->bind( 2, d->headerFields );
+        if ( bindIds( q, 1, OtherHeader ) ) {
+            submit( q );
+            d->otherheader->q = q;
+            queries++;
+        }
     }
 
     if ( d->body ) {
-        q = new Query( "select pn.message, pn.part, bp.text, bp.data, "
+        q = new Query( "select pn.message, pn.part, pn.bodypart, "
+                       "bp.text, bp.data, "
+                       "bp.compressed, bp.external, bp.hash, "
                        "bp.bytes as rawbytes, pn.bytes, pn.lines "
                        "from part_numbers pn "
                        "left join bodyparts bp on (pn.bodypart=bp.id) "
                        "where pn.message=any($1) "
                        "order by pn.message, pn.part",
                        d->body );
-        bindIds( q, 1, Body );
+        // the bodies may be large, so we have them streamed rather
+        // than buffered all at once
+        q->setBatchSize( 256 );
+        if ( bindIds( q, 1, Body ) ) {
+            submit( q );
+            d->body->q = q;
+            queries++;
+        }
+    }
+
+    if ( !queries && q ) {
+        // everything came from the cache. we still send the last
+        // select, for no messages, so that the owner is notified from
+        // the event loop as usual, not from within its own execute().
+        FetcherData::Decoder * o = d->body;
+        if ( !o )
+            o = d->otherheader;
+        if ( !o )
+            o = d->addresses;
+        if ( !o )
+            o = d->trivia;
+        if ( !o )
+            o = d->partnumbers;
         submit( q );
-        d->body->q = q;
+        o->q = q;
     }
 
     if ( d->transaction )
@@ -622,19 +936,122 @@ void FetcherData::Decoder::process()
             setDone( m );
         }
     }
+    if ( !projected && type != Fetcher::Trivia && Server::useCache() ) {
+        if ( !::rowCache )
+            ::rowCache = new FetchedRowCache;
+        ::rowCache->insert( id, type, &mr );
+    }
     mr.clear();
 }
 
+
+// decodes whatever the FetchedRowCache knows about the messages in
+// the current batch, so that makeQueries() won't select those rows.
+// body rows contain everything the part number decoder needs, so it
+// can use them too.
+
+void FetcherData::Decoder::useCache()
+{
+    if ( projected || type == Fetcher::Trivia || !::rowCache )
+        return;
+    if ( !::rowCacheHits ) {
+        ::rowCacheHits = new GraphableCounter( "fetcher-row-cache-hits" );
+        ::rowCacheMisses = new GraphableCounter( "fetcher-row-cache-misses" );
+    }
+    Map< List<Message> >::Iterator bi( d->batch );
+    while ( bi ) {
+        List<Message>::Iterator i( *bi );
+        ++bi;
+        List<Row> * rows = 0;
+        bool looked = false;
+        while ( i ) {
+            Message * m = i;
+            ++i;
+            if ( !m->databaseId() || isDone( m ) )
+                continue;
+            if ( !looked ) {
+                rows = ::rowCache->find( m->databaseId(), type );
+                if ( !rows && type == Fetcher::PartNumbers )
+                    rows = ::rowCache->find( m->databaseId(),
+                                             Fetcher::Body );
+                looked = true;
+                if ( rows )
+                    ::rowCacheHits->tick();
+                else
+                    ::rowCacheMisses->tick();
+            }
+            if ( rows ) {
+                decode( m, rows );
+                setDone( m );
+            }
+        }
+    }
+}
+
+// adds the fields in \a blob, a header_blobs row as written by
+// Injector::addHeader(), to \a h. if \a names is non-null, only the
+// fields named in it are added.
+
+static void addCompactFields( Header * h, const EString & blob,
+                              const EStringList * names )
+{
+    PgUtf8Codec p;
+    EStringList::Iterator l( EStringList::split( '\n', blob ) );
+    while ( l ) {
+        EString line = *l;
+        ++l;
+        int sp = line.find( ' ' );
+        int colon = line.find( ": ", sp );
+        if ( sp < 1 || colon < sp )
+            continue;
+        EString name = line.mid( sp + 1, colon - sp - 1 );
+        if ( names && !names->contains( name.lower() ) )
+            continue;
+
+        EString v;
+        uint i = colon + 2;
+        while ( i < line.length() ) {
+            char c = line[i++];
+            if ( c == '\\' && i < line.length() ) {
+                c = line[i++];
+                if ( c == 'n' )
+                    c = '\n';
+                else if ( c == 'r' )
+                    c = '\r';
+            }
+            v.append( c );
+        }
+
+        HeaderField * f = HeaderField::assemble( name, p.toUnicode( v ) );
+        f->setPosition( line.mid( 0, sp ).number( 0 ) );
+        h->add( f );
+    }
+}
+
+
 void FetcherData::HeaderDecoder::decode( Message * m, List<Row> * rows )
 {
+    // a projected fetch may name fields m already has, which we
+    // mustn't add twice
+    EStringList wanted;
+    if ( projected ) {
+        EStringList::Iterator i( d->headerFields );
+        while ( i ) {
+            if ( !m->hasHeaderField( *i ) )
+                wanted.append( *i );
+            ++i;
+        }
+    }
+    else {
+        m->removeFetchedFields( false );
+    }
+
     List<Row>::Iterator i( rows );
     while ( i ) {
         Row * r = i;
         ++i;
 
         EString part = r->getEString( "part" );
-        EString name = r->getEString( "name" );
-        UString value = r->getUString( "value" );
 
         Header * h = m->header();
         if ( part.endsWith( ".rfc822" ) ) {
@@ -653,7 +1070,16 @@ void FetcherData::HeaderDecoder::decode( Message * m, List<Row> * rows )
         else {
             h = m->bodypart( part, true )->header();
         }
-        HeaderField * f = HeaderField::assemble( name, value );
+        if ( r->isNull( "name" ) ) {
+            addCompactFields( h, r->getEString( "value" ),
+                              projected ? &wanted : 0 );
+            continue;
+        }
+        if ( projected &&
+             !wanted.contains( r->getEString( "name" ).lower() ) )
+            continue;
+        HeaderField * f = HeaderField::assemble( r->getEString( "name" ),
+                                                 r->getUString( "value" ) );
         f->setPosition( r->getInt( "position" ) );
         h->add( f );
     }
@@ -662,19 +1088,46 @@ void FetcherData::HeaderDecoder::decode( Message * m, List<Row> * rows )
 
 void FetcherData::HeaderDecoder::setDone( Message * m )
 {
-    m->setHeadersFetched();
+    if ( !projected ) {
+        m->setHeadersFetched();
+        return;
+    }
+    EStringList::Iterator i( d->headerFields );
+    while ( i ) {
+        m->setHeaderFieldFetched( *i );
+        ++i;
+    }
 }
 
 
 bool FetcherData::HeaderDecoder::isDone( Message * m ) const
 {
-    return m->hasHeaders();
+    if ( m->hasHeaders() )
+        return true;
+    return projected && d->hasAll( m, d->headerFields );
+}
+
+
+/*! Returns true if \a m has all the header fields named in \a l. */
+
+bool FetcherData::hasAll( Message * m, const EStringList & l ) const
+{
+    EStringList::Iterator i( l );
+    while ( i ) {
+        if ( !m->hasHeaderField( *i ) )
+            return false;
+        ++i;
+    }
+    return true;
 }
 
 
 
 void FetcherData::AddressDecoder::decode( Message * m, List<Row> * rows )
 {
+    if ( !projected )
+        m->removeFetchedFields( true );
+
     List<Row>::Iterator i( rows );
     while ( i ) {
         Row * r = i;
@@ -685,6 +1138,9 @@ void FetcherData::AddressDecoder::decode( Message * m, List<Row> * rows )
 
         // XXX: use something for mapping
         HeaderField::Type field = (HeaderField::Type)r->getInt( "field" );
+        if ( projected &&
+             m->hasHeaderField( HeaderField::fieldName( field ) ) )
+            continue;
 
         Header * h = m->header();
         if ( part.endsWith( ".rfc822" ) ) {
@@ -726,13 +1182,23 @@ void FetcherData::AddressDecoder::decode( Message * m, List<Row> * rows )
 
 void FetcherData::AddressDecoder::setDone( Message * m )
 {
-    m->setAddressesFetched();
+    if ( !projected ) {
+        m->setAddressesFetched();
+        return;
+    }
+    EStringList::Iterator i( d->addressFields );
+    while ( i ) {
+        m->setHeaderFieldFetched( *i );
+        ++i;
+    }
 }
 
 
 bool FetcherData::AddressDecoder::isDone( Message * m ) const
 {
-    return m->hasAddresses();
+    if ( m->hasAddresses() )
+        return true;
+    return projected && d->hasAll( m, d->addressFields );
 }
 
 
@@ -750,13 +1216,23 @@ void FetcherData::BodyDecoder::decode( Message * m, List<Row> * rows )
         if ( !part.endsWith( ".rfc822" ) ) {
             Bodypart * bp = m->bodypart( part, true );
 
-            if ( !r->isNull( "data" ) )
-                bp->setData( r->getEString( "data" ) );
+            if ( !r->isNull( "external" ) && r->getBoolean( "external" ) ) {
+                bp->setExternalData( r->getEString( "hash" ) );
+            }
+            else if ( !r->isNull( "data" ) ) {
+                if ( !r->isNull( "compressed" ) &&
+                     r->getBoolean( "compressed" ) )
+                    bp->setCompressedData( r->getEString( "data" ) );
+                else
+                    bp->setData( r->getEString( "data" ) );
+            }
             else if ( !r->isNull( "text" ) )
                 bp->setText( r->getUString( "text" ) );
 
             if ( !r->isNull( "rawbytes" ) )
                 bp->setNumBytes( r->getInt( "rawbytes" ) );
+            if ( !r->isNull( "bodypart" ) )
+                bp->setId( r->getInt( "bodypart" ) );
         }
     }
 }
@@ -800,6 +1276,8 @@ void FetcherData::PartNumberDecoder::decode( Message * m, List<Row> * rows )
         }
         else {
             Bodypart * bp = m->bodypart( part, true );
+            if ( !r->isNull( "rawbytes" ) )
+                bp->setNumBytes( r->getInt( "rawbytes" ) );
             if ( !r->isNull( "bytes" ) )
                 bp->setNumEncodedBytes( r->getInt( "bytes" ) );
             if ( !r->isNull( "lines" ) )
@@ -855,10 +1333,12 @@ void Fetcher::fetch( Type t )
     case Addresses:
         if ( !d->addresses )
             d->addresses = new FetcherData::AddressDecoder( d );
+        d->addresses->projected = false;
         break;
     case OtherHeader:
         if ( !d->otherheader )
             d->otherheader = new FetcherData::HeaderDecoder( d );
+        d->otherheader->projected = false;
         break;
     case Body:
         if ( !d->body )
@@ -877,6 +1357,44 @@ void Fetcher::fetch( Type t )
 }
 
 
+/*! Instructs this Fetcher to fetch the top-level header fields named
+    in \a names, but not necessarily the rest of the header. This is
+    much cheaper than fetch( OtherHeader ) and fetch( Addresses ) when
+    a client wants only a few fields of many messages.
+
+    If fetch() is also called for OtherHeader or Addresses, it takes
+    precedence. Calls to this function must precede execute().
+*/
+
+void Fetcher::fetchHeaderFields( const EStringList & names )
+{
+    Scope x( log() );
+    EStringList::Iterator i( names );
+    while ( i ) {
+        EString n = i->lower();
+        uint t = HeaderField::fieldType( n );
+        if ( t > 0 && t <= HeaderField::LastAddressField ) {
+            if ( !d->addresses ) {
+                d->addresses = new FetcherData::AddressDecoder( d );
+                d->addresses->projected = true;
+            }
+            if ( d->addresses->projected && !d->addressFields.contains( n ) )
+                d->addressFields.append( n );
+        }
+        else {
+            if ( !d->otherheader ) {
+                d->otherheader = new FetcherData::HeaderDecoder( d );
+                d->otherheader->projected = true;
+            }
+            if ( d->otherheader->projected &&
+                 !d->headerFields.contains( n ) )
+                d->headerFields.append( n );
+        }
+        ++i;
+    }
+}
+
+
 /*! Returns true if this Fetcher will fetch (or is fetching) data of
     type \a t. Returns false until fetch() has been called for \a t.
 */
@@ -922,8 +1440,25 @@ void Fetcher::setTransaction( class Transaction * t )
 
 void Fetcher::submit( Query * q )
 {
-    if ( d->transaction )
+    if ( d->transaction ) {
         d->transaction->enqueue( q );
-    else
-        q->execute();
+        return;
+    }
+    if ( d->replica )
+        q->allowReplica( d->replicaMailbox, d->replicaModSeq );
+    q->execute();
+}
+
+
+/*! Permits the queries done by this Fetcher to be sent to a replica
+    that has seen \a modseq for \a mailbox, as described in
+    Query::allowReplica(). This has no effect if setTransaction() is
+    used.
+*/
+
+void Fetcher::allowReplica( uint mailbox, int64 modseq )
+{
+    d->replica = true;
+    d->replicaMailbox = mailbox;
+    d->replicaModSeq = modseq;
 }
@@ -36,6 +36,7 @@ public:
     void addMessages( List<Message> * );
 
     void fetch( Type );
+    void fetchHeaderFields( const class EStringList & );
     bool fetching( Type ) const;
 
     void execute();
@@ -43,6 +44,7 @@ public:
     bool done() const;
 
     void setTransaction( class Transaction * );
+    void allowReplica( uint, int64 );
 
 private:
     class FetcherData * d;
@@ -53,7 +55,7 @@ private:
     void makeQueries();
     void waitForEnd();
     void submit( Query * );
-    void bindIds( Query *, uint, Type );
+    bool bindIds( Query *, uint, Type );
 };
 
 
@@ -14,6 +14,9 @@
 #include "parser.h"
 #include "utf.h"
 
+// strlen
+#include <string.h>
+
 static struct {
     const char * name;
     HeaderField::Type type;
@@ -54,11 +57,102 @@ static struct {
 };
 
 
+// fieldNames is looked up once per header field parsed, so it's
+// indexed by a perfect hash: setupFieldSlots() picks a seed for which
+// each known name hashes (case-insensitively) to a slot of its own,
+// so any name is found or rejected after one hash and at most one
+// comparison. typeNames maps each Type back to its name.
+
+static const uint fieldSlotCount = 256;
+static int fieldSlots[fieldSlotCount];
+static const char * typeNames[HeaderField::Other + 1];
+static uint fieldSeed = 0;
+static bool fieldSlotsReady = false;
+
+
+static uint fieldHash( const char * s, uint l, uint seed )
+{
+    uint h = seed;
+    uint i = 0;
+    while ( i < l ) {
+        char c = s[i++];
+        if ( c >= 'A' && c <= 'Z' )
+            c += 'a' - 'A';
+        h = ( h ^ (uint)c ) * 16777619;
+    }
+    return ( h ^ ( h >> 16 ) ) % fieldSlotCount;
+}
+
+
+static void setupFieldSlots()
+{
+    uint seed = 2166136261u;
+    bool ok = false;
+    while ( !ok ) {
+        uint i = 0;
+        while ( i < fieldSlotCount )
+            fieldSlots[i++] = -1;
+        ok = true;
+        i = 0;
+        while ( ok && fieldNames[i].name ) {
+            const char * n = fieldNames[i].name;
+            uint h = fieldHash( n, ::strlen( n ), seed );
+            if ( fieldSlots[h] >= 0 )
+                ok = false;
+            else
+                fieldSlots[h] = i;
+            i++;
+        }
+        if ( !ok )
+            seed++;
+    }
+    fieldSeed = seed;
+
+    uint i = 0;
+    while ( fieldNames[i].name ) {
+        typeNames[fieldNames[i].type] = fieldNames[i].name;
+        i++;
+    }
+    fieldSlotsReady = true;
+}
+
+
+// Returns the index in fieldNames of the name given by the \a l bytes
+// at \a s, compared case-insensitively, or -1 if it's not there.
+
+static int fieldIndex( const char * s, uint l )
+{
+    if ( !fieldSlotsReady )
+        setupFieldSlots();
+    int i = fieldSlots[fieldHash( s, l, fieldSeed )];
+    if ( i < 0 )
+        return -1;
+    const char * n = fieldNames[i].name;
+    uint j = 0;
+    while ( j < l && n[j] ) {
+        char a = s[j];
+        char b = n[j];
+        if ( a >= 'A' && a <= 'Z' )
+            a += 'a' - 'A';
+        if ( b >= 'A' && b <= 'Z' )
+            b += 'a' - 'A';
+        if ( a != b )
+            return -1;
+        j++;
+    }
+    if ( j < l || n[j] )
+        return -1;
+    return i;
+}
+
+
 class HeaderFieldData
     : public Garbage
 {
 public:
-    HeaderFieldData() : type( HeaderField::Other ), position( (uint)-1 ) {}
+    HeaderFieldData()
+        : type( HeaderField::Other ), position( (uint)-1 ), parsed( true )
+    {}
 
     HeaderField::Type type;
     EString name;
@@ -66,6 +160,8 @@ public:
     EString unparsed;
     EString error;
     uint position;
+    EString raw;
+    bool parsed;
 };
 
 
@@ -77,7 +173,10 @@ public:
     error() was recorded during parsing by the various functions that
     parse() field values, e.g. parseText()).
 
-    Users may obtain HeaderField objects only via create().
+    Users may obtain HeaderField objects only via create(), which
+    leaves the parsing until the field's value or validity is first
+    looked at. A field that's only copied around by name and type
+    never sees the address, date or MIME parsers.
 */
 
 
@@ -87,12 +186,11 @@ public:
 
 HeaderField *HeaderField::fieldNamed( const EString &name )
 {
-    int i = 0;
     EString n = name.headerCased();
-    while ( fieldNames[i].name && n != fieldNames[i].name )
-        i++;
-
-    HeaderField::Type t = fieldNames[i].type;
+    int i = fieldIndex( name.data(), name.length() );
+    HeaderField::Type t = Other;
+    if ( i >= 0 )
+        t = fieldNames[i].type;
     HeaderField * hf = 0;
 
     switch ( t ) {
@@ -109,7 +207,7 @@ HeaderField *HeaderField::fieldNamed( const EString &name )
         if ( n == "List-Id" )
             hf = new ListIdField;
         else
-            hf = new HeaderField( fieldNames[i].type );
+            hf = new HeaderField( t );
         break;
 
     case From:
@@ -161,8 +259,8 @@ HeaderField *HeaderField::fieldNamed( const EString &name )
 
 /*! This static function returns a pointer to a new HeaderField object
     that represents the given field \a name (case-insensitive) and its
-    \a value (which is parsed appropriately). Neither \a name nor
-    value may contain the separating ':'.
+    \a value (which is parsed appropriately when it's first needed).
+    Neither \a name nor value may contain the separating ':'.
 
     This function is for use by the message parser.
 */
@@ -171,6 +269,13 @@ HeaderField *HeaderField::create( const EString &name,
                                   const EString &value )
 {
     HeaderField *hf = fieldNamed( name );
+    if ( value[0] != ':' && value[0] != ' ' ) {
+        // the common case, where there's nothing to retry below
+        hf->d->raw = value;
+        hf->d->parsed = false;
+        return hf;
+    }
+
     hf->parse( value );
     if ( hf->valid() )
         return hf;
@@ -213,6 +318,23 @@ HeaderField *HeaderField::assemble( const EString &name,
 }
 
 
+/*! Parses the value given to create(), if that hasn't been done
+    yet. Every function that looks at the parsed value calls this
+    first; subclasses have to do the same in their own accessors.
+*/
+
+void HeaderField::parseIfNeeded() const
+{
+    if ( d->parsed )
+        return;
+    d->parsed = true;
+    ((HeaderField*)this)->parse( d->raw );
+    if ( !d->error.isEmpty() )
+        d->unparsed = d->raw;
+    d->raw.truncate();
+}
+
+
 /*! Constructs a HeaderField of type \a t. */
 
 HeaderField::HeaderField( HeaderField::Type t )
@@ -267,6 +389,7 @@ void HeaderField::setName( const EString &n )
 
 EString HeaderField::rfc822( bool avoidUtf8 ) const
 {
+    parseIfNeeded();
     if ( d->type == Subject ||
          d->type == Comments ||
          d->type == ContentDescription ) {
@@ -302,6 +425,7 @@ EString HeaderField::rfc822( bool avoidUtf8 ) const
 
 UString HeaderField::value() const
 {
+    parseIfNeeded();
     return d->value;
 }
 
@@ -312,6 +436,7 @@ UString HeaderField::value() const
 
 void HeaderField::setValue( const UString &s )
 {
+    parseIfNeeded();
     d->value = s;
     d->error.truncate();
 }
@@ -324,6 +449,7 @@ void HeaderField::setValue( const UString &s )
 
 bool HeaderField::valid() const
 {
+    parseIfNeeded();
     return d->error.isEmpty();
 }
 
@@ -335,6 +461,7 @@ bool HeaderField::valid() const
 
 EString HeaderField::error() const
 {
+    parseIfNeeded();
     return d->error;
 }
 
@@ -343,6 +470,7 @@ EString HeaderField::error() const
 
 void HeaderField::setError( const EString &s )
 {
+    parseIfNeeded();
     d->error = s;
 }
 
@@ -351,10 +479,14 @@ void HeaderField::setError( const EString &s )
     a string \a s from a message and sets the field value(). This default
     function handles fields that are not specially handled by subclasses
     using functions like parseText().
+
+    Calling parse() directly discards anything create() left for
+    parseIfNeeded().
 */
 
 void HeaderField::parse( const EString &s )
 {
+    d->parsed = true;
     switch ( d->type ) {
     case From:
     case ResentFrom:
@@ -649,10 +781,11 @@ void HeaderField::parseErrorsTo( const EString & s )
 
 const char *HeaderField::fieldName( HeaderField::Type t )
 {
-    uint i = 0;
-    while ( fieldNames[i].name && fieldNames[i].type != t )
-        i++;
-    return fieldNames[i].name;
+    if ( !fieldSlotsReady )
+        setupFieldSlots();
+    if ( t > Other )
+        return 0;
+    return typeNames[t];
 }
 
 
@@ -662,18 +795,34 @@ const char *HeaderField::fieldName( HeaderField::Type t )
 
 uint HeaderField::fieldType( const EString & n )
 {
-    EString fn = n.headerCased();
-    if ( fn.endsWith( ":" ) )
-        fn.truncate( fn.length()-1 );
-    uint i = 0;
-    while ( fieldNames[i].name && fn != fieldNames[i].name )
-        i++;
-    if ( fieldNames[i].name )
+    uint l = n.length();
+    if ( l && n[l-1] == ':' )
+        l--;
+    int i = fieldIndex( n.data(), l );
+    if ( i >= 0 )
         return fieldNames[i].type;
     return 0;
 }
 
 
+/*! Returns true if fields named \a n are always stored in rows of
+    their own, and false if compact-headers may store them in the
+    part's header_blobs row instead.
+
+    The fields kept apart are the address fields and those the server
+    uses for searching, sorting and threading, e.g. Subject, Message-ID,
+    References and Thread-Index.
+*/
+
+bool HeaderField::isBrokenOut( const EString & n )
+{
+    uint t = fieldType( n );
+    if ( t && t <= Keywords )
+        return true;
+    return n.headerCased() == "Thread-Index";
+}
+
+
 /*! Returns a version of \a s with long lines wrapped according to the
     rules in RFC [2]822. This function is not static, because it needs
     to look at the field name.
@@ -837,6 +986,7 @@ EString HeaderField::unparsedValue() const
 
 void HeaderField::setUnparsedValue( const EString & s )
 {
+    parseIfNeeded();
     d->unparsed = s;
 }
 
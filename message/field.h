@@ -46,6 +46,8 @@ protected:
     HeaderField( HeaderField::Type );
     virtual ~HeaderField();
 
+    void parseIfNeeded() const;
+
 public:
     Type type() const;
 
@@ -71,6 +73,7 @@ public:
 
     static const char *fieldName( HeaderField::Type );
     static uint fieldType( const EString & );
+    static bool isBrokenOut( const EString & );
 
     EString wrap( const EString & ) const;
 
@@ -4,14 +4,45 @@
 
 #include "dict.h"
 #include "scope.h"
+#include "graph.h"
 #include "allocator.h"
 #include "transaction.h"
+#include "dbsignal.h"
 #include "address.h"
 #include "query.h"
 #include "flag.h"
 #include "utf.h"
 
 
+// A process-wide name-to-id map for one helper table, shared by all
+// the creators that use useSharedCache(). Rows are never renumbered,
+// so the cache stays valid until someone obliterates the database.
+
+class HelperRowCache
+    : public EventHandler
+{
+public:
+    HelperRowCache( const EString & table )
+        : EventHandler(), entries( 0 ) {
+        setLog( new Log );
+        Allocator::addEternal( this, "helper row cache" );
+        (void)new DatabaseSignal( "obliterated", this );
+        hits = new GraphableCounter( table + "-cache-hits" );
+        misses = new GraphableCounter( table + "-cache-misses" );
+    }
+
+    void execute() { ids.clear(); entries = 0; }
+
+    Dict<uint> ids;
+    uint entries;
+    GraphableCounter * hits;
+    GraphableCounter * misses;
+};
+
+
+static Dict<HelperRowCache> * helperRowCaches = 0;
+
+
 
 /*! \class HelperRowCreator helperrowcreator.h
 
@@ -33,7 +64,7 @@ class HelperRowCreatorData
 public:
     HelperRowCreatorData()
         : s( 0 ), c( 0 ), notify( 0 ), parent( 0 ), t( 0 ),
-          done( false ), inserted( false )
+          done( false ), inserted( false ), cache( 0 )
     {}
 
     Query * s;
@@ -46,6 +77,8 @@ public:
     bool done;
     bool inserted;
     Dict<uint> names;
+    EString table;
+    HelperRowCache * cache;
 };
 
 
@@ -61,6 +94,7 @@ HelperRowCreator::HelperRowCreator( const EString & table,
 {
     setLog( new Log );
     d->parent = transaction;
+    d->table = table;
     d->n = table + "_creator";
     d->e = constraint;
 }
@@ -198,17 +232,83 @@ void HelperRowCreator::add( const EString & s, uint id )
     *tmp = id;
 
     d->names.insert( s.lower(), tmp );
+    cacheId( s.lower(), id );
 }
 
 
-/*! Returns the id stored earlier with add() for the name \a s. */
+/*! Returns the id stored earlier with add() for the name \a s, or
+    found in the shared cache.
+*/
 
 uint HelperRowCreator::id( const EString & s )
 {
     uint * p = d->names.find( s.lower() );
     if ( p )
         return *p;
-    return 0;
+    uint r = cachedId( s.lower() );
+    if ( r ) {
+        p = (uint *)Allocator::alloc( sizeof(uint), 0 );
+        *p = r;
+        d->names.insert( s.lower(), p );
+    }
+    return r;
+}
+
+
+/*! Makes this creator share its knowledge with other creators for the
+    same table in this process, so that names looked up once needn't
+    be looked up again. The shared cache is cleared if the database is
+    obliterated.
+
+    Only ids that were already in the table when this creator looked
+    are shared; any it inserted are as uncertain as its transaction.
+*/
+
+void HelperRowCreator::useSharedCache()
+{
+    if ( !::helperRowCaches ) {
+        ::helperRowCaches = new Dict<HelperRowCache>;
+        Allocator::addEternal( ::helperRowCaches, "helper row caches" );
+    }
+    d->cache = ::helperRowCaches->find( d->table );
+    if ( !d->cache ) {
+        d->cache = new HelperRowCache( d->table );
+        ::helperRowCaches->insert( d->table, d->cache );
+    }
+}
+
+
+/*! Returns the id the shared cache has for the \a key, or 0 if there
+    is none (or useSharedCache() hasn't been called).
+*/
+
+uint HelperRowCreator::cachedId( const EString & key )
+{
+    if ( !d->cache )
+        return 0;
+    uint * p = d->cache->ids.find( key );
+    if ( !p )
+        return 0;
+    d->cache->hits->tick();
+    return *p;
+}
+
+
+/*! Records in the shared cache that \a key has \a id, if that's
+    known to be safe (see useSharedCache()).
+*/
+
+void HelperRowCreator::cacheId( const EString & key, uint id )
+{
+    if ( !d->cache || d->inserted || d->cache->ids.contains( key ) )
+        return;
+    if ( d->cache->entries >= 65536 )
+        d->cache->execute();
+    uint * p = (uint *)Allocator::alloc( sizeof(uint), 0 );
+    *p = id;
+    d->cache->ids.insert( key, p );
+    d->cache->entries++;
+    d->cache->misses->tick();
 }
 
 
@@ -270,7 +370,8 @@ Query * FlagCreator::makeSelect()
     if ( sl.isEmpty() )
         return 0;
     s->bind( 1, sl );
-    log( "Looking up " + fn( sl.count() ) + " flags", Log::Debug );
+    if ( Log::enabled( Log::Debug ) )
+        log( "Looking up " + fn( sl.count() ) + " flags", Log::Debug );
     return s;
 }
 
@@ -321,6 +422,7 @@ FieldNameCreator::FieldNameCreator( const EStringList & f,
     : HelperRowCreator( "field_names", tr,  "field_names_name_key" ),
       names( f )
 {
+    useSharedCache();
 }
 
 
@@ -339,7 +441,8 @@ Query * FieldNameCreator::makeSelect()
     if ( sl.isEmpty() )
         return 0;
     q->bind( 1, sl );
-    log( "Looking up " + fn( sl.count() ) + " field names", Log::Debug );
+    if ( Log::enabled( Log::Debug ) )
+        log( "Looking up " + fn( sl.count() ) + " field names", Log::Debug );
     return q;
 }
 
@@ -382,6 +485,7 @@ AnnotationNameCreator::AnnotationNameCreator( const EStringList & f,
     : HelperRowCreator( "annotation_names", t, "annotation_names_name_key" ),
       names( f )
 {
+    useSharedCache();
 }
 
 Query *  AnnotationNameCreator::makeSelect()
@@ -401,7 +505,9 @@ Query *  AnnotationNameCreator::makeSelect()
         return 0;
 
     q->bind( 1, sl );
-    log( "Looking up " + fn( sl.count() ) + " annotation names", Log::Debug );
+    if ( Log::enabled( Log::Debug ) )
+        log( "Looking up " + fn( sl.count() ) + " annotation names",
+             Log::Debug );
     return q;
 }
 
@@ -450,6 +556,7 @@ AddressCreator::AddressCreator( Dict<Address> * addresses,
       a( addresses ), bulk( false ), decided( false ),
       base( t ), sub( 0 ), insert( 0 ), obtain( 0 )
 {
+    useSharedCache();
 }
 
 
@@ -462,6 +569,7 @@ AddressCreator::AddressCreator( Address * address, class Transaction * t )
       a( new Dict<Address> ), bulk( false ), decided( false ),
       base( t ), sub( 0 ), insert( 0 ), obtain( 0 )
 {
+    useSharedCache();
     a->insert( AddressCreator::key( address ), address );
 }
 
@@ -478,6 +586,7 @@ AddressCreator::AddressCreator( List<Address> * addresses,
       a( new Dict<Address> ), bulk( false ), decided( false ),
       base( t ), sub( 0 ), insert( 0 ), obtain( 0 )
 {
+    useSharedCache();
     List<Address>::Iterator address( addresses );
     while ( address ) {
         a->insert( AddressCreator::key( address ), address );
@@ -553,7 +662,8 @@ Query * AddressCreator::makeSelect()
     if ( asked.isEmpty() )
         return 0;
     q->setString( s );
-    log( "Looking up " + fn( asked.count() ) + " addresses", Log::Debug );
+    if ( Log::enabled( Log::Debug ) )
+        log( "Looking up " + fn( asked.count() ) + " addresses", Log::Debug );
     return q;
 }
 
@@ -567,8 +677,14 @@ void AddressCreator::processSelect( Query * q )
                          r->getUString( "localpart" ),
                          r->getUString( "domain" ) );
         Address * our = a->find( key( c ) );
-        if ( our )
+        if ( our ) {
             our->setId( r->getInt( "id" ) );
+            // in the bulk case, f tells us whether the row existed
+            // before we inserted anything. the others mustn't be
+            // cached until the transaction commits.
+            if ( !r->hasColumn( "f" ) || r->getBoolean( "f" ) )
+                cacheId( key( c ), our->id() );
+        }
         else
             log( "Unexpected result from db: " + c->toString( false ) );
     }
@@ -632,9 +748,14 @@ void AddressCreator::execute()
     if ( !decided ) {
         uint c = 0;
         Dict<Address>::Iterator i( a );
-        while ( c < useTempTable && i ) {
-            if ( !i->id() )
-                ++c;
+        while ( i ) {
+            if ( !i->id() ) {
+                uint id = cachedId( key( i ) );
+                if ( id )
+                    i->setId( id );
+                else
+                    ++c;
+            }
             ++i;
         }
         if ( c >= useTempTable )
@@ -705,8 +826,8 @@ void AddressCreator::execute()
         return;
 
     if ( !obtain ) {
-        obtain = new Query( "select id, name, localpart::text, domain::text "
-                            "from na", this );
+        obtain = new Query( "select id, f, name, localpart::text, "
+                            "domain::text from na", this );
         sub->enqueue( obtain );
         sub->enqueue( new Query( "drop table na", 0 ) );
         sub->commit();
@@ -26,6 +26,9 @@ public:
 
 protected:
     virtual void add( const EString &, uint );
+    void useSharedCache();
+    uint cachedId( const EString & );
+    void cacheId( const EString &, uint );
 
 private:
     virtual Query * makeSelect() = 0;
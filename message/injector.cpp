@@ -5,6 +5,8 @@
 #include "map.h"
 #include "dict.h"
 #include "flag.h"
+#include "cache.h"
+#include "hashmap.h"
 #include "query.h"
 #include "timer.h"
 #include "address.h"
@@ -12,16 +14,20 @@
 #include "ustring.h"
 #include "mailbox.h"
 #include "bodypart.h"
+#include "mailboxchange.h"
+#include "blobstore.h"
 #include "datefield.h"
 #include "mimefields.h"
 #include "messagecache.h"
 #include "helperrowcreator.h"
 #include "addressfield.h"
 #include "transaction.h"
+#include "configuration.h"
 #include "annotation.h"
 #include "postgres.h"
 #include "session.h"
 #include "scope.h"
+#include "allocator.h"
 #include "graph.h"
 #include "html.h"
 #include "md5.h"
@@ -29,27 +35,169 @@
 #include "log.h"
 #include "dsn.h"
 
+// memcpy
+#include <string.h>
+
 
 static GraphableCounter * successes;
 static GraphableCounter * failures;
 
+// batched injection: how many injectors are running as batches, and
+// the one collecting messages to inject when one of those finishes.
+static uint batchesRunning;
+static Injector * boarding;
+
 
 struct BodypartRow
     : public Garbage
 {
     BodypartRow()
-        : id( 0 ), text( 0 ), data( 0 ), bytes( 0 )
+        : id( 0 ), prehash( 0 ), contents( 0 ), text( 0 ), data( 0 ),
+          bytes( 0 ), compressed( false ), external( false )
     {}
 
     uint id;
+    uint prehash;
     EString hash;
+    EString * contents;
     EString * text;
     EString * data;
     uint bytes;
+    bool compressed;
+    bool external;
     List<Bodypart> bodyparts;
 };
 
 
+// Remembers the ids of recently injected bodyparts, so that when the
+// same attachment is sent to many recipients, we needn't compute its
+// MD5 hash or look it up in the database again. The key is a cheap
+// hash of the stored contents; the contents themselves are kept (they
+// are shared with the Bodypart, not copied) and compared on each hit.
+//
+// aox vacuum may have removed a cached bodypart since, so the ids
+// are checked (and locked) within the injection's transaction, and
+// the bodyparts which are gone are stored again as usual.
+
+class BodypartCache
+    : public Cache
+{
+public:
+    BodypartCache(): Cache( 4 ), bytes( 0 ) {}
+
+    struct Entry
+        : public Garbage
+    {
+        Entry(): id( 0 ) {}
+        uint id;
+        EString contents;
+    };
+
+    void clear() { ids.clear(); bytes = 0; }
+
+    uint find( uint h, const EString & s ) const {
+        Entry * e = ids.find( h );
+        if ( e && e->contents == s )
+            return e->id;
+        return 0;
+    }
+
+    void insert( uint h, const EString & s, uint id ) {
+        if ( bytes > 32 * 1024 * 1024 || ids.count() >= 8192 )
+            clear();
+        Entry * e = new Entry;
+        e->id = id;
+        e->contents = s;
+        ids.insert( h, e );
+        bytes += s.length();
+    }
+
+    HashMap<Entry> ids;
+    uint bytes;
+};
+
+static BodypartCache * bodypartCache = 0;
+
+
+// Keeps a block of message ids fetched from messages_id_seq ahead of
+// time, so that an injection needn't wait for nextval() before it
+// can copy its messages in. The block is refilled outside any
+// transaction when it runs low. Sequence values are never rolled
+// back, so ids fetched this way are as good as any; the ones left when
+// the process exits are merely skipped.
+//
+// A process that injects only once (e.g. aoxdeliver) would waste a
+// whole block, so the pool starts filling on the second injection.
+
+class IdPool
+    : public EventHandler
+{
+public:
+    IdPool(): EventHandler(), q( 0 ), used( 0 ) {}
+
+    IntegerSet take( uint n ) {
+        IntegerSet r;
+        used++;
+        if ( ids.count() >= n ) {
+            while ( r.count() < n ) {
+                uint id = ids.smallest();
+                r.add( id );
+                ids.remove( id );
+            }
+        }
+        uint block =
+            Configuration::scalar( Configuration::InjectionBatchSize );
+        if ( block < n )
+            block = n;
+        if ( used > 1 && !q && ids.count() < block ) {
+            q = new Query( "select nextval('messages_id_seq')::int as id "
+                           "from generate_series(1,$1)", this );
+            q->bind( 1, block * 2 - ids.count() );
+            q->execute();
+        }
+        return r;
+    }
+
+    void execute() {
+        while ( q && q->hasResults() )
+            ids.add( q->nextRow()->getInt( "id" ) );
+        if ( q && q->done() )
+            q = 0;
+    }
+
+    IntegerSet ids;
+    Query * q;
+    uint used;
+};
+
+static IdPool * messageIds = 0;
+
+
+// This is a cheap hash for BodypartCache, which reads eight bytes at a
+// time and mixes them with a multiply-xorshift step.
+
+static uint prehash( const EString & s )
+{
+    const char * p = s.data();
+    uint l = s.length();
+    unsigned long long h = 0x9e3779b97f4a7c15ULL ^ l;
+    uint i = 0;
+    while ( i + 8 <= l ) {
+        unsigned long long w;
+        memcpy( &w, p + i, 8 );
+        h = ( h ^ w ) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+        i += 8;
+    }
+    while ( i < l ) {
+        h = ( h ^ (unsigned char)p[i] ) * 0xc4ceb9fe1a85ec53ULL;
+        i++;
+    }
+    h ^= h >> 29;
+    return (uint)h;
+}
+
+
 // The following is everything the Injector needs to do its work.
 
 enum State {
@@ -61,8 +209,8 @@ enum State {
     ConvertingThreadIndex,
     CreatingThreadRoots,
     InsertingBodyparts,
-    SelectingMessageIds, SelectingUids,
-    InsertingMessages,
+    SelectingMessageIds, InsertingMessages,
+    SelectingUids, InsertingMailboxMessages,
     AwaitingCompletion, Done
 };
 
@@ -73,7 +221,8 @@ class InjectorData
 public:
     InjectorData()
         : owner( 0 ),
-          state( Inactive ), failed( false ), retried( 0 ), transaction( 0 ),
+          state( Inactive ), failed( false ),
+          batchable( false ), batch( false ), carrier( 0 ), transaction( 0 ),
           mailboxesCreated( 0 ),
           fieldNameCreator( 0 ), flagCreator( 0 ), annotationNameCreator( 0 ),
           lockUidnext( 0 ), select( 0 ), insert( 0 ),
@@ -104,7 +253,11 @@ public:
 
     State state;
     bool failed;
-    bool retried;
+
+    bool batchable;
+    bool batch;
+    Injector * carrier;
+    List<Injector> passengers;
 
     Transaction *transaction;
 
@@ -138,6 +291,7 @@ public:
 
     Dict<BodypartRow> hashes;
     List<BodypartRow> bodyparts;
+    List<Bodypart> cachedBodyparts;
 
     // for convertInReplyTo()
     Dict< List<Message> > outlooks;
@@ -281,6 +435,9 @@ EString Injector::error() const
     if ( !d->failed )
         return "";
 
+    if ( d->carrier )
+        return d->carrier->error();
+
     List<Injectee>::Iterator it( d->messages );
     while ( it ) {
         Message * m = it;
@@ -316,6 +473,120 @@ void Injector::setTransaction( class Transaction * t )
 }
 
 
+/*! Permits this Injector to store its messages together with those
+    of other Injectors, in one transaction, if several are busy at
+    once. This saves the helper row lookups, uidnext updates and
+    round-trips each would otherwise pay separately.
+
+    If the shared transaction fails, each Injector retries on its own,
+    so one bad message cannot cause the others to fail. The owner is
+    notified as usual. Batching is not used if setTransaction() has
+    been called, or if injection-batch-size is less than 2.
+*/
+
+void Injector::allowBatching()
+{
+    d->batchable = true;
+}
+
+
+/*! This private helper decides whether this Injector runs on its own
+    or as part of a batch. If there is room, it runs on its own (but
+    counts as a running batch). If not, it hands its work to the batch
+    that's boarding, starting that at once if it's full, and returns
+    true to indicate that it's now waiting.
+*/
+
+bool Injector::board()
+{
+    uint max = Configuration::scalar( Configuration::InjectionBatchSize );
+    if ( !d->batchable || d->transaction || max < 2 )
+        return false;
+
+    if ( !::boarding && ::batchesRunning < 2 ) {
+        ::batchesRunning++;
+        d->batch = true;
+        return false;
+    }
+
+    if ( !::boarding ) {
+        ::boarding = new Injector( 0 );
+        ::boarding->setLog( new Log );
+    }
+    Injector * b = ::boarding;
+    b->d->passengers.append( this );
+    b->addInjection( &d->injectables );
+    List<InjectorData::Delivery>::Iterator i( d->deliveries );
+    while ( i ) {
+        b->d->deliveries.append( i );
+        ++i;
+    }
+    if ( Log::enabled( Log::Debug ) )
+        log( "Waiting to be injected along with " +
+             fn( b->d->passengers.count() - 1 ) + " other deliveries",
+             Log::Debug );
+
+    if ( b->d->injectables.count() + b->d->deliveries.count() >= max ) {
+        ::boarding = 0;
+        ::batchesRunning++;
+        b->d->batch = true;
+        b->execute();
+    }
+    return true;
+}
+
+
+/*! This private helper is called when a batch has finished. It
+    starts the one that's boarding, and tells each Injector that handed
+    its work to this batch how it went. If the batch failed, they each
+    start again on their own.
+*/
+
+void Injector::finishBatch()
+{
+    d->batch = false;
+    if ( ::batchesRunning )
+        ::batchesRunning--;
+    if ( ::boarding && ::batchesRunning < 2 ) {
+        Injector * b = ::boarding;
+        ::boarding = 0;
+        ::batchesRunning++;
+        b->d->batch = true;
+        b->execute();
+    }
+
+    if ( d->passengers.isEmpty() )
+        return;
+
+    bool retry = d->failed && d->passengers.count() > 1;
+    if ( retry ) {
+        log( "Batched injection of " + fn( d->messages.count() ) +
+             " messages failed; injecting separately: " + error() );
+        if ( d->transaction && !d->transaction->done() )
+            d->transaction->rollback();
+    }
+
+    List<Injector> passengers;
+    while ( !d->passengers.isEmpty() )
+        passengers.append( d->passengers.shift() );
+    List<Injector>::Iterator i( passengers );
+    while ( i ) {
+        Injector * p = i;
+        ++i;
+        p->d->batchable = false;
+        if ( retry ) {
+            p->d->state = Inactive;
+        }
+        else {
+            p->d->carrier = this;
+            p->d->failed = d->failed;
+            p->d->state = Done;
+        }
+        p->execute();
+    }
+}
+
+
 void Injector::execute()
 {
     Scope x( log() );
@@ -333,6 +604,8 @@ void Injector::execute()
         last = d->state;
         switch ( d->state ) {
         case Inactive:
+            if ( board() )
+                return;
             findMessages();
             logDescription();
             if ( d->messages.isEmpty() ) {
@@ -384,14 +657,20 @@ void Injector::execute()
             selectMessageIds();
             break;
 
-        case SelectingUids:
-            selectUids();
-            break;
-
         case InsertingMessages:
             insertMessages();
             insertDeliveries();
             insertThreadIndexes();
+            insertThreadLinks();
+            next();
+            break;
+
+        case SelectingUids:
+            selectUids();
+            break;
+
+        case InsertingMailboxMessages:
+            insertMailboxMessages();
             next();
             if ( !d->mailboxes.isEmpty() )
                 Mailbox::refreshMailboxes( d->transaction );
@@ -405,9 +684,17 @@ void Injector::execute()
             if ( d->failed || d->transaction->failed() ) {
                 ::failures->tick();
                 Cache::clearAllCaches( false );
+                if ( ::bodypartCache )
+                    ::bodypartCache->clear();
+                Dict<Address>::Iterator a( d->addresses );
+                while ( a ) {
+                    a->uncache();
+                    ++a;
+                }
             }
             else {
                 ::successes->tick();
+                rememberBodyparts();
             }
 
             next();
@@ -422,6 +709,9 @@ void Injector::execute()
     }
     while ( last != d->state && d->state != Done && !d->failed );
 
+    if ( d->batch && done() )
+        finishBatch();
+
     if ( d->state == Done && d->owner ) {
         if ( d->failed )
             log( "Injection failed: " + error() );
@@ -465,9 +755,10 @@ void Injector::findMessages()
         }
         ++dm;
     }
-    log( "Injecting " + fn( d->messages.count() ) + " messages (" +
-         fn( d->injectables.count() ) + ", " +
-         fn( d->deliveries.count() ) + ")", Log::Debug );
+    if ( Log::enabled( Log::Debug ) )
+        log( "Injecting " + fn( d->messages.count() ) + " messages (" +
+             fn( d->injectables.count() ) + ", " +
+             fn( d->deliveries.count() ) + ")", Log::Debug );
 }
 
 
@@ -525,6 +816,7 @@ void Injector::createMailboxes()
 void Injector::findDependencies()
 {
     Dict<Injector> seenFields;
+    bool compact = Configuration::toggle( Configuration::CompactHeaders );
 
     List<Header> * l = new List<Header>;
 
@@ -563,7 +855,8 @@ void Injector::findDependencies()
                 EString n( hf->name() );
 
                 if ( hf->type() >= HeaderField::Other &&
-                     !seenFields.contains( n ) )
+                     !seenFields.contains( n ) &&
+                     ( !compact || HeaderField::isBrokenOut( n ) ) )
                 {
                     d->fields.append( n );
                     seenFields.insert( n, this );
@@ -993,7 +1286,9 @@ void Injector::convertThreadIndex()
             // this will be run first because of "order by field desc" above
             t = new InjectorData::ThreadParentInfo;
             antecedents.insert( r->getEString( "value" ), t );
-            log( "antecedent <" + r->getEString( "value" ) + ">", Log::Debug );
+            if ( Log::enabled( Log::Debug ) )
+                log( "antecedent <" + r->getEString( "value" ) + ">",
+                     Log::Debug );
             antecedents2.insert( m, t );
         }
     }
@@ -1024,7 +1319,8 @@ void Injector::convertThreadIndex()
             if ( !tpi && t.length() > 27 ) {
                 // we don't, but maybe there is a grandparent?
                 EString gt = t.mid( 0, ( (t.length() - 22 - 6) / 5 ) * 5 + 22 );
-                log( "considering <" + gt.e64() + ">", Log::Debug );
+                if ( Log::enabled( Log::Debug ) )
+                    log( "considering <" + gt.e64() + ">", Log::Debug );
                 tpi = antecedents.find( gt.e64() );
             }
             if ( tpi && ref.isEmpty() ) {
@@ -1096,6 +1392,87 @@ void Injector::insertThreadIndexes()
 }
 
 
+/*! Inserts a row into thread_links for each message that has a
+    Message-ID or a parent, and links the messages to their parents
+    and children using linkThreads().
+
+    By now, convertInReplyTo() and addMoreReferences() have given
+    References fields to the messages which only had In-Reply-To, so
+    the parent is always the last message-id in References. All of
+    References is recorded as well, so that Thread can link a message
+    to its grandparent when its parent is missing.
+*/
+
+void Injector::insertThreadLinks()
+{
+    Query * q = new Query( "copy thread_links "
+                           "(message, messageid, parent_messageid, "
+                           "ancestors) "
+                           "from stdin with binary", 0 );
+
+    IntegerSet ids;
+    List<Injectee>::Iterator m( d->messages );
+    while ( m ) {
+        InjectorData::ThreadInjectee t( m, d->transaction );
+        EString id = t.messageId();
+        EStringList refs = t.references();
+        if ( !id.isEmpty() || !refs.isEmpty() ) {
+            q->bind( 1, m->databaseId() );
+            if ( id.isEmpty() )
+                q->bindNull( 2 );
+            else
+                q->bind( 2, id );
+            if ( refs.isEmpty() ) {
+                q->bindNull( 3 );
+                q->bindNull( 4 );
+            }
+            else {
+                q->bind( 3, *refs.lastElement() );
+                q->bind( 4, refs.join( " " ) );
+            }
+            q->submitLine();
+            ids.add( m->databaseId() );
+        }
+        ++m;
+    }
+
+    if ( ids.isEmpty() )
+        return;
+
+    d->transaction->enqueue( q );
+    linkThreads( d->transaction, ids );
+}
+
+
+/*! Enqueues queries in \a t to fill in thread_links.parent for the
+    messages in \a ids, and for the messages whose parents are among
+    \a ids. The rows for \a ids must already be in thread_links.
+
+    Children and parents can arrive in either order, so each new
+    message looks for its parent and for children that have been
+    waiting for it.
+*/
+
+void Injector::linkThreads( Transaction * t, const IntegerSet & ids )
+{
+    Query * q = new Query( "update thread_links c set parent=p.message "
+                           "from thread_links p "
+                           "where c.message=any($1) and c.parent is null "
+                           "and p.messageid=c.parent_messageid "
+                           "and p.message!=c.message", 0 );
+    q->bind( 1, ids );
+    t->enqueue( q );
+
+    q = new Query( "update thread_links c set parent=p.message "
+                   "from thread_links p "
+                   "where p.message=any($1) and c.parent is null "
+                   "and c.parent_messageid=p.messageid "
+                   "and p.message!=c.message", 0 );
+    q->bind( 1, ids );
+    t->enqueue( q );
+}
+
+
 /*! Inserts rows into the thread_roots table, so that insertMessages()
     can reference what it needs to.
 */
@@ -1128,19 +1505,64 @@ void Injector::insertBodyparts()
         if ( d->substate == 0 ) {
             List<Injectee>::Iterator it( d->messages );
             while ( it ) {
-                Message * m = it;
+                Injectee * m = it;
                 List<Bodypart>::Iterator bi( m->allBodyparts() );
                 while ( bi ) {
-                    addBodypartRow( bi );
+                    uint id = m->reusedBodypart( bi );
+                    if ( id )
+                        bi->setId( id );
+                    else
+                        addBodypartRow( bi );
                     ++bi;
                 }
                 ++it;
             }
 
+            if ( !d->cachedBodyparts.isEmpty() ) {
+                IntegerSet ids;
+                List<Bodypart>::Iterator bi( d->cachedBodyparts );
+                while ( bi ) {
+                    ids.add( bi->id() );
+                    ++bi;
+                }
+                d->select = new Query( "select id from bodyparts "
+                                       "where id=any($1) for share",
+                                       this );
+                d->select->bind( 1, ids );
+                d->transaction->enqueue( d->select );
+                d->transaction->execute();
+                d->substate = 10;
+            }
+            else if ( d->bodyparts.isEmpty() ) {
+                d->substate = 5;
+            }
+            else {
+                d->substate++;
+            }
+        }
+
+        if ( d->substate == 10 ) {
+            // the cached bodyparts which vacuum has removed are
+            // stored again
+            if ( !d->select->done() )
+                return;
+
+            IntegerSet found;
+            while ( d->select->hasResults() )
+                found.add( d->select->nextRow()->getInt( "id" ) );
+            List<Bodypart>::Iterator bi( d->cachedBodyparts );
+            while ( bi ) {
+                if ( !found.contains( bi->id() ) )
+                    addBodypartRow( bi, false );
+                ++bi;
+            }
+            d->cachedBodyparts.clear();
+            d->select = 0;
+
             if ( d->bodyparts.isEmpty() )
                 d->substate = 5;
             else
-                d->substate++;
+                d->substate = 1;
         }
 
         if ( d->substate == 1 ) {
@@ -1148,10 +1570,12 @@ void Injector::insertBodyparts()
                 new Query( "create temporary table bp ("
                            "bid integer, bytes integer, "
                            "hash text, text text, data bytea, "
+                           "compressed boolean, external boolean, "
                            "i integer, n boolean default 'f')", 0 );
 
             Query * copy =
-                new Query( "copy bp (bytes,hash,text,data,i) "
+                new Query( "copy bp "
+                           "(bytes,hash,text,data,compressed,external,i) "
                            "from stdin with binary", this );
 
             uint i = 0;
@@ -1169,7 +1593,9 @@ void Injector::insertBodyparts()
                     copy->bind( 4, *br->data );
                 else
                     copy->bindNull( 4 );
-                copy->bind( 5, i++ );
+                copy->bind( 5, br->compressed );
+                copy->bind( 6, br->external );
+                copy->bind( 7, i++ );
                 copy->submitLine();
 
                 ++bi;
@@ -1186,7 +1612,9 @@ void Injector::insertBodyparts()
             Query * setId =
                 new Query( "update bp set bid=b.id from bodyparts b where "
                            "bp.hash=b.hash and not bp.text is distinct from "
-                           "b.text and not bp.data is distinct from b.data",
+                           "b.text and not bp.data is distinct from b.data "
+                           "and bp.compressed=coalesce(b.compressed,false) "
+                           "and bp.external=coalesce(b.external,false)",
                            0 );
 
             Query * setNew =
@@ -1195,8 +1623,10 @@ void Injector::insertBodyparts()
 
             d->insert =
                 new Query( "insert into bodyparts "
-                           "(id,bytes,hash,text,data) "
-                           "select bid,bytes,hash,text,data "
+                           "(id,bytes,hash,text,data,compressed,external) "
+                           "select bid,bytes,hash,text,data,"
+                           "case when compressed then true end,"
+                           "case when external then true end "
                            "from bp where n", this );
 
             d->substate++;
@@ -1237,6 +1667,7 @@ void Injector::insertBodyparts()
                 BodypartRow * br = bi;
                 Row * r = d->select->nextRow();
                 uint id = r->getInt( "bid" );
+                br->id = id;
 
                 List<Bodypart>::Iterator it( br->bodyparts );
                 while ( it ) {
@@ -1270,9 +1701,13 @@ Query * Injector::selectNextvals( const EString & sequence, uint num )
 }
 
 
-/*! Adds \a b to the list of bodyparts if it's not there already. */
+/*! Adds \a b to the list of bodyparts if it's not there already.
+    If \a useCache is true and the same contents were injected a
+    moment ago, \a b gets the id they were stored with instead, and
+    insertBodyparts() checks that the id is still valid.
+*/
 
-void Injector::addBodypartRow( Bodypart * b )
+void Injector::addBodypartRow( Bodypart * b, bool useCache )
 {
     bool storeText = false;
     bool storeData = false;
@@ -1326,8 +1761,46 @@ void Injector::addBodypartRow( Bodypart * b )
     else {
         data = s = new EString( b->data() );
     }
+
+    // If we injected the same contents a moment ago, we know its id.
+
+    uint ph = ::prehash( *s );
+    if ( ::bodypartCache && useCache ) {
+        uint id = ::bodypartCache->find( ph, *s );
+        if ( id ) {
+            b->setId( id );
+            d->cachedBodyparts.append( b );
+            return;
+        }
+    }
+
     hash = MD5::hash( *s ).hex();
 
+    // Very large data may live in the BlobStore, and other large
+    // data may be stored compressed, if that helps.
+
+    bool external = false;
+    bool compressed = false;
+    uint threshold = Configuration::scalar( Configuration::CompressBodyparts );
+    if ( data && BlobStore::wanted( data->length() ) ) {
+        // external rows are matched by hash alone, since their data
+        // column is null, so they need a hash that can't collide
+        EString key = BlobStore::key( *data );
+        if ( BlobStore::store( key, *data ) ) {
+            hash = key;
+            data = 0;
+            external = true;
+        }
+    }
+    if ( !external && data && threshold && data->length() >= threshold ) {
+        EString c = Bodypart::compressed( *data );
+        if ( !c.isEmpty() &&
+             c.length() < data->length() - data->length() / 10 ) {
+            data = new EString( c );
+            compressed = true;
+        }
+    }
+
     // And where does it fit in the list of bodyparts we know already?
     // Either we've seen it before (in which case we add it to the list
     // of bodyparts in the appropriate BodypartRow entry), or we haven't
@@ -1337,7 +1810,11 @@ void Injector::addBodypartRow( Bodypart * b )
 
     if ( !br ) {
         br = new BodypartRow;
+        br->prehash = ph;
         br->hash = hash;
+        br->contents = s;
+        br->compressed = compressed;
+        br->external = external;
         br->text = text;
         br->data = data;
         br->bytes = b->numBytes();
@@ -1348,6 +1825,28 @@ void Injector::addBodypartRow( Bodypart * b )
 }
 
 
+/*! Records the ids of the bodyparts this Injector has stored, so that
+    later Injectors can reuse them without asking the database. This
+    should be called only once the transaction has committed, since
+    the ids of new bodyparts are meaningless if it didn't.
+*/
+
+void Injector::rememberBodyparts()
+{
+    if ( d->bodyparts.isEmpty() )
+        return;
+    if ( !::bodypartCache )
+        ::bodypartCache = new BodypartCache;
+    List<BodypartRow>::Iterator bi( d->bodyparts );
+    while ( bi ) {
+        EString * s = bi->contents;
+        if ( bi->id && s )
+            ::bodypartCache->insert( bi->prehash, *s, bi->id );
+        ++bi;
+    }
+}
+
+
 /*! This function inserts rows into the messages table for each Message
     in d->messages, and updates the objects with the newly-created ids.
     It expects to be called repeatedly until it returns true, which it
@@ -1356,27 +1855,40 @@ void Injector::addBodypartRow( Bodypart * b )
 
 void Injector::selectMessageIds()
 {
+    IntegerSet ids;
     if ( !d->select ) {
-        d->select = selectNextvals( "messages_id_seq", d->messages.count() );
-        d->transaction->enqueue( d->select );
-        d->transaction->execute();
+        if ( !::messageIds ) {
+            ::messageIds = new IdPool;
+            Allocator::addEternal( ::messageIds, "prefetched message ids" );
+        }
+        ids = ::messageIds->take( d->messages.count() );
+        if ( ids.isEmpty() ) {
+            d->select = selectNextvals( "messages_id_seq",
+                                        d->messages.count() );
+            d->transaction->enqueue( d->select );
+            d->transaction->execute();
+        }
     }
 
-    if ( !d->select->done() )
-        return;
-
-    if ( d->select->failed() )
-        return;
+    if ( d->select ) {
+        if ( !d->select->done() )
+            return;
+        if ( d->select->failed() )
+            return;
+        while ( d->select->hasResults() )
+            ids.add( d->select->nextRow()->getInt( "id" ) );
+        d->select = 0;
+    }
 
     Query * copy
         = new Query( "copy messages "
-                     "(id,rfc822size,idate,thread_root) "
+                     "(id,rfc822size,idate,thread_root,base_subject) "
                      "from stdin with binary", this );
 
+    uint i = 0;
     List<Injectee>::Iterator m( d->messages );
-    while ( m && d->select->hasResults() ) {
-        Row * r = d->select->nextRow();
-        m->setDatabaseId( r->getInt( "id" ) );
+    while ( m && i < ids.count() ) {
+        m->setDatabaseId( ids.value( ++i ) );
         copy->bind( 1, m->databaseId() );
         if ( !m->hasTrivia() ) {
             m->setRfc822Size( m->rfc822( false ).length() );
@@ -1392,6 +1904,11 @@ void Injector::selectMessageIds()
         else {
             copy->bindNull( 4 );
         }
+        HeaderField * subject = m->header()->field( HeaderField::Subject );
+        if ( subject )
+            copy->bind( 5, Message::baseSubject( subject->value() ) );
+        else
+            copy->bindNull( 5 );
         copy->submitLine();
         ++m;
     }
@@ -1427,9 +1944,17 @@ void Injector::selectUids()
     // message.
     //
     // To protect against concurrent injection into the same
-    // mailboxes, we hold a write lock on the mailboxes during
-    // injection; thus, the Injectors try to acquire locks in the same
-    // order to avoid deadlock.
+    // mailboxes, we hold a write lock on the mailboxes from here
+    // until the transaction commits; thus, the Injectors try to
+    // acquire locks in the same order to avoid deadlock.
+    //
+    // Everything that doesn't depend on the UIDs (the messages, their
+    // header fields, deliveries and threads) has already been
+    // enqueued, so the lock is held only while the mailbox_messages,
+    // flags and annotations rows are copied in and the transaction
+    // commits. Since a mailbox's UIDs are allocated and committed
+    // under this one lock, a transaction that sees uidnext also sees
+    // all the messages below it, as IMAP requires.
 
     if ( !d->lockUidnext ) {
         if ( d->mailboxes.isEmpty() ) {
@@ -1513,6 +2038,14 @@ void Injector::selectUids()
         u->bind( 1, mb->mailbox->id() );
         u->bind( 2, n );
         d->transaction->enqueue( u );
+
+        if ( n ) {
+            IntegerSet uids;
+            uids.add( uidnext, uidnext + n - 1 );
+            MailboxChange::publish( d->transaction, mb->mailbox,
+                                    MailboxChange::New, uids,
+                                    nextms, uidnext + n );
+        }
     }
 
     if ( d->lockUidnext->done() )
@@ -1520,7 +2053,10 @@ void Injector::selectUids()
 }
 
 
-/*! Injects messages into the correct tables. */
+/*! Injects messages into the correct tables, except those which
+    need to know the messages' UIDs. insertMailboxMessages() does the
+    rest.
+*/
 
 void Injector::insertMessages()
 {
@@ -1536,25 +2072,15 @@ void Injector::insertMessages()
                    "from stdin with binary", 0 );
     Query * qd =
         new Query( "copy date_fields (message,value) from stdin", 0 );
-
-    Query * qm =
-        new Query( "copy mailbox_messages "
-                   "(mailbox,uid,message,modseq,seen,deleted) "
-                   "from stdin with binary", 0 );
-    Query * qf =
-        new Query( "copy flags (mailbox,uid,flag) "
-                   "from stdin with binary", 0 );
-    Query * qn =
-        new Query( "copy annotations (mailbox,uid,name,value,owner) "
+    Query * qb =
+        new Query( "copy header_blobs (message,part,fields) "
                    "from stdin with binary", 0 );
+
     Query * qw =
         new Query( "copy unparsed_messages (bodypart) "
                    "from stdin with binary", 0 );
 
-    uint flags = 0;
     uint wrapped = 0;
-    uint mailboxes = 0;
-    uint annotations = 0;
 
     List<Injectee>::Iterator it( d->messages );
     while ( it ) {
@@ -1566,7 +2092,7 @@ void Injector::insertMessages()
         // bodyparts table.
 
         addPartNumber( qp, mid, "" );
-        addHeader( qh, qa, qd, mid, "", m->header() );
+        addHeader( qh, qa, qd, qb, mid, "", m->header() );
 
         // Since the MIME header fields belonging to the first-child of
         // a single-part Message are appended to the RFC 822 header, we
@@ -1593,7 +2119,7 @@ void Injector::insertMessages()
 
             addPartNumber( qp, mid, pn, b );
             if ( !skip )
-                addHeader( qh, qa, qd, mid, pn, b->header() );
+                addHeader( qh, qa, qd, qb, mid, pn, b->header() );
             else
                 skip = false;
 
@@ -1602,7 +2128,8 @@ void Injector::insertMessages()
             if ( b->message() ) {
                 EString rpn( pn + ".rfc822" );
                 addPartNumber( qp, mid, rpn, b );
-                addHeader( qh, qa, qd, mid, rpn, b->message()->header() );
+                addHeader( qh, qa, qd, qb, mid, rpn,
+                           b->message()->header() );
             }
 
             // If the message we're injecting is a wrapper around a
@@ -1623,6 +2150,40 @@ void Injector::insertMessages()
         ++it;
     }
 
+    d->transaction->enqueue( qp );
+    d->transaction->enqueue( qh );
+    d->transaction->enqueue( qa );
+    d->transaction->enqueue( qd );
+    if ( Configuration::toggle( Configuration::CompactHeaders ) )
+        d->transaction->enqueue( qb );
+    if ( wrapped )
+        d->transaction->enqueue( qw );
+}
+
+
+/*! Injects the mailbox-specific rows for each message: its UID,
+    flags and annotations in each mailbox. This is called once
+    selectUids() holds the lock on the mailboxes, so it does as little
+    as possible.
+*/
+
+void Injector::insertMailboxMessages()
+{
+    Query * qm =
+        new Query( "copy mailbox_messages "
+                   "(mailbox,uid,message,modseq,seen,deleted) "
+                   "from stdin with binary", 0 );
+    Query * qf =
+        new Query( "copy flags (mailbox,uid,flag) "
+                   "from stdin with binary", 0 );
+    Query * qn =
+        new Query( "copy annotations (mailbox,uid,name,value,owner) "
+                   "from stdin with binary", 0 );
+
+    uint flags = 0;
+    uint mailboxes = 0;
+    uint annotations = 0;
+
     List<Injectee>::Iterator imi( d->injectables );
     while ( imi ) {
         Injectee * m = imi;
@@ -1644,18 +2205,12 @@ void Injector::insertMessages()
         }
     }
 
-    d->transaction->enqueue( qp );
-    d->transaction->enqueue( qh );
-    d->transaction->enqueue( qa );
-    d->transaction->enqueue( qd );
     if ( mailboxes )
         d->transaction->enqueue( qm );
     if ( flags )
         d->transaction->enqueue( qf );
     if ( annotations )
         d->transaction->enqueue( qn );
-    if ( wrapped )
-        d->transaction->enqueue( qw );
 }
 
 
@@ -1691,11 +2246,20 @@ void Injector::addPartNumber( Query * q, uint mid, const EString &part,
 /*! Add each field from the header \a h (belonging to the given \a part
     of the message with id \a mid) to one of the queries \a qh, \a qa,
     or \a qd, depending on their type.
+
+    If compact-headers is enabled, the fields which aren't broken out
+    (see HeaderField::isBrokenOut()) are instead collected into a
+    single header_blobs row, which is added to \a qb. Each field is one
+    line, "position name: value", with backslash, CR and LF escaped.
 */
 
-void Injector::addHeader( Query * qh, Query * qa, Query * qd, uint mid,
-                          const EString & part, Header * h )
+void Injector::addHeader( Query * qh, Query * qa, Query * qd, Query * qb,
+                          uint mid, const EString & part, Header * h )
 {
+    bool compact = Configuration::toggle( Configuration::CompactHeaders );
+    PgUtf8Codec p;
+    EString blob;
+
     List< HeaderField >::Iterator it( h->fields() );
     while ( it ) {
         HeaderField * hf = it;
@@ -1716,6 +2280,19 @@ void Injector::addHeader( Query * qh, Query * qa, Query * qd, uint mid,
                 ++n;
             }
         }
+        else if ( compact && !HeaderField::isBrokenOut( hf->name() ) ) {
+            EString v = p.fromUnicode( hf->value() );
+            v.replace( "\\", "\\\\" );
+            v.replace( "\r", "\\r" );
+            v.replace( "\n", "\\n" );
+            if ( !blob.isEmpty() )
+                blob.append( '\n' );
+            blob.appendNumber( hf->position() );
+            blob.append( ' ' );
+            blob.append( hf->name() );
+            blob.append( ": " );
+            blob.append( v );
+        }
         else {
             uint t = 0;
             if ( d->fieldNameCreator )
@@ -1740,6 +2317,13 @@ void Injector::addHeader( Query * qh, Query * qa, Query * qd, uint mid,
 
         ++it;
     }
+
+    if ( blob.isEmpty() )
+        return;
+    qb->bind( 1, mid );
+    qb->bind( 2, part );
+    qb->bind( 3, blob );
+    qb->submitLine();
 }
 
 
@@ -1842,9 +2426,11 @@ void Injector::insertDeliveries()
 
         Query * q =
             new Query( "insert into deliveries "
-                       "(sender,message,injected_at,expires_at,deliver_after) "
+                       "(sender,message,injected_at,expires_at,deliver_after,"
+                       "next_attempt) "
                        "values ($1,$2,current_timestamp,"
-                       "current_timestamp+interval '2 weeks',$3)", 0 );
+                       "current_timestamp+interval '2 weeks',$3,"
+                       "coalesce($3,current_timestamp))", 0 );
         q->bind( 1, sender->id() );
         q->bind( 2, di->message->databaseId() );
         if ( di->later )
@@ -1875,7 +2461,8 @@ void Injector::insertDeliveries()
         Header * h = di->message->header();
         if ( h && h->field( "Auto-Submitted" ) && !di->later ) {
             q = new Query( "update deliveries "
-                           "set deliver_after=injected_at+'1 minute'::interval "
+                           "set deliver_after=injected_at+'1 minute'::interval,"
+                           " next_attempt=injected_at+'1 minute'::interval "
                            "where message=$1 and exists ("
                            "(select dr.id from delivery_recipients dr"
                            " join addresses a on (dr.recipient=a.id)"
@@ -1896,7 +2483,7 @@ void Injector::insertDeliveries()
         ++di;
     }
 
-    d->transaction->enqueue( new Query( "notify deliveries_updated", 0 ) );
+    d->transaction->enqueueNotification( "deliveries_updated" );
 }
 
 
@@ -2023,6 +2610,15 @@ public:
 
     List<Mailbox> mailboxes;
 
+    struct Reuse
+        : public Garbage
+    {
+        Reuse( Bodypart * b, uint i ): bodypart( b ), id( i ) {}
+        Bodypart * bodypart;
+        uint id;
+    };
+    List<Reuse> reused;
+
     Mailbox * mailbox( ::Mailbox * mb, bool create = false ) {
         if ( mailboxes.firstElement() &&
              mailboxes.firstElement()->mailbox == mb )
@@ -2190,6 +2786,69 @@ List<Mailbox> * Injectee::mailboxes() const
 }
 
 
+// returns true if \a a and \a b would be stored as the same bodyparts
+// row; that is, if they have the same type and contents.
+static bool sameContents( Bodypart * a, Bodypart * b )
+{
+    ContentType * ac = a->contentType();
+    ContentType * bc = b->contentType();
+    if ( !ac != !bc )
+        return false;
+    if ( ac && ( ac->type() != bc->type() ||
+                 ac->subtype() != bc->subtype() ) )
+        return false;
+    if ( ac && ac->type() == "multipart" )
+        return false;
+    if ( ac && ac->type() != "text" ) {
+        EString d = a->data();
+        return !d.isEmpty() && d == b->data();
+    }
+    UString t = a->text();
+    return !t.isEmpty() && t == b->text();
+}
+
+
+/*! Notes that this message may contain bodyparts of \a source, an
+    existing message whose bodies were fetched from the database (for
+    example by CATENATE), so that the Injector can point to the
+    existing bodyparts rows instead of storing the contents again.
+*/
+
+void Injectee::reuseBodyparts( Message * source )
+{
+    if ( !source )
+        return;
+    List<Bodypart>::Iterator o( source->allBodyparts() );
+    while ( o ) {
+        if ( o->id() ) {
+            List<Bodypart>::Iterator b( allBodyparts() );
+            while ( b ) {
+                if ( !reusedBodypart( b ) && sameContents( b, o ) )
+                    d->reused.append( new InjecteeData::Reuse( b,
+                                                               o->id() ) );
+                ++b;
+            }
+        }
+        ++o;
+    }
+}
+
+
+/*! Returns the id of the existing bodyparts row that \a b can use
+    (see reuseBodyparts()), or 0 if \a b has to be stored.
+*/
+
+uint Injectee::reusedBodypart( Bodypart * b ) const
+{
+    List<InjecteeData::Reuse>::Iterator i( d->reused );
+    while ( i && i->bodypart != b )
+        ++i;
+    if ( i )
+        return i->id;
+    return 0;
+}
+
+
 // scans the message for a header field of the appropriate name, and
 // returns the field value. The name must not contain the trailing ':'.
 
@@ -13,6 +13,8 @@ class Address;
 class Mailbox;
 class Bodypart;
 class Annotation;
+class Transaction;
+class IntegerSet;
 class UStringList;
 
 
@@ -36,6 +38,9 @@ public:
 
     List<Mailbox> * mailboxes() const;
 
+    void reuseBodyparts( Message * );
+    uint reusedBodypart( Bodypart * ) const;
+
     static Injectee * wrapUnparsableMessage( const EString &,
                                              const EString &,
                                              const EString &,
@@ -62,14 +67,19 @@ public:
                       class Date * = 0 );
 
     void setTransaction( class Transaction * );
+    void allowBatching();
 
     void addAddress( Address * );
     uint addressId( Address * );
 
+    static void linkThreads( Transaction *, const IntegerSet & );
+
 private:
     class InjectorData * d;
 
     void next();
+    bool board();
+    void finishBatch();
     void createMailboxes();
     void findMessages();
     void findDependencies();
@@ -80,14 +90,18 @@ private:
     void convertThreadIndex();
     void insertThreadIndexes();
     void insertThreadRoots();
+    void insertThreadLinks();
     void insertBodyparts();
-    void addBodypartRow( Bodypart * );
+    void addBodypartRow( Bodypart *, bool = true );
+    void rememberBodyparts();
     void selectMessageIds();
     void selectUids();
     void insertMessages();
+    void insertMailboxMessages();
     void insertDeliveries();
     void addPartNumber( Query *, uint, const EString &, Bodypart * = 0 );
-    void addHeader( Query *, Query *, Query *, uint, const EString &, Header * );
+    void addHeader( Query *, Query *, Query *, Query *,
+                    uint, const EString &, Header * );
     void addMailbox( Query *, Injectee *, Mailbox * );
     uint addFlags( Query *, Injectee *, Mailbox * );
     uint addAnnotations( Query *, Injectee *, Mailbox * );
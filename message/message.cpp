@@ -15,10 +15,53 @@
 #include "dict.h"
 #include "flag.h"
 #include "md5.h"
+#include "log.h"
+#include "graph.h"
+
+// gettimeofday
+#include <sys/time.h>
 
 
 static const char * crlf = "\015\012";
 
+static GraphableDataSet * parseTime = 0;
+static GraphableDataSet * parseTimeMax = 0;
+
+
+// Records how long Message::parse() takes, in the message-parse-time
+// data sets, and logs parses which stall the event loop noticeably.
+
+class ParseTimer
+{
+public:
+    ParseTimer( uint s ): size( s ) {
+        (void)::gettimeofday( &started, 0 );
+    }
+
+    ~ParseTimer() {
+        struct timeval now;
+        (void)::gettimeofday( &now, 0 );
+        long ms = ( now.tv_sec - started.tv_sec ) * 1000 +
+                  ( now.tv_usec - started.tv_usec ) / 1000;
+        if ( ms < 0 )
+            ms = 0;
+        if ( !::parseTime ) {
+            ::parseTime = new GraphableDataSet( "message-parse-time" );
+            ::parseTimeMax = new GraphableDataSet( "message-parse-time-max",
+                                                   100 );
+        }
+        ::parseTime->addNumber( (uint)ms );
+        ::parseTimeMax->addNumber( (uint)ms );
+        if ( ms >= 500 )
+            ::log( "Parsing a message of " + EString::humanNumber( size ) +
+                   " bytes took " + fn( ms ) + "ms", Log::Info );
+    }
+
+private:
+    struct timeval started;
+    uint size;
+};
+
 
 class MessageData
     : public Garbage
@@ -28,7 +71,10 @@ public:
         : databaseId( 0 ), threadId( 0 ),
           wrapped( false ), rfc822Size( 0 ), internalDate( 0 ),
           hasHeaders( false ), hasAddresses( false ), hasBodies( false ),
-          hasTrivia( false ), hasBytesAndLines( false ), hasPGPsignedPart( false )
+          hasTrivia( false ), hasBytesAndLines( false ),
+          hasPGPsignedPart( false ),
+          cacheRfc822( false ), renderedAvoidsUtf8( false ),
+          fetchedFields( 0 )
     {}
 
     EString error;
@@ -46,7 +92,12 @@ public:
     bool hasTrivia : 1;
     bool hasBytesAndLines : 1;
     bool hasPGPsignedPart : 1;
+    bool cacheRfc822 : 1;
+    bool renderedAvoidsUtf8 : 1;
     EString rawSignedMessageBody;
+    EString rendered;
+
+    EStringList * fetchedFields;
 };
 
 
@@ -84,6 +135,7 @@ Message::Message()
 
 void Message::parse( const EString & rfc2822 )
 {
+    ParseTimer timer( rfc2822.length() );
     uint i = 0;
 
     children()->clear();
@@ -247,8 +299,11 @@ Header * Message::parseHeader( uint & i, uint end,
             if ( j && rfc2822[j-1] == '\r' )
                 j--;
             EString value = rfc2822.mid( i, j-i );
-            if ( !value.simplified().isEmpty() ||
-                 name.lower().startsWith( "x-" ) ) {
+            uint k = i;
+            while ( k < j && ( rfc2822[k] == ' ' || rfc2822[k] == '\t' ||
+                               rfc2822[k] == '\r' || rfc2822[k] == '\n' ) )
+                k++;
+            if ( k < j || name.lower().startsWith( "x-" ) ) {
                 HeaderField * f = HeaderField::create( name, value );
                 h->add( f );
             }
@@ -296,6 +351,10 @@ EString Message::error() const
 
 EString Message::rfc822( bool avoidUtf8 ) const
 {
+    if ( d->cacheRfc822 && !d->rendered.isEmpty() &&
+         d->renderedAvoidsUtf8 == avoidUtf8 )
+        return d->rendered;
+
     EString r;
     if ( d->rfc822Size )
         r.reserve( d->rfc822Size );
@@ -306,10 +365,37 @@ EString Message::rfc822( bool avoidUtf8 ) const
     r.append( crlf );
     r.append( body( avoidUtf8 ) );
 
+    if ( d->cacheRfc822 && d->hasHeaders && d->hasAddresses && d->hasBodies ) {
+        d->rendered = r;
+        d->renderedAvoidsUtf8 = avoidUtf8;
+    }
+
     return r;
 }
 
 
+/*! Records that this message will not change once it has been fetched
+    completely, so that rfc822() may keep the text it returns and
+    return it again the next time. MessageCache calls this for the
+    messages it holds.
+*/
+
+void Message::setRfc822Cacheable()
+{
+    d->cacheRfc822 = true;
+}
+
+
+/*! Returns the length of the text kept by rfc822(), or 0 if it hasn't
+    kept any.
+*/
+
+uint Message::cachedRfc822Size() const
+{
+    return d->rendered.length();
+}
+
+
 /*! Returns the text representation of the body of this message. */
 
 EString Message::body( bool avoidUtf8 ) const
@@ -534,6 +620,7 @@ bool Message::hasBodies() const
 void Message::setHeadersFetched()
 {
     d->hasHeaders = true;
+    d->rendered.truncate();
 }
 
 
@@ -543,6 +630,7 @@ void Message::setBodiesFetched()
 {
     setBytesAndLinesFetched();
     d->hasBodies = true;
+    d->rendered.truncate();
 }
 
 
@@ -864,6 +952,77 @@ bool Message::hasAddresses() const
 void Message::setAddressesFetched()
 {
     d->hasAddresses = true;
+    d->rendered.truncate();
+}
+
+
+/*! Returns true if this message knows the contents of its top-level
+    header field(s) called \a name, either because all its headers
+    (or addresses) have been fetched, or because setHeaderFieldFetched()
+    has been called for \a name.
+*/
+
+bool Message::hasHeaderField( const EString & name ) const
+{
+    uint t = HeaderField::fieldType( name );
+    if ( t > 0 && t <= HeaderField::LastAddressField ) {
+        if ( d->hasAddresses )
+            return true;
+    }
+    else {
+        if ( d->hasHeaders )
+            return true;
+    }
+    return d->fetchedFields && d->fetchedFields->contains( name.lower() );
+}
+
+
+/*! Records that the top-level header field(s) called \a name have
+    been fetched, while the rest of the header may not have been.
+*/
+
+void Message::setHeaderFieldFetched( const EString & name )
+{
+    if ( !d->fetchedFields )
+        d->fetchedFields = new EStringList;
+    if ( !d->fetchedFields->contains( name.lower() ) )
+        d->fetchedFields->append( name.lower() );
+}
+
+
+/*! Removes the fields noted by setHeaderFieldFetched() from the
+    header, so that fetching the entire header (if \a addresses is
+    false) or all the addresses (if \a addresses is true) won't add
+    any field twice.
+*/
+
+void Message::removeFetchedFields( bool addresses )
+{
+    if ( !d->fetchedFields )
+        return;
+
+    d->rendered.truncate();
+    EStringList::Iterator i( d->fetchedFields );
+    while ( i ) {
+        EString name = *i;
+        uint t = HeaderField::fieldType( name );
+        bool a = t > 0 && t <= HeaderField::LastAddressField;
+        if ( a == addresses ) {
+            EString exact;
+            List<HeaderField>::Iterator f( header()->fields() );
+            while ( f && exact.isEmpty() ) {
+                if ( f->name().lower() == name )
+                    exact = f->name();
+                ++f;
+            }
+            if ( !exact.isEmpty() )
+                header()->removeField( exact.cstr() );
+            d->fetchedFields->take( i );
+        }
+        else {
+            ++i;
+        }
+    }
 }
 
 
@@ -45,6 +45,9 @@ public:
 
     List<Bodypart> * allBodyparts() const;
 
+    void setRfc822Cacheable();
+    uint cachedRfc822Size() const;
+
     void setRfc822Size( uint );
     uint rfc822Size() const;
     void setInternalDate( uint );
@@ -54,6 +57,9 @@ public:
     void setHeadersFetched();
     bool hasAddresses() const;
     void setAddressesFetched();
+    bool hasHeaderField( const EString & ) const;
+    void setHeaderFieldFetched( const EString & );
+    void removeFetchedFields( bool );
     bool hasTrivia() const;
     void setTriviaFetched( bool );
     bool hasBodies() const;
@@ -2,32 +2,69 @@
 
 #include "messagecache.h"
 
+#include "configuration.h"
+#include "bodypart.h"
 #include "message.h"
 #include "mailbox.h"
 #include "server.h"
-#include "map.h"
-
-#include <time.h> // time(0)
+#include "hashmap.h"
+#include "header.h"
+#include "graph.h"
 
 
 static class MessageCache * c = 0;
+static GraphableCounter * hits = 0;
+static GraphableCounter * misses = 0;
+static GraphableCounter * evictions = 0;
 
 
 class MessageCacheData
     : public Garbage
 {
 public:
-    MessageCacheData(): Garbage() {}
-    Map<Map<Message> > m;
+    MessageCacheData(): Garbage(), newest( 0 ), oldest( 0 ) {}
+
+    // one Entry per cached message, linked from newest to oldest use
+    class Entry
+        : public Garbage
+    {
+    public:
+        Entry(): Garbage(), mailbox( 0 ), uid( 0 ), message( 0 ),
+                 newer( 0 ), older( 0 ) {}
+        uint mailbox;
+        uint uid;
+        Message * message;
+        Entry * newer;
+        Entry * older;
+    };
+
+    HashMap<HashMap<Entry> > m;
+    Entry * newest;
+    Entry * oldest;
+
+    void unlink( Entry * );
+    void use( Entry * );
+    void evict( Entry * );
 };
 
 
 /*! \class MessageCache messagecache.h
 
-  The MessageCache class caches messages until the Allocator decides
-  to clear out old Garbage. As a special feature, it can also cache
-  messages a few seconds longer, although that should be used
-  sparingly.
+  The MessageCache class caches messages for reuse, keeping those
+  used most recently.
+
+  Unlike most other Cache subclasses, it isn't emptied at garbage
+  collection time. Instead shrink() estimates how much memory the
+  cached headers and bodies use, and discards the least recently used
+  messages until each is within its budget, half of message-cache-size
+  for headers and half for bodies. shrink() is called only when the
+  total exceeds message-cache-size, not merely because garbage is
+  being collected. The bodies' budget also
+  covers the text Message::rfc822() keeps for the cached messages, so
+  that FETCH BODY[] and POP RETR don't build it anew each time. The
+  number of hits,
+  misses and evictions is available as message-cache-hits,
+  message-cache-misses and message-cache-evictions.
 */
 
 
@@ -38,7 +75,10 @@ public:
 MessageCache::MessageCache()
     : Cache( 1 ), d( new MessageCacheData )
 {
-    // nothing
+    reconfigure();
+    ::hits = new GraphableCounter( "message-cache-hits" );
+    ::misses = new GraphableCounter( "message-cache-misses" );
+    ::evictions = new GraphableCounter( "message-cache-evictions" );
 }
 
 
@@ -53,12 +93,20 @@ void MessageCache::insert( class Mailbox * mb, uint uid,
         return;
     if ( !c )
         c = new MessageCache;
-    Map<Message> * mbcache = c->d->m.find( mb->id() );
+    HashMap<MessageCacheData::Entry> * mbcache = c->d->m.find( mb->id() );
     if ( !mbcache ) {
-        mbcache = new Map<Message>;
+        mbcache = new HashMap<MessageCacheData::Entry>;
         c->d->m.insert( mb->id(), mbcache );
     }
-    mbcache->insert( uid, m );
+    MessageCacheData::Entry * e = mbcache->find( uid );
+    if ( !e ) {
+        e = new MessageCacheData::Entry;
+        e->mailbox = mb->id();
+        e->uid = uid;
+        mbcache->insert( uid, e );
+    }
+    e->message = m;
+    c->d->use( e );
 }
 
 
@@ -70,16 +118,123 @@ class Message * MessageCache::find( class Mailbox * mailbox, uint uid )
 {
     if ( !c )
         return 0;
-    Map<Message> * mbcache = c->d->m.find( mailbox->id() );
+    MessageCacheData::Entry * e = 0;
+    HashMap<MessageCacheData::Entry> * mbcache
+        = c->d->m.find( mailbox->id() );
     if ( mbcache )
-        return mbcache->find( uid );
-    return 0;
+        e = mbcache->find( uid );
+    if ( !e ) {
+        ::misses->tick();
+        return 0;
+    }
+    ::hits->tick();
+    c->d->use( e );
+    return e->message;
 }
 
 
 void MessageCache::clear()
 {
     d->m.clear();
+    d->newest = 0;
+    d->oldest = 0;
+}
+
+
+// Rough estimates of the memory used by the header and the bodies of
+// m. Bodypart::data() may have to read or decompress the data, so we
+// use the byte counts from the database instead.
+
+static uint headerCost( Message * m )
+{
+    if ( !m->hasHeaders() && !m->hasAddresses() )
+        return 0;
+    uint n = m->header()->fields()->count();
+    List<Bodypart>::Iterator i( m->allBodyparts() );
+    while ( i ) {
+        if ( i->header() )
+            n += i->header()->fields()->count();
+        ++i;
+    }
+    return n * 128;
+}
+
+
+static uint bodyCost( Message * m )
+{
+    if ( !m->hasBodies() )
+        return 0;
+    uint n = 0;
+    List<Bodypart>::Iterator i( m->allBodyparts() );
+    while ( i ) {
+        if ( i->children()->isEmpty() )
+            n += i->numBytes();
+        ++i;
+    }
+    return n + m->cachedRfc822Size();
+}
+
+
+/*! Sets the budget according to message-cache-size, or to a quarter
+    of memory-limit if that's 0.
+*/
+
+void MessageCache::reconfigure()
+{
+    uint mb = Configuration::scalar( Configuration::MessageCacheSize );
+    if ( !mb )
+        mb = Configuration::scalar( Configuration::MemoryLimit ) / 4;
+    if ( !mb )
+        mb = 1;
+    setBudget( 1024 * 1024 * mb );
+}
+
+
+/*! Returns the estimated size of the cached headers and bodies. */
+
+uint MessageCache::cost() const
+{
+    uint n = 0;
+    MessageCacheData::Entry * e = d->newest;
+    while ( e ) {
+        n += headerCost( e->message ) + bodyCost( e->message );
+        e = e->older;
+    }
+    return n;
+}
+
+
+/*! Discards the least recently used messages until the headers and
+    the bodies of those remaining fit in their budgets. A message is
+    discarded for exceeding the body budget only if it has bodies.
+*/
+
+void MessageCache::shrink()
+{
+    uint limit = budget() / 2;
+
+    uint headers = 0;
+    uint bodies = 0;
+    MessageCacheData::Entry * e = d->newest;
+    while ( e ) {
+        headers += headerCost( e->message );
+        bodies += bodyCost( e->message );
+        e = e->older;
+    }
+
+    e = d->oldest;
+    while ( e && ( headers > limit || bodies > limit ) ) {
+        MessageCacheData::Entry * newer = e->newer;
+        uint h = headerCost( e->message );
+        uint b = bodyCost( e->message );
+        if ( headers > limit || b ) {
+            headers -= h;
+            bodies -= b;
+            d->evict( e );
+            ::evictions->tick();
+        }
+        e = newer;
+    }
 }
 
 
@@ -93,6 +248,54 @@ class Message * MessageCache::provide( class Mailbox * mailbox, uint uid )
     if ( m )
         return m;
     m = new Message;
+    m->setRfc822Cacheable();
     insert( mailbox, uid, m );
     return m;
 }
+
+
+// Removes e from the list of entries, leaving its neighbours linked.
+
+void MessageCacheData::unlink( Entry * e )
+{
+    if ( e->newer )
+        e->newer->older = e->older;
+    else if ( newest == e )
+        newest = e->older;
+    if ( e->older )
+        e->older->newer = e->newer;
+    else if ( oldest == e )
+        oldest = e->newer;
+    e->newer = 0;
+    e->older = 0;
+}
+
+
+// Records that e has just been used, making it the newest entry.
+
+void MessageCacheData::use( Entry * e )
+{
+    if ( newest == e )
+        return;
+    unlink( e );
+    e->older = newest;
+    if ( newest )
+        newest->newer = e;
+    newest = e;
+    if ( !oldest )
+        oldest = e;
+}
+
+
+// Removes e from the cache entirely.
+
+void MessageCacheData::evict( Entry * e )
+{
+    unlink( e );
+    HashMap<Entry> * mbcache = m.find( e->mailbox );
+    if ( mbcache ) {
+        mbcache->remove( e->uid );
+        if ( mbcache->isEmpty() )
+            m.remove( e->mailbox );
+    }
+}
@@ -18,6 +18,9 @@ public:
     static class Message * provide( class Mailbox *, uint );
 
     void clear();
+    void shrink();
+    uint cost() const;
+    void reconfigure();
 
 private:
     class MessageCacheData * d;
@@ -50,6 +50,7 @@ MimeField::MimeField( HeaderField::Type t )
 
 EStringList *MimeField::parameters() const
 {
+    parseIfNeeded();
     EStringList *l = new EStringList;
     List< MimeFieldData::Parameter >::Iterator it( d->parameters );
     while ( it ) {
@@ -67,6 +68,7 @@ EStringList *MimeField::parameters() const
 
 EString MimeField::parameterString() const
 {
+    parseIfNeeded();
     EString s;
     List< MimeFieldData::Parameter >::Iterator it( d->parameters );
     while ( it ) {
@@ -93,6 +95,7 @@ EString MimeField::parameterString() const
 
 EString MimeField::parameter( const EString &n ) const
 {
+    parseIfNeeded();
     EString s = n.lower();
     List< MimeFieldData::Parameter >::Iterator it( d->parameters );
     while ( it && s != it->name )
@@ -109,6 +112,7 @@ EString MimeField::parameter( const EString &n ) const
 
 void MimeField::addParameter( const EString &n, const EString &v )
 {
+    parseIfNeeded();
     EString s = n.lower();
     List< MimeFieldData::Parameter >::Iterator it( d->parameters );
     while ( it && s != it->name )
@@ -131,6 +135,7 @@ void MimeField::addParameter( const EString &n, const EString &v )
 
 void MimeField::removeParameter( const EString &n )
 {
+    parseIfNeeded();
     EString s = n.lower();
     List< MimeFieldData::Parameter >::Iterator it( d->parameters );
     while ( it && s != it->name )
@@ -269,6 +274,7 @@ void MimeField::parseParameters( EmailParser *p )
 
 EString MimeField::rfc822( bool ) const
 {
+    parseIfNeeded();
     EString s = baseValue();
     uint lineLength = name().length() + 2 + s.length();
 
@@ -309,6 +315,7 @@ EString MimeField::rfc822( bool ) const
 
 UString MimeField::value() const
 {
+    parseIfNeeded();
     Utf8Codec c;
     return c.toUnicode( rfc822( false ) );
     // the best that can be said about this is that it corresponds to
@@ -533,6 +540,7 @@ void ContentType::parse( const EString &s )
 
 EString ContentType::type() const
 {
+    parseIfNeeded();
     return t;
 }
 
@@ -541,12 +549,14 @@ EString ContentType::type() const
 
 EString ContentType::subtype() const
 {
+    parseIfNeeded();
     return st;
 }
 
 
 EString ContentType::baseValue() const
 {
+    parseIfNeeded();
     return t + "/" + st;
 }
 
@@ -602,6 +612,7 @@ void ContentTransferEncoding::parse( const EString &s )
 
 void ContentTransferEncoding::setEncoding( EString::Encoding en )
 {
+    parseIfNeeded();
     e = en;
 }
 
@@ -610,12 +621,14 @@ void ContentTransferEncoding::setEncoding( EString::Encoding en )
 
 EString::Encoding ContentTransferEncoding::encoding() const
 {
+    parseIfNeeded();
     return e;
 }
 
 
 EString ContentTransferEncoding::baseValue() const
 {
+    parseIfNeeded();
     EString s;
     switch ( e ) {
     case EString::Binary:
@@ -683,6 +696,7 @@ void ContentDisposition::parse( const EString &s )
 
 ContentDisposition::Disposition ContentDisposition::disposition() const
 {
+    parseIfNeeded();
     if ( d == "inline" )
         return Inline;
     else
@@ -692,6 +706,7 @@ ContentDisposition::Disposition ContentDisposition::disposition() const
 
 EString ContentDisposition::baseValue() const
 {
+    parseIfNeeded();
     return d;
 }
 
@@ -748,11 +763,13 @@ void ContentLanguage::parse( const EString &s )
 
 const EStringList *ContentLanguage::languages() const
 {
+    parseIfNeeded();
     return &l;
 }
 
 
 EString ContentLanguage::baseValue() const
 {
+    parseIfNeeded();
     return l.join( ", " );
 }
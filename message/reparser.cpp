@@ -0,0 +1,540 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "reparser.h"
+
+#include "configuration.h"
+#include "transaction.h"
+#include "estringlist.h"
+#include "integerset.h"
+#include "allocator.h"
+#include "blobstore.h"
+#include "bodypart.h"
+#include "injector.h"
+#include "database.h"
+#include "mailbox.h"
+#include "server.h"
+#include "timer.h"
+#include "query.h"
+#include "list.h"
+
+
+// the number of seconds a background Reparser rests between batches
+static const uint pause = 10;
+
+// and how long after startup it begins
+static const uint delay = 60;
+
+
+class ReparseBatch
+    : public EventHandler
+{
+public:
+    ReparseBatch( class ReparserData *, const IntegerSet & );
+
+    void execute();
+
+    ReparserData * d;
+    IntegerSet ids;
+    Transaction * t;
+    Query * q;
+    Injector * injector;
+    bool processed;
+    bool committed;
+    bool finished;
+    uint reparsed;
+    uint unparsable;
+    EStringList report;
+    EStringList failures;
+    EString error;
+};
+
+
+class ReparserData
+    : public Garbage
+{
+public:
+    ReparserData()
+        : owner( 0 ), reparser( 0 ),
+          batchSize( 256 ), concurrency( 1 ), last( 0 ),
+          background( false ), keepFailures( false ),
+          exhausted( false ), done( false ),
+          reparsed( 0 ), unparsable( 0 ),
+          find( 0 ), timer( 0 ),
+          report( new EStringList ), failures( new EStringList )
+    {}
+
+    EventHandler * owner;
+    Reparser * reparser;
+    uint batchSize;
+    uint concurrency;
+    uint last;
+    bool background;
+    bool keepFailures;
+    bool exhausted;
+    bool done;
+    uint reparsed;
+    uint unparsable;
+    EString error;
+
+    Query * find;
+    Timer * timer;
+    List<ReparseBatch> batches;
+    EStringList * report;
+    EStringList * failures;
+};
+
+
+/*! \class Reparser reparser.h
+    The Reparser class retries messages which could not be parsed when
+    they arrived, and stores those which can be parsed now.
+
+    Such messages are stored wrapped in an application/octet-stream
+    bodypart, and listed in unparsed_messages. When a newer parser can
+    cope with one, Reparser injects the parsed message into the same
+    mailbox, moves the wrapper to deleted_messages and removes the
+    unparsed_messages row.
+
+    The work is done in batches of setBatchSize() messages, in order of
+    bodypart ID, with one transaction per batch so that a failure or
+    interruption loses at most the batches in progress. Up to
+    setConcurrency() batches run at once. checkpoint() returns the
+    largest bodypart ID such that it and all smaller ones are done, and
+    setStart() lets a later Reparser resume from there.
+
+    If setBackground() is used, the Reparser runs one batch at a time,
+    starts a batch only when the database is idle and rests between
+    batches, so that it can run within the server without getting in
+    the way. setup() starts such a Reparser if background-reparse is
+    enabled.
+*/
+
+
+/*! Constructs a Reparser which notifies \a owner after each batch and
+    when it's done(). Nothing happens until execute() is called.
+*/
+
+Reparser::Reparser( EventHandler * owner )
+    : d( new ReparserData )
+{
+    d->owner = owner;
+    d->reparser = this;
+    d->batchSize = Configuration::scalar( Configuration::ReparseBatchSize );
+    if ( !d->batchSize )
+        d->batchSize = 1;
+    setLog( new Log );
+}
+
+
+/*! Instructs this Reparser to retry at most \a n messages per
+    transaction. The default is reparse-batch-size.
+*/
+
+void Reparser::setBatchSize( uint n )
+{
+    d->batchSize = n ? n : 1;
+}
+
+
+/*! Instructs this Reparser to work on up to \a n batches at once. The
+    default is 1, and background Reparsers ignore this.
+*/
+
+void Reparser::setConcurrency( uint n )
+{
+    d->concurrency = n ? n : 1;
+}
+
+
+/*! Instructs this Reparser to skip the unparsed messages whose
+    bodypart ID is \a id or smaller, e.g. because an earlier Reparser's
+    checkpoint() was \a id. The default is 0, so nothing is skipped.
+*/
+
+void Reparser::setStart( uint id )
+{
+    d->last = id;
+}
+
+
+/*! Makes this Reparser run at low priority if \a background is true,
+    as described in the class documentation. The default is false.
+*/
+
+void Reparser::setBackground( bool background )
+{
+    d->background = background;
+}
+
+
+/*! Makes this Reparser keep a copy of each message that still cannot
+    be parsed, for takeFailures(), if \a keep is true. The default is
+    false.
+*/
+
+void Reparser::setKeepFailures( bool keep )
+{
+    d->keepFailures = keep;
+}
+
+
+void Reparser::execute()
+{
+    if ( d->done )
+        return;
+
+    bool progressed = false;
+
+    List<ReparseBatch>::Iterator b( d->batches );
+    while ( b ) {
+        if ( b->finished ) {
+            ReparseBatch * x = b;
+            d->batches.take( b );
+            d->reparsed += x->reparsed;
+            d->unparsable += x->unparsable;
+            d->report->append( x->report );
+            d->failures->append( x->failures );
+            if ( !x->error.isEmpty() && d->error.isEmpty() )
+                d->error = x->error;
+            log( "Reparsed " + fn( x->reparsed ) + " messages, " +
+                 fn( x->unparsable ) + " still unparsable, up to bodypart " +
+                 fn( x->ids.largest() ) );
+            progressed = true;
+            if ( d->background )
+                d->timer = new Timer( this, pause );
+        }
+        else {
+            ++b;
+        }
+    }
+
+    if ( d->find && d->find->done() ) {
+        IntegerSet ids;
+        while ( d->find->hasResults() )
+            ids.add( d->find->nextRow()->getInt( "bodypart" ) );
+        if ( d->find->failed() && d->error.isEmpty() )
+            d->error = d->find->error();
+        d->find = 0;
+        if ( ids.isEmpty() ) {
+            d->exhausted = true;
+        }
+        else {
+            d->last = ids.largest();
+            ReparseBatch * x = new ReparseBatch( d, ids );
+            d->batches.append( x );
+            x->execute();
+        }
+    }
+
+    if ( !d->find && !d->exhausted && d->error.isEmpty() )
+        startBatch();
+
+    if ( d->batches.isEmpty() && !d->find &&
+         ( d->exhausted || !d->error.isEmpty() ) ) {
+        d->done = true;
+        if ( !d->error.isEmpty() )
+            log( "Reparsing failed: " + d->error, Log::Error );
+        else if ( d->reparsed || d->unparsable )
+            log( "Reparsed " + fn( d->reparsed ) + " messages in all, " +
+                 fn( d->unparsable ) + " still unparsable",
+                 Log::Significant );
+    }
+
+    if ( d->owner && ( progressed || d->done ) )
+        d->owner->execute();
+}
+
+
+/*! Looks for the next batch of unparsed messages, if there's room for
+    another batch and this Reparser isn't resting.
+*/
+
+void Reparser::startBatch()
+{
+    uint concurrency = d->concurrency;
+    if ( d->background ) {
+        concurrency = 1;
+        if ( d->timer && d->timer->active() )
+            return;
+    }
+    if ( d->batches.count() >= concurrency )
+        return;
+    if ( d->background && !Database::idle() ) {
+        Database::notifyWhenIdle( this );
+        return;
+    }
+
+    d->find = new Query( "select bodypart from unparsed_messages "
+                         "where bodypart>$1 "
+                         "order by bodypart limit $2", this );
+    d->find->bind( 1, d->last );
+    d->find->bind( 2, d->batchSize );
+    d->find->execute();
+}
+
+
+/*! Returns true if this Reparser has finished its work, and false if
+    it's still working.
+*/
+
+bool Reparser::done() const
+{
+    return d->done;
+}
+
+
+/*! Returns true if a batch failed. The batches that completed before
+    stay committed.
+*/
+
+bool Reparser::failed() const
+{
+    return !d->error.isEmpty();
+}
+
+
+/*! Returns the error message if failed(), and an empty string if not.
+*/
+
+EString Reparser::error() const
+{
+    return d->error;
+}
+
+
+/*! Returns the largest bodypart ID such that all unparsed messages
+    with that ID or smaller have been handled. A Reparser given this
+    value with setStart() does the remaining work.
+*/
+
+uint Reparser::checkpoint() const
+{
+    uint c = d->last;
+    List<ReparseBatch>::Iterator b( d->batches );
+    while ( b ) {
+        if ( b->ids.smallest() <= c )
+            c = b->ids.smallest() - 1;
+        ++b;
+    }
+    return c;
+}
+
+
+/*! Returns the number of messages stored so far. */
+
+uint Reparser::reparsed() const
+{
+    return d->reparsed;
+}
+
+
+/*! Returns the number of messages which still cannot be parsed. */
+
+uint Reparser::unparsable() const
+{
+    return d->unparsable;
+}
+
+
+/*! Returns a list describing what happened to each message retried
+    since the last call, one line per message, and starts a new list.
+*/
+
+EStringList * Reparser::takeReport()
+{
+    EStringList * r = d->report;
+    d->report = new EStringList;
+    return r;
+}
+
+
+/*! Returns the text of each message which could not be parsed since
+    the last call, or an empty list unless setKeepFailures() was used,
+    and starts a new list.
+*/
+
+EStringList * Reparser::takeFailures()
+{
+    EStringList * r = d->failures;
+    d->failures = new EStringList;
+    return r;
+}
+
+
+// starts a background Reparser in the first server process, once
+// the server has settled down.
+
+class ReparseStarter
+    : public EventHandler
+{
+public:
+    ReparseStarter(): EventHandler() {}
+
+    void execute() {
+        if ( Server::process() > 1 )
+            return;
+        Reparser * r = new Reparser( 0 );
+        Allocator::addEternal( r, "background reparser" );
+        r->setBackground( true );
+        r->execute();
+    }
+};
+
+
+/*! Arranges for the server to start a background Reparser shortly
+    after startup, if background-reparse is enabled. Only the first of
+    the server-processes does so.
+
+    New messages are only stored unparsed if the current parser can't
+    handle them, so retrying once per server start is enough.
+*/
+
+void Reparser::setup()
+{
+    if ( !Configuration::toggle( Configuration::BackgroundReparse ) )
+        return;
+    ReparseStarter * s = new ReparseStarter;
+    Allocator::addEternal( s, "background reparse starter" );
+    (void)new Timer( s, delay );
+}
+
+
+/*! Constructs a batch which retries the unparsed messages in \a ids
+    on behalf of \a data's Reparser.
+*/
+
+ReparseBatch::ReparseBatch( ReparserData * data, const IntegerSet & set )
+    : EventHandler(), d( data ), ids( set ),
+      t( 0 ), q( 0 ), injector( 0 ),
+      processed( false ), committed( false ), finished( false ),
+      reparsed( 0 ), unparsable( 0 )
+{
+    setLog( d->reparser->log() );
+}
+
+
+void ReparseBatch::execute()
+{
+    if ( finished )
+        return;
+
+    if ( !t ) {
+        t = new Transaction( this );
+        q = new Query( "select mm.mailbox, mm.uid, mm.modseq, "
+                       "mm.message as wrapper, "
+                       "mb.nextmodseq, "
+                       "b.id as bodypart, b.text, b.data, b.compressed, "
+                       "b.external, b.hash "
+                       "from unparsed_messages u "
+                       "join bodyparts b on (u.bodypart=b.id) "
+                       "join part_numbers p on (p.bodypart=b.id) "
+                       "join mailbox_messages mm on (p.message=mm.message) "
+                       "join mailboxes mb on (mm.mailbox=mb.id) "
+                       "where u.bodypart=any($1) "
+                       "order by mm.mailbox "
+                       "for update of u",
+                       this );
+        q->bind( 1, ids );
+        t->enqueue( q );
+        t->execute();
+    }
+
+    if ( !q->done() )
+        return;
+
+    if ( !processed ) {
+        processed = true;
+        IntegerSet parsable;
+        List<Injectee> injectables;
+        while ( q->hasResults() ) {
+            Row * r = q->nextRow();
+            Mailbox * mb = Mailbox::find( r->getInt( "mailbox" ) );
+            if ( !mb )
+                continue;
+
+            EString text;
+            if ( !r->isNull( "external" ) && r->getBoolean( "external" ) )
+                text = BlobStore::fetch( r->getEString( "hash" ) );
+            else if ( r->isNull( "data" ) )
+                text = r->getEString( "text" );
+            else if ( !r->isNull( "compressed" ) &&
+                      r->getBoolean( "compressed" ) )
+                text = Bodypart::uncompressed( r->getEString( "data" ) );
+            else
+                text = r->getEString( "data" );
+
+            EString where = mb->name().utf8() + ":" +
+                            fn( r->getInt( "uid" ) );
+            Injectee * im = new Injectee;
+            im->parse( text );
+            if ( !im->valid() ) {
+                report.append( "parsing " + where + " still fails: " +
+                               im->error().simplified() );
+                if ( d->keepFailures )
+                    failures.append( text );
+                unparsable++;
+                continue;
+            }
+
+            EStringList x;
+            im->setFlags( mb, &x );
+            injectables.append( im );
+            parsable.add( r->getInt( "bodypart" ) );
+
+            Query * i
+                = new Query( "insert into deleted_messages "
+                             "(mailbox,uid,message,modseq,deleted_by,reason) "
+                             "values ($1,$2,$3,$4,$5,$6)", 0 );
+            i->bind( 1, r->getInt( "mailbox" ) );
+            i->bind( 2, r->getInt( "uid" ) );
+            i->bind( 3, r->getInt( "wrapper" ) );
+            i->bind( 4, r->getBigint( "nextmodseq" ) );
+            i->bindNull( 5 );
+            i->bind( 6,
+                     EString( d->background ? "reparsed by archiveopteryx "
+                                            : "reparsed by aox " ) +
+                     Configuration::compiledIn( Configuration::Version ) );
+            t->enqueue( i );
+            report.append( "reparsed " + where );
+            reparsed++;
+        }
+
+        if ( !injectables.isEmpty() ) {
+            Query * del =
+                new Query( "delete from unparsed_messages where "
+                           "bodypart=any($1)", 0 );
+            del->bind( 1, parsable );
+            t->enqueue( del );
+
+            injector = new Injector( this );
+            injector->addInjection( &injectables );
+            injector->setTransaction( t );
+            injector->execute();
+        }
+    }
+
+    if ( injector && !injector->done() )
+        return;
+
+    if ( !committed ) {
+        committed = true;
+        if ( injector && injector->failed() )
+            t->rollback();
+        else
+            t->commit();
+    }
+
+    if ( !t->done() )
+        return;
+
+    if ( injector && injector->failed() )
+        error = injector->error();
+    else if ( t->failed() )
+        error = t->error();
+    if ( !error.isEmpty() ) {
+        reparsed = 0;
+        report.clear();
+        failures.clear();
+    }
+    finished = true;
+    d->reparser->execute();
+}
@@ -0,0 +1,46 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef REPARSER_H
+#define REPARSER_H
+
+#include "event.h"
+
+class EStringList;
+
+
+class Reparser
+    : public EventHandler
+{
+public:
+    Reparser( EventHandler * );
+
+    void setBatchSize( uint );
+    void setConcurrency( uint );
+    void setStart( uint );
+    void setBackground( bool );
+    void setKeepFailures( bool );
+
+    void execute();
+
+    bool done() const;
+    bool failed() const;
+    EString error() const;
+
+    uint checkpoint() const;
+    uint reparsed() const;
+    uint unparsable() const;
+
+    EStringList * takeReport();
+    EStringList * takeFailures();
+
+    static void setup();
+
+private:
+    class ReparserData * d;
+    friend class ReparseBatch;
+
+    void startBatch();
+};
+
+
+#endif
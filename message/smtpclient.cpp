@@ -7,6 +7,9 @@
 #include "scope.h"
 #include "timer.h"
 #include "buffer.h"
+#include "allocator.h"
+#include "resolver.h"
+#include "dict.h"
 #include "configuration.h"
 #include "recipient.h"
 #include "eventloop.h"
@@ -14,8 +17,11 @@
 #include "address.h"
 #include "message.h"
 #include "ustring.h"
+#include "graph.h"
 // time
 #include <time.h>
+// gettimeofday, struct timeval
+#include <sys/time.h>
 
 
 class SmtpClientData
@@ -24,12 +30,15 @@ class SmtpClientData
 public:
     SmtpClientData()
         : state( Invalid ), dsn( 0 ),
-          owner( 0 ), log( 0 ), sentMail( false ),
-          wbt( 0 ), wbs( 0 ),
+          owner( 0 ), recipients( 0 ), log( 0 ), sentMail( false ),
+          closed( false ), wbt( 0 ), wbs( 0 ),
           enhancedstatuscodes( false ),
           unicode( false ),
           size( false )
-    {}
+    {
+        connecting.tv_sec = 0;
+        sending.tv_sec = 0;
+    }
 
     enum State { Invalid,
                  Connected, Banner, Hello,
@@ -42,8 +51,11 @@ public:
     DSN * dsn;
     EString dotted;
     EventHandler * owner;
+    List<Recipient> * recipients;
+    EString target;
     Log * log;
     bool sentMail;
+    bool closed;
     List<Recipient>::Iterator rcptTo;
     List<Recipient> accepted;
 
@@ -52,6 +64,8 @@ public:
     bool enhancedstatuscodes;
     bool unicode;
     bool size;
+    struct timeval connecting;
+    struct timeval sending;
     Timer * closeTimer;
     class TimerCloser
         : public EventHandler
@@ -72,18 +86,64 @@ public:
 
     Archiveopteryx uses it to send outgoing messages to a smarthost.
 
+    The clients form a pool for each destination, i.e. the smarthost
+    or (if direct-delivery is enabled) an MX host. provide() reuses an
+    idle client if there is one, opens a new connection if there are
+    fewer than smarthost-connections (or mx-connections), and
+    otherwise makes the caller wait until a client to the same
+    destination becomes idle or closes. A client that has sent one
+    message sends rset and waits for the next, so each connection
+    carries as many messages as the server lets it.
 */
 
+
+static Dict< List<EventHandler> > * waiters = 0;
+
+static GraphableDataSet * connectTime = 0;
+static GraphableDataSet * connectTime95 = 0;
+static GraphableDataSet * dataTime = 0;
+static GraphableDataSet * dataTime95 = 0;
+
+
+// records the number of milliseconds since a in two data sets, and
+// forgets a.
+
+static void record( struct timeval & a,
+                    GraphableDataSet * average, GraphableDataSet * p95 )
+{
+    if ( !a.tv_sec )
+        return;
+    struct timeval now;
+    (void)::gettimeofday( &now, 0 );
+    long elapsed = ( now.tv_sec - a.tv_sec ) * 1000000 +
+                   ( now.tv_usec - a.tv_usec );
+    a.tv_sec = 0;
+    if ( elapsed < 0 )
+        elapsed = 0;
+    average->addNumber( (uint)( elapsed / 1000 ) );
+    p95->addNumber( (uint)( elapsed / 1000 ) );
+}
+
 /*! Constructs an SMTP client which will immediately connect to \a
     address and introduce itself, and then wait politely for something
-    to do.
+    to do. \a target names the destination for provide(); it is empty
+    for the smarthost, and the host name of an MX otherwise.
 */
 
-SmtpClient::SmtpClient( const Endpoint & address )
+SmtpClient::SmtpClient( const Endpoint & address, const EString & target )
     : Connection( Connection::socket( address.protocol() ),
                   Connection::SmtpClient ),
       d( new SmtpClientData )
 {
+    d->target = target;
+    if ( !::connectTime ) {
+        ::connectTime = new GraphableDataSet( "smtp-client-connect-time" );
+        ::connectTime95 = new GraphableDataSet( "smtp-client-connect-time-95",
+                                                95 );
+        ::dataTime = new GraphableDataSet( "smtp-client-data-time" );
+        ::dataTime95 = new GraphableDataSet( "smtp-client-data-time-95", 95 );
+    }
+    (void)::gettimeofday( &d->connecting, 0 );
     connect( address );
     EventLoop::global()->addConnection( this );
     setTimeoutAfter( 4 );
@@ -145,6 +205,7 @@ void SmtpClient::react( Event e )
 
     case Error:
     case Close:
+        d->closed = true;
         if ( state() == Connecting ) {
             d->error = "Connection refused by SMTP/LMTP server";
             finish( "4.4.1" );
@@ -166,6 +227,9 @@ void SmtpClient::react( Event e )
     if ( d->owner &&
          ( s1 != Connection::state() || s2 != d->state || s3 != d->error ) )
         d->owner->notify();
+
+    if ( d->closed )
+        wakeWaiter( d->target );
 }
 
 
@@ -180,7 +244,8 @@ void SmtpClient::parse()
         if ( !s )
             return;
         extendTimeout( 10 );
-        log( "Received: " + *s, Log::Debug );
+        if ( Log::enabled( Log::Debug ) )
+            log( "Received: " + *s, Log::Debug );
         bool ok = false;
         uint response = s->mid( 0, 3 ).number( &ok );
         if ( !ok ) {
@@ -200,8 +265,12 @@ void SmtpClient::parse()
             case 2:
                 if ( d->state == SmtpClientData::Connected )
                     d->state = SmtpClientData::Banner;
-                if ( d->state == SmtpClientData::Hello )
+                if ( d->state == SmtpClientData::Hello ) {
                     recordExtension( *s );
+                    record( d->connecting, ::connectTime, ::connectTime95 );
+                }
+                if ( d->state == SmtpClientData::Body )
+                    record( d->sending, ::dataTime, ::dataTime95 );
                 SmtpHelo::setUnicodeSupported( d->unicode );
                 if ( d->rcptTo )
                     d->accepted.append( d->rcptTo );
@@ -230,6 +299,8 @@ void SmtpClient::parse()
                     log( "Closing because the SMTP server sent 421" );
                     close();
                     d->state = SmtpClientData::Invalid;
+                    d->closed = true;
+                    wakeWaiter( d->target );
                 }
                 break;
             default:
@@ -296,7 +367,7 @@ void SmtpClient::sendCommand()
     case SmtpClientData::MailFrom:
     case SmtpClientData::RcptTo:
         if ( d->state == SmtpClientData::MailFrom ) {
-            d->rcptTo = d->dsn->recipients()->first();
+            d->rcptTo = d->recipients->first();
             d->state = SmtpClientData::RcptTo;
         }
         else {
@@ -311,6 +382,7 @@ void SmtpClient::sendCommand()
             if ( !d->accepted.isEmpty() ) {
                 send = "data";
                 d->state = SmtpClientData::Data;
+                (void)::gettimeofday( &d->sending, 0 );
             }
             else {
                 finish( "4.5.0" );
@@ -341,10 +413,11 @@ void SmtpClient::sendCommand()
     case SmtpClientData::Rset:
         finish( "4.5.0" );
         delete d->closeTimer;
-        if ( idleClient() == this )
+        if ( idleClient( d->target ) == this )
             d->closeTimer = new Timer( d->timerCloser, 298 );
         else
             d->closeTimer = new Timer( d->timerCloser, 15 );
+        wakeWaiter( d->target );
         return;
 
     case SmtpClientData::Error:
@@ -355,13 +428,16 @@ void SmtpClient::sendCommand()
 
     case SmtpClientData::Quit:
         close();
+        d->closed = true;
+        wakeWaiter( d->target );
         break;
     }
 
     if ( send.isEmpty() )
         return;
 
-    log( "Sending: " + send, Log::Debug );
+    if ( Log::enabled( Log::Debug ) )
+        log( "Sending: " + send, Log::Debug );
     enqueue( send + "\r\n" );
     d->sent = send;
     setTimeoutAfter( 300 );
@@ -522,7 +598,7 @@ void SmtpClient::handleFailure( const EString & line )
     else {
         List<Recipient>::Iterator i;
         if ( d->dsn )
-            i = d->dsn->recipients();
+            i = d->recipients;
         while ( i ) {
             if ( i->action() == Recipient::Unknown ) {
                 if ( permanent )
@@ -559,10 +635,14 @@ bool SmtpClient::ready() const
     about which recipients fail or succeed, and how. Notifies \a user
     when it's done.
 
+    If \a recipients is non-null, only those of the \a dsn's
+    recipients are sent to. Otherwise all are.
+
     Does not use DSN::envelopeId() at present.
 */
 
-void SmtpClient::send( DSN * dsn, EventHandler * user )
+void SmtpClient::send( DSN * dsn, EventHandler * user,
+                       List<Recipient> * recipients )
 {
     if ( !ready() )
         return;
@@ -585,6 +665,9 @@ void SmtpClient::send( DSN * dsn, EventHandler * user )
     log( s, Log::Significant );
 
     d->dsn = dsn;
+    d->recipients = recipients;
+    if ( !recipients )
+        d->recipients = dsn->recipients();
     d->dotted.truncate();
     d->owner = user;
     d->sentMail = false;
@@ -604,7 +687,7 @@ void SmtpClient::send( DSN * dsn, EventHandler * user )
 void SmtpClient::finish( const char * status )
 {
     if ( d->dsn ) {
-        List<Recipient>::Iterator i( d->dsn->recipients() );
+        List<Recipient>::Iterator i( d->recipients );
         while ( i ) {
             if ( i->action() == Recipient::Unknown )
                 i->setAction( Recipient::Delayed, status );
@@ -615,6 +698,7 @@ void SmtpClient::finish( const char * status )
     if ( d->owner )
         d->owner->notify();
     d->dsn = 0;
+    d->recipients = 0;
     d->dotted.truncate();
     d->owner = 0;
     d->log = 0;
@@ -642,7 +726,8 @@ void SmtpClient::recordExtension( const EString & line )
     }
     else if ( w == "size" ) {
         d->size = true;
-        ::observedSize = l.section( " ", 2 ).number( 0 );
+        if ( d->target.isEmpty() )
+            ::observedSize = l.section( " ", 2 ).number( 0 );
     }
 }
 
@@ -682,21 +767,58 @@ EString SmtpClient::error() const
 }
 
 
-/*! Provides an SMTP client.
+/*! Provides an SMTP client for \a user, connected to \a host, or
+    to the smarthost if \a host is empty.
 
     If one is idly waiting now, provide() returns its address. If not,
-    provide() makes one and then returns it.
+    and there are fewer than smarthost-connections (or mx-connections)
+    clients to the same destination, provide() makes one and then
+    returns it. If there are that many already, provide() returns a
+    null pointer and notifies \a user when a client becomes idle or
+    disappears, so \a user can call provide() again.
+
+    provide() also returns a null pointer, and doesn't notify \a
+    user, if \a host cannot be resolved.
 */
 
-SmtpClient * SmtpClient::provide()
+SmtpClient * SmtpClient::provide( EventHandler * user, const EString & host )
 {
-    SmtpClient * c = idleClient();
+    SmtpClient * c = idleClient( host );
     if ( c )
         return c;
 
-    Endpoint e( Configuration::SmartHostAddress,
-                Configuration::SmartHostPort );
-    return new SmtpClient( e );
+    uint max = Configuration::scalar( Configuration::SmartHostConnections );
+    if ( !host.isEmpty() )
+        max = Configuration::scalar( Configuration::MxConnections );
+    if ( max && clients( host ) >= max ) {
+        if ( !::waiters ) {
+            ::waiters = new Dict< List<EventHandler> >;
+            Allocator::addEternal( ::waiters, "smtp client waiters" );
+        }
+        List<EventHandler> * l = ::waiters->find( host );
+        if ( !l ) {
+            l = new List<EventHandler>;
+            ::waiters->insert( host, l );
+        }
+        if ( !l->find( user ) )
+            l->append( user );
+        return 0;
+    }
+
+    if ( host.isEmpty() ) {
+        Endpoint e( Configuration::SmartHostAddress,
+                    Configuration::SmartHostPort );
+        return new SmtpClient( e, host );
+    }
+
+    EStringList::Iterator a( Resolver::resolve( host ) );
+    while ( a ) {
+        Endpoint e( *a, 25 );
+        if ( e.valid() )
+            return new SmtpClient( e, host );
+        ++a;
+    }
+    return 0;
 }
 
 
@@ -720,18 +842,19 @@ DSN * SmtpClient::sending() const
 }
 
 
-/*! This private helper returns a pointer to an idle SMTP client, or a
-    null pointer if none are idle.
+/*! This private helper returns a pointer to an idle SMTP client
+    connected to \a target, or a null pointer if none are idle.
 */
 
-SmtpClient * SmtpClient::idleClient()
+SmtpClient * SmtpClient::idleClient( const EString & target )
 {
     List<Connection>::Iterator c( EventLoop::global()->connections() );
     while ( c ) {
         if ( c->type() == Connection::SmtpClient ) {
             Connection * tmp = c;
             SmtpClient * sc = (SmtpClient*)tmp;
-            if ( sc->d->state == SmtpClientData::Rset )
+            if ( sc->d->state == SmtpClientData::Rset && !sc->d->closed &&
+                 sc->d->target == target )
                 return sc;
         }
         ++c;
@@ -740,6 +863,46 @@ SmtpClient * SmtpClient::idleClient()
 }
 
 
+/*! This private helper returns the number of SMTP clients to \a
+    target that are connected or connecting, and haven't started to
+    log out.
+*/
+
+uint SmtpClient::clients( const EString & target )
+{
+    uint n = 0;
+    List<Connection>::Iterator c( EventLoop::global()->connections() );
+    while ( c ) {
+        if ( c->type() == Connection::SmtpClient ) {
+            Connection * tmp = c;
+            SmtpClient * sc = (SmtpClient*)tmp;
+            if ( !sc->d->closed && sc->d->state != SmtpClientData::Quit &&
+                 sc->d->target == target )
+                n++;
+        }
+        ++c;
+    }
+    return n;
+}
+
+
+/*! This private helper notifies the EventHandler that has waited
+    longest for provide() to return a client to \a target, if
+    any. Called whenever a client becomes idle or closes.
+*/
+
+void SmtpClient::wakeWaiter( const EString & target )
+{
+    if ( !::waiters )
+        return;
+    List<EventHandler> * l = ::waiters->find( target );
+    if ( !l || l->isEmpty() )
+        return;
+    EventHandler * h = l->shift();
+    h->notify();
+}
+
+
 /*! Returns the SIZE argument provided by the smarthost, or something smaller
     if the smarthost's capacity outstrips our own.
 */
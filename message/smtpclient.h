@@ -5,6 +5,7 @@
 
 #include "connection.h"
 #include "event.h"
+#include "list.h"
 
 
 class DSN;
@@ -18,14 +19,14 @@ class SmtpClient
     : public Connection
 {
 public:
-    SmtpClient( const Endpoint & );
+    SmtpClient( const Endpoint &, const EString & );
 
     void react( Event );
 
-    static SmtpClient * provide();
+    static SmtpClient * provide( EventHandler *, const EString & );
 
     bool ready() const;
-    void send( DSN *, EventHandler * );
+    void send( DSN *, EventHandler *, List<Recipient> * = 0 );
     DSN * sending() const;
     bool sent() const;
 
@@ -46,7 +47,9 @@ private:
 
     static EString dotted( const EString & );
 
-    static SmtpClient * idleClient();
+    static SmtpClient * idleClient( const EString & );
+    static uint clients( const EString & );
+    static void wakeWaiter( const EString & );
 };
 
 
@@ -6,7 +6,6 @@
 #include "map.h"
 #include "user.h"
 #include "event.h"
-#include "query.h"
 #include "scope.h"
 #include "entropy.h"
 #include "estring.h"
@@ -14,11 +13,11 @@
 #include "mailbox.h"
 #include "message.h"
 #include "session.h"
-#include "selector.h"
+#include "expunger.h"
 #include "eventloop.h"
 #include "popcommand.h"
+#include "messagecache.h"
 #include "estringlist.h"
-#include "transaction.h"
 #include "configuration.h"
 
 
@@ -109,113 +108,13 @@ void POP::setState( State s )
     if ( s == Update && user() && !d->toBeDeleted.isEmpty() ) {
         log( "Deleting " + fn( d->toBeDeleted.count() ) + " messages" );
 
-        class PopDeleter
-            : public EventHandler
-        {
-        private:
-            User * user;
-            Mailbox * mailbox;
-            IntegerSet s;
-            ::Transaction * t;
-            Query * nms;
-            RetentionSelector * r;
-            Query * iq;
-            int64 ms;
-
-        public:
-            PopDeleter( User * u, Mailbox * m, const IntegerSet & ms )
-                : user( u ), mailbox( m ), s( ms ),
-                  t( 0 ), nms( 0 ), r( 0 ), iq( 0 ), ms( 0 )
-            {}
-
-            void execute()
-            {
-                if ( !r ) {
-                    r = new RetentionSelector( mailbox, this );
-                    r->execute();
-                }
-
-                if ( !t ) {
-                    t = new ::Transaction( this );
-                    nms = new Query( "select nextmodseq from mailboxes "
-                                     "where id=$1 for update", this );
-                    nms->bind( 1, mailbox->id() );
-                    t->enqueue( nms );
-                    t->execute();
-                }
-
-                if ( nms ) {
-                    if ( !r->done() )
-                        return;
-
-                    if ( !nms->done() )
-                        return;
-
-                    ms = nms->nextRow()->getBigint( "nextmodseq" );
-                    nms = 0;
-
-                    Selector * s = new Selector;
-                    if ( r->retains() ) {
-                        Selector * n = new Selector( Selector::Not );
-                        s->add( n );
-                        n->add( r->retains() );
-                    }
-                    s->add( new Selector( this->s ) );
-                    s->simplify();
-                    EStringList wanted;
-                    wanted.append( "mailbox" );
-                    wanted.append( "uid" );
-                    wanted.append( "message" );
-                    iq = s->query( 0, mailbox, 0, this, false,
-                                   &wanted, false );
-                    int i = iq->string().find( " from " );
-                    uint msb = s->placeHolder();
-                    uint ub = s->placeHolder();
-                    uint rb = s->placeHolder();
-                    iq->setString(
-                        "insert into deleted_messages "
-                        "(mailbox,uid,message,modseq,deleted_by,reason) " +
-                        iq->string().mid( 0, i ) + ", $" + fn( msb ) +", $" +
-                        fn( ub ) + ", $" + fn( rb ) + iq->string().mid( i ) );
-                    iq->bind( msb, ms );
-                    iq->bind( ub, user->id() );
-                    iq->bind( rb,
-                             "POP delete " + Scope::current()->log()->id() );
-                    t->enqueue( iq );
-                    t->execute();
-                }
-
-                if ( iq ) {
-                    if ( !iq->done() )
-                        return;
-
-                    if ( iq->rows() ) {
-                        // at least one message was deleted
-                        Query * q = new Query( "update mailboxes set "
-                                               "nextmodseq=$1 where id=$2",
-                                               this );
-                        q->bind( 1, ms+1 );
-                        q->bind( 2, mailbox->id() );
-                        t->enqueue( q );
-                        Mailbox::refreshMailboxes( t );
-                    }
-                    iq = 0;
-                    t->commit();
-                }
-
-                if ( !t->done() )
-                    return;
-
-                if ( t->failed() )
-                    log( "Error deleting messages: " + t->error() );
-            }
-        };
-
         session()->earlydeletems( d->toBeDeleted );
 
-        PopDeleter * pd = new PopDeleter( user(), session()->mailbox(),
-                                          d->toBeDeleted );
-        pd->execute();
+        Expunger * e = new Expunger( session()->mailbox(), d->toBeDeleted,
+                                     user(),
+                                     "POP delete " +
+                                     Scope::current()->log()->id(), 0 );
+        e->execute();
     }
     d->state = s;
 }
@@ -486,14 +385,23 @@ void POP::badUser()
 
 
 /*! Returns a pointer to the Message object with UID \a uid, or 0 if
-    there isn't any.
+    there isn't any such message in the session.
+
+    The Message objects are created the first time a command asks for
+    them, so that a session on a large maildrop doesn't need one for
+    each message. A new Message may not know its database ID.
 */
 
 class Message * POP::message( uint uid )
 {
     if ( !d->messages )
         return 0;
-    return d->messages->find( uid );
+    Message * m = d->messages->find( uid );
+    if ( m || !session() || !session()->msn( uid ) )
+        return m;
+    m = MessageCache::provide( session()->mailbox(), uid );
+    d->messages->insert( uid, m );
+    return m;
 }
 
 
@@ -503,9 +411,9 @@ void POP::sendChallenge( const EString &s )
 }
 
 
-/*! Records the Message objects needed for this Pop session. Each of
-    the Message objects is presumed to know its database ID, and may
-    know more. \a m is a map from UID to Message objects.
+/*! Records the Message objects needed for this Pop session. \a m
+    is a map from UID to Message objects, which message() extends as
+    needed.
 */
 
 void POP::setMessageMap( Map<Message> * m )
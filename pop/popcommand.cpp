@@ -14,9 +14,11 @@
 #include "message.h"
 #include "session.h"
 #include "mailbox.h"
+#include "span.h"
 #include "mechanism.h"
 #include "estringlist.h"
 #include "permissions.h"
+#include "passwordhash.h"
 #include "messagecache.h"
 
 
@@ -29,7 +31,9 @@ public:
           m( 0 ), r( 0 ),
           user( 0 ), mailbox( 0 ), permissions( 0 ),
           session( 0 ), sentFetch( false ), started( false ),
-          message( 0 ), n( 0 ), findIds( 0 ), map( 0 )
+          message( 0 ), n( 0 ), sent( 0 ), header( true ),
+          lnhead( 0 ), lnbody( 0 ), size( 0 ),
+          q( 0 ), msn( 0 ), map( 0 ), span( 0 )
     {}
 
     POP * pop;
@@ -50,8 +54,18 @@ public:
     Message * message;
     int n;
 
-    Query * findIds;
+    EString text;
+    uint sent;
+    bool header;
+    uint lnhead;
+    uint lnbody;
+    uint size;
+    EString messageId;
+
+    Query * q;
+    uint msn;
     Map<Message> * map;
+    Span * span;
 
     class PopSession
         : public Session
@@ -68,6 +82,16 @@ public:
 };
 
 
+// the span names for each PopCommand::Command
+
+static const char * spanNames[] = {
+    "pop quit", "pop capa", "pop noop", "pop stls", "pop auth",
+    "pop user", "pop pass", "pop apop", "pop stat", "pop list",
+    "pop retr", "pop dele", "pop rset", "pop top", "pop uidl",
+    "pop session"
+};
+
+
 /*! \class PopCommand popcommand.h
     This class represents a single POP3 command. It is analogous to an
     IMAP Command, except that it does all the work itself, rather than
@@ -85,6 +109,7 @@ PopCommand::PopCommand( POP * pop, Command cmd, EStringList * args )
     d->pop = pop;
     d->cmd = cmd;
     d->args = args;
+    d->span = Span::start( spanNames[cmd], log() );
 }
 
 
@@ -96,6 +121,8 @@ PopCommand::PopCommand( POP * pop, Command cmd, EStringList * args )
 void PopCommand::finish()
 {
     d->done = true;
+    if ( d->span )
+        d->span->end();
     d->pop->runCommands();
 }
 
@@ -364,6 +391,12 @@ bool PopCommand::apop()
 
         void verify()
         {
+            if ( PasswordHash::isHash( storedSecret() ) ) {
+                // APOP needs the cleartext password
+                setState( Failed );
+                return;
+            }
+
             UString s( challenge );
             s.append( storedSecret() );
 
@@ -446,37 +479,9 @@ bool PopCommand::session()
     if ( !d->session->initialised() )
         return false;
 
-    if ( !d->map ) {
-        d->session->clearUnannounced();
-        IntegerSet s( d->session->messages() );
-        IntegerSet r;
+    // the Message objects are made by POP::message() when needed
+    if ( !d->map )
         d->map = new Map<Message>;
-        while ( !s.isEmpty() ) {
-            uint uid = s.smallest();
-            s.remove( uid );
-            Message * m = MessageCache::provide( d->mailbox, uid );
-            if ( !m->databaseId() )
-                r.add( uid );
-            d->map->insert( uid, m );
-        }
-        if ( !r.isEmpty() ) {
-            d->findIds = new Query( "select message, uid "
-                                    "from mailbox_messages "
-                                    "where mailbox=$1 and uid=any($2)",
-                                    this );
-            d->findIds->bind( 1, d->mailbox->id() );
-            d->findIds->bind( 2, r );
-            d->findIds->execute();
-        }
-    }
-    if ( d->findIds && !d->findIds->done() )
-        return false;
-    while ( d->findIds && d->findIds->hasResults() ) {
-        Row * r = d->findIds->nextRow();
-        Message * m = d->map->find( r->getInt( "uid" ) );
-        if ( m )
-            m->setDatabaseId( r->getInt( "message" ) );
-    }
 
     d->session->clearUnannounced();
     d->pop->setMessageMap( d->map );
@@ -486,36 +491,37 @@ bool PopCommand::session()
 }
 
 
-/*! Handles the guts of the STAT/LIST data acquisition. */
+// a page of message sizes for the session's messages, with UIDs
+// from first to last.
 
-bool PopCommand::fetch822Size()
+static Query * sizes( Mailbox * m, uint first, uint last,
+                      EventHandler * owner )
 {
-    ::List<Message> * l = new ::List<Message>;
-
-    uint n = d->set.count();
-    while ( n >= 1 ) {
-        uint uid = d->set.value( n );
-        Message * m = d->pop->message( uid );
-        if ( m && !m->hasTrivia() )
-            l->prepend( m );
-        n--;
-    }
+    Query * q = new Query( "select mm.uid, mm.message, m.rfc822size "
+                           "from mailbox_messages mm "
+                           "join messages m on (mm.message=m.id) "
+                           "where mm.mailbox=$1 and mm.uid>=$2 "
+                           "and mm.uid<=$3 "
+                           "order by mm.uid", owner );
+    q->bind( 1, m->id() );
+    q->bind( 2, first );
+    q->bind( 3, last );
+    q->execute();
+    return q;
+}
 
-    if ( l->isEmpty() )
-        return true;
 
-    if ( !d->sentFetch ) {
-        d->sentFetch = true;
-        Fetcher * mtf = new Fetcher( l, this, d->pop );
-        mtf->fetch( Fetcher::Trivia );
-        mtf->execute();
-    }
+// the number of messages LIST and UIDL handle at a time
+static const uint pageSize = 4096;
 
-    return false;
-}
 
+/*! Handles the STAT command.
 
-/*! Handles the STAT command. */
+    The mailbox_counts table has the number of messages and the total
+    size, so STAT needn't look at each message unless the mailbox has
+    changed since the session started, in which case it adds up the
+    sizes of the session's messages.
+*/
 
 bool PopCommand::stat()
 {
@@ -524,31 +530,41 @@ bool PopCommand::stat()
     if ( !d->started ) {
         log( "STAT command" );
         d->started = true;
-        uint n = s->count();
-        while ( n >= 1 ) {
-            d->set.add( s->uid( n ) );
-            n--;
-        }
+        d->q = new Query( "select messages, bytes from mailbox_counts "
+                          "where mailbox=$1", this );
+        d->q->bind( 1, s->mailbox()->id() );
+        d->q->execute();
     }
 
-    if ( !fetch822Size() )
+    if ( !d->q->done() )
         return false;
 
-    uint size = 0;
-    uint n = s->count();
-    while ( n >= 1 ) {
-        Message * m = d->pop->message( s->uid( n ) );
-        if ( m )
-            size += m->rfc822Size();
-        n--;
+    Row * r = d->q->nextRow();
+    if ( !d->sentFetch &&
+         !( r && (uint)r->getInt( "messages" ) == s->count() ) ) {
+        d->sentFetch = true;
+        d->q = new Query( "select coalesce(sum(m.rfc822size),0)::bigint "
+                          "as bytes "
+                          "from mailbox_messages mm "
+                          "join messages m on (mm.message=m.id) "
+                          "where mm.mailbox=$1 and mm.uid=any($2)", this );
+        d->q->bind( 1, s->mailbox()->id() );
+        d->q->bind( 2, s->messages() );
+        d->q->execute();
+        return false;
     }
 
+    int64 size = 0;
+    if ( r )
+        size = r->getBigint( "bytes" );
     d->pop->ok( fn( s->count() ) + " " + fn( size ) );
     return true;
 }
 
 
-/*! Handles the LIST command. */
+/*! Handles the LIST command. Without an argument, the sizes are
+    fetched and sent one page at a time, as the client reads them.
+*/
 
 bool PopCommand::list()
 {
@@ -558,11 +574,9 @@ bool PopCommand::list()
         d->started = true;
 
         if ( d->args->count() == 0 ) {
-            uint n = s->count();
-            while ( n >= 1 ) {
-                d->set.add( s->uid( n ) );
-                n--;
-            }
+            log( "LIST command" );
+            d->msn = 1;
+            d->pop->ok( "Done" );
         }
         else {
             bool ok;
@@ -572,44 +586,63 @@ bool PopCommand::list()
                 d->pop->err( "Bad message number" );
                 return true;
             }
-            d->set.add( s->uid( msn ) );
+            uint uid = s->uid( msn );
+            log( "LIST command (" + fn( uid ) + ")" );
+            d->q = sizes( s->mailbox(), uid, uid, this );
         }
-        log( "LIST command (" + d->set.set() + ")" );
     }
 
-    if ( !fetch822Size() )
-        return false;
-
     if ( d->args->count() == 1 ) {
-        uint uid = d->set.smallest();
-        Message * m = d->pop->message( uid );
-
-        if ( m )
+        if ( !d->q->done() )
+            return false;
+        Row * r = d->q->nextRow();
+        if ( r ) {
+            uint uid = r->getInt( "uid" );
             d->pop->ok( fn( s->msn( uid ) ) + " " +
-                        fn( m->rfc822Size() ) );
-        else
+                        fn( r->getInt( "rfc822size" ) ) );
+        }
+        else {
             d->pop->err( "No such message" );
+        }
+        return true;
     }
-    else {
-        uint i = 1;
 
-        d->pop->ok( "Done" );
-        while ( i <= d->set.count() ) {
-            uint uid = d->set.value( i );
-            Message * m = d->pop->message( uid );
-            if ( m )
-                d->pop->enqueue( fn( s->msn( uid ) ) + " " +
-                                 fn( m->rfc822Size() ) + "\r\n" );
-            i++;
+    while ( true ) {
+        while ( d->q && d->q->hasResults() ) {
+            Row * r = d->q->nextRow();
+            uint msn = s->msn( r->getInt( "uid" ) );
+            if ( msn )
+                d->pop->enqueue( fn( msn ) + " " +
+                                 fn( r->getInt( "rfc822size" ) ) + "\r\n" );
+        }
+        if ( d->q && !d->q->done() )
+            return false;
+        d->q = 0;
+        if ( d->msn > s->count() )
+            break;
+        if ( d->pop->writeBufferFull() ) {
+            d->pop->waitForRoom( this );
+            return false;
         }
-        d->pop->enqueue( ".\r\n" );
+        uint last = d->msn + pageSize - 1;
+        if ( last > s->count() )
+            last = s->count();
+        d->q = sizes( s->mailbox(), s->uid( d->msn ), s->uid( last ), this );
+        d->msn = last + 1;
     }
+
+    d->pop->enqueue( ".\r\n" );
     return true;
 }
 
 
 /*! Handles both the RETR (if \a lines is false) and TOP (if \a lines
     is true) commands.
+
+    The message is fetched into a private Message, so that its bodies
+    aren't kept in RAM for the rest of the session, and stream() sends
+    it a little at a time as the client reads. TOP with a line count
+    of 0 fetches only the header.
 */
 
 bool PopCommand::retr( bool lines )
@@ -640,8 +673,8 @@ bool PopCommand::retr( bool lines )
             }
         }
 
-        d->message = d->pop->message( s->uid( msn ) );
-        if ( !d->message ) {
+        Message * m = d->pop->message( s->uid( msn ) );
+        if ( !m ) {
             log( "No such message "+fn(s->uid(msn))+" "+fn(msn),
              Log::Significant);
             d->pop->err( "No such message" );
@@ -649,76 +682,134 @@ bool PopCommand::retr( bool lines )
         }
 
         d->started = true;
-        Fetcher * f = new Fetcher( d->message, this );
-        if ( !d->message->hasBodies() )
-            f->fetch( Fetcher::Body );
-        if ( !d->message->hasHeaders() )
-            f->fetch( Fetcher::OtherHeader );
-        if ( !d->message->hasAddresses() )
-            f->fetch( Fetcher::Addresses );
-        f->execute();
+        d->message = new Message;
+        d->message->setDatabaseId( m->databaseId() );
+        if ( !m->databaseId() ) {
+            uint uid = s->uid( msn );
+            d->q = sizes( s->mailbox(), uid, uid, this );
+        }
     }
 
-    if ( !( d->message->hasBodies() &&
-            d->message->hasHeaders() &&
-            d->message->hasAddresses() ) )
-        return false;
-
-    if ( d->message->rfc822Size() > 2 )
-        d->pop->ok( "Done" );
-    else {
-        log( "Aborting due to overlapping session", Log::Significant );
-        d->pop->abort( "Overlapping sessions" );
-        return true;
+    if ( d->q ) {
+        if ( !d->q->done() )
+            return false;
+        Row * r = d->q->nextRow();
+        d->q = 0;
+        if ( !r ) {
+            d->pop->err( "No such message" );
+            return true;
+        }
+        Message * m = d->pop->message( r->getInt( "uid" ) );
+        if ( m )
+            m->setDatabaseId( r->getInt( "message" ) );
+        d->message->setDatabaseId( r->getInt( "message" ) );
     }
 
-    Buffer * b = new Buffer;
-    b->append( d->message->rfc822( true ) ); // XXX always downgrades
-
-    int ln = d->n;
-    bool header = true;
-    int lnhead = 0;
-    int lnbody = 0;
-    int msize = b->size();
+    if ( d->message && !d->sentFetch ) {
+        d->sentFetch = true;
+        Fetcher * f = new Fetcher( d->message, this );
+        f->fetch( Fetcher::Trivia );
+        f->fetch( Fetcher::OtherHeader );
+        f->fetch( Fetcher::Addresses );
+        if ( !lines || d->n > 0 )
+            f->fetch( Fetcher::Body );
+        f->execute();
+    }
 
-    EString * t;
-    while ( ( t = b->removeLine() ) != 0 ) {
-        if ( header && t->isEmpty() )
-            header = false;
+    if ( d->message ) {
+        Message * m = d->message;
+        bool headerOnly = lines && d->n <= 0;
+        if ( !( m->hasTrivia() && m->hasHeaders() && m->hasAddresses() &&
+                ( headerOnly || m->hasBodies() ) ) )
+            return false;
 
-        if ( !header && lines && ln-- < 0 )
-            break;
+        if ( m->rfc822Size() > 2 )
+            d->pop->ok( "Done" );
+        else {
+            log( "Aborting due to overlapping session", Log::Significant );
+            d->pop->abort( "Overlapping sessions" );
+            return true;
+        }
 
-        if ( header )
-            lnhead++;
+        // XXX always downgrades
+        if ( headerOnly )
+            d->text = m->header()->asText( true ) + "\r\n";
         else
-            lnbody++;
-
-        if ( t->startsWith( "." ) )
-            d->pop->enqueue( "." );
-        d->pop->enqueue( *t );
-        d->pop->enqueue( "\r\n" );
+            d->text = m->rfc822( true );
+        d->size = d->text.length();
+        d->messageId = m->header()->messageId();
+        d->message = 0;
     }
 
-    EString st = b->string( b->size() );
-    if ( !st.isEmpty() && !( !header && lines && ln-- < 0 ) ) {
-        if ( st.startsWith( "." ) )
-            d->pop->enqueue( "." );
-        d->pop->enqueue( st );
-        d->pop->enqueue( "\r\n" );
+    if ( !stream( lines ) ) {
+        d->pop->waitForRoom( this );
+        return false;
     }
-
     d->pop->enqueue( ".\r\n" );
+    d->text.truncate();
 
     if( !lines )
         log( "Retrieved "
-         + fn( lnhead ) + ":" + fn( lnbody ) + "/" + fn( msize )
-         + " " + d->message->header()->messageId().forlog(),
+         + fn( d->lnhead ) + ":" + fn( d->lnbody ) + "/" + fn( d->size )
+         + " " + d->messageId.forlog(),
          Log::Significant );
     return true;
 }
 
 
+/*! Sends the next part of the message rendered by retr(), dot-stuffed
+    and with CRLF line endings, and returns true if all of it has been
+    sent (or, if \a lines is true, the header and the requested number
+    of body lines). Returns false if the write buffer is full, in which
+    case retr() waits for room and is executed again once the client
+    has read some.
+*/
+
+bool PopCommand::stream( bool lines )
+{
+    uint l = d->text.length();
+    while ( d->sent < l ) {
+        if ( d->pop->writeBufferFull() )
+            return false;
+
+        EString chunk;
+        chunk.reserve( 65536 + 1024 );
+        while ( d->sent < l && chunk.length() < 65536 ) {
+            int lf = d->text.find( '\n', d->sent );
+            uint next = l;
+            if ( lf >= 0 )
+                next = lf + 1;
+            uint end = next;
+            if ( lf >= 0 )
+                end = lf;
+            if ( end > d->sent && d->text[end-1] == '\r' )
+                end--;
+            uint start = d->sent;
+            d->sent = next;
+
+            if ( d->header && end == start )
+                d->header = false;
+            if ( !d->header && lines && d->n-- < 0 ) {
+                d->sent = l;
+                break;
+            }
+
+            if ( d->header )
+                d->lnhead++;
+            else
+                d->lnbody++;
+
+            if ( d->text[start] == '.' && end > start )
+                chunk.append( '.' );
+            chunk.append( d->text.mid( start, end - start ) );
+            chunk.append( "\r\n" );
+        }
+        d->pop->enqueue( chunk );
+    }
+    return true;
+}
+
+
 /*! Marks the specified message for later deletion. Although the RFC
     prohibits the client from marking the same message twice, we
     blithely allow it.
@@ -756,11 +847,14 @@ bool PopCommand::dele()
 }
 
 
-/*! Handles the UIDL command. */
+/*! Handles the UIDL command. Without an argument, the list is sent
+    one page at a time, as the client reads it.
+*/
 
 bool PopCommand::uidl()
 {
     ::Session * s = d->pop->session();
+    EString uidvalidity = fn( s->mailbox()->uidvalidity() );
 
     if ( d->args->count() == 1 ) {
         bool ok;
@@ -771,24 +865,35 @@ bool PopCommand::uidl()
         }
         uint uid = s->uid( msn );
         log( "UIDL command (" + fn( uid ) + ")" );
-        d->pop->ok( fn( msn ) + " " + fn( s->mailbox()->uidvalidity() ) +
-                    fn( uid ) );
+        d->pop->ok( fn( msn ) + " " + uidvalidity + "/" + fn( uid ) );
+        return true;
     }
-    else {
-        log( "UIDL command" );
-        uint msn = 1;
 
+    if ( !d->started ) {
+        log( "UIDL command" );
+        d->started = true;
+        d->msn = 1;
         d->pop->ok( "Done" );
-        while ( msn <= s->count() ) {
-            uint uid = s->uid( msn );
-            d->pop->enqueue( fn( msn ) + " " +
-                             fn( s->mailbox()->uidvalidity() ) + "/" +
-                             fn( uid ) + "\r\n" );
-            msn++;
+    }
+
+    while ( d->msn <= s->count() ) {
+        if ( d->pop->writeBufferFull() ) {
+            d->pop->waitForRoom( this );
+            return false;
+        }
+        uint last = d->msn + pageSize - 1;
+        if ( last > s->count() )
+            last = s->count();
+        EString page;
+        while ( d->msn <= last ) {
+            page.append( fn( d->msn ) + " " + uidvalidity + "/" +
+                         fn( s->uid( d->msn ) ) + "\r\n" );
+            d->msn++;
         }
-        d->pop->enqueue( ".\r\n" );
+        d->pop->enqueue( page );
     }
 
+    d->pop->enqueue( ".\r\n" );
     return true;
 }
 
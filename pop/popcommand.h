@@ -34,10 +34,10 @@ private:
     bool pass();
     bool apop();
     bool session();
-    bool fetch822Size();
     bool stat();
     bool list();
     bool retr( bool );
+    bool stream( bool );
     bool dele();
     bool uidl();
 };
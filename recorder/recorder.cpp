@@ -13,6 +13,7 @@
 
 #include <stdio.h> // fprintf, printf
 #include <stdlib.h> // exit
+#include <sys/time.h> // gettimeofday
 
 
 class RecorderData
@@ -21,12 +22,19 @@ class RecorderData
 public:
     RecorderData()
         : client( 0 ), server( 0 ), log( 0 )
-    {}
+    {
+        (void)::gettimeofday( &started, 0 );
+        toServerSince = started;
+        toClientSince = started;
+    }
     RecorderClient * client;
     RecorderServer * server;
     File * log;
     EString toServer;
     EString toClient;
+    struct timeval started;
+    struct timeval toServerSince;
+    struct timeval toClientSince;
 
     enum Direction { ToServer, ToClient };
     void dump( Direction );
@@ -51,7 +59,22 @@ void RecorderData::dump( Direction dir )
     }
     if ( !lines )
         return;
+    // when the first byte was sent, relative to the start of the
+    // connection, so replay tools can pace the session
+    struct timeval * t = &toServerSince;
+    if ( dir == ToClient )
+        t = &toClientSince;
+    long ms = ( t->tv_sec - started.tv_sec ) * 1000 +
+              ( t->tv_usec - started.tv_usec ) / 1000;
     EString f;
+    f.append( "# time " );
+    f.appendNumber( (int)( ms / 1000 ) );
+    f.append( "." );
+    EString frac = fn( (uint)( ms % 1000 ) );
+    while ( frac.length() < 3 )
+        frac = "0" + frac;
+    f.append( frac );
+    f.append( "\n" );
     if ( dir == ToClient )
         f.append( "receive " );
     else
@@ -132,6 +155,8 @@ void RecorderServer::react( Event e )
     switch( e ) {
     case Read:
         tmp = readBuffer()->string( readBuffer()->size() );
+        if ( d->toServer.isEmpty() )
+            (void)::gettimeofday( &d->toServerSince, 0 );
         d->toServer.append( tmp );
         d->client->enqueue( tmp );
         readBuffer()->remove( tmp.length() );
@@ -175,6 +200,8 @@ void RecorderClient::react( Event e )
     switch( e ) {
     case Read:
         tmp = readBuffer()->string( readBuffer()->size() );
+        if ( d->toClient.isEmpty() )
+            (void)::gettimeofday( &d->toClientSince, 0 );
         d->toClient.append( tmp );
         d->server->enqueue( tmp );
         readBuffer()->remove( tmp.length() );
@@ -6,6 +6,7 @@
 #include "entropy.h"
 #include "configuration.h"
 #include "user.h"
+#include "passwordhash.h"
 #include "md5.h"
 
 #include <time.h>
@@ -67,6 +68,8 @@ void CramMD5::verify()
     if ( Configuration::toggle( Configuration::AuthAnonymous ) &&
          user() && user()->login() == "anonymous" )
         setState( Succeeded );
+    else if ( PasswordHash::isHash( storedSecret() ) )
+        setState( Failed ); // we need the cleartext password
     else if ( secret().utf8() ==
               MD5::HMAC( storedSecret().utf8(), challengeSent ).hex() )
         setState( Succeeded );
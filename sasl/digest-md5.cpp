@@ -8,6 +8,7 @@
 #include "estring.h"
 #include "list.h"
 #include "user.h"
+#include "passwordhash.h"
 #include "md5.h"
 
 #include <time.h>
@@ -248,6 +249,12 @@ void DigestMD5::require( class Variable * v, const EString & n )
 
 void DigestMD5::verify()
 {
+    if ( PasswordHash::isHash( storedSecret() ) ) {
+        // we need the cleartext password
+        setState( Failed );
+        return;
+    }
+
     EString R, A1, A2;
 
     A1 = MD5::hash( login().utf8() +":"+ d->realm +":"+ storedSecret().utf8() )
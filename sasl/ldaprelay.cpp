@@ -3,10 +3,21 @@
 #include "ldaprelay.h"
 
 #include "configuration.h"
+#include "connection.h"
 #include "eventloop.h"
 #include "mechanism.h"
+#include "allocator.h"
+#include "endpoint.h"
 #include "buffer.h"
+#include "cache.h"
+#include "graph.h"
+#include "dict.h"
+#include "list.h"
 #include "user.h"
+#include "md5.h"
+
+// time
+#include <time.h>
 
 
 class LdapRelayData
@@ -16,59 +27,195 @@ public:
     LdapRelayData()
         : mechanism( 0 ),
           state( LdapRelay::Working ),
-          haveReadType( false ), responseLength( 0 )
+          attempts( 0 )
         {}
 
     SaslMechanism * mechanism;
 
     LdapRelay::State state;
-    bool haveReadType;
-    uint responseLength;
+    EString dn;
+    EString password;
+    EString key;
+    uint attempts;
 };
 
 
-/*! \class LdapRelay ldaprelay.h
+class LdapConnection;
 
-    The LdapRelay class helps Mechanism relay SASL challenges and
-    responses to and from an LDAP server. If the LDAP server accepts
-    the authentication, then the user is accepted as an Archiveopteryx
-    user.
 
-    The LdapRelay state machine contains the following states:
+// an idle connection is closed after this many seconds, since LDAP
+// servers tend to forget quiet clients, and a bind fails unless the
+// server answers within bindTime seconds.
 
-    Working: The LDAP server still hasn't answered.
+static const uint idleTime = 120;
+static const uint bindTime = 30;
 
-    BindFailed: We should reject this authentication.
 
-    BindSucceeded: We should accept this authentication.
+// remembers which dn/password pairs the LDAP server recently
+// accepted, and until when they may be accepted without asking again.
 
-    The implementation is based on RFC 4511.
-*/
+class LdapCache
+    : public Cache
+{
+public:
+    class Entry
+        : public Garbage
+    {
+    public:
+        Entry( uint t ): expires( t ) {}
+        uint expires;
+    };
+
+    LdapCache(): Cache( 10 ) {}
+    void clear() { entries.clear(); }
+    Dict<Entry> entries;
+};
 
 
+static List<LdapRelay> * queue = 0;
+static List<LdapConnection> * pool = 0;
+static LdapCache * cache = 0;
+static GraphableCounter * binds = 0;
+static GraphableCounter * hits = 0;
 
-/*! Constructs an LdapRelay to verify whatever \a mechanism needs. */
 
-LdapRelay::LdapRelay( SaslMechanism * mechanism )
-    : Connection( Connection::socket( server().protocol() ),
+// returns the BER encoding of an element with \a tag and \a content.
+
+static EString element( uint tag, const EString & content )
+{
+    EString r;
+    r.append( (char)tag );
+    uint l = content.length();
+    if ( l < 0x80 ) {
+        r.append( (char)l );
+    }
+    else {
+        char b[4];
+        uint n = 0;
+        while ( l ) {
+            b[n++] = (char)( l & 0xff );
+            l >>= 8;
+        }
+        r.append( (char)( 0x80 | n ) );
+        while ( n )
+            r.append( b[--n] );
+    }
+    r.append( content );
+    return r;
+}
+
+
+// returns the content octets of a BER integer with value \a n.
+
+static EString integer( uint n )
+{
+    char b[5];
+    uint k = 0;
+    do {
+        b[k++] = (char)( n & 0xff );
+        n >>= 8;
+    } while ( n );
+    if ( b[k-1] & 0x80 )
+        b[k++] = 0;
+    EString r;
+    while ( k )
+        r.append( b[--k] );
+    return r;
+}
+
+
+// returns the value of the BER integer or enumeration whose content
+// octets are \a s.
+
+static uint number( const EString & s )
+{
+    uint n = 0;
+    uint i = 0;
+    while ( i < s.length() ) {
+        n = n * 256 + (uint)(unsigned char)s[i];
+        i++;
+    }
+    return n;
+}
+
+
+// reads the BER element starting at \a i in \a s, sets \a tag and \a
+// content and advances \a i past it. returns false (and sets
+// nothing) if \a s doesn't contain a complete element there.
+
+static bool element( const EString & s, uint & i, uint & tag,
+                     EString & content )
+{
+    uint p = i;
+    if ( p + 2 > s.length() )
+        return false;
+    uint t = (unsigned char)s[p];
+    uint l = (unsigned char)s[p+1];
+    p += 2;
+    if ( l & 0x80 ) {
+        uint n = l & 0x7f;
+        if ( n < 1 || n > 4 || p + n > s.length() )
+            return false;
+        l = 0;
+        while ( n ) {
+            l = l * 256 + (unsigned char)s[p];
+            p++;
+            n--;
+        }
+    }
+    if ( p + l > s.length() )
+        return false;
+    tag = t;
+    content = s.mid( p, l );
+    i = p + l;
+    return true;
+}
+
+
+// one persistent connection to the LDAP server. it binds on behalf
+// of one LdapRelay at a time, since RFC 4511 section 4.2.1 doesn't
+// permit sending a bind while another operation is outstanding.
+
+class LdapConnection
+    : public Connection
+{
+public:
+    LdapConnection();
+
+    void react( Event );
+
+    bool idle() const;
+    void send( ::LdapRelay * );
+
+    static void dispatch();
+
+private:
+    void parse();
+    void handle( const EString & );
+    void lost( const EString & );
+
+    ::LdapRelay * relay;
+    uint messageId;
+    uint served;
+    bool up;
+    bool gone;
+};
+
+
+LdapConnection::LdapConnection()
+    : Connection( Connection::socket( ::LdapRelay::server().protocol() ),
                   Connection::LdapRelay ),
-      d ( new LdapRelayData )
+      relay( 0 ), messageId( 0 ), served( 0 ), up( false ), gone( false )
 {
-    d->mechanism = mechanism;
-    setTimeoutAfter( 30 );
-    connect( server() );
+    setTimeoutAfter( bindTime );
+    connect( ::LdapRelay::server() );
     EventLoop::global()->addConnection( this );
 }
 
 
-/*! Reacts to incoming packets from the LDAP server, changes the
-    object's state, and eventually notifies the Mechanism. \a e is as
-    for Connection::react().
-*/
-
-void LdapRelay::react( Event e )
+void LdapConnection::react( Event e )
 {
-    if ( d->state != Working )
+    if ( gone )
         return;
 
     switch( e ) {
@@ -77,270 +224,334 @@ void LdapRelay::react( Event e )
         break;
 
     case Connection::Timeout:
-        fail( "LDAP server timeout" );
+        if ( relay || !up ) {
+            lost( "LDAP server timeout" );
+        }
+        else {
+            // idle for a while; we'll reconnect when needed
+            gone = true;
+            pool->remove( this );
+            setState( Closing );
+        }
         break;
 
     case Connect:
-        bind();
+        up = true;
+        setTimeoutAfter( idleTime );
+        dispatch();
         break;
 
     case Error:
-        fail( "Unexpected error" );
+        lost( "Unexpected error" );
         break;
 
     case Close:
-        fail( "Unexpected close by LDAP server" );
+        lost( "Unexpected close by LDAP server" );
         break;
 
     case Shutdown:
         break;
     }
-
-    if ( d->state == Working )
-        return;
-
-    setState( Closing );
-    d->mechanism->execute();
 }
 
 
-/*! Returns the address of the LDAP server used. */
+// returns true if this connection is ready to send a bind
 
-Endpoint LdapRelay::server()
+bool LdapConnection::idle() const
 {
-    return Endpoint(
-        Configuration::text( Configuration::LdapServerAddress ),
-        Configuration::scalar( Configuration::LdapServerPort ) );
-
+    return up && !gone && !relay && state() == Connected;
 }
 
 
-static bool hasTypeAndLength( Buffer * r )
-{
-    uint l = (*r)[1];
-
-    if ( r->size() >= 2 && ( l < 0x80 || r->size() >= 2+(l&0x7f) ) )
-        return true;
-    return false;
-}
-
+// sends a bind request on behalf of \a r
 
-static uint removeLength( Buffer * r )
+void LdapConnection::send( ::LdapRelay * r )
 {
-    uint length = (*r)[0];
-    r->remove( 1 );
-
-    // Handle the indefinite form encoding of length (generated by
-    // e.g. Active Directory, but not permitted by RFC4511, p.42).
-    // <http://www.w3.org/Protocols/HTTP-NG/asn1.html>
-
-    if ( length >= 0x80 ) {
-        uint lengthLength = length & 0x7f;
-        length = 0;
-        uint i = 0;
-        while ( i < lengthLength ) {
-            length *= 256;
-            length += (*r)[i];
-            ++i;
-        }
-        r->remove( lengthLength );
-    }
+    relay = r;
+    r->d->attempts++;
+    messageId++;
+    if ( messageId > 0x7fffffff )
+        messageId = 1;
+
+    // BindRequest ::= [APPLICATION 0] SEQUENCE {
+    //     version        INTEGER (1 ..  127),
+    //     name           LDAPDN,
+    //     authentication AuthenticationChoice }
+    // where simple authentication is [0] OCTET STRING
+
+    EString b;
+    b.append( element( 0x02, integer( 3 ) ) );
+    b.append( element( 0x04, r->d->dn ) );
+    b.append( element( 0x80, r->d->password ) );
+
+    EString m;
+    m.append( element( 0x02, integer( messageId ) ) );
+    m.append( element( 0x60, b ) );
 
-    return length;
+    enqueue( element( 0x30, m ) );
+    setTimeoutAfter( bindTime );
+    ::binds->tick();
 }
 
 
-/*! Parses the response the server sends, which has to be a bind
-    response.
-*/
+// splits the incoming data into LDAPMessages and handles each
 
-void LdapRelay::parse()
+void LdapConnection::parse()
 {
     Buffer * r = readBuffer();
-
-    if ( !d->haveReadType ) {
-        // LDAPMessage magic bytes (30 xx)
-        //     30 -> universal context-specific zero
-        //     xx -> message length
-
-        if ( !hasTypeAndLength( r ) )
-            return;
-
-        uint byte = (*r)[0];
-        if ( byte != 0x30 ) {
-            fail( "Expected LDAP type byte 0x30, received 0x" +
-                  EString::fromNumber( byte, 16 ).lower() );
+    while ( !gone && r->size() >= 2 ) {
+        if ( (*r)[0] != 0x30 ) {
+            lost( "Expected LDAP type byte 0x30, received 0x" +
+                  EString::fromNumber( (*r)[0], 16 ).lower() );
             return;
         }
-        r->remove( 1 );
-
-        d->responseLength = removeLength( r );
-        if ( d->responseLength < 8 ) {
-            fail( "Expected LDAP response of at least 8 bytes, received "
-                  "only " + fn( d->responseLength ) + " bytes" );
-            return;
+        uint n = 2;
+        uint l = (*r)[1];
+        if ( l & 0x80 ) {
+            uint ll = l & 0x7f;
+            if ( ll < 1 || ll > 4 ) {
+                lost( "Unsupported LDAP length encoding 0x" +
+                      EString::fromNumber( l, 16 ).lower() );
+                return;
+            }
+            if ( r->size() < 2 + ll )
+                return;
+            l = 0;
+            while ( n < 2 + ll ) {
+                l = l * 256 + (*r)[n];
+                n++;
+            }
         }
-
-        d->haveReadType = true;
+        if ( r->size() < n + l )
+            return;
+        EString m = r->string( n + l ).mid( n );
+        r->remove( n + l );
+        handle( m );
     }
+}
 
-    if ( r->size() < d->responseLength )
-        return;
 
-    //  message-id (02 01 01)
-    //     02 -> integer
-    //     01 -> length
-    //     01 -> message-id
-    if ( (*r)[0] != 2 || (*r)[1] != 1 || (*r)[2] != 1 ) {
-        fail( "Expected LDAP message-id to have type 2 length 1 ID 1, "
-              "received type " + fn( (*r)[0] ) + " length " + fn( (*r)[1] ) +
-              " ID " + fn( (*r)[2] ) );
+// handles the LDAPMessage whose content is \a m
+
+void LdapConnection::handle( const EString & m )
+{
+    uint i = 0;
+    uint tag = 0;
+    EString id;
+    EString op;
+    if ( !element( m, i, tag, id ) || tag != 0x02 ||
+         !element( m, i, tag, op ) ) {
+        lost( "Malformed LDAP message" );
         return;
     }
-    r->remove( 3 );
-
-    //  bindresponse (61 07)
-    //     61 -> APPLICATION 1, BindResponse
-    //     07 -> length of remaining bytes
-    if ( (*r)[0] != 0x61 ) {
-        fail( "Expected LDAP response type 0x61, received type " +
-              EString::fromNumber( (*r)[0] ) );
+
+    // an ExtendedResponse with message-id 0 is a notice of
+    // disconnection (RFC 4511 section 4.4.1)
+    if ( number( id ) == 0 && tag == 0x78 ) {
+        lost( "LDAP server is closing the connection" );
         return;
     }
-    r->remove( 1 );
 
-    // The next three bytes should be the LDAP result code.
-    uint bindResponseLength = removeLength( r );
-    if ( bindResponseLength < 3 ) {
-        fail( "Expected bind response with length >= 3, received "
-              "only " + fn( bindResponseLength ) + " bytes" );
+    if ( tag != 0x61 || !relay || number( id ) != messageId ) {
+        log( "Ignoring unexpected LDAP response of type 0x" +
+             EString::fromNumber( tag, 16 ).lower(), Log::Debug );
         return;
     }
 
-    //   resultcode
-    //     0a -> enum
-    //     01 -> length?
-    //     00 -> success
-    if ( (*r)[0] != 10 || (*r)[1] != 1 ) {
-        fail( "Expected LDAP result code to have type 10 length 1, "
-              "received type " + fn( (*r)[0] ) + " length " + fn( (*r)[1] ) );
+    // BindResponse ::= [APPLICATION 1] SEQUENCE {
+    //     resultCode        ENUMERATED,
+    //     matchedDN         LDAPDN,
+    //     diagnosticMessage LDAPString, ... }
+
+    uint j = 0;
+    EString code;
+    if ( !element( op, j, tag, code ) || tag != 0x0a ) {
+        lost( "Expected LDAP result code in bind response" );
         return;
     }
-    uint resultCode = (*r)[2];
-    r->remove( 3 );
-    if ( resultCode != 0 )
-        fail( "LDAP server refused authentication with result code " +
-              fn( resultCode ) );
+    EString matched;
+    EString diagnostic;
+    if ( element( op, j, tag, matched ) )
+        (void)element( op, j, tag, diagnostic );
+
+    ::LdapRelay * r = relay;
+    relay = 0;
+    served++;
+    setTimeoutAfter( idleTime );
+
+    if ( !diagnostic.isEmpty() )
+        r->d->mechanism->log( "Note: LDAP server returned error message: " +
+                              diagnostic );
+    if ( number( code ) == 0 )
+        r->succeed();
     else
-        succeed();
+        r->fail( "LDAP server refused authentication with result code " +
+                 fn( number( code ) ) );
+    r->d->mechanism->execute();
 
-    // I think we don't care about the rest of the data.
+    dispatch();
+}
 
-    //   matchedDN
-    //     04 -> octetstring
-    //     00 -> length
-    if ( (*r)[1] + 2 >= (int)r->size() )
-        return;
-    r->remove( (*r)[1] + 2 );
 
-    //   errorMessage
-    //     04 -> octetstring
-    //     00 -> length
+// takes this connection out of the pool after \a error. if it was
+// working for a relay and had worked before, the relay gets another
+// chance on a fresh connection, since the server may just have
+// forgotten an old one. a connection that never came up isn't
+// replaced, and when the last one goes, the waiting relays fail.
 
-    if ( (*r)[0] != 4 || (*r)[1] >= r->size() )
+void LdapConnection::lost( const EString & error )
+{
+    if ( gone )
         return;
-    uint l = (*r)[1];
-    r->remove( 2 );
-    EString e( r->string( l ) );
-    if ( !e.isEmpty() )
-        log( "Note: LDAP server returned error message: " + e );
-
-    if ( d->state != BindFailed )
-        unbind();
+    gone = true;
+    pool->remove( this );
+    if ( state() != Closing )
+        setState( Closing );
+
+    ::LdapRelay * r = relay;
+    relay = 0;
+    if ( r ) {
+        if ( served && r->d->attempts < 2 ) {
+            log( error + " (will retry)", Log::Debug );
+            queue->prepend( r );
+        }
+        else {
+            r->fail( error );
+            r->d->mechanism->execute();
+        }
+    }
+    else if ( !up ) {
+        log( error );
+    }
+
+    if ( up ) {
+        dispatch();
+    }
+    else if ( pool->isEmpty() ) {
+        // we can't reach the server at all, so don't keep anyone
+        // waiting
+        while ( !queue->isEmpty() ) {
+            r = queue->shift();
+            r->fail( error );
+            r->d->mechanism->execute();
+        }
+    }
 }
 
 
-/*! Sends a single bind request. */
+// gives queued relays to idle connections, and opens new connections
+// if more are needed and permitted by ldap-connections.
 
-void LdapRelay::bind()
+void LdapConnection::dispatch()
 {
-    // LDAP message
-    //     30 -> LDAP message
-    //     nn -> number of remaining bytes
+    List<LdapConnection>::Iterator i( pool );
+    uint connecting = 0;
+    while ( i && !queue->isEmpty() ) {
+        LdapConnection * c = i;
+        ++i;
+        if ( c->idle() )
+            c->send( queue->shift() );
+        else if ( !c->up )
+            connecting++;
+    }
 
-    EString m;
-    m.append( 0x30 );
+    uint max = Configuration::scalar( Configuration::LdapConnections );
+    if ( max < 1 )
+        max = 1;
+    while ( queue->count() > connecting && pool->count() < max ) {
+        pool->append( new LdapConnection );
+        connecting++;
+    }
+}
 
-    // Message id
-    //     02 -> integer
-    //     01 -> length
-    //     01 -> message-id
 
-    EString id;
-    id.append( "\002\001\001" );
+/*! \class LdapRelay ldaprelay.h
+
+    The LdapRelay class helps Mechanism relay SASL challenges and
+    responses to and from an LDAP server. If the LDAP server accepts
+    the authentication, then the user is accepted as an Archiveopteryx
+    user.
+
+    The LdapRelay state machine contains the following states:
+
+    Working: The LDAP server still hasn't answered.
 
-    // Bind request
-    //     60 -> APPLICATION 0, i.e. bind request
-    //     nn -> number of remaining bytes
+    BindFailed: We should reject this authentication.
 
-    EString h;
-    h.append( 0x60 );
+    BindSucceeded: We should accept this authentication.
 
-    //   version (03)
-    //    02 -> integer
-    //    01 -> length
-    //    03 -> version
+    LdapRelay doesn't connect to the server itself. Instead it waits
+    for one of a pool of persistent connections (at most
+    ldap-connections) to be free, and that connection sends a bind
+    request on its behalf. Each connection carries one bind at a time,
+    as RFC 4511 requires, and idle connections are closed after a
+    couple of minutes. If a connection that worked before breaks
+    during a bind, the bind is retried once on a new connection.
 
-    EString s;
-    s.append( "\002\001\003" );
+    Successful binds are remembered for ldap-cache-lifetime seconds,
+    so that a client which logs in repeatedly doesn't cost an LDAP
+    round-trip every time.
 
-    //   name (?)
-    //    04 -> octetstring
-    //    nn -> length
-    //    s* -> DN
+    The implementation is based on RFC 4511.
+*/
 
-    s.append( 0x04 );
-    EString dn;
-    if ( d->mechanism->user() )
-        dn = d->mechanism->user()->ldapdn().utf8();
-    s.append( (char)dn.length() );
-    s.append( dn );
-
-    //   authentication
-    //    80 -> type: context-specific universal zero, and zero is "password"
-    //    nn -> length
-    //    s* -> password
-
-    s.append( 0x80 );
-    EString pw = d->mechanism->secret().utf8();
-    s.append( (char)pw.length() );
-    s.append( pw );
-
-    // Fill in the length fields
-
-    h.append( (char)s.length() );
-    m.append( (char)( id.length() + h.length() + s.length() ) );
-
-    enqueue( m );
-    enqueue( id );
-    enqueue( h );
-    enqueue( s );
+
+
+/*! Constructs an LdapRelay to verify whatever \a mechanism needs. If
+    the answer is known at once, state() is not Working on return, and
+    \a mechanism won't be notified.
+*/
+
+LdapRelay::LdapRelay( SaslMechanism * mechanism )
+    : d ( new LdapRelayData )
+{
+    d->mechanism = mechanism;
+    if ( mechanism->user() )
+        d->dn = mechanism->user()->ldapdn().utf8();
+    d->password = mechanism->secret().utf8();
+
+    if ( d->password.isEmpty() ) {
+        // a simple bind with an empty password is an unauthenticated
+        // bind, which many servers accept
+        fail( "Refusing to relay an empty password to the LDAP server" );
+        return;
+    }
+
+    if ( !::queue ) {
+        ::queue = new List<LdapRelay>;
+        Allocator::addEternal( ::queue, "LDAP binds waiting" );
+        ::pool = new List<LdapConnection>;
+        Allocator::addEternal( ::pool, "LDAP connections" );
+        ::cache = new LdapCache;
+        ::binds = new GraphableCounter( "ldap-binds" );
+        ::hits = new GraphableCounter( "ldap-cache-hits" );
+    }
+
+    EString k = d->dn;
+    k.append( '\0' );
+    k.append( d->password );
+    d->key = MD5::hash( k );
+
+    LdapCache::Entry * e = ::cache->entries.find( d->key );
+    if ( e && e->expires > (uint)time( 0 ) ) {
+        ::hits->tick();
+        succeed();
+        return;
+    }
+
+    ::queue->append( this );
+    LdapConnection::dispatch();
 }
 
 
-/*! Sends an unbind request. */
+/*! Returns the address of the LDAP server used. */
 
-void LdapRelay::unbind()
+Endpoint LdapRelay::server()
 {
-    EString m;
-    m.append( 0x30 );
-    m.append( 0x05 );
-    m.append( 0x02 );
-    m.append( 0x01 );
-    m.append( 0x03 );
-    m.append( 0x42 );
-    m.append( "\000", 1 );
-    enqueue( m );
+    return Endpoint(
+        Configuration::text( Configuration::LdapServerAddress ),
+        Configuration::scalar( Configuration::LdapServerPort ) );
+
 }
 
 
@@ -352,11 +563,13 @@ void LdapRelay::fail( const EString & error )
         return;
 
     d->state = BindFailed;
-    log( error );
+    d->mechanism->log( error );
 }
 
 
-/*! This private helper sets the state and logs. */
+/*! This private helper sets the state, logs and remembers the
+    successful bind for ldap-cache-lifetime seconds.
+*/
 
 void LdapRelay::succeed()
 {
@@ -364,7 +577,18 @@ void LdapRelay::succeed()
         return;
 
     d->state = BindSucceeded;
-    log( "LDAP authentication succeeded" );
+    d->mechanism->log( "LDAP authentication succeeded" );
+
+    uint lifetime =
+        Configuration::scalar( Configuration::LdapCacheLifetime );
+    if ( !lifetime || !::cache )
+        return;
+    uint expires = time( 0 ) + lifetime;
+    LdapCache::Entry * e = ::cache->entries.find( d->key );
+    if ( e )
+        e->expires = expires;
+    else
+        ::cache->entries.insert( d->key, new LdapCache::Entry( expires ) );
 }
 
 
@@ -3,20 +3,20 @@
 #ifndef LDAPRELAY_H
 #define LDAPRELAY_H
 
-#include "connection.h"
+#include "global.h"
 
 
+class EString;
+class Endpoint;
 class SaslMechanism;
 
 
 class LdapRelay
-    : public Connection
+    : public Garbage
 {
 public:
     LdapRelay( SaslMechanism * );
 
-    void react( Event );
-
     enum State { Working,
                  BindFailed,
                  BindSucceeded };
@@ -25,12 +25,9 @@ public:
 
     static Endpoint server();
 
-    void parse();
-    void bind();
-    void unbind();
-
 private:
     class LdapRelayData * d;
+    friend class LdapConnection;
 
     void fail( const EString & );
     void succeed();
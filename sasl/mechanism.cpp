@@ -8,6 +8,7 @@
 #include "saslconnection.h"
 #include "estringlist.h"
 #include "ldaprelay.h"
+#include "passwordhash.h"
 #include "mailbox.h"
 #include "scope.h"
 #include "graph.h"
@@ -32,7 +33,7 @@ public:
         : state( SaslMechanism::IssuingChallenge ),
           command( 0 ), user( 0 ),
           l( 0 ), type( SaslMechanism::Plain ),
-          connection( 0 ), ldapRelay( 0 )
+          connection( 0 ), ldapRelay( 0 ), hash( 0 )
     {}
 
     SaslMechanism::State state;
@@ -46,6 +47,7 @@ public:
     SaslMechanism::Type type;
     SaslConnection * connection;
     LdapRelay * ldapRelay;
+    PasswordHash * hash;
 };
 
 
@@ -378,7 +380,9 @@ void SaslMechanism::tick()
     The default implementation is suitable for Anonymous or Plain text
     authentication. It returns true if the stored secret is empty, or
     matches the client-supplied secret, or if the user is trying to
-    log in as anonymous and that's permitted.
+    log in as anonymous and that's permitted. If the stored secret is
+    a crypt(3) hash, a PasswordHash checks it in a worker thread and
+    calls execute() again when it has the answer.
 */
 
 void SaslMechanism::verify()
@@ -389,7 +393,10 @@ void SaslMechanism::verify()
         else
             setState( Failed );
     }
-    else if ( d->ldapRelay ) {
+    else if ( d->ldapRelay ||
+              ( d->user && !d->user->ldapdn().isEmpty() ) ) {
+        if ( !d->ldapRelay )
+            d->ldapRelay = new LdapRelay( this );
         switch ( d->ldapRelay->state() ) {
         case LdapRelay::BindSucceeded:
             setState( Succeeded );
@@ -401,8 +408,15 @@ void SaslMechanism::verify()
             break;
         }
     }
-    else if ( d->user && !d->user->ldapdn().isEmpty() ) {
-        d->ldapRelay = new LdapRelay( this );
+    else if ( PasswordHash::isHash( storedSecret() ) ) {
+        if ( !d->hash )
+            d->hash = new PasswordHash( secret(), storedSecret(), this );
+        if ( !d->hash->done() )
+            return;
+        if ( d->hash->matched() )
+            setState( Succeeded );
+        else
+            setState( Failed );
     }
     else if ( storedSecret().isEmpty() || storedSecret() == secret() ) {
         setState( Succeeded );
@@ -0,0 +1,271 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "clusterbus.h"
+
+#include "log.h"
+#include "graph.h"
+#include "estring.h"
+#include "dbsignal.h"
+#include "allocator.h"
+#include "eventloop.h"
+#include "configuration.h"
+
+// socket, setsockopt, bind, sendto, recvfrom
+#include <sys/types.h>
+#include <sys/socket.h>
+// ip_mreq, ipv6_mreq
+#include <netinet/in.h>
+// close
+#include <unistd.h>
+// errno
+#include <errno.h>
+// time
+#include <time.h>
+// HMAC, EVP_sha256, CRYPTO_memcmp
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
+
+
+// Each datagram starts with an HMAC-SHA256 of the rest, keyed with
+// cluster-secret. The rest is the sending time, the notification's
+// name and its payload, separated by spaces.
+
+static const uint macLength = 32;
+
+// Datagrams older (or newer) than this many seconds are dropped.
+static const uint maxSkew = 30;
+
+static ClusterBus * bus = 0;
+static GraphableCounter * sent = 0;
+static GraphableCounter * received = 0;
+
+
+static EString mac( const EString & body )
+{
+    EString key = Configuration::text( Configuration::ClusterSecret );
+    unsigned char r[EVP_MAX_MD_SIZE];
+    unsigned int l = 0;
+    if ( !::HMAC( EVP_sha256(), key.data(), key.length(),
+                  (const unsigned char *)body.data(), body.length(),
+                  r, &l ) || l != macLength )
+        return "";
+    return EString( (const char *)r, l );
+}
+
+
+class ClusterBusData
+    : public Garbage
+{
+public:
+    ClusterBusData() {}
+
+    Endpoint group;
+};
+
+
+/*! \class ClusterBus clusterbus.h
+    The ClusterBus class carries database notifications directly
+    between the servers of a cluster.
+
+    When several servers share a database, each one learns about the
+    others' changes only via PostgreSQL's NOTIFY. ClusterBus sends a
+    copy of each notification enqueued with
+    Transaction::enqueueNotification() to an IP multicast group
+    (cluster-group and cluster-port) as soon as the transaction
+    commits, and hands the copies it receives to
+    DatabaseSignal::notifyFromPeer(). Since the copy includes the
+    payload, a MailboxChange can usually be applied everywhere without
+    waiting for PostgreSQL or querying it.
+
+    The bus is an optimisation, not a replacement: PostgreSQL's copy
+    still arrives, and DatabaseSignal ignores whichever copy arrives
+    second. A lost datagram merely means that the notification
+    arrives at the usual time.
+
+    Every process of every server joins the group, including the
+    sender, so processes on the same host benefit too. Datagrams are
+    authenticated with cluster-secret and must be recent; the bus is
+    not used unless cluster-secret is set.
+*/
+
+
+/*! Constructs a ClusterBus reading from \a fd and sending to \a
+    group.
+*/
+
+ClusterBus::ClusterBus( int fd, const Endpoint & group )
+    : Connection( fd, Connection::ClusterBus ), d( new ClusterBusData )
+{
+    d->group = group;
+    setState( Connected );
+    EventLoop::global()->addConnection( this );
+}
+
+
+/*! Joins the multicast group named by cluster-group and
+    cluster-port, if cluster-group is set. Must be called in each
+    process after the server forks, since each process needs its own
+    copy of each datagram.
+*/
+
+void ClusterBus::setup()
+{
+    if ( ::bus )
+        return;
+    EString g = Configuration::text( Configuration::ClusterGroup );
+    if ( g.isEmpty() )
+        return;
+    if ( Configuration::text( Configuration::ClusterSecret ).isEmpty() ) {
+        ::log( "cluster-group is set, but cluster-secret is not; "
+               "not using the cluster bus", Log::Error );
+        return;
+    }
+
+    Endpoint e( Configuration::ClusterGroup, Configuration::ClusterPort );
+    if ( !e.valid() || e.protocol() == Endpoint::Unix ) {
+        ::log( "Cannot use cluster-group " + g, Log::Error );
+        return;
+    }
+
+    int fd = ::socket( e.protocol() == Endpoint::IPv6 ? AF_INET6 : AF_INET,
+                       SOCK_DGRAM, 0 );
+    if ( fd < 0 ) {
+        ::log( "Cannot create cluster bus socket", Log::Error );
+        return;
+    }
+
+    int one = 1;
+    int ttl = 1;
+    int r = ::setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+    if ( r >= 0 )
+        r = ::bind( fd, e.sockaddr(), e.sockaddrSize() );
+    if ( r >= 0 && e.protocol() == Endpoint::IPv6 ) {
+        struct ipv6_mreq m;
+        m.ipv6mr_multiaddr = ((struct sockaddr_in6 *)e.sockaddr())->sin6_addr;
+        m.ipv6mr_interface = 0;
+        r = ::setsockopt( fd, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+                          &m, sizeof( m ) );
+        if ( r >= 0 )
+            r = ::setsockopt( fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP,
+                              &one, sizeof( one ) );
+        if ( r >= 0 )
+            r = ::setsockopt( fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+                              &ttl, sizeof( ttl ) );
+    }
+    else if ( r >= 0 ) {
+        struct ip_mreq m;
+        m.imr_multiaddr = ((struct sockaddr_in *)e.sockaddr())->sin_addr;
+        m.imr_interface.s_addr = htonl( INADDR_ANY );
+        r = ::setsockopt( fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                          &m, sizeof( m ) );
+        unsigned char c = 1;
+        if ( r >= 0 )
+            r = ::setsockopt( fd, IPPROTO_IP, IP_MULTICAST_LOOP,
+                              &c, sizeof( c ) );
+        if ( r >= 0 )
+            r = ::setsockopt( fd, IPPROTO_IP, IP_MULTICAST_TTL,
+                              &c, sizeof( c ) );
+    }
+    if ( r < 0 ) {
+        ::log( "Cannot join cluster-group " + e.string() +
+               " (errno " + fn( errno ) + ")", Log::Error );
+        ::close( fd );
+        return;
+    }
+
+    if ( !::sent ) {
+        ::sent = new GraphableCounter( "cluster-notifications-sent" );
+        ::received = new GraphableCounter( "cluster-notifications-received" );
+    }
+    ::bus = new ClusterBus( fd, e );
+    Allocator::addEternal( ::bus, "cluster bus" );
+    ::log( "Using cluster bus " + e.string() );
+}
+
+
+/*! Sends the notification \a name with \a payload to the other
+    members of the cluster, if the cluster bus is in use. The caller
+    (Transaction) must be sure that the change it announces has been
+    committed.
+*/
+
+void ClusterBus::send( const EString & name, const EString & payload )
+{
+    if ( !::bus )
+        return;
+    EString body;
+    body.appendNumber( (uint)::time( 0 ) );
+    body.append( ' ' );
+    body.append( name );
+    body.append( ' ' );
+    body.append( payload );
+    EString m = mac( body );
+    if ( m.isEmpty() )
+        return;
+    EString datagram = m + body;
+    if ( ::sendto( ::bus->fd(), datagram.data(), datagram.length(), 0,
+                   ::bus->d->group.sockaddr(),
+                   ::bus->d->group.sockaddrSize() ) ==
+         (int)datagram.length() )
+        ::sent->tick();
+}
+
+
+void ClusterBus::read()
+{
+    char data[65536];
+    while ( true ) {
+        int len = ::recvfrom( fd(), data, sizeof( data ), 0, 0, 0 );
+        if ( len < 0 && errno == EINTR )
+            continue;
+        if ( len < 0 )
+            return;
+        if ( len <= (int)macLength )
+            continue;
+
+        EString datagram( data, len );
+        EString body = datagram.mid( macLength );
+        EString m = mac( body );
+        if ( m.isEmpty() ||
+             CRYPTO_memcmp( m.data(), datagram.data(), macLength ) ) {
+            log( "Ignoring cluster bus datagram with bad signature",
+                 Log::Debug );
+            continue;
+        }
+
+        int a = body.find( ' ' );
+        int b = body.find( ' ', a + 1 );
+        bool ok = a > 0 && b > a + 1;
+        uint t = ok ? body.mid( 0, a ).number( &ok ) : 0;
+        uint now = (uint)::time( 0 );
+        if ( !ok || t + maxSkew < now || now + maxSkew < t ) {
+            log( "Ignoring stale or malformed cluster bus datagram",
+                 Log::Debug );
+            continue;
+        }
+
+        ::received->tick();
+        DatabaseSignal::notifyFromPeer( body.mid( a + 1, b - a - 1 ),
+                                        body.mid( b + 1 ) );
+    }
+}
+
+
+void ClusterBus::react( Event e )
+{
+    switch ( e ) {
+    case Read:
+    case Timeout:
+    case Connect:
+    case Shutdown:
+        break;
+
+    case Error:
+    case Close:
+        if ( ::bus == this ) {
+            ::bus = 0;
+            Allocator::removeEternal( this );
+        }
+        break;
+    }
+}
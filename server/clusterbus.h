@@ -0,0 +1,29 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef CLUSTERBUS_H
+#define CLUSTERBUS_H
+
+#include "connection.h"
+
+
+class ClusterBus
+    : public Connection
+{
+public:
+    static void setup();
+
+    static void send( const EString &, const EString & );
+
+    void read();
+    void write() {}
+    bool canWrite() { return false; }
+    void react( Event );
+
+private:
+    ClusterBus( int, const Endpoint & );
+
+    class ClusterBusData * d;
+};
+
+
+#endif
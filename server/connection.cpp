@@ -3,6 +3,7 @@
 #include "connection.h"
 
 #include "tlsthread.h"
+#include "tlsengine.h"
 
 #include "log.h"
 #include "file.h"
@@ -15,7 +16,12 @@
 #include "eventloop.h"
 #include "allocator.h"
 #include "resolver.h"
+#include "graph.h"
+#include "dict.h"
 #include "user.h"
+#include "span.h"
+#include "event.h"
+#include "configuration.h"
 
 // errno
 #include <errno.h>
@@ -36,18 +42,20 @@ class ConnectionData
 public:
     ConnectionData()
         : r( 0 ), w( 0 ),
-          tls( 0 ), l( 0 ), session( 0 ),
+          tls( 0 ), engine( 0 ), l( 0 ), session( 0 ), span( 0 ),
           fd( -1 ), timeout( 0 ),
           wbt( 0 ), wbs( 0 ),
           state( Connection::Invalid ),
           type( Connection::Client ),
-          pending( false )
+          pending( false ), waiters( 0 ), loop( 0 )
     {}
 
     Buffer *r, *w;
     TlsThread * tls;
+    TlsEngine * engine;
     Log *l;
     Session * session;
+    Span * span;
     int fd;
     uint timeout;
     uint wbt, wbs;
@@ -57,9 +65,30 @@ public:
     bool pending;
     Endpoint self, peer;
     Connection::Event event;
+    List<EventHandler> * waiters;
+    uint loop;
 };
 
 
+// a producer of output should pause once this much is waiting to be
+// written, and is told to go on when the client has read all but the
+// last little bit.
+
+static const uint highWater = 262144;
+static const uint lowWater = 65536;
+
+
+// tells the event loop, if there is one, that c may want something
+// different from what it wanted last time.
+
+static void noticeChange( const Connection * c )
+{
+    EventLoop * l = EventLoop::global();
+    if ( l )
+        l->notice( (Connection *)c );
+}
+
+
 /*! \class Connection connection.h
     Represents a single TCP connection (or other socket).
 
@@ -150,6 +179,8 @@ void Connection::setState( Connection::State st )
     if ( st == d->state )
         return;
 
+    noticeChange( this );
+
     Scope x( log() );
     bool internal = hasProperty( Internal );
     if ( st == Connected  )
@@ -160,6 +191,35 @@ void Connection::setState( Connection::State st )
         log( "Closing: " + description() + " (" +
              fn( EventLoop::global()->connections()->count() ) + " connections)",
              internal ? Log::Debug : Log::Info );
+
+    if ( st == Connected && !d->span ) {
+        const char * n = 0;
+        switch ( d->type ) {
+        case ImapServer:
+            n = "imap session";
+            break;
+        case SmtpServer:
+            n = "smtp session";
+            break;
+        case Pop3Server:
+            n = "pop session";
+            break;
+        case ManageSieveServer:
+            n = "managesieve session";
+            break;
+        default:
+            break;
+        }
+        if ( n )
+            d->span = Span::root( n, d->l );
+        if ( d->span )
+            d->span->setArgument( "peer", d->peer.string() );
+    }
+    else if ( st == Invalid && d->span ) {
+        d->span->end();
+        d->span = 0;
+    }
+
     d->state = st;
 }
 
@@ -199,6 +259,8 @@ bool Connection::hasProperty( Property p ) const
     case RecorderServer:
     case GraphDumper:
     case EGDServer:
+    case Connection::DnsClient:
+    case Connection::ClusterBus:
         if ( p == Internal )
             return true;
         break;
@@ -367,6 +429,12 @@ EString Connection::description() const
     case ManageSieveServer:
         r = "ManageSieve server";
         break;
+    case Connection::DnsClient:
+        r = "DNS client";
+        break;
+    case Connection::ClusterBus:
+        r = "Cluster bus";
+        break;
     }
     Endpoint her = peer();
     Endpoint me = self();
@@ -410,6 +478,7 @@ uint Connection::timeout() const
 void Connection::setTimeout( uint tm )
 {
     d->timeout = tm;
+    noticeChange( this );
 }
 
 
@@ -419,6 +488,7 @@ void Connection::setTimeout( uint tm )
 void Connection::setTimeoutAfter( uint n )
 {
     d->timeout = n + (uint)time(0);
+    noticeChange( this );
 }
 
 
@@ -464,10 +534,16 @@ Buffer *Connection::readBuffer() const
 }
 
 
-/*! Returns a pointer to the connection's write buffer. */
+/*! Returns a pointer to the connection's write buffer.
+
+    Whoever asks for the write buffer may be about to write to it, so
+    this tells the EventLoop to look at this Connection again. Use
+    writeBufferSize() to look without writing.
+*/
 
 Buffer *Connection::writeBuffer() const
 {
+    noticeChange( this );
     return d->w;
 }
 
@@ -514,12 +590,65 @@ Endpoint Connection::peer() const
 }
 
 
-/*! Closes this connection. */
+static Dict<GraphableDataSet> * deflateStats;
+
+
+// records the compression ratio and CPU time of \a w for type \a t
+static void recordCompression( Connection::Type t, Buffer * w )
+{
+    EString n;
+    switch ( t ) {
+    case Connection::ImapServer:
+        n = "imap";
+        break;
+    case Connection::Pop3Server:
+        n = "pop3";
+        break;
+    case Connection::SmtpServer:
+        n = "smtp";
+        break;
+    default:
+        n = "other";
+        break;
+    }
+
+    if ( !deflateStats ) {
+        deflateStats = new Dict<GraphableDataSet>;
+        Allocator::addEternal( deflateStats, "deflate statistics" );
+    }
+    GraphableDataSet * ratio = deflateStats->find( "ratio-" + n );
+    if ( !ratio ) {
+        ratio = new GraphableDataSet( "deflate-ratio-" + n );
+        deflateStats->insert( "ratio-" + n, ratio );
+    }
+    GraphableDataSet * cpu = deflateStats->find( "cpu-" + n );
+    if ( !cpu ) {
+        cpu = new GraphableDataSet( "deflate-cpu-" + n );
+        deflateStats->insert( "cpu-" + n, cpu );
+    }
+    ratio->addNumber( w->compressionRatio() );
+    cpu->addNumber( w->compressionTime() );
+}
+
+
+/*! Closes this connection.
+
+    If the connection used COMPRESS=DEFLATE, the compression ratio (as
+    a percentage) and the CPU time spent compressing (in microseconds)
+    are recorded in the deflate-ratio-* and deflate-cpu-* statistics
+    for the connection's type.
+*/
 
 void Connection::close()
 {
-    if ( valid() && d->fd >= 0 )
+    if ( d->w->compression() == Buffer::Compressing )
+        recordCompression( d->type, d->w );
+    if ( valid() && d->fd >= 0 ) {
+        EventLoop::global()->stopWatching( d->fd );
+        if ( d->engine )
+            d->engine->close();
         ::close( d->fd );
+    }
     if ( d->tls )
         d->tls->close();
     d->r->close();
@@ -527,6 +656,7 @@ void Connection::close()
     setState( Invalid );
     d->session = 0;
     EventLoop::global()->removeConnection( this );
+    wakeWaiters();
 }
 
 
@@ -535,7 +665,11 @@ void Connection::close()
 
 void Connection::read()
 {
-    if ( valid() )
+    if ( !valid() )
+        return;
+    if ( d->engine )
+        d->engine->read();
+    else
         d->r->read( d->fd );
 }
 
@@ -548,7 +682,10 @@ void Connection::write()
     if ( !valid() )
         return;
 
-    d->w->write( d->fd );
+    if ( d->engine )
+        d->engine->write();
+    else
+        d->w->write( d->fd );
     uint wbs = d->w->size();
     if ( wbs && !d->wbs ) {
         d->wbt = time( 0 );
@@ -568,6 +705,66 @@ void Connection::write()
         d->wbt = 0;
         d->wbs = 0;
     }
+    if ( d->waiters && wbs < lowWater )
+        wakeWaiters();
+}
+
+
+/*! Returns true if so much output is waiting to be written that
+    whoever produces it should pause, e.g. because the client reads
+    slowly. Producers that get true should call waitForRoom() and stop
+    until resumed.
+*/
+
+bool Connection::writeBufferFull() const
+{
+    return d->w->size() >= highWater;
+}
+
+
+/*! Returns the number of bytes waiting in the write buffer. Unlike
+    writeBuffer(), this doesn't make the EventLoop look at this
+    Connection again.
+*/
+
+uint Connection::writeBufferSize() const
+{
+    if ( !d->w )
+        return 0;
+    return d->w->size();
+}
+
+
+/*! Arranges for \a h to be notified once most of the output waiting
+    in the write buffer has been written, or when the connection is
+    closed. Does nothing unless writeBufferFull() is true, since there
+    may then be no write to wait for.
+*/
+
+void Connection::waitForRoom( EventHandler * h )
+{
+    if ( !h || !valid() || !writeBufferFull() )
+        return;
+    if ( !d->waiters )
+        d->waiters = new List<EventHandler>;
+    if ( !d->waiters->find( h ) )
+        d->waiters->append( h );
+}
+
+
+/*! Notifies each EventHandler waiting for room in the write buffer,
+    if any. */
+
+void Connection::wakeWaiters()
+{
+    List<EventHandler> * l = d->waiters;
+    d->waiters = 0;
+    List<EventHandler>::Iterator i( l );
+    while ( i ) {
+        EventHandler * h = i;
+        ++i;
+        h->notify();
+    }
 }
 
 
@@ -575,10 +772,25 @@ void Connection::write()
 
 bool Connection::canWrite()
 {
+    if ( d->engine && d->engine->wantsWrite() )
+        return true;
     return d->w->size() > 0;
 }
 
 
+/*! Returns true if this Connection wants to read input from its
+    socket, and false if it wants the OS to hold on to it for the time
+    being. Subclasses can reimplement this to push back on a client
+    that sends faster than the server wants to handle. The default
+    implementation always returns true.
+*/
+
+bool Connection::canRead()
+{
+    return true;
+}
+
+
 /*! Returns true only if the Event \a e is pending on this Connection.
 */
 
@@ -604,11 +816,16 @@ void Connection::enqueue( const EString &s )
 */
 
 
-/*! Starts TLS negotiation on this connection. */
+/*! Starts TLS negotiation on this connection.
+
+    Normally the TLS work is done by a TlsEngine within the EventLoop.
+    If use-tls-thread is enabled, a TlsThread does it instead, and
+    this Connection talks to the thread via a socketpair.
+*/
 
 void Connection::startTls()
 {
-    if ( d->tls || !valid() )
+    if ( d->tls || d->engine || !valid() )
         return;
 
     write();
@@ -616,6 +833,15 @@ void Connection::startTls()
     log( "Negotiating TLS for client " + peer().string(),
          Log::Debug );
 
+    if ( !Configuration::toggle( Configuration::UseTlsThread ) ) {
+        d->engine = new TlsEngine( d->fd, d->r, d->w );
+        if ( d->engine->broken() ) {
+            log( "Cannot start TLS", Log::Error );
+            close();
+        }
+        return;
+    }
+
     int sv[2];
     int r = ::socketpair( AF_UNIX, SOCK_STREAM, 0, sv );
     if ( r < 0 ) {
@@ -645,9 +871,11 @@ void Connection::startTls()
     if ( fcntl( sv[1], F_SETFL, flags ) < 0 )
         die( FD );
 
+    EventLoop::global()->stopWatching( d->fd );
     t->setClientFD( d->fd );
     t->setServerFD( sv[0] );
     d->fd = sv[1];
+    noticeChange( this );
 
     d->tls = t;
 }
@@ -659,7 +887,7 @@ void Connection::startTls()
 
 bool Connection::hasTls() const
 {
-    if ( d->tls )
+    if ( d->tls || d->engine )
         return true;
     return false;
 }
@@ -674,10 +902,14 @@ bool Connection::hasTls() const
 
     Logs errors only if \a silent is false.
 
+    If \a shared is true, the socket is bound with SO_REUSEPORT, so
+    that other sockets may listen to the same endpoint and the kernel
+    shares new connections between them.
+
     (Why does this return an int instead of a bool?)
 */
 
-int Connection::listen( const Endpoint &e, bool silent )
+int Connection::listen( const Endpoint &e, bool silent, bool shared )
 {
     if ( !e.valid() )
         return -1;
@@ -691,6 +923,23 @@ int Connection::listen( const Endpoint &e, bool silent )
     int i = 1;
     ::setsockopt( d->fd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof (int) );
 
+    if ( shared ) {
+#ifdef SO_REUSEPORT
+        if ( ::setsockopt( d->fd, SOL_SOCKET, SO_REUSEPORT,
+                           &i, sizeof (int) ) < 0 ) {
+            if ( !silent )
+                log( "Cannot set SO_REUSEPORT. Error code " + fn( errno ),
+                     Log::Error );
+            return -1;
+        }
+#else
+        if ( !silent )
+            log( "SO_REUSEPORT is not supported on this platform",
+                 Log::Error );
+        return -1;
+#endif
+    }
+
     if ( e.protocol() == Endpoint::Unix )
         unlink( File::chrooted( e.address() ).cstr() );
 
@@ -1075,3 +1324,23 @@ class Session * Connection::session() const
 {
     return d->session;
 }
+
+
+/*! Returns the flags EventLoop keeps for this Connection. Only
+    EventLoop uses this.
+*/
+
+uint Connection::loopFlags() const
+{
+    return d->loop;
+}
+
+
+/*! Sets the flags EventLoop keeps for this Connection to \a f. Only
+    EventLoop uses this.
+*/
+
+void Connection::setLoopFlags( uint f )
+{
+    d->loop = f;
+}
@@ -33,7 +33,9 @@ public:
         Listener,
         Pipe,
         ManageSieveServer,
-        LdapRelay
+        LdapRelay,
+        DnsClient,
+        ClusterBus
     };
     Connection();
     Connection( int, Type );
@@ -69,15 +71,20 @@ public:
     virtual void read();
     virtual void write();
     virtual bool canWrite();
+    virtual bool canRead();
 
     void enqueue( const EString & );
 
+    bool writeBufferFull() const;
+    uint writeBufferSize() const;
+    void waitForRoom( class EventHandler * );
+
     enum Event { Error, Connect, Read, Timeout, Close, Shutdown };
     virtual void react( Event ) = 0;
 
     bool isPending( Event );
 
-    int listen( const Endpoint &, bool );
+    int listen( const Endpoint &, bool, bool = false );
     int connect( const Endpoint & );
     int connect( const EString &, uint );
     int accept();
@@ -102,12 +109,16 @@ public:
     virtual void setSession( class Session * );
     class Session * session() const;
 
+    uint loopFlags() const;
+    void setLoopFlags( uint );
+
 protected:
     void substitute( Connection *, Event );
     void init( int );
 
 private:
     class ConnectionData *d;
+    void wakeWaiters();
 };
 
 
@@ -0,0 +1,797 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+// time
+#include <time.h>
+// close
+#include <unistd.h>
+// errno
+#include <errno.h>
+
+#if !defined( T_AAAA )
+// OS X defines T_AAAA in nameser_compat.h
+#include <arpa/nameser_compat.h>
+#endif
+
+#include "dnsquery.h"
+
+#include "map.h"
+#include "dict.h"
+#include "cache.h"
+#include "event.h"
+#include "entropy.h"
+#include "endpoint.h"
+#include "resolver.h"
+#include "allocator.h"
+#include "eventloop.h"
+#include "connection.h"
+#include "configuration.h"
+
+
+class DnsQueryData
+    : public Garbage
+{
+public:
+    DnsQueryData()
+        : type( DnsQuery::Address ), owner( 0 ),
+          started( false ), done( false ), failed( false ),
+          nxdomain( false ), outstanding( 0 ), ttl( 3600 )
+    {}
+
+    EString name;
+    DnsQuery::Type type;
+    EventHandler * owner;
+    bool started;
+    bool done;
+    bool failed;
+    bool nxdomain;
+    uint outstanding;
+    uint ttl;
+    EStringList v6;
+    EStringList v4;
+    EStringList results;
+};
+
+
+// the answers we've received, kept until their TTL expires or the
+// allocator wants the memory.
+
+class DnsCache
+    : public Cache
+{
+public:
+    class Entry
+        : public Garbage
+    {
+    public:
+        Entry(): expires( 0 ) {}
+        EStringList results;
+        uint expires;
+    };
+
+    DnsCache(): Cache( 10 ) {}
+    void clear() { entries.clear(); }
+
+    static EString key( const EString & name, DnsQuery::Type type ) {
+        if ( type == DnsQuery::MailExchangers )
+            return "mx " + name;
+        return "a " + name;
+    }
+
+    Dict<Entry> entries;
+};
+
+static DnsCache * cache = 0;
+
+
+// one packet sent to the name server, and the query waiting for it
+
+class DnsPacket
+    : public Garbage
+{
+public:
+    DnsPacket(): query( 0 ), type( 0 ), id( 0 ), tries( 0 ), sent( 0 ) {}
+
+    DnsQuery * query;
+    uint type;
+    uint id;
+    uint tries;
+    uint sent;
+    EString packet;
+};
+
+
+// DnsClient sends queries to the name servers listed in
+// /etc/resolv.conf using one UDP socket, and hands each reply to the
+// DnsQuery waiting for it. Lost packets are resent to the next name
+// server.
+
+class DnsClient
+    : public Connection
+{
+public:
+    DnsClient( int );
+
+    static DnsClient * client();
+
+    void send( DnsQuery *, uint );
+
+    void read();
+    void write() {}
+    bool canWrite() { return false; }
+    void react( Event );
+
+private:
+    void transmit( DnsPacket * );
+    void wait();
+
+    Map<DnsPacket> pending;
+    uint outstanding;
+    List<Endpoint> servers;
+};
+
+
+static DnsClient * dnsclient = 0;
+static bool noDnsClient = false;
+
+
+DnsClient::DnsClient( int fd )
+    : Connection( fd, Connection::DnsClient ), outstanding( 0 )
+{
+    setState( Connected );
+    EventLoop::global()->addConnection( this );
+}
+
+
+// returns a pointer to the DnsClient, creating one if necessary, or
+// a null pointer if we can't use one.
+
+DnsClient * DnsClient::client()
+{
+    if ( ::dnsclient || ::noDnsClient )
+        return ::dnsclient;
+
+    List<Endpoint> servers;
+    if ( res_init() == 0 ) {
+        int i = 0;
+        while ( i < _res.nscount ) {
+            if ( _res.nsaddr_list[i].sin_family == AF_INET ) {
+                Endpoint e( (struct sockaddr *)&_res.nsaddr_list[i],
+                            sizeof( struct sockaddr_in ) );
+                if ( e.valid() )
+                    servers.append( new Endpoint( e ) );
+            }
+            i++;
+        }
+    }
+
+    int fd = -1;
+    if ( !servers.isEmpty() )
+        fd = ::socket( AF_INET, SOCK_DGRAM, 0 );
+    if ( fd < 0 ) {
+        ::log( "Cannot use asynchronous DNS; will block while resolving",
+               Log::Error );
+        ::noDnsClient = true;
+        return 0;
+    }
+
+    ::dnsclient = new DnsClient( fd );
+    ::dnsclient->servers.append( servers );
+    Allocator::addEternal( ::dnsclient, "DNS client" );
+    return ::dnsclient;
+}
+
+
+// sends a query for type \a type to the name server, and arranges
+// for \a q to receive the answer.
+
+void DnsClient::send( DnsQuery * q, uint type )
+{
+    DnsPacket * p = new DnsPacket;
+    p->query = q;
+    p->type = type;
+
+    uint n = 0;
+    do {
+        p->id = Entropy::asNumber( 2 ) & 0xffff;
+        n++;
+    } while ( pending.contains( p->id ) && n < 8 );
+    if ( pending.contains( p->id ) ) {
+        q->fail();
+        return;
+    }
+
+    u_char buffer[512];
+    int len = res_mkquery( QUERY, q->name().cstr(), C_IN, type,
+                           0, 0, 0, buffer, sizeof( buffer ) );
+    if ( len < 12 ) {
+        q->fail();
+        return;
+    }
+    buffer[0] = p->id >> 8;
+    buffer[1] = p->id & 0xff;
+    p->packet.append( (const char *)buffer, len );
+
+    pending.insert( p->id, p );
+    outstanding++;
+    transmit( p );
+    wait();
+}
+
+
+// sends \a p to the next name server.
+
+void DnsClient::transmit( DnsPacket * p )
+{
+    Endpoint * e = servers.first();
+    uint n = p->tries % servers.count();
+    List<Endpoint>::Iterator i( servers );
+    while ( i && n ) {
+        ++i;
+        n--;
+    }
+    if ( i )
+        e = i;
+    p->tries++;
+    p->sent = (uint)::time( 0 );
+    (void)::sendto( fd(), p->packet.data(), p->packet.length(), 0,
+                    e->sockaddr(), e->sockaddrSize() );
+}
+
+
+// makes sure we wake up to retransmit, or not, as needed.
+
+void DnsClient::wait()
+{
+    if ( !outstanding )
+        setTimeout( 0 );
+    else if ( !timeout() )
+        setTimeoutAfter( 1 );
+}
+
+
+void DnsClient::read()
+{
+    char data[4096];
+    while ( true ) {
+        struct sockaddr_storage from;
+        socklen_t fromlen = sizeof( from );
+        int len = ::recvfrom( fd(), data, sizeof( data ), 0,
+                              (struct sockaddr *)&from, &fromlen );
+        if ( len < 0 && errno == EINTR )
+            continue;
+        if ( len < 12 )
+            return;
+
+        // only accept replies from the servers we asked
+        Endpoint source( (struct sockaddr *)&from, fromlen );
+        bool known = false;
+        List<Endpoint>::Iterator s( servers );
+        while ( s && !known ) {
+            if ( s->address() == source.address() &&
+                 s->port() == source.port() )
+                known = true;
+            ++s;
+        }
+
+        EString buffer( data, len );
+        uint id = ( (unsigned char)buffer[0] << 8 ) + (unsigned char)buffer[1];
+        DnsPacket * p = pending.find( id );
+        if ( known && p && ( buffer[2] & 0x80 ) ) {
+            // we don't retry truncated answers using TCP, since
+            // parse() accepts the part that fits.
+            pending.remove( id );
+            outstanding--;
+            p->query->answer( p->type, buffer );
+        }
+    }
+}
+
+
+void DnsClient::react( Event e )
+{
+    switch ( e ) {
+    case Read:
+        wait();
+        break;
+
+    case Timeout:
+        {
+            uint now = (uint)::time( 0 );
+            List<DnsPacket> expired;
+            Map<DnsPacket>::Iterator i( pending );
+            while ( i ) {
+                if ( i->sent + 2 <= now )
+                    expired.append( i );
+                ++i;
+            }
+            List<DnsPacket>::Iterator p( expired );
+            while ( p ) {
+                if ( p->tries < 3 ) {
+                    transmit( p );
+                }
+                else {
+                    pending.remove( p->id );
+                    outstanding--;
+                    log( "DNS lookup timed out for " + p->query->name(),
+                         Log::Debug );
+                    p->query->fail();
+                }
+                ++p;
+            }
+            wait();
+        }
+        break;
+
+    case Connect:
+    case Shutdown:
+        break;
+
+    case Error:
+    case Close:
+        {
+            ::dnsclient = 0;
+            Allocator::removeEternal( this );
+            Map<DnsPacket>::Iterator i( pending );
+            List<DnsPacket> all;
+            while ( i ) {
+                all.append( i );
+                ++i;
+            }
+            pending.clear();
+            outstanding = 0;
+            List<DnsPacket>::Iterator p( all );
+            while ( p ) {
+                p->query->fail();
+                ++p;
+            }
+        }
+        break;
+    }
+}
+
+
+/*! \class DnsQuery dnsquery.h
+    The DnsQuery class looks up the addresses or mail exchangers of a
+    domain name without blocking the event loop.
+
+    Resolver calls res_query(), which waits until the name server
+    answers. That's fine at startup, but a DeliveryAgent that looks up
+    dozens of domains stops the entire process once for each. DnsQuery
+    sends its packets via a single UDP socket, which the EventLoop
+    watches like any other Connection, and notifies its owner when the
+    answer has arrived.
+
+    Answers are cached for as long as their TTL allows, but at least a
+    minute (so that SmtpClient's Resolver::resolve() call finds the
+    answer) and at most an hour. Negative answers are cached for five
+    minutes, temporary failures not at all. If /etc/resolv.conf names
+    no usable name server, DnsQuery falls back to Resolver, and
+    blocks.
+
+    The results of a successful Address lookup are the IPv6 addresses
+    followed by the IPv4 addresses, subject to use-ipv6 and
+    use-ipv4. The results of a MailExchangers lookup follow the rules
+    documented for Resolver::mx().
+*/
+
+
+/*! Constructs a query for the \a type records of \a name, which will
+    notify \a owner once it's done().
+*/
+
+DnsQuery::DnsQuery( const EString & name, Type type, EventHandler * owner )
+    : d( new DnsQueryData )
+{
+    d->name = name.lower();
+    d->type = type;
+    d->owner = owner;
+}
+
+
+// returns true if resolving \a name doesn't involve the DNS.
+
+static bool isLiteral( const EString & name )
+{
+    return name.isEmpty() || name == "localhost" ||
+        name.contains( ':' ) || name.startsWith( "/" ) ||
+        ( name.contains( '.' ) && name[name.length()-1] <= '9' );
+}
+
+
+/*! Starts the lookup. If the answer is available at once (because
+    it's cached, or because name() is an address literal), done() is
+    true when execute() returns, and the owner is not notified.
+*/
+
+void DnsQuery::execute()
+{
+    if ( d->started )
+        return;
+    d->started = true;
+
+    EStringList * c = cached( d->name, d->type );
+    if ( c ) {
+        d->results.append( *c );
+        d->done = true;
+        return;
+    }
+
+    if ( d->type == Address && isLiteral( d->name ) ) {
+        d->results.append( Resolver::resolve( d->name ) );
+        d->done = true;
+        return;
+    }
+
+    DnsClient * client = DnsClient::client();
+    if ( !client ) {
+        if ( d->type == Address ) {
+            d->results.append( Resolver::resolve( d->name ) );
+        }
+        else {
+            bool ok = true;
+            d->results.append( Resolver::mx( d->name, &ok ) );
+            d->failed = !ok;
+        }
+        d->done = true;
+        return;
+    }
+
+    if ( d->type == MailExchangers ) {
+        d->outstanding = 1;
+        client->send( this, T_MX );
+    }
+    else {
+        bool use6 = Configuration::toggle( Configuration::UseIPv6 );
+        bool use4 = Configuration::toggle( Configuration::UseIPv4 );
+        d->outstanding = ( use6 ? 1 : 0 ) + ( use4 ? 1 : 0 );
+        if ( !d->outstanding )
+            d->done = true;
+        if ( use6 )
+            client->send( this, T_AAAA );
+        if ( use4 && !d->done )
+            client->send( this, T_A );
+    }
+}
+
+
+/*! Returns the name looked up, as set by the constructor (but in
+    lower case).
+*/
+
+EString DnsQuery::name() const
+{
+    return d->name;
+}
+
+
+/*! Returns the type of lookup, as set by the constructor. */
+
+DnsQuery::Type DnsQuery::type() const
+{
+    return d->type;
+}
+
+
+/*! Returns true if the lookup has finished, successfully or not. */
+
+bool DnsQuery::done() const
+{
+    return d->done;
+}
+
+
+/*! Returns true if the lookup failed temporarily, ie. if no name
+    server gave a usable answer. A name that doesn't exist is not a
+    failure: its results() are empty.
+*/
+
+bool DnsQuery::failed() const
+{
+    return d->failed;
+}
+
+
+/*! Returns the results of the lookup, or an empty list if it hasn't
+    finished or has failed().
+*/
+
+EStringList DnsQuery::results() const
+{
+    return d->results;
+}
+
+
+/*! Returns a pointer to the cached results of a \a type lookup for \a
+    name, or a null pointer if there are none and a query has to be
+    sent.
+*/
+
+EStringList * DnsQuery::cached( const EString & name, Type type )
+{
+    if ( !::cache )
+        return 0;
+    DnsCache::Entry * e = ::cache->entries.find( DnsCache::key( name.lower(),
+                                                                type ) );
+    if ( !e || e->expires <= (uint)::time( 0 ) )
+        return 0;
+    return &e->results;
+}
+
+
+// this private helper finishes the lookup: it combines the answers,
+// caches the result if it's not a failure and notifies the owner.
+
+static void store( const EString & name, DnsQuery::Type type,
+                   const EStringList & results, uint ttl )
+{
+    if ( !::cache ) {
+        ::cache = new DnsCache;
+        Allocator::addEternal( ::cache, "DNS cache" );
+    }
+    if ( ttl > 3600 )
+        ttl = 3600;
+    else if ( ttl < 60 )
+        ttl = 60;
+    DnsCache::Entry * e = new DnsCache::Entry;
+    e->results.append( results );
+    e->expires = (uint)::time( 0 ) + ttl;
+    ::cache->entries.insert( DnsCache::key( name, type ), e );
+}
+
+
+/*! This private function is called by DnsClient with a \a reply to
+    a query of \a type.
+*/
+
+void DnsQuery::answer( uint type, const EString & reply )
+{
+    uint rcode = reply[3] & 0x0f;
+    uint ttl = 3600;
+    EStringList r;
+    if ( rcode == 3 ) {
+        // NXDOMAIN
+        d->nxdomain = true;
+        ttl = 300;
+    }
+    else if ( rcode != 0 || !parse( reply, type, &r, &ttl ) ) {
+        fail();
+        return;
+    }
+    else if ( r.isEmpty() ) {
+        // NODATA
+        ttl = 300;
+    }
+
+    if ( ttl < d->ttl )
+        d->ttl = ttl;
+    // MX answers are kept in v4, with the A answers
+    if ( type == T_AAAA )
+        d->v6.append( r );
+    else
+        d->v4.append( r );
+
+    if ( d->outstanding )
+        d->outstanding--;
+    if ( d->outstanding || d->done )
+        return;
+
+    d->done = true;
+    if ( d->type == MailExchangers ) {
+        // no MX means the domain itself, a null MX means no mail
+        if ( !d->nxdomain && d->v4.isEmpty() )
+            d->results.append( d->name );
+        else if ( !d->v4.contains( "" ) )
+            d->results.append( d->v4 );
+    }
+    else {
+        d->results.append( d->v6 );
+        d->results.append( d->v4 );
+    }
+
+    // if one of the AAAA and A lookups failed, we use the other's
+    // answer, but don't cache it
+    if ( !d->failed )
+        store( d->name, d->type, d->results, d->ttl );
+    else if ( !d->results.isEmpty() )
+        d->failed = false;
+    if ( d->owner )
+        d->owner->notify();
+}
+
+
+/*! This private function records that one of the packets sent for
+    this query received no usable answer.
+*/
+
+void DnsQuery::fail()
+{
+    d->failed = true;
+    if ( d->outstanding )
+        d->outstanding--;
+    if ( d->outstanding || d->done )
+        return;
+
+    d->done = true;
+    if ( d->type == Address ) {
+        d->results.append( d->v6 );
+        d->results.append( d->v4 );
+        if ( !d->results.isEmpty() )
+            d->failed = false;
+    }
+    if ( d->failed )
+        d->results.clear();
+    if ( d->owner )
+        d->owner->notify();
+}
+
+
+// reads a domain name at offset \a i in \a p and moves \a i past
+// it. sets *\a bad if the name is unparsable.
+
+static EString readName( const EString & p, uint & i, bool * bad )
+{
+    EString r;
+    uint c = i;
+    uint jumps = 0;
+    bool jumped = false;
+    while ( !*bad ) {
+        if ( c >= p.length() ) {
+            *bad = true;
+        }
+        else if ( (unsigned char)p[c] == 0 ) {
+            c++;
+            break;
+        }
+        else if ( (unsigned char)p[c] < 64 ) {
+            uint l = (unsigned char)p[c];
+            if ( c + 1 + l > p.length() ) {
+                *bad = true;
+            }
+            else {
+                if ( !r.isEmpty() )
+                    r.append( '.' );
+                r.append( p.mid( c + 1, l ) );
+                c += 1 + l;
+            }
+        }
+        else if ( (unsigned char)p[c] >= 192 &&
+                  c + 1 < p.length() && jumps < 32 ) {
+            uint target = ( ( (unsigned char)p[c] & 0x3f ) << 8 ) +
+                          (unsigned char)p[c+1];
+            if ( !jumped )
+                i = c + 2;
+            jumped = true;
+            jumps++;
+            c = target;
+        }
+        else {
+            *bad = true;
+        }
+    }
+    if ( !jumped )
+        i = c;
+    return r;
+}
+
+
+// one mail exchanger and its preference, used while sorting
+class Exchanger
+    : public Garbage
+{
+public:
+    Exchanger( uint p, const EString & n ): preference( p ), name( n ) {}
+    uint preference;
+    EString name;
+};
+
+
+/*! Parses the DNS \a reply to a query for \a type records (T_A,
+    T_AAAA or T_MX) and appends the answers to \a results. Returns
+    true if \a reply could be parsed, and false if not. If there are
+    answers, *\a ttl is set to the smallest TTL among them.
+
+    Addresses are returned in the form used by Endpoint::address();
+    mail exchangers are returned by name, most preferred first. A null
+    MX (RFC 7505) is returned as an empty string.
+
+    Truncated packets are silently accepted (the partial RR is
+    ignored).
+*/
+
+bool DnsQuery::parse( const EString & reply, uint type,
+                      EStringList * results, uint * ttl )
+{
+    if ( reply.length() < 12 )
+        return false;
+
+    uint qdcount = ( (unsigned char)reply[4] << 8 ) + (unsigned char)reply[5];
+    uint ancount = ( (unsigned char)reply[6] << 8 ) + (unsigned char)reply[7];
+
+    bool bad = false;
+    uint p = 12;
+    while ( p < reply.length() && qdcount && !bad ) {
+        (void)readName( reply, p, &bad );
+        p += 4;
+        qdcount--;
+    }
+
+    List<Exchanger> exchangers;
+    while ( p + 10 <= reply.length() && ancount && !bad ) {
+        (void)readName( reply, p, &bad );
+        if ( bad || p + 10 > reply.length() )
+            break;
+        uint t = ( (unsigned char)reply[p] << 8 ) + (unsigned char)reply[p+1];
+        uint rrttl = ( (unsigned char)reply[p+4] << 24 ) +
+                     ( (unsigned char)reply[p+5] << 16 ) +
+                     ( (unsigned char)reply[p+6] << 8 ) +
+                     (unsigned char)reply[p+7];
+        uint rdlength = ( (unsigned char)reply[p+8] << 8 ) +
+                        (unsigned char)reply[p+9];
+        p += 10;
+        if ( p + rdlength > reply.length() )
+            break;
+
+        EString a;
+        if ( t != type ) {
+            // a CNAME, most likely. the answer follows.
+        }
+        else if ( t == T_A && rdlength == 4 ) {
+            uint i = 0;
+            while ( i < rdlength ) {
+                if ( !a.isEmpty() )
+                    a.append( '.' );
+                a.append( fn( (unsigned char)reply[p+i] ) );
+                i++;
+            }
+        }
+        else if ( t == T_AAAA && rdlength == 16 ) {
+            uint i = 0;
+            while ( i < rdlength ) {
+                if ( !a.isEmpty() )
+                    a.append( ':' );
+                a.append( fn( ( (unsigned char)reply[p+i] << 8 ) +
+                              (unsigned char)reply[p+i+1], 16 ) );
+                i += 2;
+            }
+        }
+        else if ( t == T_MX && rdlength >= 3 ) {
+            uint preference = ( (unsigned char)reply[p] << 8 ) +
+                              (unsigned char)reply[p+1];
+            uint n = p + 2;
+            EString name = readName( reply, n, &bad ).lower();
+            Exchanger * x = new Exchanger( preference, name );
+            List<Exchanger>::Iterator i( exchangers );
+            while ( i && i->preference <= preference )
+                ++i;
+            exchangers.insert( i, x );
+            if ( rrttl < *ttl )
+                *ttl = rrttl;
+        }
+
+        if ( !a.isEmpty() ) {
+            Endpoint e( a, 1 );
+            // if it's not valid, we received an illegal reply from
+            // the DNS server. let's ignore that silently.
+            if ( e.valid() ) {
+                results->append( e.address() );
+                if ( rrttl < *ttl )
+                    *ttl = rrttl;
+            }
+        }
+        p += rdlength;
+        ancount--;
+    }
+
+    List<Exchanger>::Iterator i( exchangers );
+    while ( i ) {
+        results->append( i->name );
+        ++i;
+    }
+
+    return !bad;
+}
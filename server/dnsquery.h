@@ -0,0 +1,41 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef DNSQUERY_H
+#define DNSQUERY_H
+
+#include "estringlist.h"
+
+class EventHandler;
+
+
+class DnsQuery
+    : public Garbage
+{
+public:
+    enum Type { Address, MailExchangers };
+
+    DnsQuery( const EString &, Type, EventHandler * );
+
+    void execute();
+
+    EString name() const;
+    Type type() const;
+
+    bool done() const;
+    bool failed() const;
+    EStringList results() const;
+
+    static EStringList * cached( const EString &, Type );
+
+    static bool parse( const EString &, uint, EStringList *, uint * );
+
+private:
+    class DnsQueryData * d;
+    friend class DnsClient;
+
+    void answer( uint, const EString & );
+    void fail();
+};
+
+
+#endif
@@ -13,47 +13,75 @@
 #include "event.h"
 #include "list.h"
 #include "log.h"
+#include "poller.h"
+#include "estringlist.h"
+#include "cache.h"
+#include "logclient.h"
+#include "tlsengine.h"
+#include "configuration.h"
+#include "dict.h"
+#include "map.h"
 
 // time
 #include <time.h>
+// gettimeofday
+#include <sys/time.h>
 // errno
 #include <errno.h>
-// struct timeval, fd_set
-#include <sys/time.h>
-#include <sys/types.h>
-#include <sys/select.h>
 // getsockopt, SOL_SOCKET, SO_ERROR
+#include <sys/types.h>
 #include <sys/socket.h>
-// read, select
+// read
 #include <unistd.h>
 // ioctl, FIONREAD
 #include <sys/ioctl.h>
-
-// memset (for FD_* under OpenBSD)
-#include <string.h>
+// typeid
+#include <typeinfo>
+// abi::__cxa_demangle
+#include <cxxabi.h>
+// free
+#include <stdlib.h>
 
 
 static bool freeMemorySoon;
+static bool profileMemorySoon;
+static bool drainSoon;
+static bool reloadSoon;
 
 
 static EventLoop * loop;
 
 
+// the flags EventLoop keeps in each Connection's loopFlags()
+
+enum {
+    Member = 1, // in LoopData::connections
+    Noticed = 2, // in LoopData::noticed
+    Queued = 4 // about to be dispatched
+};
+
+
 class LoopData
     : public Garbage
 {
 public:
     LoopData()
-        : log( new Log ), startup( false ),
-          stop( false ), limit( 16 * 1024 * 1024 )
+        : log( new Log ), poller( 0 ), startup( false ),
+          stop( false ), draining( false ), limit( 16 * 1024 * 1024 ),
+          noticed( new List<Connection> ), nextTimeout( 0 )
     {}
 
     Log *log;
+    Poller * poller;
     bool startup;
     bool stop;
+    bool draining;
     List< Connection > connections;
-    List< Timer > timers;
+    TimerWheel timers;
     uint limit;
+    List< Connection > * noticed;
+    Map< Connection > fds;
+    uint nextTimeout;
 
     class Stopper
         : public EventHandler
@@ -74,6 +102,56 @@ public:
         }
         bool stage2;
     };
+
+    // closes a share of the remaining external connections each
+    // second, so that they're all gone when the time is up
+    class Drainer
+        : public EventHandler
+    {
+    public:
+        Drainer( uint s ): left( s ), timer( new Timer( this, 1 ) ) {
+            timer->setRepeating( true );
+        }
+        void execute() {
+            EventLoop * l = EventLoop::global();
+            if ( !l || l->inShutdown() ) {
+                timer->setRepeating( false );
+                return;
+            }
+            List<Connection> clients;
+            List<Connection>::Iterator i( l->connections() );
+            while ( i ) {
+                Connection * c = i;
+                ++i;
+                if ( c->state() == Connection::Connected &&
+                     !c->hasProperty( Connection::Internal ) &&
+                     !c->hasProperty( Connection::Listens ) )
+                    clients.append( c );
+            }
+            if ( clients.isEmpty() || left <= 1 ) {
+                timer->setRepeating( false );
+                l->stop();
+                return;
+            }
+            uint n = ( clients.count() + left - 1 ) / left;
+            left--;
+            i = clients.first();
+            while ( i && n ) {
+                Connection * c = i;
+                ++i;
+                try {
+                    Scope x( c->log() );
+                    c->react( Connection::Shutdown );
+                    c->setState( Connection::Closing );
+                } catch ( const Exception& e ) {
+                    l->removeConnection( c );
+                }
+                n--;
+            }
+        }
+        uint left;
+        Timer * timer;
+    };
 };
 
 
@@ -84,6 +162,14 @@ public:
     and periodically informs them about any events (e.g., read/write,
     errors, timeouts) that occur. The loop continues until something
     calls stop().
+
+    The EventLoop uses a Poller to find out which Connections are
+    ready. The Poller is created by start(), so that a process which
+    forks after setup() gets its own epoll or kqueue descriptor.
+
+    Each iteration only looks at the Connections the Poller reports
+    ready and those that have been notice()d since the last
+    iteration, so that thousands of idle connections cost nothing.
 */
 
 
@@ -134,10 +220,14 @@ void EventLoop::addConnection( Connection * c )
 
     Scope x( d->log );
 
-    if ( d->connections.find( c ) )
+    if ( c->loopFlags() & Member )
         return;
 
     d->connections.prepend( c );
+    c->setLoopFlags( c->loopFlags() | Member );
+    if ( d->poller )
+        d->poller->remove( c->fd() );
+    notice( c );
     setConnectionCounts();
 }
 
@@ -150,8 +240,14 @@ void EventLoop::removeConnection( Connection * c )
 {
     Scope x( d->log );
 
-    if ( d->connections.remove( c ) == 0 )
+    if ( d->poller )
+        d->poller->remove( c->fd() );
+    if ( c->fd() >= 0 && d->fds.find( c->fd() ) == c )
+        d->fds.remove( c->fd() );
+    if ( !( c->loopFlags() & Member ) )
         return;
+    c->setLoopFlags( c->loopFlags() & ~Member );
+    d->connections.remove( c );
     setConnectionCounts();
 
     // if this is a server, with external connections, and we just
@@ -186,10 +282,49 @@ List< Connection > *EventLoop::connections() const
 
 
 static GraphableNumber * sizeinram = 0;
+static GraphableNumber * timergraph = 0;
+static GraphableNumber * gcpause = 0;
+static GraphableCounter * gccount = 0;
+static GraphableDataSet * gcpausetime = 0;
+static GraphableNumber * gcfreed = 0;
+static GraphableNumber * gclive = 0;
+static GraphableNumber * eternals = 0;
+static GraphableCounter * cacheclears = 0;
+static GraphableNumber * cachebytes = 0;
+static GraphableNumber * bufferbytes = 0;
+static GraphableNumber * sizeclasses[32];
 
 static const uint gcDelay = 30;
 
 
+// returns the number of bytes waiting in the read and write buffers
+// of the connections in l.
+
+static uint bufferedBytes( List<Connection> * l )
+{
+    uint n = 0;
+    List<Connection>::Iterator i( l );
+    while ( i ) {
+        if ( i->readBuffer() )
+            n += i->readBuffer()->size();
+        n += i->writeBufferSize();
+        ++i;
+    }
+    return n;
+}
+
+
+// appends c to l unless it's already queued for dispatch.
+
+static void queue( List<Connection> * l, Connection * c )
+{
+    if ( c->loopFlags() & Queued )
+        return;
+    c->setLoopFlags( c->loopFlags() | Queued );
+    l->append( c );
+}
+
+
 /*! Starts the EventLoop and runs it until stop() is called. */
 
 void EventLoop::start()
@@ -198,7 +333,18 @@ void EventLoop::start()
     time_t gc = time(0);
     bool haveLoggedStartup = false;
 
-    log( "Starting event loop", Log::Debug );
+    if ( !d->poller )
+        d->poller = Poller::create();
+
+    // the new Poller knows nothing, so it has to hear about everyone
+    List< Connection >::Iterator i( d->connections );
+    while ( i ) {
+        notice( i );
+        ++i;
+    }
+
+    log( EString( "Starting event loop using " ) + d->poller->name(),
+         Log::Debug );
 
     while ( !d->stop && !Log::disastersYet() ) {
         if ( !haveLoggedStartup && !inStartup() ) {
@@ -210,72 +356,81 @@ void EventLoop::start()
 
         Connection * c;
 
-        uint timeout = gcDelay;
-        int maxfd = -1;
+        uint timeout = time( 0 ) + gcDelay;
 
-        fd_set r, w;
-        FD_ZERO( &r );
-        FD_ZERO( &w );
+        // Figure out what events the noticed connections want. The
+        // others want what they wanted last time, so neither we nor
+        // the Poller need to look at them. The Poller only talks to
+        // the kernel when the answer changes.
 
-        // Figure out what events each connection wants.
-
-        List< Connection >::Iterator it( d->connections );
+        List< Connection > * noticed = d->noticed;
+        d->noticed = new List< Connection >;
+        List< Connection > writers;
+        List< Connection >::Iterator it( noticed );
         while ( it ) {
             c = it;
             ++it;
+            c->setLoopFlags( c->loopFlags() & ~Noticed );
+            if ( !( c->loopFlags() & Member ) )
+                continue;
 
             int fd = c->fd();
             if ( fd < 0 ) {
                 removeConnection( c );
             }
-            else if ( c->type() == Connection::Listener && inStartup() ) {
+            else {
                 // we don't accept new connections until we've
                 // completed startup
-            }
-            else {
-                if ( fd > maxfd )
-                    maxfd = fd;
-                FD_SET( fd, &r );
-                if ( c->canWrite() ||
-                     c->state() == Connection::Connecting ||
-                     c->state() == Connection::Closing )
-                    FD_SET( fd, &w );
-                if ( c->timeout() > 0 && c->timeout() < timeout )
-                    timeout = c->timeout();
+                bool a = !( c->type() == Connection::Listener &&
+                            inStartup() );
+                bool w = a && ( c->canWrite() ||
+                                c->state() == Connection::Connecting ||
+                                c->state() == Connection::Closing );
+                bool r = a && c->canRead();
+                d->poller->setInterest( fd, r, w );
+                d->fds.insert( fd, c );
+                if ( a && c->timeout() > 0 &&
+                     ( !d->nextTimeout || c->timeout() < d->nextTimeout ) )
+                    d->nextTimeout = c->timeout();
+                // a connection that wants to write is dispatched
+                // whether the Poller says so or not, as before. one
+                // that has paused reading may want to go on at any
+                // time, so we look at it again next time.
+                if ( w )
+                    writers.append( c );
+                if ( w || ( a && !r ) )
+                    notice( c );
             }
         }
 
         // Figure out whether any timers need attention soon
 
-        List< Timer >::Iterator t( d->timers );
-        while ( t ) {
-            if ( t->active() && t->timeout() < timeout )
-                timeout = t->timeout();
-            ++t;
-        }
+        if ( d->nextTimeout && d->nextTimeout < timeout )
+            timeout = d->nextTimeout;
+        timeout = d->timers.nextTimeout( timeout );
 
         // Look for interesting input
 
-        struct timeval tv;
-        tv.tv_sec = timeout - time( 0 );
-        tv.tv_usec = 0;
-
-        if ( tv.tv_sec < 0 )
-            tv.tv_sec = 0;
-        if ( tv.tv_sec > 60 )
-            tv.tv_sec = 60;
+        int sleep = timeout - time( 0 );
+        if ( sleep < 0 )
+            sleep = 0;
+        if ( sleep > 60 )
+            sleep = 60;
 
         // we never ask the OS to sleep shorter than .2 seconds
-        if ( tv.tv_sec < 1 )
-            tv.tv_usec = 200000;
-
-        if ( select( maxfd+1, &r, &w, 0, &tv ) < 0 ) {
-            // r and w are undefined. we clear them, and dispatch()
-            // won't jump to conclusions
-            FD_ZERO( &r );
-            FD_ZERO( &w );
-        }
+        uint ms = sleep * 1000;
+        if ( sleep < 1 )
+            ms = 200;
+
+        // If the last garbage collection left memory unswept, sweep
+        // a little of it now and don't sleep until it's all done.
+        if ( Allocator::sweepIncrementally() )
+            ms = 0;
+
+        d->poller->wait( ms );
         time_t now = time( 0 );
+        struct timeval woke;
+        (void)::gettimeofday( &woke, 0 );
 
         // Graph our size before processing events
         if ( !sizeinram )
@@ -284,34 +439,86 @@ void EventLoop::start()
 
         // Any interesting timers?
 
-        if ( !d->timers.isEmpty() ) {
-            uint now = time( 0 );
-            t = d->timers.first();
-            while ( t ) {
-                Timer * tmp = t;
-                ++t;
-                if ( tmp->active() && tmp->timeout() <= now )
-                    tmp->execute();
+        d->timers.run( time( 0 ) );
+        if ( ::drainSoon ) {
+            ::drainSoon = false;
+            drain( Configuration::scalar( Configuration::DrainTime ) );
+        }
+        if ( ::reloadSoon ) {
+            ::reloadSoon = false;
+            reload();
+        }
+        if ( !timergraph )
+            timergraph = new GraphableNumber( "timers" );
+        timergraph->setValue( d->timers.count() );
+
+        // Dispatch events to the connections that have something to
+        // do: Those the Poller found ready, those that want to write
+        // and those whose timeout has passed. Idle connections are
+        // left alone.
+
+        List< Connection > todo;
+        uint n = 0;
+        while ( n < d->poller->readyCount() ) {
+            int fd = d->poller->ready( n );
+            n++;
+            c = d->fds.find( fd );
+            if ( c && c->fd() == fd )
+                queue( &todo, c );
+        }
+        it = writers.first();
+        while ( it ) {
+            queue( &todo, it );
+            ++it;
+        }
+        if ( d->nextTimeout && (uint)now >= d->nextTimeout ) {
+            // at least one timeout has passed. find all of them, and
+            // the next one that hasn't.
+            d->nextTimeout = 0;
+            it = d->connections.first();
+            while ( it ) {
+                c = it;
+                ++it;
+                uint t = c->timeout();
+                if ( !t ||
+                     ( c->type() == Connection::Listener && inStartup() ) )
+                    continue;
+                if ( (uint)now >= t )
+                    queue( &todo, c );
+                else if ( !d->nextTimeout || t < d->nextTimeout )
+                    d->nextTimeout = t;
             }
         }
 
-        // Figure out what each connection cares about.
-
-        it = d->connections.first();
+        it = todo.first();
         while ( it ) {
             c = it;
             ++it;
+            c->setLoopFlags( c->loopFlags() & ~Queued );
+            if ( !( c->loopFlags() & Member ) )
+                continue;
             int fd = c->fd();
-            if ( fd >= 0 ) {
-                dispatch( c, FD_ISSET( fd, &r ), FD_ISSET( fd, &w ), now );
-                FD_CLR( fd, &r );
-                FD_CLR( fd, &w );
-            }
-            else {
+            if ( fd < 0 ) {
                 removeConnection( c );
+                continue;
             }
+            if ( c->type() == Connection::Listener && inStartup() )
+                continue;
+            bool r = d->poller->readable( fd );
+            bool w = d->poller->writable( fd );
+            dispatch( c, r, w, now );
+            notice( c );
         }
 
+        // If handling the events took a noticeable time, we're busy,
+        // and COMPRESS=DEFLATE may want to use less CPU.
+
+        struct timeval done;
+        (void)::gettimeofday( &done, 0 );
+        long busy = ( done.tv_sec - woke.tv_sec ) * 1000 +
+                    ( done.tv_usec - woke.tv_usec ) / 1000;
+        Buffer::setBusy( busy >= 100 );
+
         // Graph our size after processing all the events too
 
         sizeinram->setValue( Allocator::inUse() + Allocator::allocated() );
@@ -338,6 +545,13 @@ void EventLoop::start()
                     // if memory usage is extreme enough we'll collect
                     // garbage every second.
                     uint factor = a / d->limit;
+                    if ( factor ) {
+                        // what's waiting in connection buffers isn't
+                        // garbage, so collecting sooner because of it
+                        // is pointless.
+                        uint b = bufferedBytes( &d->connections );
+                        factor = ( a > b ? a - b : 0 ) / d->limit;
+                    }
                     uint period = gcDelay >> factor;
                     if ( (uint)(now - gc) > period )
                         ::freeMemorySoon = true;
@@ -365,9 +579,9 @@ void EventLoop::start()
                 c->react( Connection::Shutdown );
             if ( c->state() == Connection::Connected )
                 c->write();
-            if ( c->writeBuffer()->size() > 0 )
+            if ( c->writeBufferSize() > 0 )
                 c->log( "Still have " +
-                        EString::humanNumber( c->writeBuffer()->size() ) +
+                        EString::humanNumber( c->writeBufferSize() ) +
                         " bytes to write", Log::Debug );
         } catch ( const Exception& e ) {
             // we don't really care at this point, do we?
@@ -394,6 +608,53 @@ void EventLoop::freeMemory()
     }
     Garbage * biggest = Allocator::free( &x );
     // x now points to free memory
+    if ( !gcpause ) {
+        gcpause = new GraphableNumber( "gc-pause" );
+        gccount = new GraphableCounter( "gc-runs" );
+        gcpausetime = new GraphableDataSet( "gc-pause-time" );
+        gcfreed = new GraphableNumber( "gc-freed" );
+        gclive = new GraphableNumber( "gc-live" );
+        eternals = new GraphableNumber( "gc-roots" );
+        cacheclears = new GraphableCounter( "cache-clears" );
+        cachebytes = new GraphableNumber( "cache-bytes" );
+        bufferbytes = new GraphableNumber( "buffered-bytes" );
+    }
+    gcpause->setValue( Allocator::pauseTime() / 1000 );
+    gccount->tick();
+    gcpausetime->addNumber( Allocator::pauseTime() );
+    gcfreed->setValue( Allocator::freedBytes() );
+    gclive->setValue( Allocator::survivingBytes() );
+    eternals->setValue( Allocator::eternals() );
+    cacheclears->setValue( Cache::clears() );
+    cachebytes->setValue( Cache::totalCost() );
+    bufferbytes->setValue( bufferedBytes( &d->connections ) );
+
+    // graph the live bytes in each size class, so the statistics
+    // port shows what the memory is used for
+    uint n = 0;
+    while ( n < Allocator::sizeClasses() && n < 32 ) {
+        uint size = Allocator::sizeClass( n );
+        uint live = Allocator::liveBytes( n );
+        if ( !sizeclasses[n] && live ) {
+            if ( size )
+                sizeclasses[n] = new GraphableNumber( "memory-size-" +
+                                                      fn( size ) );
+            else
+                sizeclasses[n] = new GraphableNumber( "memory-large" );
+        }
+        if ( sizeclasses[n] )
+            sizeclasses[n]->setValue( live );
+        n++;
+    }
+
+    if ( ::profileMemorySoon ) {
+        ::profileMemorySoon = false;
+        EStringList::Iterator l( Allocator::profile() );
+        while ( l ) {
+            log( "Heap profile: " + *l, Log::Significant );
+            ++l;
+        }
+    }
     i = d->connections.first();
     Connection * victim = 0;
     while ( i ) {
@@ -413,7 +674,7 @@ void EventLoop::freeMemory()
 
 
 /*! Dispatches events to the connection \a c, based on its current
-    state, the time \a now and the results from select: \a r is true
+    state, the time \a now and the results from the Poller: \a r is true
     if the FD may be read, and \a w is true if we know that the FD may
     be written to. If \a now is past that Connection's timeout, we
     must send a Timeout event.
@@ -433,6 +694,7 @@ void EventLoop::dispatch( Connection * c, bool r, bool w, uint now )
 
     try {
         Scope x( c->log() );
+        EventClock clock( c );
         if ( c->timeout() != 0 && now >= c->timeout() ) {
             c->setTimeout( 0 );
             c->react( Connection::Timeout );
@@ -492,13 +754,13 @@ void EventLoop::dispatch( Connection * c, bool r, bool w, uint now )
             }
         }
 
-        uint s = c->writeBuffer()->size();
+        uint s = c->writeBufferSize();
         c->write();
         // if we're closing anyway, and we can't write any of what we
         // want to write, then just forget the buffered data and go on
         // with the close
         if ( c->state() == Connection::Closing &&
-             s && s == c->writeBuffer()->size() )
+             s && s == c->writeBufferSize() )
             c->writeBuffer()->remove( s );
     }
     catch ( const Exception& e ) {
@@ -564,6 +826,42 @@ void EventLoop::stop( uint s )
 }
 
 
+/*! Instructs this EventLoop to stop accepting new connections, close
+    the external connections gradually during the next \a s seconds,
+    and then stop.
+
+    Listener connections are closed right away. The others get a
+    Shutdown event and are closed a few at a time, so that when a new
+    server listens to the same ports (see use-reuseport), the clients
+    reconnect to it at a steady rate rather than all at once.
+*/
+
+void EventLoop::drain( uint s )
+{
+    if ( d->stop || d->draining )
+        return;
+    d->draining = true;
+    log( "Draining connections during the next " + fn( s ) + " seconds",
+         Log::Significant );
+
+    List<Connection>::Iterator i( d->connections );
+    while ( i ) {
+        Connection * c = i;
+        ++i;
+        try {
+            Scope x( c->log() );
+            if ( c->hasProperty( Connection::Listens ) ) {
+                c->react( Connection::Shutdown );
+                c->close();
+            }
+        } catch ( const Exception& e ) {
+            removeConnection( c );
+        }
+    }
+    (void)new LoopData::Drainer( s );
+}
+
+
 /*! Closes all Connections except \a c1 and \a c2. This helps TlsProxy
     do its work.
 */
@@ -626,6 +924,14 @@ bool EventLoop::inStartup() const
 
 void EventLoop::setStartup( bool p )
 {
+    if ( d->startup && !p ) {
+        // the listeners may accept connections now
+        List< Connection >::Iterator i( d->connections );
+        while ( i ) {
+            notice( i );
+            ++i;
+        }
+    }
     d->startup = p;
 }
 
@@ -660,13 +966,42 @@ void EventLoop::shutdown()
 }
 
 
+/*! Tells the Poller to stop watching \a fd. Connection calls this
+    before it closes \a fd or hands it over to someone else, so that
+    the kernel's interest set doesn't refer to a reused descriptor.
+*/
+
+void EventLoop::stopWatching( int fd )
+{
+    if ( d->poller )
+        d->poller->remove( fd );
+    if ( fd >= 0 )
+        d->fds.remove( fd );
+}
+
+
+/*! Records that \a c may want different events from what it wanted
+    last time, so that the next iteration of start() looks at it
+    again. Connection calls this whenever its state, timeout or write
+    buffer may have changed.
+*/
+
+void EventLoop::notice( Connection * c )
+{
+    if ( !c || ( c->loopFlags() & Noticed ) )
+        return;
+    c->setLoopFlags( c->loopFlags() | Noticed );
+    d->noticed->append( c );
+}
+
+
 /*! Records that \a t exists, so that the event loop will process \a
     t.
 */
 
 void EventLoop::addTimer( Timer * t )
 {
-    d->timers.append( t );
+    d->timers.insert( t );
 }
 
 
@@ -676,9 +1011,7 @@ void EventLoop::addTimer( Timer * t )
 
 void EventLoop::removeTimer( Timer * t )
 {
-    List<Timer>::Iterator i( d->timers.find( t ) );
-    if ( i )
-        d->timers.take( i );
+    d->timers.remove( t );
 }
 
 static GraphableNumber * imapgraph = 0;
@@ -688,6 +1021,7 @@ static GraphableNumber * othergraph = 0;
 static GraphableNumber * internalgraph = 0;
 static GraphableNumber * httpgraph = 0;
 static GraphableNumber * dbgraph = 0;
+static GraphableNumber * clientgraph = 0;
 
 
 
@@ -717,6 +1051,8 @@ void EventLoop::setConnectionCounts()
         case Connection::RecorderClient:
         case Connection::RecorderServer:
         case Connection::Pipe:
+        case Connection::DnsClient:
+        case Connection::ClusterBus:
             internal++;
             break;
         case Connection::DatabaseClient:
@@ -757,6 +1093,9 @@ void EventLoop::setConnectionCounts()
         internalgraph = new GraphableNumber( "internal-connections" );
         httpgraph = new GraphableNumber( "http-connections" );
         dbgraph = new GraphableNumber( "db-connections" );
+        // the IMAP, POP and SMTP connections to this process,
+        // to show how evenly the processes share the load
+        clientgraph = new GraphableNumber( "client-connections" );
     }
     imapgraph->setValue( imap );
     pop3graph->setValue( pop3 );
@@ -765,6 +1104,7 @@ void EventLoop::setConnectionCounts()
     internalgraph->setValue( internal );
     httpgraph->setValue( http );
     dbgraph->setValue( db );
+    clientgraph->setValue( imap + pop3 + smtp );
 }
 
 
@@ -794,6 +1134,59 @@ void EventLoop::freeMemorySoon()
 }
 
 
+/*! Requests the event loop to collect garbage at the earliest
+    opportunity and log a profile of the heap afterwards. Server
+    calls this on SIGUSR2.
+*/
+
+void EventLoop::profileMemorySoon()
+{
+    ::profileMemorySoon = true;
+    ::freeMemorySoon = true;
+}
+
+
+/*! Requests the global event loop to drain() its connections during
+    drain-time seconds at the earliest opportunity. Server calls this
+    on SIGQUIT.
+*/
+
+void EventLoop::drainSoon()
+{
+    ::drainSoon = true;
+}
+
+
+/*! Requests the global event loop to reload() the configuration at
+    the earliest opportunity. Server calls this on SIGHUP.
+*/
+
+void EventLoop::reloadSoon()
+{
+    ::reloadSoon = true;
+}
+
+
+/*! Rereads the configuration file (see Configuration::reread()), and
+    makes the subsystems that keep configuration values to themselves
+    use the new ones: The log level, the TLS certificate, the cache
+    budgets and the memory usage goal.
+*/
+
+void EventLoop::reload()
+{
+    if ( !Configuration::reread() )
+        return;
+
+    LogClient::reconfigure();
+    TlsEngine::reconfigure();
+    Cache::reconfigureAll();
+    if ( d->limit )
+        setMemoryUsage( 1024 * 1024 *
+                        Configuration::scalar( Configuration::MemoryLimit ) );
+}
+
+
 /*! Instructs this event loop to collect garbage when memory usage
     passes \a limit bytes. The default is 0, which means to collect
     garbage even if very little is being used.
@@ -813,3 +1206,195 @@ uint EventLoop::memoryUsage() const
 {
     return d->limit;
 }
+
+
+// the CPU time used by one kind of Connection, or by one EventHandler
+// class, in a counter that holds milliseconds
+
+class CpuAccount
+    : public Garbage
+{
+public:
+    CpuAccount( const EString & n, const EString & metric )
+        : name( n ), counter( new GraphableCounter( metric + "-cpu-time" ) ),
+          usecs( 0 ) {}
+
+    void add( int64 u ) {
+        usecs += u;
+        if ( usecs < 1000 )
+            return;
+        counter->tick( (uint)( usecs / 1000 ) );
+        usecs = usecs % 1000;
+    }
+
+    EString name;
+    GraphableCounter * counter;
+    int64 usecs;
+};
+
+
+static EventClock * innermost = 0;
+static Dict<CpuAccount> * cpuAccounts = 0;
+static GraphableCounter * stalls = 0;
+
+
+static const char * connectionTypeNames[] = {
+    "client", "database", "imap", "log-server", "log-client",
+    "graph-dumper", "smtp", "smtp-client", "pop", "http",
+    "tls-proxy", "tls-client", "recorder-client", "recorder",
+    "egd", "listener", "pipe", "managesieve", "ldap-relay", "dns",
+    "cluster-bus"
+};
+
+
+// returns the CpuAccount for the Connection c or the EventHandler h
+
+static CpuAccount * account( Connection * c, EventHandler * h )
+{
+    if ( !cpuAccounts ) {
+        cpuAccounts = new Dict<CpuAccount>;
+        Allocator::addEternal( cpuAccounts, "CPU time per handler" );
+    }
+
+    const char * key;
+    if ( h )
+        key = typeid( *h ).name();
+    else if ( (uint)c->type() < sizeof( connectionTypeNames ) /
+                                sizeof( connectionTypeNames[0] ) )
+        key = connectionTypeNames[c->type()];
+    else
+        key = "other";
+
+    CpuAccount * a = cpuAccounts->find( key );
+    if ( a )
+        return a;
+
+    if ( h ) {
+        EString n;
+        int status = 0;
+        char * dm = abi::__cxa_demangle( key, 0, 0, &status );
+        if ( dm && !status )
+            n = dm;
+        else
+            n = key;
+        ::free( dm );
+        a = new CpuAccount( "handler " + n, "handler-" + n );
+    }
+    else {
+        a = new CpuAccount( EString( key ) + " connection", key );
+    }
+    cpuAccounts->insert( key, a );
+    return a;
+}
+
+
+/*! \class EventClock eventloop.h
+    The EventClock class measures how long a Connection or an
+    EventHandler keeps the EventLoop busy.
+
+    An EventClock is created on the stack around each call to
+    Connection::react() and EventHandler::execute(). Its destructor
+    adds the CPU time used to a statistic for the Connection::Type or
+    the EventHandler's class, and if the elapsed time exceeds
+    event-loop-stall-time, logs which connection or handler blocked
+    the loop.
+
+    EventClocks nest. Time spent in an inner EventClock, e.g. when a
+    database connection's reaction notifies an IMAP command, is
+    charged to the inner one only.
+*/
+
+
+/*! Starts measuring the time used by \a c. */
+
+EventClock::EventClock( Connection * c )
+    : outer( innermost ), connection( c ), handler( 0 )
+{
+    start();
+}
+
+
+/*! Starts measuring the time used by \a h. */
+
+EventClock::EventClock( EventHandler * h )
+    : outer( innermost ), connection( 0 ), handler( h )
+{
+    start();
+}
+
+
+// returns the current wall clock and thread CPU time in microseconds
+
+static void now( int64 & wall, int64 & cpu )
+{
+    struct timespec ts;
+    (void)::clock_gettime( CLOCK_MONOTONIC, &ts );
+    wall = (int64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    (void)::clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts );
+    cpu = (int64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/*! This private helper records the start time. */
+
+void EventClock::start()
+{
+    innerWall = 0;
+    innerCpu = 0;
+    innermost = this;
+    now( wall, cpu );
+}
+
+
+/*! Charges the time used since construction, less that used by
+    inner EventClocks, and logs a stall if it was too long.
+*/
+
+EventClock::~EventClock()
+{
+    int64 w, c;
+    now( w, c );
+    w -= wall;
+    c -= cpu;
+
+    innermost = outer;
+    if ( outer ) {
+        outer->innerWall += w;
+        outer->innerCpu += c;
+    }
+
+    int64 ownWall = w - innerWall;
+    int64 ownCpu = c - innerCpu;
+    if ( ownCpu < 0 )
+        ownCpu = 0;
+
+    Connection * conn = connection;
+    EventClock * o = outer;
+    while ( !conn && o ) {
+        conn = o->connection;
+        o = o->outer;
+    }
+
+    CpuAccount * a = account( connection, handler );
+    a->add( ownCpu );
+
+    uint limit = Configuration::scalar( Configuration::EventLoopStallTime );
+    if ( !limit || ownWall < (int64)limit * 1000 )
+        return;
+
+    if ( !stalls )
+        stalls = new GraphableCounter( "event-loop-stalls" );
+    stalls->tick();
+
+    EString m( "Event loop stalled for " );
+    m.appendNumber( ( ownWall + 500 ) / 1000 );
+    m.append( "ms (" );
+    m.appendNumber( ( ownCpu + 500 ) / 1000 );
+    m.append( "ms CPU) by " );
+    m.append( a->name );
+    if ( conn ) {
+        m.append( " on " );
+        m.append( conn->description() );
+    }
+    ::log( m, Log::Significant );
+}
@@ -7,6 +7,7 @@
 
 
 class Connection;
+class EventHandler;
 
 
 class EventLoop
@@ -18,11 +19,15 @@ public:
 
     virtual void start();
     virtual void stop( uint = 0 );
+    void drain( uint );
+    void reload();
     virtual void addConnection( Connection * );
     virtual void removeConnection( Connection * );
+    void stopWatching( int );
     void closeAllExcept( Connection *, Connection * );
     void closeAllExceptListeners();
     void flushAll();
+    void notice( Connection * );
 
     void dispatch( Connection *, bool, bool, uint );
 
@@ -37,6 +42,9 @@ public:
     static EventLoop * global();
     static void shutdown();
     static void freeMemorySoon();
+    static void profileMemorySoon();
+    static void drainSoon();
+    static void reloadSoon();
 
     virtual void addTimer( class Timer * );
     virtual void removeTimer( class Timer * );
@@ -55,4 +63,24 @@ private:
 };
 
 
+class EventClock
+{
+public:
+    EventClock( Connection * );
+    EventClock( EventHandler * );
+    ~EventClock();
+
+private:
+    EventClock * outer;
+    Connection * connection;
+    EventHandler * handler;
+    int64 wall;
+    int64 cpu;
+    int64 innerWall;
+    int64 innerCpu;
+
+    void start();
+};
+
+
 #endif
@@ -0,0 +1,528 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "expirer.h"
+
+#include "map.h"
+#include "dict.h"
+#include "list.h"
+#include "query.h"
+#include "mailbox.h"
+#include "selector.h"
+#include "database.h"
+#include "integerset.h"
+#include "estringlist.h"
+#include "transaction.h"
+
+// time
+#include <time.h>
+// UINT_MAX
+#include <limits.h>
+
+
+class ExpiryPolicy
+    : public Garbage
+{
+public:
+    ExpiryPolicy(): id( 0 ), retain( false ), duration( 0 ) {}
+
+    uint id;
+    bool retain;
+    uint duration;
+    EString selector;
+};
+
+
+// a set of mailboxes to which the same policies apply
+
+class ExpiryGroup
+    : public Garbage
+{
+public:
+    ExpiryGroup(): simple( true ), age( 0 ), since( 0 ) {}
+
+    IntegerSet mailboxes;
+    List<Mailbox> mailboxList;
+    List<ExpiryPolicy> policies;
+    bool simple;
+    uint age;
+    uint since;
+};
+
+
+class ExpirerData
+    : public Garbage
+{
+public:
+    ExpirerData()
+        : owner( 0 ), batchSize( 1000 ), since( 0 ), now( 0 ),
+          incremental( false ), done( false ), expired( 0 ),
+          policies( 0 ), groups( 0 ), t( 0 ), insert( 0 )
+    {}
+
+    EventHandler * owner;
+    uint batchSize;
+    uint since;
+    EString sinceFingerprint;
+    uint now;
+    bool incremental;
+    bool done;
+    uint expired;
+    EString error;
+    EString fingerprint;
+
+    Query * policies;
+    List<ExpiryGroup> * groups;
+    Transaction * t;
+    Query * insert;
+};
+
+
+/*! \class Expirer expirer.h
+    The Expirer class moves the messages that the retention policies
+    say should be deleted from mailbox_messages to deleted_messages.
+
+    RetentionSelector builds one Selector covering every policy and
+    every mailbox. That's fine for deciding whether to keep a single
+    message, but evaluating it means looking at every message in the
+    database. Expirer instead works out each mailbox's effective
+    policies once and groups the mailboxes that share them. For a
+    group whose policies have no search conditions, the effective
+    policy is a single cutoff: a message is deleted when it's older
+    than both the shortest delete policy and the longest retain
+    policy. Those groups are expired by internal date, which the
+    m_idate index (see "aox tune database") can answer directly, and
+    which the m_ib block range index narrows down to the oldest part
+    of the messages table even without m_idate. The rare groups with
+    search conditions fall back to a Selector.
+
+    Each group is expired in batches of setBatchSize() messages, one
+    transaction per batch, so that no transaction holds the mailbox
+    locks for long.
+
+    If setSince() says when a previous Expirer last ran with the same
+    policies, only the messages that have become old enough since then
+    are considered, so the cost of each run depends on the number of
+    messages expiring rather than on the number of messages. That's
+    not entirely accurate: a message copied into a mailbox keeps its
+    internal date, so it may be older than the previous run's cutoff
+    without having been considered by it. The owner should
+    occasionally run an Expirer without setSince().
+*/
+
+
+/*! Constructs an Expirer which notifies \a owner when it's done().
+    Nothing happens until execute() is called.
+*/
+
+Expirer::Expirer( EventHandler * owner )
+    : d( new ExpirerData )
+{
+    d->owner = owner;
+    setLog( new Log );
+}
+
+
+/*! Instructs this Expirer to move at most \a n messages per
+    transaction. The default is 1000.
+*/
+
+void Expirer::setBatchSize( uint n )
+{
+    d->batchSize = n ? n : 1;
+}
+
+
+/*! Tells this Expirer that a previous Expirer, whose fingerprint() was
+    \a fingerprint, considered all messages as of \a t (its time()).
+    If the policies are still the same, this Expirer only considers
+    the messages which have become old enough since then.
+*/
+
+void Expirer::setSince( uint t, const EString & fingerprint )
+{
+    d->since = t;
+    d->sinceFingerprint = fingerprint;
+}
+
+
+void Expirer::execute()
+{
+    if ( d->done )
+        return;
+
+    if ( !d->policies ) {
+        d->now = (uint)::time( 0 );
+        d->policies = new Query( "select id, action, mailbox, duration, "
+                                 "selector from retention_policies "
+                                 "order by id", this );
+        d->policies->execute();
+    }
+
+    if ( !d->policies->done() )
+        return;
+
+    if ( !d->groups ) {
+        if ( Mailbox::refreshing() ) {
+            Database::notifyWhenIdle( this );
+            return;
+        }
+        if ( d->policies->failed() ) {
+            d->error = d->policies->error();
+            d->groups = new List<ExpiryGroup>;
+        }
+        else {
+            computeGroups();
+        }
+    }
+
+    while ( d->error.isEmpty() ) {
+        if ( d->t ) {
+            if ( !d->t->done() )
+                return;
+            if ( d->t->failed() ) {
+                d->error = d->t->error();
+                break;
+            }
+            uint n = d->insert->rows();
+            d->expired += n;
+            d->t = 0;
+            d->insert = 0;
+            if ( n < d->batchSize ) {
+                ExpiryGroup * g = d->groups->shift();
+                log( "Expired messages in " +
+                     fn( g->mailboxes.count() ) + " mailboxes; " +
+                     fn( d->expired ) + " so far" );
+            }
+        }
+
+        if ( d->groups->isEmpty() )
+            break;
+
+        startBatch();
+    }
+
+    d->done = true;
+    if ( d->error.isEmpty() )
+        log( "Expired " + fn( d->expired ) + " messages",
+             d->expired ? Log::Significant : Log::Info );
+    else
+        log( "Expiring messages failed: " + d->error, Log::Error );
+    if ( d->owner )
+        d->owner->notify();
+}
+
+
+// adds \a m and its descendants to \a l.
+
+static void addMailboxes( List<Mailbox> * l, Mailbox * m )
+{
+    if ( m->ordinary() && m->id() )
+        l->append( m );
+    List<Mailbox>::Iterator c( m->children() );
+    while ( c ) {
+        addMailboxes( l, c );
+        ++c;
+    }
+}
+
+
+/*! Reads the policies, works out which apply to each mailbox, and
+    groups the mailboxes that share the same policies.
+*/
+
+void Expirer::computeGroups()
+{
+    List<ExpiryPolicy> global;
+    Map< List<ExpiryPolicy> > direct;
+    while ( d->policies->hasResults() ) {
+        Row * r = d->policies->nextRow();
+        ExpiryPolicy * p = new ExpiryPolicy;
+        p->id = r->getInt( "id" );
+        p->retain = r->getEString( "action" ) == "retain";
+        p->duration = r->getInt( "duration" );
+        if ( !r->isNull( "selector" ) )
+            p->selector = r->getEString( "selector" );
+
+        d->fingerprint.append( fn( p->id ) + " " +
+                               r->getEString( "action" ) + " " );
+        if ( r->isNull( "mailbox" ) ) {
+            global.append( p );
+            d->fingerprint.append( "- " );
+        }
+        else {
+            uint m = r->getInt( "mailbox" );
+            List<ExpiryPolicy> * l = direct.find( m );
+            if ( !l ) {
+                l = new List<ExpiryPolicy>;
+                direct.insert( m, l );
+            }
+            l->append( p );
+            d->fingerprint.append( fn( m ) + " " );
+        }
+        d->fingerprint.append( fn( p->duration ) + " " +
+                               p->selector + "\n" );
+    }
+
+    d->incremental = d->since && d->since < d->now &&
+                     d->fingerprint == d->sinceFingerprint;
+
+    d->groups = new List<ExpiryGroup>;
+    Dict<ExpiryGroup> groups;
+
+    List<Mailbox> mailboxes;
+    addMailboxes( &mailboxes, Mailbox::root() );
+    List<Mailbox>::Iterator m( mailboxes );
+    while ( m ) {
+        // the policies on this mailbox and its ancestors, and the
+        // global ones, sorted by id so that the key is canonical
+        List<ExpiryPolicy> all;
+        all.append( &global );
+        Mailbox * a = m;
+        while ( a ) {
+            List<ExpiryPolicy> * l = direct.find( a->id() );
+            if ( l )
+                all.append( l );
+            a = a->parent();
+        }
+
+        EString key;
+        bool deletes = false;
+        Map<ExpiryPolicy> sorted;
+        List<ExpiryPolicy>::Iterator p( all );
+        while ( p ) {
+            sorted.insert( p->id, p );
+            if ( !p->retain )
+                deletes = true;
+            ++p;
+        }
+        if ( deletes ) {
+            Map<ExpiryPolicy>::Iterator s( sorted );
+            while ( s ) {
+                key.appendNumber( s->id );
+                key.append( " " );
+                ++s;
+            }
+            ExpiryGroup * g = groups.find( key );
+            if ( !g ) {
+                g = new ExpiryGroup;
+                Map<ExpiryPolicy>::Iterator s( sorted );
+                while ( s ) {
+                    g->policies.append( s );
+                    ++s;
+                }
+                groups.insert( key, g );
+                d->groups->append( g );
+            }
+            g->mailboxes.add( m->id() );
+            g->mailboxList.append( m );
+        }
+        ++m;
+    }
+
+    // work out the effective cutoff for each group without search
+    // conditions, and drop the groups whose messages are all kept
+    List<ExpiryGroup>::Iterator g( d->groups );
+    while ( g ) {
+        bool forever = false;
+        uint shortestDelete = UINT_MAX;
+        uint longestRetain = 0;
+        List<ExpiryPolicy>::Iterator p( g->policies );
+        while ( p ) {
+            if ( !p->selector.isEmpty() )
+                g->simple = false;
+            else if ( p->retain && !p->duration )
+                forever = true;
+            else if ( p->retain && p->duration > longestRetain )
+                longestRetain = p->duration;
+            else if ( !p->retain && p->duration < shortestDelete )
+                shortestDelete = p->duration;
+            ++p;
+        }
+        if ( g->simple ) {
+            g->age = shortestDelete;
+            if ( longestRetain > g->age )
+                g->age = longestRetain;
+            if ( d->incremental && d->since > g->age * 86400 )
+                g->since = d->since - g->age * 86400;
+        }
+        if ( g->simple && forever )
+            d->groups->take( g );
+        else
+            ++g;
+    }
+}
+
+
+/*! Starts a transaction to expire the next batch of messages in the
+    first group.
+*/
+
+void Expirer::startBatch()
+{
+    ExpiryGroup * g = d->groups->firstElement();
+
+    d->t = new Transaction( this );
+    d->t->enqueue( new Query( "create temporary table expiring ("
+                              "mailbox integer, "
+                              "uid integer )", 0 ) );
+
+    if ( g->simple ) {
+        EString s( "insert into expiring (mailbox,uid) "
+                   "select mm.mailbox, mm.uid "
+                   "from mailbox_messages mm "
+                   "join messages m on (mm.message=m.id) "
+                   "where mm.mailbox=any($1) and m.idate<=$2 " );
+        if ( g->since )
+            s.append( "and m.idate>$4 " );
+        s.append( "limit $3" );
+        d->insert = new Query( s, 0 );
+        d->insert->bind( 1, g->mailboxes );
+        d->insert->bind( 2, d->now - g->age * 86400 );
+        d->insert->bind( 3, d->batchSize );
+        if ( g->since )
+            d->insert->bind( 4, g->since );
+    }
+    else {
+        Selector * s = new Selector( Selector::And );
+        Selector * where = new Selector( Selector::Or );
+        s->add( where );
+        List<Mailbox>::Iterator m( g->mailboxList );
+        while ( m ) {
+            where->add( new Selector( m, false ) );
+            ++m;
+        }
+        Selector * deletes = new Selector( Selector::Or );
+        Selector * retains = new Selector( Selector::Or );
+        List<ExpiryPolicy>::Iterator p( g->policies );
+        while ( p ) {
+            Selector * c = new Selector( Selector::And );
+            if ( !p->selector.isEmpty() )
+                c->add( Selector::fromString( p->selector ) );
+            if ( p->duration )
+                c->add( new Selector( Selector::Age,
+                                      p->retain ? Selector::Smaller
+                                                : Selector::Larger,
+                                      p->duration * 86400 ) );
+            if ( c->children()->isEmpty() )
+                c->add( new Selector( Selector::NoField,
+                                      Selector::All, 0 ) );
+            if ( p->retain )
+                retains->add( c );
+            else
+                deletes->add( c );
+            ++p;
+        }
+        s->add( deletes );
+        if ( !retains->children()->isEmpty() ) {
+            Selector * n = new Selector( Selector::Not );
+            n->add( retains );
+            s->add( n );
+        }
+        s->simplify();
+
+        EStringList wanted;
+        wanted.append( "mailbox" );
+        wanted.append( "uid" );
+        d->insert = s->query( 0, 0, 0, 0, false, &wanted, false );
+        d->insert->setString( "insert into expiring (mailbox,uid) " +
+                              d->insert->string() +
+                              " limit " + fn( d->batchSize ) );
+    }
+    d->t->enqueue( d->insert );
+
+    // lock the mailboxes we'll change. as in aox vacuum, this locks
+    // at least the mailboxes we need, and seldom any others.
+    d->t->enqueue( new Query( "select nextmodseq from mailboxes "
+                              "join expiring on (mailboxes.id=mailbox) "
+                              "order by id "
+                              "for update", 0 ) );
+
+    // insert those messages which still exist into dm. we join
+    // against mm in case something expunged one of them meanwhile.
+    d->t->enqueue( new Query( "insert into deleted_messages "
+                              "(mailbox, uid, message,"
+                              " modseq, deleted_by, reason) "
+                              "select e.mailbox, e.uid, mm.message,"
+                              " m.nextmodseq, null, 'Retention policy' "
+                              "from expiring e "
+                              "join mailbox_messages mm"
+                              " using (mailbox,uid) "
+                              "join mailboxes m on (e.mailbox=m.id)",
+                              0 ) );
+
+    d->t->enqueue( new Query( "update mailboxes "
+                              "set nextmodseq=nextmodseq+1 "
+                              "where id in (select mailbox from expiring)",
+                              0 ) );
+    d->t->enqueue( new Query( "drop table expiring", 0 ) );
+    d->t->enqueueNotification( "mailboxes_updated" );
+    d->t->commit();
+}
+
+
+/*! Returns true if this Expirer has finished, and false if it's still
+    working.
+*/
+
+bool Expirer::done() const
+{
+    return d->done;
+}
+
+
+/*! Returns true if this Expirer failed. The batches committed before
+    the failure stay committed.
+*/
+
+bool Expirer::failed() const
+{
+    return !d->error.isEmpty();
+}
+
+
+/*! Returns the error message if failed(), and an empty string if not.
+*/
+
+EString Expirer::error() const
+{
+    return d->error;
+}
+
+
+/*! Returns the number of messages moved to deleted_messages so far. */
+
+uint Expirer::expired() const
+{
+    return d->expired;
+}
+
+
+/*! Returns the time this Expirer used to decide which messages are old
+    enough, or 0 if it hasn't started yet.
+*/
+
+uint Expirer::time() const
+{
+    return d->now;
+}
+
+
+/*! Returns true if setSince() was used and applied, ie. only recently
+    expired messages were considered, and false if this Expirer
+    considered all messages.
+*/
+
+bool Expirer::incremental() const
+{
+    return d->incremental;
+}
+
+
+/*! Returns a string describing the retention policies this Expirer
+    used, suitable for setSince().
+*/
+
+EString Expirer::fingerprint() const
+{
+    return d->fingerprint;
+}
@@ -0,0 +1,39 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef EXPIRER_H
+#define EXPIRER_H
+
+#include "event.h"
+
+class EString;
+
+
+class Expirer
+    : public EventHandler
+{
+public:
+    Expirer( EventHandler * );
+
+    void setBatchSize( uint );
+    void setSince( uint, const EString & );
+
+    void execute();
+
+    bool done() const;
+    bool failed() const;
+    EString error() const;
+
+    uint expired() const;
+    uint time() const;
+    bool incremental() const;
+    EString fingerprint() const;
+
+private:
+    class ExpirerData * d;
+
+    void computeGroups();
+    void startBatch();
+};
+
+
+#endif
@@ -0,0 +1,323 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "expunger.h"
+
+#include "user.h"
+#include "query.h"
+#include "mailbox.h"
+#include "selector.h"
+#include "integerset.h"
+#include "transaction.h"
+#include "mailboxchange.h"
+
+
+// the largest number of messages removed in one transaction
+static const uint chunkSize = 2048;
+
+
+class ExpungerData
+    : public Garbage
+{
+public:
+    ExpungerData()
+        : mailbox( 0 ), user( 0 ), owner( 0 ),
+          deletedOnly( false ), done( false ), total( 0 ), retained( 0 ),
+          modseq( 0 ), r( 0 ), t( 0 ),
+          findModseq( 0 ), findUids( 0 ), expunge( 0 )
+    {}
+
+    Mailbox * mailbox;
+    User * user;
+    EString reason;
+    EventHandler * owner;
+    bool deletedOnly;
+    bool done;
+    EString error;
+
+    IntegerSet remaining;
+    IntegerSet chunk;
+    IntegerSet marked;
+    IntegerSet expunged;
+    uint total;
+    uint retained;
+
+    int64 modseq;
+    RetentionSelector * r;
+    Transaction * t;
+    Query * findModseq;
+    Query * findUids;
+    Query * expunge;
+};
+
+
+/*! \class Expunger expunger.h
+    The Expunger class removes a set of messages from a mailbox, for
+    both IMAP EXPUNGE and POP QUIT.
+
+    It works through the messages in chunks of at most 2048 UIDs, in
+    one transaction per chunk, so that removing tens of thousands of
+    messages doesn't hold the mailbox's nextmodseq lock (and thereby
+    block every other change to the mailbox) for the whole time. Each
+    chunk locks its rows, moves them to deleted_messages unless the
+    retention policy keeps them, bumps the mailbox's nextmodseq,
+    publishes the change and commits, and progress is logged after
+    each chunk.
+
+    If the process stops or a chunk fails, the chunks that were
+    committed stay expunged and the rest stay in the mailbox.
+*/
+
+
+/*! Constructs an Expunger which will remove \a uids from \a mailbox
+    on behalf of \a user, recording \a reason in deleted_messages, and
+    notify \a owner when it's done. \a user may be null.
+*/
+
+Expunger::Expunger( Mailbox * mailbox, const IntegerSet & uids,
+                    User * user, const EString & reason,
+                    EventHandler * owner )
+    : d( new ExpungerData )
+{
+    d->mailbox = mailbox;
+    d->remaining = uids;
+    d->total = uids.count();
+    d->user = user;
+    d->reason = reason;
+    d->owner = owner;
+}
+
+
+/*! Restricts the Expunger to messages that have the \\Deleted flag
+    when their chunk is processed if \a only is true, as IMAP EXPUNGE
+    requires. The default is false, which removes all the messages
+    regardless of flags.
+
+    If \a only is true, messages the retention policy keeps also lose
+    their \\Deleted flag, so the policy is visible to the user.
+*/
+
+void Expunger::setDeletedOnly( bool only )
+{
+    d->deletedOnly = only;
+}
+
+
+void Expunger::execute()
+{
+    if ( d->done )
+        return;
+
+    if ( !d->r ) {
+        d->r = new RetentionSelector( d->mailbox, this );
+        d->r->execute();
+    }
+
+    if ( !d->r->done() )
+        return;
+
+    while ( true ) {
+        if ( !d->t ) {
+            if ( d->remaining.isEmpty() )
+                break;
+            startChunk();
+        }
+
+        if ( d->findUids ) {
+            while ( d->findUids->hasResults() ) {
+                Row * r = d->findUids->nextRow();
+                d->marked.add( r->getInt( "uid" ) );
+            }
+            if ( d->findModseq->hasResults() ) {
+                Row * r = d->findModseq->nextRow();
+                d->modseq = r->getBigint( "nextmodseq" );
+            }
+            if ( !d->findUids->done() || !d->findModseq->done() )
+                return;
+            d->findUids = 0;
+
+            if ( d->marked.isEmpty() ) {
+                d->t->commit();
+            }
+            else {
+                Selector * s = new Selector;
+                s->add( new Selector( d->marked ) );
+                if ( d->r->retains() ) {
+                    Selector * n = new Selector( Selector::Not );
+                    s->add( n );
+                    n->add( d->r->retains() );
+                }
+                s->simplify();
+
+                EStringList wanted;
+                wanted.append( "mailbox" );
+                wanted.append( "uid" );
+                wanted.append( "message" );
+
+                d->expunge = s->query( d->user, d->mailbox, 0, this,
+                                       false, &wanted, false );
+                int i = d->expunge->string().find( " from " );
+                uint msb = s->placeHolder();
+                uint ub = s->placeHolder();
+                uint rb = s->placeHolder();
+                d->expunge->setString(
+                    "insert into deleted_messages "
+                    "(mailbox,uid,message,modseq,deleted_by,reason) " +
+                    d->expunge->string().mid( 0, i ) +
+                    ", $" + fn( msb ) + ", $" + fn( ub ) +
+                    ", $" + fn( rb ) +
+                    d->expunge->string().mid( i ) );
+                d->expunge->bind( msb, d->modseq );
+                if ( d->user )
+                    d->expunge->bind( ub, d->user->id() );
+                else
+                    d->expunge->bindNull( ub );
+                d->expunge->bind( rb, d->reason );
+                d->t->enqueue( d->expunge );
+                d->t->execute();
+            }
+        }
+
+        if ( d->expunge ) {
+            if ( !d->expunge->done() )
+                return;
+
+            uint rows = d->expunge->rows();
+            if ( rows < d->marked.count() ) {
+                d->retained += d->marked.count() - rows;
+                if ( d->deletedOnly ) {
+                    Query * q = new Query( "update mailbox_messages "
+                                           "set modseq=$1, deleted=false "
+                                           "where mailbox=$2 "
+                                           "and uid=any($3)", 0 );
+                    q->bind( 1, d->modseq );
+                    q->bind( 2, d->mailbox->id() );
+                    q->bind( 3, d->marked );
+                    d->t->enqueue( q );
+                }
+            }
+            Query * q = new Query( "update mailboxes set nextmodseq=$1 "
+                                   "where id=$2", 0 );
+            q->bind( 1, d->modseq + 1 );
+            q->bind( 2, d->mailbox->id() );
+            d->t->enqueue( q );
+            // if some messages are retained, they're changed rather
+            // than expunged, and the others have to ask the database.
+            if ( rows == d->marked.count() )
+                MailboxChange::publish( d->t, d->mailbox,
+                                        MailboxChange::Expunged,
+                                        d->marked, d->modseq );
+            Mailbox::refreshMailboxes( d->t );
+            d->t->commit();
+            d->expunge = 0;
+        }
+
+        if ( !d->t->done() )
+            return;
+
+        if ( d->t->failed() ||
+             d->t->state() == Transaction::RolledBack ) {
+            d->error = d->t->error();
+            log( "Error expunging messages: " + d->error, Log::Error );
+            d->remaining.clear();
+        }
+        else if ( !d->marked.isEmpty() ) {
+            d->expunged.add( d->marked );
+            log( "Expunged " + fn( d->total - d->remaining.count() ) +
+                 " of " + fn( d->total ) + " messages (" +
+                 d->marked.set() + ")" );
+        }
+        d->t = 0;
+    }
+
+    d->done = true;
+    if ( d->owner )
+        d->owner->notify();
+}
+
+
+/*! Starts a transaction to remove the next chunk of messages. */
+
+void Expunger::startChunk()
+{
+    uint n = d->remaining.count();
+    if ( n > chunkSize )
+        n = chunkSize;
+    uint first = d->remaining.smallest();
+    uint last = d->remaining.value( n );
+    IntegerSet range;
+    range.add( first, last );
+    d->chunk = d->remaining.intersection( range );
+    d->remaining.remove( first, last );
+    d->marked.clear();
+
+    d->t = new Transaction( this );
+
+    d->findModseq = new Query( "select nextmodseq from mailboxes "
+                               "where id=$1 for update", this );
+    d->findModseq->bind( 1, d->mailbox->id() );
+    d->t->enqueue( d->findModseq );
+
+    EString s( "select uid from mailbox_messages "
+               "where mailbox=$1 and uid>=$2 and uid<=$3 "
+               "and uid=any($4)" );
+    if ( d->deletedOnly )
+        s.append( " and deleted" );
+    s.append( " order by uid for update" );
+    d->findUids = new Query( s, this );
+    d->findUids->bind( 1, d->mailbox->id() );
+    d->findUids->bind( 2, first );
+    d->findUids->bind( 3, last );
+    d->findUids->bind( 4, d->chunk );
+    d->t->enqueue( d->findUids );
+
+    d->t->execute();
+}
+
+
+/*! Returns true if the Expunger has finished its work, whether or not
+    it succeeded.
+*/
+
+bool Expunger::done() const
+{
+    return d->done;
+}
+
+
+/*! Returns true if a database error stopped the Expunger. Chunks
+    committed before the error remain expunged.
+*/
+
+bool Expunger::failed() const
+{
+    return !d->error.isEmpty();
+}
+
+
+/*! Returns the database error that stopped the Expunger, or an empty
+    string if there wasn't any.
+*/
+
+EString Expunger::error() const
+{
+    return d->error;
+}
+
+
+/*! Returns the UIDs of the messages handled in committed chunks. If
+    retained() is not 0, some of these were kept in the mailbox by
+    the retention policy.
+*/
+
+IntegerSet Expunger::expunged() const
+{
+    return d->expunged;
+}
+
+
+/*! Returns the number of messages the retention policy kept. */
+
+uint Expunger::retained() const
+{
+    return d->retained;
+}
@@ -0,0 +1,39 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef EXPUNGER_H
+#define EXPUNGER_H
+
+#include "event.h"
+
+class IntegerSet;
+class Mailbox;
+class EString;
+class User;
+
+
+class Expunger
+    : public EventHandler
+{
+public:
+    Expunger( Mailbox *, const IntegerSet &, User *,
+              const EString &, EventHandler * );
+
+    void setDeletedOnly( bool );
+
+    void execute();
+
+    bool done() const;
+    bool failed() const;
+    EString error() const;
+
+    IntegerSet expunged() const;
+    uint retained() const;
+
+private:
+    class ExpungerData * d;
+
+    void startChunk();
+};
+
+
+#endif
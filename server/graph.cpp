@@ -4,9 +4,25 @@
 
 #include "allocator.h"
 #include "eventloop.h"
+#include "estringlist.h"
+#include "buffer.h"
+#include "timer.h"
+#include "event.h"
+#include "dict.h"
 #include "list.h"
+#include "log.h"
 
 #include <time.h> // time()
+// mmap
+#include <sys/mman.h>
+// getpid
+#include <unistd.h>
+// kill
+#include <signal.h>
+// memcpy
+#include <string.h>
+// errno
+#include <errno.h>
 
 
 static List<GraphableNumber> * numbers = 0;
@@ -67,8 +83,13 @@ GraphableNumber::GraphableNumber( const EString & name )
 
 void GraphableNumber::clearOldHistory( uint t )
 {
-    if ( d->min < t - 2 * graphableHistorySize )
+    if ( d->min < t - 2 * graphableHistorySize ) {
+        // nothing recent is left, but the number keeps its value
+        uint v = lastValue();
         d->min = t;
+        d->max = t;
+        d->values[t%graphableHistorySize] = v;
+    }
     while ( d->min < t + 1 - graphableHistorySize )
         d->values[d->min++%graphableHistorySize] = 0;
     if ( d->max < d->min )
@@ -193,6 +214,49 @@ EString GraphableNumber::name() const
 }
 
 
+/*! Returns the OpenMetrics name for a number called \a name: "aox_"
+    followed by \a name, with each character other than letters and
+    digits changed to '_'.
+*/
+
+EString GraphableNumber::metricName( const EString & name )
+{
+    EString r( "aox_" );
+    uint i = 0;
+    while ( i < name.length() ) {
+        char c = name[i];
+        if ( ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) ||
+             ( c >= '0' && c <= '9' ) )
+            r.append( c );
+        else
+            r.append( '_' );
+        i++;
+    }
+    return r;
+}
+
+
+/*! Appends this number's current value to \a r, labelled with \a
+    labels, as MetricsServer wants it: one line per sample, each
+    consisting of the metric family and its type, a tab, and the
+    OpenMetrics sample line. GraphableNumber reports a gauge.
+*/
+
+void GraphableNumber::appendMetrics( EString & r,
+                                     const EString & labels ) const
+{
+    EString n = metricName( name() );
+    r.append( n );
+    r.append( " gauge\t" );
+    r.append( n );
+    r.append( "{" );
+    r.append( labels );
+    r.append( "} " );
+    r.appendNumber( lastValue() );
+    r.append( "\n" );
+}
+
+
 /*! \class GraphableCounter graph.h
 
     The GraphableCounter class provides a tick counter; you can tell
@@ -209,44 +273,93 @@ GraphableCounter::GraphableCounter( const EString & name )
 }
 
 
-/*! Increases the counter's value by 1. */
+/*! Increases the counter's value by \a n, 1 by default. */
 
-void GraphableCounter::tick()
+void GraphableCounter::tick( uint n )
 {
-    setValue( lastValue() + 1 );
+    setValue( lastValue() + n );
 }
 
 
+/*! Appends the counter's value to \a r, labelled with \a labels, as
+    an OpenMetrics counter.
+*/
+
+void GraphableCounter::appendMetrics( EString & r,
+                                      const EString & labels ) const
+{
+    EString n = metricName( name() );
+    r.append( n );
+    r.append( " counter\t" );
+    r.append( n );
+    r.append( "_total{" );
+    r.append( labels );
+    r.append( "} " );
+    r.appendNumber( lastValue() );
+    r.append( "\n" );
+}
+
+
+static const uint dataSetSamples = 256;
+
+// the histogram buckets hold numbers up to 1, 2, 4, ... 2^24, and the
+// last one holds everything larger.
+static const uint dataSetBuckets = 26;
+
+
 class GraphableDataSetData
     : public Garbage
 {
 public:
-    GraphableDataSetData(): t( 0 ), n( 0 ) {}
+    GraphableDataSetData()
+        : t( 0 ), s( 0 ), n( 0 ), percentile( 0 ), count( 0 ), sum( 0 ) {
+        setFirstNonPointer( &t );
+        uint i = 0;
+        while ( i < ::dataSetBuckets )
+            buckets[i++] = 0;
+    }
+    // no pointers after this line
     uint t;
     uint s;
     uint n;
+    uint percentile;
+    uint samples[::dataSetSamples];
+    int64 count;
+    int64 sum;
+    int64 buckets[::dataSetBuckets];
 };
 
 
 /*! \class GraphableDataSet graph.h
 
     The GraphableDataSet keeps track of numbers and keeps a record of
-    their past averages.
+    their past averages or percentiles.
 
     The current second is kept in some detail; past seconds are kept
-    as averages only.
+    as averages (or percentiles) only. In addition, a data set that
+    records averages counts all its numbers in a histogram, which
+    MetricsServer reports.
 */
 
 
-/*! Constructs an empty data set named \a name. */
+/*! Constructs an empty data set named \a name. If \a percentile is
+    0, the value recorded for each second is the average of that
+    second's numbers, otherwise it's the given percentile (so 50 is
+    the median and 100 the maximum).
+*/
 
-GraphableDataSet::GraphableDataSet( const EString & name )
-    : GraphableNumber( name )
+GraphableDataSet::GraphableDataSet( const EString & name, uint percentile )
+    : GraphableNumber( name ), d( new GraphableDataSetData )
 {
+    if ( percentile > 100 )
+        percentile = 100;
+    d->percentile = percentile;
 }
 
 
-/*! Adds \a n to this second's numbers. */
+/*! Adds \a n to this second's numbers. Only the first few hundred
+    numbers each second are considered for percentiles.
+*/
 
 void GraphableDataSet::addNumber( uint n )
 {
@@ -256,10 +369,78 @@ void GraphableDataSet::addNumber( uint n )
         d->n = 0;
         d->s = 0;
     }
-    n++;
     d->s += n;
-    if ( d->n )
+    if ( !d->percentile ) {
+        uint b = 0;
+        while ( b < ::dataSetBuckets - 1 && n > ( 1u << b ) )
+            b++;
+        d->buckets[b]++;
+        d->count++;
+        d->sum += n;
+        d->n++;
         setValue( ( d->s + (d->n/2) ) / d->n );
+        return;
+    }
+
+    if ( d->n >= ::dataSetSamples )
+        return;
+
+    // keep this second's samples sorted, so the percentile is a lookup
+    uint i = d->n;
+    while ( i > 0 && d->samples[i-1] > n ) {
+        d->samples[i] = d->samples[i-1];
+        i--;
+    }
+    d->samples[i] = n;
+    d->n++;
+    setValue( d->samples[( d->n - 1 ) * d->percentile / 100] );
+}
+
+
+/*! Appends this data set's histogram to \a r, labelled with \a
+    labels. A data set that records percentiles has no histogram, and
+    is reported as a gauge of the most recent percentile.
+*/
+
+void GraphableDataSet::appendMetrics( EString & r,
+                                      const EString & labels ) const
+{
+    if ( d->percentile ) {
+        GraphableNumber::appendMetrics( r, labels );
+        return;
+    }
+
+    EString n = metricName( name() );
+    EString f = n + " histogram\t" + n;
+    int64 c = 0;
+    uint b = 0;
+    while ( b < ::dataSetBuckets ) {
+        c += d->buckets[b];
+        r.append( f );
+        r.append( "_bucket{" );
+        r.append( labels );
+        r.append( ",le=\"" );
+        if ( b < ::dataSetBuckets - 1 )
+            r.appendNumber( 1 << b );
+        else
+            r.append( "+Inf" );
+        r.append( "\"} " );
+        r.appendNumber( c );
+        r.append( "\n" );
+        b++;
+    }
+    r.append( f );
+    r.append( "_sum{" );
+    r.append( labels );
+    r.append( "} " );
+    r.appendNumber( d->sum );
+    r.append( "\n" );
+    r.append( f );
+    r.append( "_count{" );
+    r.append( labels );
+    r.append( "} " );
+    r.appendNumber( d->count );
+    r.append( "\n" );
 }
 
 
@@ -315,3 +496,285 @@ void GraphDumper::react( Event )
 {
     setState( Closing );
 }
+
+
+// Each process of a multi-process server publishes its metrics in a
+// slot of a shared segment once a second, so that whichever process
+// answers a scrape can report on all of them. As in SharedCache, the
+// sequence number is odd while the slot's owner writes it.
+
+static const uint boardSlotSize = 65536;
+
+struct BoardSlot
+{
+    volatile uint sequence;
+    volatile int pid;
+    uint length;
+    char data[boardSlotSize - 3 * sizeof( uint )];
+};
+
+static const uint boardMaxLength = sizeof( ((BoardSlot *)0)->data );
+
+static BoardSlot * board = 0;
+static uint boardSlots = 0;
+
+
+// returns this process's metrics in the format appendMetrics()
+// produces. if two numbers have the same name, only the first is
+// reported.
+
+static EString snapshot()
+{
+    EString labels( "pid=\"" );
+    labels.appendNumber( (int)getpid() );
+    labels.append( "\"" );
+    EString r;
+    Dict<GraphableNumber> seen;
+    List<GraphableNumber>::Iterator i( numbers );
+    while ( i ) {
+        if ( !seen.contains( i->name() ) ) {
+            seen.insert( i->name(), i );
+            i->appendMetrics( r, labels );
+        }
+        ++i;
+    }
+    return r;
+}
+
+
+static bool alive( int pid )
+{
+    return pid && ( ::kill( pid, 0 ) == 0 || errno != ESRCH );
+}
+
+
+class MetricsPublisher
+    : public EventHandler
+{
+public:
+    MetricsPublisher(): slot( 0 ) {
+        Allocator::addEternal( this, "metrics publisher" );
+        Timer * t = new Timer( this, 1 );
+        t->setRepeating( true );
+    }
+
+    void execute() {
+        int me = getpid();
+        uint i = 0;
+        while ( !slot && i < ::boardSlots ) {
+            BoardSlot * s = &::board[i++];
+            int pid = s->pid;
+            if ( pid == me ||
+                 ( !alive( pid ) &&
+                   __sync_bool_compare_and_swap( &s->pid, pid, me ) ) )
+                slot = s;
+        }
+        if ( !slot )
+            return;
+
+        EString m = snapshot();
+        uint l = m.length();
+        while ( l > boardMaxLength || ( l && m[l-1] != '\n' ) )
+            l--;
+        slot->sequence++;
+        __sync_synchronize();
+        slot->length = l;
+        memcpy( slot->data, m.data(), l );
+        __sync_synchronize();
+        slot->sequence++;
+    }
+
+    BoardSlot * slot;
+};
+
+
+class MetricsServerData
+    : public Garbage
+{
+public:
+    MetricsServerData(): Garbage() {}
+
+    EString request;
+};
+
+
+/*! \class MetricsServer graph.h
+    The MetricsServer class answers HTTP requests for /metrics with
+    the values of all GraphableNumber objects in the OpenMetrics text
+    format.
+
+    Gauges are reported as such, GraphableCounter objects as counters
+    and GraphableDataSet objects as histograms. Each sample is labelled
+    with the pid of the process it comes from. When the server runs
+    several processes, setup() and publish() let each of them report
+    the others' numbers as well, as they were at most a second ago.
+*/
+
+
+/*! Constructs a MetricsServer to answer a request on \a fd. */
+
+MetricsServer::MetricsServer( int fd )
+    : Connection( fd, Connection::HttpServer ), d( new MetricsServerData )
+{
+    EventLoop::global()->addConnection( this );
+    setTimeoutAfter( 10 );
+}
+
+
+void MetricsServer::react( Event e )
+{
+    switch ( e ) {
+    case Read:
+        respond();
+        break;
+    case Connect:
+        break;
+    case Timeout:
+    case Error:
+    case Close:
+    case Shutdown:
+        setState( Closing );
+        break;
+    }
+}
+
+
+/*! Reads the request, and once it's complete, sends the response and
+    closes the connection.
+*/
+
+void MetricsServer::respond()
+{
+    EString * l = readBuffer()->removeLine();
+    while ( l && !l->isEmpty() ) {
+        if ( d->request.isEmpty() )
+            d->request = *l;
+        l = readBuffer()->removeLine();
+    }
+    if ( !l || state() == Closing )
+        return;
+
+    EString method = d->request.section( " ", 1 );
+    EString path = d->request.section( " ", 2 );
+    EString status( "200 OK" );
+    EString type( "application/openmetrics-text; version=1.0.0;"
+                  " charset=utf-8" );
+    EString body;
+    if ( method != "GET" && method != "HEAD" ) {
+        status = "405 Method Not Allowed";
+        type = "text/plain";
+        body = "Only GET is supported\n";
+    }
+    else if ( path != "/metrics" && path != "/" ) {
+        status = "404 Not Found";
+        type = "text/plain";
+        body = "Only /metrics is available\n";
+    }
+    else {
+        // our own numbers, then the others' from the board
+        EStringList snapshots;
+        snapshots.append( snapshot() );
+        int me = getpid();
+        uint i = 0;
+        while ( i < ::boardSlots ) {
+            BoardSlot * s = &::board[i++];
+            int pid = s->pid;
+            if ( pid == me || !alive( pid ) )
+                continue;
+            uint before = s->sequence;
+            __sync_synchronize();
+            EString m;
+            if ( !( before & 1 ) && s->length <= boardMaxLength )
+                m.append( s->data, s->length );
+            __sync_synchronize();
+            if ( s->sequence == before )
+                snapshots.append( m );
+        }
+
+        // group the samples by metric family, as OpenMetrics requires
+        EStringList families;
+        Dict<EString> samples;
+        EStringList::Iterator sn( snapshots );
+        while ( sn ) {
+            EString m = *sn;
+            uint b = 0;
+            while ( b < m.length() ) {
+                int e = m.find( '\n', b );
+                if ( e < 0 )
+                    e = m.length();
+                int t = m.find( '\t', b );
+                if ( t > (int)b && t < e ) {
+                    EString f = m.mid( b, t - b );
+                    EString * s = samples.find( f );
+                    if ( !s ) {
+                        s = new EString;
+                        samples.insert( f, s );
+                        families.append( f );
+                    }
+                    s->append( m.mid( t + 1, e - t - 1 ) );
+                    s->append( "\n" );
+                }
+                b = e + 1;
+            }
+            ++sn;
+        }
+
+        body.reserve( snapshots.count() * 32768 );
+        EStringList::Iterator f( families );
+        while ( f ) {
+            body.append( "# TYPE " );
+            body.append( *f );
+            body.append( "\n" );
+            body.append( *samples.find( *f ) );
+            ++f;
+        }
+        body.append( "# EOF\n" );
+    }
+
+    EString r( "HTTP/1.0 " );
+    r.append( status );
+    r.append( "\r\nContent-Type: " );
+    r.append( type );
+    r.append( "\r\nContent-Length: " );
+    r.appendNumber( body.length() );
+    r.append( "\r\nConnection: close\r\n\r\n" );
+    if ( method != "HEAD" )
+        r.append( body );
+    enqueue( r );
+    setState( Closing );
+}
+
+
+/*! Maps a segment where \a processes processes can publish their
+    metrics. This must be called before the server forks, and only if
+    it will run more than one process.
+*/
+
+void MetricsServer::setup( uint processes )
+{
+    if ( ::board || processes < 2 )
+        return;
+
+    uint size = processes * sizeof( BoardSlot );
+    void * p = ::mmap( 0, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if ( p == MAP_FAILED ) {
+        ::log( "Unable to map the metrics segment. Error code " +
+               fn( errno ), Log::Error );
+        return;
+    }
+
+    ::board = (BoardSlot *)p;
+    ::boardSlots = processes;
+}
+
+
+/*! Starts publishing this process's metrics once a second, if setup()
+    has mapped a segment for that.
+*/
+
+void MetricsServer::publish()
+{
+    if ( ::board )
+        (void)new MetricsPublisher;
+}
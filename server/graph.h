@@ -24,6 +24,10 @@ public:
     uint youngestTime() const;
     uint value( uint );
 
+    virtual void appendMetrics( EString &, const EString & ) const;
+
+    static EString metricName( const EString & );
+
 private:
     class GraphableNumberData * d;
     void clearOldHistory( uint );
@@ -36,7 +40,9 @@ class GraphableCounter
 public:
     GraphableCounter( const EString & );
 
-    void tick();
+    void tick( uint = 1 );
+
+    void appendMetrics( EString &, const EString & ) const;
 };
 
 
@@ -44,10 +50,12 @@ class GraphableDataSet
     : public GraphableNumber
 {
 public:
-    GraphableDataSet( const EString & );
+    GraphableDataSet( const EString &, uint = 0 );
 
     void addNumber( uint );
 
+    void appendMetrics( EString &, const EString & ) const;
+
 private:
     class GraphableDataSetData * d;
 };
@@ -63,4 +71,21 @@ public:
 };
 
 
+class MetricsServer
+    : public Connection
+{
+public:
+    MetricsServer( int );
+
+    void react( Event );
+
+    static void setup( uint );
+    static void publish();
+
+private:
+    class MetricsServerData * d;
+    void respond();
+};
+
+
 #endif
@@ -3,45 +3,15 @@
 #include "integerset.h"
 
 #include "estringlist.h"
+#include "allocator.h"
 #include "map.h"
 
 
 static inline uint bitsSet( uint b )
 {
-    uint r = 0;
-    while ( b ) {
-        switch ( b & 15 ) {
-        case 0:
-            r += 0;
-            break;
-        case 1:
-        case 2:
-        case 4:
-        case 8:
-            r += 1;
-            break;
-        case 3:
-        case 5:
-        case 6:
-        case 9:
-        case 10:
-        case 12:
-            r += 2;
-            break;
-        case 7:
-        case 11:
-        case 13:
-        case 14:
-            r += 3;
-            break;
-        case 15:
-            r += 4;
-            break;
-        }
-        b >>= 4;
-    }
-    return r;
-};
+    // this becomes a single popcnt instruction where the CPU has one
+    return __builtin_popcount( b );
+}
 
 
 static const uint BlockSize = 8192;
@@ -53,7 +23,8 @@ class SetData
     : public Garbage
 {
 public:
-    SetData() {}
+    SetData(): blocks( 0 ), before( 0 ), numBlocks( 0 ), total( 0 ),
+               indexed( false ) {}
 
     class Block
         : public Garbage
@@ -110,6 +81,28 @@ public:
     };
 
     Map<Block> b;
+
+    // A sorted array of the blocks in b, and the number of values in
+    // the blocks before each, built by IntegerSet::recount() and
+    // discarded whenever the set changes.
+    Block ** blocks;
+    uint * before;
+    uint numBlocks;
+    uint total;
+    bool indexed;
+
+    uint find( uint value ) const {
+        uint b = 0;
+        uint e = numBlocks;
+        while ( b + 1 < e ) {
+            uint m = ( b + e ) / 2;
+            if ( blocks[m]->start <= value )
+                b = m;
+            else
+                e = m;
+        }
+        return b;
+    }
 };
 
 
@@ -177,6 +170,7 @@ void IntegerSet::add( uint n1, uint n2 )
         return;
     }
 
+    d->indexed = false;
     uint n = n1;
     uint s = n - (n%BlockSize);
     SetData::Block * b = d->b.find( s );
@@ -208,6 +202,7 @@ void IntegerSet::add( const IntegerSet & set )
         *this = set;
         return;
     }
+    d->indexed = false;
     Map<SetData::Block>::Iterator i( set.d->b );
     while( i ) {
         SetData::Block * b = d->b.find( i->start );
@@ -256,13 +251,7 @@ uint IntegerSet::largest() const
 uint IntegerSet::count() const
 {
     recount();
-    uint c = 0;
-    Map<SetData::Block>::Iterator i( d->b );
-    while ( i ) {
-        c += i->count;
-        ++i;
-    }
-    return c;
+    return d->total;
 }
 
 
@@ -286,15 +275,21 @@ uint IntegerSet::value( uint index ) const
     if ( !index )
         return 0;
     recount();
-    uint c = 0;
-    Map<SetData::Block>::Iterator i( d->b );
-    while ( i && c + i->count < index ) {
-        c += i->count;
-        ++i;
-    }
-    if ( !i )
+    if ( index > d->total )
         return 0;
 
+    uint b = 0;
+    uint e = d->numBlocks;
+    while ( b + 1 < e ) {
+        uint m = ( b + e ) / 2;
+        if ( d->before[m] < index )
+            b = m;
+        else
+            e = m;
+    }
+    SetData::Block * i = d->blocks[b];
+    uint c = d->before[b];
+
     uint bs = bitsSet( i->contents[0] );
     uint n = 0;
     while ( c + bs < index ) {
@@ -323,17 +318,14 @@ uint IntegerSet::value( uint index ) const
 uint IntegerSet::index( uint value ) const
 {
     recount();
-    uint i = 0;
-    Map<SetData::Block>::Iterator b( d->b );
-    while ( b && b->start + BlockSize - 1 < value ) {
-        i += b->count;
-        ++b;
-    }
-    if ( !b )
+    if ( !d->numBlocks )
         return 0;
 
-    if ( b->start > value )
+    uint k = d->find( value );
+    SetData::Block * b = d->blocks[k];
+    if ( b->start > value || b->start + BlockSize - 1 < value )
         return 0;
+    uint i = d->before[k];
 
     uint vi = (value-b->start)/BitsPerUint;
     if ( !(b->contents[vi] & 1 << (value%BitsPerUint)) )
@@ -378,6 +370,7 @@ void IntegerSet::remove( uint value )
     if ( ! ( (b->contents[i/BitsPerUint] & 1 << ( i % BitsPerUint )) ) )
         return;
 
+    d->indexed = false;
     b->contents[i/BitsPerUint] &= ~(1 << ( i % BitsPerUint ) );
     if ( b->count ) {
         b->count--;
@@ -404,6 +397,7 @@ void IntegerSet::remove( uint v1, uint v2 )
 
 void IntegerSet::remove( const IntegerSet & other )
 {
+    d->indexed = false;
     Map<SetData::Block>::Iterator mine( d->b );
     Map<SetData::Block>::Iterator hers( other.d->b );
     while ( mine && hers ) {
@@ -538,6 +532,69 @@ EString IntegerSet::set() const
 }
 
 
+/*! Stores the first and last number of each of the first \a max
+    ranges of consecutive numbers in this set in \a first and \a
+    last, and returns the number of ranges, which may be larger than
+    \a max. Callers can use this to decide whether a range condition
+    is cheaper than a list of numbers.
+
+    \a first and \a last may be null if \a max is 0.
+*/
+
+uint IntegerSet::ranges( uint * first, uint * last, uint max ) const
+{
+    uint r = 0;
+    uint s = 0;
+    uint e = 0;
+
+    Map<SetData::Block>::Iterator it( d->b );
+    while ( it ) {
+        uint v = it->start;
+        uint n = 0;
+        while ( n < ArraySize ) {
+            uint b = it->contents[n];
+            if ( b == ~0u && e && e + 1 == v ) {
+                // the common case: a whole word continuing a range
+                e = v + BitsPerUint - 1;
+            }
+            else if ( b ) {
+                uint j = 0;
+                while ( j < BitsPerUint ) {
+                    if ( b & ( 1 << j ) ) {
+                        if ( e && e + 1 == v + j ) {
+                            e = v + j;
+                        }
+                        else {
+                            if ( e ) {
+                                if ( r < max ) {
+                                    first[r] = s;
+                                    last[r] = e;
+                                }
+                                r++;
+                            }
+                            s = v + j;
+                            e = s;
+                        }
+                    }
+                    j++;
+                }
+            }
+            n++;
+            v += BitsPerUint;
+        }
+        ++it;
+    }
+    if ( e ) {
+        if ( r < max ) {
+            first[r] = s;
+            last[r] = e;
+        }
+        r++;
+    }
+    return r;
+}
+
+
 /*! Returns the contents of this set as a comma-separated list of
     decimal numbers.
 */
@@ -572,11 +629,16 @@ EString IntegerSet::csl() const
 
 
 /*! This private helper ensures that all blocks have an accurate count
-    of set bits, and that no blocks are empty.
+    of set bits, that no blocks are empty, and that the top-level
+    index used by count(), value() and index() is up to date.
 */
 
 void IntegerSet::recount() const
 {
+    if ( d->indexed )
+        return;
+
+    uint n = 0;
     Map<SetData::Block>::Iterator i( d->b );
     while ( i ) {
         SetData::Block * b = i;
@@ -585,7 +647,27 @@ void IntegerSet::recount() const
             b->recount();
         if ( !b->count )
             d->b.remove( b->start );
+        else
+            n++;
+    }
+
+    if ( n > d->numBlocks || n * 4 < d->numBlocks ) {
+        d->blocks = (SetData::Block **)
+                    Allocator::alloc( n * sizeof( SetData::Block * ) );
+        d->before = (uint *)Allocator::alloc( n * sizeof( uint ), 0 );
+    }
+    d->numBlocks = n;
+    d->total = 0;
+    n = 0;
+    Map<SetData::Block>::Iterator j( d->b );
+    while ( j ) {
+        d->blocks[n] = j;
+        d->before[n] = d->total;
+        d->total += j->count;
+        n++;
+        ++j;
     }
+    d->indexed = true;
 }
 
 
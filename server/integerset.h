@@ -28,6 +28,7 @@ public:
 
     EString set() const;
     EString csl() const;
+    uint ranges( uint *, uint *, uint ) const;
 
     void add( uint, uint );
     void add( uint n ) { add( n, n ); }
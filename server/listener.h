@@ -17,13 +17,17 @@ class Listener
     : public Connection
 {
 public:
-    Listener( const Endpoint &e, const EString & s, bool silent = false )
+    Listener( const Endpoint &e, const EString & s, bool silent = false,
+              uint process = 0 )
         : Connection(), svc( s )
     {
         setType( Connection::Listener );
-        if ( listen( e, silent ) >= 0 ) {
+        if ( listen( e, silent, process > 0 ) < 0 )
+            return;
+        if ( process )
+            Server::addListener( this, process );
+        else
             EventLoop::global()->addConnection( this );
-        }
     }
 
     void read() {}
@@ -64,6 +68,16 @@ public:
         bool use4 = Configuration::toggle( Configuration::UseIPv4 );
         bool use6 = Configuration::toggle( Configuration::UseIPv6 );
 
+        // with use-reuseport, each server process gets its own
+        // socket for each address, and the kernel picks a process
+        // for each new connection. even a single process shares its
+        // sockets, so that a new server can listen alongside it
+        // while it drains (see aox restart -g).
+        bool shared = Configuration::toggle( Configuration::UseReusePort );
+        uint processes = 1;
+        if ( shared )
+            processes = Server::processes();
+
         uint c = 0;
         EString a = Configuration::text( address );
         uint p = Configuration::scalar( port );
@@ -104,7 +118,11 @@ public:
                     bool silent = false;
                     if ( any6 && *it == "0.0.0.0" )
                         silent = true;
-                    Listener<T> * l = new Listener<T>( e, svc, silent );
+                    uint process = 0;
+                    if ( shared && e.protocol() != Endpoint::Unix )
+                        process = 1;
+                    Listener<T> * l
+                        = new Listener<T>( e, svc, silent, process );
                     if ( l->state() != Listening ) {
                         delete l;
                         l = 0;
@@ -128,6 +146,15 @@ public:
                         c++;
                         if ( *it == "::" )
                             any6 = true;
+                        while ( process && process < processes ) {
+                            process++;
+                            Listener<T> * o
+                                = new Listener<T>( e, svc, false, process );
+                            if ( o->state() != Listening )
+                                ::log( "Cannot listen for " + svc + " on " +
+                                       *it + " for process " +
+                                       fn( process ), Log::Disaster );
+                        }
                     }
                 }
                 else {
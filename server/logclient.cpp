@@ -14,29 +14,24 @@
 #include <stdio.h>
 // gettimeofday
 #include <sys/time.h>
-// localtime
-#include <time.h>
 // openlog, syslog
 #include <syslog.h>
 
 
-/* This static function returns a nicely-formatted timestamp. */
+// log records are collected into batches of roughly this size. see
+// LogServer::parse() for the format.
+static const uint batchSize = 16384;
 
-static EString time()
+
+// appends the \a bytes least significant bytes of \a n to \a s, most
+// significant first.
+
+static void appendBinary( EString & s, uint n, uint bytes )
 {
-    struct timeval tv;
-    struct timezone tz;
-    if ( ::gettimeofday( &tv, &tz ) < 0 )
-        return "";
-    struct tm * t = localtime( (const time_t *)&tv.tv_sec );
-
-    // yuck.
-    char result[32];
-    sprintf( result, "%04d-%02d-%02d %02d:%02d:%02d.%03d",
-             t->tm_year + 1900, t->tm_mon+1, t->tm_mday,
-             t->tm_hour, t->tm_min, t->tm_sec,
-             (int)tv.tv_usec/1000 );
-    return result;
+    while ( bytes ) {
+        bytes--;
+        s.append( (char)( ( n >> ( 8 * bytes ) ) & 0xff ) );
+    }
 }
 
 
@@ -71,6 +66,7 @@ public:
         case Timeout:
             break;
         case Shutdown:
+            flush();
             if ( state() == Connected )
                 enqueue( "shutdown\r\n" );
             break;
@@ -84,9 +80,37 @@ public:
         }
     }
 
+    // The batch is sent whenever the event loop gives us a chance
+    // to write, so records logged during one pass through the loop
+    // usually share a frame.
+    bool canWrite()
+    {
+        return !batch.isEmpty() || Connection::canWrite();
+    }
+
+    void write()
+    {
+        flush();
+        Connection::write();
+    }
+
+    void flush()
+    {
+        if ( batch.isEmpty() )
+            return;
+        EString f;
+        f.reserve( batch.length() + 5 );
+        f.append( '\001' );
+        appendBinary( f, batch.length(), 4 );
+        f.append( batch );
+        enqueue( f );
+        batch.truncate();
+    }
+
     Endpoint logServer;
     Logger *owner;
     EString name;
+    EString batch;
 };
 
 
@@ -138,16 +162,25 @@ void LogClient::send( const EString &id, Log::Severity s, const EString & m )
     if ( d->state() == Connection::Invalid )
         d->reconnect();
 
-    EString t( id );
-    t.reserve( m.length() + 35 );
-    t.append( " x/" );
-    t.append( Log::severity( s ) );
-    t.append( " " );
-    t.append( time() );
-    t.append( " " );
-    t.append( m.simplified() );
-    t.append( "\r\n" );
-    d->enqueue( t );
+    struct timeval tv;
+    if ( ::gettimeofday( &tv, 0 ) < 0 ) {
+        tv.tv_sec = 0;
+        tv.tv_usec = 0;
+    }
+
+    EString & b = d->batch;
+    if ( b.isEmpty() )
+        b.reserve( batchSize + m.length() );
+    b.append( (char)s );
+    appendBinary( b, tv.tv_sec, 4 );
+    appendBinary( b, tv.tv_usec / 1000, 2 );
+    appendBinary( b, id.length(), 2 );
+    b.append( id );
+    appendBinary( b, m.length(), 4 );
+    b.append( m );
+
+    if ( b.length() >= batchSize || s >= Log::Error )
+        d->write();
 }
 
 
@@ -238,6 +271,16 @@ void LogClient::setup( const EString & n )
         EventLoop::global()->addConnection( client->d );
     }
 
+    reconfigure();
+}
+
+
+/*! Sets the log level according to the log-level variable. Called by
+    setup() and when the configuration has been reread.
+*/
+
+void LogClient::reconfigure()
+{
     Log::Severity ls;
     EString ll( Configuration::text( Configuration::LogLevel ) );
     if ( ll == Log::severity( Log::Disaster ) )
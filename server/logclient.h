@@ -14,6 +14,7 @@ class LogClient
 {
 public:
     static void setup( const EString & );
+    static void reconfigure();
 
     void send( const EString &, Log::Severity, const EString & );
 
@@ -3,7 +3,9 @@
 #include "mailbox.h"
 
 #include "log.h"
-#include "map.h"
+#include "utf.h"
+#include "file.h"
+#include "hashmap.h"
 #include "dict.h"
 #include "user.h"
 #include "query.h"
@@ -19,14 +21,87 @@
 #include "allocator.h"
 #include "integerset.h"
 #include "estringlist.h"
+#include "mailboxview.h"
+#include "mailboxchange.h"
 #include "transaction.h"
+#include "configuration.h"
 
+// time
+#include <time.h>
+// getpid
+#include <unistd.h>
+// rename
+#include <stdio.h>
 
-static Map<Mailbox> * mailboxes = 0;
+
+static HashMap<Mailbox> * mailboxes = 0;
 static UDict<Mailbox> * mailboxesByName = 0;
 static bool wiped = false;
 
 
+// every insert or update of a mailboxes row gives it a new changeseq,
+// so once the tree is loaded, a refresh needs only the rows whose
+// changeseq is higher than any seen. but a transaction takes its
+// changeseq before it commits, so a row with a lower changeseq than
+// one already seen may still appear. we therefore read from the
+// highest changeseq seen by a reader that finished at least
+// changeSeqOverlap seconds ago. changes missed by that are still
+// seen via the per-mailbox notifications.
+
+class ChangeSeqCheckpoint
+    : public Garbage
+{
+public:
+    ChangeSeqCheckpoint( uint t, int64 s ): time( t ), changeSeq( s ) {}
+    uint time;
+    int64 changeSeq;
+};
+
+static List<ChangeSeqCheckpoint> * checkpoints = 0;
+static const uint changeSeqOverlap = 60;
+
+
+static int64 lowestUnseenChangeSeq()
+{
+    if ( !::checkpoints || ::checkpoints->isEmpty() )
+        return 0;
+    uint limit = time( 0 ) - changeSeqOverlap;
+    List<ChangeSeqCheckpoint>::Iterator i( ::checkpoints );
+    ChangeSeqCheckpoint * c = i;
+    ++i;
+    while ( i && i->time <= limit ) {
+        c = i;
+        ++i;
+    }
+    return c->changeSeq;
+}
+
+
+static void addChangeSeqCheckpoint( int64 s )
+{
+    if ( !::checkpoints ) {
+        ::checkpoints = new List<ChangeSeqCheckpoint>;
+        Allocator::addEternal( ::checkpoints, "mailbox changeseq history" );
+    }
+    if ( !::checkpoints->isEmpty() &&
+         ::checkpoints->lastElement()->changeSeq > s )
+        s = ::checkpoints->lastElement()->changeSeq;
+    uint now = time( 0 );
+    ::checkpoints->append( new ChangeSeqCheckpoint( now, s ) );
+
+    // keep only the newest checkpoint that's old enough to be used
+    // and those newer than that
+    uint limit = now - changeSeqOverlap;
+    while ( ::checkpoints->count() > 1 ) {
+        List<ChangeSeqCheckpoint>::Iterator i( ::checkpoints );
+        ++i;
+        if ( i->time > limit )
+            break;
+        ::checkpoints->shift();
+    }
+}
+
+
 class MailboxData
     : public Garbage
 {
@@ -35,7 +110,7 @@ public:
         : type( Mailbox::Ordinary ), id( 0 ),
           uidnext( 0 ), uidvalidity( 0 ), owner( 0 ),
           parent( 0 ), children( 0 ),
-          nextModSeq( 1 )
+          nextModSeq( 1 ), view( 0 )
     {}
 
     UString name;
@@ -52,6 +127,7 @@ public:
     List< Mailbox > * children;
 
     int64 nextModSeq;
+    MailboxView * view;
 };
 
 
@@ -80,8 +156,10 @@ public:
     EventHandler * owner;
     Query * q;
     bool done;
+    bool all;
+    int64 changeSeq;
 
-    MailboxReader( EventHandler * ev, int64 );
+    MailboxReader( EventHandler * ev, const IntegerSet *, int64 = 0 );
     void execute();
 };
 
@@ -89,23 +167,33 @@ public:
 static List<MailboxReader> * readers = 0;
 
 
-MailboxReader::MailboxReader( EventHandler * ev, int64 c )
-    : owner( ev ), q( 0 ), done( false )
+MailboxReader::MailboxReader( EventHandler * ev, const IntegerSet * ids,
+                              int64 since )
+    : owner( ev ), q( 0 ), done( false ), all( !ids ), changeSeq( since )
 {
     if ( !::readers ) {
         ::readers = new List<MailboxReader>;
         Allocator::addEternal( ::readers, "active mailbox readers" );
     }
     ::readers->append( this );
-    q = new Query( "select m.id, m.name, m.deleted, m.owner, "
-                   "m.uidnext, m.nextmodseq, m.uidvalidity, m.flag "
-                   //"m.change " // better: m.change
-                   "from mailboxes m ",
-                   //"where change>=$1"
-                   this );
-    c = c; //query->bind( 1, c );
     if ( !::mailboxes )
         Mailbox::setup();
+    EString s( "select m.id, m.name, m.deleted, m.owner, "
+               "m.uidnext, m.nextmodseq, m.uidvalidity, m.flag, "
+               "m.changeseq "
+               "from mailboxes m" );
+    int64 from = since;
+    if ( !ids && !::wiped )
+        from = lowestUnseenChangeSeq();
+    if ( ids )
+        s.append( " where m.id=any($1)" );
+    else if ( from )
+        s.append( " where m.changeseq>$1" );
+    q = new Query( s, this );
+    if ( ids )
+        q->bind( 1, *ids );
+    else if ( from )
+        q->bind( 1, from );
 }
 
 
@@ -113,6 +201,10 @@ void MailboxReader::execute() {
     while ( q->hasResults() ) {
         Row * r = q->nextRow();
 
+        int64 cs = r->getBigint( "changeseq" );
+        if ( cs > changeSeq )
+            changeSeq = cs;
+
         UString n = r->getUString( "name" );
         uint id = r->getInt( "id" );
         Mailbox * m = ::mailboxes->find( id );
@@ -151,6 +243,8 @@ void MailboxReader::execute() {
     if ( q->transaction() )
         q->transaction()->commit();
     ::readers->remove( this );
+    if ( all && !q->failed() )
+        addChangeSeqCheckpoint( changeSeq );
     ::wiped = false;
     if ( q->failed() && !EventLoop::global()->inShutdown() ) {
         List<Mailbox> * c = Mailbox::root()->children();
@@ -169,13 +263,39 @@ class MailboxesWatcher
     : public EventHandler
 {
 public:
-    MailboxesWatcher(): EventHandler(), t( 0 ), m( 0 ) {
-        (void)new DatabaseSignal( "mailboxes_updated", this );
+    MailboxesWatcher()
+        : EventHandler(), t( 0 ), m( 0 ), s( 0 ), all( false ) {
+        s = new DatabaseSignal( "mailboxes_updated", this );
     }
     void execute() {
         if ( EventLoop::global()->inShutdown() )
             return;
 
+        // the trigger says which mailbox changed and its new modseq,
+        // so we can skip what we already know and read only the rest
+        EStringList * p = s->payloads();
+        if ( !p )
+            all = true;
+        EStringList::Iterator i( p );
+        while ( i && !all ) {
+            bool ok = false;
+            uint id = i->section( " ", 1 ).number( &ok );
+            EString n = i->section( " ", 2 );
+            int64 modseq = 0;
+            uint c = 0;
+            while ( c < n.length() && n[c] >= '0' && n[c] <= '9' )
+                modseq = modseq * 10 + n[c++] - '0';
+            Mailbox * mb = ok ? Mailbox::find( id ) : 0;
+            if ( !ok )
+                all = true;
+            else if ( !mb || mb->nextModSeq() < modseq )
+                changed.add( id );
+            ++i;
+        }
+
+        if ( !all && changed.isEmpty() && !t )
+            return;
+
         if ( !t ) {
             // use a timer to run only one mailboxreader per 2-3
             // seconds.
@@ -192,12 +312,22 @@ public:
         else {
             // time's out, time to work
             t = 0;
-            m = new MailboxReader( 0, 0 );
+            if ( !all && changed.isEmpty() )
+                return;
+            if ( all )
+                m = new MailboxReader( 0, 0 );
+            else
+                m = new MailboxReader( 0, &changed );
             m->q->execute();
+            all = false;
+            changed.clear();
         }
     }
     Timer * t;
     MailboxReader * m;
+    DatabaseSignal * s;
+    IntegerSet changed;
+    bool all;
 };
 
 
@@ -217,6 +347,8 @@ public:
             ::mailboxes->clear();
             ::mailboxesByName->clear();
             ::wiped = true;
+            if ( ::checkpoints )
+                ::checkpoints->clear();
             (void)Mailbox::root();
             mr = new MailboxReader( this, 0 );
             mr->q->execute();
@@ -230,10 +362,240 @@ public:
 };
 
 
+// the mailbox-snapshot file holds one line per mailbox and a first
+// line with the number of mailboxes and the changeseq from which the
+// tree has to be refreshed. the names and flags are base64-encoded,
+// so that every line is a list of words.
+
+static const char * snapshotMagic = "aox-mailbox-snapshot-1";
+
+
+// writes the snapshot a little after startup, when a checkpoint is
+// old enough to be used (see ChangeSeqCheckpoint), and hourly after
+// that.
+
+class SnapshotWriter
+    : public EventHandler
+{
+public:
+    SnapshotWriter(): EventHandler() {
+        setLog( new Log );
+        (void)new Timer( this, changeSeqOverlap + 5 );
+    }
+    void execute();
+};
+
+
+void SnapshotWriter::execute()
+{
+    (void)new Timer( this, 3600 );
+    int64 cs = lowestUnseenChangeSeq();
+    if ( !cs || EventLoop::global()->inShutdown() )
+        return;
+
+    EString body;
+    uint n = 0;
+    HashMap<Mailbox>::Iterator i( ::mailboxes );
+    while ( i ) {
+        Mailbox * m = i;
+        ++i;
+        if ( !m->id() )
+            continue;
+        EString f = m->flag().e64();
+        if ( f.isEmpty() )
+            f = "-";
+        body.appendNumber( m->id() );
+        body.append( m->deleted() ? " 1 " : " 0 " );
+        body.appendNumber( m->owner() );
+        body.append( ' ' );
+        body.appendNumber( m->uidnext() );
+        body.append( ' ' );
+        body.appendNumber( m->nextModSeq() );
+        body.append( ' ' );
+        body.appendNumber( m->uidvalidity() );
+        body.append( ' ' );
+        body.append( f );
+        body.append( ' ' );
+        body.append( m->name().utf8().e64() );
+        body.append( '\n' );
+        n++;
+    }
+
+    // write a new file and rename it, so no reader sees half a file
+    EString name = Configuration::text( Configuration::MailboxSnapshot );
+    EString tmp = name + "." + fn( getpid() );
+    {
+        File f( tmp, File::Write, 0600 );
+        if ( !f.valid() ) {
+            log( "Cannot write mailbox snapshot to " + tmp, Log::Error );
+            return;
+        }
+        f.write( EString( snapshotMagic ) + " " + fn( n ) + " " +
+                 fn( cs ) + "\n" );
+        f.write( body );
+    }
+    if ( ::rename( File::chrooted( tmp ).cstr(),
+                   File::chrooted( name ).cstr() ) < 0 ) {
+        log( "Cannot rename mailbox snapshot " + tmp + " to " + name,
+             Log::Error );
+        File::unlink( File::chrooted( tmp ) );
+        return;
+    }
+    log( "Wrote snapshot of " + fn( n ) + " mailboxes as of changeseq " +
+         fn( cs ), Log::Debug );
+}
+
+
+// reads the snapshot, checks that the mailboxes it names all still
+// exist and that the changeseq hasn't gone backwards (as it would
+// if the database had been recreated), builds the tree from it and
+// then starts a MailboxReader for the rows that have changed since.
+// if anything is wrong, it falls back to reading all the rows.
+
+class SnapshotReader
+    : public EventHandler
+{
+public:
+    struct Entry
+        : public Garbage
+    {
+        Entry()
+            : Garbage(), id( 0 ), owner( 0 ), uidnext( 0 ),
+              uidvalidity( 0 ), nextModSeq( 0 ), deleted( false ) {}
+        uint id;
+        uint owner;
+        uint uidnext;
+        uint uidvalidity;
+        int64 nextModSeq;
+        bool deleted;
+        EString flag;
+        UString name;
+    };
+
+    SnapshotReader( EventHandler *, const EString & );
+    void execute();
+
+    EventHandler * owner;
+    List<Entry> entries;
+    IntegerSet ids;
+    int64 changeSeq;
+    Query * check;
+    MailboxReader * reader;
+};
+
+
+static int64 number64( const EString & s, bool * ok )
+{
+    int64 n = 0;
+    uint i = 0;
+    *ok = !s.isEmpty();
+    while ( i < s.length() && s[i] >= '0' && s[i] <= '9' )
+        n = n * 10 + s[i++] - '0';
+    if ( i < s.length() )
+        *ok = false;
+    return n;
+}
+
+
+SnapshotReader::SnapshotReader( EventHandler * ev, const EString & contents )
+    : EventHandler(), owner( ev ), changeSeq( 0 ), check( 0 ), reader( 0 )
+{
+    EStringList * lines = EStringList::split( '\n', contents );
+    EStringList::Iterator l( lines );
+    if ( !l || l->section( " ", 1 ) != snapshotMagic )
+        return;
+    bool ok = false;
+    uint n = l->section( " ", 2 ).number( &ok );
+    if ( ok )
+        changeSeq = number64( l->section( " ", 3 ), &ok );
+    ++l;
+    Utf8Codec c;
+    while ( ok && l ) {
+        if ( !l->isEmpty() ) {
+            Entry * e = new Entry;
+            bool o[6];
+            e->id = l->section( " ", 1 ).number( &o[0] );
+            e->deleted = l->section( " ", 2 ) == "1";
+            e->owner = l->section( " ", 3 ).number( &o[1] );
+            e->uidnext = l->section( " ", 4 ).number( &o[2] );
+            e->nextModSeq = number64( l->section( " ", 5 ), &o[3] );
+            e->uidvalidity = l->section( " ", 6 ).number( &o[4] );
+            EString f = l->section( " ", 7 );
+            if ( f != "-" )
+                e->flag = f.de64();
+            e->name = c.toUnicode( l->section( " ", 8 ).de64() );
+            o[5] = c.valid() && !e->name.isEmpty();
+            uint i = 0;
+            while ( i < 6 && o[i] )
+                i++;
+            if ( i < 6 || !e->id )
+                ok = false;
+            entries.append( e );
+            ids.add( e->id );
+        }
+        ++l;
+    }
+    if ( !ok || entries.count() != n || ids.count() != n || !changeSeq ) {
+        log( "Ignoring unreadable mailbox snapshot" );
+        entries.clear();
+        return;
+    }
+
+    check = new Query( "select count(*)::integer as n, "
+                       "(select coalesce(max(changeseq),0) "
+                       "from mailboxes) as cs "
+                       "from mailboxes where id=any($1)", this );
+    check->bind( 1, ids );
+}
+
+
+void SnapshotReader::execute()
+{
+    if ( reader )
+        return;
+    if ( !check->done() )
+        return;
+
+    Row * r = check->nextRow();
+    if ( !r || check->failed() ||
+         (uint)r->getInt( "n" ) != entries.count() ||
+         r->getBigint( "cs" ) < changeSeq ) {
+        log( "Mailbox snapshot is out of date, reading all mailboxes" );
+        reader = new MailboxReader( owner, 0 );
+        reader->q->execute();
+        return;
+    }
+
+    List<Entry>::Iterator e( entries );
+    while ( e ) {
+        Mailbox * m = Mailbox::obtain( e->name );
+        m->setId( e->id );
+        ::mailboxes->insert( e->id, m );
+        m->setDeleted( e->deleted );
+        m->setUidvalidity( e->uidvalidity );
+        if ( e->owner )
+            m->setOwner( e->owner );
+        m->setUidnextAndNextModSeq( e->uidnext, e->nextModSeq, 0, false );
+        m->setFlag( e->flag );
+        ++e;
+    }
+    log( "Read " + fn( entries.count() ) + " mailboxes from snapshot, "
+         "refreshing from changeseq " + fn( changeSeq ) );
+    entries.clear();
+
+    reader = new MailboxReader( owner, 0, changeSeq );
+    reader->q->execute();
+}
+
+
 /*! This static function is responsible for building a tree of
     Mailboxes from the contents of the mailboxes table. It expects to
     be called by ::main().
 
+    If mailbox-snapshot is set, the tree is first built from the
+    snapshot file, and only the mailboxes that have changed since
+    it was written are read from the database.
+
     The \a owner (if one is specified) is notified of completion.
 */
 
@@ -241,7 +603,7 @@ void Mailbox::setup( EventHandler * owner )
 {
     ::wiped = true;
 
-    ::mailboxes = new Map<Mailbox>;
+    ::mailboxes = new HashMap<Mailbox>;
     Allocator::addEternal( ::mailboxes, "mailbox tree" );
 
     ::mailboxesByName = new UDict<Mailbox>;
@@ -250,9 +612,22 @@ void Mailbox::setup( EventHandler * owner )
     (void)root();
 
     Scope x( new Log );
-    (new MailboxReader( owner, 0 ))->q->execute();
+    EString snapshot = Configuration::text( Configuration::MailboxSnapshot );
+    SnapshotReader * sr = 0;
+    if ( !snapshot.isEmpty() ) {
+        File f( snapshot );
+        if ( f.valid() )
+            sr = new SnapshotReader( owner, f.contents() );
+    }
+    if ( sr && sr->check )
+        sr->check->execute();
+    else
+        (new MailboxReader( owner, 0 ))->q->execute();
+    if ( !snapshot.isEmpty() )
+        (void)new SnapshotWriter;
 
     (void)new MailboxesWatcher;
+    MailboxChange::setup();
     if ( !Configuration::toggle( Configuration::Security ) )
         (void)new MailboxObliterator;
 }
@@ -553,16 +928,27 @@ void Mailbox::setOwner( uint n )
 
 /*! Atomically sets both uidnext() to \a n and nextModSeq() to \a
     m. Uses subtransactions of \a t for all work needed.
+
+    If \a initialise is true (the default), a SessionInitialiser
+    brings the sessions up to date. MailboxChange::apply() passes
+    false, since it updates the sessions itself.
+
+    Neither value ever decreases, so a MailboxReader that read the
+    row before a MailboxChange arrived can't undo the change.
 */
 
-void Mailbox::setUidnextAndNextModSeq( uint n, int64 m, Transaction * t )
+void Mailbox::setUidnextAndNextModSeq( uint n, int64 m, Transaction * t,
+                                       bool initialise )
 {
     if ( n == d->uidnext && m == d->nextModSeq )
         return;
+    if ( m < d->nextModSeq || n < d->uidnext )
+        return;
     d->uidnext = n;
     d->nextModSeq = m;
 
-    (void)new SessionInitialiser( this, t );
+    if ( initialise )
+        (void)new SessionInitialiser( this, t );
 }
 
 
@@ -640,7 +1026,7 @@ Query * Mailbox::create( Transaction * t, User * owner )
         m = m->parent();
     }
 
-    t->enqueue( new Query( "notify mailboxes_updated", 0 ) );
+    t->enqueueNotification( "mailboxes_updated" );
 
     return q;
 }
@@ -666,7 +1052,7 @@ Query * Mailbox::remove( Transaction * t )
     q->bind( 1, id() );
     t->enqueue( q );
 
-    t->enqueue( new Query( "notify mailboxes_updated", 0 ) );
+    t->enqueueNotification( "mailboxes_updated" );
 
     return q;
 }
@@ -682,7 +1068,7 @@ void Mailbox::refreshMailboxes( class Transaction * t )
     MailboxReader * mr = new MailboxReader( 0, 0 );
     Transaction * s = t->subTransaction( mr );
     s->enqueue( mr->q );
-    s->enqueue( new Query( "notify mailboxes_updated", 0 ) );
+    s->enqueueNotification( "mailboxes_updated" );
     s->execute();
 }
 
@@ -712,6 +1098,18 @@ List<Session> * Mailbox::sessions() const
 }
 
 
+/*! Returns the MailboxView shared by all sessions on this mailbox,
+    creating an empty one if necessary.
+*/
+
+MailboxView * Mailbox::view() const
+{
+    if ( !d->view )
+        d->view = new MailboxView( (Mailbox*)this );
+    return d->view;
+}
+
+
 /*! Returns the value last specified by nextModSeq(), or 1 initially. */
 
 int64 Mailbox::nextModSeq() const
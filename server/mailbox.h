@@ -42,7 +42,8 @@ public:
     void setOwner( uint );
     void setUidvalidity( uint );
     void setDeleted( bool );
-    void setUidnextAndNextModSeq( uint, int64, Transaction * );
+    void setUidnextAndNextModSeq( uint, int64, Transaction *,
+                                  bool = true );
     void setFlag( EString );
 
     Mailbox * parent() const;
@@ -74,6 +75,7 @@ public:
 
     void abortSessions();
     List<class Session> * sessions() const;
+    class MailboxView * view() const;
 
     static bool refreshing();
 
@@ -0,0 +1,458 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "mailboxchange.h"
+
+#include "log.h"
+#include "query.h"
+#include "scope.h"
+#include "event.h"
+#include "graph.h"
+#include "estring.h"
+#include "session.h"
+#include "mailbox.h"
+#include "dbsignal.h"
+#include "eventloop.h"
+#include "estringlist.h"
+#include "mailboxview.h"
+#include "transaction.h"
+
+
+static const char * channel = "mailbox_change";
+static GraphableCounter * applied = 0;
+static GraphableCounter * ignored = 0;
+
+
+class MailboxChangeData
+    : public Garbage
+{
+public:
+    MailboxChangeData()
+        : mailbox( 0 ), kind( MailboxChange::Changed ),
+          modseq( 0 ), uidnext( 0 )
+    {}
+
+    Mailbox * mailbox;
+    MailboxChange::Kind kind;
+    IntegerSet uids;
+    int64 modseq;
+    uint uidnext;
+};
+
+
+/*! \class MailboxChange mailboxchange.h
+    The MailboxChange class describes one committed change to a
+    mailbox, and carries it from the process that made it to all the
+    others.
+
+    The mailboxes_updated notification tells each process only that a
+    mailbox has a new nextmodseq, so each process has to ask the
+    database what changed. The transaction that makes a change knows
+    exactly what it did, so it calls publish() to send a notification
+    on the mailbox_change channel, containing the mailbox, the modseq
+    the change used, the mailbox's new uidnext and which UIDs were
+    added, changed or expunged.
+
+    When the notification arrives, apply() updates the mailbox, its
+    MailboxView and every Session on it directly, so neither
+    MailboxReader nor SessionInitialiser needs to run. This is
+    possible only if everything in the process had seen the change
+    just before this one, i.e. if the mailbox's nextModSeq() equals
+    modSeq(). If not (some change was made without publish(), a
+    notification was too large to send, or a SessionInitialiser is
+    already busy), apply() does nothing and the usual
+    mailboxes_updated processing does the work.
+
+    Changed is used for flag and annotation changes, where a superset
+    of the changed UIDs causes only some redundant FETCH
+    responses. New and Expunged must name exactly the UIDs in
+    question.
+*/
+
+
+/*! Constructs a change of \a kind to \a mailbox, affecting \a uids
+    at modseq \a modseq, after which the mailbox's uidnext is \a
+    uidnext. If \a uidnext is 0, the change doesn't affect uidnext.
+*/
+
+MailboxChange::MailboxChange( Mailbox * mailbox, Kind kind,
+                              const IntegerSet & uids,
+                              int64 modseq, uint uidnext )
+    : d( new MailboxChangeData )
+{
+    d->mailbox = mailbox;
+    d->kind = kind;
+    d->uids = uids;
+    d->modseq = modseq;
+    d->uidnext = uidnext;
+}
+
+
+/*! Returns the mailbox changed, as set by the constructor. */
+
+Mailbox * MailboxChange::mailbox() const
+{
+    return d->mailbox;
+}
+
+
+/*! Returns the kind of change, as set by the constructor. */
+
+MailboxChange::Kind MailboxChange::kind() const
+{
+    return d->kind;
+}
+
+
+/*! Returns the UIDs affected, as set by the constructor. */
+
+IntegerSet MailboxChange::uids() const
+{
+    return d->uids;
+}
+
+
+/*! Returns the modseq used by this change; the mailbox's nextmodseq
+    is one more than this afterwards.
+*/
+
+int64 MailboxChange::modSeq() const
+{
+    return d->modseq;
+}
+
+
+/*! Returns the mailbox's uidnext after this change, or 0 if the
+    change does not affect uidnext.
+*/
+
+uint MailboxChange::uidnext() const
+{
+    return d->uidnext;
+}
+
+
+// this helper gives the first read-write session the \Recent flag
+// for new messages, if no other session (in this or another
+// process) has claimed them already, and then tells all the
+// sessions about the messages. first_recent is read and moved past
+// the new messages in one transaction, so a gap in the UIDs can't
+// make the claim miss.
+
+class RecentClaim
+    : public EventHandler
+{
+public:
+    RecentClaim( MailboxChange * c, List<Session> * s )
+        : change( c ), sessions( s ), t( 0 ), q( 0 ), first( 0 ) {
+        t = new Transaction( this );
+        q = new Query( "select first_recent from mailboxes "
+                       "where id=$1 for update", this );
+        q->bind( 1, c->mailbox()->id() );
+        t->enqueue( q );
+        t->execute();
+    }
+
+    void execute() {
+        if ( !t )
+            return;
+        if ( q ) {
+            if ( !q->done() )
+                return;
+            IntegerSet uids = change->uids();
+            Row * r = q->nextRow();
+            q = 0;
+            if ( r && r->getInt( "first_recent" ) <= uids.largest() ) {
+                first = r->getInt( "first_recent" );
+                Query * u = new Query( "update mailboxes "
+                                       "set first_recent=$2 "
+                                       "where id=$1", this );
+                u->bind( 1, change->mailbox()->id() );
+                u->bind( 2, uids.largest() + 1 );
+                t->enqueue( u );
+            }
+            t->commit();
+        }
+
+        if ( !t->done() )
+            return;
+
+        if ( first && !t->failed() ) {
+            List<Session>::Iterator i( sessions );
+            while ( i && i->readOnly() )
+                ++i;
+            if ( i ) {
+                IntegerSet uids = change->uids();
+                uint n = 1;
+                while ( n <= uids.count() ) {
+                    uint uid = uids.value( n );
+                    if ( uid >= first )
+                        i->addRecent( uid );
+                    n++;
+                }
+            }
+        }
+        t = 0;
+        List<Session>::Iterator i( sessions );
+        while ( i ) {
+            i->emitUpdates( 0 );
+            ++i;
+        }
+    }
+
+    MailboxChange * change;
+    List<Session> * sessions;
+    Transaction * t;
+    Query * q;
+    uint first;
+};
+
+
+/*! Applies this change to mailbox(), its view and its sessions, and
+    asks the sessions to tell their clients. Returns true if that was
+    possible, and false if this change must be learned from the
+    database instead.
+*/
+
+bool MailboxChange::apply()
+{
+    Mailbox * m = d->mailbox;
+    if ( !m || m->deleted() || m->nextModSeq() != d->modseq )
+        return false;
+
+    uint uidnext = d->uidnext;
+    if ( !uidnext )
+        uidnext = m->uidnext();
+    if ( uidnext < m->uidnext() )
+        return false;
+    if ( d->kind == New && ( d->uids.isEmpty() ||
+                             d->uids.smallest() < m->uidnext() ||
+                             d->uids.largest() >= uidnext ) )
+        return false;
+
+    MailboxView * v = m->view();
+    if ( v->initialiser() )
+        return false;
+
+    List<Session> * sessions = m->sessions();
+    if ( sessions ) {
+        if ( v->uidnext() != m->uidnext() ||
+             v->nextModSeq() != m->nextModSeq() )
+            return false;
+        List<Session>::Iterator i( sessions );
+        while ( i ) {
+            if ( i->uidnext() != m->uidnext() ||
+                 i->nextModSeq() != m->nextModSeq() )
+                return false;
+            ++i;
+        }
+    }
+
+    m->setUidnextAndNextModSeq( uidnext, d->modseq + 1, 0, false );
+    if ( !sessions ) {
+        v->reset();
+        return true;
+    }
+
+    if ( d->kind == New ) {
+        uint n = 1;
+        while ( n <= d->uids.count() ) {
+            v->add( d->uids.value( n ) );
+            n++;
+        }
+    }
+    else if ( d->kind == Expunged ) {
+        v->remove( d->uids );
+    }
+    v->advance( uidnext, d->modseq + 1 );
+
+    bool claim = false;
+    List<Session>::Iterator i( sessions );
+    while ( i ) {
+        if ( d->kind == Expunged )
+            i->expunge( d->uids );
+        else
+            i->addUnannounced( d->uids );
+        i->setUidnext( uidnext );
+        i->setNextModSeq( d->modseq + 1 );
+        if ( d->kind == New && !i->readOnly() )
+            claim = true;
+        ++i;
+    }
+
+    if ( claim ) {
+        (void)new RecentClaim( this, sessions );
+        return true;
+    }
+
+    i = sessions->first();
+    while ( i ) {
+        i->emitUpdates( 0 );
+        ++i;
+    }
+    return true;
+}
+
+
+/*! Returns the part of a mailbox_change notification that precedes
+    the UIDs, for a change of \a kind to \a m at \a modseq, leaving
+    uidnext at \a uidnext (or unchanged if \a uidnext is 0).
+
+    Callers that compute the UIDs in SQL can append them to this
+    and use pg_notify() themselves; publish() is simpler otherwise.
+*/
+
+EString MailboxChange::header( Mailbox * m, Kind kind,
+                               int64 modseq, uint uidnext )
+{
+    EString r;
+    r.appendNumber( m->id() );
+    r.append( ' ' );
+    r.append( fn( modseq ) );
+    r.append( ' ' );
+    r.appendNumber( uidnext );
+    switch ( kind ) {
+    case New:
+        r.append( " new " );
+        break;
+    case Changed:
+        r.append( " changed " );
+        break;
+    case Expunged:
+        r.append( " expunged " );
+        break;
+    }
+    return r;
+}
+
+
+/*! Enqueues a notification in \a t, announcing a change of \a kind to
+    \a uids in \a m at \a modseq, after which the mailbox's uidnext is
+    \a uidnext (0 means that the change does not affect uidnext).
+
+    PostgreSQL sends the notification when and if \a t commits. If \a
+    uids is too large to fit in a notification, nothing is sent, and
+    the other processes fall back to asking the database.
+*/
+
+void MailboxChange::publish( Transaction * t, Mailbox * m, Kind kind,
+                             const IntegerSet & uids,
+                             int64 modseq, uint uidnext )
+{
+    if ( !t || !m || uids.isEmpty() )
+        return;
+    EString s = uids.set();
+    // PostgreSQL's limit is 8000 bytes; leave room for the header
+    if ( s.length() > 7900 )
+        return;
+    t->enqueueNotification( channel, header( m, kind, modseq, uidnext ) + s );
+}
+
+
+/*! Parses \a payload, as sent by publish(), and returns a pointer to
+    the change it describes, or a null pointer if \a payload is
+    unparsable or refers to an unknown mailbox.
+*/
+
+MailboxChange * MailboxChange::parse( const EString & payload )
+{
+    EStringList * w = EStringList::split( ' ', payload );
+    if ( w->count() != 5 )
+        return 0;
+
+    EStringList::Iterator i( w );
+    bool ok = true;
+    uint id = i->number( &ok );
+    ++i;
+    int64 modseq = 0;
+    uint c = 0;
+    while ( ok && c < i->length() && (*i)[c] >= '0' && (*i)[c] <= '9' )
+        modseq = modseq * 10 + (*i)[c++] - '0';
+    if ( !c || c < i->length() )
+        ok = false;
+    ++i;
+    uint uidnext = 0;
+    if ( ok )
+        uidnext = i->number( &ok );
+    ++i;
+    Kind kind = Changed;
+    if ( *i == "new" )
+        kind = New;
+    else if ( *i == "expunged" )
+        kind = Expunged;
+    else if ( *i != "changed" )
+        ok = false;
+    ++i;
+
+    IntegerSet uids;
+    const EString & s = *i;
+    c = 0;
+    uint from = 0;
+    while ( ok && c < s.length() ) {
+        uint n = 0;
+        uint b = c;
+        while ( c < s.length() && s[c] >= '0' && s[c] <= '9' )
+            n = n * 10 + s[c++] - '0';
+        if ( c == b || !n ) {
+            ok = false;
+        }
+        else if ( c < s.length() && s[c] == ':' ) {
+            from = n;
+        }
+        else {
+            if ( from )
+                uids.add( from, n );
+            else
+                uids.add( n );
+            from = 0;
+        }
+        c++;
+    }
+
+    Mailbox * m = ok ? Mailbox::find( id ) : 0;
+    if ( !m || uids.isEmpty() )
+        return 0;
+    return new MailboxChange( m, kind, uids, modseq, uidnext );
+}
+
+
+class MailboxChangeWatcher
+    : public EventHandler
+{
+public:
+    MailboxChangeWatcher(): EventHandler(), s( 0 ) {
+        s = new DatabaseSignal( channel, this );
+    }
+    void execute() {
+        if ( EventLoop::global()->inShutdown() )
+            return;
+        EStringList * p = s->payloads();
+        EStringList::Iterator i( p );
+        while ( i ) {
+            MailboxChange * c = MailboxChange::parse( *i );
+            if ( c && c->apply() ) {
+                ::applied->tick();
+            }
+            else {
+                log( "Not applying mailbox change: " + *i, Log::Debug );
+                ::ignored->tick();
+            }
+            ++i;
+        }
+    }
+    DatabaseSignal * s;
+};
+
+
+/*! Starts listening for changes published by other processes. Called
+    by Mailbox::setup().
+*/
+
+void MailboxChange::setup()
+{
+    Scope x( new Log );
+    if ( !::applied ) {
+        ::applied = new GraphableCounter( "mailbox-changes-applied" );
+        ::ignored = new GraphableCounter( "mailbox-changes-ignored" );
+    }
+    (void)new MailboxChangeWatcher;
+}
@@ -0,0 +1,41 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef MAILBOXCHANGE_H
+#define MAILBOXCHANGE_H
+
+#include "integerset.h"
+
+class Transaction;
+class Mailbox;
+class EString;
+
+
+class MailboxChange
+    : public Garbage
+{
+public:
+    enum Kind { New, Changed, Expunged };
+
+    MailboxChange( Mailbox *, Kind, const IntegerSet &, int64, uint );
+
+    Mailbox * mailbox() const;
+    Kind kind() const;
+    IntegerSet uids() const;
+    int64 modSeq() const;
+    uint uidnext() const;
+
+    bool apply();
+
+    static void setup();
+
+    static void publish( Transaction *, Mailbox *, Kind,
+                         const IntegerSet &, int64, uint = 0 );
+    static EString header( Mailbox *, Kind, int64, uint );
+    static MailboxChange * parse( const EString & );
+
+private:
+    class MailboxChangeData * d;
+};
+
+
+#endif
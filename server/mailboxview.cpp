@@ -0,0 +1,167 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "mailboxview.h"
+
+#include "mailbox.h"
+#include "session.h"
+
+
+class MailboxViewData
+    : public Garbage
+{
+public:
+    MailboxViewData()
+        : mailbox( 0 ), initialiser( 0 ), uidnext( 1 ), nextModSeq( 1 )
+    {}
+
+    Mailbox * mailbox;
+    SessionInitialiser * initialiser;
+    IntegerSet messages;
+    IntegerSet expunged;
+    uint uidnext;
+    int64 nextModSeq;
+};
+
+
+/*! \class MailboxView mailboxview.h
+    The MailboxView class keeps what this process knows about the
+    contents of a Mailbox, shared by all the Sessions on it.
+
+    SessionInitialiser updates the view along with the sessions, so
+    that each change to the mailbox is fetched from the database
+    once, however many sessions there are. A new Session starts out
+    with a copy of the view, and if the view is current(), it needs
+    no queries at all. Each Session keeps its own copy of messages()
+    since each client learns about expunges at its own pace, and that
+    copy is what maps between UIDs and MSNs.
+
+    Only one SessionInitialiser without a Transaction runs per
+    mailbox at a time; see initialiser(). When the last session on
+    the mailbox goes away, the next SessionInitialiser calls reset(),
+    since no one keeps the view up to date after that.
+*/
+
+
+/*! Constructs an empty view of \a mailbox. */
+
+MailboxView::MailboxView( Mailbox * mailbox )
+    : d( new MailboxViewData )
+{
+    d->mailbox = mailbox;
+}
+
+
+/*! Returns the mailbox this view describes. */
+
+Mailbox * MailboxView::mailbox() const
+{
+    return d->mailbox;
+}
+
+
+/*! Returns the uidnext value up to which messages() is known to be
+    complete. The initial value is 1.
+*/
+
+uint MailboxView::uidnext() const
+{
+    return d->uidnext;
+}
+
+
+/*! Returns the modseq up to which messages() is known to be
+    complete. The initial value is 1.
+*/
+
+int64 MailboxView::nextModSeq() const
+{
+    return d->nextModSeq;
+}
+
+
+/*! Returns the UIDs of all the messages in the mailbox, as of
+    uidnext() and nextModSeq().
+*/
+
+const IntegerSet & MailboxView::messages() const
+{
+    return d->messages;
+}
+
+
+/*! Returns true if this view knows about everything Mailbox knows
+    about, and false if a SessionInitialiser has work to do.
+*/
+
+bool MailboxView::current() const
+{
+    return d->uidnext >= d->mailbox->uidnext() &&
+        d->nextModSeq >= d->mailbox->nextModSeq();
+}
+
+
+/*! Records that \a uid is in the mailbox, unless it's been expunged
+    already.
+*/
+
+void MailboxView::add( uint uid )
+{
+    if ( !d->expunged.contains( uid ) )
+        d->messages.add( uid );
+}
+
+
+/*! Records that \a uids have been expunged. */
+
+void MailboxView::remove( const IntegerSet & uids )
+{
+    d->messages.remove( uids );
+    d->expunged.add( uids );
+}
+
+
+/*! Records that messages() is complete up to \a uidnext and \a
+    nextModSeq. Neither value ever decreases.
+*/
+
+void MailboxView::advance( uint uidnext, int64 nextModSeq )
+{
+    if ( uidnext > d->uidnext )
+        d->uidnext = uidnext;
+    if ( nextModSeq > d->nextModSeq )
+        d->nextModSeq = nextModSeq;
+}
+
+
+/*! Forgets everything, so that the next SessionInitialiser loads the
+    mailbox from scratch.
+*/
+
+void MailboxView::reset()
+{
+    d->messages.clear();
+    d->expunged.clear();
+    d->uidnext = 1;
+    d->nextModSeq = 1;
+}
+
+
+/*! Returns the SessionInitialiser that's currently updating the
+    sessions on this mailbox without a Transaction, or a null
+    pointer if there isn't one.
+*/
+
+SessionInitialiser * MailboxView::initialiser() const
+{
+    return d->initialiser;
+}
+
+
+/*! Records that \a initialiser is updating the sessions on this
+    mailbox. \a initialiser may be a null pointer.
+*/
+
+void MailboxView::setInitialiser( SessionInitialiser * initialiser )
+{
+    d->initialiser = initialiser;
+}
@@ -0,0 +1,39 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef MAILBOXVIEW_H
+#define MAILBOXVIEW_H
+
+#include "global.h"
+#include "integerset.h"
+
+class SessionInitialiser;
+class Mailbox;
+
+
+class MailboxView
+    : public Garbage
+{
+public:
+    MailboxView( Mailbox * );
+
+    Mailbox * mailbox() const;
+
+    uint uidnext() const;
+    int64 nextModSeq() const;
+    const IntegerSet & messages() const;
+    bool current() const;
+
+    void add( uint );
+    void remove( const IntegerSet & );
+    void advance( uint, int64 );
+    void reset();
+
+    SessionInitialiser * initialiser() const;
+    void setInitialiser( SessionInitialiser * );
+
+private:
+    class MailboxViewData * d;
+};
+
+
+#endif
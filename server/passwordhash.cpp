@@ -0,0 +1,345 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "passwordhash.h"
+
+#include "map.h"
+#include "event.h"
+#include "buffer.h"
+#include "estring.h"
+#include "ustring.h"
+#include "entropy.h"
+#include "allocator.h"
+#include "eventloop.h"
+#include "connection.h"
+#include "configuration.h"
+
+// crypt_r, crypt_gensalt
+#include <crypt.h>
+// write
+#include <unistd.h>
+// socketpair
+#include <sys/socket.h>
+// malloc, free
+#include <stdlib.h>
+// strdup, memcpy, memset
+#include <string.h>
+
+#include <pthread.h>
+
+// OPENSSL_cleanse
+#include <openssl/crypto.h>
+
+
+// Stored secrets starting with this are crypt(3) hashes.
+
+static const char * prefix = "{CRYPT}";
+
+
+// A job is shared between the main thread and a worker, so it's
+// malloced and contains no pointers to collectible memory. The
+// worker sends the job pointer back through a socket when it's done.
+
+struct Job
+{
+    Job * next;
+    uint id;
+    char * key;
+    char * setting;
+    bool matched;
+};
+
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static Job * queue = 0;
+static Job * queueEnd = 0;
+static int results = -1;
+static uint workers = 0;
+static uint lastId = 0;
+static Map<PasswordHash> * pending = 0;
+
+
+// frees j, and clears the cleartext password first so that it
+// doesn't linger in freed memory
+
+static void freeJob( Job * j )
+{
+    if ( j->key )
+        OPENSSL_cleanse( j->key, strlen( j->key ) );
+    ::free( j->key );
+    ::free( j->setting );
+    ::free( j );
+}
+
+
+// compares two NUL-terminated strings in time that depends only on
+// their lengths
+
+static bool same( const char * a, const char * b )
+{
+    uint la = strlen( a );
+    uint lb = strlen( b );
+    uint i = 0;
+    unsigned char diff = la != lb;
+    while ( i < la && i < lb ) {
+        diff |= a[i] ^ b[i];
+        i++;
+    }
+    return !diff;
+}
+
+
+// hashes j->key with j->setting and notes whether the result is the
+// setting, i.e. the stored hash
+
+static void check( Job * j, struct crypt_data * cd )
+{
+    char * h = ::crypt_r( j->key, j->setting, cd );
+    j->matched = h && *h != '*' && same( h, j->setting );
+}
+
+
+static void * worker( void * )
+{
+    struct crypt_data * cd = (struct crypt_data *)::malloc( sizeof( *cd ) );
+    if ( cd )
+        memset( cd, 0, sizeof( *cd ) );
+    while ( cd ) {
+        pthread_mutex_lock( &lock );
+        while ( !queue )
+            pthread_cond_wait( &work, &lock );
+        Job * j = queue;
+        queue = j->next;
+        if ( !queue )
+            queueEnd = 0;
+        pthread_mutex_unlock( &lock );
+
+        check( j, cd );
+        if ( ::write( results, &j, sizeof( j ) ) != sizeof( j ) )
+            break;
+    }
+    return 0;
+}
+
+
+class PasswordHashData
+    : public Garbage
+{
+public:
+    PasswordHashData(): owner( 0 ), done( false ), matched( false ) {}
+
+    EventHandler * owner;
+    bool done;
+    bool matched;
+};
+
+
+// reads finished jobs from the workers and tells their owners
+
+class PasswordHashPipe
+    : public Connection
+{
+public:
+    PasswordHashPipe( int fd )
+        : Connection( fd, Connection::Pipe ) {
+        setState( Connected );
+        EventLoop::global()->addConnection( this );
+    }
+
+    void react( Event e ) {
+        if ( e != Read )
+            return;
+        Buffer * r = readBuffer();
+        while ( r->size() >= sizeof( Job * ) ) {
+            Job * j = 0;
+            EString s = r->string( sizeof( j ) );
+            r->remove( sizeof( j ) );
+            memcpy( &j, s.data(), sizeof( j ) );
+            PasswordHash * h = pending->find( j->id );
+            if ( h ) {
+                pending->remove( j->id );
+                h->d->done = true;
+                h->d->matched = j->matched;
+            }
+            freeJob( j );
+            if ( h && h->d->owner )
+                h->d->owner->execute();
+        }
+    }
+};
+
+
+// starts the workers, if that's possible and hasn't been done yet.
+// this happens when the first hash is checked, and so after the
+// server has forked.
+
+static bool startWorkers()
+{
+    if ( workers )
+        return true;
+    uint n = Configuration::scalar( Configuration::PasswordHashThreads );
+    if ( !n )
+        return false;
+
+    // a socketpair rather than a pipe, since EventLoop::dispatch()
+    // wants sockets
+    int fds[2];
+    if ( ::socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) < 0 )
+        return false;
+    results = fds[1];
+    pending = new Map<PasswordHash>;
+    Allocator::addEternal( pending, "password hashes being checked" );
+    (void)new PasswordHashPipe( fds[0] );
+
+    uint i = 0;
+    while ( i < n ) {
+        pthread_t t;
+        if ( pthread_create( &t, 0, worker, 0 ) == 0 ) {
+            pthread_detach( t );
+            workers++;
+        }
+        i++;
+    }
+    if ( workers )
+        return true;
+    log( "Cannot start password hashing threads; hashing in the main loop",
+         Log::Error );
+    return false;
+}
+
+
+/*! \class PasswordHash passwordhash.h
+    The PasswordHash class checks a password against a stored crypt(3)
+    hash without blocking the EventLoop.
+
+    A stored secret which starts with "{CRYPT}" is a crypt(3) hash,
+    e.g. "{CRYPT}$y$j9T$..." for yescrypt or "{CRYPT}$6$..." for
+    SHA-512, rather than a cleartext password. Such hashes are meant
+    to be slow to compute, so PasswordHash computes them in a small
+    pool of threads (password-hash-threads) and notifies its owner
+    when the result is known. If the pool cannot be used, the hash is
+    checked at once, in the main loop.
+
+    The worker threads never touch collectible memory.
+*/
+
+
+/*! Starts checking whether \a secret matches the hash \a stored, and
+    arranges for \a owner to be notified when done() becomes true. If
+    the result is known at once, done() is true immediately and \a
+    owner isn't notified.
+*/
+
+PasswordHash::PasswordHash( const UString & secret, const UString & stored,
+                            EventHandler * owner )
+    : d( new PasswordHashData )
+{
+    d->owner = owner;
+    if ( !isHash( stored ) ) {
+        d->done = true;
+        return;
+    }
+
+    Job * j = (Job *)::malloc( sizeof( Job ) );
+    if ( !j )
+        die( Memory );
+    j->next = 0;
+    j->id = ++lastId;
+    j->key = ::strdup( secret.utf8().cstr() );
+    j->setting = ::strdup( stored.utf8().mid( strlen( prefix ) ).cstr() );
+    j->matched = false;
+
+    if ( !startWorkers() ) {
+        struct crypt_data * cd =
+            (struct crypt_data *)Allocator::alloc( sizeof( *cd ), 0 );
+        memset( cd, 0, sizeof( *cd ) );
+        check( j, cd );
+        d->done = true;
+        d->matched = j->matched;
+        freeJob( j );
+        return;
+    }
+
+    pending->insert( j->id, this );
+    pthread_mutex_lock( &lock );
+    if ( queueEnd )
+        queueEnd->next = j;
+    else
+        queue = j;
+    queueEnd = j;
+    pthread_cond_signal( &work );
+    pthread_mutex_unlock( &lock );
+}
+
+
+/*! Returns true once the secret has been checked, and false while a
+    worker is still computing the hash.
+*/
+
+bool PasswordHash::done() const
+{
+    return d->done;
+}
+
+
+/*! Returns true if the secret matched the stored hash, and false if it
+    didn't, is not yet known, or the stored secret isn't a hash.
+*/
+
+bool PasswordHash::matched() const
+{
+    return d->matched;
+}
+
+
+/*! Returns true if \a stored is a crypt(3) hash rather than a
+    cleartext password.
+*/
+
+bool PasswordHash::isHash( const UString & stored )
+{
+    return stored.startsWith( prefix );
+}
+
+
+/*! Returns \a secret hashed as configured by password-hash, ready to
+    be stored in the users table, or \a secret itself if password-hash
+    is empty. Returns an empty string if password-hash is set but
+    crypt(3) cannot hash using it, so that the caller can refuse to
+    store the password rather than store it in cleartext.
+
+    This runs in the calling thread, and is meant for aox, not the
+    server.
+*/
+
+UString PasswordHash::hashed( const UString & secret )
+{
+    EString method = Configuration::text( Configuration::PasswordHash );
+    if ( method.isEmpty() )
+        return secret;
+
+    EString setting;
+#ifdef CRYPT_GENSALT_IMPLEMENTS_AUTO_ENTROPY
+    char * s = ::crypt_gensalt( method.cstr(), 0, 0, 0 );
+    if ( s )
+        setting = s;
+#endif
+    if ( setting.isEmpty() ) {
+        // crypt_gensalt is missing or doesn't know the method. we
+        // hope it's one of the $id$salt schemes.
+        EString salt = Entropy::asString( 12 ).e64();
+        salt.replace( "+", "." );
+        setting = method + salt + "$";
+    }
+
+    struct crypt_data * cd =
+        (struct crypt_data *)Allocator::alloc( sizeof( *cd ), 0 );
+    memset( cd, 0, sizeof( *cd ) );
+    char * h = ::crypt_r( secret.utf8().cstr(), setting.cstr(), cd );
+    if ( !h || *h == '*' )
+        return UString();
+    UString r;
+    r.append( prefix );
+    r.append( h );
+    return r;
+}
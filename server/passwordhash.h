@@ -0,0 +1,30 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef PASSWORDHASH_H
+#define PASSWORDHASH_H
+
+#include "global.h"
+
+class UString;
+class EventHandler;
+
+
+class PasswordHash
+    : public Garbage
+{
+public:
+    PasswordHash( const UString &, const UString &, EventHandler * );
+
+    bool done() const;
+    bool matched() const;
+
+    static bool isHash( const UString & );
+    static UString hashed( const UString & );
+
+private:
+    class PasswordHashData * d;
+    friend class PasswordHashPipe;
+};
+
+
+#endif
@@ -4,9 +4,13 @@
 
 #include "integerset.h"
 #include "estringlist.h"
+#include "dbsignal.h"
 #include "mailbox.h"
+#include "cache.h"
 #include "event.h"
+#include "graph.h"
 #include "query.h"
+#include "dict.h"
 #include "user.h"
 
 
@@ -28,12 +32,44 @@ static const char * rightNames[Permissions::NumRights] = {
 };
 
 
+// remembers the rights the permissions table grants each user on
+// each mailbox, until the permissions_updated notification says that
+// the permissions, groups or mailboxes have changed. generation lets
+// execute() discard rights fetched before the most recent
+// notification.
+
+class AclCache
+    : public Cache
+{
+public:
+    class X: public EventHandler {
+    public:
+        X( AclCache * ac ): me( ac ) {
+            (void)new DatabaseSignal( "permissions_updated", this );
+        }
+        void execute() {
+            me->clear();
+        }
+        AclCache * me;
+    };
+    AclCache(): Cache( 10 ), generation( 0 ) {}
+    void clear() { rights.clear(); generation++; }
+    Dict<EString> rights;
+    uint generation;
+};
+
+static AclCache * cache = 0;
+static GraphableCounter * hits = 0;
+static GraphableCounter * misses = 0;
+
+
 class PermissionData
     : public Garbage
 {
 public:
     PermissionData()
-        : ready( false ), mailbox( 0 ), user( 0 ), owner( 0 ), q( 0 )
+        : ready( false ), mailbox( 0 ), user( 0 ), owner( 0 ), q( 0 ),
+          generation( 0 )
     {
         uint i = 0;
         while ( i < Permissions::NumRights )
@@ -46,6 +82,8 @@ public:
     EventHandler * owner;
     bool allowed[ Permissions::NumRights ];
     Query * q;
+    EString key;
+    uint generation;
 };
 
 
@@ -118,6 +156,11 @@ Permissions::Permissions( Mailbox * mailbox, const UString &authid,
     calls execute() to calculate permissions, issuing queries if
     necessary. If any queries are needed, \a handler will be notified
     when the object is ready().
+
+    The rights fetched are remembered per mailbox and user until the
+    permissions_updated notification arrives, so the next Permissions
+    object for the same pair is ready() at once. PermissionsChecker
+    can then answer without waiting.
 */
 
 Permissions::Permissions( Mailbox *mailbox, User *user,
@@ -183,7 +226,28 @@ void Permissions::execute()
             d->allowed[Read] = true;
         }
 
-        // For everyone else, we have to check.
+        // For everyone else, we have to check, unless we did
+        // recently.
+        if ( !::cache ) {
+            ::cache = new AclCache;
+            (void)new AclCache::X( ::cache );
+            ::hits = new GraphableCounter( "acl-cache-hits" );
+            ::misses = new GraphableCounter( "acl-cache-misses" );
+        }
+        d->key = fn( d->mailbox->id() );
+        d->key.append( ' ' );
+        d->key.append( d->user->login().utf8() );
+        EString * cached = ::cache->rights.find( d->key );
+        if ( d->mailbox->id() && cached ) {
+            ::hits->tick();
+            allow( *cached );
+            d->ready = true;
+            d->owner = 0;
+            return;
+        }
+        ::misses->tick();
+        d->generation = ::cache->generation;
+
         d->q = new Query( "select * from permissions "
                           "where mailbox=any($1) and "
                           "(identifier=$2 or"
@@ -226,10 +290,12 @@ void Permissions::execute()
             p.append( r->getEString( "rights" ) );
     }
 
-    if ( p.isEmpty() )
-        allow( "l" );
-    else
-        allow( p.join( "" ) ); // ooooh.
+    EString rights = "l";
+    if ( !p.isEmpty() )
+        rights = p.join( "" ); // ooooh.
+    allow( rights );
+    if ( d->mailbox->id() && d->generation == ::cache->generation )
+        ::cache->rights.insert( d->key, new EString( rights ) );
 
     d->ready = true;
     d->owner->execute();
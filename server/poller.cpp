@@ -0,0 +1,481 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "poller.h"
+
+#include "allocator.h"
+#include "log.h"
+
+// errno
+#include <errno.h>
+// close
+#include <unistd.h>
+// struct timeval, fd_set, select
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+// memset (for FD_* under OpenBSD), memmove
+#include <string.h>
+
+#if defined( __linux__ )
+#define USE_EPOLL
+// epoll_create, epoll_ctl, epoll_wait
+#include <sys/epoll.h>
+#elif defined( __FreeBSD__ ) || defined( __OpenBSD__ ) || \
+      defined( __NetBSD__ ) || defined( __DragonFly__ ) || \
+      defined( __APPLE__ )
+#define USE_KQUEUE
+// kqueue, kevent
+#include <sys/event.h>
+#endif
+
+
+static const uint WantRead = 1;
+static const uint WantWrite = 2;
+static const uint Watched = 4;
+static const uint Readable = 8;
+static const uint Writable = 16;
+
+
+class PollerData
+    : public Garbage
+{
+public:
+    PollerData()
+        : state( 0 ), ready( 0 ), size( 0 ), nready( 0 ), max( -1 ) {
+        setFirstNonPointer( &size );
+    }
+
+    unsigned char * state;
+    int * ready;
+    // no pointers after this line
+    uint size;
+    uint nready;
+    int max;
+
+    void grow( int fd ) {
+        if ( (uint)fd < size )
+            return;
+        uint n = size;
+        if ( n < 1024 )
+            n = 1024;
+        while ( n <= (uint)fd )
+            n *= 2;
+        unsigned char * s = (unsigned char*)Allocator::alloc( n, 0 );
+        int * r = (int*)Allocator::alloc( n * sizeof( int ), 0 );
+        memset( s, 0, n );
+        if ( size ) {
+            memmove( s, state, size );
+            memmove( r, ready, nready * sizeof( int ) );
+        }
+        state = s;
+        ready = r;
+        size = n;
+    }
+};
+
+
+/*! \class Poller poller.h
+    The Poller class tells the EventLoop which file descriptors are
+    ready for reading or writing.
+
+    EventLoop tells its Poller which file descriptors it cares about
+    using setInterest() and remove(), then calls wait() to sleep until
+    something happens. Afterwards, readyCount() and ready() list the
+    file descriptors that are ready, and readable() and writable()
+    describe what happened to each.
+
+    Poller itself only keeps track of the interest set. The
+    subclasses talk to the operating system: One uses epoll on Linux,
+    one kqueue on the BSDs, and one select() everywhere else. The
+    epoll and kqueue variants keep the interest set in the kernel, so
+    their cost depends on the number of active file descriptors
+    rather than the number of connections, and they are not limited
+    by FD_SETSIZE.
+
+    create() picks the best variant available.
+*/
+
+
+/*! Constructs a Poller which isn't interested in any file
+    descriptors.
+*/
+
+Poller::Poller()
+    : Garbage(), d( new PollerData )
+{
+}
+
+
+/*! Exists only to avoid compiler warnings. */
+
+Poller::~Poller()
+{
+}
+
+
+/*! Records that the caller wants to know when \a fd is readable (if
+    \a r is true) and/or writable (if \a w is true). Does nothing
+    unless that is a change from the last call for \a fd, so it's
+    cheap to call this for every Connection in each loop iteration.
+*/
+
+void Poller::setInterest( int fd, bool r, bool w )
+{
+    if ( fd < 0 )
+        return;
+    d->grow( fd );
+    uint s = d->state[fd];
+    uint n = Watched;
+    if ( r )
+        n |= WantRead;
+    if ( w )
+        n |= WantWrite;
+    if ( ( s & ( Watched|WantRead|WantWrite ) ) == n )
+        return;
+    if ( !watch( fd, r, w, !( s & Watched ) ) )
+        return;
+    d->state[fd] = ( s & ( Readable|Writable ) ) | n;
+    if ( fd > d->max )
+        d->max = fd;
+}
+
+
+/*! Forgets all interest in \a fd. This must be called before \a fd
+    is closed or reused by another Connection.
+*/
+
+void Poller::remove( int fd )
+{
+    if ( fd < 0 || (uint)fd >= d->size || !( d->state[fd] & Watched ) )
+        return;
+    unwatch( fd );
+    d->state[fd] = 0;
+}
+
+
+/*! \fn void Poller::wait( uint ms )
+
+    Implemented by subclasses to wait for at most \a ms milliseconds
+    until at least one file descriptor becomes ready, and call
+    setReady() for each file descriptor that did.
+*/
+
+
+/*! \fn bool Poller::watch( int fd, bool r, bool w, bool n )
+
+    Implemented by subclasses to tell the operating system about the
+    interest in \a fd: \a r is true if reading is interesting and \a w
+    if writing is. \a n is true if \a fd is new to this Poller.
+    Returns true if successful and false if not.
+*/
+
+
+/*! \fn void Poller::unwatch( int fd )
+
+    Implemented by subclasses to tell the operating system that \a fd
+    no longer is of interest.
+*/
+
+
+/*! Returns true if the last wait() found \a fd to be readable, or
+    found that an error condition exists on \a fd.
+*/
+
+bool Poller::readable( int fd ) const
+{
+    if ( fd < 0 || (uint)fd >= d->size )
+        return false;
+    return d->state[fd] & Readable;
+}
+
+
+/*! Returns true if the last wait() found \a fd to be writable. */
+
+bool Poller::writable( int fd ) const
+{
+    if ( fd < 0 || (uint)fd >= d->size )
+        return false;
+    return d->state[fd] & Writable;
+}
+
+
+/*! Returns the number of file descriptors the last wait() found
+    ready.
+*/
+
+uint Poller::readyCount() const
+{
+    return d->nready;
+}
+
+
+/*! Returns the \a i'th file descriptor the last wait() found ready,
+    counting from 0, or -1 if \a i is at least readyCount().
+*/
+
+int Poller::ready( uint i ) const
+{
+    if ( i >= d->nready )
+        return -1;
+    return d->ready[i];
+}
+
+
+/*! Records that \a fd is readable (if \a r is true) and/or writable
+    (if \a w is true). Subclasses call this from wait().
+*/
+
+void Poller::setReady( int fd, bool r, bool w )
+{
+    if ( fd < 0 || (uint)fd >= d->size || ( !r && !w ) )
+        return;
+    if ( !( d->state[fd] & ( Readable|Writable ) ) )
+        d->ready[d->nready++] = fd;
+    if ( r )
+        d->state[fd] |= Readable;
+    if ( w )
+        d->state[fd] |= Writable;
+}
+
+
+/*! Forgets the results of the last wait(). Subclasses call this at
+    the start of wait(). The cost is proportional to the number of
+    file descriptors that were ready, not to the number watched.
+*/
+
+void Poller::clearReady()
+{
+    while ( d->nready ) {
+        int fd = d->ready[--d->nready];
+        d->state[fd] &= ~( Readable|Writable );
+    }
+}
+
+
+/*! Returns true if the caller wants to know when \a fd is readable. */
+
+bool Poller::wantsRead( int fd ) const
+{
+    if ( fd < 0 || (uint)fd >= d->size )
+        return false;
+    return d->state[fd] & WantRead;
+}
+
+
+/*! Returns true if the caller wants to know when \a fd is writable. */
+
+bool Poller::wantsWrite( int fd ) const
+{
+    if ( fd < 0 || (uint)fd >= d->size )
+        return false;
+    return d->state[fd] & WantWrite;
+}
+
+
+/*! Returns the largest file descriptor ever watched by this Poller,
+    or -1 if none has been watched.
+*/
+
+int Poller::maxFd() const
+{
+    return d->max;
+}
+
+
+class SelectPoller
+    : public Poller
+{
+public:
+    const char * name() const { return "select"; }
+
+    bool watch( int fd, bool, bool, bool ) {
+        if ( fd < FD_SETSIZE )
+            return true;
+        ::log( "Cannot watch fd " + fn( fd ) + " using select()",
+               Log::Error );
+        return false;
+    }
+
+    void unwatch( int ) {}
+
+    void wait( uint ms ) {
+        clearReady();
+
+        fd_set r, w;
+        FD_ZERO( &r );
+        FD_ZERO( &w );
+        int max = maxFd();
+        if ( max >= FD_SETSIZE )
+            max = FD_SETSIZE - 1;
+        int fd = 0;
+        while ( fd <= max ) {
+            if ( wantsRead( fd ) )
+                FD_SET( fd, &r );
+            if ( wantsWrite( fd ) )
+                FD_SET( fd, &w );
+            fd++;
+        }
+
+        struct timeval tv;
+        tv.tv_sec = ms / 1000;
+        tv.tv_usec = ( ms % 1000 ) * 1000;
+        if ( ::select( max+1, &r, &w, 0, &tv ) <= 0 )
+            return;
+
+        fd = 0;
+        while ( fd <= max ) {
+            setReady( fd, FD_ISSET( fd, &r ), FD_ISSET( fd, &w ) );
+            fd++;
+        }
+    }
+};
+
+
+#if defined( USE_EPOLL )
+
+static const int epollSize = 1024;
+static struct epoll_event epollEvents[epollSize];
+
+
+class EpollPoller
+    : public Poller
+{
+public:
+    EpollPoller( int f ): epfd( f ) {}
+
+    const char * name() const { return "epoll"; }
+
+    bool watch( int fd, bool r, bool w, bool n ) {
+        struct epoll_event e;
+        memset( &e, 0, sizeof( e ) );
+        e.data.fd = fd;
+        if ( r )
+            e.events |= EPOLLIN;
+        if ( w )
+            e.events |= EPOLLOUT;
+        int op = n ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        int result = ::epoll_ctl( epfd, op, fd, &e );
+        if ( result < 0 && op == EPOLL_CTL_ADD && errno == EEXIST )
+            result = ::epoll_ctl( epfd, EPOLL_CTL_MOD, fd, &e );
+        else if ( result < 0 && op == EPOLL_CTL_MOD && errno == ENOENT )
+            result = ::epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &e );
+        return result >= 0;
+    }
+
+    void unwatch( int fd ) {
+        // the event is ignored, but linux before 2.6.9 insists on it
+        struct epoll_event e;
+        memset( &e, 0, sizeof( e ) );
+        (void)::epoll_ctl( epfd, EPOLL_CTL_DEL, fd, &e );
+    }
+
+    void wait( uint ms ) {
+        clearReady();
+        int n = ::epoll_wait( epfd, epollEvents, epollSize, ms );
+        int i = 0;
+        while ( i < n ) {
+            uint ev = epollEvents[i].events;
+            bool bad = ev & ( EPOLLERR | EPOLLHUP );
+            setReady( epollEvents[i].data.fd,
+                      bad || ( ev & EPOLLIN ), bad || ( ev & EPOLLOUT ) );
+            i++;
+        }
+    }
+
+private:
+    int epfd;
+};
+
+#endif
+
+
+#if defined( USE_KQUEUE )
+
+static const int kqueueSize = 1024;
+static struct kevent kqueueEvents[kqueueSize];
+
+
+class KqueuePoller
+    : public Poller
+{
+public:
+    KqueuePoller( int f ): kq( f ) {}
+
+    const char * name() const { return "kqueue"; }
+
+    bool watch( int fd, bool r, bool w, bool n ) {
+        struct kevent c[2];
+        int i = 0;
+        if ( r != ( !n && wantsRead( fd ) ) ) {
+            EV_SET( &c[i], fd, EVFILT_READ, r ? EV_ADD : EV_DELETE,
+                    0, 0, 0 );
+            i++;
+        }
+        if ( w != ( !n && wantsWrite( fd ) ) ) {
+            EV_SET( &c[i], fd, EVFILT_WRITE, w ? EV_ADD : EV_DELETE,
+                    0, 0, 0 );
+            i++;
+        }
+        if ( !i )
+            return true;
+        return ::kevent( kq, c, i, 0, 0, 0 ) >= 0 || errno == ENOENT;
+    }
+
+    void unwatch( int fd ) {
+        struct kevent c[2];
+        EV_SET( &c[0], fd, EVFILT_READ, EV_DELETE, 0, 0, 0 );
+        EV_SET( &c[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, 0 );
+        (void)::kevent( kq, c, 1, 0, 0, 0 );
+        (void)::kevent( kq, c+1, 1, 0, 0, 0 );
+    }
+
+    void wait( uint ms ) {
+        clearReady();
+        struct timespec ts;
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = ( ms % 1000 ) * 1000000;
+        int n = ::kevent( kq, 0, 0, kqueueEvents, kqueueSize, &ts );
+        int i = 0;
+        while ( i < n ) {
+            struct kevent * e = &kqueueEvents[i];
+            bool bad = e->flags & ( EV_EOF | EV_ERROR );
+            setReady( (int)e->ident,
+                      bad || e->filter == EVFILT_READ,
+                      bad || e->filter == EVFILT_WRITE );
+            i++;
+        }
+    }
+
+private:
+    int kq;
+};
+
+#endif
+
+
+/*! Returns a new Poller using the best mechanism available: epoll on
+    Linux, kqueue on the BSDs and OS X, and select() if neither is
+    available or the kernel refuses to provide it.
+
+    The Poller must be created in the process that uses it, since
+    epoll and kqueue descriptors don't survive fork() intact.
+*/
+
+Poller * Poller::create()
+{
+#if defined( USE_EPOLL )
+    int epfd = ::epoll_create( 1024 );
+    if ( epfd >= 0 )
+        return new EpollPoller( epfd );
+    ::log( "Cannot use epoll, falling back to select(). Error code " +
+           fn( errno ), Log::Info );
+#endif
+#if defined( USE_KQUEUE )
+    int kq = ::kqueue();
+    if ( kq >= 0 )
+        return new KqueuePoller( kq );
+    ::log( "Cannot use kqueue, falling back to select(). Error code " +
+           fn( errno ), Log::Info );
+#endif
+    return new SelectPoller;
+}
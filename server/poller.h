@@ -0,0 +1,46 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef POLLER_H
+#define POLLER_H
+
+#include "global.h"
+
+
+class Poller
+    : public Garbage
+{
+public:
+    Poller();
+    virtual ~Poller();
+
+    static Poller * create();
+
+    virtual const char * name() const = 0;
+
+    void setInterest( int, bool, bool );
+    void remove( int );
+
+    virtual void wait( uint ) = 0;
+
+    bool readable( int ) const;
+    bool writable( int ) const;
+
+    uint readyCount() const;
+    int ready( uint ) const;
+
+protected:
+    virtual bool watch( int, bool, bool, bool ) = 0;
+    virtual void unwatch( int ) = 0;
+
+    void setReady( int, bool, bool );
+    void clearReady();
+    bool wantsRead( int ) const;
+    bool wantsWrite( int ) const;
+    int maxFd() const;
+
+private:
+    class PollerData * d;
+};
+
+
+#endif
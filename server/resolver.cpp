@@ -6,6 +6,7 @@
 #include <resolv.h>
 #include <netdb.h>
 #include <errno.h>
+#include <time.h>
 
 #if !defined( T_AAAA )
 // OS X defines T_AAAA in nameser_compat.h
@@ -15,6 +16,7 @@
 #include "resolver.h"
 
 #include "dict.h"
+#include "dnsquery.h"
 #include "endpoint.h"
 #include "allocator.h"
 #include "configuration.h"
@@ -28,7 +30,16 @@ public:
     Dict<EStringList> names;
     EString reply;
     EString host;
-    bool bad;
+
+    class Exchangers
+        : public Garbage
+    {
+    public:
+        Exchangers(): expires( 0 ) {}
+        EStringList hosts;
+        uint expires;
+    };
+    Dict<Exchangers> exchangers;
 };
 
 
@@ -38,9 +49,10 @@ public:
     until the process exits. It does not consider the TTLs on the DNS
     results.
 
-    The only public functions are resolve(), which does a cache lookup
+    The main public functions are resolve(), which does a cache lookup
     and failing that, a DNS lookup, and errors(), which returns a list
-    of all errors seen so far. A server can ensure that it calls
+    of all errors seen so far. mx() looks up mail exchangers, and
+    forgets them again when their TTL expires. A server can ensure that it calls
     resolve() at startup time for all required names, and if errors()
     remains empty, all is well and remains well until the end of the
     process.
@@ -103,8 +115,13 @@ EStringList Resolver::resolve( const EString & name )
         results->append( name );
     }
     else if ( !r->d->host.isEmpty() ) {
-        // it's a domain name. we use res_search() since getnameinfo()
-        // had such bad karma when we tried it.
+        // it's a domain name. perhaps a DnsQuery has looked it up
+        // lately.
+        EStringList * c = DnsQuery::cached( r->d->host, DnsQuery::Address );
+        if ( c && !c->isEmpty() )
+            return *c;
+        // if not, we use res_search() since getnameinfo() had such bad
+        // karma when we tried it.
         if ( use6 )
             r->query( T_AAAA, results );
         if ( use4 )
@@ -117,6 +134,70 @@ EStringList Resolver::resolve( const EString & name )
 }
 
 
+/*! Returns the mail exchangers for \a domain, most preferred first.
+
+    If \a domain has no MX records, the result contains just \a
+    domain, as RFC 5321 section 5 says. If \a domain does not exist,
+    or publishes a null MX (RFC 7505), the result is empty. In these
+    cases *\a ok is set to true. If the lookup fails temporarily, mx()
+    returns an empty list and sets *\a ok to false.
+
+    Results are cached for as long as their TTL allows, but at most an
+    hour.
+*/
+
+EStringList Resolver::mx( const EString & domain, bool * ok )
+{
+    Resolver * r = resolver();
+    r->d->host = domain.lower();
+    *ok = true;
+
+    uint now = (uint)::time( 0 );
+    ResolverData::Exchangers * e = r->d->exchangers.find( r->d->host );
+    if ( e && e->expires > now )
+        return e->hosts;
+
+    e = new ResolverData::Exchangers;
+    uint ttl = 3600;
+
+    r->d->reply.reserve( 4096 );
+    log( "Looking up MX for " + r->d->host, Log::Debug );
+    int len = res_query( r->d->host.cstr(), C_IN, T_MX,
+                         (u_char*)r->d->reply.data(),
+                         r->d->reply.capacity() );
+    if ( len <= 0 ) {
+        if ( h_errno == NO_DATA ) {
+            e->hosts.append( r->d->host );
+        }
+        else if ( h_errno != HOST_NOT_FOUND ) {
+            r->d->errors.append( "DNS error while looking up MX for " +
+                                 r->d->host );
+            *ok = false;
+            return e->hosts;
+        }
+        e->expires = now + ttl;
+        r->d->exchangers.insert( r->d->host, e );
+        return e->hosts;
+    }
+
+    r->d->reply.setLength( len );
+    EStringList found;
+    if ( !DnsQuery::parse( r->d->reply, T_MX, &found, &ttl ) )
+        r->d->errors.append( "Parse error in response packet for " +
+                             r->d->host );
+
+    // a null MX means that the domain doesn't accept mail at all
+    if ( found.isEmpty() )
+        e->hosts.append( r->d->host );
+    else if ( !found.contains( "" ) )
+        e->hosts.append( found );
+
+    e->expires = now + ttl;
+    r->d->exchangers.insert( r->d->host, e );
+    return e->hosts;
+}
+
+
 /*! Returns a list of one-line error messages concerning all
     resolution errors since startup.
 */
@@ -146,56 +227,6 @@ Resolver * Resolver::resolver()
 }
 
 
-/*! Reads and returns a single string from the stored DNS reply at
-    offset \a i, modifying \a i. If errors occur, an error is
-    logged. If the parser runs off the end of the reply, readString()
-    returns an empty string, but logs no error.
-*/
-
-EString Resolver::readString( uint & i )
-{
-    bool ok = true;
-    bool bad = false;
-    EString r;
-    uint c = d->reply[i];
-    if ( i >= d->reply.length() ) {
-        ok = false;
-    }
-    if ( c == 0 ) {
-        // all is in perfect order
-        i++;
-    }
-    else if ( c < 64 ) {
-        i++;
-        r.append( d->reply.mid( i, c ) );
-        i += c;
-        // and just in case that wasn't all, do a spot of tail recursion
-        EString domain = readString( i );
-        if ( !domain.isEmpty() ) {
-            r.append( "." );
-            r.append( domain );
-        }
-    }
-    else if ( c >= 192 ) {
-        uint qi = ( ( d->reply[i] & 0x3f ) << 8 ) + d->reply[i+1];
-        if ( qi < i )
-            r.append( readString( qi ) );
-        else
-            bad = true;
-        i += 2;
-    }
-    else {
-        bad = true;
-    }
-    if ( bad )
-        d->errors.append( "Parse error in response packet for " + d->host );
-    else if ( ok )
-        return r;
-    return "";
-}
-
-
-
 /*! This private function issues a DNS query of \a type and appends
     the results to \a results. Truncated packets are silently accepted
     (the partial RR is ignored).  \a type is passed through to
@@ -204,7 +235,6 @@ EString Resolver::readString( uint & i )
 
 void Resolver::query( uint type, EStringList * results )
 {
-    d->bad = false;
     d->reply.reserve( 4096 );
     log( "Starting DNS lookup (type " + fn( type ) + ") for " + d->host,
          Log::Debug );
@@ -224,65 +254,7 @@ void Resolver::query( uint type, EStringList * results )
     }
 
     d->reply.setLength( len );
-
-    uint p = 12;
-
-    if ( len < 12 )
-        return;
-
-    uint qdcount = (  d->reply[4] << 8 ) +  d->reply[5];
-    uint ancount = (  d->reply[6] << 8 ) +  d->reply[7];
-
-    // skip the query section
-    while ( p < d->reply.length() && qdcount && !d->bad ) {
-        (void)readString( p );
-        p += 4;
-        qdcount--;
-    }
-
-    // parse each A and AAAA in the answer section
-    while ( p < d->reply.length() && ancount && !d->bad  ) {
-        EString n = readString( p );
-        EString a;
-        uint type = ( d->reply[p] << 8 ) + d->reply[p+1];
-        uint rdlength = ( d->reply[p+8] << 8 ) + d->reply[p+9];
-        p += 10;
-        if ( type == T_A ) {
-            if ( rdlength == 4 ) {
-                uint i = 0;
-                while ( i < rdlength ) {
-                    if ( !a.isEmpty() )
-                        a.append( '.' );
-                    a.append( fn( d->reply[p+i] ) );
-                    i++;
-                }
-            }
-        }
-        else if ( type == T_AAAA ) {
-            if ( rdlength == 16 ) {
-                uint i = 0;
-                while ( i < rdlength ) {
-                    if ( !a.isEmpty() )
-                        a.append( ':' );
-                    a.append( fn( ( d->reply[p+i] << 8 ) + d->reply[p+i+1],
-                                  16 ) );
-                    i += 2;
-                }
-            }
-        }
-        else if ( type == T_CNAME ) {
-            // hm.
-        }
-        p += rdlength;
-        if ( p <= d->reply.length() && !d->bad && !a.isEmpty() ) {
-            Endpoint * e = new Endpoint( a, 1 );
-            if ( e->valid() )
-                results->append( e->address() );
-            // if not, we received an illegal reply from the DNS
-            // server. let's ignore that silently for now.
-        }
-        ancount--;
-    }
-
-    // we don't care about the NS and AD sections, so we're done
+    uint ttl = 0;
+    if ( !DnsQuery::parse( d->reply, type, results, &ttl ) )
+        d->errors.append( "Parse error in response packet for " + d->host );
 }
@@ -13,11 +13,11 @@ private:
     Resolver();
 
     static Resolver * resolver();
-    EString readString( uint & );
     void query( uint, EStringList * );
 
 public:
     static EStringList resolve( const EString & );
+    static EStringList mx( const EString &, bool * );
     static EStringList errors();
 
 private:
@@ -9,6 +9,7 @@
 #include "date.h"
 #include "cache.h"
 #include "session.h"
+#include "sessionindex.h"
 #include "mailbox.h"
 #include "allocator.h"
 #include "estringlist.h"
@@ -16,6 +17,7 @@
 #include "transaction.h"
 #include "annotation.h"
 #include "dbsignal.h"
+#include "postgres.h"
 #include "field.h"
 #include "user.h"
 
@@ -23,6 +25,11 @@
 
 
 static bool tsearchAvailable = false;
+static bool bodyTrigramsAvailable = false;
+static bool subjectTsearchAvailable = false;
+static bool headerTrigramsAvailable = false;
+static bool addressTrigramsAvailable = false;
+static bool headerBlobsFound = false;
 static bool retunerCreated = false;
 
 static EString * tsconfig;
@@ -32,41 +39,125 @@ class TuningDetector
     : public EventHandler
 {
 public:
-    TuningDetector(): q( 0 ) {
+    TuningDetector(): q( 0 ), b( 0 ) {
         ::tsearchAvailable = false;
+        ::bodyTrigramsAvailable = false;
+        ::subjectTsearchAvailable = false;
+        ::headerTrigramsAvailable = false;
+        ::addressTrigramsAvailable = false;
         q = new Query(
-            "select indexdef from pg_indexes where "
-            "indexdef ilike '% USING gin (to_tsvector%'"
-            "and tablename='bodyparts' and schemaname=$1",
+            "select tablename::text, indexdef from pg_indexes where "
+            "indexdef ilike '% USING gin (%' and "
+            "tablename in ('bodyparts','header_fields','addresses') "
+            "and schemaname=$1",
             this
         );
         q->bind( 1, Configuration::text( Configuration::DbSchema ) );
         q->execute();
+        b = new Query( "select message from header_blobs limit 1", this );
+        b->execute();
     }
     void execute() {
-        if ( !q->done() )
-            return;
-        ::tsearchAvailable = q->hasResults();
-        Row * r = q->nextRow();
-        if ( r ) {
+        if ( b->nextRow() )
+            ::headerBlobsFound = true;
+
+        Row * r;
+        while ( (r=q->nextRow()) != 0 ) {
+            EString table( r->getEString( "tablename" ) );
             EString def( r->getEString( "indexdef" ) );
 
+            if ( def.contains( "gin_trgm_ops" ) ) {
+                if ( table == "bodyparts" )
+                    ::bodyTrigramsAvailable = true;
+                else if ( table == "header_fields" )
+                    ::headerTrigramsAvailable = true;
+                else if ( table == "addresses" )
+                    ::addressTrigramsAvailable = true;
+                continue;
+            }
+            if ( !def.contains( "to_tsvector(" ) )
+                continue;
+
             uint n = 12 + def.find( "to_tsvector(" );
             def = def.mid( n, def.length()-n-1 ).section( ",", 1 );
 
-            if ( def[0] == '\'' && def.endsWith( "::regconfig" ) ) {
+            if ( def[0] != '\'' || !def.endsWith( "::regconfig" ) )
+                continue;
+            if ( tsconfig && *tsconfig != def )
+                continue;
+            if ( !tsconfig ) {
                 tsconfig = new EString( def );
                 Allocator::addEternal( tsconfig, "tsearch configuration" );
             }
-            else {
-                ::tsearchAvailable = false;
-            }
+            if ( table == "bodyparts" )
+                ::tsearchAvailable = true;
+            else if ( table == "header_fields" )
+                ::subjectTsearchAvailable = true;
         }
     }
     Query * q;
+    Query * b;
 };
 
 
+// returns true if header searches have to look in header_blobs too,
+// because compact-headers is or was used.
+
+static bool headerBlobs()
+{
+    return ::headerBlobsFound ||
+        Configuration::toggle( Configuration::CompactHeaders );
+}
+
+
+// Selector binds its arguments to placeholders, so searches that
+// differ only in their arguments have identical SQL. The second time
+// query() produces a text, we make it a PreparedStatement, so that
+// each database handle parses and plans it once rather than for each
+// search. Each statement graphs its own execution times as
+// search-shape-<name>. There are at most maxShapes of them, and all
+// texts seen once are forgotten now and then.
+
+static const uint maxShapes = 64;
+static Dict<PreparedStatement> * shapes = 0;
+static Dict<uint> * candidates = 0;
+
+
+static PreparedStatement * shape( const EString & sql )
+{
+    if ( !::shapes ) {
+        ::shapes = new Dict<PreparedStatement>;
+        Allocator::addEternal( ::shapes, "prepared search statements" );
+        ::candidates = new Dict<uint>;
+        Allocator::addEternal( ::candidates, "search statement texts" );
+    }
+
+    PreparedStatement * ps = ::shapes->find( sql );
+    if ( ps || ::shapes->count() >= maxShapes )
+        return ps;
+
+    uint * n = ::candidates->find( sql );
+    if ( !n ) {
+        if ( ::candidates->count() >= 1024 )
+            ::candidates->clear();
+        n = (uint*)Allocator::alloc( sizeof( uint ), 0 );
+        *n = 0;
+        ::candidates->insert( sql, n );
+    }
+    (*n)++;
+    if ( *n < 2 )
+        return 0;
+
+    ::candidates->remove( sql );
+    ps = new PreparedStatement( sql );
+    ps->setGraph( "search-shape-" + ps->name() );
+    ::shapes->insert( sql, ps );
+    log( "Preparing search statement " + ps->name() + ": " + sql,
+         Log::Debug );
+    return ps;
+}
+
+
 class RetuningDetector
     : public EventHandler
 {
@@ -152,6 +243,30 @@ public:
 };
 
 
+// Returns true if \a s can only match messages in the mailboxes
+// named by its MailboxTree selectors.
+
+static bool confined( Selector * s )
+{
+    if ( s->field() == Selector::MailboxTree )
+        return true;
+    if ( s->action() != Selector::And && s->action() != Selector::Or )
+        return false;
+    List<Selector>::Iterator i( s->children() );
+    if ( !i )
+        return false;
+    while ( i ) {
+        bool c = confined( i );
+        if ( c && s->action() == Selector::And )
+            return true;
+        if ( !c && s->action() == Selector::Or )
+            return false;
+        ++i;
+    }
+    return s->action() == Selector::Or;
+}
+
+
 /*! \class Selector selector.h
 
     This class represents a set of conditions to select messages from
@@ -545,7 +660,10 @@ void Selector::simplify()
     The \a mailbox to search is passed in separately, because we can't
     use the Session's mailbox while building views. If \a mailbox is a
     null pointer, the query will search either the entire database or
-    the part that's visible to \a user.
+    the part that's visible to \a user. If \a user is supplied and
+    the search is confined to the mailboxes named by MailboxTree
+    selectors, the caller is responsible for checking that \a user
+    may read those.
 
     If \a deleted is supplied and true (the default is false), then
     the Query looks at the deleted_messages table instead of the
@@ -631,6 +749,10 @@ Query * Selector::query( User * user, Mailbox * mailbox,
         // normal case: search one mailbox
         mboxClause = mm() + ".mailbox=$" + fn( mboxId );
     }
+    else if ( user && confined( this ) ) {
+        // search only the mailboxes named by MailboxTree selectors,
+        // whose permissions the caller has checked
+    }
     else if ( user ) {
         // search all mailboxes accessible to user
         uint owner = placeHolder();
@@ -652,7 +774,7 @@ Query * Selector::query( User * user, Mailbox * mailbox,
             // closest parent which has a permissions row.
             "   select mp.id"
             "    from mailboxes mp"
-            "    join permssions p on (mp.id=p.mailbox)"
+            "    join permissions p on (mp.id=p.mailbox)"
             "    where (p.identifier='anyone' or p.identifier=$"+fn(n)+") and"
             "    (mp.id=mb.id or"
             "     lower(mp.name)||'/'="
@@ -699,7 +821,11 @@ Query * Selector::query( User * user, Mailbox * mailbox,
             q.append( " order by m.idate" );
     }
 
-    d->query->setString( q );
+    PreparedStatement * ps = shape( q );
+    if ( ps )
+        d->query->setPreparedStatement( *ps );
+    else
+        d->query->setString( q );
     return d->query;
 }
 
@@ -870,6 +996,56 @@ static EString q( const UString & orig )
 }
 
 
+// returns \a v escaped the way Injector::addHeader() escapes the
+// values it stores in header_blobs
+
+static UString blobEscaped( const UString & v )
+{
+    UString r;
+    uint i = 0;
+    while ( i < v.length() ) {
+        uint c = v[i++];
+        if ( c == '\\' )
+            r.append( "\\\\" );
+        else if ( c == '\r' )
+            r.append( "\\r" );
+        else if ( c == '\n' )
+            r.append( "\\n" );
+        else
+            r.append( c );
+    }
+    return r;
+}
+
+
+static EString regexQuoted( const EString & s )
+{
+    EString r;
+    uint i = 0;
+    while ( i < s.length() ) {
+        if ( EString( "\\^$.|?*+()[]{}" ).contains( s[i] ) )
+            r.append( '\\' );
+        r.append( s[i] );
+        i++;
+    }
+    return r;
+}
+
+
+// returns a regular expression matching the header_blobs rows which
+// contain a field named \a name whose value contains \a value
+
+static EString blobPattern( const EString & name, const UString & value )
+{
+    Utf8Codec c;
+    EString r( "(^|\n)[0-9]+ " );
+    r.append( regexQuoted( name ) );
+    r.append( ": [^\n]*" );
+    r.append( regexQuoted( c.fromUnicode( blobEscaped( value ) ) ) );
+    return r;
+}
+
+
 static EString matchTsvector( const EString & col, uint n )
 {
     EString s( "octet_length(" );
@@ -878,7 +1054,14 @@ static EString matchTsvector( const EString & col, uint n )
     s.append( *tsconfig );
     s.append( ", " );
     s.append( col );
-    s.append( ") @@ plainto_tsquery($" );
+    // the query must be parsed with the same configuration as the
+    // index, and from 9.6 on we can require the words in order
+    if ( Postgres::version() >= 90600 )
+        s.append( ") @@ phraseto_tsquery(" );
+    else
+        s.append( ") @@ plainto_tsquery(" );
+    s.append( *tsconfig );
+    s.append( ", $" );
     s.appendNumber( n );
     s.append( ")" );
     return s;
@@ -923,6 +1106,38 @@ EString Selector::whereHeaderField()
     if ( t == HeaderField::Other )
         t = 0;
 
+    // compact-headers may have put the field in header_blobs
+    EString blob;
+    if ( headerBlobs() && !HeaderField::isBrokenOut( d->s8 ) ) {
+        uint b = placeHolder( blobPattern( d->s8, d->s16 ) );
+        blob = " or " + mm() + ".message in "
+               "(select message from header_blobs where fields ~* $" +
+               fn( b ) + ")";
+    }
+
+    if ( ::headerTrigramsAvailable && !d->s16.isEmpty() &&
+         !( t == HeaderField::MessageId &&
+            d->s16.startsWith( "<" ) && d->s16.endsWith( ">" ) ) ) {
+        // with a trigram index, postgres can find the matching
+        // fields first and then the messages
+        uint like = placeHolder( q( d->s16 ) );
+        EString field;
+        if ( t ) {
+            field = "field=" + fn( t );
+        }
+        else {
+            uint f = placeHolder( d->s8 );
+            field = "field=(select id from field_names where name=$" +
+                    fn( f ) + ")";
+        }
+        EString r = mm() + ".message in "
+                    "(select message from header_fields where " + field +
+                    " and value ilike " + matchAny( like ) + ")";
+        if ( blob.isEmpty() )
+            return r;
+        return "(" + r + blob + ")";
+    }
+
     EString jn = fn( ++root()->d->join );
     EString j = " left join header_fields hf" + jn +
                " on (" + mm() + ".message=hf" + jn + ".message";
@@ -932,7 +1147,7 @@ EString Selector::whereHeaderField()
         j.append( " and hf" + jn + ".value=$" + fn( like ) );
     }
     else if ( t == HeaderField::Subject &&
-              ::tsearchAvailable && sensibleWords( d->s16 ) ) {
+              ::subjectTsearchAvailable && sensibleWords( d->s16 ) ) {
         uint like = placeHolder( q( d->s16 ) );
         j.append( " and (" + matchTsvector( "hf" + jn + ".value", like ) + " "
                   "and hf" + jn + ".value ilike " + matchAny( like ) + ")" );
@@ -954,7 +1169,9 @@ EString Selector::whereHeaderField()
     j.append( ")" );
     root()->d->leftJoins.append( j );
 
-    return "hf" + jn + ".field is not null";
+    if ( blob.isEmpty() )
+        return "hf" + jn + ".field is not null";
+    return "(hf" + jn + ".field is not null" + blob + ")";
 }
 
 
@@ -971,9 +1188,27 @@ EString Selector::whereHeaders( List<Selector> * sl )
     if ( sl->count() == 1 )
         return sl->first()->whereHeaderField();
 
+    // header_blobs can't be joined like header_fields, so if any of
+    // the fields may be there, we search for each separately
+    List<Selector>::Iterator si( sl );
+    while ( si && HeaderField::isBrokenOut( si->d->s8 ) )
+        ++si;
+    if ( si && headerBlobs() ) {
+        EStringList any;
+        si = sl->first();
+        while ( si ) {
+            if ( si->d->s8.isEmpty() )
+                any.append( si->whereHeader() );
+            else
+                any.append( si->whereHeaderField() );
+            ++si;
+        }
+        return "(" + any.join( " or " ) + ")";
+    }
+
     EStringList likes;
     EStringList fields;
-    List<Selector>::Iterator si( sl );
+    si = sl->first();
     while ( si ) {
         fields.append( si->d->s8 );
         likes.append( q( si->d->s16 ) );
@@ -1389,6 +1624,14 @@ EString Selector::whereAddressFields( List<Selector> * fields )
 
     }
 
+    // with trigram indices on addresses, a subselect lets postgres
+    // find the addresses first
+    if ( ::addressTrigramsAvailable && !addresses.isEmpty() )
+        return mm() + ".message in "
+            "(select af" + jn + ".message from address_fields af" + jn +
+            " join addresses a" + jn + " on (a" + jn + ".id=af" + jn +
+            ".address) where " + addresses.join( " or " ) + ")";
+
     // after all that, we finally have what we need to put together
     // the join condition
     EString r = " left join address_fields af" + jn +
@@ -1422,15 +1665,28 @@ EString Selector::whereHeader()
         return "true"; // there _is_ at least one header field ;)
 
     uint like = placeHolder( q( d->s16 ) );
+    List<Selector> dummy;
+    dummy.append( this );
+    EString blob;
+    if ( headerBlobs() ) {
+        uint b = placeHolder( q( blobEscaped( d->s16 ) ) );
+        blob = " or " + mm() + ".message in "
+               "(select message from header_blobs where fields ilike " +
+               matchAny( b ) + ")";
+    }
+    if ( ::headerTrigramsAvailable )
+        return "(" + mm() + ".message in "
+            "(select message from header_fields where value ilike " +
+            matchAny( like ) + ") or " +
+            whereAddressFields( &dummy ) + blob + ")";
+
     EString jn = "hf" + fn( ++root()->d->join );
     EString j = " left join header_fields " + jn +
                " on (" + mm() + ".message=" + jn + ".message and " +
                jn + ".value ilike " + matchAny( like ) + ")";
     root()->d->leftJoins.append( j );
-    List<Selector> dummy;
-    dummy.append( this );
     return "(" + jn + ".field is not null or " +
-        whereAddressFields( &dummy ) + ")";
+        whereAddressFields( &dummy ) + blob + ")";
 }
 
 
@@ -1439,20 +1695,30 @@ EString Selector::whereHeader()
     pictures. (For some formats we search on the text part, because
     the injector sets bodyparts.text based on bodyparts.data.)
 
-    This function uses full-text search if available, but filters the
-    results with a plain 'ilike' in order to avoid overly liberal
-    stemming. (Perhaps we actually want liberal stemming. I don't
-    know. IMAP says not to do it, but do we listen?)
+    If "aox tune search" has built a trigram index on bodyparts.text,
+    postgres can use that to find the matching bodyparts first, and
+    the search still matches substrings, as IMAP requires.
+
+    Otherwise, this function uses full-text search if available, but
+    filters the results with a plain 'ilike' in order to avoid overly
+    liberal stemming. (Perhaps we actually want liberal stemming. I
+    don't know. IMAP says not to do it, but do we listen?)
 */
 
 EString Selector::whereBody()
 {
+    uint bt = placeHolder( q( d->s16 ) );
+
+    if ( ::bodyTrigramsAvailable && !d->s16.isEmpty() )
+        return mm() + ".message in "
+            "(select pn.message from part_numbers pn "
+            "join bodyparts bp on (bp.id=pn.bodypart) "
+            "where bp.text ilike " + matchAny( bt ) + ")";
+
     root()->d->needBodyparts = true;
 
     EString s;
 
-    uint bt = placeHolder( q( d->s16 ) );
-
     if ( ::tsearchAvailable && sensibleWords( d->s16 ) )
         s.append( "(" + matchTsvector( "bp.text", bt ) + " "
                   "and bp.text ilike " + matchAny( bt ) + ")" );
@@ -1539,6 +1805,34 @@ EString Selector::whereSet( const IntegerSet & s )
     uint u = placeHolder();
     uint c = s.count();
 
+    // a few ranges (such as 1:*) are cheaper to send as ranges, and
+    // let the database use an index range scan
+    uint first[4];
+    uint last[4];
+    uint r = 0;
+    if ( c > 2 )
+        r = s.ranges( first, last, 4 );
+    if ( r && r <= 4 ) {
+        Query * q = root()->d->query;
+        EString w;
+        uint i = 0;
+        while ( i < r ) {
+            if ( i )
+                w.append( " or " );
+            uint u2 = placeHolder();
+            q->bind( u, first[i] );
+            q->bind( u2, last[i] );
+            w.append( mm() + ".uid between $" + fn( u ) +
+                      " and $" + fn( u2 ) );
+            i++;
+            if ( i < r )
+                u = placeHolder();
+        }
+        if ( r > 1 )
+            return "(" + w + ")";
+        return w;
+    }
+
     if ( c > 2 ) {
         root()->d->query->bind( u, s );
         return mm() + ".uid=any($" + fn( u ) + ")";
@@ -1811,9 +2105,10 @@ EString Selector::whereNoField()
 /*! This implements a search that's bound to a specific mailbox or a
     subtree.
 
-    This does no permission checking. query() includes a gargantuan
-    clause to limit the search to mailboxes the user can read; this
-    function relies on that clause.
+    This does no permission checking. Unless the entire search is
+    confined to such mailboxes, query() includes a gargantuan clause
+    to limit the search to mailboxes the user can read; this function
+    relies on that clause, or on the caller having checked.
 */
 
 EString Selector::whereMailbox()
@@ -2052,6 +2347,221 @@ Selector::MatchResult Selector::match( Session * s, uint uid )
 }
 
 
+/*! Returns true if matches() can evaluate this condition using the
+    Session and its SessionIndex, and at least one part of the
+    condition needs the index. If the condition can be evaluated
+    without the index, match() is cheaper.
+*/
+
+bool Selector::usesIndex() const
+{
+    return indexUse() == 2;
+}
+
+
+/*! This private helper returns 0 if matches() cannot evaluate this
+    condition, 1 if it can do so using only the Session, and 2 if it
+    needs the SessionIndex.
+*/
+
+uint Selector::indexUse() const
+{
+    if ( d->a == And || d->a == Or || d->a == Not ) {
+        uint r = 1;
+        List< Selector >::Iterator i( d->children );
+        while ( i ) {
+            uint u = i->indexUse();
+            if ( !u )
+                return 0;
+            if ( u > r )
+                r = u;
+            ++i;
+        }
+        return r;
+    }
+    else if ( d->a == All ) {
+        return 1;
+    }
+    else if ( d->a == Contains && d->f == Uid ) {
+        return 1;
+    }
+    else if ( d->a == Contains && d->f == Flags ) {
+        if ( d->s8 == "\\recent" )
+            return 1;
+        // an unknown flag may just be unknown to us so far
+        if ( Flag::id( d->s8 ) )
+            return 2;
+    }
+    else if ( d->f == InternalDate &&
+              ( d->a == OnDate || d->a == SinceDate ||
+                d->a == BeforeDate ) ) {
+        return 2;
+    }
+    else if ( d->f == Rfc822Size &&
+              ( d->a == Larger || d->a == Smaller ) ) {
+        return 2;
+    }
+    return 0;
+}
+
+
+/*! Returns the subset of \a uids in session \a s which matches this
+    condition. The session's SessionIndex must be ready() if
+    usesIndex() is true.
+
+    Each condition is evaluated for all of \a uids at once, using
+    bitmap operations on IntegerSet where possible, so this is much
+    faster than calling match() for each message. And narrows the
+    candidates for each child in turn.
+*/
+
+IntegerSet Selector::matches( Session * s, const IntegerSet & uids )
+{
+    IntegerSet r;
+
+    if ( d->a == And ) {
+        r = uids;
+        List< Selector >::Iterator i( d->children );
+        while ( i && !r.isEmpty() ) {
+            r = i->matches( s, r );
+            ++i;
+        }
+    }
+    else if ( d->a == Or ) {
+        List< Selector >::Iterator i( d->children );
+        while ( i ) {
+            r.add( i->matches( s, uids ) );
+            ++i;
+        }
+    }
+    else if ( d->a == Not ) {
+        r = uids;
+        r.remove( d->children->first()->matches( s, uids ) );
+    }
+    else if ( d->a == All ) {
+        r = uids;
+    }
+    else if ( d->a == Contains && d->f == Uid ) {
+        r = uids.intersection( d->s );
+    }
+    else if ( d->a == Contains && d->f == Flags ) {
+        if ( d->s8 == "\\recent" )
+            r = uids.intersection( s->recent() );
+        else
+            r = uids.intersection( s->index()->flagged( Flag::id( d->s8 ) ) );
+    }
+    else if ( d->f == InternalDate ) {
+        uint day = d->s8.mid( 0, 2 ).number( 0 );
+        EString month = d->s8.mid( 3, 3 );
+        uint year = d->s8.mid( 7 ).number( 0 );
+        // XXX: local time zone is ignored here, as in whereInternalDate()
+        Date d1;
+        d1.setDate( year, month, day, 0, 0, 0, 0 );
+        Date d2;
+        d2.setDate( year, month, day, 23, 59, 59, 0 );
+        uint from = 0;
+        uint to = UINT_MAX;
+        if ( d->a == OnDate || d->a == SinceDate )
+            from = d1.unixTime();
+        if ( d->a == OnDate || d->a == BeforeDate )
+            to = d2.unixTime();
+        r = uids.intersection( s->index()->receivedBetween( from, to ) );
+    }
+    else if ( d->f == Rfc822Size ) {
+        if ( d->a == Larger && d->n < UINT_MAX )
+            r = uids.intersection( s->index()->sizeBetween( d->n + 1,
+                                                            UINT_MAX ) );
+        else if ( d->a == Smaller && d->n > 0 )
+            r = uids.intersection( s->index()->sizeBetween( 0,
+                                                            d->n - 1 ) );
+    }
+
+    return r;
+}
+
+
+/*! Returns true if this is an And condition where some children can
+    be evaluated by matches() and others only by the database, ie. if
+    narrow() may be able to help.
+*/
+
+bool Selector::canNarrow() const
+{
+    if ( d->a != And )
+        return false;
+    bool cheap = false;
+    bool expensive = false;
+    List< Selector >::Iterator i( d->children );
+    while ( i ) {
+        if ( i->indexUse() )
+            cheap = true;
+        else
+            expensive = true;
+        ++i;
+    }
+    return cheap && expensive;
+}
+
+
+/*! Returns true if narrow() needs the session's SessionIndex to be
+    ready, and false if it needs only the Session.
+*/
+
+bool Selector::narrowingUsesIndex() const
+{
+    List< Selector >::Iterator i( d->children );
+    while ( i ) {
+        if ( i->indexUse() == 2 )
+            return true;
+        ++i;
+    }
+    return false;
+}
+
+
+/*! Evaluates the children of this And condition that matches() can
+    handle against session \a s, and if they're selective, replaces
+    them by a single UID set, so that the database only has to
+    evaluate the remaining, expensive children for the messages in
+    that set. Returns true if the condition was changed, and false if
+    not.
+
+    Each cheap child only looks at the messages the previous ones
+    left. If together they leave more than half the messages in the
+    session, the UID set would cost about as much as it saves, and
+    nothing is changed.
+*/
+
+bool Selector::narrow( Session * s )
+{
+    if ( !canNarrow() )
+        return false;
+
+    IntegerSet all( s->messages() );
+    IntegerSet u( all );
+    List< Selector >::Iterator i( d->children );
+    while ( i && !u.isEmpty() ) {
+        if ( i->indexUse() )
+            u = i->matches( s, u );
+        ++i;
+    }
+
+    if ( u.count() * 2 > all.count() )
+        return false;
+
+    i = d->children->first();
+    while ( i ) {
+        if ( i->indexUse() )
+            d->children->take( i );
+        else
+            ++i;
+    }
+    add( new Selector( u ) );
+    simplify();
+    return true;
+}
+
+
 /*! Returns true if this condition needs an updated Session to be
     correctly evaluated, and false if not.
 */
@@ -2061,7 +2571,7 @@ bool Selector::needSession() const
     if ( d->a == Contains && d->f == Flags && d->s8 == "\\recent" )
         return true;
 
-    if ( d->a == And || d->a == Or ) {
+    if ( d->a == And || d->a == Or || d->a == Not ) {
         List< Selector >::Iterator i( d->children );
         while ( i ) {
             if ( i->needSession() )
@@ -2780,8 +3290,10 @@ RetentionSelector::RetentionSelector( Mailbox * m, EventHandler * h )
     if ( !m )
         return;
 
-    if ( !::cache )
+    if ( !::cache ) {
         ::cache = new RetentionPoliciesCache;
+        (void)new RetentionPoliciesCache::X( ::cache );
+    }
     Selector * s = ::cache->retains.find( m->id() );
     if ( !s )
         return;
@@ -73,6 +73,13 @@ public:
     };
     MatchResult match( class Session *, uint );
 
+    bool usesIndex() const;
+    IntegerSet matches( class Session *, const IntegerSet & );
+
+    bool canNarrow() const;
+    bool narrowingUsesIndex() const;
+    bool narrow( class Session * );
+
     EString string();
 
     static Selector * fromString( const EString & );
@@ -119,6 +126,8 @@ private:
     EString m();
 
     EString whereSet( const IntegerSet & );
+
+    uint indexUse() const;
 };
 
 
@@ -29,6 +29,8 @@
 #include <time.h>
 // trunc()
 #include <math.h>
+// sched_getaffinity, sched_setaffinity
+#include <sched.h>
 
 // our own includes, _after_ the system header files. lots of system
 // header files break if we've already defined UINT_MAX, etc.
@@ -45,6 +47,8 @@
 #include "configuration.h"
 #include "eventloop.h"
 #include "allocator.h"
+#include "sharedcache.h"
+#include "graph.h"
 #include "resolver.h"
 #include "entropy.h"
 #include "query.h"
@@ -60,9 +64,20 @@ public:
           chrootMode( Server::JailDir ),
           queries( new List< Query > ),
           children( 0 ),
-          mainProcess( false )
+          mainProcess( false ), process( 0 ),
+          listeners( new List<ProcessListener> )
     {}
 
+    class ProcessListener
+        : public Garbage
+    {
+    public:
+        ProcessListener( Connection * c, uint p )
+            : connection( c ), process( p ) {}
+        Connection * connection;
+        uint process;
+    };
+
     EString name;
     Server::Stage stage;
     EString configFile;
@@ -73,6 +88,8 @@ public:
     List< Query > *queries;
     List<pid_t> * children;
     bool mainProcess;
+    uint process;
+    List<ProcessListener> * listeners;
 };
 
 
@@ -291,6 +308,7 @@ void Server::files()
     s = open( "/dev/null", O_RDWR );
 
     Entropy::setup();
+    Configuration::retainDirectory();
 }
 
 
@@ -323,6 +341,30 @@ static void shutdownLoop( int )
 }
 
 
+static bool draining = false;
+
+
+static void drainLoop( int )
+{
+    ::draining = true;
+    Server::killChildren( SIGQUIT );
+    EventLoop::drainSoon();
+}
+
+
+static void reloadLoop( int )
+{
+    Server::killChildren( SIGHUP );
+    EventLoop::reloadSoon();
+}
+
+
+static void profileMemory( int )
+{
+    EventLoop::profileMemorySoon();
+}
+
+
 static void dumpCoreAndGoOn( int )
 {
     if ( fork() )
@@ -366,8 +408,9 @@ void Server::loop()
     sigemptyset( &sa.sa_mask ); // we block no other signals
     sa.sa_flags = 0; // in particular, we don't want SA_RESETHAND
 
-    // we cannot reread files, so we ignore sighup
-    sa.sa_handler = SIG_IGN;
+    // sighup rereads the configuration file, and passes the signal
+    // on to the children so that they do the same
+    sa.sa_handler = reloadLoop;
     ::sigaction( SIGHUP, &sa, 0 );
 
     // sigint and sigterm both should stop the server
@@ -375,6 +418,11 @@ void Server::loop()
     ::sigaction( SIGINT, &sa, 0 );
     ::sigaction( SIGTERM, &sa, 0 );
 
+    // sigquit stops accepting connections and lets the existing ones
+    // drain away, so that a new server can take over the ports
+    sa.sa_handler = drainLoop;
+    ::sigaction( SIGQUIT, &sa, 0 );
+
     // sigpipe happens if we're writing to an already-closed fd. we'll
     // discover that it's closed a little later.
     sa.sa_handler = SIG_IGN;
@@ -384,6 +432,10 @@ void Server::loop()
     sa.sa_handler = dumpCoreAndGoOn;
     ::sigaction( SIGUSR1, &sa, 0 );
 
+    // and one to log a heap profile after the next collection
+    sa.sa_handler = profileMemory;
+    ::sigaction( SIGUSR2, &sa, 0 );
+
     // a custom signal to die, quickly, for last-resort exit
     sa.sa_handler = ::killChildrenAndExit;
     ::sigaction( SIGALRM, &sa, 0 );
@@ -676,6 +728,84 @@ bool Server::useCache()
 }
 
 
+/*! Returns the number of processes this server runs to serve its
+    clients (see server-processes).
+*/
+
+uint Server::processes()
+{
+    if ( d && d->name == "archiveopteryx" )
+        return Configuration::scalar( Configuration::ServerProcesses );
+    return 1;
+}
+
+
+/*! Returns the number of this process among the processes(), counting
+    from 1, or 0 if this is the only process.
+*/
+
+uint Server::process()
+{
+    if ( d )
+        return d->process;
+    return 0;
+}
+
+
+/*! Records that the listening Connection \a c belongs to \a process,
+    which must be between 1 and processes(). When the server forks, \a
+    c starts listening in that process and is closed in the others.
+
+    This is used for SO_REUSEPORT, where each process has its own
+    listening socket and the kernel decides which process gets each
+    new connection.
+*/
+
+void Server::addListener( Connection * c, uint process )
+{
+    d->listeners->append( new ServerData::ProcessListener( c, process ) );
+}
+
+
+// binds this process to the n'th of the CPUs it may use, counting
+// from 1 and wrapping around.
+
+static void bindToCpu( uint n )
+{
+#if defined(__linux__) && defined(CPU_SET)
+    cpu_set_t allowed;
+    CPU_ZERO( &allowed );
+    if ( ::sched_getaffinity( 0, sizeof( allowed ), &allowed ) < 0 )
+        return;
+    uint count = CPU_COUNT( &allowed );
+    if ( !count )
+        return;
+    uint wanted = ( n - 1 ) % count;
+    uint cpu = 0;
+    while ( cpu < CPU_SETSIZE ) {
+        if ( CPU_ISSET( cpu, &allowed ) ) {
+            if ( !wanted )
+                break;
+            wanted--;
+        }
+        cpu++;
+    }
+    cpu_set_t mine;
+    CPU_ZERO( &mine );
+    CPU_SET( cpu, &mine );
+    if ( ::sched_setaffinity( 0, sizeof( mine ), &mine ) < 0 )
+        log( "Cannot bind process to CPU " + fn( cpu ) +
+             ". Error code " + fn( errno ), Log::Error );
+    else
+        log( "Bound process to CPU " + fn( cpu ) );
+#else
+    (void)n;
+    log( "use-cpu-affinity is not supported on this platform",
+         Log::Error );
+#endif
+}
+
+
 /*! Maintains the requisite number of children. Only child processes
     return from this function.
 */
@@ -684,14 +814,20 @@ void Server::maintainChildren()
 {
     d->mainProcess = true;
     d->children = new List<pid_t>;
-    uint children = 1;
-    if ( d->name == "archiveopteryx" )
-        children = Configuration::scalar( Configuration::ServerProcesses );
+    uint children = processes();
     uint i = 0;
     while ( i < children ) {
         d->children->append( new pid_t( 0 ) );
         i++;
     }
+    if ( children > 1 ) {
+        uint mb = Configuration::scalar( Configuration::SharedCacheSize );
+        if ( mb > 1024 )
+            mb = 1024;
+        SharedCache::setup( mb * 1024 * 1024 );
+        if ( Configuration::toggle( Configuration::UseMetrics ) )
+            MetricsServer::setup( children );
+    }
     uint failures = 0;
     while ( children > 1 && d->mainProcess ) {
         // check that all children exist
@@ -706,7 +842,9 @@ void Server::maintainChildren()
         }
         // add new children in each empty slot
         c = d->children->first();
-        while ( c && d->mainProcess ) {
+        uint slot = 0;
+        while ( c && d->mainProcess && !::draining ) {
+            slot++;
             if ( !*c ) {
                 *c = ::fork();
                 if ( *c < 0 ) {
@@ -719,7 +857,9 @@ void Server::maintainChildren()
                 }
                 else {
                     // a child. fork() must return.
+                    Entropy::reseed();
                     d->mainProcess = false;
+                    d->process = slot;
                 }
             }
             ++c;
@@ -729,11 +869,19 @@ void Server::maintainChildren()
             int status = 0;
             time_t now = time( 0 );
             pid_t child = ::waitpid( -1, &status, 0 );
+            if ( child == (pid_t)-1 && errno == ECHILD && ::draining ) {
+                log( "All child processes have drained. Quitting." );
+                exit( 0 );
+            }
             if ( child == (pid_t)-1 && errno == ECHILD ) {
                 log( "Qutting due to unexpected lack of child processes.",
                      Log::Error );
                 exit( 0 );
             }
+            if ( child == (pid_t)-1 && errno == EINTR )
+                continue;
+            if ( ::draining )
+                continue;
             if ( time( 0 ) >= now + 5 ) {
                 // not a failure, or the first in a long while
                 log( "Child process failed; no problem yet",
@@ -761,6 +909,19 @@ void Server::maintainChildren()
     // serve users.
     d->children = 0;
     EventLoop::global()->closeAllExceptListeners();
+    List<ServerData::ProcessListener>::Iterator l( d->listeners );
+    while ( l ) {
+        if ( l->process == d->process || !d->process )
+            EventLoop::global()->addConnection( l->connection );
+        else
+            l->connection->close();
+        ++l;
+    }
+    d->listeners->clear();
+    if ( d->process &&
+         Configuration::toggle( Configuration::UseCpuAffinity ) )
+        bindToCpu( d->process );
+    MetricsServer::publish();
     log( "Process " + fn( getpid() ) + " started" );
     if ( Configuration::toggle( Configuration::UseStatistics ) ) {
         uint port = Configuration::scalar( Configuration::StatisticsPort );
@@ -42,6 +42,10 @@ public:
     static EString name();
     static bool useCache();
 
+    static uint processes();
+    static uint process();
+    static void addListener( class Connection *, uint );
+
     static void killChildren( int );
 
 private:
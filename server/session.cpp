@@ -6,15 +6,21 @@
 #include "integerset.h"
 #include "allocator.h"
 #include "selector.h"
+#include "sessionindex.h"
+#include "mailboxview.h"
 #include "mailbox.h"
 #include "message.h"
 #include "event.h"
 #include "query.h"
 #include "scope.h"
 #include "flag.h"
+#include "graph.h"
 #include "map.h"
 #include "log.h"
 
+// gettimeofday
+#include <sys/time.h>
+
 
 class SessionData
     : public Garbage
@@ -24,7 +30,7 @@ public:
         : readOnly( true ),
           mailbox( 0 ),
           uidnext( 1 ), nextModSeq( 1 ),
-          permissions( 0 )
+          permissions( 0 ), index( 0 )
     {}
 
     bool readOnly;
@@ -36,6 +42,7 @@ public:
     int64 nextModSeq;
     Permissions * permissions;
     IntegerSet unannounced;
+    SessionIndex * index;
 };
 
 
@@ -54,17 +61,10 @@ Session::Session( Mailbox * m, bool readOnly )
 {
     d->mailbox = m;
     d->readOnly = readOnly;
-    Session * other = 0;
-    List<Session> * all = d->mailbox->sessions();
-    if ( all )
-        other = all->firstElement();
-    if ( other ) {
-        d->uidnext = other->d->uidnext;
-        d->nextModSeq = other->d->nextModSeq;
-        d->msns.add( other->d->msns );
-        d->msns.add( other->d->unannounced );
-        d->msns.remove( other->d->expunges );
-    }
+    MailboxView * v = m->view();
+    d->uidnext = v->uidnext();
+    d->nextModSeq = v->nextModSeq();
+    d->msns.add( v->messages() );
     (void)new SessionInitialiser( m, 0, this );
 }
 
@@ -303,8 +303,11 @@ public:
           also( 0 ),
           oldUidnext( 0 ), newUidnext( 0 ),
           state( NoTransaction ),
-          changeRecent( false )
-        {}
+          changeRecent( false ), again( false ), view( false )
+        {
+            started.tv_sec = 0;
+            started.tv_usec = 0;
+        }
 
     Mailbox * mailbox;
     List<Session> sessions;
@@ -326,9 +329,17 @@ public:
     State state;
 
     bool changeRecent;
+    bool again;
+    bool view;
+
+    struct timeval started;
 };
 
 
+static GraphableDataSet * updateWait = 0;
+static GraphableDataSet * updateWaitMax = 0;
+
+
 /*! \class SessionInitialiser session.h
 
     The SessionInitialiser class performs the database queries
@@ -337,7 +348,26 @@ public:
     When it's created, it tries to see whether the database work can
     be skipped. If not, it does all the necessary database queries and
     updates, and finally informs the Session objects of new and
-    modified Message objects.
+    modified Message objects. The mailbox's MailboxView is updated
+    along with the sessions.
+
+    Nothing is locked. If nothing has changed according to the
+    modseqs and uidnext, no queries are needed. If only flags have
+    changed or messages been expunged, the first_recent column needn't
+    be read or written. The queries only read, so when no Transaction
+    is involved, they may be sent to a replica, except the first_recent
+    read: changing first_recent doesn't change the modseq, so a replica
+    that has seen the new modseq may still have an old first_recent,
+    and two sessions could then claim the same messages. The first_recent
+    update, which waits for the mailbox row lock, is never sent via
+    the Transaction, so it can't hold up the transaction's other
+    work. The time spent waiting for the database is recorded in the
+    session-update-wait statistics.
+
+    If a SessionInitialiser without a Transaction is already working
+    on the mailbox, a new one merely asks that one to run again when
+    it's done, so that many changes arriving at once cause one round
+    of queries rather than one each.
 */
 
 /*! Constructs an SessionInitialiser for \a mailbox. If \a t is
@@ -352,8 +382,18 @@ SessionInitialiser::SessionInitialiser( Mailbox * mailbox, Transaction * t,
     setLog( new Log );
     d->mailbox = mailbox;
     d->also = also;
-    if ( t )
+    if ( t ) {
         d->t = t->subTransaction( this );
+    }
+    else if ( !also ) {
+        MailboxView * v = mailbox->view();
+        SessionInitialiser * busy = v->initialiser();
+        if ( busy ) {
+            busy->d->again = true;
+            return;
+        }
+        v->setInitialiser( this );
+    }
     execute();
 }
 
@@ -389,13 +429,25 @@ void SessionInitialiser::execute()
             recordMailboxChanges();
             recordExpunges();
             if ( d->messages->done() &&
-                 ( !d->expunges || d->expunges->done() ) )
+                 ( !d->expunges || d->expunges->done() ) ) {
+                recordWait();
                 d->state = SessionInitialiserData::Updated;
+            }
             break;
         case SessionInitialiserData::Updated:
             releaseLock(); // may change d->state
             break;
         case SessionInitialiserData::QueriesDone:
+            if ( d->again ) {
+                d->again = false;
+                d->recent = 0;
+                d->messages = 0;
+                d->expunges = 0;
+                d->state = SessionInitialiserData::NoTransaction;
+            }
+            else if ( d->mailbox->view()->initialiser() == this ) {
+                d->mailbox->view()->setInitialiser( 0 );
+            }
             break;
         }
     } while ( state != d->state );
@@ -420,6 +472,16 @@ void SessionInitialiser::findSessions()
     d->oldUidnext = d->newUidnext;
     d->oldModSeq = d->newModSeq;
     List<Session> * sessions =  d->mailbox->sessions();
+    MailboxView * v = d->mailbox->view();
+    d->view = false;
+    if ( !sessions && !d->also ) {
+        v->reset();
+    }
+    else if ( v->uidnext() > 1 ) {
+        d->oldUidnext = v->uidnext();
+        d->oldModSeq = v->nextModSeq();
+        d->view = true;
+    }
     if ( d->also ) {
         if ( !sessions )
             sessions = new List<Session>;
@@ -435,6 +497,9 @@ void SessionInitialiser::findSessions()
         if ( s->nextModSeq() < d->oldModSeq )
             d->oldModSeq = s->nextModSeq();
     }
+    // an empty view can be filled in only if we fetch everything
+    if ( d->oldUidnext <= 1 && !d->sessions.isEmpty() )
+        d->view = true;
     // if some session is behind the mailbox, carry out an update
     if ( d->newUidnext > d->oldUidnext ||
          d->newModSeq > d->oldModSeq )
@@ -479,12 +544,16 @@ void SessionInitialiser::grabLock()
          fn( d->newModSeq ) + ">, UID [" + fn( d->oldUidnext ) + "," +
          fn( d->newUidnext ) + ">" );
 
+    (void)::gettimeofday( &d->started, 0 );
     if ( highestRecent < d->newUidnext - 1 )
         d->recent = new Query( "select first_recent from mailboxes "
                                "where id=$1", this );
     if ( d->recent ) {
         d->recent->bind( 1, d->mailbox->id() );
-        submit( d->recent );
+        if ( d->t )
+            submit( d->recent );
+        else
+            d->recent->execute(); // never on a replica, see above
     }
 }
 
@@ -540,11 +609,12 @@ void SessionInitialiser::findRecent()
 
     if ( !d->changeRecent )
         return;
+    // this needs the row lock, so it mustn't delay our transaction
     Query * q = new Query( "update mailboxes set first_recent=$2 "
                            "where id=$1 and first_recent<$2", 0 );
     q->bind( 1, d->mailbox->id() );
     q->bind( 2, recent );
-    submit( q );
+    q->execute();
 }
 
 
@@ -592,9 +662,12 @@ void SessionInitialiser::findMailboxChanges()
 
 void SessionInitialiser::recordMailboxChanges()
 {
+    MailboxView * v = d->mailbox->view();
     Row * r = 0;
     while ( (r=d->messages->nextRow()) != 0 ) {
         uint uid = r->getInt( "uid" );
+        if ( d->view )
+            v->add( uid );
         addToSessions( uid, r->getBigint( "modseq" ) );
     }
 }
@@ -615,6 +688,8 @@ void SessionInitialiser::recordExpunges()
     if ( uids.isEmpty() )
         return;
 
+    if ( d->view )
+        d->mailbox->view()->remove( uids );
     List<Session>::Iterator i( d->sessions );
     while ( i ) {
         Session * s = i;
@@ -629,6 +704,8 @@ void SessionInitialiser::recordExpunges()
 
 void SessionInitialiser::emitUpdates()
 {
+    if ( d->view )
+        d->mailbox->view()->advance( d->newUidnext, d->newModSeq );
     List<Session>::Iterator s( d->sessions );
     while ( s ) {
         if ( s->nextModSeq() < d->newModSeq )
@@ -663,7 +740,9 @@ void SessionInitialiser::addToSessions( uint uid, int64 ms )
 
 
 /*! This private helper submits \a q via our Transaction if we're
-    using one, directly if not.
+    using one, directly if not. In the latter case, \a q may be sent
+    to a replica that has seen all changes up to the modseq we're
+    updating to.
 */
 
 void SessionInitialiser::submit( class Query * q )
@@ -673,11 +752,37 @@ void SessionInitialiser::submit( class Query * q )
         d->t->execute();
     }
     else {
+        q->allowReplica( d->mailbox->id(), d->newModSeq );
         q->execute();
     }
 }
 
 
+/*! Records how long this initialiser waited for the database, from
+    the first query until all changes were received.
+*/
+
+void SessionInitialiser::recordWait()
+{
+    if ( !d->started.tv_sec )
+        return;
+    struct timeval now;
+    (void)::gettimeofday( &now, 0 );
+    long ms = ( now.tv_sec - d->started.tv_sec ) * 1000 +
+              ( now.tv_usec - d->started.tv_usec ) / 1000;
+    d->started.tv_sec = 0;
+    if ( ms < 0 )
+        ms = 0;
+    if ( !::updateWait ) {
+        ::updateWait = new GraphableDataSet( "session-update-wait" );
+        ::updateWaitMax = new GraphableDataSet( "session-update-wait-max",
+                                                100 );
+    }
+    ::updateWait->addNumber( (uint)ms );
+    ::updateWaitMax->addNumber( (uint)ms );
+}
+
+
 /*! Returns a message set containing all the UIDs that have been
     expunged in the database, but not yet reported to the client.
 */
@@ -713,6 +818,19 @@ void Session::clearExpunged( uint uid )
 }
 
 
+/*! Records that the client has been told that the messages in \a
+    uids no longer exist. This is the same as calling
+    clearExpunged() for each UID, but much faster for large sets.
+*/
+
+void Session::clearExpunged( const IntegerSet & uids )
+{
+    d->msns.remove( uids );
+    d->expunges.remove( uids );
+    d->unannounced.remove( uids );
+}
+
+
 /*! Records that the client has requested that \a uid no longer
     exists.
 
@@ -760,6 +878,8 @@ IntegerSet Session::unannounced() const
 void Session::addUnannounced( const IntegerSet & s )
 {
     d->unannounced.add( s );
+    if ( d->index )
+        d->index->forget( s );
 }
 
 
@@ -771,6 +891,8 @@ void Session::addUnannounced( const IntegerSet & s )
 void Session::addUnannounced( uint uid )
 {
     d->unannounced.add( uid );
+    if ( d->index )
+        d->index->forget( uid );
 }
 
 
@@ -783,6 +905,35 @@ void Session::clearUnannounced()
 }
 
 
+/*! Returns the SessionIndex for this session, creating an empty one
+    if there isn't one yet. The index is kept up to date as
+    SessionInitialiser reports changes, but may have to be refresh()ed
+    before use.
+*/
+
+SessionIndex * Session::index()
+{
+    if ( !d->index )
+        d->index = new SessionIndex( this );
+    return d->index;
+}
+
+
+/*! Releases memory which the Session can recreate when it's needed
+    again, for use when the client has been idle for a while. This
+    implementation drops the SessionIndex, which index() rebuilds on
+    demand. Subclasses may release more, but must call this.
+
+    The MSN map and the UID sets are kept, since they are needed to
+    send updates, and IntegerSet already stores them as ranges.
+*/
+
+void Session::compact()
+{
+    d->index = 0;
+}
+
+
 /*! Does whatever is necessary to tell the client about new
     flags. This is really a hack for ImapSession.
 */
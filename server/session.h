@@ -58,6 +58,7 @@ public:
 
     void expunge( const IntegerSet & );
     virtual void clearExpunged( uint );
+    virtual void clearExpunged( const IntegerSet & );
     virtual void earlydeletems( const IntegerSet & );
 
     virtual void emitUpdates( Transaction * );
@@ -67,6 +68,10 @@ public:
     void addUnannounced( const IntegerSet & );
     void clearUnannounced();
 
+    class SessionIndex * index();
+
+    virtual void compact();
+
     virtual void sendFlagUpdate();
 
 private:
@@ -96,6 +101,7 @@ private:
     void emitUpdates();
     void addToSessions( uint, int64 );
     void submit( class Query * );
+    void recordWait();
 };
 
 
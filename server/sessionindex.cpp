@@ -0,0 +1,363 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "sessionindex.h"
+
+#include "allocator.h"
+#include "session.h"
+#include "mailbox.h"
+#include "query.h"
+#include "scope.h"
+#include "flag.h"
+#include "list.h"
+#include "map.h"
+#include "log.h"
+
+// memmove
+#include <string.h>
+
+
+class SessionIndexData
+    : public Garbage
+{
+public:
+    SessionIndexData()
+        : session( 0 ), messages( 0 ), flags( 0 ),
+          uids( 0 ), idates( 0 ), sizes( 0 ),
+          broken( false ), n( 0 ), size( 0 )
+    {}
+
+    Session * session;
+    Query * messages;
+    Query * flags;
+    List<EventHandler> waiting;
+
+    IntegerSet known;
+    IntegerSet loading;
+    IntegerSet changed;
+    Map<IntegerSet> flagged;
+
+    uint * uids;
+    uint * idates;
+    uint * sizes;
+
+    // no pointers after this line
+    bool broken;
+    uint n;
+    uint size;
+
+    IntegerSet * flag( uint id ) {
+        IntegerSet * s = flagged.find( id );
+        if ( !s ) {
+            s = new IntegerSet;
+            flagged.insert( id, s );
+        }
+        return s;
+    }
+
+    void grow() {
+        uint s = size * 2;
+        if ( s < 1024 )
+            s = 1024;
+        uint * u = (uint*)Allocator::alloc( s * sizeof( uint ), 0 );
+        uint * i = (uint*)Allocator::alloc( s * sizeof( uint ), 0 );
+        uint * z = (uint*)Allocator::alloc( s * sizeof( uint ), 0 );
+        if ( n ) {
+            memmove( u, uids, n * sizeof( uint ) );
+            memmove( i, idates, n * sizeof( uint ) );
+            memmove( z, sizes, n * sizeof( uint ) );
+        }
+        uids = u;
+        idates = i;
+        sizes = z;
+        size = s;
+    }
+};
+
+
+/*! \class SessionIndex sessionindex.h
+    The SessionIndex class keeps the flags, internaldate and
+    rfc822size of each message in a Session, so that Selector can
+    evaluate the common SEARCH keys without asking the database.
+
+    The flags are kept as one IntegerSet per flag, and the two
+    numbers as arrays sorted by UID. Since a message's internaldate
+    and size never change, only its flags can become stale. Session
+    calls forget() for each message the SessionInitialiser reports as
+    new or changed, and the next refresh() reloads just those.
+
+    ready() returns true when the index covers every message in the
+    session. If it doesn't, refresh() loads the missing messages and
+    notifies its caller when that's done.
+*/
+
+
+/*! Constructs an empty index for \a session. */
+
+SessionIndex::SessionIndex( Session * session )
+    : d( new SessionIndexData )
+{
+    setLog( new Log );
+    d->session = session;
+}
+
+
+/*! Returns true if the index knows everything about each message in
+    the session, and false if refresh() needs to be called.
+*/
+
+bool SessionIndex::ready() const
+{
+    if ( d->broken || d->messages )
+        return false;
+    return d->known.contains( d->session->messages() );
+}
+
+
+/*! Returns true if refresh() failed, in which case the index should
+    not be used.
+*/
+
+bool SessionIndex::failed() const
+{
+    return d->broken;
+}
+
+
+/*! Starts loading whatever the index is missing, and arranges for \a
+    owner to be notified when that's done. Does nothing (except
+    remember \a owner) if a refresh is already running.
+*/
+
+void SessionIndex::refresh( EventHandler * owner )
+{
+    if ( owner )
+        d->waiting.append( owner );
+    if ( d->messages || d->broken )
+        return;
+
+    compact();
+
+    d->loading = d->session->messages();
+    d->loading.remove( d->known );
+    if ( d->loading.isEmpty() )
+        return;
+    d->changed.clear();
+
+    Map<IntegerSet>::Iterator i( d->flagged );
+    while ( i ) {
+        i->remove( d->loading );
+        ++i;
+    }
+
+    uint mailbox = d->session->mailbox()->id();
+
+    d->messages = new Query( "select mm.uid, mm.seen, mm.deleted, "
+                             "m.idate, m.rfc822size "
+                             "from mailbox_messages mm "
+                             "join messages m on (mm.message=m.id) "
+                             "where mm.mailbox=$1 and mm.uid=any($2)",
+                             this );
+    d->messages->bind( 1, mailbox );
+    d->messages->bind( 2, d->loading );
+    d->messages->execute();
+
+    d->flags = new Query( "select uid, flag from flags "
+                          "where mailbox=$1 and uid=any($2)", this );
+    d->flags->bind( 1, mailbox );
+    d->flags->bind( 2, d->loading );
+    d->flags->execute();
+}
+
+
+void SessionIndex::execute()
+{
+    Scope x( log() );
+
+    if ( !d->messages )
+        return;
+
+    uint seen = Flag::id( "\\seen" );
+    uint deleted = Flag::id( "\\deleted" );
+
+    Row * r;
+    while ( (r=d->messages->nextRow()) != 0 ) {
+        uint uid = r->getInt( "uid" );
+        setData( uid, r->getInt( "idate" ), r->getInt( "rfc822size" ) );
+        if ( seen && r->getBoolean( "seen" ) )
+            d->flag( seen )->add( uid );
+        if ( deleted && r->getBoolean( "deleted" ) )
+            d->flag( deleted )->add( uid );
+    }
+
+    while ( (r=d->flags->nextRow()) != 0 )
+        d->flag( r->getInt( "flag" ) )->add( r->getInt( "uid" ) );
+
+    if ( !d->messages->done() || !d->flags->done() )
+        return;
+
+    if ( d->messages->failed() || d->flags->failed() ) {
+        log( "Could not index session: " + d->messages->error() +
+             d->flags->error(), Log::Error );
+        d->broken = true;
+    }
+    else {
+        log( "Indexed " + fn( d->loading.count() ) + " messages",
+             Log::Debug );
+        d->loading.remove( d->changed );
+        d->known.add( d->loading );
+    }
+
+    d->messages = 0;
+    d->flags = 0;
+    d->loading.clear();
+    d->changed.clear();
+
+    List<EventHandler>::Iterator w( d->waiting );
+    while ( w ) {
+        EventHandler * h = w;
+        d->waiting.take( w );
+        h->notify();
+    }
+}
+
+
+/*! Records that the flags of the message with UID \a uid may have
+    changed, so the next refresh() needs to reload them.
+*/
+
+void SessionIndex::forget( uint uid )
+{
+    d->known.remove( uid );
+    if ( d->messages )
+        d->changed.add( uid );
+}
+
+
+/*! Records that the flags of each message in \a uids may have
+    changed.
+*/
+
+void SessionIndex::forget( const IntegerSet & uids )
+{
+    d->known.remove( uids );
+    if ( d->messages )
+        d->changed.add( uids );
+}
+
+
+/*! Returns the UIDs of the messages that have the flag whose id is
+    \a flag. The result may include messages that aren't in the
+    session any more.
+*/
+
+IntegerSet SessionIndex::flagged( uint flag ) const
+{
+    IntegerSet * s = d->flagged.find( flag );
+    if ( s )
+        return *s;
+    return IntegerSet();
+}
+
+
+/*! Returns the UIDs of the messages whose internaldate is at least
+    \a from and at most \a to.
+*/
+
+IntegerSet SessionIndex::receivedBetween( uint from, uint to ) const
+{
+    IntegerSet r;
+    uint i = 0;
+    while ( i < d->n ) {
+        if ( d->idates[i] >= from && d->idates[i] <= to )
+            r.add( d->uids[i] );
+        i++;
+    }
+    return r;
+}
+
+
+/*! Returns the UIDs of the messages whose rfc822size is at least \a
+    from and at most \a to.
+*/
+
+IntegerSet SessionIndex::sizeBetween( uint from, uint to ) const
+{
+    IntegerSet r;
+    uint i = 0;
+    while ( i < d->n ) {
+        if ( d->sizes[i] >= from && d->sizes[i] <= to )
+            r.add( d->uids[i] );
+        i++;
+    }
+    return r;
+}
+
+
+/*! Records that \a uid has internaldate \a idate and rfc822size \a
+    size. Since neither can change, this does nothing if \a uid is
+    known already.
+*/
+
+void SessionIndex::setData( uint uid, uint idate, uint size )
+{
+    uint i = d->n;
+    if ( d->n && d->uids[d->n-1] >= uid ) {
+        uint b = 0;
+        uint e = d->n;
+        while ( b < e ) {
+            uint m = ( b + e ) / 2;
+            if ( d->uids[m] < uid )
+                b = m + 1;
+            else
+                e = m;
+        }
+        if ( d->uids[b] == uid )
+            return;
+        i = b;
+    }
+
+    if ( d->n == d->size )
+        d->grow();
+    if ( i < d->n ) {
+        uint c = ( d->n - i ) * sizeof( uint );
+        memmove( d->uids + i + 1, d->uids + i, c );
+        memmove( d->idates + i + 1, d->idates + i, c );
+        memmove( d->sizes + i + 1, d->sizes + i, c );
+    }
+    d->uids[i] = uid;
+    d->idates[i] = idate;
+    d->sizes[i] = size;
+    d->n++;
+}
+
+
+/*! Discards the data for expunged messages once they make up more
+    than half of the index.
+*/
+
+void SessionIndex::compact()
+{
+    const IntegerSet & live = d->session->messages();
+    if ( d->n < 1024 || d->n <= 2 * live.count() )
+        return;
+
+    uint i = 0;
+    uint j = 0;
+    while ( i < d->n ) {
+        if ( live.contains( d->uids[i] ) ) {
+            d->uids[j] = d->uids[i];
+            d->idates[j] = d->idates[i];
+            d->sizes[j] = d->sizes[i];
+            j++;
+        }
+        i++;
+    }
+    d->n = j;
+
+    d->known = d->known.intersection( live );
+    Map<IntegerSet>::Iterator f( d->flagged );
+    while ( f ) {
+        *f = f->intersection( live );
+        ++f;
+    }
+}
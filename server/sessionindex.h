@@ -0,0 +1,39 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef SESSIONINDEX_H
+#define SESSIONINDEX_H
+
+#include "event.h"
+#include "integerset.h"
+
+class Session;
+
+
+class SessionIndex
+    : public EventHandler
+{
+public:
+    SessionIndex( Session * );
+
+    bool ready() const;
+    bool failed() const;
+    void refresh( EventHandler * );
+
+    void execute();
+
+    void forget( uint );
+    void forget( const IntegerSet & );
+
+    IntegerSet flagged( uint ) const;
+    IntegerSet receivedBetween( uint, uint ) const;
+    IntegerSet sizeBetween( uint, uint ) const;
+
+private:
+    class SessionIndexData * d;
+
+    void setData( uint, uint, uint );
+    void compact();
+};
+
+
+#endif
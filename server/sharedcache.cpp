@@ -0,0 +1,220 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "sharedcache.h"
+
+#include "graph.h"
+#include "log.h"
+
+// mmap
+#include <sys/mman.h>
+// memcpy
+#include <string.h>
+// errno
+#include <errno.h>
+
+
+// The segment is an array of fixed-size slots. Each slot is guarded
+// by a sequence number, which is odd while a process writes the slot.
+// Readers copy the slot and check that the sequence number didn't
+// change meanwhile; writers that find a slot busy simply don't write.
+// A slot stored under a string key holds the key followed by the
+// value, and keyLength says how long the key is; numeric keys have a
+// keyLength of 0, so the two kinds never match each other.
+
+static const uint slotSize = 2048;
+
+struct Slot
+{
+    volatile uint sequence;
+    uint key;
+    uint keyLength;
+    uint length;
+    char data[slotSize - 4 * sizeof( uint )];
+};
+
+static const uint maxLength = sizeof( ((Slot *)0)->data );
+
+static Slot * slots = 0;
+static uint numSlots = 0;
+static GraphableCounter * hits = 0;
+static GraphableCounter * misses = 0;
+
+
+/*! \class SharedCache sharedcache.h
+
+    The SharedCache class provides a small cache shared by all the
+    processes of a server, outside the garbage-collected heap.
+
+    setup() maps an anonymous shared memory segment, and must be
+    called before the server forks its children. Thereafter any
+    process may insert() a string under a nonzero key (or a nonempty
+    string key) and any process may find() it, until something else
+    is inserted with a key that hashes to the same slot. Strings
+    longer than about 2KB aren't cached at all.
+
+    Since the segment is shared, the cache needs no locks: a reader
+    that sees a slot change while reading it treats that as a miss.
+    Callers must therefore be able to recompute anything they cache.
+*/
+
+
+/*! Maps a shared segment of \a size bytes, unless that's too small
+    to be useful, or the segment has already been mapped.
+*/
+
+void SharedCache::setup( uint size )
+{
+    if ( ::slots || size < 16 * slotSize )
+        return;
+
+    void * p = ::mmap( 0, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if ( p == MAP_FAILED ) {
+        log( "Unable to map shared cache. Error code " + fn( errno ),
+             Log::Error );
+        return;
+    }
+
+    ::slots = (Slot *)p;
+    ::numSlots = size / slotSize;
+    log( "Sharing " + fn( ::numSlots ) + " cache slots between processes",
+         Log::Debug );
+}
+
+
+/*! Returns true if setup() has mapped the shared segment, and false
+    if find() will never find anything.
+*/
+
+bool SharedCache::enabled()
+{
+    return ::slots != 0;
+}
+
+
+static Slot * slot( uint key )
+{
+    uint h = key * 2654435761u;
+    return &::slots[( h ^ ( h >> 16 ) ) % ::numSlots];
+}
+
+
+// returns the hash of the string key k, which is never 0
+
+static uint hash( const EString & k )
+{
+    uint h = 2166136261u;
+    uint i = 0;
+    while ( i < k.length() ) {
+        h = ( h ^ (unsigned char)k[i] ) * 16777619u;
+        i++;
+    }
+    if ( !h )
+        h = 1;
+    return h;
+}
+
+
+// does the work for both kinds of find(): returns the value stored
+// in key's slot under the string key k (empty for numeric keys)
+
+static EString lookup( uint key, const EString & k )
+{
+    if ( !::slots || !key )
+        return "";
+    if ( !::hits ) {
+        ::hits = new GraphableCounter( "shared-cache-hits" );
+        ::misses = new GraphableCounter( "shared-cache-misses" );
+    }
+
+    Slot * s = slot( key );
+    uint before = s->sequence;
+    __sync_synchronize();
+    EString r;
+    if ( !( before & 1 ) && s->key == key && s->length <= maxLength &&
+         s->keyLength == k.length() && s->keyLength < s->length &&
+         !memcmp( s->data, k.data(), k.length() ) )
+        r.append( s->data + s->keyLength, s->length - s->keyLength );
+    __sync_synchronize();
+    if ( s->sequence != before )
+        r.truncate();
+
+    if ( r.isEmpty() )
+        ::misses->tick();
+    else
+        ::hits->tick();
+    return r;
+}
+
+
+// does the work for both kinds of insert()
+
+static void store( uint key, const EString & k, const EString & value )
+{
+    if ( !::slots || !key || value.isEmpty() ||
+         k.length() + value.length() > maxLength )
+        return;
+
+    Slot * s = slot( key );
+    uint before = s->sequence;
+    if ( ( before & 1 ) ||
+         !__sync_bool_compare_and_swap( &s->sequence, before, before + 1 ) )
+        return;
+
+    s->key = key;
+    s->keyLength = k.length();
+    s->length = k.length() + value.length();
+    memcpy( s->data, k.data(), k.length() );
+    memcpy( s->data + k.length(), value.data(), value.length() );
+    __sync_synchronize();
+    s->sequence = before + 2;
+}
+
+
+/*! Returns the string most recently inserted under \a key, or an
+    empty string if there isn't one.
+*/
+
+EString SharedCache::find( uint key )
+{
+    return lookup( key, "" );
+}
+
+
+/*! Stores \a value under \a key, replacing whatever was in its slot,
+    or does nothing if \a value is too long or another process is
+    writing the slot just now.
+*/
+
+void SharedCache::insert( uint key, const EString & value )
+{
+    store( key, "", value );
+}
+
+
+/*! \overload
+
+    Returns the string most recently inserted under the string \a
+    key, or an empty string if there isn't one. String keys never
+    match numeric keys.
+*/
+
+EString SharedCache::find( const EString & key )
+{
+    if ( key.isEmpty() )
+        return "";
+    return lookup( hash( key ), key );
+}
+
+
+/*! \overload
+
+    Stores \a value under the string \a key. The key is stored along
+    with the value, so the two together must fit in a slot.
+*/
+
+void SharedCache::insert( const EString & key, const EString & value )
+{
+    if ( !key.isEmpty() )
+        store( hash( key ), key, value );
+}
@@ -0,0 +1,334 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "span.h"
+
+#include "log.h"
+#include "dict.h"
+#include "event.h"
+#include "timer.h"
+#include "estring.h"
+#include "allocator.h"
+#include "configuration.h"
+
+// open
+#include <fcntl.h>
+// write, lseek, getpid
+#include <unistd.h>
+// atexit
+#include <stdlib.h>
+// gettimeofday
+#include <sys/time.h>
+
+// we want large file support if available, but don't care
+#if !defined(O_LARGEFILE)
+#define O_LARGEFILE 0
+#endif
+
+
+static int traceFd = -1;
+static uint sampling = 1;
+static uint roots = 0;
+static uint nextId = 1;
+static EString * pending = 0;
+static Dict<Span> * spansByLog = 0;
+
+
+class SpanData
+    : public Garbage
+{
+public:
+    SpanData()
+        : id( 0 ), parent( 0 ), track( 0 ), started( 0 ), ended( false )
+    {}
+
+    EString name;
+    uint id;
+    uint parent;
+    uint track;
+    int64 started;
+    EString log;
+    EString arguments;
+    bool ended;
+};
+
+
+// flushes the trace file once per second, so that a quiet server's
+// traces don't linger in RAM.
+
+class SpanFlusher
+    : public EventHandler
+{
+public:
+    SpanFlusher(): t( new Timer( this, 1 ) ) { t->setRepeating( true ); }
+
+    void execute() { Span::flush(); }
+
+    Timer * t;
+};
+
+
+// returns the current time in microseconds since the epoch
+
+static int64 now()
+{
+    struct timeval tv;
+    (void)::gettimeofday( &tv, 0 );
+    return (int64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+// appends \a v to \a s as a JSON string
+
+static void appendJson( EString & s, const EString & v )
+{
+    s.append( '"' );
+    uint i = 0;
+    while ( i < v.length() ) {
+        char c = v[i];
+        if ( c == '"' || c == '\\' ) {
+            s.append( '\\' );
+            s.append( c );
+        }
+        else if ( c < 32 ) {
+            s.append( ' ' );
+        }
+        else {
+            s.append( c );
+        }
+        i++;
+    }
+    s.append( '"' );
+}
+
+
+static void flushAtExit()
+{
+    Span::flush();
+}
+
+
+/*! \class Span span.h
+    The Span class records how long something took, so that the whole
+    life of e.g. an IMAP session can be examined afterwards: When each
+    command started and ended, which transactions and queries it
+    caused, and when each of those ran.
+
+    Spans form a tree. A root() span is started for each client
+    session (if the session is sampled, see trace-sampling), and other
+    spans are started as children of it or of each other, either
+    explicitly or by finding the nearest span associated with a Log or
+    its parents (see setLog()). If there is no suitable parent, no
+    span is created, so tracing costs next to nothing for most
+    objects when it's disabled or the session isn't sampled.
+
+    When a span ends, it is written to the trace-file in the Chrome
+    trace event format, as a "complete" event. Each session is shown
+    as one thread, and each span's arguments include its ID and its
+    parent's ID. The file is a JSON array without the closing
+    bracket, which the format permits.
+*/
+
+
+/*! Constructs a span called \a name, with \a parent as parent (if
+    any), and associates it with \a log (if nonzero).
+*/
+
+Span::Span( const char * name, Span * parent, Log * log )
+    : d( new SpanData )
+{
+    d->name = name;
+    d->id = nextId++;
+    d->started = now();
+    if ( parent ) {
+        d->parent = parent->d->id;
+        d->track = parent->d->track;
+    }
+    else {
+        d->track = d->id;
+    }
+    if ( log )
+        setLog( log );
+}
+
+
+/*! Starts and returns a new span called \a name with no parent, and
+    associates it with \a log, so that spans started for its children
+    have this as parent.
+
+    Returns a null pointer if tracing is disabled, or if this root
+    isn't sampled.
+*/
+
+Span * Span::root( const char * name, Log * log )
+{
+    if ( traceFd < 0 )
+        return 0;
+    roots++;
+    if ( sampling > 1 && roots % sampling )
+        return 0;
+    return new Span( name, 0, log );
+}
+
+
+/*! Starts and returns a new span called \a name, whose parent is the
+    span associated with \a log or with its closest ancestor. Returns
+    a null pointer if there is no such span.
+
+    The new span isn't associated with \a log; call setLog() if it
+    should be.
+*/
+
+Span * Span::start( const char * name, Log * log )
+{
+    if ( !spansByLog || spansByLog->isEmpty() )
+        return 0;
+    Log * l = log;
+    while ( l ) {
+        Span * p = spansByLog->find( l->id() );
+        if ( p )
+            return new Span( name, p, 0 );
+        l = l->parent();
+    }
+    return 0;
+}
+
+
+/*! Starts and returns a new span called \a name as a child of \a
+    parent. Returns a null pointer if \a parent is null.
+*/
+
+Span * Span::start( const char * name, Span * parent )
+{
+    if ( !parent )
+        return 0;
+    return new Span( name, parent, 0 );
+}
+
+
+/*! Changes this span's name to \a name. */
+
+void Span::setName( const EString & name )
+{
+    d->name = name;
+}
+
+
+/*! Records that this span's argument \a name has value \a value. The
+    trace viewer shows arguments when the span is selected.
+*/
+
+void Span::setArgument( const char * name, const EString & value )
+{
+    d->arguments.append( ",\"" );
+    d->arguments.append( name );
+    d->arguments.append( "\":" );
+    appendJson( d->arguments, value );
+}
+
+
+/*! Associates this span with \a log, so that start() uses it as
+    parent for spans started for \a log or its descendants, until
+    end() is called.
+*/
+
+void Span::setLog( Log * log )
+{
+    if ( !log || !spansByLog )
+        return;
+    d->log = log->id();
+    spansByLog->insert( d->log, this );
+}
+
+
+/*! Ends this span and writes it to the trace file. Calling end() more
+    than once has no effect.
+*/
+
+void Span::end()
+{
+    if ( d->ended )
+        return;
+    d->ended = true;
+
+    if ( !d->log.isEmpty() && spansByLog->find( d->log ) == this )
+        spansByLog->remove( d->log );
+
+    if ( traceFd < 0 )
+        return;
+
+    EString & e = *pending;
+    e.append( "{\"name\":" );
+    appendJson( e, d->name );
+    e.append( ",\"ph\":\"X\",\"pid\":" );
+    e.appendNumber( (int)getpid() );
+    e.append( ",\"tid\":" );
+    e.appendNumber( d->track );
+    e.append( ",\"ts\":" );
+    e.appendNumber( d->started );
+    e.append( ",\"dur\":" );
+    e.appendNumber( now() - d->started );
+    e.append( ",\"args\":{\"id\":" );
+    e.appendNumber( d->id );
+    if ( d->parent ) {
+        e.append( ",\"parent\":" );
+        e.appendNumber( d->parent );
+    }
+    e.append( d->arguments );
+    e.append( "}},\n" );
+
+    if ( e.length() > 65536 )
+        flush();
+}
+
+
+/*! Opens the trace-file, if one is configured. This must be called
+    before the server gives up its privileges, and after the EventLoop
+    is created.
+*/
+
+void Span::setup()
+{
+    EString name = Configuration::text( Configuration::TraceFile );
+    if ( name.isEmpty() )
+        return;
+
+    traceFd = ::open( name.cstr(),
+                      O_WRONLY|O_APPEND|O_CREAT|O_LARGEFILE, 0600 );
+    if ( traceFd < 0 ) {
+        ::log( "Cannot open trace-file " + name, Log::Error );
+        return;
+    }
+    if ( ::lseek( traceFd, 0, SEEK_END ) == 0 ) {
+        if ( ::write( traceFd, "[\n", 2 ) ) {
+            // nothing to do if it fails
+        }
+    }
+
+    sampling = Configuration::scalar( Configuration::TraceSampling );
+    pending = new EString;
+    Allocator::addEternal( pending, "unwritten trace events" );
+    spansByLog = new Dict<Span>;
+    Allocator::addEternal( spansByLog, "open trace spans" );
+    Allocator::addEternal( new SpanFlusher, "trace flusher" );
+    ::atexit( flushAtExit );
+}
+
+
+/*! Writes all ended spans to the trace file. end() and a timer call
+    this as needed.
+*/
+
+void Span::flush()
+{
+    if ( traceFd < 0 || !pending || pending->isEmpty() )
+        return;
+    uint done = 0;
+    while ( done < pending->length() ) {
+        int r = ::write( traceFd, pending->data() + done,
+                         pending->length() - done );
+        if ( r <= 0 )
+            break;
+        done += r;
+    }
+    pending->truncate();
+}
@@ -0,0 +1,35 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef SPAN_H
+#define SPAN_H
+
+#include "global.h"
+
+class EString;
+class Log;
+
+
+class Span
+    : public Garbage
+{
+public:
+    static Span * root( const char *, Log * );
+    static Span * start( const char *, Log * );
+    static Span * start( const char *, Span * );
+
+    void setName( const EString & );
+    void setArgument( const char *, const EString & );
+    void setLog( Log * );
+    void end();
+
+    static void setup();
+    static void flush();
+
+private:
+    Span( const char *, Span *, Log * );
+
+    class SpanData * d;
+};
+
+
+#endif
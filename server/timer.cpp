@@ -11,14 +11,23 @@
 #include <time.h>
 
 
+static const uint NoSlot = UINT_MAX;
+
+
 class TimerData
     : public Garbage
 {
 public:
-    TimerData(): owner( 0 ), timeout( 0 ), interval( 0 ), repeating( false ) {}
+    TimerData()
+        : owner( 0 ), prev( 0 ), next( 0 ),
+          timeout( 0 ), interval( 0 ), slot( NoSlot ), repeating( false )
+    {}
     EventHandler * owner;
+    Timer * prev;
+    Timer * next;
     uint timeout;
     uint interval;
+    uint slot;
     bool repeating;
 };
 
@@ -133,6 +142,7 @@ void Timer::notify()
 
     Scope s( d->owner->log() );
     try {
+        EventClock clock( d->owner );
         d->owner->execute();
     }
     catch ( const Exception& e ) {
@@ -190,3 +200,241 @@ bool Timer::repeating() const
 {
     return d->repeating;
 }
+
+
+static const uint NearBits = 8;
+static const uint NearSlots = 1 << NearBits;
+static const uint NearMask = NearSlots - 1;
+static const uint FarSlots = 64;
+static const uint FarSpan = NearSlots * FarSlots;
+static const uint Far = NearSlots;
+static const uint Rest = Far + FarSlots;
+static const uint Due = Rest + 1;
+static const uint Firing = Due + 1;
+static const uint NumSlots = Firing + 1;
+
+
+class TimerWheelData
+    : public Garbage
+{
+public:
+    TimerWheelData(): current( time( 0 ) ), count( 0 ) {
+        uint i = 0;
+        while ( i < NumSlots )
+            slots[i++] = 0;
+        setFirstNonPointer( &current );
+    }
+
+    Timer * slots[NumSlots];
+    // no pointers after this line
+    uint current;
+    uint count;
+};
+
+
+/*! \class TimerWheel timer.h
+
+    The TimerWheel class keeps track of the Timer objects belonging to
+    an EventLoop, such that inserting and removing a Timer costs
+    O(1), and such that finding the next timeout and the Timers that
+    have expired is cheap, no matter how many Timers there are.
+
+    It is a two-level hashed timing wheel with second resolution. The
+    first level has a slot for each of the next 256 seconds, the
+    second a slot for each of the next 64 256-second periods, and
+    anything further in the future is kept in a separate list. When
+    the first level wraps around, the next second-level slot is
+    redistributed into it, and so on. Each Timer knows its own slot
+    and neighbours, so removal needs no search.
+
+    run() executes each Timer that has expired, and nextTimeout()
+    says when run() next needs to be called.
+*/
+
+
+/*! Constructs an empty TimerWheel whose current time is the time of
+    construction.
+*/
+
+TimerWheel::TimerWheel()
+    : Garbage(), d( new TimerWheelData )
+{
+}
+
+
+/*! This private helper adds \a t to \a slot. */
+
+void TimerWheel::link( Timer * t, uint slot )
+{
+    t->d->slot = slot;
+    t->d->prev = 0;
+    t->d->next = d->slots[slot];
+    if ( t->d->next )
+        t->d->next->d->prev = t;
+    d->slots[slot] = t;
+    d->count++;
+}
+
+
+/*! This private helper removes \a t from whatever slot it's in, if
+    any.
+*/
+
+void TimerWheel::unlink( Timer * t )
+{
+    if ( t->d->slot == NoSlot )
+        return;
+    if ( t->d->prev )
+        t->d->prev->d->next = t->d->next;
+    else
+        d->slots[t->d->slot] = t->d->next;
+    if ( t->d->next )
+        t->d->next->d->prev = t->d->prev;
+    t->d->prev = 0;
+    t->d->next = 0;
+    t->d->slot = NoSlot;
+    d->count--;
+}
+
+
+/*! Records that \a t exists, and puts it into the slot corresponding
+    to its Timer::timeout(). Does nothing if \a t isn't active. If \a
+    t already is in the wheel, it's moved.
+*/
+
+void TimerWheel::insert( Timer * t )
+{
+    unlink( t );
+    if ( !t->active() )
+        return;
+
+    uint tm = t->timeout();
+    if ( tm <= d->current )
+        link( t, Due );
+    else if ( tm - d->current < NearSlots )
+        link( t, tm & NearMask );
+    else if ( tm - d->current < FarSpan )
+        link( t, Far + ( ( tm >> NearBits ) % FarSlots ) );
+    else
+        link( t, Rest );
+}
+
+
+/*! Forgets \a t. Nothing happens if \a t isn't in the wheel. */
+
+void TimerWheel::remove( Timer * t )
+{
+    unlink( t );
+}
+
+
+/*! Returns the earliest time at which run() may have something to
+    do, or \a limit if that time is after \a limit. The cost is
+    proportional to the number of seconds until the return value.
+*/
+
+uint TimerWheel::nextTimeout( uint limit ) const
+{
+    if ( d->slots[Due] )
+        return d->current;
+
+    uint s = d->current + 1;
+    while ( s <= limit && s < d->current + NearSlots ) {
+        if ( d->slots[s & NearMask] )
+            return s;
+        if ( !( s & NearMask ) &&
+             d->slots[Far + ( ( s >> NearBits ) % FarSlots )] )
+            return s;
+        s++;
+    }
+    return limit;
+}
+
+
+/*! This private helper redistributes the timers in the second-level
+    slot for the period starting at \a s, and if \a s is the start of
+    a second-level revolution, the timers in the far future too.
+*/
+
+void TimerWheel::cascade( uint s )
+{
+    uint slot = Far + ( ( s >> NearBits ) % FarSlots );
+    while ( d->slots[slot] ) {
+        Timer * t = d->slots[slot];
+        unlink( t );
+        link( t, Firing );
+    }
+    if ( !( s % FarSpan ) ) {
+        while ( d->slots[Rest] ) {
+            Timer * t = d->slots[Rest];
+            unlink( t );
+            link( t, Firing );
+        }
+    }
+    while ( d->slots[Firing] )
+        insert( d->slots[Firing] );
+}
+
+
+/*! Executes all Timers whose timeout is at or before \a now, and
+    advances the wheel to \a now. Repeating Timers are put back into
+    the wheel after execution.
+
+    If the clock has gone backwards or jumped far forwards, all Timers
+    are redistributed first.
+*/
+
+void TimerWheel::run( uint now )
+{
+    if ( now < d->current || now - d->current > NearSlots ) {
+        uint i = 0;
+        while ( i < Firing ) {
+            while ( d->slots[i] ) {
+                Timer * t = d->slots[i];
+                unlink( t );
+                link( t, Firing );
+            }
+            i++;
+        }
+        d->current = now;
+        while ( d->slots[Firing] )
+            insert( d->slots[Firing] );
+    }
+
+    uint slot = Due;
+    while ( slot != NoSlot ) {
+        // move the timers to a private list, so that we can cope
+        // with timers being added and removed by the owners
+        while ( d->slots[slot] ) {
+            Timer * t = d->slots[slot];
+            unlink( t );
+            link( t, Firing );
+        }
+        while ( d->slots[Firing] ) {
+            Timer * t = d->slots[Firing];
+            unlink( t );
+            if ( t->active() && t->timeout() <= now )
+                t->execute();
+            if ( t->active() && t->d->slot == NoSlot )
+                insert( t );
+        }
+
+        if ( d->current < now ) {
+            d->current++;
+            if ( !( d->current & NearMask ) )
+                cascade( d->current );
+            slot = d->current & NearMask;
+        }
+        else {
+            slot = NoSlot;
+        }
+    }
+}
+
+
+/*! Returns the number of Timers in the wheel. */
+
+uint TimerWheel::count() const
+{
+    return d->count;
+}
@@ -27,6 +27,30 @@ public:
 
 private:
     class TimerData * d;
+    friend class TimerWheel;
+};
+
+
+class TimerWheel
+    : public Garbage
+{
+public:
+    TimerWheel();
+
+    void insert( Timer * );
+    void remove( Timer * );
+
+    uint nextTimeout( uint ) const;
+    void run( uint );
+
+    uint count() const;
+
+private:
+    class TimerWheelData * d;
+
+    void link( Timer *, uint );
+    void unlink( Timer * );
+    void cascade( uint );
 };
 
 #endif
@@ -0,0 +1,578 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "tlsengine.h"
+
+#include "log.h"
+#include "file.h"
+#include "graph.h"
+#include "buffer.h"
+#include "estring.h"
+#include "sharedcache.h"
+#include "configuration.h"
+
+// shutdown
+#include <sys/socket.h>
+// memcmp, memcpy
+#include <string.h>
+// time
+#include <time.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+
+// the largest amount of cleartext handed to SSL_write() at once,
+// which is also the largest TLS record
+static const uint bs = 16384;
+
+
+class TlsEngineData
+    : public Garbage
+{
+public:
+    TlsEngineData()
+        : ssl( 0 ), fd( -1 ), r( 0 ), w( 0 ),
+          writing( 0 ),
+          readWantsWrite( false ), writeWantsRead( false ),
+          handshaken( false ), broken( false )
+    {}
+
+    SSL * ssl;
+    int fd;
+    Buffer * r;
+    Buffer * w;
+
+    // the length of an SSL_write() that has to be retried, or 0
+    uint writing;
+    bool readWantsWrite;
+    bool writeWantsRead;
+    bool handshaken;
+    bool broken;
+};
+
+
+static SSL_CTX * ctx = 0;
+static GraphableCounter * handshakes = 0;
+static GraphableCounter * resumptions = 0;
+
+// the session lifetime, and a secret from which all session ticket
+// keys are derived. setup() picks the secret before the server
+// forks, so all processes use the same keys.
+static uint lifetime = 0;
+static unsigned char ticketSecret[32];
+
+
+// a session ticket key, derived from the secret and the number of
+// the lifetime period in which it is used
+
+class TicketKey
+{
+public:
+    TicketKey( uint period ) {
+        derive( "name", period, name, sizeof( name ) );
+        derive( "aes", period, aes, sizeof( aes ) );
+        derive( "hmac", period, hmac, sizeof( hmac ) );
+    }
+
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+
+private:
+    static void derive( const char * label, uint period,
+                        unsigned char * out, uint length ) {
+        unsigned char in[64];
+        uint l = strlen( label );
+        memcpy( in, label, l );
+        memcpy( in + l, &period, sizeof( period ) );
+        memcpy( in + l + sizeof( period ), ticketSecret,
+                sizeof( ticketSecret ) );
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int mdl = 0;
+        (void)EVP_Digest( in, l + sizeof( period ) + sizeof( ticketSecret ),
+                          md, &mdl, EVP_sha256(), 0 );
+        memcpy( out, md, length < mdl ? length : mdl );
+    }
+};
+
+
+// prepares h to compute the HMAC-SHA256 of a ticket using k, and
+// returns true if that worked. OpenSSL 3 deprecates HMAC_CTX, so
+// there we use an EVP_MAC.
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX TicketMac;
+
+static bool initMac( EVP_MAC_CTX * h, const TicketKey & k )
+{
+    OSSL_PARAM p[2];
+    p[0] = OSSL_PARAM_construct_utf8_string( OSSL_MAC_PARAM_DIGEST,
+                                             (char *)"SHA256", 0 );
+    p[1] = OSSL_PARAM_construct_end();
+    return EVP_MAC_init( h, k.hmac, sizeof( k.hmac ), p ) > 0;
+}
+#else
+typedef HMAC_CTX TicketMac;
+
+static bool initMac( HMAC_CTX * h, const TicketKey & k )
+{
+    return HMAC_Init_ex( h, k.hmac, sizeof( k.hmac ), EVP_sha256(), 0 ) > 0;
+}
+#endif
+
+
+// OpenSSL calls this to encrypt (enc is 1) or decrypt a session
+// ticket. tickets made with the previous period's key are accepted,
+// and renewed (that's the 2).
+
+static int ticketKey( SSL *, unsigned char * name, unsigned char * iv,
+                      EVP_CIPHER_CTX * c, TicketMac * h, int enc )
+{
+    uint period = time( 0 ) / lifetime;
+    if ( enc ) {
+        TicketKey k( period );
+        if ( RAND_bytes( iv, EVP_CIPHER_iv_length( EVP_aes_256_cbc() ) )
+             <= 0 )
+            return -1;
+        memcpy( name, k.name, sizeof( k.name ) );
+        EVP_EncryptInit_ex( c, EVP_aes_256_cbc(), 0, k.aes, iv );
+        if ( !initMac( h, k ) )
+            return -1;
+        return 1;
+    }
+
+    uint i = 0;
+    while ( i < 2 ) {
+        TicketKey k( period - i );
+        if ( !memcmp( name, k.name, sizeof( k.name ) ) ) {
+            if ( !initMac( h, k ) )
+                return -1;
+            EVP_DecryptInit_ex( c, EVP_aes_256_cbc(), 0, k.aes, iv );
+            return i ? 2 : 1;
+        }
+        i++;
+    }
+    return 0;
+}
+
+
+// the two callbacks store sessions in the SharedCache, so that a
+// client can resume its session with another process
+
+static EString sessionKey( const unsigned char * id, uint length )
+{
+    return "tls-session:" + EString( (const char *)id, length );
+}
+
+
+static int newSession( SSL *, SSL_SESSION * s )
+{
+    if ( !SharedCache::enabled() )
+        return 0;
+    unsigned char b[2048];
+    int n = i2d_SSL_SESSION( s, 0 );
+    if ( n <= 0 || n > (int)sizeof( b ) )
+        return 0;
+    unsigned char * p = b;
+    n = i2d_SSL_SESSION( s, &p );
+    unsigned int l = 0;
+    const unsigned char * id = SSL_SESSION_get_id( s, &l );
+    SharedCache::insert( sessionKey( id, l ), EString( (char *)b, n ) );
+    // we don't keep a reference to s
+    return 0;
+}
+
+
+static SSL_SESSION * getSession( SSL *, const unsigned char * id, int l,
+                                 int * copy )
+{
+    *copy = 0;
+    EString v( SharedCache::find( sessionKey( id, l ) ) );
+    if ( v.isEmpty() )
+        return 0;
+    const unsigned char * p = (const unsigned char *)v.data();
+    return d2i_SSL_SESSION( 0, &p, v.length() );
+}
+
+
+// returns the name of the file containing the certificate chain and
+// private key, as seen from inside the jail.
+
+static EString certificateFile()
+{
+    EString keyFile( Configuration::text( Configuration::TlsCertFile ) );
+    if ( keyFile.isEmpty() ) {
+        keyFile = Configuration::compiledIn( Configuration::LibDir );
+        keyFile.append( "/automatic-key.pem" );
+    }
+    return File::chrooted( keyFile );
+}
+
+
+/*! Performs any OpenSSL initialisation needed to create TlsEngine
+    and TlsThread objects later.
+*/
+
+void TlsEngine::setup()
+{
+    if ( ctx )
+        return;
+
+    SSL_load_error_strings();
+    SSL_library_init();
+
+    ctx = ::SSL_CTX_new( SSLv23_server_method() );
+    long options = SSL_OP_ALL
+        // also try to pick the same ciphers suites more often
+        | SSL_OP_CIPHER_SERVER_PREFERENCE
+        // and don't use SSLv2, even if the client wants to
+        | SSL_OP_NO_SSLv2
+        // and not v3 either
+        | SSL_OP_NO_SSLv3
+        ;
+    SSL_CTX_set_options( ctx, options );
+
+    // TlsEngine retries writes with the same length, but not with
+    // the same pointer, and likes to know about partial writes
+    SSL_CTX_set_mode( ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                      SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER );
+
+    SSL_CTX_set_cipher_list( ctx, "kEDH:HIGH:!aNULL:!MD5" );
+
+    EString keyFile = certificateFile();
+    if ( !SSL_CTX_use_certificate_chain_file( ctx, keyFile.cstr() ) ||
+         !SSL_CTX_use_RSAPrivateKey_file( ctx, keyFile.cstr(),
+                                          SSL_FILETYPE_PEM ) )
+        log( "OpenSSL needs both the certificate and "
+             "private key in this file: " + keyFile,
+             Log::Disaster );
+    // we go on anyway; the disaster will take down the server in
+    // a hurry.
+
+    // we don't ask for a client cert
+    SSL_CTX_set_verify( ctx, SSL_VERIFY_NONE, NULL );
+
+    // clients may resume sessions using tickets or session IDs
+    lifetime = Configuration::scalar( Configuration::TlsSessionLifetime );
+    if ( !lifetime ||
+         RAND_bytes( ticketSecret, sizeof( ticketSecret ) ) <= 0 ) {
+        SSL_CTX_set_session_cache_mode( ctx, SSL_SESS_CACHE_OFF );
+        SSL_CTX_set_options( ctx, SSL_OP_NO_TICKET );
+        return;
+    }
+    SSL_CTX_set_timeout( ctx, lifetime );
+    SSL_CTX_set_session_id_context( ctx, (const unsigned char *)"aox", 3 );
+    SSL_CTX_set_session_cache_mode( ctx, SSL_SESS_CACHE_SERVER );
+    SSL_CTX_sess_set_new_cb( ctx, newSession );
+    SSL_CTX_sess_set_get_cb( ctx, getSession );
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb( ctx, ticketKey );
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb( ctx, ticketKey );
+#endif
+}
+
+
+/*! Loads the certificate named by tls-certificate again, e.g. after
+    the configuration has been reread or the certificate renewed, so
+    that new TLS sessions use it. Existing sessions are not affected.
+
+    The new certificate and key are checked first, and if they cannot
+    be used, the old ones are kept. Does nothing if setup() hasn't
+    been called.
+*/
+
+void TlsEngine::reconfigure()
+{
+    if ( !ctx )
+        return;
+
+    EString keyFile = certificateFile();
+    SSL_CTX * test = ::SSL_CTX_new( SSLv23_server_method() );
+    bool ok = test &&
+              SSL_CTX_use_certificate_chain_file( test, keyFile.cstr() ) &&
+              SSL_CTX_use_RSAPrivateKey_file( test, keyFile.cstr(),
+                                              SSL_FILETYPE_PEM ) &&
+              SSL_CTX_check_private_key( test );
+    if ( test )
+        SSL_CTX_free( test );
+    if ( !ok ||
+         !SSL_CTX_use_certificate_chain_file( ctx, keyFile.cstr() ) ||
+         !SSL_CTX_use_RSAPrivateKey_file( ctx, keyFile.cstr(),
+                                          SSL_FILETYPE_PEM ) ) {
+        ERR_clear_error();
+        log( "Cannot use the certificate and private key in " + keyFile +
+             "; keeping the old ones", Log::Error );
+        return;
+    }
+    log( "Loaded the TLS certificate in " + keyFile );
+}
+
+
+/*! Returns the OpenSSL context shared by all TlsEngine and TlsThread
+    objects, calling setup() first if necessary.
+*/
+
+SSL_CTX * TlsEngine::context()
+{
+    if ( !ctx )
+        setup();
+    return ctx;
+}
+
+
+/*! \class TlsEngine tlsengine.h
+    Runs TLS on a Connection's socket from within the EventLoop.
+
+    A TlsEngine lets OpenSSL read and write the encrypted data
+    directly on the socket, decrypts into the Connection's read
+    Buffer and encrypts from its write Buffer. Unlike TlsThread, it
+    needs no thread, no socketpair and no copying between the two.
+
+    Clients may resume TLS sessions for tls-session-lifetime seconds,
+    using session tickets or session IDs. The ticket keys are derived
+    from a secret shared by all server processes and change after each
+    such period, and session IDs are cached in the SharedCache. The
+    tls-handshakes and tls-resumptions counters show how often
+    clients resume.
+
+    If use-kernel-tls is enabled and OpenSSL and the kernel support
+    it, the record encryption is offloaded to the kernel after the
+    handshake.
+
+    When TLS fails or the peer closes the TLS session, the TlsEngine
+    shuts the socket down, so that the EventLoop notices and the
+    Connection is closed in the usual way.
+*/
+
+
+/*! Constructs a TlsEngine for the nonblocking socket \a fd, which
+    decrypts into \a r and encrypts from \a w. If \a asClient is
+    supplied and true (the default is false), the engine initiates
+    the handshake. If not, it acts as a server and expects the peer
+    to initiate the handshake.
+*/
+
+TlsEngine::TlsEngine( int fd, Buffer * r, Buffer * w, bool asClient )
+    : d( new TlsEngineData )
+{
+    d->fd = fd;
+    d->r = r;
+    d->w = w;
+    d->ssl = ::SSL_new( context() );
+    if ( !d->ssl || !::SSL_set_fd( d->ssl, fd ) ) {
+        d->broken = true;
+        return;
+    }
+#ifdef SSL_OP_ENABLE_KTLS
+    if ( Configuration::toggle( Configuration::UseKernelTls ) )
+        SSL_set_options( d->ssl, SSL_OP_ENABLE_KTLS );
+#endif
+    if ( asClient ) {
+        SSL_set_connect_state( d->ssl );
+        // sends the ClientHello, or learns that it has to wait
+        int n = ::SSL_do_handshake( d->ssl );
+        if ( n <= 0 )
+            (void)fail( n );
+    }
+    else {
+        SSL_set_accept_state( d->ssl );
+    }
+}
+
+
+/*! Reads and decrypts as much as possible from the socket, and
+    appends the cleartext to the read Buffer. Any handshake data
+    OpenSSL has to send in response is sent at once.
+*/
+
+void TlsEngine::read()
+{
+    if ( d->broken || !d->ssl )
+        return;
+
+    d->readWantsWrite = false;
+    char buf[bs];
+    bool more = true;
+    while ( more ) {
+        ERR_clear_error();
+        int n = ::SSL_read( d->ssl, buf, bs );
+        if ( n > 0 ) {
+            d->r->append( buf, n );
+        }
+        else {
+            int e = SSL_get_error( d->ssl, n );
+            if ( e == SSL_ERROR_WANT_WRITE )
+                d->readWantsWrite = true;
+            more = false;
+            if ( fail( n ) )
+                return;
+        }
+    }
+
+    if ( !d->handshaken && SSL_is_init_finished( d->ssl ) ) {
+        d->handshaken = true;
+        bool resumed = SSL_session_reused( d->ssl );
+        if ( !handshakes ) {
+            handshakes = new GraphableCounter( "tls-handshakes" );
+            resumptions = new GraphableCounter( "tls-resumptions" );
+        }
+        handshakes->tick();
+        if ( resumed )
+            resumptions->tick();
+        log( EString( "TLS handshake done: " ) +
+             SSL_get_version( d->ssl ) + ", " +
+             SSL_get_cipher_name( d->ssl ) +
+             ( resumed ? ", resumed" : "" ) +
+             ( kernelOffload() ? ", kernel offload" : "" ),
+             Log::Debug );
+    }
+
+    if ( d->writeWantsRead )
+        write();
+}
+
+
+/*! Encrypts and writes as much as possible of the write Buffer to the
+    socket.
+*/
+
+void TlsEngine::write()
+{
+    if ( d->broken || !d->ssl )
+        return;
+
+    if ( d->readWantsWrite )
+        read();
+
+    d->writeWantsRead = false;
+    while ( !d->broken && d->w->size() > 0 ) {
+        // a retried write has to be exactly as long as the first try
+        uint l = d->writing;
+        if ( !l ) {
+            l = d->w->size();
+            if ( l > bs )
+                l = bs;
+        }
+        EString s = d->w->string( l );
+        ERR_clear_error();
+        int n = ::SSL_write( d->ssl, s.data(), l );
+        if ( n > 0 ) {
+            d->w->remove( n );
+            d->writing = 0;
+        }
+        else {
+            d->writing = l;
+            if ( SSL_get_error( d->ssl, n ) == SSL_ERROR_WANT_READ )
+                d->writeWantsRead = true;
+            (void)fail( n );
+            return;
+        }
+    }
+}
+
+
+/*! Returns true if the engine has something to send even though the
+    write Buffer may be empty, e.g. when OpenSSL needs to write
+    during a handshake.
+*/
+
+bool TlsEngine::wantsWrite() const
+{
+    return !d->broken && ( d->readWantsWrite || d->writing );
+}
+
+
+/*! Returns true if TLS has failed or the peer has closed the TLS
+    session, and false if the engine is in working order.
+*/
+
+bool TlsEngine::broken() const
+{
+    return d->broken;
+}
+
+
+/*! Returns true if the kernel encrypts the data this engine sends,
+    and false if OpenSSL does.
+*/
+
+bool TlsEngine::kernelOffload() const
+{
+#ifdef BIO_get_ktls_send
+    if ( d->ssl && BIO_get_ktls_send( SSL_get_wbio( d->ssl ) ) )
+        return true;
+#endif
+    return false;
+}
+
+
+/*! Says goodbye to the peer if the session is healthy, and frees the
+    OpenSSL state. The socket itself is left for the Connection to
+    close.
+*/
+
+void TlsEngine::close()
+{
+    if ( !d->ssl )
+        return;
+    if ( !d->broken && d->handshaken ) {
+        ERR_clear_error();
+        (void)::SSL_shutdown( d->ssl );
+    }
+    ::SSL_free( d->ssl );
+    d->ssl = 0;
+    d->broken = true;
+}
+
+
+/*! Looks at the result \a n of an OpenSSL call, and returns true if
+    the session is broken or closed, in which case the socket is shut
+    down so the EventLoop sees it as gone. Returns false if OpenSSL
+    merely wants to read or write more.
+*/
+
+bool TlsEngine::fail( int n )
+{
+    int e = SSL_get_error( d->ssl, n );
+    switch ( e ) {
+    case SSL_ERROR_NONE:
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+    case SSL_ERROR_WANT_ACCEPT:
+    case SSL_ERROR_WANT_CONNECT:
+    case SSL_ERROR_WANT_X509_LOOKUP:
+        return false;
+        break;
+
+    case SSL_ERROR_ZERO_RETURN:
+        // not an error, the peer closed cleanly
+        log( "Peer closed the TLS session", Log::Debug );
+        break;
+
+    default:
+        {
+            char b[256];
+            unsigned long c = ERR_get_error();
+            if ( c ) {
+                ERR_error_string_n( c, b, sizeof( b ) );
+                log( EString( "TLS error: " ) + b, Log::Info );
+            }
+            else {
+                log( "TLS error (" + fn( e ) + ")", Log::Info );
+            }
+        }
+        break;
+    }
+
+    d->broken = true;
+    ::shutdown( d->fd, SHUT_RDWR );
+    return true;
+}
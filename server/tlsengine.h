@@ -0,0 +1,37 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef TLSENGINE_H
+#define TLSENGINE_H
+
+#include "global.h"
+
+class Buffer;
+
+
+class TlsEngine
+    : public Garbage
+{
+public:
+    TlsEngine( int, Buffer *, Buffer *, bool = false );
+
+    static void setup();
+    static void reconfigure();
+    static struct ssl_ctx_st * context();
+
+    void read();
+    void write();
+    bool wantsWrite() const;
+
+    bool broken() const;
+    bool kernelOffload() const;
+
+    void close();
+
+private:
+    class TlsEngineData * d;
+
+    bool fail( int );
+};
+
+
+#endif
@@ -2,7 +2,7 @@
 
 #include "tlsthread.h"
 
-#include "file.h"
+#include "tlsengine.h"
 #include "estring.h"
 #include "allocator.h"
 #include "configuration.h"
@@ -80,53 +80,12 @@ static void * trampoline( void * t )
 }
 
 
-static SSL_CTX * ctx = 0;
-
-
-/*! Perform any OpenSSL initialisation needed to enable us to create
-    TlsThreads later.
-*/
-
-void TlsThread::setup()
-{
-    SSL_load_error_strings();
-    SSL_library_init();
-
-    ctx = ::SSL_CTX_new( SSLv23_server_method() );
-    long options = SSL_OP_ALL
-        // also try to pick the same ciphers suites more often
-        | SSL_OP_CIPHER_SERVER_PREFERENCE
-        // and don't use SSLv2, even if the client wants to
-        | SSL_OP_NO_SSLv2
-        // and not v3 either
-        | SSL_OP_NO_SSLv3
-        ;
-    SSL_CTX_set_options( ctx, options );
-
-    SSL_CTX_set_cipher_list( ctx, "kEDH:HIGH:!aNULL:!MD5" );
-
-    EString keyFile( Configuration::text( Configuration::TlsCertFile ) );
-    if ( keyFile.isEmpty() ) {
-        keyFile = Configuration::compiledIn( Configuration::LibDir );
-        keyFile.append( "/automatic-key.pem" );
-    }
-    keyFile = File::chrooted( keyFile );
-    if ( !SSL_CTX_use_certificate_chain_file( ctx, keyFile.cstr() ) ||
-         !SSL_CTX_use_RSAPrivateKey_file( ctx, keyFile.cstr(),
-                                          SSL_FILETYPE_PEM ) )
-        log( "OpenSSL needs both the certificate and "
-             "private key in this file: " + keyFile,
-             Log::Disaster );
-    // we go on anyway; the disaster will take down the server in
-    // a hurry.
-
-    // we don't ask for a client cert
-    SSL_CTX_set_verify( ctx, SSL_VERIFY_NONE, NULL );
-}
-
-
 /*! \class TlsThread tlsthread.h
     Creates and manages a thread for TLS processing using openssl
+
+    Connection normally uses TlsEngine, which does the same work
+    within the EventLoop. TlsThread is used instead if use-tls-thread
+    is enabled.
 */
 
 
@@ -140,10 +99,7 @@ void TlsThread::setup()
 TlsThread::TlsThread( bool asClient )
     : d( new TlsThreadData )
 {
-    if ( !ctx )
-        setup();
-
-    d->ssl = ::SSL_new( ctx );
+    d->ssl = ::SSL_new( TlsEngine::context() );
     if ( asClient )
         SSL_set_connect_state( d->ssl );
     else
@@ -13,8 +13,6 @@ public:
     TlsThread( bool = false );
     ~TlsThread();
 
-    static void setup();
-
     void setServerFD( int );
     void setClientFD( int );
 
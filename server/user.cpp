@@ -5,10 +5,54 @@
 #include "helperrowcreator.h"
 #include "configuration.h"
 #include "transaction.h"
+#include "dbsignal.h"
 #include "address.h"
 #include "mailbox.h"
+#include "cache.h"
+#include "graph.h"
 #include "query.h"
 #include "codec.h"
+#include "dict.h"
+
+
+// remembers the row refresh() found for each login, so that a client
+// which logs in again and again doesn't cost a query each time. the
+// aliases_updated notification (sent when users or aliases are
+// updated or deleted) clears it; generation lets refreshHelper()
+// discard rows fetched before the most recent notification. users
+// who don't exist aren't remembered, since creating a user sends no
+// notification.
+
+class UserCache
+    : public Cache
+{
+public:
+    class X: public EventHandler {
+    public:
+        X( UserCache * uc ): me( uc ) {
+            (void)new DatabaseSignal( "aliases_updated", this );
+        }
+        void execute() {
+            me->clear();
+        }
+        UserCache * me;
+    };
+    UserCache(): Cache( 100 ), generation( 0 ) {}
+    void clear() { rows.clear(); generation++; }
+    Dict<Row> rows;
+    uint generation;
+};
+
+static UserCache * cache = 0;
+static GraphableCounter * hits = 0;
+static GraphableCounter * misses = 0;
+
+
+static EString cacheKey( const UString & login )
+{
+    return login.titlecased().utf8();
+}
+
 class UserData
     : public Garbage
 {
@@ -16,7 +60,7 @@ public:
     UserData()
         : id( 0 ), inbox( 0 ), inboxId( 0 ), home( 0 ), address( 0 ), quota( 0 ),
           q( 0 ), result( 0 ), t( 0 ), user( 0 ),
-          state( User::Unverified ),
+          generation( 0 ), state( User::Unverified ),
           mode( LoungingAround )
     {}
 
@@ -33,6 +77,7 @@ public:
     Query * result;
     Transaction * t;
     EventHandler * user;
+    uint generation;
     EString error;
     User::State state;
 
@@ -268,13 +313,34 @@ static PreparedStatement * psa;
 
 /*! Starts refreshing this object from the database, and remembers to
     call \a user when the refresh is complete.
+
+    If this User has a login() and another User with the same login
+    was recently refreshed, the refresh completes at once, without
+    calling \a user, using the row that one found. The rows are
+    forgotten when the users or aliases tables are updated.
 */
 
 void User::refresh( EventHandler * user )
 {
     if ( d->q )
         return;
+    if ( !::cache ) {
+        ::cache = new UserCache;
+        (void)new UserCache::X( ::cache );
+        ::hits = new GraphableCounter( "user-cache-hits" );
+        ::misses = new GraphableCounter( "user-cache-misses" );
+    }
+    if ( !d->login.isEmpty() ) {
+        Row * r = ::cache->rows.find( cacheKey( d->login ) );
+        if ( r ) {
+            ::hits->tick();
+            parse( r );
+            return;
+        }
+        ::misses->tick();
+    }
     d->user = user;
+    d->generation = ::cache->generation;
     if ( !psl ) {
         psl = new PreparedStatement(
             "select u.id, u.login, u.secret, u.ldapdn, "
@@ -327,33 +393,9 @@ void User::refreshHelper()
     d->state = Nonexistent;
     Row * r = d->q->nextRow();
     if ( r ) {
-        d->id = r->getInt( "id" );
-        d->login = r->getUString( "login" );
-        if ( r->isNull( "secret" ) )
-            d->secret.truncate();
-        else
-            d->secret = r->getUString( "secret" );
-        d->inboxId = r->getInt( "inbox" );
-        if ( r->isNull( "ldapdn" ) )
-            d->ldapdn.truncate();
-        else
-            d->ldapdn = r->getUString( "ldapdn" );
-        UString tmp = r->getUString( "parentspace" );
-        tmp.append( '/' );
-        tmp.append( d->login );
-        d->home = Mailbox::obtain( tmp, true );
-        d->home->setOwner( d->id );
-        if ( r->isNull( "localpart" ) ) {
-            d->address = new Address();
-        }
-        else {
-            UString n = r->getUString( "name" );
-            UString l = r->getUString( "localpart" );
-            UString h = r->getUString( "domain" );
-            d->address = new Address( n, l, h );
-        }
-        d->quota = r->getBigint( "quota" );
-        d->state = Refreshed;
+        parse( r );
+        if ( d->generation == ::cache->generation )
+            ::cache->rows.insert( cacheKey( d->login ), r );
         d->q = 0;
     }
     if ( d->user )
@@ -362,6 +404,42 @@ void User::refreshHelper()
 }
 
 
+/*! Sets up this object from \a r, a row returned by the query in
+    refresh(), and changes state() to Refreshed.
+*/
+
+void User::parse( Row * r )
+{
+    d->id = r->getInt( "id" );
+    d->login = r->getUString( "login" );
+    if ( r->isNull( "secret" ) )
+        d->secret.truncate();
+    else
+        d->secret = r->getUString( "secret" );
+    d->inboxId = r->getInt( "inbox" );
+    if ( r->isNull( "ldapdn" ) )
+        d->ldapdn.truncate();
+    else
+        d->ldapdn = r->getUString( "ldapdn" );
+    UString tmp = r->getUString( "parentspace" );
+    tmp.append( '/' );
+    tmp.append( d->login );
+    d->home = Mailbox::obtain( tmp, true );
+    d->home->setOwner( d->id );
+    if ( r->isNull( "localpart" ) ) {
+        d->address = new Address();
+    }
+    else {
+        UString n = r->getUString( "name" );
+        UString l = r->getUString( "localpart" );
+        UString h = r->getUString( "domain" );
+        d->address = new Address( n, l, h );
+    }
+    d->quota = r->getBigint( "quota" );
+    d->state = Refreshed;
+}
+
+
 /*! This function is used to create a user on behalf of \a owner.
 
     It returns a pointer to a Query that can be used to track the
@@ -487,6 +565,8 @@ Query * User::remove( Transaction * t )
     Query * q = new Query( "delete from users where login=$1", 0 );
     q->bind( 1, d->login );
     t->enqueue( q );
+    if ( ::cache )
+        ::cache->rows.remove( cacheKey( d->login ) );
     return q;
 }
 
@@ -528,6 +608,9 @@ void User::csHelper()
     if ( !d->q->done() )
         return;
 
+    if ( ::cache )
+        ::cache->rows.remove( cacheKey( d->login ) );
+
     if ( d->q->failed() )
         d->result->setError( d->q->error() );
     else
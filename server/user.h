@@ -62,6 +62,7 @@ private:
     void refreshHelper();
     void createHelper();
     void csHelper();
+    void parse( class Row * );
 
 private:
     class UserData * d;
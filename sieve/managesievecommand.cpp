@@ -9,6 +9,7 @@
 #include "query.h"
 #include "scope.h"
 #include "sieve.h"
+#include "span.h"
 #include "buffer.h"
 #include "address.h"
 #include "mailbox.h"
@@ -29,7 +30,7 @@ public:
     ManageSieveCommandData()
         : sieve( 0 ), pos( 0 ), done( false ),
           m( 0 ),
-          user( 0 ), t( 0 ), query( 0 ), step( 0 )
+          user( 0 ), t( 0 ), query( 0 ), step( 0 ), span( 0 )
     {}
 
     ManageSieve * sieve;
@@ -47,6 +48,7 @@ public:
     EString no;
     EString ok;
     uint step;
+    Span * span;
 
     // for putscript. I think we need subclasses here too.
     Dict<Mailbox> create;
@@ -74,50 +76,55 @@ ManageSieveCommand::ManageSieveCommand( ManageSieve * sieve,
     d->cmd = cmd;
     setLog( new Log );
     Scope x( log() );
+    const char * n = 0;
     switch( cmd ) {
     case Authenticate:
-        log( "Executing authenticate command" );
+        n = "authenticate";
         break;
     case StartTls:
-        log( "Executing starttls command" );
+        n = "starttls";
         break;
     case Logout:
-        log( "Executing logout command" );
+        n = "logout";
         break;
     case Capability:
-        log( "Executing capability command" );
+        n = "capability";
         break;
     case HaveSpace:
-        log( "Executing havespace command" );
+        n = "havespace";
         break;
     case PutScript:
-        log( "Executing putscript command" );
+        n = "putscript";
         break;
     case ListScripts:
-        log( "Executing listscripts command" );
+        n = "listscripts";
         break;
     case SetActive:
-        log( "Executing setactive command" );
+        n = "setactive";
         break;
     case GetScript:
-        log( "Executing getscript command" );
+        n = "getscript";
         break;
     case DeleteScript:
-        log( "Executing deletescript command" );
+        n = "deletescript";
         break;
     case RenameScript:
-        log( "Executing renamescript command" );
+        n = "renamescript";
         break;
     case Noop:
-        log( "Executing noop command" );
+        n = "noop";
         break;
     case XAoxExplain:
-        log( "Executing xaoxexplain command" );
+        n = "xaoxexplain";
         break;
     case Unknown:
-        log( "Executing unknown command" );
+        n = "unknown";
         break;
     }
+    log( "Executing " + EString( n ) + " command" );
+    d->span = Span::start( "managesieve command", log() );
+    if ( d->span )
+        d->span->setName( "managesieve " + EString( n ) );
 }
 
 
@@ -223,6 +230,10 @@ void ManageSieveCommand::execute()
         return;
 
     d->done = true;
+    if ( d->span ) {
+        d->span->setArgument( "ok", d->no.isEmpty() ? "yes" : "no" );
+        d->span->end();
+    }
     if ( d->no.isEmpty() ) {
         d->sieve->enqueue( "OK" );
         if ( !d->ok.isEmpty() ) {
@@ -343,19 +354,49 @@ bool ManageSieveCommand::haveSpace()
     I also like the timing of this: Uploading a script containing
     fileinto "x" creates x at once (instead of later, which sendmail
     does).
+
+    If the user already has a script by that name with exactly the
+    same content, PUTSCRIPT does nothing and reports OK. Tools that
+    synchronise filters upload the same scripts again and again, and
+    rewriting a script makes every server forget the recipients and
+    parsed scripts it has cached.
 */
 
 bool ManageSieveCommand::putScript()
 {
-    if ( !d->t ) {
+    if ( !d->t && !d->query ) {
         d->name = string();
         whitespace();
         d->script = string();
         end();
+        if ( !d->no.isEmpty() )
+            return true;
         if ( d->script.isEmpty() ) {
             no( "Script cannot be empty" );
             return true;
         }
+        if ( !d->name.isEmpty() ) {
+            d->query = new Query( "select script from scripts "
+                                  "where owner=$1 and name=$2", this );
+            d->query->bind( 1, d->sieve->user()->id() );
+            d->query->bind( 2, d->name );
+            d->query->execute();
+        }
+    }
+
+    if ( !d->t && d->query ) {
+        if ( !d->query->done() )
+            return false;
+        Row * r = d->query->nextRow();
+        d->query = 0;
+        if ( r && !r->isNull( "script" ) &&
+             r->getEString( "script" ) == d->script ) {
+            log( "Script is unchanged: " + d->name );
+            return true;
+        }
+    }
+
+    if ( !d->t ) {
         SieveScript script;
         script.parse( d->script.crlf() );
         EString e = script.parseErrors();
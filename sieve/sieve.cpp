@@ -5,6 +5,10 @@
 #include "md5.h"
 #include "utf.h"
 #include "date.h"
+#include "dict.h"
+#include "map.h"
+#include "graph.h"
+#include "cache.h"
 #include "html.h"
 #include "user.h"
 #include "codec.h"
@@ -21,10 +25,12 @@
 #include "ustringlist.h"
 #include "sievenotify.h"
 #include "sievescript.h"
+#include "sievematcher.h"
 #include "sieveaction.h"
 #include "transaction.h"
 #include "spoolmanager.h"
 #include "addressfield.h"
+#include "dbsignal.h"
 #include "configuration.h"
 #include "sieveproduction.h"
 
@@ -55,7 +61,9 @@ public:
             : d( data ), address( a ), mailbox( m ),
               done( false ), ok( true ),
               implicitKeep( true ), explicitKeep( false ),
-              sq( 0 ), script( new SieveScript ), user( 0 ), handler( 0 )
+              sq( 0 ), generation( 0 ),
+              unresolved( false ), matched( false ),
+              script( new SieveScript ), user( 0 ), handler( 0 )
         {
             d->recipients.append( this );
         }
@@ -71,6 +79,10 @@ public:
         List<SieveAction> actions;
         List<SieveCommand> pending;
         Query * sq;
+        UString lookup;
+        uint generation;
+        bool unresolved;
+        bool matched;
         SieveScript * script;
         EString error;
         UString prefix;
@@ -81,6 +93,8 @@ public:
         bool evaluate( SieveCommand * );
         enum Result { True, False, Undecidable };
         Result evaluate( SieveTest * );
+
+        void setAlias( Row * );
     };
 
     Address * sender;
@@ -97,11 +111,227 @@ public:
     Injector * injector;
     List<SieveAction> * vacations;
     bool softError;
+    Dict<UStringList> haystacks;
 
     Recipient * recipient( Address * a );
+    void resolve( Query * );
+    void alias( Recipient *, Row * );
 };
 
 
+// returns the key used to match the recipients looked up by
+// Sieve::resolveRecipients() with the rows found. addresses uses
+// citext, so case doesn't matter.
+
+static EString aliasKey( const UString & localpart, const UString & domain )
+{
+    return localpart.titlecased().utf8() + "@" + domain.titlecased().utf8();
+}
+
+
+// remembers the alias rows found for each recipient, or an empty
+// list for a recipient that isn't an alias, and the parsed form of
+// each script seen, until the aliases_updated notification says that
+// the aliases, scripts, users or mailboxes have changed. generation
+// lets resolve() discard rows fetched before the most recent
+// notification.
+
+class RecipientCache
+    : public Cache
+{
+public:
+    class X: public EventHandler {
+    public:
+        X( RecipientCache * rc ): me( rc ) {
+            (void)new DatabaseSignal( "aliases_updated", this );
+        }
+        void execute() {
+            me->clear();
+        }
+        RecipientCache * me;
+    };
+    RecipientCache(): Cache( 10 ), generation( 0 ) {}
+    void clear() { rows.clear(); scripts.clear(); generation++; }
+    Dict< List<Row> > rows;
+    Map<SieveScript> scripts;
+    uint generation;
+};
+
+static RecipientCache * cache = 0;
+static GraphableCounter * hits = 0;
+static GraphableCounter * misses = 0;
+static GraphableCounter * parses = 0;
+
+
+// remembers the autoresponses this process has sent, and until when
+// each suppresses similar ones. A row in autoresponses is never
+// removed before it expires, so an entry stays true even though other
+// processes may send autoresponses too; they're found by the query,
+// as before. Only positive answers are kept.
+
+class AutoresponseCache
+    : public Cache
+{
+public:
+    class Entry
+        : public Garbage
+    {
+    public:
+        Entry( uint e ): expires( e ) {}
+        uint expires;
+    };
+
+    AutoresponseCache(): Cache( 10 ) {}
+    void clear() { sent.clear(); }
+    Dict<Entry> sent;
+};
+
+static AutoresponseCache * autoresponses = 0;
+
+
+static EString autoresponseKey( SieveAction * a )
+{
+    return a->handle().utf8() + " " +
+        a->senderAddress()->lpdomain().lower() + " " +
+        a->recipientAddress()->lpdomain().lower();
+}
+
+
+/*! Records the alias information in \a r for this recipient: The
+    mailbox, and the owner's sieve script if there is one.
+*/
+
+void SieveData::Recipient::setAlias( Row * r )
+{
+    matched = true;
+    if ( !r->isNull( "mailbox" ) )
+        mailbox = Mailbox::find( r->getInt( "mailbox" ) );
+    if ( r->isNull( "script" ) )
+        return;
+
+    prefix = r->getUString( "namespace" ) + "/" +
+             r->getUString( "login" ) + "/";
+    user = new User;
+    user->setLogin( r->getUString( "login" ) );
+    user->setId( r->getInt( "userid" ) );
+    user->setAddress( new Address( r->getUString( "name" ),
+                                   r->getEString( "localpart" ),
+                                   r->getEString( "domain" ) ) );
+
+    // evaluating a script doesn't change it, so all deliveries to
+    // this user can share one parsed copy, as long as the source is
+    // the same.
+    EString source = r->getEString( "script" ).crlf();
+    uint id = 0;
+    if ( ::cache && !r->isNull( "scriptid" ) )
+        id = r->getInt( "scriptid" );
+    SieveScript * parsed = 0;
+    if ( id )
+        parsed = ::cache->scripts.find( id );
+    if ( parsed && parsed->source() == source ) {
+        script = parsed;
+    }
+    else {
+        script = new SieveScript;
+        script->parse( source );
+        if ( ::parses )
+            ::parses->tick();
+        if ( id )
+            ::cache->scripts.insert( id, script );
+    }
+    EString errors = script->parseErrors();
+    if ( !errors.isEmpty() ) {
+        log( "Note: Sieve script for " + user->login().utf8() +
+             "had parse errors.", Log::Error );
+        EStringList::Iterator i( EStringList::split( '\n', errors ) );
+        while ( i ) {
+            log( "Sieve: " + *i, Log::Error );
+            ++i;
+        }
+    }
+    List<SieveCommand>::Iterator c( script->topLevelCommands() );
+    while ( c ) {
+        pending.append( c );
+        ++c;
+    }
+}
+
+
+/*! Records that \a r is an alias for \a in. If \a in already has
+    an alias, a new Recipient is created for \a r instead.
+*/
+
+void SieveData::alias( Recipient * in, Row * r )
+{
+    if ( in->matched )
+        in = new Recipient( in->address, 0, this );
+    in->setAlias( r );
+}
+
+
+/*! Distributes the rows returned by \a q, which was issued by
+    Sieve::resolveRecipients(), to the recipients that were looked
+    up. A recipient with more than one alias row gets one Recipient
+    object per row, as before.
+
+    The rows are also cached, unless the aliases changed while \a q
+    was running.
+*/
+
+void SieveData::resolve( Query * q )
+{
+    bool fresh = !q->failed();
+    Dict< List<Recipient> > batch;
+    EStringList keys;
+    List<Recipient>::Iterator i( recipients );
+    while ( i ) {
+        if ( i->sq == q ) {
+            if ( i->generation != ::cache->generation )
+                fresh = false;
+            EString k = aliasKey( i->lookup, i->address->domain() );
+            List<Recipient> * l = batch.find( k );
+            if ( !l ) {
+                l = new List<Recipient>;
+                batch.insert( k, l );
+                keys.append( k );
+            }
+            l->append( i );
+            i->sq = 0;
+        }
+        ++i;
+    }
+
+    Dict< List<Row> > found;
+    Row * r;
+    while ( (r=q->nextRow()) != 0 ) {
+        EString k = aliasKey( r->getUString( "localpart" ),
+                              r->getUString( "domain" ) );
+        List<Row> * rows = found.find( k );
+        if ( !rows ) {
+            rows = new List<Row>;
+            found.insert( k, rows );
+        }
+        rows->append( r );
+        List<Recipient>::Iterator l( batch.find( k ) );
+        while ( l ) {
+            alias( l, r );
+            ++l;
+        }
+    }
+
+    if ( !fresh )
+        return;
+    EStringList::Iterator k( keys );
+    while ( k ) {
+        List<Row> * rows = found.find( *k );
+        if ( !rows )
+            rows = new List<Row>;
+        ::cache->rows.insert( *k, rows );
+        ++k;
+    }
+}
+
+
 SieveData::Recipient * SieveData::recipient( Address * a )
 {
     List<SieveData::Recipient>::Iterator it( recipients );
@@ -165,57 +395,13 @@ void Sieve::execute()
 
     // 0: find the data needed for evaluate().
     if ( d->state == 0 ) {
-        bool wasReady = ready();
         List<SieveData::Recipient>::Iterator i( d->recipients );
         while ( i ) {
-            if ( i->sq && i->sq->hasResults() ) {
-                Row * r;
-                SieveData::Recipient *in = i;
-                for ( in = i ;
-                      (r = i->sq->nextRow()) ;
-                      in = new SieveData::Recipient( i->address, 0, d) ) {
-                    if ( !r->isNull( "mailbox" ) )
-                        in->mailbox = Mailbox::find( r->getInt( "mailbox" ) );
-                    if ( !r->isNull( "script" ) ) {
-                        in->prefix = r->getUString( "namespace" ) + "/" +
-                                    r->getUString( "login" ) + "/";
-                        in->user = new User;
-                        in->user->setLogin( r->getUString( "login" ) );
-                        in->user->setId( r->getInt( "userid" ) );
-                        in->user->setAddress( new Address(
-                                                 r->getUString( "name" ),
-                                                 r->getEString( "localpart" ),
-                                                 r->getEString( "domain" ) ) );
-                        in->script->parse( r->getEString( "script" ).crlf() );
-                        EString errors = in->script->parseErrors();
-                        if ( !errors.isEmpty() ) {
-                            log( "Note: Sieve script for " +
-                                 in->user->login().utf8() +
-                                 "had parse errors.", Log::Error );
-                            EString prefix = "Sieve script for " +
-                                            in->user->login().utf8();
-                            EStringList::Iterator i(
-                                EStringList::split( '\n', errors ) );
-                            while ( i ) {
-                                log( "Sieve: " + *i, Log::Error );
-                                ++i;
-                            }
-                        }
-                        List<SieveCommand>::Iterator
-                            c(in->script->topLevelCommands());
-                        while ( c ) {
-                            in->pending.append( c );
-                            ++c;
-                        }
-                    }
-                }
-                i->sq = 0;
-            }
             if ( i->sq && i->sq->done() )
-                i->sq = 0;
+                d->resolve( i->sq );
             ++i;
         }
-        if ( ready() && !wasReady ) {
+        if ( ready() ) {
             i = d->recipients.first();
             while ( i ) {
                 EventHandler * h = i->handler;
@@ -239,6 +425,22 @@ void Sieve::execute()
 
         if ( !d->autoresponses ) {
             d->vacations = vacations();
+            Date now;
+            now.setCurrentTime();
+            List<SieveAction>::Iterator i( d->vacations );
+            while ( ::autoresponses && i ) {
+                AutoresponseCache::Entry * e
+                    = ::autoresponses->sent.find( autoresponseKey( i ) );
+                if ( e && e->expires > now.unixTime() ) {
+                    log( "Suppressing vacation response to " +
+                         i->recipientAddress()->toString( false ) +
+                         " (sent recently)" );
+                    d->vacations->take( i );
+                }
+                else {
+                    ++i;
+                }
+            }
             if ( d->vacations->isEmpty() ) {
                 d->state = 2;
             }
@@ -350,6 +552,7 @@ void Sieve::execute()
                                       d->forwardingDate );
 
         d->state = 3;
+        d->injector->allowBatching();
         d->injector->execute();
     }
 
@@ -389,6 +592,12 @@ void Sieve::execute()
             q->bind( 3, e.isoDateTime() );
             q->bind( 4, i->handle() );
             d->transaction->enqueue( q );
+            if ( !::autoresponses )
+                ::autoresponses = new AutoresponseCache;
+            if ( !d->injector->failed() )
+                ::autoresponses->sent.insert(
+                    autoresponseKey( i ),
+                    new AutoresponseCache::Entry( e.unixTime() ) );
             ++i;
         }
 
@@ -469,6 +678,9 @@ void Sieve::addRecipient( Address * address, Mailbox * destination,
     script and other needed information so that delivery to \a address
     can be evaluated. Calls \a user when the information is available.
 
+    The lookup starts when resolveRecipients() is called, so that many
+    recipients can share one query.
+
     If \a address is not a registered alias, Sieve will refuse mail to
     it.
 */
@@ -483,18 +695,6 @@ void Sieve::addRecipient( Address * address, EventHandler * user )
 
     r->handler = user;
 
-    r->sq = new Query( "select al.mailbox, s.script, m.owner, "
-                       "n.name as namespace, u.id as userid, u.login, "
-                       "a.name, a.localpart::text, a.domain::text "
-                       "from aliases al "
-                       "join addresses a on (al.address=a.id) "
-                       "join mailboxes m on (al.mailbox=m.id) "
-                       "left join scripts s on "
-                       " (s.owner=m.owner and s.active='t') "
-                       "left join users u on (s.owner=u.id) "
-                       "left join namespaces n on (u.parentspace=n.id) "
-                       "where m.deleted='f' and "
-                       "a.localpart=$1 and a.domain=$2", this );
     UString localpart( address->localpart() );
     if ( Configuration::toggle( Configuration::UseSubaddressing ) ) {
         EString sep( Configuration::text( Configuration::AddressSeparator ) );
@@ -516,9 +716,89 @@ void Sieve::addRecipient( Address * address, EventHandler * user )
                 localpart = localpart.mid( 0, n );
         }
     }
-    r->sq->bind( 1, localpart );
-    r->sq->bind( 2, address->domain() );
-    r->sq->execute();
+    r->lookup = localpart;
+    r->unresolved = true;
+}
+
+
+/*! Starts looking up every recipient added by addRecipient() since the
+    last call, using one query for all of them.
+
+    SMTP calls this each time it has run its commands, so all the RCPT
+    TO commands in a pipelined burst are resolved together instead of
+    one by one.
+*/
+
+void Sieve::resolveRecipients()
+{
+    Scope x( log() );
+
+    if ( !::cache ) {
+        ::cache = new RecipientCache;
+        (void)new RecipientCache::X( ::cache );
+        ::hits = new GraphableCounter( "recipient-cache-hits" );
+        ::parses = new GraphableCounter( "sieve-script-parses" );
+        ::misses = new GraphableCounter( "recipient-cache-misses" );
+    }
+
+    Query * q = 0;
+    bool cached = false;
+    UStringList localparts;
+    UStringList domains;
+    List<SieveData::Recipient>::Iterator i( d->recipients );
+    while ( i ) {
+        SieveData::Recipient * r = i;
+        ++i;
+        if ( !r->unresolved )
+            continue;
+        r->unresolved = false;
+        List<Row> * rows = ::cache->rows.find(
+            aliasKey( r->lookup, r->address->domain() ) );
+        if ( rows ) {
+            ::hits->tick();
+            cached = true;
+            List<Row>::Iterator a( rows );
+            while ( a ) {
+                d->alias( r, a );
+                ++a;
+            }
+        }
+        else {
+            ::misses->tick();
+            if ( !q )
+                q = new Query( "select al.mailbox, s.id as scriptid, "
+                               "s.script, m.owner, "
+                               "n.name as namespace, u.id as userid, "
+                               "u.login, a.name, a.localpart::text, "
+                               "a.domain::text "
+                               "from aliases al "
+                               "join addresses a on (al.address=a.id) "
+                               "join mailboxes m on (al.mailbox=m.id) "
+                               "left join scripts s on "
+                               " (s.owner=m.owner and s.active='t') "
+                               "left join users u on (s.owner=u.id) "
+                               "left join namespaces n "
+                               " on (u.parentspace=n.id) "
+                               "where m.deleted='f' and "
+                               "a.localpart=any($1::citext[]) and "
+                               "a.domain=any($2::citext[])", this );
+            localparts.append( r->lookup );
+            domains.append( r->address->domain() );
+            r->generation = ::cache->generation;
+            r->sq = q;
+        }
+    }
+    if ( !q ) {
+        if ( cached && d->state == 0 )
+            execute();
+        return;
+    }
+
+    localparts.removeDuplicates( false );
+    domains.removeDuplicates( false );
+    q->bind( 1, localparts );
+    q->bind( 2, domains );
+    q->execute();
 }
 
 
@@ -1184,10 +1464,48 @@ static void addAddress( UStringList * l, Address * a,
 }
 
 
+// returns a key describing the input extracted from the message for
+// \a t, if that input doesn't depend on the recipient, so that
+// evaluate() can share it between all the recipients' tests. The key
+// doesn't include the comparator or keys, which are applied later.
+
+static EString haystackKey( SieveTest * t )
+{
+    EString id = t->identifier();
+    if ( id != "address" && id != "header" && id != "body" )
+        return "";
+    EString k = id;
+    k.append( ' ' );
+    if ( id == "address" ) {
+        k.appendNumber( (uint)t->addressPart() );
+    }
+    else if ( id == "body" ) {
+        k.appendNumber( (uint)t->bodyMatchType() );
+        if ( t->contentTypes() )
+            k.append( " " + t->contentTypes()->join( " " ).utf8() );
+        return k;
+    }
+    k.append( ' ' );
+    if ( t->headers() )
+        k.append( t->headers()->join( "\n" ).utf8() );
+    return k;
+}
+
+
 SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
 {
     UStringList * haystack = 0;
-    if ( t->identifier() == "address" ) {
+    EString key;
+    if ( d->message && d->message->hasHeaders() ) {
+        key = haystackKey( t );
+        if ( !key.isEmpty() )
+            haystack = d->haystacks.find( key );
+    }
+
+    if ( haystack ) {
+        // extracted for another recipient (or another test)
+    }
+    else if ( t->identifier() == "address" ) {
         if ( !d->message )
             return Undecidable;
         haystack = new UStringList;
@@ -1393,8 +1711,12 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
         if ( !d->message )
             return Undecidable;
         uint s = d->message->rfc822Size();
-        if ( !s )
+        if ( !s ) {
+            // remember the size, so that the other recipients' size
+            // tests don't have to generate the message again
             s = d->message->rfc822( false ).length();
+            d->message->setRfc822Size( s );
+        }
         if ( t->sizeOverLimit() ) {
             if ( s > t->sizeLimit() )
                 return True;
@@ -1533,17 +1855,31 @@ SieveData::Recipient::Result SieveData::Recipient::evaluate( SieveTest * t )
         return False;
     }
 
+    if ( !key.isEmpty() && haystack && !d->haystacks.contains( key ) )
+        d->haystacks.insert( key, haystack );
+
     Collation * c = t->comparator();
     if ( !c )
         c = Collation::create( us( "i;ascii-casemap" ) );
 
     if ( t->matchType() == SieveTest::Count ) {
+        // the haystack may be shared, so count into a new list
         UString * hn = new UString;
         hn->append( fn( haystack->count() ).cstr() );
-        haystack->clear();
+        haystack = new UStringList;
         haystack->append( hn );
     }
 
+    if ( t->matcher() ) {
+        UStringList::Iterator h( haystack );
+        while ( h ) {
+            if ( t->matcher()->matches( *h ) )
+                return True;
+            ++h;
+        }
+        return False;
+    }
+
     UStringList::Iterator h( haystack );
     while ( h ) {
         UString s( *h );
@@ -1866,7 +2202,7 @@ bool Sieve::rejected() const
 bool Sieve::ready() const
 {
     List<SieveData::Recipient>::Iterator i( d->recipients );
-    while ( i && !i->sq )
+    while ( i && !i->sq && !i->unresolved )
         ++i;
     if ( i )
         return false;
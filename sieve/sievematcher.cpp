@@ -0,0 +1,336 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "sievematcher.h"
+
+#include "ustringlist.h"
+#include "dict.h"
+#include "list.h"
+
+
+// one state in the Aho-Corasick automaton used for :contains. the
+// children form a singly-linked list, since most states have only
+// one or two.
+
+class MatcherNode
+    : public Garbage
+{
+public:
+    MatcherNode( uint ch )
+        : c( ch ), output( false ),
+          child( 0 ), sibling( 0 ), fail( 0 ), next( 0 ) {}
+
+    MatcherNode * find( uint ch ) const {
+        MatcherNode * n = child;
+        while ( n && n->c != ch )
+            n = n->sibling;
+        return n;
+    }
+
+    uint c;
+    bool output;
+    MatcherNode * child;
+    MatcherNode * sibling;
+    MatcherNode * fail;
+    MatcherNode * next;
+};
+
+
+// one :matches pattern: the folded characters, and for each, whether
+// it's a literal, '?' or '*'.
+
+class MatcherPattern
+    : public Garbage
+{
+public:
+    UString chars;
+    EString kinds;
+};
+
+
+class SieveMatcherData
+    : public Garbage
+{
+public:
+    SieveMatcherData()
+        : type( SieveMatcher::Is ), fold( true ),
+          always( false ), root( 0 ) {}
+
+    SieveMatcher::Type type;
+    bool fold;
+    bool always;
+    Dict<UString> keys;
+    MatcherNode * root;
+    List<MatcherPattern> patterns;
+};
+
+
+static inline uint folded( uint c, bool fold )
+{
+    if ( fold && c >= 'a' && c <= 'z' )
+        return c - 'a' + 'A';
+    return c;
+}
+
+
+static UString folded( const UString & s, bool fold )
+{
+    if ( !fold )
+        return s;
+    UString r;
+    r.reserve( s.length() );
+    uint i = 0;
+    while ( i < s.length() ) {
+        r.append( folded( s[i], fold ) );
+        i++;
+    }
+    return r;
+}
+
+
+/*! \class SieveMatcher sievematcher.h
+    The SieveMatcher class matches a string against all the keys of a
+    Sieve test at once.
+
+    SieveTest::parse() compiles one for each :is, :contains and
+    :matches test that uses the i;octet or i;ascii-casemap
+    comparators, and Sieve evaluates the test using it instead of
+    calling the Collation once for each key. :is uses a Dict of the
+    keys, :contains an Aho-Corasick automaton which finds any key in
+    one pass over the string, and :matches a compiled form of each
+    pattern, matched without recursion.
+
+    The keys are case-folded once at compile time if the collation
+    is i;ascii-casemap, so matching folds only the string tested.
+*/
+
+SieveMatcher::SieveMatcher()
+    : d( new SieveMatcherData )
+{
+}
+
+
+/*! Compiles a matcher of \a type for \a keys, compared using the
+    collation named \a comparator, and returns it. An empty \a
+    comparator means i;ascii-casemap, as in RFC 5228.
+
+    Returns a null pointer if \a comparator isn't i;octet or
+    i;ascii-casemap, or \a keys is null. The caller must then fall
+    back to the Collation.
+*/
+
+SieveMatcher * SieveMatcher::compile( Type type, const UString & comparator,
+                                      UStringList * keys )
+{
+    if ( !keys )
+        return 0;
+
+    SieveMatcher * m = new SieveMatcher;
+    if ( comparator.isEmpty() || comparator == "i;ascii-casemap" )
+        m->d->fold = true;
+    else if ( comparator == "i;octet" )
+        m->d->fold = false;
+    else
+        return 0;
+
+    m->d->type = type;
+    if ( type == Contains )
+        m->d->root = new MatcherNode( 0 );
+
+    UStringList::Iterator i( keys );
+    while ( i ) {
+        m->addKey( folded( *i, m->d->fold ) );
+        ++i;
+    }
+
+    if ( type == Contains )
+        m->link();
+    return m;
+}
+
+
+/*! Adds the (already folded) key \a k. */
+
+void SieveMatcher::addKey( const UString & k )
+{
+    switch ( d->type ) {
+    case Is:
+        d->keys.insert( k.utf8(), new UString( k ) );
+        break;
+
+    case Contains:
+        {
+            if ( k.isEmpty() )
+                d->always = true;
+            MatcherNode * n = d->root;
+            uint i = 0;
+            while ( i < k.length() ) {
+                MatcherNode * c = n->find( k[i] );
+                if ( !c ) {
+                    c = new MatcherNode( k[i] );
+                    c->sibling = n->child;
+                    n->child = c;
+                }
+                n = c;
+                i++;
+            }
+            n->output = true;
+        }
+        break;
+
+    case Matches:
+        {
+            MatcherPattern * p = new MatcherPattern;
+            uint i = 0;
+            while ( i < k.length() ) {
+                if ( k[i] == '\\' && i + 1 < k.length() ) {
+                    i++;
+                    p->chars.append( k[i] );
+                    p->kinds.append( 'c' );
+                }
+                else if ( k[i] == '*' ) {
+                    // consecutive stars are the same as one
+                    if ( !p->kinds.endsWith( "*" ) ) {
+                        p->chars.append( k[i] );
+                        p->kinds.append( '*' );
+                    }
+                }
+                else {
+                    p->chars.append( k[i] );
+                    p->kinds.append( k[i] == '?' ? '?' : 'c' );
+                }
+                i++;
+            }
+            d->patterns.append( p );
+        }
+        break;
+    }
+}
+
+
+/*! Computes the failure links of the :contains automaton,
+    breadth-first, and propagates the output flags along them.
+*/
+
+void SieveMatcher::link()
+{
+    MatcherNode * head = 0;
+    MatcherNode * tail = 0;
+
+    MatcherNode * c = d->root->child;
+    while ( c ) {
+        c->fail = d->root;
+        if ( tail )
+            tail->next = c;
+        else
+            head = c;
+        tail = c;
+        c = c->sibling;
+    }
+
+    while ( head ) {
+        MatcherNode * n = head;
+        head = n->next;
+        if ( !head )
+            tail = 0;
+
+        c = n->child;
+        while ( c ) {
+            MatcherNode * f = n->fail;
+            while ( f != d->root && !f->find( c->c ) )
+                f = f->fail;
+            MatcherNode * t = f->find( c->c );
+            c->fail = ( t && t != c ) ? t : d->root;
+            if ( c->fail->output )
+                c->output = true;
+            if ( tail )
+                tail->next = c;
+            else
+                head = c;
+            tail = c;
+            c = c->sibling;
+        }
+    }
+}
+
+
+// returns true if pattern p matches all of s. single-star
+// backtracking suffices: when a later star matches, earlier stars
+// never need to match anything else.
+
+static bool glob( const MatcherPattern * p, const UString & s, bool fold )
+{
+    uint pl = p->chars.length();
+    uint sl = s.length();
+    uint pi = 0;
+    uint si = 0;
+    uint star = pl;
+    uint mark = 0;
+
+    while ( si < sl ) {
+        if ( pi < pl && p->kinds[pi] == '*' ) {
+            star = pi++;
+            mark = si;
+        }
+        else if ( pi < pl &&
+                  ( p->kinds[pi] == '?' ||
+                    p->chars[pi] == folded( s[si], fold ) ) ) {
+            pi++;
+            si++;
+        }
+        else if ( star < pl ) {
+            pi = star + 1;
+            si = ++mark;
+        }
+        else {
+            return false;
+        }
+    }
+    while ( pi < pl && p->kinds[pi] == '*' )
+        pi++;
+    return pi == pl;
+}
+
+
+/*! Returns true if \a s matches at least one of the keys. */
+
+bool SieveMatcher::matches( const UString & s ) const
+{
+    switch ( d->type ) {
+    case Is:
+        return d->keys.contains( folded( s, d->fold ).utf8() );
+
+    case Contains:
+        {
+            if ( d->always )
+                return true;
+            MatcherNode * n = d->root;
+            uint i = 0;
+            while ( i < s.length() ) {
+                uint c = folded( s[i], d->fold );
+                MatcherNode * t = n->find( c );
+                while ( !t && n != d->root ) {
+                    n = n->fail;
+                    t = n->find( c );
+                }
+                if ( t )
+                    n = t;
+                if ( n->output )
+                    return true;
+                i++;
+            }
+        }
+        return false;
+
+    case Matches:
+        {
+            List<MatcherPattern>::Iterator i( d->patterns );
+            while ( i ) {
+                if ( glob( i, s, d->fold ) )
+                    return true;
+                ++i;
+            }
+        }
+        return false;
+    }
+    return false;
+}
@@ -0,0 +1,31 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef SIEVEMATCHER_H
+#define SIEVEMATCHER_H
+
+#include "ustring.h"
+
+class UStringList;
+
+
+class SieveMatcher
+    : public Garbage
+{
+public:
+    enum Type { Is, Contains, Matches };
+
+    static SieveMatcher * compile( Type, const UString &, UStringList * );
+
+    bool matches( const UString & ) const;
+
+private:
+    SieveMatcher();
+
+    class SieveMatcherData * d;
+
+    void addKey( const UString & );
+    void link();
+};
+
+
+#endif
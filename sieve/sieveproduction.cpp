@@ -7,6 +7,7 @@
 #include "estringlist.h"
 #include "sievenotify.h"
 #include "collation.h"
+#include "sievematcher.h"
 #include "bodypart.h"
 #include "mailbox.h"
 #include "address.h"
@@ -1009,7 +1010,7 @@ public:
           bodyMatchType( SieveTest::Text ),
           headers( 0 ), envelopeParts( 0 ), keys( 0 ),
           contentTypes( 0 ),
-          sizeOver( false ), sizeLimit( 0 )
+          sizeOver( false ), sizeLimit( 0 ), matcher( 0 )
     {}
 
     EString identifier;
@@ -1020,6 +1021,7 @@ public:
     SieveTest::MatchOperator matchOperator;
     SieveTest::AddressPart addressPart;
     Collation * comparator;
+    UString comparatorName;
     SieveTest::BodyMatchType bodyMatchType;
 
     UStringList * headers;
@@ -1030,6 +1032,7 @@ public:
     UString zone;
     bool sizeOver;
     uint sizeLimit;
+    SieveMatcher * matcher;
 };
 
 
@@ -1563,6 +1566,26 @@ void SieveTest::parse()
     if ( arguments() )
         arguments()->flagUnparsedAsBad();
 
+    if ( d->keys && error().isEmpty() ) {
+        switch ( d->matchType ) {
+        case Is:
+            d->matcher = SieveMatcher::compile( SieveMatcher::Is,
+                                                d->comparatorName, d->keys );
+            break;
+        case Contains:
+            d->matcher = SieveMatcher::compile( SieveMatcher::Contains,
+                                                d->comparatorName, d->keys );
+            break;
+        case Matches:
+            d->matcher = SieveMatcher::compile( SieveMatcher::Matches,
+                                                d->comparatorName, d->keys );
+            break;
+        case Value:
+        case Count:
+            break;
+        }
+    }
+
     // if the ihave was correctly parsed and names something we don't
     // support, then we have to suppress some errors.
     if ( identifier() == "ihave" && error().isEmpty() ) {
@@ -1593,6 +1616,7 @@ void SieveTest::findComparator()
         return;
     }
 
+    d->comparatorName = a;
     d->comparator = Collation::create( a );
     if ( !d->comparator )
         arguments()->tagError( ":comparator",
@@ -1712,6 +1736,17 @@ Collation * SieveTest::comparator() const
 }
 
 
+/*! Returns the SieveMatcher compiled by parse() for this test's
+    keys, or a null pointer if the match type or comparator doesn't
+    permit that. Evaluating the test must then use comparator().
+*/
+
+SieveMatcher * SieveTest::matcher() const
+{
+    return d->matcher;
+}
+
+
 /*! As SieveArgumentList::takeStringList( \a n ), and additionally checks
     that each string is a valid header field name according to RFC
     2822 section 3.6.8, and if identifier() is "address", that each
@@ -172,6 +172,7 @@ public:
     AddressPart addressPart() const;
 
     class Collation * comparator() const;
+    class SieveMatcher * matcher() const;
 
     enum BodyMatchType { Rfc822, Text, SpecifiedTypes };
     BodyMatchType bodyMatchType() const;
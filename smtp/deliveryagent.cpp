@@ -5,8 +5,13 @@
 #include "spoolmanager.h"
 #include "transaction.h"
 #include "estringlist.h"
+#include "integerset.h"
 #include "smtpclient.h"
+#include "configuration.h"
+#include "endpoint.h"
+#include "dnsquery.h"
 #include "recipient.h"
+#include "allocator.h"
 #include "injector.h"
 #include "address.h"
 #include "fetcher.h"
@@ -16,22 +21,33 @@
 #include "scope.h"
 #include "timer.h"
 #include "date.h"
+#include "dict.h"
 #include "dsn.h"
 #include "log.h"
 
+// time
+#include <time.h>
+// gettimeofday, struct timeval
+#include <sys/time.h>
+
 
 class DeliveryAgentData
     : public Garbage
 {
 public:
     DeliveryAgentData()
-        : messageId( 0 ), t( 0 ),
+        : messageId( 0 ), owner( 0 ), t( 0 ),
           qm( 0 ), qs( 0 ), qr( 0 ), message( 0 ), expired( false ),
-          dsn( 0 ), injector( 0 ), update( 0 ), client( 0 ),
-          updatedDelivery( false )
-    {}
+          dsn( 0 ), update( 0 ), routes( 0 ),
+          updatedDelivery( false ), bounce( false ), finished( false ),
+          nextAttempt( 0 )
+    {
+        started.tv_sec = 0;
+        updating.tv_sec = 0;
+    }
 
     uint messageId;
+    EventHandler * owner;
     Transaction * t;
     Query * qm;
     Query * qs;
@@ -40,29 +56,93 @@ public:
     uint deliveryId;
     bool expired;
     DSN * dsn;
-    Injector * injector;
     Query * update;
-    SmtpClient * client;
+
+    // the recipients sent to one destination, ie. the smarthost or
+    // an MX, and the client sending to them
+    class Route
+        : public Garbage
+    {
+    public:
+        Route( const EString & h ): host( h ), client( 0 ) {}
+        EString host;
+        List<Recipient> recipients;
+        SmtpClient * client;
+    };
+    List<Route> * routes;
+
+    // the MX and address lookups route() needs, by domain and host
+    Dict<DnsQuery> exchangers;
+    Dict<DnsQuery> addresses;
+
     bool updatedDelivery;
+    bool bounce;
+    bool finished;
+    uint nextAttempt;
+
+    struct timeval started;
+    struct timeval updating;
 };
 
 
+static GraphableDataSet * pickupDelay = 0;
+static GraphableDataSet * pickupDelay95 = 0;
+static GraphableDataSet * updateTime = 0;
+static GraphableDataSet * updateTime95 = 0;
+static GraphableDataSet * deliveryTime = 0;
+static GraphableDataSet * deliveryTime95 = 0;
+
+
+// returns the number of milliseconds since a, or 0 if a hasn't
+// happened.
+
+static uint msSince( const struct timeval & a )
+{
+    if ( !a.tv_sec )
+        return 0;
+    struct timeval now;
+    (void)::gettimeofday( &now, 0 );
+    long elapsed = ( now.tv_sec - a.tv_sec ) * 1000000 +
+                   ( now.tv_usec - a.tv_usec );
+    if ( elapsed < 0 )
+        return 0;
+    return (uint)( elapsed / 1000 );
+}
+
+
 /*! \class DeliveryAgent deliveryagent.h
     Responsible for attempting to deliver a queued message and updating
     the corresponding row in the deliveries table.
+
+    Normally the message is sent to the smarthost. If direct-delivery
+    is enabled, the recipients are grouped by the MX host of their
+    domain, and each group is sent in one SMTP transaction, in
+    parallel with the others.
 */
 
 /*! Creates a new DeliveryAgent object to deliver the message with the
-    given \a id.
+    given \a id, and to notify \a owner when it's done.
 */
 
-DeliveryAgent::DeliveryAgent( uint id )
+DeliveryAgent::DeliveryAgent( uint id, EventHandler * owner )
     : d( new DeliveryAgentData )
 {
     setLog( new Log );
     Scope x( log() );
     log( "Attempting delivery for message " + fn( id ) );
     d->messageId = id;
+    d->owner = owner;
+    (void)::gettimeofday( &d->started, 0 );
+    if ( !::pickupDelay ) {
+        ::pickupDelay = new GraphableDataSet( "delivery-pickup-delay" );
+        ::pickupDelay95 = new GraphableDataSet( "delivery-pickup-delay-95",
+                                                95 );
+        ::updateTime = new GraphableDataSet( "delivery-update-time" );
+        ::updateTime95 = new GraphableDataSet( "delivery-update-time-95",
+                                               95 );
+        ::deliveryTime = new GraphableDataSet( "delivery-time" );
+        ::deliveryTime95 = new GraphableDataSet( "delivery-time-95", 95 );
+    }
 }
 
 
@@ -80,14 +160,18 @@ void DeliveryAgent::execute()
 {
     // Fetch and lock the row in deliveries matching (mailbox,uid).
 
-    if ( !d->messageId )
+    if ( d->finished )
         return;
 
     if ( !d->t ) {
         d->t = new Transaction( this );
         d->qm = new Query(
-            "select id, sender, current_timestamp > expires_at as expired "
-            "from deliveries where message=$1 for update",
+            "select id, sender, current_timestamp > expires_at as expired, "
+            "(extract(epoch from current_timestamp-next_attempt)*1000)"
+            "::bigint as late "
+            "from deliveries "
+            "where message=$1 and next_attempt<=current_timestamp "
+            "for update",
             this );
         d->qm->bind( 1, d->messageId );
         d->t->enqueue( d->qm );
@@ -125,10 +209,18 @@ void DeliveryAgent::execute()
 
         if ( !r->isNull( "expired" ) && r->getBoolean( "expired" ) == true )
             d->expired = true;
+
+        // how long the message waited for the spool manager after it
+        // was due
+        int64 late = r->getBigint( "late" );
+        if ( late < 0 )
+            late = 0;
+        ::pickupDelay->addNumber( (uint)late );
+        ::pickupDelay95->addNumber( (uint)late );
     }
     else if ( !d->qs ) {
         d->t->rollback();
-        d->messageId = 0;
+        finish();
         log( "Could not find/lock deliveries row; aborting" );
         return;
     }
@@ -148,17 +240,19 @@ void DeliveryAgent::execute()
         createDSN();
 
         if ( !d->dsn->deliveriesPending() ) {
-            d->t->rollback();
-            d->messageId = 0;
+            Query * q = new Query( "update deliveries set next_attempt=null "
+                                   "where id=$1", 0 );
+            q->bind( 1, d->deliveryId );
+            d->t->enqueue( q );
+            d->t->commit();
+            finish();
             log( "Delivery already completed; will do nothing", Log::Debug );
             return;
         }
     }
 
-    if ( !d->client && d->dsn->deliveriesPending() ) {
-        d->client = SmtpClient::provide();
-        d->client->send( d->dsn, this );
-    }
+    if ( d->dsn->deliveriesPending() && !send() )
+        return;
 
     // Once the SmtpClient has updated the action and status for each
     // recipient, we can decide whether or not to spool a bounce.
@@ -172,13 +266,14 @@ void DeliveryAgent::execute()
             return;
 
         d->updatedDelivery = true;
-        updateDelivery();
-
         if ( d->expired ) {
             log( "Delivery expired; will bounce", Log::Debug );
             expireRecipients( d->dsn );
         }
 
+        updateDelivery();
+        (void)::gettimeofday( &d->updating, 0 );
+
         if ( d->dsn->deliveriesPending() ) {
             // must try again
         }
@@ -186,12 +281,8 @@ void DeliveryAgent::execute()
             // no need to tell anyone, right?
         }
         else {
-            log( "Sending bounce message", Log::Debug );
-            d->injector = injectBounce( d->dsn );
+            d->bounce = true;
         }
-
-        if ( d->injector )
-            d->injector->execute();
     }
 
     // Once the update finishes, we're done.
@@ -201,7 +292,22 @@ void DeliveryAgent::execute()
         return;
     }
 
-    if ( d->t->failed() && d->client && d->client->sent() ) {
+    uint ms = msSince( d->updating );
+    ::updateTime->addNumber( ms );
+    ::updateTime95->addNumber( ms );
+    ms = msSince( d->started );
+    ::deliveryTime->addNumber( ms );
+    ::deliveryTime95->addNumber( ms );
+
+    bool sent = false;
+    List<DeliveryAgentData::Route>::Iterator r( d->routes );
+    while ( r && !sent ) {
+        if ( r->client && r->client->sent() )
+            sent = true;
+        ++r;
+    }
+
+    if ( d->t->failed() && sent ) {
         // We might end up resending copies of messages that we couldn't
         // update during this transaction.
         log( "Delivery attempt worked, but database could not be updated: " +
@@ -211,7 +317,170 @@ void DeliveryAgent::execute()
         SpoolManager::shutdown();
     }
 
-    d->messageId = 0;
+    if ( d->bounce && !d->t->failed() ) {
+        log( "Sending bounce message", Log::Debug );
+        injectBounce( d->dsn );
+    }
+
+    finish();
+}
+
+
+/*! This private helper hands the pending recipients to SmtpClient
+    objects, one for each destination, and returns true if that's
+    done. If route() is still waiting for the DNS, or some destination
+    has no free client, send() returns false, and this agent is
+    notified when it's time to try again.
+*/
+
+bool DeliveryAgent::send()
+{
+    if ( !route() )
+        return false;
+
+    bool all = true;
+    List<DeliveryAgentData::Route>::Iterator r( d->routes );
+    while ( r ) {
+        if ( !r->client ) {
+            r->client = SmtpClient::provide( this, r->host );
+            if ( !r->client )
+                all = false;
+            else if ( r->host.isEmpty() )
+                r->client->send( d->dsn, this );
+            else
+                r->client->send( d->dsn, this, &r->recipients );
+        }
+        ++r;
+    }
+    return all;
+}
+
+
+// returns true if provide() can connect to the host looked up by
+// q, ie. if it has an address we can use.
+
+static bool routable( DnsQuery * q )
+{
+    EStringList::Iterator a( q->results() );
+    while ( a ) {
+        if ( Endpoint( *a, 25 ).valid() )
+            return true;
+        ++a;
+    }
+    return false;
+}
+
+
+/*! This private helper decides where to send each pending
+    recipient, and returns true once that's done. Without
+    direct-delivery, everything goes to the smarthost. With it, each
+    recipient goes to the most preferred MX of its domain that has an
+    address, and recipients whose domains share that MX are sent
+    together. Recipients that cannot be routed are marked as delayed
+    (if the problem may be temporary) or failed.
+
+    The MX and address lookups for all domains are sent at once, using
+    DnsQuery. route() returns false until all have been answered, and
+    DnsQuery notifies this agent as answers arrive.
+*/
+
+bool DeliveryAgent::route()
+{
+    if ( d->routes )
+        return true;
+
+    if ( !Configuration::toggle( Configuration::DirectDelivery ) ) {
+        d->routes = new List<DeliveryAgentData::Route>;
+        d->routes->append( new DeliveryAgentData::Route( "" ) );
+        return true;
+    }
+
+    bool answered = true;
+    List<Recipient>::Iterator i( d->dsn->recipients() );
+    while ( i ) {
+        if ( i->action() == Recipient::Unknown ) {
+            EString domain = i->finalRecipient()->domain().utf8().lower();
+            DnsQuery * q = d->exchangers.find( domain );
+            if ( !q ) {
+                q = new DnsQuery( domain, DnsQuery::MailExchangers, this );
+                d->exchangers.insert( domain, q );
+                q->execute();
+            }
+            if ( !q->done() ) {
+                answered = false;
+            }
+            else {
+                EStringList::Iterator m( q->results() );
+                while ( m ) {
+                    DnsQuery * a = d->addresses.find( *m );
+                    if ( !a ) {
+                        a = new DnsQuery( *m, DnsQuery::Address, this );
+                        d->addresses.insert( *m, a );
+                        a->execute();
+                    }
+                    if ( !a->done() )
+                        answered = false;
+                    ++m;
+                }
+            }
+        }
+        ++i;
+    }
+    if ( !answered )
+        return false;
+
+    d->routes = new List<DeliveryAgentData::Route>;
+    Dict<DeliveryAgentData::Route> hosts;
+    i = d->dsn->recipients()->first();
+    while ( i ) {
+        if ( i->action() == Recipient::Unknown ) {
+            EString domain = i->finalRecipient()->domain().utf8().lower();
+            DnsQuery * q = d->exchangers.find( domain );
+            EStringList mx = q->results();
+            EString host;
+            EStringList::Iterator m( mx );
+            while ( m && host.isEmpty() ) {
+                if ( routable( d->addresses.find( *m ) ) )
+                    host = *m;
+                ++m;
+            }
+            if ( q->failed() ) {
+                i->setAction( Recipient::Delayed, "4.4.3" );
+            }
+            else if ( mx.isEmpty() ) {
+                log( "Domain " + domain + " does not accept mail" );
+                i->setAction( Recipient::Failed, "5.1.2" );
+            }
+            else if ( host.isEmpty() ) {
+                log( "No usable MX host for " + domain );
+                i->setAction( Recipient::Delayed, "4.4.4" );
+            }
+            else {
+                DeliveryAgentData::Route * r = hosts.find( host );
+                if ( !r ) {
+                    r = new DeliveryAgentData::Route( host );
+                    hosts.insert( host, r );
+                    d->routes->append( r );
+                }
+                r->recipients.append( i );
+            }
+        }
+        ++i;
+    }
+    return true;
+}
+
+
+/*! This private helper records that the agent is done, and notifies
+    the owner specified to the constructor.
+*/
+
+void DeliveryAgent::finish()
+{
+    d->finished = true;
+    if ( d->owner )
+        d->owner->notify();
+    d->owner = 0;
 }
 
 
@@ -221,9 +490,18 @@ void DeliveryAgent::execute()
 
 bool DeliveryAgent::working() const
 {
-    if ( d->t && !d->t->done() )
-        return true;
-    return false;
+    return !d->finished;
+}
+
+
+/*! Returns the time (as a unix time_t) at which the message should be
+    tried again, or 0 if it doesn't need to be (or if this agent
+    hasn't tried to send it).
+*/
+
+uint DeliveryAgent::nextAttempt() const
+{
+    return d->nextAttempt;
 }
 
 
@@ -344,23 +622,99 @@ void DeliveryAgent::logDelivery( DSN * dsn )
 }
 
 
-/*! Returns a pointer to a newly-created Injector to inject a bounce
-    message derived from the specified \a dsn, or 0 if the DSN was for
-    a bounce already. The caller must call Injector::execute() when
-    appropriate.
+// collects the bounces generated by all the agents, and injects
+// them together. while one Injector is working, new bounces wait for
+// it to finish, so a burst of expiring deliveries results in a few
+// large injections rather than one per delivery. if a batch fails,
+// each of its bounces is tried on its own, so one bad bounce can't
+// take the others with it.
+
+class BounceBatch
+    : public EventHandler
+{
+public:
+    BounceBatch(): injector( 0 ), alone( false ) {
+        setLog( new Log );
+    }
+
+    void add( Injectee * m, Address * to ) {
+        List<Address> * l = new List<Address>;
+        l->append( to );
+        messages.append( m );
+        recipients.append( l );
+        if ( !injector )
+            inject();
+    }
+
+    void inject() {
+        injected.clear();
+        injectedTo.clear();
+        if ( messages.isEmpty() )
+            return;
+        injector = new Injector( this );
+        uint n = 0;
+        while ( !messages.isEmpty() && ( !alone || !n ) ) {
+            Injectee * m = messages.shift();
+            List<Address> * l = recipients.shift();
+            injector->addDelivery( m, new Address(), l );
+            injected.append( m );
+            injectedTo.append( l );
+            n++;
+        }
+        log( "Injecting " + fn( n ) + " bounce messages", Log::Debug );
+        injector->execute();
+    }
+
+    void execute() {
+        if ( !injector || !injector->done() )
+            return;
+        bool failed = injector->failed();
+        EString error = injector->error();
+        injector = 0;
+        if ( failed && injected.count() > 1 ) {
+            // put the bounces back and try them one by one
+            alone = true;
+            while ( !injected.isEmpty() ) {
+                messages.prepend( injected.pop() );
+                recipients.prepend( injectedTo.pop() );
+            }
+        }
+        else if ( failed ) {
+            log( "Could not inject bounce message: " + error,
+                 Log::Error );
+        }
+        if ( messages.isEmpty() )
+            alone = false;
+        inject();
+    }
+
+    Injector * injector;
+    bool alone;
+    List<Injectee> messages;
+    List< List<Address> > recipients;
+    List<Injectee> injected;
+    List< List<Address> > injectedTo;
+};
+
+static BounceBatch * bounces = 0;
+
+
+/*! Hands a bounce message derived from the specified \a dsn to be
+    injected along with any other bounces, unless the DSN was for a
+    bounce already. The bounce is injected after this agent's
+    transaction commits.
 */
 
-Injector * DeliveryAgent::injectBounce( DSN * dsn )
+void DeliveryAgent::injectBounce( DSN * dsn )
 {
-    List<Address> * l = new List<Address>;
     if ( dsn->sender()->type() != Address::Normal )
-        return 0;
-    l->append( dsn->sender() );
+        return;
 
-    Injector * i = new Injector( this );
-    i->setTransaction( d->t );
-    i->addDelivery( dsn->result(), new Address(), l );
-    return i;
+    if ( !::bounces ) {
+        ::bounces = new BounceBatch;
+        Allocator::addEternal( ::bounces, "bounces to be injected" );
+    }
+    ::bounces->add( dsn->result(), dsn->sender() );
 }
 
 
@@ -374,6 +728,11 @@ static GraphableCounter * messagesSent = 0;
 
 void DeliveryAgent::updateDelivery()
 {
+    // one update for each combination of action and status, which
+    // is usually just one for the entire delivery
+    Dict<IntegerSet> groups;
+    Dict<Recipient> examples;
+    EStringList keys;
     uint handled = 0;
     uint unhandled = 0;
     List<Recipient>::Iterator it( d->dsn->recipients() );
@@ -385,23 +744,53 @@ void DeliveryAgent::updateDelivery()
             unhandled++;
         else
             handled++;
+        EString k = fn( (int)r->action() ) + " " + r->status();
+        IntegerSet * g = groups.find( k );
+        if ( !g ) {
+            g = new IntegerSet;
+            groups.insert( k, g );
+            examples.insert( k, r );
+            keys.append( k );
+        }
+        g->add( r->finalRecipient()->id() );
+    }
+
+    EStringList::Iterator k( keys );
+    while ( k ) {
+        Recipient * r = examples.find( *k );
         Query * q =
             new Query( "update delivery_recipients "
                        "set action=$1, status=$2, "
                        "last_attempt=current_timestamp "
-                       "where delivery=$3 and recipient=$4",
+                       "where delivery=$3 and recipient=any($4)",
                        this );
         q->bind( 1, (int)r->action() );
         q->bind( 2, r->status() );
         q->bind( 3, d->deliveryId );
-        q->bind( 4, r->finalRecipient()->id() );
+        q->bind( 4, *groups.find( *k ) );
         if ( d->t->state() == Transaction::Executing )
             d->t->enqueue( q );
         else if ( r->action() == Recipient::Delivered ||
                   r->action() == Recipient::Relayed ||
                   r->action() == Recipient::Expanded )
             q->execute();
+        ++k;
+    }
+
+    Query * q;
+    if ( unhandled ) {
+        d->nextAttempt = (uint)::time( 0 ) + SPOOLINTERVAL;
+        q = new Query( "update deliveries set next_attempt="
+                       "current_timestamp+interval '" SSPOOLINTERVAL " s' "
+                       "where id=$1", this );
+    }
+    else {
+        q = new Query( "update deliveries set next_attempt=null "
+                       "where id=$1", this );
     }
+    q->bind( 1, d->deliveryId );
+    if ( d->t->state() == Transaction::Executing )
+        d->t->enqueue( q );
 
     if ( d->dsn->allOk() ) {
         if ( handled )
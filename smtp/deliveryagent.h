@@ -10,7 +10,6 @@ class DSN;
 class Query;
 class Mailbox;
 class Message;
-class Injector;
 class SmtpClient;
 
 
@@ -18,13 +17,14 @@ class DeliveryAgent
     : public EventHandler
 {
 public:
-    DeliveryAgent( uint );
+    DeliveryAgent( uint, EventHandler * = 0 );
 
     uint messageId() const;
 
     void execute();
 
     bool working() const;
+    uint nextAttempt() const;
 
 private:
     class DeliveryAgentData * d;
@@ -33,8 +33,11 @@ private:
     void createDSN();
     void expireRecipients( DSN * );
     void logDelivery( DSN * );
-    Injector * injectBounce( DSN * );
+    void injectBounce( DSN * );
     void updateDelivery();
+    bool send();
+    bool route();
+    void finish();
 };
 
 
@@ -0,0 +1,169 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#include "messagecopy.h"
+
+#include "file.h"
+#include "estring.h"
+
+// open
+#include <fcntl.h>
+// write, close
+#include <unistd.h>
+// errno
+#include <errno.h>
+// malloc, free, atexit
+#include <stdlib.h>
+// memcpy
+#include <string.h>
+
+#include <pthread.h>
+
+
+// we want large file support if available, but don't care
+#if !defined(O_LARGEFILE)
+#define O_LARGEFILE 0
+#endif
+
+
+// one file waiting to be written. the job and its data are malloced,
+// so the writer thread never touches memory the allocator might
+// free.
+
+struct CopyJob {
+    int fd;
+    char * data;
+    uint length;
+    CopyJob * next;
+};
+
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+static CopyJob * head = 0;
+static CopyJob * tail = 0;
+static bool busy = false;
+static bool started = false;
+static bool broken = false;
+
+
+// writes and closes one file, and frees the job.
+
+static void finish( CopyJob * j )
+{
+    uint done = 0;
+    while ( done < j->length ) {
+        int r = ::write( j->fd, j->data + done, j->length - done );
+        if ( r > 0 )
+            done += r;
+        else if ( r == 0 || errno != EINTR )
+            done = j->length;
+    }
+    ::close( j->fd );
+    ::free( j->data );
+    ::free( j );
+}
+
+
+static void * writer( void * )
+{
+    pthread_mutex_lock( &lock );
+    while ( true ) {
+        while ( !head ) {
+            busy = false;
+            pthread_cond_broadcast( &idle );
+            pthread_cond_wait( &queued, &lock );
+        }
+        CopyJob * j = head;
+        head = j->next;
+        if ( !head )
+            tail = 0;
+        busy = true;
+        pthread_mutex_unlock( &lock );
+        finish( j );
+        pthread_mutex_lock( &lock );
+    }
+    return 0;
+}
+
+
+// waits for the writer thread to finish its queue, so that copies
+// aren't lost when the process exits.
+
+static void drain()
+{
+    pthread_mutex_lock( &lock );
+    while ( head || busy )
+        pthread_cond_wait( &idle, &lock );
+    pthread_mutex_unlock( &lock );
+}
+
+
+/*! \class MessageCopy messagecopy.h
+    The MessageCopy class writes the files requested by the
+    message-copy configuration variable without blocking the event
+    loop.
+
+    write() opens the file at once, so that an unusable
+    message-copy-directory is reported as it always was, and leaves
+    the actual writing to a thread that's started the first time
+    it's needed. The process waits for that thread to finish its
+    queue before exiting.
+*/
+
+
+/*! Creates \a name, which must not exist, and arranges for \a
+    contents to be written to it in the background. Returns true if
+    the file could be created, and false if not.
+*/
+
+bool MessageCopy::write( const EString & name, const EString & contents )
+{
+    EString chn = File::chrooted( name );
+    int fd = ::open( chn.cstr(), O_WRONLY|O_CREAT|O_EXCL|O_LARGEFILE, 0644 );
+    if ( fd < 0 )
+        return false;
+
+    CopyJob * j = (CopyJob*)::malloc( sizeof( CopyJob ) );
+    char * data = (char*)::malloc( contents.length() + 1 );
+    if ( !j || !data ) {
+        ::free( j );
+        ::free( data );
+        ::close( fd );
+        return false;
+    }
+    ::memcpy( data, contents.data(), contents.length() );
+    j->fd = fd;
+    j->data = data;
+    j->length = contents.length();
+    j->next = 0;
+
+    pthread_mutex_lock( &lock );
+    if ( !started && !broken ) {
+        pthread_t t;
+        if ( pthread_create( &t, 0, writer, 0 ) == 0 ) {
+            pthread_detach( t );
+            ::atexit( drain );
+            started = true;
+        }
+        else {
+            broken = true;
+        }
+    }
+    if ( started ) {
+        if ( tail )
+            tail->next = j;
+        else
+            head = j;
+        tail = j;
+        busy = true;
+        pthread_cond_signal( &queued );
+        j = 0;
+    }
+    pthread_mutex_unlock( &lock );
+
+    // without a thread, we write it the old-fashioned way
+    if ( j )
+        finish( j );
+    return true;
+}
@@ -0,0 +1,22 @@
+// Copyright 2009 The Archiveopteryx Developers <info@aox.org>
+
+#ifndef MESSAGECOPY_H
+#define MESSAGECOPY_H
+
+#include "global.h"
+
+class EString;
+
+
+class MessageCopy
+    : public Garbage
+{
+private:
+    MessageCopy();
+
+public:
+    static bool write( const EString &, const EString & );
+};
+
+
+#endif
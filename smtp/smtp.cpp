@@ -4,7 +4,9 @@
 
 #include "smtpmailrcpt.h"
 #include "smtpcommand.h"
+#include "configuration.h"
 #include "transaction.h"
+#include "allocator.h"
 #include "eventloop.h"
 #include "address.h"
 #include "mailbox.h"
@@ -12,12 +14,16 @@
 #include "query.h"
 #include "scope.h"
 #include "sieve.h"
+#include "timer.h"
 #include "date.h"
+#include "dict.h"
 #include "user.h"
 
 // getpid()
 #include <sys/types.h>
 #include <unistd.h>
+// time()
+#include <time.h>
 
 
 class SMTPData
@@ -26,13 +32,16 @@ class SMTPData
 public:
     SMTPData():
         executing( false ), executeAgain( false ),
+        tarpit( false ), usingDatabase( false ),
         inputState( SMTP::Command ),
         dialect( SMTP::Smtp ),
         sieve( 0 ), user( 0 ), permittedAddresses( 0 ),
-        recipients( new List<SmtpRcptTo> ), now( 0 ) {}
+        recipients( new List<SmtpRcptTo> ), sources( 0 ), now( 0 ) {}
 
     bool executing;
     bool executeAgain;
+    bool tarpit;
+    bool usingDatabase;
     SMTP::InputState inputState;
     SMTP::Dialect dialect;
     Sieve * sieve;
@@ -42,6 +51,7 @@ public:
     List<Address> * permittedAddresses;
     List<SmtpRcptTo> * recipients;
     EString body;
+    List<Message> * sources;
     Date * now;
     EString id;
 
@@ -55,8 +65,45 @@ public:
     private:
         List<Address> * a;
     };
+
+    class Greeter
+        : public EventHandler
+    {
+    public:
+        Greeter( SMTP * s ): smtp( s ) {}
+        void execute() { smtp->greet(); }
+        SMTP * smtp;
+    };
+};
+
+
+// the number of connections each client address has made during the
+// current minute, for smtp-connection-rate.
+
+class ConnectionCount
+    : public Garbage
+{
+public:
+    ConnectionCount(): n( 0 ) {}
+    uint n;
 };
 
+static Dict<ConnectionCount> * connectionCounts = 0;
+static uint connectionMinute = 0;
+
+// the sessions that may use the database, and the ones waiting to.
+static uint databaseUsers = 0;
+static List<SMTP> * databaseWaiters = 0;
+
+static uint databaseLimit()
+{
+    uint max = Configuration::scalar( Configuration::DbMaxHandles );
+    uint reserved = Configuration::scalar( Configuration::DbReservedHandles );
+    if ( max > reserved + 1 )
+        return max - reserved;
+    return 1;
+}
+
 
 /*! \class SMTP smtp.h
     The SMTP class implements a basic SMTP server.
@@ -79,14 +126,89 @@ public:
     This subclass of SMTP implements SMTP submission (RFC 4409).
 */
 
-/*!  Constructs an (E)SMTP server for socket \a s, speaking \a dialect. */
+/*!  Constructs an (E)SMTP server for socket \a s, speaking \a dialect.
+
+    If the port already has smtp-max-connections connections, the
+    client is told to try later and the connection is closed at
+    once. If the client has connected more than smtp-connection-rate
+    times this minute, the greeting is delayed by smtp-tarpit seconds,
+    during which the client's commands are not processed.
+*/
 
 SMTP::SMTP( int s, Dialect dialect )
     : SaslConnection( s, Connection::SmtpServer ), d( new SMTPData )
 {
     Scope x( log() );
     d->dialect = dialect;
-    switch( dialect ) {
+
+    uint port = self().port();
+    uint sessions = 0;
+    List<Connection>::Iterator i( EventLoop::global()->connections() );
+    while ( i ) {
+        if ( i->type() == Connection::SmtpServer &&
+             i->state() == Connected && i->self().port() == port )
+            sessions++;
+        ++i;
+    }
+    uint max = Configuration::scalar( Configuration::SmtpMaxConnections );
+    if ( sessions >= max ) {
+        log( "Refusing connection from " + peer().address() +
+             " (" + fn( sessions ) + " connections)", Log::Significant );
+        enqueue( "421 Too many connections, try again later\r\n" );
+        write();
+        close();
+        return;
+    }
+
+    uint rate = Configuration::scalar( Configuration::SmtpConnectionRate );
+    if ( rate && dialect != Lmtp ) {
+        uint minute = (uint)::time( 0 ) / 60;
+        if ( !::connectionCounts ) {
+            ::connectionCounts = new Dict<ConnectionCount>;
+            Allocator::addEternal( ::connectionCounts,
+                                   "SMTP connections per address" );
+        }
+        if ( minute != ::connectionMinute ) {
+            ::connectionCounts->clear();
+            ::connectionMinute = minute;
+        }
+        EString a = peer().address();
+        ConnectionCount * c = ::connectionCounts->find( a );
+        if ( !c ) {
+            c = new ConnectionCount;
+            ::connectionCounts->insert( a, c );
+        }
+        c->n++;
+        if ( c->n > rate )
+            d->tarpit = true;
+    }
+
+    setTimeoutAfter( 1800 );
+    EventLoop::global()->addConnection( this );
+
+    if ( d->tarpit ) {
+        uint delay = Configuration::scalar( Configuration::SmtpTarpit );
+        log( "Delaying greeting to " + peer().address() +
+             " by " + fn( delay ) + " seconds" );
+        (void)new Timer( new SMTPData::Greeter( this ), delay );
+    }
+    else {
+        greet();
+    }
+}
+
+
+/*! Sends the greeting, and handles any commands the client has sent
+    before it. Called by the constructor, or a little later if the
+    client is tarpitted.
+*/
+
+void SMTP::greet()
+{
+    d->tarpit = false;
+    if ( !valid() )
+        return;
+    switch( d->dialect ) {
     case Smtp:
         enqueue( "220 ESMTP " );
         break;
@@ -99,8 +221,10 @@ SMTP::SMTP( int s, Dialect dialect )
     }
     enqueue( Configuration::hostname() );
     enqueue( "\r\n" );
-    setTimeoutAfter( 1800 );
-    EventLoop::global()->addConnection( this );
+    if ( readBuffer()->size() ) {
+        parse();
+        execute();
+    }
 }
 
 
@@ -125,7 +249,8 @@ void SMTP::react( Event e )
     switch ( e ) {
     case Read:
         setTimeoutAfter( 1800 );
-        parse();
+        if ( !d->tarpit )
+            parse();
         break;
 
     case Timeout:
@@ -219,6 +344,10 @@ void SMTP::execute()
                 c->notify();
         }
 
+        // look up all the recipients that the commands just added
+        if ( d->sieve && !d->sieve->ready() && useDatabase() )
+            d->sieve->resolveRecipients();
+
         // see if any old commands may be retired
         i = d->commands.first();
         while ( i && i->done() ) {
@@ -230,6 +359,67 @@ void SMTP::execute()
 
     // allow execute() to be called again
     d->executing = false;
+
+    // and let others use the database if we don't need it any more
+    if ( d->usingDatabase &&
+         ( d->commands.isEmpty() || d->inputState != Command ||
+           Connection::state() != Connected ) )
+        releaseDatabase();
+}
+
+
+/*! Returns true if this session may use the database now, and false
+    if it has to wait. If it has to wait, execute() is called when
+    it's this session's turn.
+
+    At most db-max-handles minus db-reserved-handles sessions use the
+    database at once, so that SMTP can't occupy every handle and
+    starve interactive IMAP users. At least one may, whatever the
+    configuration. A session keeps its turn until it has no commands
+    left to run, is receiving a message body, or is closed.
+*/
+
+bool SMTP::useDatabase()
+{
+    if ( d->usingDatabase )
+        return true;
+
+    if ( ::databaseUsers < databaseLimit() ) {
+        ::databaseUsers++;
+        d->usingDatabase = true;
+        return true;
+    }
+
+    if ( !::databaseWaiters ) {
+        ::databaseWaiters = new List<SMTP>;
+        Allocator::addEternal( ::databaseWaiters,
+                               "SMTP sessions waiting for the database" );
+    }
+    if ( !::databaseWaiters->find( this ) ) {
+        log( "Waiting for a database handle", Log::Debug );
+        ::databaseWaiters->append( this );
+    }
+    return false;
+}
+
+
+/*! Records that this session doesn't need the database, and lets the
+    next waiting session use it.
+*/
+
+void SMTP::releaseDatabase()
+{
+    if ( !d->usingDatabase )
+        return;
+    d->usingDatabase = false;
+    ::databaseUsers--;
+
+    while ( ::databaseWaiters && !::databaseWaiters->isEmpty() &&
+            ::databaseUsers < databaseLimit() ) {
+        SMTP * w = ::databaseWaiters->shift();
+        if ( w->Connection::state() == Connected )
+            w->execute();
+    }
 }
 
 
@@ -276,6 +466,7 @@ void SMTP::reset()
     d->sieve = 0;
     d->recipients = new List<SmtpRcptTo>;
     d->body.truncate();
+    d->sources = 0;
     d->id.truncate();
     d->now = 0;
 }
@@ -410,6 +601,17 @@ void SMTP::setBody( const EString & b )
 }
 
 
+/*! Appends \a b to the body recorded by setBody(), without copying
+    what's there already. SmtpBdat and SmtpBurl use this to build the
+    message one chunk at a time.
+*/
+
+void SMTP::appendBody( const EString & b )
+{
+    d->body.append( b );
+}
+
+
 /*! Returns what setBody() set. Used for SmtpBdat instances to
     coordinate the body.
 */
@@ -420,6 +622,31 @@ EString SMTP::body() const
 }
 
 
+/*! Records that \a m, which was fetched from the database, is part of
+    the body. SmtpBurl uses this so that the message it builds can
+    reuse the bodyparts of the messages its URLs refer to. reset()
+    clears the list.
+*/
+
+void SMTP::addBodySource( Message * m )
+{
+    if ( !d->sources )
+        d->sources = new List<Message>;
+    if ( !d->sources->find( m ) )
+        d->sources->append( m );
+}
+
+
+/*! Returns the messages recorded by addBodySource(), or a null
+    pointer if there are none.
+*/
+
+List<Message> * SMTP::bodySources() const
+{
+    return d->sources;
+}
+
+
 /*! Returns true if \a c is the oldest command in the SMTP server's
     queue of outstanding commands, and false if the queue is empty or
     there is a command older than \a c in the queue.
@@ -466,11 +693,15 @@ private:
 SMTPS::SMTPS( int s )
     : SMTPSubmit( s ), d( new SMTPSData )
 {
+    if ( !valid() )
+        return;
+    // if the greeting is delayed, greet() sends it later via TLS
     EString * tmp = writeBuffer()->removeLine();
     if ( tmp )
         d->banner = *tmp;
     startTls();
-    enqueue( d->banner + "\r\n" );
+    if ( tmp )
+        enqueue( d->banner + "\r\n" );
 }
 
 
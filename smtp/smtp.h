@@ -9,6 +9,7 @@
 
 class User;
 class EString;
+class Message;
 class Address;
 class SmtpCommand;
 
@@ -27,6 +28,11 @@ public:
 
     void execute();
 
+    void greet();
+
+    bool useDatabase();
+    void releaseDatabase();
+
     enum InputState { Command, Sasl, Chunk, Data };
     InputState inputState() const;
     void setInputState( InputState );
@@ -49,8 +55,12 @@ public:
     List<class SmtpRcptTo> * rcptTo() const;
 
     void setBody( const EString & );
+    void appendBody( const EString & );
     EString body() const;
 
+    void addBodySource( Message * );
+    List<Message> * bodySources() const;
+
     bool isFirstCommand( SmtpCommand * ) const;
 
     void setTransactionId( const EString & );
@@ -12,6 +12,7 @@
 #include "eventloop.h"
 #include "scope.h"
 #include "smtp.h"
+#include "span.h"
 
 
 class SmtpCommandData
@@ -20,13 +21,14 @@ class SmtpCommandData
 public:
     SmtpCommandData()
         : responseCode( 200 ), enhancedCode( 0 ),
-          done( false ), smtp( 0 ) {}
+          done( false ), smtp( 0 ), span( 0 ) {}
 
     uint responseCode;
     const char * enhancedCode;
     EStringList response;
     bool done;
     SMTP * smtp;
+    Span * span;
 };
 
 
@@ -46,6 +48,7 @@ SmtpCommand::SmtpCommand( class SMTP * s )
 {
     setLog( new Log );
     d->smtp = s;
+    d->span = Span::start( "smtp command", log() );
 }
 
 
@@ -82,6 +85,11 @@ void SmtpCommand::emitResponses()
     if ( !d->responseCode )
         return;
 
+    if ( d->span ) {
+        d->span->setArgument( "response", fn( d->responseCode ) );
+        d->span->end();
+    }
+
     Scope x( log() );
     EString r;
     EString n = fn( d->responseCode );
@@ -216,8 +224,12 @@ SmtpCommand * SmtpCommand::create( SMTP * server, const EString & command )
     else {
         r = new SmtpCommand( server );
         r->respond( 500, "Unknown command (" + c.upper() + ")", "5.5.1" );
+        c = "unknown";
     }
 
+    if ( r->d->span )
+        r->d->span->setName( "smtp " + c );
+
     Scope x( r->log() );
     r->log( "Command: " + command.simplified(), Log::Debug );
 
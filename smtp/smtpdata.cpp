@@ -9,16 +9,17 @@
 #include "spoolmanager.h"
 #include "sieveaction.h"
 #include "smtpparser.h"
+#include "messagecopy.h"
 #include "injector.h"
 #include "address.h"
 #include "imapurl.h"
+#include "message.h"
 #include "mailbox.h"
 #include "buffer.h"
 #include "graph.h"
 #include "scope.h"
 #include "sieve.h"
 #include "codec.h"
-#include "file.h"
 #include "list.h"
 #include "date.h"
 #include "smtp.h"
@@ -156,6 +157,8 @@ void SmtpData::execute()
 
     // state 2: have received CR LF "." CR LF, have not started injection
     if ( d->state == 2 ) {
+        if ( !server()->useDatabase() )
+            return;
         server()->sieve()->setMessage( message( server()->body() ),
                                        server()->transactionTime() );
         if ( server()->dialect() == SMTP::Submit &&
@@ -541,6 +544,12 @@ Injectee * SmtpData::message( const EString & body )
         // mail or a few other agents.
         m->simplifyMimeStructure();
     }
+    // bodyparts copied by BURL can point to the existing rows
+    List<Message>::Iterator s( server()->bodySources() );
+    while ( s ) {
+        m->reuseBodyparts( s );
+        ++s;
+    }
     d->message = m;
     return m;
 }
@@ -586,12 +595,20 @@ SmtpBdat::SmtpBdat( SMTP * s, SmtpParser * p )
 
 void SmtpBdat::execute()
 {
+    // move whatever part of the chunk has arrived out of the read
+    // buffer at once, rather than letting the buffer grow to the
+    // size of the chunk.
     if ( !d->read ) {
         Buffer * r = server()->readBuffer();
-        if ( r->size() < d->size )
+        uint n = d->size - d->chunk.length();
+        if ( n > r->size() )
+            n = r->size();
+        if ( n ) {
+            r->appendTo( d->chunk, n );
+            r->remove( n );
+        }
+        if ( d->chunk.length() < d->size )
             return;
-        d->chunk = r->string( d->size );
-        r->remove( d->size );
         server()->setInputState( SMTP::Command );
         d->read = true;
     }
@@ -599,9 +616,8 @@ void SmtpBdat::execute()
     if ( !server()->isFirstCommand( this ) )
         return;
 
-    EString b = server()->body();
-    b.append( d->chunk );
-    server()->setBody( b );
+    server()->appendBody( d->chunk );
+    d->chunk.truncate();
     if ( d->last ) {
         SmtpData::execute();
     }
@@ -687,9 +703,12 @@ void SmtpBurl::execute()
     if ( !server()->isFirstCommand( this ) )
         return;
 
-    EString b( server()->body() );
-    b.append( d->url->text() );
-    server()->setBody( b );
+    server()->appendBody( d->url->text() );
+    List<Message>::Iterator m( d->fetcher->messages() );
+    while ( m ) {
+        server()->addBodySource( m );
+        ++m;
+    }
     if ( d->last ) {
         SmtpData::execute();
     }
@@ -701,7 +720,11 @@ void SmtpBurl::execute()
 
 
 /*! Writes a copy of the incoming message to the file system. \a soft is
-    true if the message provoked a temporary delivery failure. */
+    true if the message provoked a temporary delivery failure.
+
+    The file is written by MessageCopy, so the event loop doesn't wait
+    for the disk.
+*/
 
 void SmtpData::makeCopy( bool soft ) const
 {
@@ -711,49 +734,47 @@ void SmtpData::makeCopy( bool soft ) const
     filename.replace( "/", "-" );
     copy.append( filename );
 
-    File f( copy, File::ExclusiveWrite );
-    if ( !f.valid() ) {
-        log( "Could not open " + copy + " for writing", Log::Disaster );
-        return;
-    }
-
-    f.write( "From: " );
-    f.write( server()->sieve()->sender()->toString( false ) );
-    f.write( "\n" );
+    EString f;
+    f.reserve( d->body.length() + 256 );
+    f.append( "From: " );
+    f.append( server()->sieve()->sender()->toString( false ) );
+    f.append( "\n" );
 
     List<SmtpRcptTo>::Iterator it( server()->rcptTo() );
     while ( it ) {
-        f.write( "To: " );
-        f.write( it->address()->toString( false ) );
-        f.write( "\n" );
+        f.append( "To: " );
+        f.append( it->address()->toString( false ) );
+        f.append( "\n" );
         ++it;
     }
 
     if ( !server()->sieve()->error().isEmpty() ||
          d->ok.startsWith( "Worked around: " ) ) {
         copy.append( "-err" );
-        EString e;
         if ( !server()->sieve()->error().isEmpty() ) {
-            f.write( "Error: Sieve/Injector: " );
-            f.write( server()->sieve()->error().simplified() );
+            f.append( "Error: Sieve/Injector: " );
+            f.append( server()->sieve()->error().simplified() );
         }
         else {
-            f.write( "Parser: " );
-            f.write( d->ok.simplified() );
+            f.append( "Parser: " );
+            f.append( d->ok.simplified() );
         }
-        f.write( "\n"
-                 "Fate: " );
+        f.append( "\n"
+                  "Fate: " );
         if ( soft )
-            f.write( "soft error (MTA will retry)" );
+            f.append( "soft error (MTA will retry)" );
         else
-            f.write( "hard error (MTA will NOT retry)" );
-        f.write( "\n" );
+            f.append( "hard error (MTA will NOT retry)" );
+        f.append( "\n" );
     }
     else {
-        f.write( "Fate: delivered\n" );
+        f.append( "Fate: delivered\n" );
     }
 
-    f.write( "\n" );
+    f.append( "\n" );
+
+    f.append( d->body );
 
-    f.write( d->body );
+    if ( !MessageCopy::write( copy, f ) )
+        log( "Could not open " + copy + " for writing", Log::Disaster );
 }
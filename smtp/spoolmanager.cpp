@@ -14,13 +14,21 @@
 #include "smtpclient.h"
 #include "allocator.h"
 #include "scope.h"
+#include "graph.h"
 
-#define SPOOLINTERVAL    900
-#define SSPOOLINTERVAL  "900"  /* Keep this in sync with SPOOLINTERVAL */
+// memmove
+#include <string.h>
+// time
+#include <time.h>
 
 
+#define SPOOLLOOKAHEAD    1024
+#define SSPOOLLOOKAHEAD "1024"  /* Keep this in sync with SPOOLLOOKAHEAD */
+
 static SpoolManager * sm;
 static bool shutdown;
+static GraphableNumber * queueLength = 0;
+static GraphableNumber * agentCount = 0;
 
 
 class SpoolManagerData
@@ -28,13 +36,78 @@ class SpoolManagerData
 {
 public:
     SpoolManagerData()
-        : q( 0 ), t( 0 ), again( false )
+        : q( 0 ), t( 0 ), starter( 0 ), again( false ),
+          complete( false ), fetched( 0 ),
+          heap( 0 ), n( 0 ), size( 0 )
     {}
 
     Query * q;
     Timer * t;
+    EventHandler * starter;
     List<DeliveryAgent> agents;
+    IntegerSet queue;
     bool again;
+    bool complete;
+    uint fetched;
+
+    // a min-heap of the upcoming delivery attempts, ordered by time
+    struct Attempt {
+        uint at;
+        uint message;
+    };
+    Attempt * heap;
+    uint n;
+    uint size;
+
+    void push( uint at, uint message ) {
+        if ( n == size ) {
+            uint s = size * 2;
+            if ( s < 64 )
+                s = 64;
+            Attempt * h
+                = (Attempt*)Allocator::alloc( s * sizeof( Attempt ), 0 );
+            if ( n )
+                memmove( h, heap, n * sizeof( Attempt ) );
+            heap = h;
+            size = s;
+        }
+        uint i = n++;
+        while ( i && heap[(i-1)/2].at > at ) {
+            heap[i] = heap[(i-1)/2];
+            i = (i-1)/2;
+        }
+        heap[i].at = at;
+        heap[i].message = message;
+    }
+
+    void pop() {
+        if ( !n )
+            return;
+        Attempt last = heap[--n];
+        uint i = 0;
+        while ( 2*i+1 < n ) {
+            uint c = 2*i+1;
+            if ( c+1 < n && heap[c+1].at < heap[c].at )
+                c++;
+            if ( last.at <= heap[c].at )
+                break;
+            heap[i] = heap[c];
+            i = c;
+        }
+        heap[i] = last;
+    }
+};
+
+
+// this helper is notified by each DeliveryAgent when it's done, and
+// starts another if there is one queued.
+
+class AgentStarter
+    : public EventHandler
+{
+public:
+    AgentStarter(): EventHandler() {}
+    void execute() { if ( ::sm ) ::sm->startAgents(); }
 };
 
 
@@ -43,6 +116,29 @@ public:
     This class periodically attempts to deliver mail from the
     deliveries table to a smarthost using DeliveryAgent.
 
+    deliveries.next_attempt says when each message should be tried
+    next (it's null when there is nothing left to do), and is set
+    when the message is spooled and after each attempt. A queue run
+    fetches the rows with the earliest next_attempt, using an index,
+    and SpoolManager keeps them in a heap ordered by time. When the
+    first one is due, SpoolManager wakes, moves the due messages to
+    its queue, and only goes back to the database if the heap has run
+    dry, if a new message has been spooled, or if SPOOLINTERVAL
+    seconds have passed (other processes may have sent some of the
+    messages meanwhile; DeliveryAgent ignores those that aren't due).
+
+    startAgents() sends as many queued messages at a time as there may
+    be SmtpClient connections (see smarthost-connections), or as
+    direct-deliveries says if direct-delivery is enabled. Whenever an
+    agent finishes, the next queued message gets one, so the
+    connections are kept busy and no more than a few deliveries rows
+    are locked at a time.
+
+    The spool-queue-length and spool-delivery-agents numbers show how
+    many due messages are waiting for an agent and how many agents are
+    working. DeliveryAgent and SmtpClient record how long each stage
+    of a delivery takes.
+
     Each archiveopteryx process has only one instance of this class,
     which is created by SpoolManager::setup().
 */
@@ -51,6 +147,7 @@ SpoolManager::SpoolManager()
     : d( new SpoolManagerData )
 {
     setLog( new Log );
+    d->starter = new AgentStarter;
 
     Query * q = new Query( "update deliveries "
                            "set expires_at=current_timestamp+interval '"
@@ -69,86 +166,126 @@ SpoolManager::SpoolManager()
 
 void SpoolManager::execute()
 {
-    // Fetch a list of spooled messages, and the next time we can try
-    // to deliver each of them.
+    if ( !d->q ) {
+        uint now = (uint)::time( 0 );
+        while ( d->n && d->heap[0].at <= now ) {
+            d->queue.add( d->heap[0].message );
+            d->pop();
+        }
 
-    uint delay = UINT_MAX;
+        if ( !d->again && now < d->fetched + SPOOLINTERVAL &&
+             ( d->n || d->complete ) ) {
+            reset();
+            startAgents();
+            return;
+        }
 
-    if ( !d->q ) {
-        IntegerSet have;
+        // Fetch the spooled messages that are due first, and the
+        // time until each is due.
+
+        IntegerSet have = d->queue;
         List<DeliveryAgent>::Iterator a( d->agents );
         while ( a ) {
-            if ( a->working() ) {
+            if ( a->working() )
                 have.add( a->messageId() );
-                delay = SPOOLINTERVAL;
-                ++a;
-            }
-            else {
-                d->agents.take( a );
-            }
+            ++a;
         }
 
         log( "Starting queue run" );
         d->again = false;
-        reset();
-        EString s( "select d.message, "
+        EString s( "select message, "
                    "extract(epoch from"
-                   " min(coalesce(dr.last_attempt+interval '"
-                   SSPOOLINTERVAL " s',"
-                   " d.deliver_after,"
-                   " current_timestamp)))::bigint"
-                   "-extract(epoch from current_timestamp)::bigint as delay "
-                   "from deliveries d "
-                   "join delivery_recipients dr on (d.id=dr.delivery) "
-                   "where (dr.action=$1 or dr.action=$2) " );
+                   " next_attempt-current_timestamp)::bigint as delay "
+                   "from deliveries "
+                   "where next_attempt is not null " );
         if ( !have.isEmpty() )
-            s.append( "and not d.message=any($3) " );
-        s.append( "group by d.message "
-                  "order by delay" );
+            s.append( "and not message=any($1) " );
+        s.append( "order by next_attempt "
+                  "limit " SSPOOLLOOKAHEAD );
         d->q = new Query( s, this );
-        d->q->bind( 1, Recipient::Unknown );
-        d->q->bind( 2, Recipient::Delayed );
         if ( !have.isEmpty() )
-            d->q->bind( 3, have );
+            d->q->bind( 1, have );
         d->q->execute();
     }
 
-    if ( d->q && !d->q->done() )
+    if ( !d->q->done() )
         return;
 
-    // Is there anything we might do?
-
-    if ( d->q && !d->q->rows() ) {
-        // No. Just finish.
-        reset();
-        log( "Ending queue run" );
-        return;
+    // Each row is either due now or goes into the heap, which we
+    // rebuild from scratch since the database knows best.
+
+    uint now = (uint)::time( 0 );
+    d->n = 0;
+    while ( d->q->hasResults() ) {
+        Row * r = d->q->nextRow();
+        int64 delay = r->getBigint( "delay" );
+        uint message = r->getInt( "message" );
+        if ( delay <= 0 )
+            d->queue.add( message );
+        else
+            d->push( now + (uint)delay, message );
     }
+    d->complete = d->q->rows() < SPOOLLOOKAHEAD;
+    d->fetched = now;
+    if ( !d->q->rows() )
+        log( "Ending queue run" );
 
-    // Yes. What?
+    reset();
+    startAgents();
+}
 
-    if ( d->q ) {
-        while ( d->q->hasResults() ) {
-            Row * r = d->q->nextRow();
-            int64 deliverableAt = r->getBigint( "delay" );
-            if ( deliverableAt <= 0 ) {
-                DeliveryAgent * a
-                    = new DeliveryAgent( r->getInt( "message" ) );
-                (void)new Timer( a, d->agents.count() * 5 );
-                d->agents.append( a );
-            }
-            else if ( delay > deliverableAt )
-                delay = deliverableAt;
+
+/*! Starts a DeliveryAgent for each queued message, until as many are
+    working as there may be smarthost connections, or direct-deliveries
+    if direct-delivery is enabled. Called after each queue
+    run and whenever an agent finishes.
+
+    When an agent that will need to try again finishes, its next
+    attempt is added to the heap.
+*/
+
+void SpoolManager::startAgents()
+{
+    Scope x( log() );
+
+    bool earlier = false;
+    List<DeliveryAgent>::Iterator a( d->agents );
+    while ( a ) {
+        if ( a->working() ) {
+            ++a;
         }
-        if ( delay < UINT_MAX ) {
-            log( "Will process the queue again in " +
-                 fn( delay ) + " seconds" );
-            d->t = new Timer( this, delay );
+        else {
+            if ( a->nextAttempt() ) {
+                if ( !d->n || a->nextAttempt() < d->heap[0].at )
+                    earlier = true;
+                d->push( a->nextAttempt(), a->messageId() );
+            }
+            d->agents.take( a );
         }
-        d->q = 0;
     }
 
-    reset();
+    uint max = Configuration::scalar( Configuration::SmartHostConnections );
+    if ( Configuration::toggle( Configuration::DirectDelivery ) )
+        max = Configuration::scalar( Configuration::DirectDeliveries );
+    if ( !max )
+        max = 1;
+    while ( d->agents.count() < max && !d->queue.isEmpty() ) {
+        uint m = d->queue.smallest();
+        d->queue.remove( m );
+        DeliveryAgent * a = new DeliveryAgent( m, d->starter );
+        d->agents.append( a );
+        a->execute();
+    }
+
+    if ( !::queueLength ) {
+        ::queueLength = new GraphableNumber( "spool-queue-length" );
+        ::agentCount = new GraphableNumber( "spool-delivery-agents" );
+    }
+    ::queueLength->setValue( d->queue.count() );
+    ::agentCount->setValue( d->agents.count() );
+
+    if ( earlier && !d->q )
+        reset();
 }
 
 
@@ -174,17 +311,32 @@ void SpoolManager::deliverNewMessage()
 
 
 
-/*! Resets the perishable state of this SpoolManager, i.e. all but the
-    Timer. Provided for convenience.
+/*! Resets the perishable state of this SpoolManager, and sets the
+    Timer so that execute() is called when the next attempt is due:
+    At once if a new message has been spooled, when the earliest
+    message in the heap is due, and in any case after SPOOLINTERVAL
+    seconds if anything is in the heap or being sent.
 */
 
 void SpoolManager::reset()
 {
     delete d->t;
     d->t = 0;
-    if ( d->again )
-        d->t = new Timer( this, 1 );
     d->q = 0;
+    if ( d->again ) {
+        d->t = new Timer( this, 1 );
+    }
+    else if ( d->n || !d->agents.isEmpty() || !d->queue.isEmpty() ) {
+        uint now = (uint)::time( 0 );
+        uint delay = SPOOLINTERVAL;
+        if ( d->n && d->heap[0].at <= now )
+            delay = 1;
+        else if ( d->n && d->heap[0].at - now < delay )
+            delay = d->heap[0].at - now;
+        log( "Will process the queue again in " +
+             fn( delay ) + " seconds", Log::Debug );
+        d->t = new Timer( this, delay );
+    }
 }
 
 
@@ -6,6 +6,10 @@
 #include "event.h"
 
 
+#define SPOOLINTERVAL    900
+#define SSPOOLINTERVAL  "900"  /* Keep this in sync with SPOOLINTERVAL */
+
+
 class SpoolManager
     : public EventHandler
 {
@@ -18,6 +22,7 @@ public:
     static void shutdown();
 
     void deliverNewMessage();
+    void startAgents();
 
 private:
     class SpoolManagerData * d;